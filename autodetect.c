@@ -0,0 +1,274 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Network characteristics auto-detection
+   Copyright 2026 the rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The server measures the round trip time and bandwidth of the link
+   with the auto-detect requests of [MS-RDPBCGR] 2.2.14, both while
+   connecting and during the session, and the client answers them on
+   the MCS message channel. The results the server reports back, and
+   the bandwidth seen here, are kept across reconnects so that -x auto
+   can pick the experience of the next logon from them. */
+
+#include <sys/time.h>
+#include "rdesktop.h"
+
+/* Below this, the link is treated as a modem */
+#define AUTODETECT_MODEM_KBPS	512
+/* From this up, and with a short enough round trip, as a LAN */
+#define AUTODETECT_LAN_KBPS	10000
+#define AUTODETECT_LAN_RTT	20
+
+extern RD_BOOL g_autodetect;
+
+/* Bandwidth measurement in progress */
+static RD_BOOL g_bw_active = False;
+static RD_BOOL g_bw_connect_time;
+static struct timeval g_bw_start;
+static uint32 g_bw_bytes;
+
+/* Results, 0 until known */
+static uint32 g_base_rtt, g_average_rtt;	/* ms */
+static uint32 g_server_bandwidth;	/* kbit/s, as reported by the server */
+static uint32 g_client_bandwidth;	/* kbit/s, as measured here */
+static uint32 g_rtt_requests, g_bw_measurements;
+
+static void
+autodetect_send_response(uint16 sequence, uint16 type, uint32 time_delta, uint32 byte_count)
+{
+	STREAM s;
+	RD_BOOL results;
+
+	results = type != RDP_RTT_RESPONSE_TYPE;
+
+	s = sec_init_message(results ? 14 : 6);
+	out_uint8(s, results ? 14 : 6);	/* headerLength */
+	out_uint8(s, TYPE_ID_AUTODETECT_RESPONSE);
+	out_uint16_le(s, sequence);
+	out_uint16_le(s, type);
+	if (results)
+	{
+		out_uint32_le(s, time_delta);
+		out_uint32_le(s, byte_count);
+	}
+	s_mark_end(s);
+	sec_send_message(s, SEC_AUTODETECT_RSP);
+	s_free(s);
+}
+
+static void
+autodetect_bw_start(RD_BOOL connect_time)
+{
+	g_bw_active = True;
+	g_bw_connect_time = connect_time;
+	g_bw_bytes = 0;
+	gettimeofday(&g_bw_start, NULL);
+}
+
+static void
+autodetect_bw_stop(uint16 sequence)
+{
+	struct timeval now;
+	uint32 delta;
+
+	if (!g_bw_active)
+	{
+		logger(Protocol, Warning, "autodetect_bw_stop(), no measurement was started");
+		return;
+	}
+	g_bw_active = False;
+
+	gettimeofday(&now, NULL);
+	delta = (now.tv_sec - g_bw_start.tv_sec) * 1000 +
+		(now.tv_usec - g_bw_start.tv_usec) / 1000;
+
+	/* bytes per ms are kbit/s once multiplied by 8 */
+	if (delta > 0)
+		g_client_bandwidth = (uint32) ((uint64) g_bw_bytes * 8 / delta);
+	g_bw_measurements++;
+
+	logger(Protocol, Debug, "autodetect_bw_stop(), %u bytes in %u ms", g_bw_bytes, delta);
+
+	autodetect_send_response(sequence,
+				 g_bw_connect_time ? RDP_BW_RESULTS_RESPONSE_TYPE_CONNECTTIME :
+				 RDP_BW_RESULTS_RESPONSE_TYPE_CONTINUOUS, delta, g_bw_bytes);
+}
+
+/* Returns the bandwidth of the link in kbit/s, 0 when not known */
+uint32
+autodetect_bandwidth(void)
+{
+	return g_server_bandwidth != 0 ? g_server_bandwidth : g_client_bandwidth;
+}
+
+static void
+autodetect_process_netchar(STREAM s, uint16 type)
+{
+	uint32 base_rtt = 0, bandwidth = 0, average_rtt = 0;
+	uint32 need;
+
+	need = type == RDP_NETCHAR_RESULTS_ALL ? 12 : 8;
+	if (!s_check_rem(s, need))
+		return;
+
+	if (type != RDP_NETCHAR_RESULTS_BANDWIDTH)
+		in_uint32_le(s, base_rtt);
+	if (type != RDP_NETCHAR_RESULTS_BASE_RTT)
+		in_uint32_le(s, bandwidth);
+	in_uint32_le(s, average_rtt);
+
+	if (base_rtt != 0)
+		g_base_rtt = base_rtt;
+	if (bandwidth != 0)
+		g_server_bandwidth = bandwidth;
+	g_average_rtt = average_rtt;
+
+	logger(Protocol, Verbose,
+	       "Network characteristics: base RTT %u ms, average RTT %u ms, bandwidth %u kbit/s",
+	       g_base_rtt, g_average_rtt, g_server_bandwidth);
+
+	tcp_tune_buffers(g_average_rtt != 0 ? g_average_rtt : g_base_rtt, autodetect_bandwidth());
+}
+
+/* Process an Auto-Detect Request PDU */
+void
+autodetect_process(STREAM s)
+{
+	uint8 length, type_id;
+	uint16 sequence, type, payload;
+
+	if (!s_check_rem(s, 6))
+	{
+		logger(Protocol, Warning, "autodetect_process(), short PDU");
+		return;
+	}
+
+	in_uint8(s, length);
+	in_uint8(s, type_id);
+	in_uint16_le(s, sequence);
+	in_uint16_le(s, type);
+
+	if (type_id != TYPE_ID_AUTODETECT_REQUEST || length < 6)
+	{
+		logger(Protocol, Warning, "autodetect_process(), unexpected header %d/%d",
+		       type_id, length);
+		return;
+	}
+
+	switch (type)
+	{
+		case RDP_RTT_REQUEST_TYPE_CONTINUOUS:
+		case RDP_RTT_REQUEST_TYPE_CONNECTTIME:
+			g_rtt_requests++;
+			autodetect_send_response(sequence, RDP_RTT_RESPONSE_TYPE, 0, 0);
+			break;
+
+		case RDP_BW_START_REQUEST_TYPE_CONTINUOUS:
+		case RDP_BW_START_REQUEST_TYPE_TUNNEL:
+			autodetect_bw_start(False);
+			break;
+
+		case RDP_BW_START_REQUEST_TYPE_CONNECTTIME:
+			autodetect_bw_start(True);
+			break;
+
+		case RDP_BW_PAYLOAD_REQUEST_TYPE:
+		case RDP_BW_STOP_REQUEST_TYPE_CONNECTTIME:
+			/* the payload only counts towards connect-time
+			   measurements, continuous ones see all traffic */
+			if (!s_check_rem(s, 2))
+				return;
+			in_uint16_le(s, payload);
+			if (g_bw_active && g_bw_connect_time)
+				g_bw_bytes += payload;
+			if (type == RDP_BW_STOP_REQUEST_TYPE_CONNECTTIME)
+				autodetect_bw_stop(sequence);
+			break;
+
+		case RDP_BW_STOP_REQUEST_TYPE_CONTINUOUS:
+		case RDP_BW_STOP_REQUEST_TYPE_TUNNEL:
+			autodetect_bw_stop(sequence);
+			break;
+
+		case RDP_NETCHAR_RESULTS_BASE_RTT:
+		case RDP_NETCHAR_RESULTS_BANDWIDTH:
+		case RDP_NETCHAR_RESULTS_ALL:
+			autodetect_process_netchar(s, type);
+			break;
+
+		default:
+			logger(Protocol, Warning, "autodetect_process(), unhandled request 0x%x",
+			       type);
+	}
+}
+
+/* Account for bytes received, for a continuous bandwidth measurement */
+void
+autodetect_received(uint32 bytes)
+{
+	if (g_bw_active && !g_bw_connect_time)
+		g_bw_bytes += bytes;
+}
+
+/* Adjust the experience flags sent at logon to what has been measured
+   of the link, when -x auto asked for it. Flags not about the
+   experience itself, such as for the cursor, are left alone. */
+uint32
+autodetect_performance_flags(uint32 flags)
+{
+	uint32 bandwidth = autodetect_bandwidth();
+
+	if (!g_autodetect || bandwidth == 0)
+		return flags;
+
+	flags &= ~(PERF_DISABLE_WALLPAPER | PERF_DISABLE_THEMING |
+		   PERF_DISABLE_MENUANIMATIONS | PERF_ENABLE_FONT_SMOOTHING);
+
+	if (bandwidth < AUTODETECT_MODEM_KBPS)
+		flags |= PERF_DISABLE_WALLPAPER | PERF_DISABLE_THEMING |
+			PERF_DISABLE_MENUANIMATIONS;
+	else if (bandwidth < AUTODETECT_LAN_KBPS || g_average_rtt > AUTODETECT_LAN_RTT)
+		flags |= PERF_DISABLE_WALLPAPER | PERF_DISABLE_MENUANIMATIONS |
+			PERF_ENABLE_FONT_SMOOTHING;
+	else
+		flags |= PERF_ENABLE_FONT_SMOOTHING;
+
+	logger(Protocol, Debug, "autodetect_performance_flags(), 0x%x for %u kbit/s, %u ms",
+	       flags, bandwidth, g_average_rtt);
+	return flags;
+}
+
+/* Format the measurements into buf, for the ctrl socket */
+RD_BOOL
+autodetect_format_stats(int n, char *buf, size_t size)
+{
+	if (n != 0)
+		return False;
+
+	snprintf(buf, size,
+		 "base_rtt=%u average_rtt=%u server_bandwidth=%u client_bandwidth=%u "
+		 "rtt_requests=%u bandwidth_measurements=%u", g_base_rtt, g_average_rtt,
+		 g_server_bandwidth, g_client_bandwidth, g_rtt_requests, g_bw_measurements);
+	return True;
+}
+
+/* Abandon a measurement cut short by a reconnect, the results stay */
+void
+autodetect_reset_state(void)
+{
+	g_bw_active = False;
+}
@@ -17,15 +17,51 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-/* three separate function for speed when decompressing the bitmaps
-   when modifying one function make the change in the others
-   jay.sorg@gmail.com */
+/* The interleaved RLE decoder is generated for each pixel size from
+   bitmap_rle.h, so that every one of them gets its own inner loops
+   without the three copies drifting apart */
 
 /* indent is confused by this file */
 /* *INDENT-OFF* */
 
+#include <pthread.h>
+#include <unistd.h>
 #include "rdesktop.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+extern RD_BOOL g_bitmap_alpha;
+
+/* Decoding time per codec, bitmaps are decoded by the worker threads
+   as well */
+enum
+{
+	BITMAP_CODEC_INTERLEAVED,
+	BITMAP_CODEC_PLANAR,
+	BITMAP_CODECS
+};
+
+static const char *g_bitmap_codec_names[BITMAP_CODECS] = { "interleaved", "planar" };
+
+static struct
+{
+	uint64 count;
+	uint64 nsec;
+} g_bitmap_codec_stats[BITMAP_CODECS];
+
+static uint64
+bitmap_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 #define CVAL(p)   (*(p++))
 #ifdef NEED_ALIGN
 #ifdef L_ENDIAN
@@ -37,21 +73,6 @@
 #define CVAL2(p, v) { v = (*((uint16*)p)); p += 2; }
 #endif /* NEED_ALIGN */
 
-#define UNROLL8(exp) { exp exp exp exp exp exp exp exp }
-
-#define REPEAT(statement) \
-{ \
-	while((count & ~0x7) && ((x+8) < width)) \
-		UNROLL8( statement; count--; x++; ); \
-	\
-	while((count > 0) && (x < width)) \
-	{ \
-		statement; \
-		count--; \
-		x++; \
-	} \
-}
-
 #define MASK_UPDATE() \
 { \
 	mixmask <<= 1; \
@@ -63,856 +84,785 @@
 }
 
 /* 1 byte bitmap decompress */
-static RD_BOOL
-bitmap_decompress1(uint8 * output, int width, int height, uint8 * input, int size)
+#define RLE_NAME bitmap_decompress1
+#define RLE_BPP 1
+#define RLE_PIXEL uint8
+#define RLE_WHITE 0xff
+#define RLE_READ_PIXEL(p, v) { v = CVAL(p); }
+#define RLE_GET(line, x) ((line)[x])
+#define RLE_PUT(line, x, v) { (line)[x] = (v); }
+#define RLE_FILL(line, x, v, n) memset((line) + (x), (v), (n))
+#include "bitmap_rle.h"
+
+/* 2 byte bitmap decompress */
+#define RLE_NAME bitmap_decompress2
+#define RLE_BPP 2
+#define RLE_PIXEL uint16
+#define RLE_WHITE 0xffff
+#define RLE_READ_PIXEL(p, v) CVAL2(p, v)
+#define RLE_GET(line, x) (((uint16 *) (line))[x])
+#define RLE_PUT(line, x, v) { ((uint16 *) (line))[x] = (v); }
+#define RLE_FILL(line, x, v, n) \
+{ \
+	uint16 *fill_ = ((uint16 *) (line)) + (x); \
+	int fill_n_ = (n); \
+	while (fill_n_-- > 0) \
+		*(fill_++) = (v); \
+}
+#include "bitmap_rle.h"
+
+/* 3 byte bitmap decompress, pixels are handled as 24 bit values */
+#define RLE_NAME bitmap_decompress3
+#define RLE_BPP 3
+#define RLE_PIXEL uint32
+#define RLE_WHITE 0xffffff
+#define RLE_READ_PIXEL(p, v) { v = CVAL(p); v |= CVAL(p) << 8; v |= CVAL(p) << 16; }
+#define RLE_GET(line, x) \
+	((uint32) (line)[(x) * 3] | ((uint32) (line)[(x) * 3 + 1] << 8) | \
+	 ((uint32) (line)[(x) * 3 + 2] << 16))
+#define RLE_PUT(line, x, v) \
+{ \
+	(line)[(x) * 3] = (uint8) (v); \
+	(line)[(x) * 3 + 1] = (uint8) ((v) >> 8); \
+	(line)[(x) * 3 + 2] = (uint8) ((v) >> 16); \
+}
+#define RLE_FILL(line, x, v, n) \
+{ \
+	int fill_i_; \
+	for (fill_i_ = 0; fill_i_ < (n); fill_i_++) \
+		RLE_PUT(line, (x) + fill_i_, v); \
+}
+#include "bitmap_rle.h"
+
+/* Decode one RLE colour plane of an RDP 6.0 planar bitmap in to width
+   * height bytes, with the scanlines in the order they are sent. Each
+   scanline after the first holds deltas against the previous one.
+   Returns the number of input bytes used or -1 if the input ran out. */
+static int
+process_plane(uint8 * in, int width, int height, uint8 * out, int size)
 {
-	uint8 *end = input + size;
-	uint8 *prevline = NULL, *line = NULL;
-	int opcode, count, offset, isfillormix, x = width;
-	int lastopcode = -1, insertmix = False, bicolour = False;
-	uint8 code;
-	uint8 colour1 = 0, colour2 = 0;
-	uint8 mixmask, mask = 0;
-	uint8 mix = 0xff;
-	int fom_mask = 0;
-
-	while (input < end)
+	int x, y, i;
+	int code;
+	int collen;
+	int replen;
+	int revcode;
+	int color;
+	uint8 * last_line;
+	uint8 * org_in;
+	uint8 * end;
+#if defined(__SSE2__)
+	__m128i vcolor;
+#endif
+
+	org_in = in;
+	end = in + size;
+	last_line = NULL;
+	for (y = 0; y < height; y++)
 	{
-		fom_mask = 0;
-		code = CVAL(input);
-		opcode = code >> 4;
-		/* Handle different opcode forms */
-		switch (opcode)
+		color = 0;
+		x = 0;
+		while (x < width)
 		{
-			case 0xc:
-			case 0xd:
-			case 0xe:
-				opcode -= 6;
-				count = code & 0xf;
-				offset = 16;
-				break;
-			case 0xf:
-				opcode = code & 0xf;
-				if (opcode < 9)
-				{
-					count = CVAL(input);
-					count |= CVAL(input) << 8;
-				}
-				else
+			if (in >= end)
+				return -1;
+			code = CVAL(in);
+			replen = code & 0xf;
+			collen = (code >> 4) & 0xf;
+			revcode = (replen << 4) | collen;
+			if ((revcode <= 47) && (revcode >= 16))
+			{
+				replen = revcode;
+				collen = 0;
+			}
+			collen = MIN(collen, width - x);
+			replen = MIN(replen, width - x - collen);
+			if (end - in < collen)
+				return -1;
+
+			if (last_line == NULL)
+			{
+				if (collen > 0)
 				{
-					count = (opcode < 0xb) ? 8 : 1;
+					memcpy(out + x, in, collen);
+					color = in[collen - 1];
+					in += collen;
+					x += collen;
 				}
-				offset = 0;
-				break;
-			default:
-				opcode >>= 1;
-				count = code & 0x1f;
-				offset = 32;
-				break;
-		}
-		/* Handle strange cases for counts */
-		if (offset != 0)
-		{
-			isfillormix = ((opcode == 2) || (opcode == 7));
-			if (count == 0)
-			{
-				if (isfillormix)
-					count = CVAL(input) + 1;
-				else
-					count = CVAL(input) + offset;
+				memset(out + x, color, replen);
+				x += replen;
+				continue;
 			}
-			else if (isfillormix)
+
+			for (i = 0; i < collen; i++)
 			{
-				count <<= 3;
+				code = in[i];
+				color = (code & 1) ? -((code >> 1) + 1) : (code >> 1);
+				out[x + i] = last_line[x + i] + color;
 			}
+			in += collen;
+			x += collen;
+
+			i = 0;
+#if defined(__SSE2__)
+			vcolor = _mm_set1_epi8((char) color);
+			for (; i + 16 <= replen; i += 16)
+				_mm_storeu_si128((__m128i *) (out + x + i),
+						 _mm_add_epi8(_mm_loadu_si128((__m128i *) (last_line + x + i)),
+							      vcolor));
+#endif
+			for (; i < replen; i++)
+				out[x + i] = last_line[x + i] + color;
+			x += replen;
 		}
-		/* Read preliminary data */
-		switch (opcode)
-		{
-			case 0:	/* Fill */
-				if ((lastopcode == opcode) && !((x == width) && (prevline == NULL)))
-					insertmix = True;
-				break;
-			case 8:	/* Bicolour */
-				colour1 = CVAL(input);
-				colour2 = CVAL(input);
-				break;
-			case 3:	/* Colour */
-				colour2 = CVAL(input);
-				break;
-			case 6:	/* SetMix/Mix */
-			case 7:	/* SetMix/FillOrMix */
-				mix = CVAL(input);
-				opcode -= 5;
-				break;
-			case 9:	/* FillOrMix_1 */
-				mask = 0x03;
-				opcode = 0x02;
-				fom_mask = 3;
-				break;
-			case 0x0a:	/* FillOrMix_2 */
-				mask = 0x05;
-				opcode = 0x02;
-				fom_mask = 5;
-				break;
-		}
-		lastopcode = opcode;
-		mixmask = 0;
-		/* Output body */
-		while (count > 0)
+		last_line = out;
+		out += width;
+	}
+	return (int) (in - org_in);
+}
+
+/* Step over a colour plane without decoding it, returns the number of
+   input bytes it occupies or -1 if the input ran out */
+static int
+skip_plane(uint8 * in, int width, int height, int size)
+{
+	int x, y;
+	int code;
+	int collen;
+	int replen;
+	int revcode;
+	uint8 * org_in;
+	uint8 * end;
+
+	org_in = in;
+	end = in + size;
+	for (y = 0; y < height; y++)
+	{
+		x = 0;
+		while (x < width)
 		{
-			if (x >= width)
-			{
-				if (height <= 0)
-					return False;
-				x = 0;
-				height--;
-				prevline = line;
-				line = output + height * width;
-			}
-			switch (opcode)
+			if (in >= end)
+				return -1;
+			code = CVAL(in);
+			replen = code & 0xf;
+			collen = (code >> 4) & 0xf;
+			revcode = (replen << 4) | collen;
+			if ((revcode <= 47) && (revcode >= 16))
 			{
-				case 0:	/* Fill */
-					if (insertmix)
-					{
-						if (prevline == NULL)
-							line[x] = mix;
-						else
-							line[x] = prevline[x] ^ mix;
-						insertmix = False;
-						count--;
-						x++;
-					}
-					if (prevline == NULL)
-					{
-						REPEAT(line[x] = 0)
-					}
-					else
-					{
-						REPEAT(line[x] = prevline[x])
-					}
-					break;
-				case 1:	/* Mix */
-					if (prevline == NULL)
-					{
-						REPEAT(line[x] = mix)
-					}
-					else
-					{
-						REPEAT(line[x] = prevline[x] ^ mix)
-					}
-					break;
-				case 2:	/* Fill or Mix */
-					if (prevline == NULL)
-					{
-						REPEAT
-						(
-							MASK_UPDATE();
-							if (mask & mixmask)
-								line[x] = mix;
-							else
-								line[x] = 0;
-						)
-					}
-					else
-					{
-						REPEAT
-						(
-							MASK_UPDATE();
-							if (mask & mixmask)
-								line[x] = prevline[x] ^ mix;
-							else
-								line[x] = prevline[x];
-						)
-					}
-					break;
-				case 3:	/* Colour */
-					REPEAT(line[x] = colour2)
-					break;
-				case 4:	/* Copy */
-					REPEAT(line[x] = CVAL(input))
-					break;
-				case 8:	/* Bicolour */
-					REPEAT
-					(
-						if (bicolour)
-						{
-							line[x] = colour2;
-							bicolour = False;
-						}
-						else
-						{
-							line[x] = colour1;
-							bicolour = True; count++;
-						}
-					)
-					break;
-				case 0xd:	/* White */
-					REPEAT(line[x] = 0xff)
-					break;
-				case 0xe:	/* Black */
-					REPEAT(line[x] = 0)
-					break;
-				default:
-					logger(Core, Warning, "bitmap_decompress(), unhandled bitmap opcode 0x%x", opcode);
-					return False;
+				replen = revcode;
+				collen = 0;
 			}
+			collen = MIN(collen, width - x);
+			replen = MIN(replen, width - x - collen);
+			if (end - in < collen)
+				return -1;
+			in += collen;
+			x += collen + replen;
 		}
 	}
-	return True;
+	return (int) (in - org_in);
 }
 
-/* 2 byte bitmap decompress */
-static RD_BOOL
-bitmap_decompress2(uint8 * output, int width, int height, uint8 * input, int size)
+/* Interleave one scanline of separate planes in to 32 bpp pixels, a
+   missing alpha plane is written as opaque */
+static void
+planar_to_bgra(uint8 * b, uint8 * g, uint8 * r, uint8 * a, uint8 * out, int width)
+{
+	int x = 0;
+#if defined(__SSE2__)
+	__m128i vb, vg, vr, va, bg, ra;
+	const __m128i opaque = _mm_set1_epi8((char) 0xff);
+
+	for (; x + 16 <= width; x += 16)
+	{
+		vb = _mm_loadu_si128((__m128i *) (b + x));
+		vg = _mm_loadu_si128((__m128i *) (g + x));
+		vr = _mm_loadu_si128((__m128i *) (r + x));
+		va = a ? _mm_loadu_si128((__m128i *) (a + x)) : opaque;
+		bg = _mm_unpacklo_epi8(vb, vg);
+		ra = _mm_unpacklo_epi8(vr, va);
+		_mm_storeu_si128((__m128i *) (out + x * 4), _mm_unpacklo_epi16(bg, ra));
+		_mm_storeu_si128((__m128i *) (out + x * 4 + 16), _mm_unpackhi_epi16(bg, ra));
+		bg = _mm_unpackhi_epi8(vb, vg);
+		ra = _mm_unpackhi_epi8(vr, va);
+		_mm_storeu_si128((__m128i *) (out + x * 4 + 32), _mm_unpacklo_epi16(bg, ra));
+		_mm_storeu_si128((__m128i *) (out + x * 4 + 48), _mm_unpackhi_epi16(bg, ra));
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	uint8x16x4_t px;
+
+	for (; x + 16 <= width; x += 16)
+	{
+		px.val[0] = vld1q_u8(b + x);
+		px.val[1] = vld1q_u8(g + x);
+		px.val[2] = vld1q_u8(r + x);
+		px.val[3] = a ? vld1q_u8(a + x) : vdupq_n_u8(0xff);
+		vst4q_u8(out + x * 4, px);
+	}
+#endif
+	for (; x < width; x++)
+	{
+		out[x * 4 + 0] = b[x];
+		out[x * 4 + 1] = g[x];
+		out[x * 4 + 2] = r[x];
+		out[x * 4 + 3] = a ? a[x] : 0xff;
+	}
+}
+
+/* Planes of bitmaps up to this size are decoded on the stack */
+#define PLANAR_STACK_SIZE (64 * 64)
+
+/* RDP 6.0 planar codec, used for 4 byte bitmaps and by the graphics
+   pipeline. Bitmap updates send the scanlines bottom up, the graphics
+   pipeline top down.
+
+   The planes are decoded in to separate scratch planes, which are
+   then interleaved a scanline at a time. The alpha plane is stepped
+   over when the visual has no use for it. */
+RD_BOOL
+bitmap_decompress_planar(uint8 * output, int width, int height, uint8 * input, int size,
+			 RD_BOOL bottom_up)
 {
-	uint8 *end = input + size;
-	uint16 *prevline = NULL, *line = NULL;
-	int opcode, count, offset, isfillormix, x = width;
-	int lastopcode = -1, insertmix = False, bicolour = False;
-	uint8 code;
-	uint16 colour1 = 0, colour2 = 0;
-	uint8 mixmask, mask = 0;
-	uint16 mix = 0xffff;
-	int fom_mask = 0;
-
-	while (input < end)
+	int code;
+	int y;
+	int bytes_pro;
+	int total_pro;
+	int plane_size;
+	uint8 stack_planes[PLANAR_STACK_SIZE * 4];
+	uint8 * planes;
+	uint8 * alpha;
+	uint8 * line;
+	RD_BOOL rv;
+
+	if (size < 1)
+		return False;
+
+	code = CVAL(input);
+	/* the only flags handled are RLE and NA (no alpha) */
+	if ((code & ~0x30) != 0)
 	{
-		fom_mask = 0;
-		code = CVAL(input);
-		opcode = code >> 4;
-		/* Handle different opcode forms */
-		switch (opcode)
-		{
-			case 0xc:
-			case 0xd:
-			case 0xe:
-				opcode -= 6;
-				count = code & 0xf;
-				offset = 16;
-				break;
-			case 0xf:
-				opcode = code & 0xf;
-				if (opcode < 9)
-				{
-					count = CVAL(input);
-					count |= CVAL(input) << 8;
-				}
-				else
-				{
-					count = (opcode < 0xb) ? 8 : 1;
-				}
-				offset = 0;
-				break;
-			default:
-				opcode >>= 1;
-				count = code & 0x1f;
-				offset = 32;
-				break;
-		}
-		/* Handle strange cases for counts */
-		if (offset != 0)
+		return False;
+	}
+	total_pro = 1;
+
+	plane_size = width * height;
+	if (plane_size <= PLANAR_STACK_SIZE)
+		planes = stack_planes;
+	else
+		planes = (uint8 *) xmalloc(plane_size * 4);
+
+	rv = False;
+	alpha = NULL;
+	if (!(code & 0x10))
+	{
+		/* raw planes, followed by a pad byte */
+		y = (code & 0x20) ? 3 : 4;
+		if (size != total_pro + plane_size * y + 1)
+			goto out;
+		if (y == 4)
 		{
-			isfillormix = ((opcode == 2) || (opcode == 7));
-			if (count == 0)
-			{
-				if (isfillormix)
-					count = CVAL(input) + 1;
-				else
-					count = CVAL(input) + offset;
-			}
-			else if (isfillormix)
+			if (g_bitmap_alpha)
 			{
-				count <<= 3;
+				alpha = planes + plane_size * 3;
+				memcpy(alpha, input, plane_size);
 			}
+			input += plane_size;
 		}
-		/* Read preliminary data */
-		switch (opcode)
+		for (y = 2; y >= 0; y--)
 		{
-			case 0:	/* Fill */
-				if ((lastopcode == opcode) && !((x == width) && (prevline == NULL)))
-					insertmix = True;
-				break;
-			case 8:	/* Bicolour */
-				CVAL2(input, colour1);
-				CVAL2(input, colour2);
-				break;
-			case 3:	/* Colour */
-				CVAL2(input, colour2);
-				break;
-			case 6:	/* SetMix/Mix */
-			case 7:	/* SetMix/FillOrMix */
-				CVAL2(input, mix);
-				opcode -= 5;
-				break;
-			case 9:	/* FillOrMix_1 */
-				mask = 0x03;
-				opcode = 0x02;
-				fom_mask = 3;
-				break;
-			case 0x0a:	/* FillOrMix_2 */
-				mask = 0x05;
-				opcode = 0x02;
-				fom_mask = 5;
-				break;
+			memcpy(planes + plane_size * y, input, plane_size);
+			input += plane_size;
 		}
-		lastopcode = opcode;
-		mixmask = 0;
-		/* Output body */
-		while (count > 0)
+		total_pro = size;
+	}
+	else
+	{
+		if (!(code & 0x20))
 		{
-			if (x >= width)
+			if (g_bitmap_alpha)
 			{
-				if (height <= 0)
-					return False;
-				x = 0;
-				height--;
-				prevline = line;
-				line = ((uint16 *) output) + height * width;
+				alpha = planes + plane_size * 3;
+				bytes_pro = process_plane(input, width, height, alpha, size - total_pro);
 			}
-			switch (opcode)
+			else
 			{
-				case 0:	/* Fill */
-					if (insertmix)
-					{
-						if (prevline == NULL)
-							line[x] = mix;
-						else
-							line[x] = prevline[x] ^ mix;
-						insertmix = False;
-						count--;
-						x++;
-					}
-					if (prevline == NULL)
-					{
-						REPEAT(line[x] = 0)
-					}
-					else
-					{
-						REPEAT(line[x] = prevline[x])
-					}
-					break;
-				case 1:	/* Mix */
-					if (prevline == NULL)
-					{
-						REPEAT(line[x] = mix)
-					}
-					else
-					{
-						REPEAT(line[x] = prevline[x] ^ mix)
-					}
-					break;
-				case 2:	/* Fill or Mix */
-					if (prevline == NULL)
-					{
-						REPEAT
-						(
-							MASK_UPDATE();
-							if (mask & mixmask)
-								line[x] = mix;
-							else
-								line[x] = 0;
-						)
-					}
-					else
-					{
-						REPEAT
-						(
-							MASK_UPDATE();
-							if (mask & mixmask)
-								line[x] = prevline[x] ^ mix;
-							else
-								line[x] = prevline[x];
-						)
-					}
-					break;
-				case 3:	/* Colour */
-					REPEAT(line[x] = colour2)
-					break;
-				case 4:	/* Copy */
-					REPEAT(CVAL2(input, line[x]))
-					break;
-				case 8:	/* Bicolour */
-					REPEAT
-					(
-						if (bicolour)
-						{
-							line[x] = colour2;
-							bicolour = False;
-						}
-						else
-						{
-							line[x] = colour1;
-							bicolour = True;
-							count++;
-						}
-					)
-					break;
-				case 0xd:	/* White */
-					REPEAT(line[x] = 0xffff)
-					break;
-				case 0xe:	/* Black */
-					REPEAT(line[x] = 0)
-					break;
-				default:
-					logger(Core, Warning, "bitmap_decompress2(), unhandled bitmap opcode 0x%x", opcode);
-					return False;
+				bytes_pro = skip_plane(input, width, height, size - total_pro);
 			}
+			if (bytes_pro < 0)
+				goto out;
+			total_pro += bytes_pro;
+			input += bytes_pro;
+		}
+
+		/* red, green and blue */
+		for (y = 2; y >= 0; y--)
+		{
+			bytes_pro = process_plane(input, width, height, planes + plane_size * y,
+						  size - total_pro);
+			if (bytes_pro < 0)
+				goto out;
+			total_pro += bytes_pro;
+			input += bytes_pro;
 		}
 	}
+
+	for (y = 0; y < height; y++)
+	{
+		line = output + (bottom_up ? height - y - 1 : y) * width * 4;
+		planar_to_bgra(planes + y * width, planes + plane_size + y * width,
+			       planes + plane_size * 2 + y * width, alpha ? alpha + y * width : NULL,
+			       line, width);
+	}
+	rv = (size == total_pro);
+
+out:
+	if (planes != stack_planes)
+		xfree(planes);
+	return rv;
+}
+
+/* main decompress function */
+RD_BOOL
+bitmap_decompress(uint8 * output, int width, int height, uint8 * input, int size, int Bpp)
+{
+	RD_BOOL rv = False;
+	uint64 begin;
+	int codec;
+	TRACE_SCOPE(TRACE_BITMAP_DECOMPRESS);
+
+	begin = bitmap_clock();
+	switch (Bpp)
+	{
+		case 1:
+			rv = bitmap_decompress1(output, width, height, input, size);
+			break;
+		case 2:
+			rv = bitmap_decompress2(output, width, height, input, size);
+			break;
+		case 3:
+			rv = bitmap_decompress3(output, width, height, input, size);
+			break;
+		case 4:
+			rv = bitmap_decompress_planar(output, width, height, input, size, True);
+			break;
+		default:
+			logger(Core, Debug, "bitmap_decompress(), unhandled BPP %d", Bpp);
+			break;
+	}
+
+	codec = Bpp == 4 ? BITMAP_CODEC_PLANAR : BITMAP_CODEC_INTERLEAVED;
+	__atomic_add_fetch(&g_bitmap_codec_stats[codec].count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&g_bitmap_codec_stats[codec].nsec, bitmap_clock() - begin,
+			   __ATOMIC_RELAXED);
+	return rv;
+}
+
+/* Format the decoding time of codec n into buf, for the ctrl socket */
+RD_BOOL
+bitmap_format_stats(int n, char *buf, size_t size)
+{
+	if (n < 0 || n >= BITMAP_CODECS)
+		return False;
+
+	snprintf(buf, size, "%s count=%llu usec=%llu", g_bitmap_codec_names[n],
+		 (unsigned long long) __atomic_load_n(&g_bitmap_codec_stats[n].count,
+						      __ATOMIC_RELAXED),
+		 (unsigned long long) __atomic_load_n(&g_bitmap_codec_stats[n].nsec,
+						      __ATOMIC_RELAXED) / 1000);
 	return True;
 }
 
-/* 3 byte bitmap decompress */
-static RD_BOOL
-bitmap_decompress3(uint8 * output, int width, int height, uint8 * input, int size)
+void
+bitmap_reset_stats(void)
 {
-	uint8 *end = input + size;
-	uint8 *prevline = NULL, *line = NULL;
-	int opcode, count, offset, isfillormix, x = width;
-	int lastopcode = -1, insertmix = False, bicolour = False;
-	uint8 code;
-	uint8 colour1[3] = {0, 0, 0}, colour2[3] = {0, 0, 0};
-	uint8 mixmask, mask = 0;
-	uint8 mix[3] = {0xff, 0xff, 0xff};
-	int fom_mask = 0;
-
-	while (input < end)
+	int n;
+
+	for (n = 0; n < BITMAP_CODECS; n++)
 	{
-		fom_mask = 0;
-		code = CVAL(input);
-		opcode = code >> 4;
-		/* Handle different opcode forms */
-		switch (opcode)
-		{
-			case 0xc:
-			case 0xd:
-			case 0xe:
-				opcode -= 6;
-				count = code & 0xf;
-				offset = 16;
-				break;
-			case 0xf:
-				opcode = code & 0xf;
-				if (opcode < 9)
-				{
-					count = CVAL(input);
-					count |= CVAL(input) << 8;
-				}
-				else
-				{
-					count = (opcode <
-						 0xb) ? 8 : 1;
-				}
-				offset = 0;
-				break;
-			default:
-				opcode >>= 1;
-				count = code & 0x1f;
-				offset = 32;
-				break;
-		}
-		/* Handle strange cases for counts */
-		if (offset != 0)
+		__atomic_store_n(&g_bitmap_codec_stats[n].count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&g_bitmap_codec_stats[n].nsec, 0, __ATOMIC_RELAXED);
+	}
+}
+
+/* Encoders producing what bitmap_decompress() reads, for storing
+   bitmaps in the persistent cache. They only aim to be fast and
+   simple: interleaved RLE is written with fill, colour and copy orders
+   only, and planar with plain runs. */
+
+/* Append an interleaved RLE order header */
+static uint8 *
+rle_put_order(uint8 * out, int opcode, int count)
+{
+	if (count < 32)
+	{
+		*(out++) = (opcode << 5) | count;
+	}
+	else if (count < 32 + 256)
+	{
+		*(out++) = opcode << 5;
+		*(out++) = count - 32;
+	}
+	else
+	{
+		*(out++) = 0xf0 | opcode;
+		*(out++) = count & 0xff;
+		*(out++) = count >> 8;
+	}
+	return out;
+}
+
+/* Pixel q in the order the decoder writes them, bottom scanline first */
+#define RLE_PIXEL_AT(q) (input + ((height - 1 - (q) / width) * width + (q) % width) * Bpp)
+/* The same pixel on the scanline written before, black on the first */
+#define RLE_PREV_AT(q) ((q) < width ? black : RLE_PIXEL_AT((q) - width))
+
+static int
+bitmap_compress_rle(uint8 * output, int size, int width, int height, uint8 * input, int Bpp)
+{
+	static const uint8 black[4] = { 0, 0, 0, 0 };
+	uint8 *out = output;
+	uint8 *end = output + size;
+	int n = width * height;
+	int p, q, fill, run, copy;
+
+	copy = 0;
+	for (p = 0; p <= n; p++)
+	{
+		fill = run = 0;
+		if (p < n)
 		{
-			isfillormix = ((opcode == 2) || (opcode == 7));
-			if (count == 0)
+			while (p + fill < n && memcmp(RLE_PIXEL_AT(p + fill), RLE_PREV_AT(p + fill), Bpp) == 0)
+				fill++;
+			run = 1;
+			while (p + run < n && memcmp(RLE_PIXEL_AT(p + run), RLE_PIXEL_AT(p), Bpp) == 0)
+				run++;
+
+			if (fill < 4 && run < 4)
 			{
-				if (isfillormix)
-					count = CVAL(input) + 1;
-				else
-					count = CVAL(input) + offset;
+				copy++;
+				continue;
 			}
-			else if (isfillormix)
+		}
+
+		if (copy > 0)
+		{
+			if (end - out < 3 + copy * Bpp)
+				return 0;
+			out = rle_put_order(out, 4, copy);
+			for (q = p - copy; q < p; q++)
 			{
-				count <<= 3;
+				memcpy(out, RLE_PIXEL_AT(q), Bpp);
+				out += Bpp;
 			}
+			copy = 0;
 		}
-		/* Read preliminary data */
-		switch (opcode)
+
+		if (p == n)
+			break;
+
+		/* fills are as long as they go, so two never follow each
+		   other, which the decoder would take as a mix */
+		if (end - out < 3 + Bpp)
+			return 0;
+		if (fill >= run)
 		{
-			case 0:	/* Fill */
-				if ((lastopcode == opcode) && !((x == width) && (prevline == NULL)))
-					insertmix = True;
-				break;
-			case 8:	/* Bicolour */
-				colour1[0] = CVAL(input);
-				colour1[1] = CVAL(input);
-				colour1[2] = CVAL(input);
-				colour2[0] = CVAL(input);
-				colour2[1] = CVAL(input);
-				colour2[2] = CVAL(input);
-				break;
-			case 3:	/* Colour */
-				colour2[0] = CVAL(input);
-				colour2[1] = CVAL(input);
-				colour2[2] = CVAL(input);
-				break;
-			case 6:	/* SetMix/Mix */
-			case 7:	/* SetMix/FillOrMix */
-				mix[0] = CVAL(input);
-				mix[1] = CVAL(input);
-				mix[2] = CVAL(input);
-				opcode -= 5;
-				break;
-			case 9:	/* FillOrMix_1 */
-				mask = 0x03;
-				opcode = 0x02;
-				fom_mask = 3;
-				break;
-			case 0x0a:	/* FillOrMix_2 */
-				mask = 0x05;
-				opcode = 0x02;
-				fom_mask = 5;
-				break;
+			out = rle_put_order(out, 0, fill);
+			p += fill - 1;
 		}
-		lastopcode = opcode;
-		mixmask = 0;
-		/* Output body */
-		while (count > 0)
+		else
 		{
-			if (x >= width)
+			out = rle_put_order(out, 3, run);
+			memcpy(out, RLE_PIXEL_AT(p), Bpp);
+			out += Bpp;
+			p += run - 1;
+		}
+	}
+
+	return out - output;
+}
+
+#undef RLE_PIXEL_AT
+#undef RLE_PREV_AT
+
+/* Encode one scanline of a planar colour plane, already turned in to
+   raw values or delta codes. Returns the bytes written or -1 if they
+   do not fit. */
+static int
+planar_compress_line(uint8 * out, int size, uint8 * line, int width)
+{
+	uint8 *start = out;
+	uint8 color = 0;
+	int x = 0, collen, replen;
+
+	while (x < width)
+	{
+		for (replen = 0; x + replen < width && line[x + replen] == color; replen++);
+
+		if (replen >= 3)
+		{
+			if (size < 1)
+				return -1;
+			/* 16 to 47 have a form of their own, 1 and 2 have none */
+			if (replen >= 16)
 			{
-				if (height <= 0)
-					return False;
-				x = 0;
-				height--;
-				prevline = line;
-				line = output + height * (width * 3);
+				replen = MIN(replen, 47);
+				*(out++) = ((replen & 0xf) << 4) | (replen >> 4);
 			}
-			switch (opcode)
+			else
 			{
-				case 0:	/* Fill */
-					if (insertmix)
-					{
-						if (prevline == NULL)
-						{
-							line[x * 3] = mix[0];
-							line[x * 3 + 1] = mix[1];
-							line[x * 3 + 2] = mix[2];
-						}
-						else
-						{
-							line[x * 3] =
-							 prevline[x * 3] ^ mix[0];
-							line[x * 3 + 1] =
-							 prevline[x * 3 + 1] ^ mix[1];
-							line[x * 3 + 2] =
-							 prevline[x * 3 + 2] ^ mix[2];
-						}
-						insertmix = False;
-						count--;
-						x++;
-					}
-					if (prevline == NULL)
-					{
-						REPEAT
-						(
-							line[x * 3] = 0;
-							line[x * 3 + 1] = 0;
-							line[x * 3 + 2] = 0;
-						)
-					}
-					else
-					{
-						REPEAT
-						(
-							line[x * 3] = prevline[x * 3];
-							line[x * 3 + 1] = prevline[x * 3 + 1];
-							line[x * 3 + 2] = prevline[x * 3 + 2];
-						)
-					}
-					break;
-				case 1:	/* Mix */
-					if (prevline == NULL)
-					{
-						REPEAT
-						(
-							line[x * 3] = mix[0];
-							line[x * 3 + 1] = mix[1];
-							line[x * 3 + 2] = mix[2];
-						)
-					}
-					else
-					{
-						REPEAT
-						(
-							line[x * 3] =
-							 prevline[x * 3] ^ mix[0];
-							line[x * 3 + 1] =
-							 prevline[x * 3 + 1] ^ mix[1];
-							line[x * 3 + 2] =
-							 prevline[x * 3 + 2] ^ mix[2];
-						)
-					}
-					break;
-				case 2:	/* Fill or Mix */
-					if (prevline == NULL)
-					{
-						REPEAT
-						(
-							MASK_UPDATE();
-							if (mask & mixmask)
-							{
-								line[x * 3] = mix[0];
-								line[x * 3 + 1] = mix[1];
-								line[x * 3 + 2] = mix[2];
-							}
-							else
-							{
-								line[x * 3] = 0;
-								line[x * 3 + 1] = 0;
-								line[x * 3 + 2] = 0;
-							}
-						)
-					}
-					else
-					{
-						REPEAT
-						(
-							MASK_UPDATE();
-							if (mask & mixmask)
-							{
-								line[x * 3] = 
-								 prevline[x * 3] ^ mix [0];
-								line[x * 3 + 1] =
-								 prevline[x * 3 + 1] ^ mix [1];
-								line[x * 3 + 2] =
-								 prevline[x * 3 + 2] ^ mix [2];
-							}
-							else
-							{
-								line[x * 3] =
-								 prevline[x * 3];
-								line[x * 3 + 1] =
-								 prevline[x * 3 + 1];
-								line[x * 3 + 2] =
-								 prevline[x * 3 + 2];
-							}
-						)
-					}
-					break;
-				case 3:	/* Colour */
-					REPEAT
-					(
-						line[x * 3] = colour2 [0];
-						line[x * 3 + 1] = colour2 [1];
-						line[x * 3 + 2] = colour2 [2];
-					)
-					break;
-				case 4:	/* Copy */
-					REPEAT
-					(
-						line[x * 3] = CVAL(input);
-						line[x * 3 + 1] = CVAL(input);
-						line[x * 3 + 2] = CVAL(input);
-					)
-					break;
-				case 8:	/* Bicolour */
-					REPEAT
-					(
-						if (bicolour)
-						{
-							line[x * 3] = colour2[0];
-							line[x * 3 + 1] = colour2[1];
-							line[x * 3 + 2] = colour2[2];
-							bicolour = False;
-						}
-						else
-						{
-							line[x * 3] = colour1[0];
-							line[x * 3 + 1] = colour1[1];
-							line[x * 3 + 2] = colour1[2];
-							bicolour = True;
-							count++;
-						}
-					)
-					break;
-				case 0xd:	/* White */
-					REPEAT
-					(
-						line[x * 3] = 0xff;
-						line[x * 3 + 1] = 0xff;
-						line[x * 3 + 2] = 0xff;
-					)
-					break;
-				case 0xe:	/* Black */
-					REPEAT
-					(
-						line[x * 3] = 0;
-						line[x * 3 + 1] = 0;
-						line[x * 3 + 2] = 0;
-					)
-					break;
-				default:
-					logger(Core, Warning, "bitmap_decompress3(), unhandled bitmap opcode 0x%x", opcode);
-					return False;
+				*(out++) = replen;
 			}
+			size--;
+			x += replen;
+			continue;
 		}
+
+		/* raw values, up to where the last one starts repeating */
+		for (collen = 1; collen < 15 && x + collen < width; collen++)
+			if (x + collen + 2 < width && line[x + collen] == line[x + collen - 1]
+			    && line[x + collen + 1] == line[x + collen - 1]
+			    && line[x + collen + 2] == line[x + collen - 1])
+				break;
+
+		color = line[x + collen - 1];
+		for (replen = 0;
+		     replen < 15 && x + collen + replen < width && line[x + collen + replen] == color;
+		     replen++);
+		if (replen < 3)
+			replen = 0;
+
+		if (size < 1 + collen)
+			return -1;
+		*(out++) = (collen << 4) | replen;
+		memcpy(out, line + x, collen);
+		out += collen;
+		size -= 1 + collen;
+		x += collen + replen;
 	}
-	return True;
+
+	return out - start;
 }
 
-/* decompress a colour plane */
 static int
-process_plane(uint8 * in, int width, int height, uint8 * out, int size)
+bitmap_compress_planar(uint8 * output, int size, int width, int height, uint8 * input)
 {
-	UNUSED(size);
-	int indexw;
-	int indexh;
-	int code;
-	int collen;
-	int replen;
-	int color;
-	int x;
-	int revcode;
-	uint8 * last_line;
-	uint8 * this_line;
-	uint8 * org_in;
-	uint8 * org_out;
+	static const int channels[] = { 3, 2, 1, 0 };	/* alpha, red, green, blue */
+	uint8 line[64 * 4];
+	uint8 *row, *prev;
+	int i, x, y, n, total, delta;
+	RD_BOOL alpha = False;
 
-	org_in = in;
-	org_out = out;
-	last_line = 0;
-	indexh = 0;
-	while (indexh < height)
+	if (width > (int) sizeof(line) || size < 1)
+		return 0;
+
+	for (i = 0; i < width * height; i++)
+		if (input[i * 4 + 3] != 0xff)
+			alpha = True;
+
+	output[0] = alpha ? 0x10 : 0x30;
+	total = 1;
+
+	for (i = alpha ? 0 : 1; i < 4; i++)
 	{
-		out = (org_out + width * height * 4) - ((indexh + 1) * width * 4);
-		color = 0;
-		this_line = out;
-		indexw = 0;
-		if (last_line == 0)
+		/* scanlines are sent bottom up */
+		prev = NULL;
+		for (y = 0; y < height; y++)
 		{
-			while (indexw < width)
+			row = input + (height - y - 1) * width * 4 + channels[i];
+			for (x = 0; x < width; x++)
 			{
-				code = CVAL(in);
-				replen = code & 0xf;
-				collen = (code >> 4) & 0xf;
-				revcode = (replen << 4) | collen;
-				if ((revcode <= 47) && (revcode >= 16))
-				{
-					replen = revcode;
-					collen = 0;
-				}
-				while (indexw < width && collen > 0)
-				{
-					color = CVAL(in);
-					*out = color;
-					out += 4;
-					indexw++;
-					collen--;
-				}
-				while (indexw < width && replen > 0)
+				if (prev == NULL)
 				{
-					*out = color;
-					out += 4;
-					indexw++;
-					replen--;
+					line[x] = row[x * 4];
+					continue;
 				}
+
+				delta = (sint8) (row[x * 4] - prev[x * 4]);
+				line[x] = delta >= 0 ? delta << 1 : ((-delta - 1) << 1) | 1;
 			}
+			prev = row;
+
+			n = planar_compress_line(output + total, size - total, line, width);
+			if (n < 0)
+				return 0;
+			total += n;
 		}
-		else
+	}
+
+	return total;
+}
+
+/* Compress a bitmap in the form bitmap_decompress() produces in to at
+   most size bytes. Returns the compressed size, or 0 if it would not
+   be smaller than size. */
+int
+bitmap_compress(uint8 * output, int size, int width, int height, uint8 * input, int Bpp)
+{
+	int n;
+
+	if (Bpp == 4)
+		n = bitmap_compress_planar(output, size, width, height, input);
+	else if (Bpp >= 1 && Bpp <= 3)
+		n = bitmap_compress_rle(output, size, width, height, input, Bpp);
+	else
+		n = 0;
+
+	return n < size ? n : 0;
+}
+
+/* Worker pool for decompressing the rectangles of one bitmap update,
+   or the tiles of a RemoteFX message, in parallel. Jobs are taken in
+   the order they were queued, and the thread waiting for a job helps
+   out with the queue rather than sleeping, which also makes the pool
+   optional. */
+#define BITMAP_MAX_THREADS 8
+
+static pthread_mutex_t g_bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_bitmap_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_bitmap_done = PTHREAD_COND_INITIALIZER;
+static BITMAP_JOB *g_bitmap_queue_head = NULL;
+static BITMAP_JOB *g_bitmap_queue_tail = NULL;
+/* Number of worker threads, -1 until the pool has been started */
+static int g_bitmap_threads = -1;
+
+/* Must be called with g_bitmap_lock held */
+static BITMAP_JOB *
+bitmap_job_pop(void)
+{
+	BITMAP_JOB *job;
+
+	job = g_bitmap_queue_head;
+	if (job != NULL)
+	{
+		g_bitmap_queue_head = job->next;
+		if (g_bitmap_queue_head == NULL)
+			g_bitmap_queue_tail = NULL;
+	}
+	return job;
+}
+
+static RD_BOOL
+bitmap_job_decode(BITMAP_JOB * job)
+{
+	if (job->decode != NULL)
+		return job->decode(job);
+	return bitmap_decompress(job->output, job->width, job->height, job->input, job->size,
+				 job->Bpp);
+}
+
+/* Decompress a job without holding the lock and mark it done */
+static void
+bitmap_job_run(BITMAP_JOB * job)
+{
+	RD_BOOL result;
+
+	pthread_mutex_unlock(&g_bitmap_lock);
+	result = bitmap_job_decode(job);
+	pthread_mutex_lock(&g_bitmap_lock);
+
+	job->result = result;
+	job->done = True;
+	pthread_cond_broadcast(&g_bitmap_done);
+}
+
+static void *
+bitmap_worker(void *arg)
+{
+	BITMAP_JOB *job;
+
+	UNUSED(arg);
+
+	pthread_mutex_lock(&g_bitmap_lock);
+	while (1)
+	{
+		job = bitmap_job_pop();
+		if (job == NULL)
 		{
-			while (indexw < width)
-			{
-				code = CVAL(in);
-				replen = code & 0xf;
-				collen = (code >> 4) & 0xf;
-				revcode = (replen << 4) | collen;
-				if ((revcode <= 47) && (revcode >= 16))
-				{
-					replen = revcode;
-					collen = 0;
-				}
-				while (indexw < width && collen > 0)
-				{
-					x = CVAL(in);
-					if (x & 1)
-					{
-						x = x >> 1;
-						x = x + 1;
-						color = -x;
-					}
-					else
-					{
-						x = x >> 1;
-						color = x;
-					}
-					x = last_line[indexw * 4] + color;
-					*out = x;
-					out += 4;
-					indexw++;
-					collen--;
-				}
-				while (indexw < width && replen > 0)
-				{
-					x = last_line[indexw * 4] + color;
-					*out = x;
-					out += 4;
-					indexw++;
-					replen--;
-				}
-			}
+			pthread_cond_wait(&g_bitmap_queued, &g_bitmap_lock);
+			continue;
 		}
-		indexh++;
-		last_line = this_line;
+		bitmap_job_run(job);
 	}
-	return (int) (in - org_in);
+
+	return NULL;
 }
 
-/* 4 byte bitmap decompress */
-static RD_BOOL
-bitmap_decompress4(uint8 * output, int width, int height, uint8 * input, int size)
+static void
+bitmap_pool_start(void)
 {
-	int code;
-	int bytes_pro;
-	int total_pro;
+	pthread_t thread;
+	long cpus;
+	int i;
 
-	code = CVAL(input);
-	if (code != 0x10)
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	/* The waiting thread does its share of the work */
+	g_bitmap_threads = 0;
+	for (i = 0; i < MIN(cpus - 1, BITMAP_MAX_THREADS); i++)
 	{
-		return False;
+		if (pthread_create(&thread, NULL, bitmap_worker, NULL) != 0)
+		{
+			logger(Core, Warning, "bitmap_pool_start(), failed to create worker thread");
+			break;
+		}
+		pthread_detach(thread);
+		g_bitmap_threads++;
 	}
-	total_pro = 1;
-	bytes_pro = process_plane(input, width, height, output + 3, size - total_pro);
-	total_pro += bytes_pro;
-	input += bytes_pro;
-	bytes_pro = process_plane(input, width, height, output + 2, size - total_pro);
-	total_pro += bytes_pro;
-	input += bytes_pro;
-	bytes_pro = process_plane(input, width, height, output + 1, size - total_pro);
-	total_pro += bytes_pro;
-	input += bytes_pro;
-	bytes_pro = process_plane(input, width, height, output + 0, size - total_pro);
-	total_pro += bytes_pro;
-	return size == total_pro;
+
+	logger(Core, Debug, "bitmap_pool_start(), using %d bitmap decompression threads",
+	       g_bitmap_threads);
 }
 
-/* main decompress function */
+/* Queue a bitmap for decompression, the result is collected with
+   bitmap_decompress_wait() */
+void
+bitmap_decompress_queue(BITMAP_JOB * job)
+{
+	job->done = False;
+	job->result = False;
+	job->next = NULL;
+
+	if (g_bitmap_threads == -1)
+		bitmap_pool_start();
+
+	if (g_bitmap_threads == 0)
+	{
+		job->result = bitmap_job_decode(job);
+		job->done = True;
+		return;
+	}
+
+	pthread_mutex_lock(&g_bitmap_lock);
+	if (g_bitmap_queue_tail != NULL)
+		g_bitmap_queue_tail->next = job;
+	else
+		g_bitmap_queue_head = job;
+	g_bitmap_queue_tail = job;
+	pthread_cond_signal(&g_bitmap_queued);
+	pthread_mutex_unlock(&g_bitmap_lock);
+}
+
+/* Wait for a queued bitmap and return whether it decompressed
+   correctly */
 RD_BOOL
-bitmap_decompress(uint8 * output, int width, int height, uint8 * input, int size, int Bpp)
+bitmap_decompress_wait(BITMAP_JOB * job)
 {
-	RD_BOOL rv = False;
+	BITMAP_JOB *next;
 
-	switch (Bpp)
+	if (g_bitmap_threads == 0)
+		return job->result;
+
+	pthread_mutex_lock(&g_bitmap_lock);
+	while (!job->done)
 	{
-		case 1:
-			rv = bitmap_decompress1(output, width, height, input, size);
-			break;
-		case 2:
-			rv = bitmap_decompress2(output, width, height, input, size);
-			break;
-		case 3:
-			rv = bitmap_decompress3(output, width, height, input, size);
-			break;
-		case 4:
-			rv = bitmap_decompress4(output, width, height, input, size);
-			break;
-		default:
-			logger(Core, Debug, "bitmap_decompress(), unhandled BPP %d", Bpp);
-			break;
+		next = bitmap_job_pop();
+		if (next != NULL)
+			bitmap_job_run(next);
+		else
+			pthread_cond_wait(&g_bitmap_done, &g_bitmap_lock);
 	}
-	return rv;
+	pthread_mutex_unlock(&g_bitmap_lock);
+
+	return job->result;
 }
 
 /* *INDENT-ON* */
@@ -0,0 +1,292 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Interleaved RLE bitmap decompressor template
+   Copyright (C) Matthew Chapman <matthewc.unsw.edu.au> 1999-2008
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* This file is included by bitmap.c once for every pixel size, and
+   has no include guard on purpose. The includer defines:
+
+   RLE_NAME                 name of the generated function
+   RLE_BPP                  bytes per pixel
+   RLE_PIXEL                type able to hold one pixel value
+   RLE_WHITE                value of a white pixel
+   RLE_READ_PIXEL(p, v)     read a pixel value from the input
+   RLE_GET(line, x)         pixel x of a scanline
+   RLE_PUT(line, x, v)      set pixel x of a scanline
+   RLE_FILL(line, x, v, n)  set n pixels starting at x
+
+   Every order is expanded a scanline segment at a time, so runs of
+   fill, copy and colour orders become memset()/memcpy() style loops
+   rather than a switch per pixel. */
+
+/* indent is confused by this file */
+/* *INDENT-OFF* */
+
+static RD_BOOL
+RLE_NAME(uint8 * output, int width, int height, uint8 * input, int size)
+{
+	uint8 *end = input + size;
+	uint8 *prevline = NULL, *line = NULL;
+	int opcode, count, offset, isfillormix, x = width;
+	int lastopcode = -1, insertmix = False, bicolour = False;
+	int n, i;
+	uint8 code;
+	RLE_PIXEL colour1 = 0, colour2 = 0, value;
+	uint8 mixmask, mask = 0;
+	RLE_PIXEL mix = RLE_WHITE;
+	int fom_mask = 0;
+
+	while (input < end)
+	{
+		fom_mask = 0;
+		code = CVAL(input);
+		opcode = code >> 4;
+		/* Handle different opcode forms */
+		switch (opcode)
+		{
+			case 0xc:
+			case 0xd:
+			case 0xe:
+				opcode -= 6;
+				count = code & 0xf;
+				offset = 16;
+				break;
+			case 0xf:
+				opcode = code & 0xf;
+				if (opcode < 9)
+				{
+					count = CVAL(input);
+					count |= CVAL(input) << 8;
+				}
+				else
+				{
+					count = (opcode < 0xb) ? 8 : 1;
+				}
+				offset = 0;
+				break;
+			default:
+				opcode >>= 1;
+				count = code & 0x1f;
+				offset = 32;
+				break;
+		}
+		/* Handle strange cases for counts */
+		if (offset != 0)
+		{
+			isfillormix = ((opcode == 2) || (opcode == 7));
+			if (count == 0)
+			{
+				if (isfillormix)
+					count = CVAL(input) + 1;
+				else
+					count = CVAL(input) + offset;
+			}
+			else if (isfillormix)
+			{
+				count <<= 3;
+			}
+		}
+		/* Read preliminary data */
+		switch (opcode)
+		{
+			case 0:	/* Fill */
+				if ((lastopcode == opcode) && !((x == width) && (prevline == NULL)))
+					insertmix = True;
+				break;
+			case 8:	/* Bicolour */
+				RLE_READ_PIXEL(input, colour1);
+				RLE_READ_PIXEL(input, colour2);
+				break;
+			case 3:	/* Colour */
+				RLE_READ_PIXEL(input, colour2);
+				break;
+			case 6:	/* SetMix/Mix */
+			case 7:	/* SetMix/FillOrMix */
+				RLE_READ_PIXEL(input, mix);
+				opcode -= 5;
+				break;
+			case 9:	/* FillOrMix_1 */
+				mask = 0x03;
+				opcode = 0x02;
+				fom_mask = 3;
+				break;
+			case 0x0a:	/* FillOrMix_2 */
+				mask = 0x05;
+				opcode = 0x02;
+				fom_mask = 5;
+				break;
+		}
+		lastopcode = opcode;
+		mixmask = 0;
+		/* Output body */
+		while (count > 0)
+		{
+			if (x >= width)
+			{
+				if (height <= 0)
+					return False;
+				x = 0;
+				height--;
+				prevline = line;
+				line = output + height * width * RLE_BPP;
+			}
+			/* the part of the order that fits on this scanline */
+			n = MIN(count, width - x);
+			switch (opcode)
+			{
+				case 0:	/* Fill */
+					if (insertmix)
+					{
+						if (prevline == NULL)
+						{
+							RLE_PUT(line, x, mix);
+						}
+						else
+						{
+							RLE_PUT(line, x, RLE_GET(prevline, x) ^ mix);
+						}
+						insertmix = False;
+						count--;
+						x++;
+						n--;
+					}
+					if (prevline == NULL)
+						memset(line + x * RLE_BPP, 0, n * RLE_BPP);
+					else
+						memcpy(line + x * RLE_BPP, prevline + x * RLE_BPP,
+						       n * RLE_BPP);
+					count -= n;
+					x += n;
+					break;
+				case 1:	/* Mix */
+					if (prevline == NULL)
+					{
+						RLE_FILL(line, x, mix, n);
+					}
+					else
+					{
+						for (i = 0; i < n; i++)
+							RLE_PUT(line, x + i, RLE_GET(prevline, x + i) ^ mix);
+					}
+					count -= n;
+					x += n;
+					break;
+				case 2:	/* Fill or Mix */
+					while (n > 0)
+					{
+						if (n >= 8 && (mixmask == 0 || mixmask == 0x80))
+						{
+							/* a whole mask byte at once */
+							mask = fom_mask ? fom_mask : CVAL(input);
+							mixmask = 0x80;
+							if (mask == 0 && prevline == NULL)
+							{
+								memset(line + x * RLE_BPP, 0, 8 * RLE_BPP);
+							}
+							else if (mask == 0)
+							{
+								memcpy(line + x * RLE_BPP, prevline + x * RLE_BPP,
+								       8 * RLE_BPP);
+							}
+							else if (mask == 0xff && prevline == NULL)
+							{
+								RLE_FILL(line, x, mix, 8);
+							}
+							else
+							{
+								for (i = 0; i < 8; i++)
+								{
+									value = prevline ? RLE_GET(prevline, x + i) : 0;
+									if (mask & (1 << i))
+										value ^= mix;
+									RLE_PUT(line, x + i, value);
+								}
+							}
+							count -= 8;
+							x += 8;
+							n -= 8;
+							continue;
+						}
+						MASK_UPDATE();
+						value = prevline ? RLE_GET(prevline, x) : 0;
+						if (mask & mixmask)
+							value ^= mix;
+						RLE_PUT(line, x, value);
+						count--;
+						x++;
+						n--;
+					}
+					break;
+				case 3:	/* Colour */
+					RLE_FILL(line, x, colour2, n);
+					count -= n;
+					x += n;
+					break;
+				case 4:	/* Copy */
+					memcpy(line + x * RLE_BPP, input, n * RLE_BPP);
+					input += n * RLE_BPP;
+					count -= n;
+					x += n;
+					break;
+				case 8:	/* Bicolour */
+					/* each colour pair only counts as one */
+					while ((count > 0) && (x < width))
+					{
+						if (bicolour)
+						{
+							RLE_PUT(line, x, colour2);
+							bicolour = False;
+							count--;
+						}
+						else
+						{
+							RLE_PUT(line, x, colour1);
+							bicolour = True;
+						}
+						x++;
+					}
+					break;
+				case 0xd:	/* White */
+					memset(line + x * RLE_BPP, 0xff, n * RLE_BPP);
+					count -= n;
+					x += n;
+					break;
+				case 0xe:	/* Black */
+					memset(line + x * RLE_BPP, 0, n * RLE_BPP);
+					count -= n;
+					x += n;
+					break;
+				default:
+					logger(Core, Warning, "%s(), unhandled bitmap opcode 0x%x", __func__,
+					       opcode);
+					return False;
+			}
+		}
+	}
+	return True;
+}
+
+/* *INDENT-ON* */
+
+#undef RLE_NAME
+#undef RLE_BPP
+#undef RLE_PIXEL
+#undef RLE_WHITE
+#undef RLE_READ_PIXEL
+#undef RLE_GET
+#undef RLE_PUT
+#undef RLE_FILL
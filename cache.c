@@ -21,31 +21,102 @@
 
 #include "rdesktop.h"
 
+/* CACHE STATISTICS */
+enum cache_stats_id
+{
+	STATS_BITMAP0,
+	STATS_BITMAP1,
+	STATS_BITMAP2,
+	STATS_GLYPH,
+	STATS_TEXT,
+	STATS_CURSOR,
+	STATS_BRUSH,
+	STATS_NUM_CACHES
+};
+
+struct cache_stats
+{
+	uint32 hits;
+	uint32 misses;
+	uint32 puts;
+	uint32 evictions;	/* entries dropped, or replaced by a put */
+	uint32 loads;		/* misses served from the persistent cache */
+	uint32 entries;
+	uint32 pending;		/* entries not decoded yet */
+	uint64 bytes;		/* of the cached data, as sent by the server */
+};
+
+static const char *g_cache_stats_names[STATS_NUM_CACHES] = {
+	"bitmap0", "bitmap1", "bitmap2", "glyph", "text", "cursor", "brush"
+};
+
+static struct cache_stats g_cache_stats[STATS_NUM_CACHES];
+
+static void
+cache_stats_add(struct cache_stats *st, uint32 bytes)
+{
+	st->puts++;
+	st->entries++;
+	st->bytes += bytes;
+}
+
+static void
+cache_stats_remove(struct cache_stats *st, uint32 bytes)
+{
+	st->evictions++;
+	st->entries--;
+	st->bytes -= bytes;
+}
+
 /* BITMAP CACHE */
 extern int g_pstcache_fd[];
+extern uint32 g_cache_budget;
 
 #define NUM_ELEMENTS(array) (sizeof(array) / sizeof(array[0]))
 #define IS_PERSISTENT(id) (g_pstcache_fd[id] > 0)
-#define TO_TOP -1
 #define NOT_SET -1
 #define IS_SET(idx) (idx >= 0)
 
 /*
- * TODO: Test for optimal value of BUMP_COUNT. TO_TOP gives lowest CPU utilisation but using
- * a positive value will hopefully result in less frequently used bitmaps having a greater chance
- * of being evicted from the cache, and thereby reducing the need to load bitmaps from disk.
- * (Jeroen)
+ * The persistent bitmap caches keep their entries in a list ordered
+ * from least to most recently used, which is also the order the stamps
+ * are written to disk in. Both policies promote in constant time:
+ *
+ * LRU moves an entry to the MRU end on every hit.
+ *
+ * CLOCK only sets the referenced flag of an entry on a hit. Eviction
+ * gives referenced entries at the LRU end a second chance by clearing
+ * the flag and moving them to the MRU end, which is amortised constant
+ * time as well.
  */
-#define BUMP_COUNT 40
+enum bmpcache_policy
+{
+	BMPCACHE_POLICY_LRU,
+	BMPCACHE_POLICY_CLOCK
+};
+
+static const char *g_bmpcache_policy_names[] = { "lru", "clock" };
+
+static enum bmpcache_policy g_bmpcache_policy = BMPCACHE_POLICY_LRU;
 
 struct bmpcache_entry
 {
 	RD_HBITMAP bitmap;
+	uint32 size;
+	uint8 *pending;		/* compressed data, decoded on first use */
+	uint16 pending_size;
+	uint8 width, height, Bpp;
 	sint16 previous;
 	sint16 next;
+	RD_BOOL referenced;
 };
 
-static struct bmpcache_entry g_bmpcache[3][0xa00];
+/* The tables are as large as the cell counts advertised to the
+   server. A persistent cache has a cell for everything on disk, but
+   keeps at most g_bmpcache_resident[id] bitmaps in memory. */
+static struct bmpcache_entry *g_bmpcache[3];
+static uint32 g_bmpcache_cells[3];
+static uint32 g_bmpcache_resident[3];
 static RD_HBITMAP g_volatile_bc[3];
 
 static int g_bmpcache_lru[3] = { NOT_SET, NOT_SET, NOT_SET };
@@ -53,6 +124,89 @@ static int g_bmpcache_mru[3] = { NOT_SET, NOT_SET, NOT_SET };
 
 static int g_bmpcache_count[3];
 
+/* Memory a cached bitmap may take at most, as pixel data in the X
+   server plus its entry here, with cells of 16x16, 32x32 and 64x64
+   pixels */
+#define BMPCACHE_CELL_BYTES(id) ((256 << (2 * (id))) * 4 + sizeof(struct bmpcache_entry))
+
+/* The same for the default cell counts of the bitmap cache v2 caps */
+#define BMPCACHE_DEFAULT_BYTES \
+	(BMPCACHE2_C0_CELLS * BMPCACHE_CELL_BYTES(0) + \
+	 BMPCACHE2_C1_CELLS * BMPCACHE_CELL_BYTES(1) + \
+	 BMPCACHE2_C2_CELLS * BMPCACHE_CELL_BYTES(2))
+
+/* Scale a cell count down to what fits into the memory budget. Every
+   cache gets the same share of its default, so the budget is spread
+   over them as the defaults are. */
+static uint32
+cache_budget_cells(uint32 cells)
+{
+	uint64 scaled;
+
+	if (g_cache_budget == 0 || g_cache_budget >= BMPCACHE_DEFAULT_BYTES)
+		return cells;
+
+	scaled = (uint64) cells * g_cache_budget / BMPCACHE_DEFAULT_BYTES;
+	return MAX(scaled, 1);
+}
+
+/* Size bitmap cache id for the capabilities about to be sent, wanting
+   cells entries. Returns the cell count to advertise, cut down to the
+   memory budget. A persistent cache advertises all of its cells, and
+   only the number kept in memory is cut down. The table never
+   shrinks, so that bitmaps kept across a reconnect stay where they
+   are. */
+uint32
+cache_bitmap_cells(uint8 id, uint32 cells, RD_BOOL persistent)
+{
+	uint32 advertised;
+
+	if (id >= NUM_ELEMENTS(g_bmpcache))
+		return 0;
+
+	if (persistent)
+	{
+		advertised = cells;
+		g_bmpcache_resident[id] = cache_budget_cells(BMPCACHE2_C2_CELLS);
+	}
+	else
+	{
+		advertised = cache_budget_cells(cells);
+		g_bmpcache_resident[id] = advertised;
+	}
+
+	if (advertised > g_bmpcache_cells[id])
+	{
+		g_bmpcache[id] = xrealloc(g_bmpcache[id], advertised * sizeof(struct bmpcache_entry));
+		memset(g_bmpcache[id] + g_bmpcache_cells[id], 0,
+		       (advertised - g_bmpcache_cells[id]) * sizeof(struct bmpcache_entry));
+		g_bmpcache_cells[id] = advertised;
+	}
+
+	if (advertised != cells)
+		logger(Core, Verbose,
+		       "cache_bitmap_cells(), bitmap cache %d cut down to %u of %u cells", id,
+		       advertised, cells);
+
+	return advertised;
+}
+
+/* Select the eviction policy of the persistent bitmap caches by name */
+RD_BOOL
+cache_set_bitmap_policy(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_ELEMENTS(g_bmpcache_policy_names); i++)
+		if (strcmp(name, g_bmpcache_policy_names[i]) == 0)
+		{
+			g_bmpcache_policy = i;
+			return True;
+		}
+
+	return False;
+}
+
 /* Setup the bitmap cache lru/mru linked list */
 void
 cache_rebuild_bmpcache_linked_list(uint8 id, sint16 * idx, int count)
@@ -70,6 +224,7 @@ cache_rebuild_bmpcache_linked_list(uint8 id, sint16 * idx, int count)
 
 	g_bmpcache_mru[id] = idx[n];
 	g_bmpcache[id][idx[n]].next = NOT_SET;
+	g_bmpcache[id][idx[n]].referenced = False;
 	n_idx = idx[n];
 	c++;
 
@@ -84,6 +239,7 @@ cache_rebuild_bmpcache_linked_list(uint8 id, sint16 * idx, int count)
 
 		g_bmpcache[id][n_idx].previous = idx[n];
 		g_bmpcache[id][idx[n]].next = n_idx;
+		g_bmpcache[id][idx[n]].referenced = False;
 		n_idx = idx[n];
 		c++;
 	}
@@ -100,70 +256,110 @@ cache_rebuild_bmpcache_linked_list(uint8 id, sint16 * idx, int count)
 	}
 }
 
-/* Move a bitmap to a new position in the linked list. */
+/* Move the bitmaps of a persistent cache to the cell indices of a new
+   connection, the one at old[n] to n unless that is NOT_SET. The rest
+   are dropped, the linked list has to be rebuilt afterwards. */
 void
-cache_bump_bitmap(uint8 id, uint16 idx, int bump)
+cache_renumber_bitmaps(uint8 id, sint16 * old, int count)
 {
-	int p_idx, n_idx, n;
-
-	if (!IS_PERSISTENT(id))
-		return;
+	struct bmpcache_entry *previous;
+	int n;
 
-	if (g_bmpcache_mru[id] == idx)
+	if (g_bmpcache_cells[id] == 0)
 		return;
 
-	logger(Core, Debug, "cache_bump_bitmap(), id=%d, idx=%d, bump=%d", id, idx, bump);
-
-	n_idx = g_bmpcache[id][idx].next;
-	p_idx = g_bmpcache[id][idx].previous;
+	previous = xmalloc(g_bmpcache_cells[id] * sizeof(struct bmpcache_entry));
+	memcpy(previous, g_bmpcache[id], g_bmpcache_cells[id] * sizeof(struct bmpcache_entry));
+	memset(g_bmpcache[id], 0, g_bmpcache_cells[id] * sizeof(struct bmpcache_entry));
+	g_bmpcache_count[id] = 0;
 
-	if (IS_SET(n_idx))
+	for (n = 0; n < count && n < (int) g_bmpcache_cells[id]; n++)
 	{
-		/* remove */
-		--g_bmpcache_count[id];
-		if (IS_SET(p_idx))
-			g_bmpcache[id][p_idx].next = n_idx;
-		else
-			g_bmpcache_lru[id] = n_idx;
-		if (IS_SET(n_idx))
-			g_bmpcache[id][n_idx].previous = p_idx;
-		else
-			g_bmpcache_mru[id] = p_idx;
-	}
-	else
-	{
-		p_idx = NOT_SET;
-		n_idx = g_bmpcache_lru[id];
+		if (!IS_SET(old[n]) || old[n] >= (int) g_bmpcache_cells[id]
+		    || previous[old[n]].bitmap == NULL)
+			continue;
+
+		g_bmpcache[id][n].bitmap = previous[old[n]].bitmap;
+		g_bmpcache[id][n].size = previous[old[n]].size;
+		previous[old[n]].bitmap = NULL;
+		g_bmpcache_count[id]++;
 	}
 
-	if (bump >= 0)
+	for (n = 0; n < (int) g_bmpcache_cells[id]; n++)
 	{
-		for (n = 0; n < bump && IS_SET(n_idx); n++)
-		{
-			p_idx = n_idx;
-			n_idx = g_bmpcache[id][p_idx].next;
-		}
+		if (previous[n].bitmap == NULL)
+			continue;
+
+		ui_destroy_bitmap(previous[n].bitmap);
+		cache_stats_remove(&g_cache_stats[STATS_BITMAP0 + id], previous[n].size);
 	}
+
+	if (g_bmpcache_count[id] > 0)
+		logger(Core, Debug, "cache_renumber_bitmaps(), %d bitmaps kept in cache %d",
+		       g_bmpcache_count[id], id);
+
+	xfree(previous);
+}
+
+/* Take a bitmap out of the linked list */
+static void
+cache_unlink_bitmap(uint8 id, uint16 idx)
+{
+	int p_idx, n_idx;
+
+	p_idx = g_bmpcache[id][idx].previous;
+	n_idx = g_bmpcache[id][idx].next;
+
+	if (IS_SET(p_idx))
+		g_bmpcache[id][p_idx].next = n_idx;
 	else
-	{
-		p_idx = g_bmpcache_mru[id];
-		n_idx = NOT_SET;
-	}
+		g_bmpcache_lru[id] = n_idx;
+
+	if (IS_SET(n_idx))
+		g_bmpcache[id][n_idx].previous = p_idx;
+	else
+		g_bmpcache_mru[id] = p_idx;
+
+	--g_bmpcache_count[id];
+}
+
+/* Put a bitmap at the most recently used end of the linked list */
+static void
+cache_link_bitmap(uint8 id, uint16 idx)
+{
+	int p_idx = g_bmpcache_mru[id];
 
-	/* insert */
-	++g_bmpcache_count[id];
 	g_bmpcache[id][idx].previous = p_idx;
-	g_bmpcache[id][idx].next = n_idx;
+	g_bmpcache[id][idx].next = NOT_SET;
+	g_bmpcache[id][idx].referenced = False;
 
-	if (p_idx >= 0)
+	if (IS_SET(p_idx))
 		g_bmpcache[id][p_idx].next = idx;
 	else
 		g_bmpcache_lru[id] = idx;
 
-	if (n_idx >= 0)
-		g_bmpcache[id][n_idx].previous = idx;
-	else
-		g_bmpcache_mru[id] = idx;
+	g_bmpcache_mru[id] = idx;
+	++g_bmpcache_count[id];
+}
+
+/* Record a use of a bitmap that is in the linked list */
+static void
+cache_touch_bitmap(uint8 id, uint16 idx)
+{
+	switch (g_bmpcache_policy)
+	{
+		case BMPCACHE_POLICY_LRU:
+			if (g_bmpcache_mru[id] != idx)
+			{
+				cache_unlink_bitmap(id, idx);
+				cache_link_bitmap(id, idx);
+			}
+			break;
+
+		case BMPCACHE_POLICY_CLOCK:
+			g_bmpcache[id][idx].referenced = True;
+			break;
+	}
 }
 
 /* Evict the least-recently used bitmap from the cache */
@@ -171,40 +367,95 @@ void
 cache_evict_bitmap(uint8 id)
 {
 	uint16 idx;
-	int n_idx;
 
-	if (!IS_PERSISTENT(id))
+	if (!IS_PERSISTENT(id) || !IS_SET(g_bmpcache_lru[id]))
 		return;
 
 	idx = g_bmpcache_lru[id];
-	n_idx = g_bmpcache[id][idx].next;
 
-	logger(Core, Debug, "cache_evict_bitmap(), id=%d idx=%d n_idx=%d bmp=%p", id, idx, n_idx,
-	       g_bmpcache[id][idx].bitmap);
+	/* second chance for anything used since it was last looked at */
+	while (g_bmpcache[id][idx].referenced)
+	{
+		cache_unlink_bitmap(id, idx);
+		cache_link_bitmap(id, idx);
+		idx = g_bmpcache_lru[id];
+	}
+
+	logger(Core, Debug, "cache_evict_bitmap(), id=%d idx=%d n_idx=%d bmp=%p", id, idx,
+	       g_bmpcache[id][idx].next, g_bmpcache[id][idx].bitmap);
 
+	cache_unlink_bitmap(id, idx);
 	ui_destroy_bitmap(g_bmpcache[id][idx].bitmap);
-	--g_bmpcache_count[id];
 	g_bmpcache[id][idx].bitmap = 0;
-
-	g_bmpcache_lru[id] = n_idx;
-	g_bmpcache[id][n_idx].previous = NOT_SET;
+	cache_stats_remove(&g_cache_stats[STATS_BITMAP0 + id], g_bmpcache[id][idx].size);
 
 	pstcache_touch_bitmap(id, idx, 0);
 }
 
+/* Drop the compressed data of a bitmap not decoded yet */
+static void
+cache_drop_pending(uint8 id, uint16 idx)
+{
+	struct bmpcache_entry *entry = &g_bmpcache[id][idx];
+
+	xfree(entry->pending);
+	entry->pending = NULL;
+	g_cache_stats[STATS_BITMAP0 + id].pending--;
+}
+
+/* Decode a bitmap stored by cache_put_compressed_bitmap() and upload
+   it, now that it is drawn for the first time */
+static void
+cache_decode_bitmap(uint8 id, uint16 idx)
+{
+	struct bmpcache_entry *entry = &g_bmpcache[id][idx];
+	uint8 *bmpdata;
+
+	bmpdata = xmalloc(entry->width * entry->height * entry->Bpp);
+	if (bitmap_decompress(bmpdata, entry->width, entry->height, entry->pending,
+			      entry->pending_size, entry->Bpp))
+	{
+		entry->bitmap = ui_create_bitmap(entry->width, entry->height, bmpdata);
+	}
+	else
+	{
+		logger(Graphics, Error, "cache_decode_bitmap(), failed to decompress bitmap data");
+		cache_stats_remove(&g_cache_stats[STATS_BITMAP0 + id], entry->size);
+	}
+	xfree(bmpdata);
+	cache_drop_pending(id, idx);
+}
+
 /* Retrieve a bitmap from the cache */
 RD_HBITMAP
 cache_get_bitmap(uint8 id, uint16 idx)
 {
-	if ((id < NUM_ELEMENTS(g_bmpcache)) && (idx < NUM_ELEMENTS(g_bmpcache[0])))
+	if ((id < NUM_ELEMENTS(g_bmpcache)) && (idx < g_bmpcache_cells[id]))
 	{
-		if (g_bmpcache[id][idx].bitmap || pstcache_load_bitmap(id, idx))
+		if (g_bmpcache[id][idx].pending != NULL)
+			cache_decode_bitmap(id, idx);
+
+		if (g_bmpcache[id][idx].bitmap)
 		{
+			g_cache_stats[STATS_BITMAP0 + id].hits++;
 			if (IS_PERSISTENT(id))
-				cache_bump_bitmap(id, idx, BUMP_COUNT);
+			{
+				cache_touch_bitmap(id, idx);
+				pstcache_mark_drawn(id, idx);
+			}
 
 			return g_bmpcache[id][idx].bitmap;
 		}
+
+		/* loading puts the bitmap at the MRU end */
+		if (pstcache_load_bitmap(id, idx))
+		{
+			g_cache_stats[STATS_BITMAP0 + id].loads++;
+			pstcache_mark_drawn(id, idx);
+			return g_bmpcache[id][idx].bitmap;
+		}
+
+		g_cache_stats[STATS_BITMAP0 + id].misses++;
 	}
 	else if ((id < NUM_ELEMENTS(g_volatile_bc)) && (idx == 0x7fff))
 	{
@@ -216,26 +467,82 @@ cache_get_bitmap(uint8 id, uint16 idx)
 	return NULL;
 }
 
-/* Store a bitmap in the cache */
+RD_BOOL
+cache_has_bitmap(uint8 id, uint16 idx)
+{
+	if ((id < NUM_ELEMENTS(g_bmpcache)) && (idx < g_bmpcache_cells[id]))
+		return g_bmpcache[id][idx].bitmap != NULL || g_bmpcache[id][idx].pending != NULL;
+
+	return False;
+}
+
+/* Store a bitmap read ahead from the persistent cache. It has not been
+   used in this session, so it goes to the least recently used end and
+   never pushes out anything else. Returns False if there is no room. */
+RD_BOOL
+cache_preload_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap, uint32 size)
+{
+	int n_idx;
+
+	if (!IS_PERSISTENT(id) || idx >= g_bmpcache_cells[id])
+		return False;
+
+	if (g_bmpcache[id][idx].bitmap != NULL
+	    || g_bmpcache_count[id] >= (int) g_bmpcache_resident[id])
+		return False;
+
+	n_idx = g_bmpcache_lru[id];
+	g_bmpcache[id][idx].bitmap = bitmap;
+	g_bmpcache[id][idx].size = size;
+	g_bmpcache[id][idx].previous = NOT_SET;
+	g_bmpcache[id][idx].next = n_idx;
+	g_bmpcache[id][idx].referenced = False;
+
+	if (IS_SET(n_idx))
+		g_bmpcache[id][n_idx].previous = idx;
+	else
+		g_bmpcache_mru[id] = idx;
+
+	g_bmpcache_lru[id] = idx;
+	++g_bmpcache_count[id];
+	cache_stats_add(&g_cache_stats[STATS_BITMAP0 + id], size);
+
+	return True;
+}
+
+/* Store a bitmap of size bytes in the cache */
 void
-cache_put_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap)
+cache_put_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap, uint32 size)
 {
 	RD_HBITMAP old;
 
-	if ((id < NUM_ELEMENTS(g_bmpcache)) && (idx < NUM_ELEMENTS(g_bmpcache[0])))
+	if ((id < NUM_ELEMENTS(g_bmpcache)) && (idx < g_bmpcache_cells[id]))
 	{
 		old = g_bmpcache[id][idx].bitmap;
 		if (old != NULL)
+		{
 			ui_destroy_bitmap(old);
+			cache_stats_remove(&g_cache_stats[STATS_BITMAP0 + id],
+					   g_bmpcache[id][idx].size);
+		}
+		else if (g_bmpcache[id][idx].pending != NULL)
+		{
+			cache_drop_pending(id, idx);
+			cache_stats_remove(&g_cache_stats[STATS_BITMAP0 + id],
+					   g_bmpcache[id][idx].size);
+		}
 		g_bmpcache[id][idx].bitmap = bitmap;
+		g_bmpcache[id][idx].size = size;
+		cache_stats_add(&g_cache_stats[STATS_BITMAP0 + id], size);
 
 		if (IS_PERSISTENT(id))
 		{
 			if (old == NULL)
-				g_bmpcache[id][idx].previous = g_bmpcache[id][idx].next = NOT_SET;
+				cache_link_bitmap(id, idx);
+			else
+				cache_touch_bitmap(id, idx);
 
-			cache_bump_bitmap(id, idx, TO_TOP);
-			if (g_bmpcache_count[id] > BMPCACHE2_C2_CELLS)
+			while (g_bmpcache_count[id] > (int) g_bmpcache_resident[id])
 				cache_evict_bitmap(id);
 		}
 	}
@@ -252,6 +559,37 @@ cache_put_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap)
 	}
 }
 
+/* Store a compressed bitmap, to be decoded when it is first drawn.
+   Many bitmaps the server caches are never used in the session, and
+   this saves decoding and uploading them. Returns False if the bitmap
+   has to be stored decoded with cache_put_bitmap() instead: when the
+   cache is persistent, as the list and the disk cache need the
+   bitmap, and for palette bitmaps, which are translated with the
+   colour map current when they arrive. */
+RD_BOOL
+cache_put_compressed_bitmap(uint8 id, uint16 idx, uint8 width, uint8 height, uint8 Bpp,
+			    uint8 * data, uint16 size)
+{
+	struct bmpcache_entry *entry;
+
+	if (id >= NUM_ELEMENTS(g_bmpcache) || idx >= g_bmpcache_cells[id] || IS_PERSISTENT(id)
+	    || Bpp < 2)
+		return False;
+
+	cache_put_bitmap(id, idx, NULL, width * height * Bpp);
+
+	entry = &g_bmpcache[id][idx];
+	entry->pending = xmalloc(size);
+	memcpy(entry->pending, data, size);
+	entry->pending_size = size;
+	entry->width = width;
+	entry->height = height;
+	entry->Bpp = Bpp;
+	g_cache_stats[STATS_BITMAP0 + id].pending++;
+
+	return True;
+}
+
 /* Updates the persistent bitmap cache MRU information on exit */
 void
 cache_save_state(void)
@@ -274,6 +612,57 @@ cache_save_state(void)
 		}
 }
 
+/* Format the statistics of cache number n as a line of name=value
+   pairs. Returns False once n is past the last cache. */
+RD_BOOL
+cache_format_stats(int n, char *buf, size_t size)
+{
+	struct cache_stats *st;
+	const char *policy;
+
+	if (n == STATS_NUM_CACHES)
+		return pstcache_format_stats(buf, size);
+	if (n < 0 || n > STATS_NUM_CACHES)
+		return False;
+
+	st = &g_cache_stats[n];
+	policy = "";
+	if (n <= STATS_BITMAP2)
+		policy = IS_PERSISTENT(n - STATS_BITMAP0) ?
+			g_bmpcache_policy_names[g_bmpcache_policy] : "volatile";
+
+	snprintf(buf, size,
+		 "%s%s%s hits=%u misses=%u loads=%u puts=%u evictions=%u entries=%u pending=%u bytes=%llu",
+		 g_cache_stats_names[n], policy[0] ? " policy=" : "", policy, st->hits,
+		 st->misses, st->loads, st->puts, st->evictions, st->entries, st->pending,
+		 (unsigned long long) st->bytes);
+	return True;
+}
+
+/* Start counting afresh, what the caches hold is left as it is */
+void
+cache_reset_stats(void)
+{
+	int n;
+
+	for (n = 0; n < STATS_NUM_CACHES; n++)
+	{
+		g_cache_stats[n].hits = g_cache_stats[n].misses = g_cache_stats[n].loads = 0;
+		g_cache_stats[n].puts = g_cache_stats[n].evictions = 0;
+	}
+}
+
+/* Log how well the caches did during the session */
+void
+cache_report_stats(void)
+{
+	char buf[256];
+	int n;
+
+	for (n = 0; cache_format_stats(n, buf, sizeof(buf)); n++)
+		logger(Core, Verbose, "Cache statistics: %s", buf);
+}
+
 
 /* FONT CACHE */
 static FONTGLYPH g_fontcache[12][256];
@@ -288,9 +677,13 @@ cache_get_font(uint8 font, uint16 character)
 	{
 		glyph = &g_fontcache[font][character];
 		if (glyph->pixmap != NULL)
+		{
+			g_cache_stats[STATS_GLYPH].hits++;
 			return glyph;
+		}
 	}
 
+	g_cache_stats[STATS_GLYPH].misses++;
 	logger(Core, Debug, "cache_get_font(), font=%d, char=%d", font, character);
 	return NULL;
 }
@@ -306,7 +699,12 @@ cache_put_font(uint8 font, uint16 character, uint16 offset,
 	{
 		glyph = &g_fontcache[font][character];
 		if (glyph->pixmap != NULL)
+		{
 			ui_destroy_glyph(glyph->pixmap);
+			cache_stats_remove(&g_cache_stats[STATS_GLYPH],
+					   (glyph->width + 7) / 8 * glyph->height);
+		}
+		cache_stats_add(&g_cache_stats[STATS_GLYPH], (width + 7) / 8 * height);
 
 		glyph->offset = offset;
 		glyph->baseline = baseline;
@@ -331,6 +729,10 @@ cache_get_text(uint8 cache_id)
 	DATABLOB *text;
 
 	text = &g_textcache[cache_id];
+	if (text->data != NULL)
+		g_cache_stats[STATS_TEXT].hits++;
+	else
+		g_cache_stats[STATS_TEXT].misses++;
 	return text;
 }
 
@@ -342,57 +744,58 @@ cache_put_text(uint8 cache_id, void *data, int length)
 
 	text = &g_textcache[cache_id];
 	if (text->data != NULL)
+	{
 		xfree(text->data);
+		cache_stats_remove(&g_cache_stats[STATS_TEXT], text->size);
+	}
+	cache_stats_add(&g_cache_stats[STATS_TEXT], length);
 	text->data = xmalloc(length);
 	text->size = length;
 	memcpy(text->data, data, length);
 }
 
 
-/* DESKTOP CACHE */
-static uint8 g_deskcache[0x38400 * 4];
+/* OFFSCREEN BITMAP CACHE */
+static RD_HBITMAP g_offscreen[OFFSCREEN_CACHE_ENTRIES];
 
-/* Retrieve desktop data from the cache */
-uint8 *
-cache_get_desktop(uint32 offset, int cx, int cy, int bytes_per_pixel)
+/* Retrieve an offscreen bitmap */
+RD_HBITMAP
+cache_get_offscreen(uint16 idx)
 {
-	int length = cx * cy * bytes_per_pixel;
+	if (idx < NUM_ELEMENTS(g_offscreen) && g_offscreen[idx] != NULL)
+		return g_offscreen[idx];
 
-	if (offset > sizeof(g_deskcache))
-		offset = 0;
+	logger(Core, Debug, "cache_get_offscreen(), idx=%d", idx);
+	return NULL;
+}
 
-	if ((offset + length) <= sizeof(g_deskcache))
+/* Store an offscreen bitmap, or delete it when bitmap is NULL */
+void
+cache_put_offscreen(uint16 idx, RD_HBITMAP bitmap)
+{
+	if (idx >= NUM_ELEMENTS(g_offscreen))
 	{
-		return &g_deskcache[offset];
+		logger(Core, Error, "cache_put_offscreen(), failed, idx=%d", idx);
+		if (bitmap != NULL)
+			ui_destroy_bitmap(bitmap);
+		return;
 	}
 
-	logger(Core, Debug, "cache_get_desktop(), offset=%d, length=%d", offset, length);
-	return NULL;
+	if (g_offscreen[idx] != NULL)
+		ui_destroy_bitmap(g_offscreen[idx]);
+	g_offscreen[idx] = bitmap;
 }
 
-/* Store desktop data in the cache */
+/* Drop all offscreen bitmaps, which do not outlive a deactivation, and
+   draw to the screen again */
 void
-cache_put_desktop(uint32 offset, int cx, int cy, int scanline, int bytes_per_pixel, uint8 * data)
+cache_reset_offscreen(void)
 {
-	int length = cx * cy * bytes_per_pixel;
-
-	if (offset > sizeof(g_deskcache))
-		offset = 0;
+	uint16 idx;
 
-	if ((offset + length) <= sizeof(g_deskcache))
-	{
-		cx *= bytes_per_pixel;
-		while (cy--)
-		{
-			memcpy(&g_deskcache[offset], data, cx);
-			data += scanline;
-			offset += cx;
-		}
-	}
-	else
-	{
-		logger(Core, Error, "cache_put_desktop(), offset=%d, length=%d", offset, length);
-	}
+	ui_switch_surface(NULL);
+	for (idx = 0; idx < NUM_ELEMENTS(g_offscreen); idx++)
+		cache_put_offscreen(idx, NULL);
 }
 
 
@@ -409,9 +812,14 @@ cache_get_cursor(uint16 cache_idx)
 	{
 		cursor = g_cursorcache[cache_idx];
 		if (cursor != NULL)
+		{
+			g_cache_stats[STATS_CURSOR].hits++;
 			return cursor;
+		}
 	}
 
+	g_cache_stats[STATS_CURSOR].misses++;
+
 	logger(Core, Debug, "cache_get_cursor(), idx=%d", cache_idx);
 	return NULL;
 }
@@ -426,7 +834,11 @@ cache_put_cursor(uint16 cache_idx, RD_HCURSOR cursor)
 	{
 		old = g_cursorcache[cache_idx];
 		if (old != NULL)
+		{
 			ui_destroy_cursor(old);
+			cache_stats_remove(&g_cache_stats[STATS_CURSOR], 0);
+		}
+		cache_stats_add(&g_cache_stats[STATS_CURSOR], 0);
 
 		g_cursorcache[cache_idx] = cursor;
 	}
@@ -447,6 +859,10 @@ cache_get_brush_data(uint8 colour_code, uint8 idx)
 	colour_code = colour_code == 1 ? 0 : 1;
 	if (idx < NUM_ELEMENTS(g_brushcache[0]))
 	{
+		if (g_brushcache[colour_code][idx].data != NULL)
+			g_cache_stats[STATS_BRUSH].hits++;
+		else
+			g_cache_stats[STATS_BRUSH].misses++;
 		return &g_brushcache[colour_code][idx];
 	}
 	logger(Core, Debug, "cache_get_brush_data(), colour=%d, idx=%d", colour_code, idx);
@@ -467,8 +883,13 @@ cache_put_brush_data(uint8 colour_code, uint8 idx, BRUSHDATA * brush_data)
 		if (bd->data != 0)
 		{
 			xfree(bd->data);
+			cache_stats_remove(&g_cache_stats[STATS_BRUSH], bd->data_size);
 		}
+		if (bd->pixmap != NULL)
+			ui_destroy_bitmap(bd->pixmap);
+		cache_stats_add(&g_cache_stats[STATS_BRUSH], brush_data->data_size);
 		memcpy(bd, brush_data, sizeof(BRUSHDATA));
+		bd->pixmap = NULL;
 	}
 	else
 	{
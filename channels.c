@@ -19,6 +19,7 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <pthread.h>
 #include "rdesktop.h"
 
 #define MAX_CHANNELS			6
@@ -26,11 +27,54 @@
 #define CHANNEL_FLAG_FIRST		0x01
 #define CHANNEL_FLAG_LAST		0x02
 #define CHANNEL_FLAG_SHOW_PROTOCOL	0x10
+/* the RDP_MPPC_* flags of the chunk, shifted up */
+#define CHANNEL_FLAG_COMPRESSION_SHIFT	16
+/* Queued bytes above which channel_send() waits for the socket */
+#define CHANNEL_QUEUE_LIMIT		(256 * 1024)
 
 extern RDP_VERSION g_rdp_version;
 extern RD_BOOL g_encryption;
+extern RD_BOOL g_network_error;
 
 uint32 vc_chunk_size = CHANNEL_CHUNK_LENGTH;
+RD_BOOL g_vc_compress = False;
+
+/* Output of mppc_compress() for the chunk being sent */
+static uint8 *g_vc_compress_buffer = NULL;
+static uint32 g_vc_compress_size = 0;
+
+/* Message being sent by channel_send_begin() and channel_send_part() */
+static VCHANNEL *g_send_channel;
+static uint32 g_send_length, g_send_offset;
+static uint8 *g_send_buffer = NULL;
+static uint32 g_send_buffer_size = 0, g_send_fill = 0;
+
+/* Chunks are not written to the socket by channel_send(), but queued
+   per channel. channel_flush() takes one chunk from each channel in
+   turn for as long as the socket can take more without blocking, so a
+   large clipboard or file transfer neither starves the other channels
+   nor holds up input and other PDUs, which are sent directly. Chunks
+   are compressed and encrypted as they leave, which keeps the MPPC
+   history and the RC4 stream in wire order. */
+typedef struct channel_chunk
+{
+	struct channel_chunk *next;
+	uint32 length;		/* of the whole message */
+	uint32 flags;		/* CHANNEL_FLAG_* other than compression */
+	uint32 size;
+	uint8 *data;
+}
+CHANNEL_CHUNK;
+
+static CHANNEL_CHUNK *g_send_queue[MAX_CHANNELS];
+static CHANNEL_CHUNK **g_send_queue_tail[MAX_CHANNELS];
+/* bytes queued, counting the chunk headers */
+static uint32 g_send_queued = 0;
+static unsigned int g_send_next = 0;
+
+/* Smartcard replies are sent from worker threads; those cannot count
+   on the main loop to finish what they queue */
+static pthread_t g_channel_thread;
 
 VCHANNEL g_channels[MAX_CHANNELS];
 unsigned int g_num_channels;
@@ -60,11 +104,16 @@ channel_register(char *name, uint32 flags, void (*callback) (STREAM))
 		return NULL;
 	}
 
+	if (g_num_channels == 0)
+		g_channel_thread = pthread_self();
+
 	channel = &g_channels[g_num_channels];
 	channel->mcs_id = MCS_GLOBAL_CHANNEL + 1 + g_num_channels;
 	strncpy(channel->name, name, 8);
 	channel->flags = flags;
 	channel->process = callback;
+	g_send_queue[g_num_channels] = NULL;
+	g_send_queue_tail[g_num_channels] = &g_send_queue[g_num_channels];
 	g_num_channels++;
 	return channel;
 }
@@ -80,86 +129,147 @@ channel_init(VCHANNEL * channel, uint32 length)
 	return s;
 }
 
-static void
-channel_send_chunk(STREAM s, VCHANNEL * channel, uint32 length)
+/* Compresses a chunk into g_vc_compress_buffer if the channel allows
+   it, returning the RDP_MPPC_* flags */
+static uint8
+channel_compress_chunk(VCHANNEL * channel, uint8 * data, uint32 length, uint32 * clength)
 {
-	uint32 flags;
-	uint32 thislength;
-	RD_BOOL inplace;
-	STREAM chunk;
+	if (!g_vc_compress || !(channel->flags & CHANNEL_OPTION_COMPRESS_RDP))
+		return 0;
 
-	/* Note: In the original clipboard implementation, this number was
-	   1592, not 1600. However, I don't remember the reason and 1600 seems
-	   to work so.. This applies only to *this* length, not the length of
-	   continuation or ending packets. */
+	if (length > g_vc_compress_size)
+	{
+		g_vc_compress_size = length;
+		g_vc_compress_buffer = xrealloc(g_vc_compress_buffer, length);
+	}
+	return mppc_compress(data, length, g_vc_compress_buffer, clength);
+}
 
-	/* Actually, CHANNEL_CHUNK_LENGTH (default value is 1600 bytes) is described
-	   in MS-RDPBCGR (s. 2.2.6, s.3.1.5.2.1) and can be set by server only
-	   in the optional field VCChunkSize of VC Caps) */
+/* Sends the oldest queued chunk of the channel with index i. Must be
+   called with SCARD_LOCK_CHANNEL held. */
+static void
+channel_send_chunk(unsigned int i)
+{
+	VCHANNEL *channel = &g_channels[i];
+	CHANNEL_CHUNK *c = g_send_queue[i];
+	uint32 flags, clength;
+	uint8 ctype;
+	STREAM s;
 
-	thislength = MIN(s_remaining(s), vc_chunk_size);
+	g_send_queue[i] = c->next;
+	if (g_send_queue[i] == NULL)
+		g_send_queue_tail[i] = &g_send_queue[i];
+	g_send_queued -= c->size + 8;
 
-	flags = 0;
-	if (length == s_remaining(s))
-	{
-		flags |= CHANNEL_FLAG_FIRST;
-	}
-	if (s_remaining(s) == thislength)
-	{
-		flags |= CHANNEL_FLAG_LAST;
-	}
-	if (channel->flags & CHANNEL_OPTION_SHOW_PROTOCOL)
-	{
-		flags |= CHANNEL_FLAG_SHOW_PROTOCOL;
-	}
+	ctype = channel_compress_chunk(channel, c->data, c->size, &clength);
+	flags = c->flags | (uint32) ctype << CHANNEL_FLAG_COMPRESSION_SHIFT;
 
 	logger(Protocol, Debug, "channel_send_chunk(), sending %d bytes with flags 0x%x",
-	       thislength, flags);
-
-	/* first fragment sent in-place */
-	inplace = False;
-	if ((flags & (CHANNEL_FLAG_FIRST|CHANNEL_FLAG_LAST)) ==
-	    (CHANNEL_FLAG_FIRST|CHANNEL_FLAG_LAST))
-	{
-		inplace = True;
-	}
+	       c->size, flags);
 
-	if (inplace)
+	s = sec_init(g_encryption ? SEC_ENCRYPT : 0, c->size + 8);
+	out_uint32_le(s, c->length);
+	out_uint32_le(s, flags);
+	if (ctype & RDP_MPPC_COMPRESSED)
 	{
-		s_pop_layer(s, channel_hdr);
-		chunk = s;
+		out_uint8a(s, g_vc_compress_buffer, clength);
 	}
 	else
 	{
-		chunk = sec_init(g_encryption ? SEC_ENCRYPT : 0, thislength + 8);
+		out_uint8a(s, c->data, c->size);
 	}
+	s_mark_end(s);
+	sec_send_to_channel(s, g_encryption ? SEC_ENCRYPT : 0, channel->mcs_id);
+	s_free(s);
 
-	out_uint32_le(chunk, length);
-	out_uint32_le(chunk, flags);
-	if (!inplace)
+	xfree(c);
+}
+
+/* Sends one queued chunk, from the channel whose turn it is */
+static void
+channel_send_next(void)
+{
+	unsigned int i, n;
+
+	for (n = 0; n < g_num_channels; n++)
 	{
-		out_uint8stream(chunk, s, thislength);
-		s_mark_end(chunk);
+		i = (g_send_next + n) % g_num_channels;
+		if (g_send_queue[i] == NULL)
+			continue;
+
+		channel_send_chunk(i);
+		g_send_next = (i + 1) % g_num_channels;
+		return;
 	}
-	sec_send_to_channel(chunk, g_encryption ? SEC_ENCRYPT : 0, channel->mcs_id);
+}
+
+/* Sends queued chunks while the socket takes them without blocking,
+   a round of one chunk per channel at a time. Must be called with
+   SCARD_LOCK_CHANNEL held. */
+static void
+channel_flush_locked(void)
+{
+	unsigned int n;
 
-	/* Sending modifies the current offset, so make it is marked as
-	   fully completed. */
-	if (inplace)
+	while (g_send_queued > 0 && tcp_can_send(0))
 	{
-		in_uint8s(s, s_remaining(s));
+		tcp_cork();
+		for (n = 0; n < g_num_channels && g_send_queued > 0; n++)
+			channel_send_next();
+		tcp_uncork();
 	}
 
-	if (!inplace)
+	/* have the main loop wake up for the rest */
+	tcp_want_send(g_send_queued > 0);
+}
+
+/* Appends a chunk of a message to the queue of a channel */
+static void
+channel_queue_chunk(VCHANNEL * channel, uint8 * data, uint32 size, uint32 length,
+		    uint32 flags)
+{
+	unsigned int i = channel - g_channels;
+	CHANNEL_CHUNK *c;
+
+	if (channel->flags & CHANNEL_OPTION_SHOW_PROTOCOL)
+		flags |= CHANNEL_FLAG_SHOW_PROTOCOL;
+
+	c = xmalloc(sizeof(CHANNEL_CHUNK) + size);
+	c->next = NULL;
+	c->length = length;
+	c->flags = flags;
+	c->size = size;
+	c->data = (uint8 *) (c + 1);
+	memcpy(c->data, data, size);
+
+	*g_send_queue_tail[i] = c;
+	g_send_queue_tail[i] = &c->next;
+	g_send_queued += size + 8;
+
+	/* too much is waiting already, so block like a plain send would */
+	while (g_send_queued > CHANNEL_QUEUE_LIMIT && g_network_error == False)
+		channel_send_next();
+}
+
+/* Sends what the socket will take of the queued chunks, and leaves
+   the rest for the main loop */
+static void
+channel_send_queued(void)
+{
+	if (pthread_equal(pthread_self(), g_channel_thread))
 	{
-		s_free(chunk);
+		channel_flush_locked();
+		return;
 	}
+
+	while (g_send_queued > 0 && g_network_error == False)
+		channel_send_next();
 }
 
 void
 channel_send(STREAM s, VCHANNEL * channel)
 {
-	uint32 length;
+	uint32 length, thislength, flags;
 
 #ifdef WITH_SCARD
 	scard_lock(SCARD_LOCK_CHANNEL);
@@ -172,16 +282,159 @@ channel_send(STREAM s, VCHANNEL * channel)
 	logger(Protocol, Debug, "channel_send(), channel = %d, length = %d", channel->mcs_id,
 	       length);
 
-	while (!s_check_end(s))
+	/* Note: In the original clipboard implementation, this number was
+	   1592, not 1600. However, I don't remember the reason and 1600 seems
+	   to work so.. This applies only to *this* length, not the length of
+	   continuation or ending packets. */
+
+	/* Actually, CHANNEL_CHUNK_LENGTH (default value is 1600 bytes) is described
+	   in MS-RDPBCGR (s. 2.2.6, s.3.1.5.2.1) and can be set by server only
+	   in the optional field VCChunkSize of VC Caps) */
+
+	/* an empty message is still sent, as a single empty chunk */
+	flags = CHANNEL_FLAG_FIRST;
+	do
 	{
-		channel_send_chunk(s, channel, length);
+		thislength = MIN(s_remaining(s), vc_chunk_size);
+		if (s_remaining(s) == thislength)
+			flags |= CHANNEL_FLAG_LAST;
+		channel_queue_chunk(channel, s->p, thislength, length, flags);
+		in_uint8s(s, thislength);
+		flags = 0;
 	}
+	while (!s_check_end(s));
+
+	channel_send_queued();
 
 #ifdef WITH_SCARD
 	scard_unlock(SCARD_LOCK_CHANNEL);
 #endif
 }
 
+/* Queues the chunk collected by channel_send_part() */
+static void
+channel_send_flush(void)
+{
+	uint32 flags;
+
+	flags = 0;
+	if (g_send_offset == 0)
+		flags |= CHANNEL_FLAG_FIRST;
+	g_send_offset += g_send_fill;
+	if (g_send_offset >= g_send_length)
+		flags |= CHANNEL_FLAG_LAST;
+
+	channel_queue_chunk(g_send_channel, g_send_buffer, g_send_fill, g_send_length, flags);
+
+	g_send_fill = 0;
+}
+
+/* Starts sending a message of length bytes, which is then given a
+   piece at a time to channel_send_part() and finished with
+   channel_send_end(). Only one chunk of it is held at a time, so the
+   message never has to be built in a single STREAM. */
+void
+channel_send_begin(VCHANNEL * channel, uint32 length)
+{
+#ifdef WITH_SCARD
+	scard_lock(SCARD_LOCK_CHANNEL);
+#endif
+
+	logger(Protocol, Debug, "channel_send_begin(), channel = %d, length = %d",
+	       channel->mcs_id, length);
+
+	if (g_send_buffer_size < vc_chunk_size)
+	{
+		g_send_buffer_size = vc_chunk_size;
+		g_send_buffer = xrealloc(g_send_buffer, g_send_buffer_size);
+	}
+
+	g_send_channel = channel;
+	g_send_length = length;
+	g_send_offset = 0;
+	g_send_fill = 0;
+}
+
+void
+channel_send_part(uint8 * data, uint32 length)
+{
+	uint32 n;
+
+	while (length > 0)
+	{
+		n = MIN(length, vc_chunk_size - g_send_fill);
+		memcpy(g_send_buffer + g_send_fill, data, n);
+		g_send_fill += n;
+		data += n;
+		length -= n;
+
+		if (g_send_fill == vc_chunk_size)
+			channel_send_flush();
+	}
+}
+
+void
+channel_send_end(void)
+{
+	/* an empty message is still sent, as a single empty chunk */
+	if (g_send_fill > 0 || g_send_offset == 0)
+		channel_send_flush();
+
+	if (g_send_offset != g_send_length)
+		logger(Protocol, Warning,
+		       "channel_send_end(), sent %d bytes of a %d byte message",
+		       g_send_offset, g_send_length);
+
+	channel_send_queued();
+
+#ifdef WITH_SCARD
+	scard_unlock(SCARD_LOCK_CHANNEL);
+#endif
+}
+
+/* Called from the main loop to send more of the queued chunks */
+void
+channel_flush(void)
+{
+	if (g_send_queued == 0)
+		return;
+
+#ifdef WITH_SCARD
+	scard_lock(SCARD_LOCK_CHANNEL);
+#endif
+	channel_flush_locked();
+#ifdef WITH_SCARD
+	scard_unlock(SCARD_LOCK_CHANNEL);
+#endif
+}
+
+/* Drops whatever is still queued for the previous connection */
+void
+channel_reset_state(void)
+{
+	CHANNEL_CHUNK *c;
+	unsigned int i;
+
+#ifdef WITH_SCARD
+	scard_lock(SCARD_LOCK_CHANNEL);
+#endif
+	for (i = 0; i < g_num_channels; i++)
+	{
+		while ((c = g_send_queue[i]) != NULL)
+		{
+			g_send_queue[i] = c->next;
+			xfree(c);
+		}
+		g_send_queue_tail[i] = &g_send_queue[i];
+	}
+	g_send_queued = 0;
+	g_send_next = 0;
+	tcp_want_send(False);
+#ifdef WITH_SCARD
+	scard_unlock(SCARD_LOCK_CHANNEL);
+#endif
+}
+
 void
 channel_process(STREAM s, uint16 mcs_channel)
 {
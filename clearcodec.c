@@ -0,0 +1,456 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Graphics pipeline ClearCodec decoder
+   Copyright 2026 the rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* ClearCodec (MS-RDPEGFX 2.2.4.1) is the lossless codec the server
+   uses for text and user interface elements. An image is made of up
+   to three layers drawn on top of each other: a run length coded
+   residual, bands of vertical bars that are cached between images,
+   and rectangles coded with one of three subcodecs. Small images can
+   be kept in a glyph cache and repeated by index. */
+
+#include "rdesktop.h"
+
+#define CLEARCODEC_FLAG_GLYPH_INDEX	0x01
+#define CLEARCODEC_FLAG_GLYPH_HIT	0x02
+#define CLEARCODEC_FLAG_CACHE_RESET	0x04
+
+#define CLEARCODEC_SUBCODEC_UNCOMPRESSED	0
+#define CLEARCODEC_SUBCODEC_NSCODEC		1
+#define CLEARCODEC_SUBCODEC_RLEX		2
+
+#define CLEARCODEC_GLYPH_CACHE_SIZE	4000
+#define CLEARCODEC_GLYPH_MAX_PIXELS	1024
+#define CLEARCODEC_VBAR_CACHE_SIZE	32768
+#define CLEARCODEC_SHORT_VBAR_CACHE_SIZE	16384
+#define CLEARCODEC_VBAR_MAX_HEIGHT	52
+
+#define PIXEL(b, g, r)	((uint32) (b) | ((uint32) (g) << 8) | ((uint32) (r) << 16) | 0xff000000)
+
+typedef struct
+{
+	uint16 count;
+	uint32 pixels[CLEARCODEC_VBAR_MAX_HEIGHT];
+}
+CLEAR_VBAR;
+
+typedef struct
+{
+	uint16 width, height;
+	uint32 *pixels;
+}
+CLEAR_GLYPH;
+
+static CLEAR_VBAR *clear_vbars;
+static CLEAR_VBAR *clear_short_vbars;
+static uint32 clear_vbar_cursor;
+static uint32 clear_short_vbar_cursor;
+static CLEAR_GLYPH clear_glyphs[CLEARCODEC_GLYPH_CACHE_SIZE];
+
+static void
+clear_put_pixel(uint8 * dst, int stride, int x, int y, uint32 pixel)
+{
+	uint8 *p = dst + y * stride + x * 4;
+
+	p[0] = pixel;
+	p[1] = pixel >> 8;
+	p[2] = pixel >> 16;
+	p[3] = pixel >> 24;
+}
+
+static RD_BOOL
+clear_in_run_length(STREAM s, uint32 * run)
+{
+	uint8 factor1;
+	uint16 factor2;
+
+	if (!s_check_rem(s, 1))
+		return False;
+	in_uint8(s, factor1);
+	*run = factor1;
+	if (factor1 < 0xff)
+		return True;
+
+	if (!s_check_rem(s, 2))
+		return False;
+	in_uint16_le(s, factor2);
+	*run = factor2;
+	if (factor2 < 0xffff)
+		return True;
+
+	if (!s_check_rem(s, 4))
+		return False;
+	in_uint32_le(s, *run);
+	return True;
+}
+
+/* The residual layer covers the whole image with runs of one colour */
+static RD_BOOL
+clear_decode_residual(STREAM s, int width, int height, uint8 * dst, int stride)
+{
+	uint8 b, g, r;
+	uint32 run, pixel, i, total;
+	uint32 n = 0;
+
+	total = width * height;
+	while (s_remaining(s) > 0)
+	{
+		if (!s_check_rem(s, 3))
+			return False;
+		in_uint8(s, b);
+		in_uint8(s, g);
+		in_uint8(s, r);
+		if (!clear_in_run_length(s, &run))
+			return False;
+		if (run > total - n)
+			return False;
+
+		pixel = PIXEL(b, g, r);
+		for (i = 0; i < run; i++, n++)
+			clear_put_pixel(dst, stride, n % width, n / width, pixel);
+	}
+
+	return (n == total);
+}
+
+static RD_BOOL
+clear_decode_bands(STREAM s, int width, int height, uint8 * dst, int stride)
+{
+	uint16 xstart, xend, ystart, yend, header, index;
+	uint8 b, g, r, yon, yoff;
+	uint32 background;
+	CLEAR_VBAR *vbar, *short_vbar;
+	int x, y, vbar_height, count;
+
+	while (s_remaining(s) > 0)
+	{
+		if (!s_check_rem(s, 11))
+			return False;
+		in_uint16_le(s, xstart);
+		in_uint16_le(s, xend);
+		in_uint16_le(s, ystart);
+		in_uint16_le(s, yend);
+		in_uint8(s, b);
+		in_uint8(s, g);
+		in_uint8(s, r);
+		background = PIXEL(b, g, r);
+
+		if (xend < xstart || yend < ystart)
+			return False;
+		vbar_height = yend - ystart + 1;
+		if (vbar_height > CLEARCODEC_VBAR_MAX_HEIGHT)
+			return False;
+
+		for (x = xstart; x <= xend; x++)
+		{
+			if (!s_check_rem(s, 2))
+				return False;
+			in_uint16_le(s, header);
+
+			short_vbar = NULL;
+			yon = 0;
+			if ((header & 0xc000) == 0x4000)
+			{
+				/* SHORT_VBAR_CACHE_HIT */
+				index = header & 0x3fff;
+				if (!s_check_rem(s, 1))
+					return False;
+				in_uint8(s, yon);
+				short_vbar = &clear_short_vbars[index];
+			}
+			else if ((header & 0xc000) == 0x0000)
+			{
+				/* SHORT_VBAR_CACHE_MISS */
+				yon = header & 0xff;
+				yoff = (header >> 8) & 0x3f;
+				if (yoff < yon || yoff - yon > CLEARCODEC_VBAR_MAX_HEIGHT)
+					return False;
+				count = yoff - yon;
+				if (!s_check_rem(s, count * 3))
+					return False;
+
+				short_vbar = &clear_short_vbars[clear_short_vbar_cursor];
+				short_vbar->count = count;
+				for (y = 0; y < count; y++)
+				{
+					in_uint8(s, b);
+					in_uint8(s, g);
+					in_uint8(s, r);
+					short_vbar->pixels[y] = PIXEL(b, g, r);
+				}
+				clear_short_vbar_cursor =
+					(clear_short_vbar_cursor + 1) % CLEARCODEC_SHORT_VBAR_CACHE_SIZE;
+			}
+
+			if (short_vbar != NULL)
+			{
+				/* the short bar on the band background makes a new bar */
+				if (yon + short_vbar->count > vbar_height)
+					return False;
+				vbar = &clear_vbars[clear_vbar_cursor];
+				vbar->count = vbar_height;
+				for (y = 0; y < vbar_height; y++)
+				{
+					if (y >= yon && y < yon + short_vbar->count)
+						vbar->pixels[y] = short_vbar->pixels[y - yon];
+					else
+						vbar->pixels[y] = background;
+				}
+				clear_vbar_cursor = (clear_vbar_cursor + 1) % CLEARCODEC_VBAR_CACHE_SIZE;
+			}
+			else
+			{
+				/* VBAR_CACHE_HIT */
+				vbar = &clear_vbars[header & 0x7fff];
+			}
+
+			if (x >= width)
+				continue;
+			count = MIN(vbar->count, vbar_height);
+			for (y = 0; y < count && ystart + y < height; y++)
+				clear_put_pixel(dst, stride, x, ystart + y, vbar->pixels[y]);
+		}
+	}
+
+	return True;
+}
+
+static RD_BOOL
+clear_decode_rlex(STREAM s, int width, int height, uint8 * dst, int stride)
+{
+	uint32 palette[128];
+	uint8 count, b, g, r, code;
+	uint8 stop, depth, start;
+	uint32 run, i, n, total;
+	int bits;
+
+	if (!s_check_rem(s, 1))
+		return False;
+	in_uint8(s, count);
+	if (count == 0 || count > 127 || !s_check_rem(s, count * 3))
+		return False;
+	for (i = 0; i < count; i++)
+	{
+		in_uint8(s, b);
+		in_uint8(s, g);
+		in_uint8(s, r);
+		palette[i] = PIXEL(b, g, r);
+	}
+
+	bits = 1;
+	while ((1 << bits) < count)
+		bits++;
+
+	n = 0;
+	total = width * height;
+	while (s_remaining(s) > 0)
+	{
+		in_uint8(s, code);
+		stop = code & ((1 << bits) - 1);
+		depth = code >> bits;
+		if (depth > stop || stop >= count)
+			return False;
+		start = stop - depth;
+		if (!clear_in_run_length(s, &run))
+			return False;
+		if (run > total - n || depth + 1u > total - n - run)
+			return False;
+
+		for (i = 0; i < run; i++, n++)
+			clear_put_pixel(dst, stride, n % width, n / width, palette[start]);
+		for (i = start; i <= stop; i++, n++)
+			clear_put_pixel(dst, stride, n % width, n / width, palette[i]);
+	}
+
+	return (n == total);
+}
+
+static RD_BOOL
+clear_decode_subcodecs(STREAM s, int width, int height, uint8 * dst, int stride)
+{
+	uint16 x, y, cx, cy;
+	uint32 size, i, n;
+	uint8 id, b, g, r, *data;
+	struct stream packet;
+	uint8 *rect;
+
+	while (s_remaining(s) > 0)
+	{
+		if (!s_check_rem(s, 13))
+			return False;
+		in_uint16_le(s, x);
+		in_uint16_le(s, y);
+		in_uint16_le(s, cx);
+		in_uint16_le(s, cy);
+		in_uint32_le(s, size);
+		in_uint8(s, id);
+		if (!s_check_rem(s, size))
+			return False;
+		in_uint8p(s, data, size);
+
+		if (x + cx > width || y + cy > height)
+			return False;
+		rect = dst + y * stride + x * 4;
+
+		switch (id)
+		{
+			case CLEARCODEC_SUBCODEC_UNCOMPRESSED:
+				if (size != (uint32) cx * cy * 3)
+					return False;
+				for (i = 0, n = 0; n < (uint32) cx * cy; n++)
+				{
+					b = data[i++];
+					g = data[i++];
+					r = data[i++];
+					clear_put_pixel(rect, stride, n % cx, n / cx, PIXEL(b, g, r));
+				}
+				break;
+
+			case CLEARCODEC_SUBCODEC_NSCODEC:
+				if (!nsc_decode(data, size, cx, cy, rect, stride))
+					return False;
+				break;
+
+			case CLEARCODEC_SUBCODEC_RLEX:
+				memset(&packet, 0, sizeof(packet));
+				packet.data = packet.p = data;
+				packet.end = data + size;
+				if (!clear_decode_rlex(&packet, cx, cy, rect, stride))
+					return False;
+				break;
+
+			default:
+				logger(Graphics, Warning,
+				       "clear_decode_subcodecs(), unknown subcodec %d", id);
+				return False;
+		}
+	}
+
+	return True;
+}
+
+/* Decode a ClearCodec image of width x height pixels in to dst, which
+   is 32 bpp with stride bytes to a scanline */
+RD_BOOL
+clear_decompress(uint8 * data, uint32 size, int width, int height, uint8 * dst, int stride)
+{
+	struct stream packet, layer;
+	STREAM s = &packet;
+	uint8 flags;
+	uint16 glyph_index = 0;
+	uint32 lengths[3];
+	CLEAR_GLYPH *glyph;
+	int i, y;
+
+	if (clear_vbars == NULL)
+	{
+		clear_vbars = xmalloc(sizeof(CLEAR_VBAR) * CLEARCODEC_VBAR_CACHE_SIZE);
+		clear_short_vbars = xmalloc(sizeof(CLEAR_VBAR) * CLEARCODEC_SHORT_VBAR_CACHE_SIZE);
+		memset(clear_vbars, 0, sizeof(CLEAR_VBAR) * CLEARCODEC_VBAR_CACHE_SIZE);
+		memset(clear_short_vbars, 0, sizeof(CLEAR_VBAR) * CLEARCODEC_SHORT_VBAR_CACHE_SIZE);
+	}
+
+	memset(s, 0, sizeof(*s));
+	s->data = s->p = data;
+	s->end = data + size;
+
+	if (!s_check_rem(s, 2))
+		return False;
+	in_uint8(s, flags);
+	in_uint8s(s, 1);	/* seqNumber */
+
+	if (flags & CLEARCODEC_FLAG_CACHE_RESET)
+	{
+		clear_vbar_cursor = 0;
+		clear_short_vbar_cursor = 0;
+	}
+
+	if (flags & CLEARCODEC_FLAG_GLYPH_INDEX)
+	{
+		if (!s_check_rem(s, 2))
+			return False;
+		in_uint16_le(s, glyph_index);
+		if (glyph_index >= CLEARCODEC_GLYPH_CACHE_SIZE
+		    || width * height > CLEARCODEC_GLYPH_MAX_PIXELS)
+			return False;
+	}
+
+	if (flags & CLEARCODEC_FLAG_GLYPH_HIT)
+	{
+		glyph = &clear_glyphs[glyph_index];
+		if (!(flags & CLEARCODEC_FLAG_GLYPH_INDEX) || glyph->pixels == NULL
+		    || glyph->width != width || glyph->height != height)
+			return False;
+		for (y = 0; y < height; y++)
+			memcpy(dst + y * stride, glyph->pixels + y * width, width * 4);
+		return True;
+	}
+
+	if (!s_check_rem(s, 12))
+		return False;
+	for (i = 0; i < 3; i++)
+		in_uint32_le(s, lengths[i]);
+
+	for (i = 0; i < 3; i++)
+	{
+		if (!s_check_rem(s, lengths[i]))
+			return False;
+		if (lengths[i] == 0)
+			continue;
+
+		memset(&layer, 0, sizeof(layer));
+		in_uint8p(s, layer.data, lengths[i]);
+		layer.p = layer.data;
+		layer.end = layer.data + lengths[i];
+
+		if ((i == 0 && !clear_decode_residual(&layer, width, height, dst, stride))
+		    || (i == 1 && !clear_decode_bands(&layer, width, height, dst, stride))
+		    || (i == 2 && !clear_decode_subcodecs(&layer, width, height, dst, stride)))
+		{
+			logger(Graphics, Warning, "clear_decompress(), corrupt layer %d", i);
+			return False;
+		}
+	}
+
+	if (flags & CLEARCODEC_FLAG_GLYPH_INDEX)
+	{
+		glyph = &clear_glyphs[glyph_index];
+		glyph->pixels = xrealloc(glyph->pixels, width * height * 4);
+		glyph->width = width;
+		glyph->height = height;
+		for (y = 0; y < height; y++)
+			memcpy(glyph->pixels + y * width, dst + y * stride, width * 4);
+	}
+
+	return True;
+}
+
+/* Forget the caches when the graphics pipeline is reset */
+void
+clear_reset(void)
+{
+	int i;
+
+	for (i = 0; i < CLEARCODEC_GLYPH_CACHE_SIZE; i++)
+	{
+		xfree(clear_glyphs[i].pixels);
+		clear_glyphs[i].pixels = NULL;
+	}
+	clear_vbar_cursor = 0;
+	clear_short_vbar_cursor = 0;
+}
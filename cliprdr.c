@@ -113,6 +113,42 @@ cliprdr_send_data(uint8 * data, uint32 length)
 	cliprdr_send_packet(CLIPRDR_DATA_RESPONSE, CLIPRDR_RESPONSE, data, length);
 }
 
+/* Starts a data response of length bytes, which is given a piece at a
+   time to cliprdr_send_data_part() and finished with
+   cliprdr_send_data_end(), so large clipboard contents are sent without
+   copying all of them into one packet. */
+void
+cliprdr_send_data_begin(uint32 length)
+{
+	STREAM s;
+
+	logger(Clipboard, Debug, "cliprdr_send_data_begin(), length %d bytes", length);
+
+	channel_send_begin(cliprdr_channel, length + 12);
+
+	s = s_alloc(8);
+	out_uint16_le(s, CLIPRDR_DATA_RESPONSE);
+	out_uint16_le(s, CLIPRDR_RESPONSE);
+	out_uint32_le(s, length);
+	channel_send_part(s->data, 8);
+	s_free(s);
+}
+
+void
+cliprdr_send_data_part(uint8 * data, uint32 length)
+{
+	channel_send_part(data, length);
+}
+
+void
+cliprdr_send_data_end(void)
+{
+	uint8 pad[4] = { 0, 0, 0, 0 };
+
+	channel_send_part(pad, sizeof(pad));
+	channel_send_end();
+}
+
 static void
 cliprdr_process(STREAM s)
 {
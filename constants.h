@@ -38,6 +38,22 @@
 #define FASTPATH_OUTPUT_SECURE_CHECKSUM 0x1
 #define FASTPATH_OUTPUT_ENCRYPTED       0x2
 
+/* [MS-RDPBCGR] 2.2.8.1.2 */
+#define FASTPATH_INPUT_ACTION_FASTPATH	0x0
+#define FASTPATH_INPUT_SECURE_CHECKSUM	0x1
+#define FASTPATH_INPUT_ENCRYPTED	0x2
+
+/* [MS-RDPBCGR] 2.2.8.1.2.2 */
+#define FASTPATH_INPUT_EVENT_SCANCODE	0x0
+#define FASTPATH_INPUT_EVENT_MOUSE	0x1
+#define FASTPATH_INPUT_EVENT_MOUSEX	0x2
+#define FASTPATH_INPUT_EVENT_SYNC	0x3
+#define FASTPATH_INPUT_EVENT_UNICODE	0x4
+
+#define FASTPATH_INPUT_KBDFLAGS_RELEASE		0x01
+#define FASTPATH_INPUT_KBDFLAGS_EXTENDED	0x02
+#define FASTPATH_INPUT_KBDFLAGS_EXTENDED1	0x04
+
 /* [MS-RDPBCGR] 2.2.9.1.2.1 */
 /* adjusted for position in updateHeader */
 #define FASTPATH_UPDATETYPE_ORDERS		0x0
@@ -164,17 +180,54 @@ enum MCS_DPU_REASON
 #define SEC_TAG_SRV_INFO	0x0c01
 #define SEC_TAG_SRV_CRYPT	0x0c02
 #define SEC_TAG_SRV_CHANNELS	0x0c03
+#define SEC_TAG_SRV_MSGCHANNEL	0x0c04
+#define SEC_TAG_SRV_MULTITRANSPORT	0x0c08
 
 #define CS_CORE			0xc001
 #define CS_SECURITY		0xc002
 #define CS_NET			0xc003
 #define CS_CLUSTER		0xc004
+#define CS_MONITOR		0xc005
+#define CS_MCS_MSGCHANNEL	0xc006
+
+/* TS_UD_CS_MONITOR */
+#define TS_MONITOR_PRIMARY	0x00000001
+#define RDP_MAX_MONITORS	16
 
 #define SEC_TAG_PUBKEY		0x0006
 #define SEC_TAG_KEYSIG		0x0008
 
 #define SEC_RSA_MAGIC		0x31415352	/* RSA1 */
 
+/* Initiate Multitransport Request, [MS-RDPBCGR] 2.2.15.1 */
+#define TRANSPORTTYPE_UDPFECR		0x01
+#define TRANSPORTTYPE_UDPFECL		0x04
+#define TRANSPORTTYPE_UDP_PREFERRED	0x100
+#define SOFTSYNC_TCP_TO_UDP		0x200
+#define MULTITRANSPORT_E_ABORT		0x80004004
+
+/* Auto-detect PDUs, [MS-RDPBCGR] 2.2.14 */
+#define TYPE_ID_AUTODETECT_REQUEST		0x00
+#define TYPE_ID_AUTODETECT_RESPONSE		0x01
+#define RDP_RTT_REQUEST_TYPE_CONTINUOUS		0x0001
+#define RDP_RTT_REQUEST_TYPE_CONNECTTIME	0x1001
+#define RDP_BW_START_REQUEST_TYPE_CONTINUOUS	0x0014
+#define RDP_BW_START_REQUEST_TYPE_TUNNEL	0x0114
+#define RDP_BW_START_REQUEST_TYPE_CONNECTTIME	0x1014
+#define RDP_BW_PAYLOAD_REQUEST_TYPE		0x0002
+#define RDP_BW_STOP_REQUEST_TYPE_CONNECTTIME	0x002b
+#define RDP_BW_STOP_REQUEST_TYPE_CONTINUOUS	0x0429
+#define RDP_BW_STOP_REQUEST_TYPE_TUNNEL		0x0629
+#define RDP_NETCHAR_RESULTS_BASE_RTT		0x0840
+#define RDP_NETCHAR_RESULTS_BANDWIDTH		0x0880
+#define RDP_NETCHAR_RESULTS_ALL			0x08c0
+#define RDP_RTT_RESPONSE_TYPE			0x0000
+#define RDP_BW_RESULTS_RESPONSE_TYPE_CONNECTTIME	0x0003
+#define RDP_BW_RESULTS_RESPONSE_TYPE_CONTINUOUS	0x000b
+
+/* TS_UD_CS_CORE.connectionType */
+#define CONNECTION_TYPE_AUTODETECT	0x07
+
 /* Client cluster constants */
 #define SEC_CC_REDIRECTION_SUPPORTED          0x00000001
 #define SEC_CC_REDIRECT_SESSIONID_FIELD_VALID 0x00000002
@@ -221,6 +274,7 @@ enum RDP_DATA_PDU_TYPE
 	RDP_DATA_PDU_POINTER = 0x1b,	/* PDUTYPE2_POINTER */
 	RDP_DATA_PDU_INPUT = 0x1c,	/* PDUTYPE2_INPUT */
 	RDP_DATA_PDU_SYNCHRONISE = 0x1f,	/* PDUTYPE2_SYNCHRONIZE */
+	RDP_DATA_PDU_REFRESH_RECT = 0x21,	/* PDUTYPE2_REFRESH_RECT */
 	RDP_DATA_PDU_BELL = 0x22,	/* PDUTYPE2_PLAY_SOUND */
 	RDP_DATA_PDU_CLIENT_WINDOW_STATUS = 0x23,	/* PDUTYPE2_SUPRESS_OUTPUT */
 	RDP_DATA_PDU_LOGON = 0x26,	/* PDUTYPE2_SAVE_SESSION_INFO */
@@ -361,6 +415,9 @@ enum RDP_INPUT_DEVICE
 #define RDP_CAPSET_CONTROL	5
 #define RDP_CAPLEN_CONTROL	0x0C
 
+#define RDP_CAPSET_BMPCACHE3_CODECID	6	/* [MS-RDPEGDI] 2.2.1.1 */
+#define RDP_CAPLEN_BMPCACHE3_CODECID	5
+
 #define RDP_CAPSET_ACTIVATE	7
 #define RDP_CAPLEN_ACTIVATE	0x0C
 
@@ -389,6 +446,11 @@ enum RDP_INPUT_DEVICE
 #define RDP_CAPSET_GLYPHCACHE	16
 #define RDP_CAPLEN_GLYPHCACHE	52
 
+#define RDP_CAPSET_OFFSCREEN	17
+#define RDP_CAPLEN_OFFSCREEN	12
+#define OFFSCREEN_CACHE_SIZE	7680	/* KiB, the most allowed */
+#define OFFSCREEN_CACHE_ENTRIES	100
+
 #define RDP_CAPSET_BMPCACHE2	19
 #define RDP_CAPLEN_BMPCACHE2	0x28
 #define BMPCACHE2_FLAG_PERSIST	((uint32)1<<31)
@@ -399,6 +461,25 @@ enum RDP_INPUT_DEVICE
 #define RDP_CAPSET_LARGE_POINTER	27
 #define RDP_CAPLEN_LARGE_POINTER	6
 
+#define RDP_CAPSET_SURFCMDS	28
+#define RDP_CAPLEN_SURFCMDS	12
+#define SURFCMDS_SET_SURFACE_BITS	0x00000002
+#define SURFCMDS_FRAME_MARKER		0x00000010
+#define SURFCMDS_STREAM_SURFACE_BITS	0x00000040
+
+#define RDP_CAPSET_BMPCODECS	29
+
+/* Codec ids we assign in the bitmap codecs capability set */
+#define RDP_CODEC_ID_NONE	0
+#define RDP_CODEC_ID_NSCODEC	1
+#define RDP_CODEC_ID_REMOTEFX	3
+
+/* Surface commands */
+#define CMDTYPE_SET_SURFACE_BITS	0x0001
+#define CMDTYPE_FRAME_MARKER		0x0004
+#define CMDTYPE_STREAM_SURFACE_BITS	0x0006
+#define EX_COMPRESSED_BITMAP_HEADER_PRESENT	0x01
+
 #define RDP_CAPSET_VC	20
 #define RDP_CAPLEN_VC	0x08
 
@@ -413,6 +494,7 @@ enum RDP_INPUT_DEVICE
 #define RDP_INFO_COMPRESSION	      0x00000080	/* mppc compression with 8kB history buffer */
 #define RDP_INFO_ENABLEWINDOWSKEY     0x00000100
 #define RDP_INFO_COMPRESSION2	      0x00000200	/* rdp5 mppc compression with 64kB history buffer */
+#define RDP_INFO_COMPRESSION_TYPE_MASK 0x00001e00	/* highest compression type supported */
 #define RDP_INFO_REMOTE_CONSOLE_AUDIO 0x00002000
 #define RDP_INFO_PASSWORD_IS_SC_PIN   0x00040000
 
@@ -432,6 +514,19 @@ enum RDP_INPUT_DEVICE
 #define RDP_MPPC_FLUSH		0x80
 #define RDP_MPPC_DICT_SIZE      65536
 
+#define RDP_COMPR_TYPE_MASK	0x0f
+#define RDP_COMPR_TYPE_8K	0x00
+#define RDP_COMPR_TYPE_64K	0x01
+#define RDP_COMPR_TYPE_RDP6	0x02
+#define RDP_COMPR_TYPE_RDP61	0x03
+
+/* RDP 6.1 bulk compression */
+#define XCRUSH_L1_COMPRESSED		0x01
+#define XCRUSH_L1_NO_COMPRESSION	0x02
+#define XCRUSH_L1_PACKET_AT_FRONT	0x04
+#define XCRUSH_L1_INNER_COMPRESSION	0x10
+#define XCRUSH_HISTORY_SIZE		2000000
+
 #define RDP5_COMPRESSED		0x80
 
 /* Keymap flags */
@@ -501,6 +596,8 @@ enum RDP_INPUT_DEVICE
 #define WAVE_FORMAT_ADPCM	2
 #define WAVE_FORMAT_ALAW	6
 #define WAVE_FORMAT_MULAW	7
+#define WAVE_FORMAT_DVI_ADPCM	0x11
+#define WAVE_FORMAT_OPUS	0x704f
 
 /* Virtual channel options */
 #define CHANNEL_OPTION_INITIALIZED	0x80000000
@@ -508,6 +605,14 @@ enum RDP_INPUT_DEVICE
 #define CHANNEL_OPTION_COMPRESS_RDP	0x00800000
 #define CHANNEL_OPTION_SHOW_PROTOCOL	0x00200000
 
+/* Dynamic virtual channel send priorities */
+#define DVC_PRIORITY_INTERACTIVE	0
+#define DVC_PRIORITY_BULK		1
+
+/* TS_VIRTUALCHANNEL_CAPABILITYSET.flags */
+#define VCCAPS_COMPR_SC		0x00000001
+#define VCCAPS_COMPR_CS_8K	0x00000002
+
 /* NT status codes for RDPDR */
 #define RD_STATUS_SUCCESS                  0x00000000
 #define RD_STATUS_NOT_IMPLEMENTED          0x00000001
@@ -533,6 +638,7 @@ enum RDP_INPUT_DEVICE
 #define RD_STATUS_NOTIFY_ENUM_DIR          0xc000010c
 #define RD_STATUS_CANCELLED                0xc0000120
 #define RD_STATUS_DIRECTORY_NOT_EMPTY      0xc0000101
+#define RD_STATUS_TOO_MANY_OPENED_FILES    0xc000011f
 
 /* RDPSND constants */
 #define TSSNDCAPS_ALIVE                    0x00000001
@@ -612,6 +718,9 @@ enum RDP_INPUT_DEVICE
 #define RDPDR_CLIENT_DISPLAY_NAME_PDU 0x00000002
 #define RDPDR_USER_LOGGEDON_PDU       0x00000004
 
+/* RDPDR extraFlags1 */
+#define ENABLE_ASYNCIO                0x00000001
+
 /* RDP5 disconnect PDU
  *
  * Named after the corresponding names on the server side:
@@ -766,6 +875,9 @@ enum RDP_DESKTOP_ORIENTATION
 #define SOLIDPATTERNBRUSHONLY	0x0040
 #define ORDERFLAGS_EXTRA_FLAGS	0x0080
 
+/* orderSupportExFlags */
+#define ORDERFLAGS_EX_CACHE_BITMAP_REV3_SUPPORT	0x0002
+
 /* orderSupport index, [MS-RDPBCGR] 2.2.7.1.3 */
 #define TS_NEG_DSTBLT_INDEX		0x00
 #define TS_NEG_PATBLT_INDEX		0x01
@@ -822,4 +934,8 @@ enum RDP_SUPPRESS_STATUS
 	ALLOW_DISPLAY_UPDATES = 0x01
 };
 
+/* evloop events */
+#define EVLOOP_READ	0x01
+#define EVLOOP_WRITE	0x02
+
 #endif /* _CONSTANTS_H */
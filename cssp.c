@@ -30,6 +30,16 @@ extern char *g_sc_container_name;
 static gss_OID_desc _gss_spnego_krb5_mechanism_oid_desc =
 	{ 9, (void *) "\x2a\x86\x48\x86\xf7\x12\x01\x02\x02" };
 
+/* Kept for the life of the process, so that reconnects, such as for
+   a redirect or a resize, neither look up the mechanisms again nor
+   read the credential cache again. With the credential held, the
+   service ticket of the first connection is used again for the same
+   server rather than asked of the KDC. */
+static int g_gss_mech_found = -1;
+static gss_cred_id_t g_gss_cred = GSS_C_NO_CREDENTIAL;
+static gss_name_t g_gss_target = GSS_C_NO_NAME;
+static char *g_gss_target_server = NULL;
+
 static STREAM
 ber_wrap_hdr_data(int tagval, STREAM in)
 {
@@ -82,6 +92,8 @@ cssp_gss_mech_available(gss_OID mech)
 
 	if (mech == GSS_C_NO_OID)
 		return True;
+	if (g_gss_mech_found != -1)
+		return g_gss_mech_found;
 
 	major_status = gss_indicate_mechs(&minor_status, &mech_set);
 	if (!mech_set)
@@ -94,7 +106,8 @@ cssp_gss_mech_available(gss_OID mech)
 		return False;
 	}
 
-	gss_test_oid_set_member(&minor_status, mech, mech_set, &mech_found);
+	major_status = gss_test_oid_set_member(&minor_status, mech, mech_set, &mech_found);
+	gss_release_oid_set(&minor_status, &mech_set);
 
 	if (GSS_ERROR(major_status))
 	{
@@ -103,10 +116,46 @@ cssp_gss_mech_available(gss_OID mech)
 		return False;
 	}
 
-	if (!mech_found)
-		return False;
+	g_gss_mech_found = mech_found ? 1 : 0;
+	return g_gss_mech_found;
+}
 
-	return True;
+/* The initiator credential from the credential cache, acquired on the
+   first connection. GSS_C_NO_CREDENTIAL, the default credential, if it
+   can't be. */
+static gss_cred_id_t
+cssp_gss_get_cred(gss_OID mech)
+{
+	OM_uint32 major_status, minor_status;
+	gss_OID_set_desc mechs;
+
+	if (g_gss_cred != GSS_C_NO_CREDENTIAL)
+		return g_gss_cred;
+
+	mechs.count = 1;
+	mechs.elements = mech;
+	major_status = gss_acquire_cred(&minor_status, GSS_C_NO_NAME, GSS_C_INDEFINITE, &mechs,
+					GSS_C_INITIATE, &g_gss_cred, NULL, NULL);
+	if (GSS_ERROR(major_status))
+	{
+		cssp_gss_report_error(GSS_C_GSS_CODE, "Failed to acquire credential",
+				      major_status, minor_status);
+		g_gss_cred = GSS_C_NO_CREDENTIAL;
+	}
+
+	return g_gss_cred;
+}
+
+/* Forget the credential, after it has failed, such as by the ticket
+   expiring, so that the next connection reads the cache again */
+static void
+cssp_gss_forget_cred(void)
+{
+	OM_uint32 minor_status;
+
+	if (g_gss_cred != GSS_C_NO_CREDENTIAL)
+		gss_release_cred(&minor_status, &g_gss_cred);
+	g_gss_cred = GSS_C_NO_CREDENTIAL;
 }
 
 static RD_BOOL
@@ -117,6 +166,13 @@ cssp_gss_get_service_name(char *server, gss_name_t * name)
 
 	const char service_name[] = "TERMSRV";
 
+	/* the name of the server connected to before */
+	if (g_gss_target != GSS_C_NO_NAME && strcmp(g_gss_target_server, server) == 0)
+	{
+		*name = g_gss_target;
+		return True;
+	}
+
 	gss_OID type = (gss_OID) GSS_C_NT_HOSTBASED_SERVICE;
 	int size = (strlen(service_name) + 1 + strlen(server) + 1);
 
@@ -135,6 +191,12 @@ cssp_gss_get_service_name(char *server, gss_name_t * name)
 
 	gss_release_buffer(&minor_status, &output);
 
+	if (g_gss_target != GSS_C_NO_NAME)
+		gss_release_name(&minor_status, &g_gss_target);
+	xfree(g_gss_target_server);
+	g_gss_target = *name;
+	g_gss_target_server = xstrdup(server);
+
 	return True;
 
 }
@@ -736,7 +798,7 @@ cssp_connect(char *server, char *user, char *domain, char *password, STREAM s)
 	gss_OID actual_mech;
 
 	gss_ctx = GSS_C_NO_CONTEXT;
-	cred = GSS_C_NO_CREDENTIAL;
+	cred = cssp_gss_get_cred(desired_mech);
 
 	token = NULL;
 	input_tok.length = 0;
@@ -774,6 +836,7 @@ cssp_connect(char *server, char *user, char *domain, char *password, STREAM s)
 
 			cssp_gss_report_error(GSS_C_GSS_CODE, "cssp_connect(), negotiation failed.",
 					      major_status, minor_status);
+			cssp_gss_forget_cred();
 			goto bail_out;
 		}
 
@@ -887,6 +950,7 @@ cssp_connect(char *server, char *user, char *domain, char *password, STREAM s)
 	if (!ret)
 		goto bail_out;
 
+	rdp_connect_phase(CONNECT_PHASE_CREDSSP);
 	return True;
 
       bail_out:
@@ -27,11 +27,14 @@
 #include <sys/un.h>
 #include <errno.h>
 #include <limits.h>
+#include <signal.h>
+#include <sysexits.h>
 #include <unistd.h>
 
 #define CTRL_LINEBUF_SIZE 1024
 #define CTRL_RESULT_SIZE 32
 #define RDESKTOP_CTRLSOCK_STORE "/.local/share/rdesktop/ctrl"
+#define RDESKTOP_HOSTSOCK_NAME "host.ctl"
 
 #define CTRL_HASH_FLAG_SEAMLESS  1
 
@@ -48,6 +51,14 @@ static char ctrlsock_name[PATH_MAX];
 static struct _ctrl_slave_t *_ctrl_slaves;
 
 #define CMD_SEAMLESS_SPAWN "seamless.spawn"
+#define CMD_CACHE_STATS "cache.stats"
+#define CMD_ORDER_STATS "orders.stats"
+#define CMD_STREAM_STATS "streams.stats"
+#define CMD_NETWORK_STATS "network.stats"
+#define CMD_TRACE_DUMP "trace.dump"
+#define CMD_STATS_GET "stats.get"
+#define CMD_STATS_RESET "stats.reset"
+#define CMD_SESSION_OPEN "session.open"
 
 typedef struct _ctrl_slave_t
 {
@@ -66,6 +77,7 @@ _ctrl_slave_new(int sock)
 	ns = (_ctrl_slave_t *) xmalloc(sizeof(_ctrl_slave_t));
 	memset(ns, 0, sizeof(_ctrl_slave_t));
 	ns->sock = sock;
+	evloop_add_fd(sock, EVLOOP_READ);
 
 	/* append new slave to end of list */
 	it = _ctrl_slaves;
@@ -104,6 +116,7 @@ _ctrl_slave_disconnect(int sock)
 	if (it->sock == sock)
 	{
 		/* shutdown socket */
+		evloop_remove_fd(sock);
 		shutdown(sock, SHUT_RDWR);
 		close(sock);
 
@@ -145,6 +158,121 @@ _ctrl_command_result(_ctrl_slave_t * slave, int result)
 	}
 }
 
+/* Send one line per cache with its statistics, see cache_format_stats() */
+static void
+_ctrl_send_cache_stats(_ctrl_slave_t * slave)
+{
+	char buf[256];
+	int n;
+
+	for (n = 0; cache_format_stats(n, buf, sizeof(buf) - 1); n++)
+	{
+		strcat(buf, "\n");
+		send(slave->sock, buf, strlen(buf), 0);
+	}
+}
+
+/* Send one line per primary order type, see orders_format_stats() */
+static void
+_ctrl_send_order_stats(_ctrl_slave_t * slave)
+{
+	char buf[256];
+	int n;
+
+	for (n = 0; orders_format_stats(n, buf, sizeof(buf) - 1); n++)
+	{
+		strcat(buf, "\n");
+		send(slave->sock, buf, strlen(buf), 0);
+	}
+}
+
+/* Send one line per stream size class, see s_format_stats() */
+static void
+_ctrl_send_stream_stats(_ctrl_slave_t * slave)
+{
+	char buf[256];
+	int n;
+
+	for (n = 0; s_format_stats(n, buf, sizeof(buf) - 1); n++)
+	{
+		strcat(buf, "\n");
+		send(slave->sock, buf, strlen(buf), 0);
+	}
+}
+
+/* Send the network measurements, see autodetect_format_stats() */
+static void
+_ctrl_send_network_stats(_ctrl_slave_t * slave)
+{
+	char buf[256];
+	int n;
+
+	for (n = 0; autodetect_format_stats(n, buf, sizeof(buf) - 1); n++)
+	{
+		strcat(buf, "\n");
+		send(slave->sock, buf, strlen(buf), 0);
+	}
+}
+
+/* Send the lines of one statistics formatter, each preceded by the
+   name of what they are about */
+static void
+_ctrl_send_prefixed_stats(_ctrl_slave_t * slave, const char *prefix,
+			  RD_BOOL(*format) (int n, char *buf, size_t size))
+{
+	char buf[320];
+	size_t len;
+	int n;
+
+	snprintf(buf, sizeof(buf), "%s ", prefix);
+	len = strlen(buf);
+	for (n = 0; format(n, buf + len, sizeof(buf) - len - 1); n++)
+	{
+		strcat(buf, "\n");
+		send(slave->sock, buf, strlen(buf), 0);
+	}
+}
+
+/* Send every runtime counter there is, one line each */
+static void
+_ctrl_send_all_stats(_ctrl_slave_t * slave)
+{
+	_ctrl_send_prefixed_stats(slave, "channel", sec_format_stats);
+	_ctrl_send_prefixed_stats(slave, "codec", bitmap_format_stats);
+	_ctrl_send_prefixed_stats(slave, "codec", rdp_format_stats);
+	_ctrl_send_prefixed_stats(slave, "codec", rdpegfx_format_stats);
+	_ctrl_send_prefixed_stats(slave, "orders", orders_format_stats);
+	_ctrl_send_prefixed_stats(slave, "cache", cache_format_stats);
+	_ctrl_send_prefixed_stats(slave, "streams", s_format_stats);
+	_ctrl_send_prefixed_stats(slave, "network", autodetect_format_stats);
+	_ctrl_send_prefixed_stats(slave, "connect", rdp_format_connect_stats);
+	_ctrl_send_prefixed_stats(slave, "display", ui_format_stats);
+#ifdef WITH_RDPSND
+	_ctrl_send_prefixed_stats(slave, "sound", rdpsnd_format_stats);
+#endif
+	_ctrl_send_prefixed_stats(slave, "rdpdr", rdpdr_format_stats);
+}
+
+/* Start all counters of stats.get afresh. Totals that describe state
+   rather than activity, such as what the caches hold or the measured
+   network, are kept. */
+static void
+_ctrl_reset_all_stats(void)
+{
+	sec_reset_stats();
+	bitmap_reset_stats();
+	rdp_reset_stats();
+	rdpegfx_reset_stats();
+	orders_reset_stats();
+	cache_reset_stats();
+	s_reset_stats();
+	ui_reset_stats();
+#ifdef WITH_RDPSND
+	rdpsnd_reset_stats();
+#endif
+	rdpdr_reset_stats();
+}
+
 static void
 _ctrl_dispatch_command(_ctrl_slave_t * slave)
 {
@@ -168,6 +296,49 @@ _ctrl_dispatch_command(_ctrl_slave_t * slave)
 		if (seamless_send_spawn(p) == (unsigned int) -1)
 			res = 1;
 	}
+	else if (strncmp(cmd, CMD_CACHE_STATS, strlen(CMD_CACHE_STATS)) == 0 &&
+		 (cmd[strlen(CMD_CACHE_STATS)] == '\0' || cmd[strlen(CMD_CACHE_STATS)] == ' '))
+	{
+		_ctrl_send_cache_stats(slave);
+		res = ERR_RESULT_OK;
+	}
+	else if (strncmp(cmd, CMD_ORDER_STATS, strlen(CMD_ORDER_STATS)) == 0 &&
+		 (cmd[strlen(CMD_ORDER_STATS)] == '\0' || cmd[strlen(CMD_ORDER_STATS)] == ' '))
+	{
+		_ctrl_send_order_stats(slave);
+		res = ERR_RESULT_OK;
+	}
+	else if (strncmp(cmd, CMD_STREAM_STATS, strlen(CMD_STREAM_STATS)) == 0 &&
+		 (cmd[strlen(CMD_STREAM_STATS)] == '\0' || cmd[strlen(CMD_STREAM_STATS)] == ' '))
+	{
+		_ctrl_send_stream_stats(slave);
+		res = ERR_RESULT_OK;
+	}
+	else if (strncmp(cmd, CMD_NETWORK_STATS, strlen(CMD_NETWORK_STATS)) == 0 &&
+		 (cmd[strlen(CMD_NETWORK_STATS)] == '\0' || cmd[strlen(CMD_NETWORK_STATS)] == ' '))
+	{
+		_ctrl_send_network_stats(slave);
+		res = ERR_RESULT_OK;
+	}
+	else if (strncmp(cmd, CMD_STATS_GET, strlen(CMD_STATS_GET)) == 0 &&
+		 (cmd[strlen(CMD_STATS_GET)] == '\0' || cmd[strlen(CMD_STATS_GET)] == ' '))
+	{
+		_ctrl_send_all_stats(slave);
+		res = ERR_RESULT_OK;
+	}
+	else if (strncmp(cmd, CMD_STATS_RESET, strlen(CMD_STATS_RESET)) == 0 &&
+		 (cmd[strlen(CMD_STATS_RESET)] == '\0' || cmd[strlen(CMD_STATS_RESET)] == ' '))
+	{
+		_ctrl_reset_all_stats();
+		res = ERR_RESULT_OK;
+	}
+#ifdef WITH_TRACE
+	else if (strncmp(cmd, CMD_TRACE_DUMP " ", strlen(CMD_TRACE_DUMP) + 1) == 0)
+	{
+		/* write the trace to the path given */
+		res = trace_dump(cmd + strlen(CMD_TRACE_DUMP) + 1) < 0 ? 1 : ERR_RESULT_OK;
+	}
+#endif
 	else
 	{
 		res = ERR_RESULT_NO_SUCH_COMMAND;
@@ -245,38 +416,21 @@ _ctrl_create_hash(const char *user, const char *domain, const char *host, char *
 }
 
 
-/** Initialize ctrl
-    Ret values: <0 failure, 0 master, 1 client
- */
-int
-ctrl_init(const char *user, const char *domain, const char *host)
+/* Become the master listening on ctrlsock_name, or a slave if another
+   process already is. Ret values as for ctrl_init(). */
+static int
+_ctrl_open_socket(const char *home)
 {
 	struct stat st;
 	struct sockaddr_un saun;
-	char hash[41], path[PATH_MAX];
-	char *home;
-
-	/* check if ctrl already initialized */
-	if (ctrlsock != 0 || _ctrl_is_slave)
-		return 0;
-
-	home = getenv("HOME");
-	if (home == NULL)
-	{
-		return -1;
-	}
-
-	/* get uniq hash for ctrlsock name */
-	_ctrl_create_hash(user, domain, host, hash, 41);
-	snprintf(ctrlsock_name, PATH_MAX, "%s" RDESKTOP_CTRLSOCK_STORE "/%s.ctl", home, hash);
-	ctrlsock_name[sizeof(ctrlsock_name) - 1] = '\0';
+	char path[PATH_MAX];
 
 	/* make sure that ctrlsock store path exists */
 	snprintf(path, PATH_MAX, "%s" RDESKTOP_CTRLSOCK_STORE, home);
 	path[sizeof(path) - 1] = '\0';
 	if (utils_mkdir_p(path, 0700) == -1)
 	{
-		logger(Core, Error, "ctrl_init(), utils_mkdir_p() failed: %s", strerror(errno));
+		logger(Core, Warning, "ctrl_init(), utils_mkdir_p() failed: %s", strerror(errno));
 		return -1;
 	}
 
@@ -298,8 +452,9 @@ ctrl_init(const char *user, const char *domain, const char *host)
 	/* setup ctrl socket and start listening for connections */
 	if ((ctrlsock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
 	{
-		logger(Core, Error, "ctrl_init(), socket() failed: %s", strerror(errno));
-		exit(1);
+		logger(Core, Warning, "ctrl_init(), socket() failed: %s", strerror(errno));
+		ctrlsock = 0;
+		return -1;
 	}
 
 	/* bind and start listening on server socket */
@@ -308,64 +463,292 @@ ctrl_init(const char *user, const char *domain, const char *host)
 	strncpy(saun.sun_path, ctrlsock_name, sizeof(saun.sun_path));
 	if (bind(ctrlsock, (struct sockaddr *) &saun, sizeof(struct sockaddr_un)) < 0)
 	{
-		logger(Core, Error, "ctrl_init(), bind() failed: %s", strerror(errno));
-		exit(1);
+		logger(Core, Warning, "ctrl_init(), bind() failed: %s", strerror(errno));
+		goto fail;
 	}
 
 	if (listen(ctrlsock, 5) < 0)
 	{
-		logger(Core, Error, "ctrl_init(), listen() failed: %s", strerror(errno));
-		exit(1);
+		logger(Core, Warning, "ctrl_init(), listen() failed: %s", strerror(errno));
+		unlink(ctrlsock_name);
+		goto fail;
 	}
 
 	/* add ctrl cleanup func to exit hooks */
 	atexit(ctrl_cleanup);
 
 	return 0;
+
+      fail:
+	close(ctrlsock);
+	ctrlsock = 0;
+	return -1;
 }
 
-void
-ctrl_cleanup()
+/** Initialize ctrl
+    Ret values: <0 failure, 0 master, 1 client
+ */
+int
+ctrl_init(const char *user, const char *domain, const char *host)
 {
-	if (ctrlsock)
+	char hash[41];
+	char *home;
+	int res;
+
+	/* check if ctrl already initialized */
+	if (ctrlsock != 0 || _ctrl_is_slave)
+		return 0;
+
+	home = getenv("HOME");
+	if (home == NULL)
 	{
-		close(ctrlsock);
-		unlink(ctrlsock_name);
+		return -1;
 	}
+
+	/* get uniq hash for ctrlsock name */
+	_ctrl_create_hash(user, domain, host, hash, 41);
+	snprintf(ctrlsock_name, PATH_MAX, "%s" RDESKTOP_CTRLSOCK_STORE "/%s.ctl", home, hash);
+	ctrlsock_name[sizeof(ctrlsock_name) - 1] = '\0';
+
+	res = _ctrl_open_socket(home);
+	if (res == 0)
+		evloop_add_fd(ctrlsock, EVLOOP_READ);
+	return res;
 }
 
-RD_BOOL
-ctrl_is_slave()
+/** Initialize the socket of the session host, which there is one of
+    per user rather than per server
+    Ret values: <0 failure, 0 host, 1 a host is already running
+ */
+int
+ctrl_host_init(void)
 {
-	return _ctrl_is_slave;
+	char *home;
+
+	if (ctrlsock != 0 || _ctrl_is_slave)
+		return 0;
+
+	home = getenv("HOME");
+	if (home == NULL)
+		return -1;
+
+	snprintf(ctrlsock_name, PATH_MAX, "%s" RDESKTOP_CTRLSOCK_STORE "/" RDESKTOP_HOSTSOCK_NAME,
+		 home);
+	ctrlsock_name[sizeof(ctrlsock_name) - 1] = '\0';
+
+	return _ctrl_open_socket(home);
 }
 
+/* Read one command line from sock into buf, returns False if the peer
+   went away first or the line does not fit */
+static RD_BOOL
+_ctrl_read_line(int sock, char *buf, size_t size)
+{
+	size_t len = 0;
+	ssize_t res;
 
-void
-ctrl_add_fds(int *n, fd_set * rfds)
+	while (len < size - 1)
+	{
+		res = recv(sock, buf + len, 1, 0);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return False;
+		if (buf[len] == '\n')
+		{
+			buf[len] = '\0';
+			return True;
+		}
+		len++;
+	}
+	return False;
+}
+
+/* Split the arguments of a session.open command, one per line and the
+   display first, into a NULL terminated argv */
+static char **
+_ctrl_split_session_args(char *args, const char *argv0, int *argc)
 {
-	_ctrl_slave_t *it;
+	char **argv, *p;
+	int n;
+
+	p = strchr(args, '\n');
+	if (p == NULL)
+		return NULL;
+
+	for (n = 2; (p = strchr(p + 1, '\n')) != NULL;)
+		n++;
+	argv = (char **) xmalloc(sizeof(char *) * (n + 1));
+
+	p = strchr(args, '\n');
+	*p++ = '\0';
+	if (args[0] != '\0')
+		setenv("DISPLAY", args, 1);
+
+	argv[0] = (char *) argv0;
+	for (n = 1; p != NULL; n++)
+	{
+		argv[n] = p;
+		p = strchr(p, '\n');
+		if (p != NULL)
+			*p++ = '\0';
+	}
+	argv[n] = NULL;
+	*argc = n;
+	return argv;
+}
+
+/** Serve session.open commands as the session host. Each session is
+    run by a child forked off the host, so that what the host loaded
+    before is shared between them until written to. Only returns in
+    such a child, with the arguments of its session, or on failure.
+    Ret values: <0 failure, 0 in a session
+ */
+int
+ctrl_host_serve(int *argc, char ***argv)
+{
+	char line[CTRL_LINEBUF_SIZE], *cmd, **sargv;
+	struct sigaction act;
+	int sock, sargc;
+	pid_t pid;
+
 	if (ctrlsock == 0)
-		return;
+		return -1;
 
-	FD_SET(ctrlsock, rfds);
-	*n = MAX(*n, ctrlsock);
+	/* sessions are not waited for */
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = SIG_IGN;
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGCHLD, &act, NULL);
 
+	logger(Core, Notice, "Session host waiting for sessions on %s", ctrlsock_name);
 
-	/* add connected slaves to fd set */
-	it = _ctrl_slaves;
-	while (it)
+	while (1)
 	{
-		FD_SET(it->sock, rfds);
-		*n = MAX(*n, it->sock);
-		it = it->next;
+		sock = accept(ctrlsock, NULL, NULL);
+		if (sock < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			logger(Core, Error, "ctrl_host_serve(), accept() failed: %s",
+			       strerror(errno));
+			return -1;
+		}
+
+		if (!_ctrl_read_line(sock, line, sizeof(line)))
+		{
+			close(sock);
+			continue;
+		}
+
+		cmd = utils_string_unescape(line);
+		if (strncmp(cmd, CMD_SESSION_OPEN " ", strlen(CMD_SESSION_OPEN) + 1) != 0)
+		{
+			xfree(cmd);
+			send(sock, "ERROR ffffffff\n", 15, 0);
+			close(sock);
+			continue;
+		}
+
+		pid = fork();
+		if (pid == 0)
+		{
+			/* the session must neither serve nor remove the socket
+			   of the host */
+			close(sock);
+			close(ctrlsock);
+			ctrlsock = 0;
+			act.sa_handler = SIG_DFL;
+			sigaction(SIGCHLD, &act, NULL);
+
+			sargv = _ctrl_split_session_args(cmd + strlen(CMD_SESSION_OPEN) + 1,
+							 (*argv)[0], &sargc);
+			if (sargv == NULL)
+				exit(EX_USAGE);
+			*argc = sargc;
+			*argv = sargv;
+			return 0;
+		}
+
+		xfree(cmd);
+		if (pid < 0)
+		{
+			logger(Core, Error, "ctrl_host_serve(), fork() failed: %s",
+			       strerror(errno));
+			send(sock, "ERROR 1\n", 8, 0);
+		}
+		else
+		{
+			logger(Core, Verbose, "Session host started session %d", (int) pid);
+			send(sock, "OK\n", 3, 0);
+		}
+		close(sock);
 	}
 }
 
+/** Hand a session over to the running session host, with the display
+    of this process and the arguments given
+    Ret values: <0 no host, 0 handed over, >0 the host failed
+ */
+int
+ctrl_host_open_session(int argc, char *argv[])
+{
+	char args[CTRL_LINEBUF_SIZE], *display, *home;
+	size_t len;
+	int i;
+
+	home = getenv("HOME");
+	if (home == NULL)
+		return -1;
+
+	snprintf(ctrlsock_name, PATH_MAX, "%s" RDESKTOP_CTRLSOCK_STORE "/" RDESKTOP_HOSTSOCK_NAME,
+		 home);
+	ctrlsock_name[sizeof(ctrlsock_name) - 1] = '\0';
+	if (!_ctrl_verify_unix_socket())
+		return -1;
+	_ctrl_is_slave = True;
+
+	display = getenv("DISPLAY");
+	STRNCPY(args, display ? display : "", sizeof(args));
+	len = strlen(args);
+	for (i = 1; i < argc; i++)
+	{
+		if (len + 1 + strlen(argv[i]) >= sizeof(args))
+		{
+			logger(Core, Error, "Too many arguments to hand over to the session host");
+			return 1;
+		}
+		args[len++] = '\n';
+		strcpy(args + len, argv[i]);
+		len += strlen(argv[i]);
+	}
+
+	return ctrl_send_command(CMD_SESSION_OPEN, args);
+}
+
 void
-ctrl_check_fds(fd_set * rfds, fd_set * wfds)
+ctrl_cleanup()
+{
+	if (ctrlsock)
+	{
+		evloop_remove_fd(ctrlsock);
+		close(ctrlsock);
+		unlink(ctrlsock_name);
+	}
+}
+
+RD_BOOL
+ctrl_is_slave()
+{
+	return _ctrl_is_slave;
+}
+
+
+/* Accept new slaves and process commands from connected ones, for
+   the sockets that evloop_wait() found ready */
+void
+ctrl_check_fds(void)
 {
-	UNUSED(wfds);
 	int ns, res, offs;
 	struct sockaddr_un fsaun;
 	socklen_t fromlen;
@@ -377,9 +760,8 @@ ctrl_check_fds(fd_set * rfds, fd_set * wfds)
 	memset(&fsaun, 0, sizeof(struct sockaddr_un));
 
 	/* check if we got any connections on server socket */
-	if (FD_ISSET(ctrlsock, rfds))
+	if (evloop_check_fd(ctrlsock) & EVLOOP_READ)
 	{
-		FD_CLR(ctrlsock, rfds);
 		fromlen = sizeof(fsaun);
 		ns = accept(ctrlsock, (struct sockaddr *) &fsaun, &fromlen);
 		if (ns < 0)
@@ -397,11 +779,10 @@ ctrl_check_fds(fd_set * rfds, fd_set * wfds)
 	it = _ctrl_slaves;
 	while (it)
 	{
-		if (FD_ISSET(it->sock, rfds))
+		if (evloop_check_fd(it->sock) & EVLOOP_READ)
 		{
 			offs = strlen(it->linebuf);
 			res = recv(it->sock, it->linebuf + offs, CTRL_LINEBUF_SIZE - offs, 0);
-			FD_CLR(it->sock, rfds);
 
 			/* linebuffer full let's disconnect slave */
 			if (it->linebuf[CTRL_LINEBUF_SIZE - 1] != '\0' &&
@@ -488,7 +869,11 @@ ctrl_send_command(const char *cmd, const char *arg)
 	/* escape the UTF-8 string */
 	escaped = utils_string_escape(tmp);
 	if ((strlen(escaped) + 1) > CTRL_LINEBUF_SIZE - 1)
+	{
+		logger(Core, Error, "ctrl_send_command(), command too long");
+		ret = -1;
 		goto bail_out;
+	}
 
 	/* send escaped UTF-8 command to master */
 	send(s, escaped, strlen(escaped), 0);
@@ -34,6 +34,11 @@
 
 #include <utime.h>
 #include <time.h>		/* ctime */
+#include <pthread.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 #if (defined(HAVE_DIRFD) || (HAVE_DECL_DIRFD == 1))
 #define DIRFD(a) (dirfd(a))
@@ -144,7 +149,6 @@ dummy_statfs(struct dummy_statfs_t *buf)
 
 extern RDPDR_DEVICE g_rdpdr_device[];
 
-FILEINFO g_fileinfo[MAX_OPEN_FILES];
 RD_BOOL g_notify_stamp = False;
 
 typedef struct
@@ -156,6 +160,10 @@ typedef struct
 } FsInfoType;
 
 static RD_NTSTATUS NotifyInfo(RD_NTHANDLE handle, uint32 info_class, NOTIFY * p);
+static void notify_release(RD_NTHANDLE handle);
+static RD_NTSTATUS disk_flush_writes(RD_NTHANDLE handle);
+static RD_NTSTATUS disk_stream_flush(RD_NTHANDLE handle);
+static void disk_streaming_release(RD_NTHANDLE handle);
 
 static time_t
 get_create_time(struct stat *filestat)
@@ -309,6 +317,569 @@ open_weak_exclusive(const char *pathname, int flags, mode_t mode)
 	}
 }
 
+/* A directory is listed once per enumeration, and the following
+   continuation queries walk through a snapshot of the names and stat()
+   information taken then. Snapshots of recently listed directories are
+   kept in a small cache and reused by later enumerations, and by queries
+   for the information of their entries. A cached snapshot is dropped
+   when inotify reports a change in the directory, when a change is made
+   through this client, or after DIR_CACHE_TTL, which also bounds how
+   long changes made elsewhere on a network file system go unnoticed.
+   Without inotify, the modification time of the directory is checked
+   instead. Disk IRPs run on the rdpdr worker threads, so the cache is
+   protected by a lock. */
+#define DIR_CACHE_SIZE	16
+#define DIR_CACHE_TTL	2000	/* ms */
+
+typedef struct
+{
+	char *name;
+	struct stat st;
+	int error;		/* errno of a failed stat(), or 0 */
+}
+DIR_ENTRY;
+
+typedef struct
+{
+	char path[PATH_MAX];
+	DIR_ENTRY *entries;	/* sorted by name */
+	unsigned int num_entries;
+	int refs;
+	uint64 created;		/* ms */
+	time_t mtime, ctime;
+	int wd;			/* inotify watch, or -1 */
+	RD_BOOL building, stale;
+}
+DIR_SNAPSHOT;
+
+static pthread_mutex_t g_dir_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static DIR_SNAPSHOT *g_dir_cache[DIR_CACHE_SIZE];
+/* inotify instance, -1 if there is none, -2 before the first use */
+static int g_dir_inotify = -2;
+
+typedef struct
+{
+	uint64 next_read;	/* offset following the last read */
+	unsigned int sequential;
+	uint8 *rbuf;		/* data read ahead */
+	uint64 roffset;
+	uint32 rlength;
+
+	uint8 *wbuf;		/* data not yet written */
+	uint64 woffset;
+	uint32 wlength;
+	RD_NTSTATUS wstatus;	/* of writing it out for another handle */
+}
+DISK_STREAMING;
+
+typedef struct
+{
+	uint32 action;
+	char *name;
+}
+NOTIFY_CHANGE;
+
+typedef struct
+{
+	RD_BOOL active;
+	int wd;			/* inotify watch */
+	uint32 filter;
+	NOTIFY_CHANGE *changes;
+	unsigned int num_changes;
+	RD_BOOL enum_dir;	/* changes were lost or not known */
+}
+NOTIFY_WATCH;
+
+/* Everything kept about an open handle */
+typedef struct
+{
+	FILEINFO info;
+	DIR_SNAPSHOT *dir_snapshot;	/* being enumerated, and how far */
+	unsigned int dir_position;
+	DISK_STREAMING streaming;
+	NOTIFY_WATCH notify;
+	struct stat attr;	/* file information, as of attr_time */
+	uint64 attr_time;	/* 0 when not known */
+	dev_t dev;		/* of the file, 0 when closed */
+	ino_t ino;
+	RD_BOOL writer;		/* opened for writing */
+	pthread_mutex_t stream_lock;	/* held to use streaming */
+}
+DISK_HANDLE;
+
+/* Windows asks for several information classes of a file in a row,
+   which are all served from one fstat() kept this long, in ms. Only
+   while the file is not open for writing, through any handle. */
+#define DISK_ATTR_TTL	1000
+
+/* Volume information comes with most directory listings and changes
+   seldom, so it is kept per file system and taken again after a
+   while. A share may span several. */
+#define DISK_VOLUME_TTL	5000	/* ms */
+#define DISK_VOLUME_CACHE	8
+
+typedef struct
+{
+	dev_t dev;
+	struct STATFS_T stat_fs;
+	FsInfoType fsinfo;
+	uint64 time;		/* 0 when not known */
+}
+DISK_VOLUME;
+
+static pthread_mutex_t g_disk_volume_lock = PTHREAD_MUTEX_INITIALIZER;
+static DISK_VOLUME g_disk_volume[DISK_VOLUME_CACHE];
+
+/* Handles are file descriptors, which the kernel hands out lowest first,
+   so they index the table directly. It grows in chunks as descriptors
+   get higher, and a chunk never moves once allocated so that the disk
+   worker threads can look handles up without a lock. */
+#define DISK_HANDLE_CHUNK	256
+
+static DISK_HANDLE *g_disk_handles[MAX_OPEN_FILES / DISK_HANDLE_CHUNK];
+/* Handles below this have an entry in the table */
+static unsigned int g_disk_handles_limit = 0;
+/* Held to change or compare the files of the handles, which the disk
+   worker threads look at for the other handles of a file */
+static pthread_mutex_t g_disk_inode_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static DISK_HANDLE *
+disk_handle(RD_NTHANDLE handle)
+{
+	return &g_disk_handles[handle / DISK_HANDLE_CHUNK][handle % DISK_HANDLE_CHUNK];
+}
+
+/* Make room in the table for handle, False if it is too high */
+static RD_BOOL
+disk_handle_reserve(RD_NTHANDLE handle)
+{
+	size_t size = DISK_HANDLE_CHUNK * sizeof(DISK_HANDLE);
+	DISK_HANDLE *chunk;
+	int i;
+
+	if (handle >= MAX_OPEN_FILES)
+		return False;
+
+	pthread_mutex_lock(&g_disk_inode_lock);
+	while (g_disk_handles_limit <= handle)
+	{
+		chunk = xmalloc(size);
+		memset(chunk, 0, size);
+		for (i = 0; i < DISK_HANDLE_CHUNK; i++)
+			pthread_mutex_init(&chunk[i].stream_lock, NULL);
+		g_disk_handles[g_disk_handles_limit / DISK_HANDLE_CHUNK] = chunk;
+		g_disk_handles_limit += DISK_HANDLE_CHUNK;
+	}
+	pthread_mutex_unlock(&g_disk_inode_lock);
+
+	return True;
+}
+
+/* Returns True if another handle has the file of handle open for
+   writing */
+static RD_BOOL
+disk_inode_written(RD_NTHANDLE handle)
+{
+	DISK_HANDLE *dh = disk_handle(handle), *other;
+	RD_BOOL written = False;
+	unsigned int i;
+
+	pthread_mutex_lock(&g_disk_inode_lock);
+	for (i = 0; i < g_disk_handles_limit && !written; i++)
+	{
+		other = disk_handle(i);
+		written = i != handle && other->writer && other->ino == dh->ino
+			&& other->dev == dh->dev;
+	}
+	pthread_mutex_unlock(&g_disk_inode_lock);
+
+	return written;
+}
+
+/* Write out what the other handles of the file of handle have buffered,
+   and drop what they have read ahead, before it is used through this
+   one. A failed write is reported by the handle it was made through. */
+static void
+disk_inode_sync(RD_NTHANDLE handle)
+{
+	DISK_HANDLE *dh = disk_handle(handle), *other;
+	RD_NTSTATUS status;
+	unsigned int i;
+
+	if (dh->ino == 0)
+		return;
+
+	pthread_mutex_lock(&g_disk_inode_lock);
+	for (i = 0; i < g_disk_handles_limit; i++)
+	{
+		other = disk_handle(i);
+		if (i == handle || other->ino != dh->ino || other->dev != dh->dev)
+			continue;
+
+		pthread_mutex_lock(&other->stream_lock);
+		status = disk_stream_flush(i);
+		if (other->streaming.wstatus == RD_STATUS_SUCCESS)
+			other->streaming.wstatus = status;
+		other->streaming.rlength = 0;
+		pthread_mutex_unlock(&other->stream_lock);
+	}
+	pthread_mutex_unlock(&g_disk_inode_lock);
+}
+
+/* Returns the file behind an open handle, or NULL */
+FILEINFO *
+disk_fileinfo(RD_NTHANDLE handle)
+{
+	if (handle >= g_disk_handles_limit || disk_handle(handle)->info.path == NULL)
+		return NULL;
+
+	return &disk_handle(handle)->info;
+}
+
+static uint64
+dir_cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+dir_entry_compare(const void *a, const void *b)
+{
+	return strcmp(((const DIR_ENTRY *) a)->name, ((const DIR_ENTRY *) b)->name);
+}
+
+/* Must be called with g_dir_cache_lock held */
+static void
+dir_snapshot_unref(DIR_SNAPSHOT * snap)
+{
+	unsigned int i;
+
+	if (--snap->refs != 0)
+		return;
+
+	for (i = 0; i < snap->num_entries; i++)
+		xfree(snap->entries[i].name);
+	xfree(snap->entries);
+	xfree(snap);
+}
+
+/* Must be called with g_dir_cache_lock held */
+static void
+dir_cache_drop(int i)
+{
+	DIR_SNAPSHOT *snap = g_dir_cache[i];
+	int j;
+
+	g_dir_cache[i] = NULL;
+
+#ifdef HAVE_SYS_INOTIFY_H
+	/* another path may lead to the same directory, and share the watch */
+	for (j = 0; j < DIR_CACHE_SIZE; j++)
+		if (g_dir_cache[j] != NULL && g_dir_cache[j]->wd == snap->wd)
+			break;
+	if (snap->wd != -1 && j == DIR_CACHE_SIZE)
+		inotify_rm_watch(g_dir_inotify, snap->wd);
+#else
+	UNUSED(j);
+#endif
+
+	/* an enumeration in progress keeps its copy */
+	if (snap->building)
+		snap->stale = True;
+	else
+		dir_snapshot_unref(snap);
+}
+
+/* Must be called with g_dir_cache_lock held. Drops the snapshots of the
+   directories inotify has seen changes in. */
+static void
+dir_cache_read_events(void)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+	int i;
+
+	if (g_dir_inotify < 0)
+		return;
+
+	while ((n = read(g_dir_inotify, buf, sizeof(buf))) > 0)
+	{
+		for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len)
+		{
+			ev = (const struct inotify_event *) p;
+			for (i = 0; i < DIR_CACHE_SIZE; i++)
+			{
+				if (g_dir_cache[i] == NULL)
+					continue;
+				if ((ev->mask & IN_Q_OVERFLOW) || g_dir_cache[i]->wd == ev->wd)
+					dir_cache_drop(i);
+			}
+		}
+	}
+#endif
+}
+
+/* Must be called with g_dir_cache_lock held */
+static RD_BOOL
+dir_cache_fresh(DIR_SNAPSHOT * snap)
+{
+	struct stat st;
+
+	if (snap->building || snap->stale)
+		return False;
+
+	if (dir_cache_now() - snap->created > DIR_CACHE_TTL)
+		return False;
+
+	if (snap->wd != -1)
+		return True;
+
+	return stat(snap->path, &st) == 0 && st.st_mtime == snap->mtime &&
+		st.st_ctime == snap->ctime;
+}
+
+/* Must be called with g_dir_cache_lock held */
+static int
+dir_cache_find(const char *path)
+{
+	int i;
+
+	for (i = 0; i < DIR_CACHE_SIZE; i++)
+		if (g_dir_cache[i] != NULL && strcmp(g_dir_cache[i]->path, path) == 0)
+			return i;
+
+	return -1;
+}
+
+/* List the directory of snap */
+static RD_BOOL
+dir_snapshot_read(DIR_SNAPSHOT * snap)
+{
+	char fullpath[PATH_MAX];
+	unsigned int size;
+	struct dirent *pdirent;
+	struct stat st;
+	DIR_ENTRY *entry;
+	DIR *pdir;
+
+	if (stat(snap->path, &st) == 0)
+	{
+		snap->mtime = st.st_mtime;
+		snap->ctime = st.st_ctime;
+	}
+
+	pdir = opendir(snap->path);
+	if (pdir == NULL)
+	{
+		logger(Disk, Error, "dir_snapshot_read(), opendir() failed: %s", strerror(errno));
+		return False;
+	}
+
+	size = 0;
+	while ((pdirent = readdir(pdir)) != NULL)
+	{
+		if (snap->num_entries == size)
+		{
+			size = MAX(size * 2, 32);
+			snap->entries = xrealloc(snap->entries, size * sizeof(DIR_ENTRY));
+		}
+
+		entry = &snap->entries[snap->num_entries++];
+		entry->name = xstrdup(pdirent->d_name);
+		entry->error = 0;
+
+		if (snprintf(fullpath, sizeof(fullpath), "%s/%s", snap->path,
+			     pdirent->d_name) >= (int) sizeof(fullpath))
+			entry->error = ENAMETOOLONG;
+		else if (stat(fullpath, &entry->st) != 0)
+			entry->error = errno;
+
+		if (entry->error != 0)
+			memset(&entry->st, 0, sizeof(entry->st));
+	}
+	closedir(pdir);
+
+	qsort(snap->entries, snap->num_entries, sizeof(DIR_ENTRY), dir_entry_compare);
+	return True;
+}
+
+/* Returns a snapshot of the directory path, from the cache when
+   possible. Release it with dir_snapshot_release(). */
+static DIR_SNAPSHOT *
+dir_snapshot_get(const char *path)
+{
+	DIR_SNAPSHOT *snap;
+	RD_BOOL cached;
+	uint64 oldest;
+	int i, slot;
+
+	pthread_mutex_lock(&g_dir_cache_lock);
+
+#ifdef HAVE_SYS_INOTIFY_H
+	if (g_dir_inotify == -2)
+		g_dir_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+	dir_cache_read_events();
+
+	i = dir_cache_find(path);
+	if (i != -1 && dir_cache_fresh(g_dir_cache[i]))
+	{
+		snap = g_dir_cache[i];
+		snap->refs++;
+		pthread_mutex_unlock(&g_dir_cache_lock);
+		return snap;
+	}
+
+	/* some other thread is listing it, so don't wait for that */
+	cached = i == -1 || !g_dir_cache[i]->building;
+	if (i != -1 && cached)
+		dir_cache_drop(i);
+
+	snap = xmalloc(sizeof(DIR_SNAPSHOT));
+	memset(snap, 0, sizeof(DIR_SNAPSHOT));
+	STRNCPY(snap->path, path, sizeof(snap->path));
+	snap->refs = 1;
+	snap->wd = -1;
+
+	/* replace the oldest snapshot which is not being listed */
+	slot = -1;
+	oldest = (uint64) - 1;
+	for (i = 0; cached && i < DIR_CACHE_SIZE; i++)
+	{
+		if (g_dir_cache[i] == NULL)
+		{
+			slot = i;
+			break;
+		}
+		if (!g_dir_cache[i]->building && g_dir_cache[i]->created < oldest)
+		{
+			slot = i;
+			oldest = g_dir_cache[i]->created;
+		}
+	}
+
+	if (slot != -1)
+	{
+		if (g_dir_cache[slot] != NULL)
+			dir_cache_drop(slot);
+
+		/* the watch goes in before the listing, so that no change is missed */
+#ifdef HAVE_SYS_INOTIFY_H
+		if (g_dir_inotify >= 0)
+			snap->wd = inotify_add_watch(g_dir_inotify, path,
+						     IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+						     IN_MOVED_TO | IN_MODIFY | IN_ATTRIB |
+						     IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+#endif
+		snap->building = True;
+		snap->refs++;
+		g_dir_cache[slot] = snap;
+	}
+
+	pthread_mutex_unlock(&g_dir_cache_lock);
+
+	if (!dir_snapshot_read(snap))
+	{
+		pthread_mutex_lock(&g_dir_cache_lock);
+		snap->building = False;
+		if (slot != -1 && g_dir_cache[slot] == snap)
+			dir_cache_drop(slot);
+		else if (slot != -1)
+			dir_snapshot_unref(snap);
+		dir_snapshot_unref(snap);
+		pthread_mutex_unlock(&g_dir_cache_lock);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&g_dir_cache_lock);
+	snap->created = dir_cache_now();
+	snap->building = False;
+	if (slot != -1)
+	{
+		dir_cache_read_events();
+		/* dropped while it was being listed */
+		if (snap->stale)
+			dir_snapshot_unref(snap);
+	}
+	pthread_mutex_unlock(&g_dir_cache_lock);
+
+	return snap;
+}
+
+static void
+dir_snapshot_release(DIR_SNAPSHOT * snap)
+{
+	if (snap == NULL)
+		return;
+
+	pthread_mutex_lock(&g_dir_cache_lock);
+	dir_snapshot_unref(snap);
+	pthread_mutex_unlock(&g_dir_cache_lock);
+}
+
+/* Forget what is cached about path, and the directory it is in, after
+   a change made through this client */
+static void
+dir_cache_invalidate(const char *path)
+{
+	char parent[PATH_MAX], *p;
+	int i;
+
+	STRNCPY(parent, path, sizeof(parent));
+	p = strrchr(parent, '/');
+	if (p != NULL)
+		*p = '\0';
+
+	pthread_mutex_lock(&g_dir_cache_lock);
+	if ((i = dir_cache_find(path)) != -1)
+		dir_cache_drop(i);
+	if ((i = dir_cache_find(parent)) != -1)
+		dir_cache_drop(i);
+	pthread_mutex_unlock(&g_dir_cache_lock);
+}
+
+/* Look up the stat() information of path in the snapshot of its
+   directory, if there is a fresh one */
+static RD_BOOL
+dir_cache_stat(const char *path, struct stat *st)
+{
+	char parent[PATH_MAX], *p;
+	DIR_ENTRY key, *entry;
+	DIR_SNAPSHOT *snap;
+	int i;
+
+	STRNCPY(parent, path, sizeof(parent));
+	p = strrchr(parent, '/');
+	if (p == NULL)
+		return False;
+	*p = '\0';
+	key.name = p + 1;
+
+	entry = NULL;
+	pthread_mutex_lock(&g_dir_cache_lock);
+	dir_cache_read_events();
+	i = dir_cache_find(parent);
+	if (i != -1 && dir_cache_fresh(g_dir_cache[i]))
+	{
+		snap = g_dir_cache[i];
+		entry = bsearch(&key, snap->entries, snap->num_entries, sizeof(DIR_ENTRY),
+				dir_entry_compare);
+		if (entry != NULL && entry->error == 0)
+			*st = entry->st;
+		else
+			entry = NULL;
+	}
+	pthread_mutex_unlock(&g_dir_cache_lock);
+
+	return entry != NULL;
+}
+
 /* Enumeration of devices from rdesktop.c        */
 /* returns number of units found and initialized. */
 /* optarg looks like ':h=/mnt/floppy,b=/mnt/usbdevice1' */
@@ -355,6 +926,7 @@ disk_create(uint32 device_id, uint32 accessmask, uint32 sharemode, uint32 create
 	int flags, mode;
 	char path[PATH_MAX];
 	struct stat filestat;
+	FILEINFO *pfinfo;
 
 	logger(Disk, Debug, "disk_create(device_id=0x%x, accessmask=0x%x, sharemode=0x%x, "
 	       "create_disp=%d, flags=0x%x, fname=%s, ...)", device_id, accessmask,
@@ -503,28 +1075,41 @@ disk_create(uint32 device_id, uint32 accessmask, uint32 sharemode, uint32 create
 
 	}
 
-	if (handle >= MAX_OPEN_FILES)
+	if (!disk_handle_reserve(handle))
 	{
-		logger(Disk, Error,
-		       "disk_create(), handle (%d) is greater than or equal to MAX_OPEN_FILES (%d)!",
+		logger(Disk, Error, "disk_create(), handle %d is past the limit of %d open files",
 		       handle, MAX_OPEN_FILES);
-		exit(EX_SOFTWARE);
+		if (dirp)
+			closedir(dirp);
+		else
+			close(handle);
+		return RD_STATUS_TOO_MANY_OPENED_FILES;
 	}
 
-	if (dirp)
-		g_fileinfo[handle].pdir = dirp;
-	else
-		g_fileinfo[handle].pdir = NULL;
-
-	g_fileinfo[handle].device_id = device_id;
-	g_fileinfo[handle].flags_and_attributes = flags_and_attributes;
-	g_fileinfo[handle].accessmask = accessmask;
-	strncpy(g_fileinfo[handle].path, path, PATH_MAX - 1);
-	g_fileinfo[handle].delete_on_close = False;
+	pfinfo = &disk_handle(handle)->info;
+	pfinfo->pdir = dirp;
+	pfinfo->device_id = device_id;
+	pfinfo->flags_and_attributes = flags_and_attributes;
+	pfinfo->accessmask = accessmask;
+	pfinfo->path = xstrdup(path);
+	pfinfo->delete_on_close = False;
+	disk_handle(handle)->attr_time = 0;
+
+	pthread_mutex_lock(&g_disk_inode_lock);
+	if (fstat(handle, &filestat) == 0)
+	{
+		disk_handle(handle)->dev = filestat.st_dev;
+		disk_handle(handle)->ino = filestat.st_ino;
+	}
+	disk_handle(handle)->writer = (accessmask & (GENERIC_ALL | GENERIC_WRITE)) != 0;
+	pthread_mutex_unlock(&g_disk_inode_lock);
 
 	if (accessmask & GENERIC_ALL || accessmask & GENERIC_WRITE)
 		g_notify_stamp = True;
 
+	if (flags & (O_CREAT | O_TRUNC))
+		dir_cache_invalidate(path);
+
 	*phandle = handle;
 	return RD_STATUS_SUCCESS;
 }
@@ -533,16 +1118,40 @@ static RD_NTSTATUS
 disk_close(RD_NTHANDLE handle)
 {
 	struct fileinfo *pfinfo;
+	RD_NTSTATUS status;
 
 	logger(Disk, Debug, "disk_close(handle=0x%x)", handle);
 
-	pfinfo = &(g_fileinfo[handle]);
+	pfinfo = &disk_handle(handle)->info;
 
 	if (pfinfo->accessmask & GENERIC_ALL || pfinfo->accessmask & GENERIC_WRITE)
 		g_notify_stamp = True;
 
 	rdpdr_abort_io(handle, 0, RD_STATUS_CANCELLED);
 
+	dir_snapshot_release(disk_handle(handle)->dir_snapshot);
+	disk_handle(handle)->dir_snapshot = NULL;
+	notify_release(handle);
+
+	/* what could not be written is lost, which the close reports */
+	status = disk_flush_writes(handle);
+	if (status == RD_STATUS_SUCCESS)
+		status = disk_handle(handle)->streaming.wstatus;
+	if (status != RD_STATUS_SUCCESS)
+		logger(Disk, Error, "disk_close(), failed to write buffered data of '%s'",
+		       pfinfo->path);
+	disk_streaming_release(handle);
+
+	pthread_mutex_lock(&g_disk_inode_lock);
+	disk_handle(handle)->dev = 0;
+	disk_handle(handle)->ino = 0;
+	disk_handle(handle)->writer = False;
+	pthread_mutex_unlock(&g_disk_inode_lock);
+
+	if (pfinfo->accessmask & GENERIC_ALL || pfinfo->accessmask & GENERIC_WRITE ||
+	    pfinfo->delete_on_close)
+		dir_cache_invalidate(pfinfo->path);
+
 	if (pfinfo->pdir)
 	{
 		if (closedir(pfinfo->pdir) < 0)
@@ -551,14 +1160,11 @@ disk_close(RD_NTHANDLE handle)
 			return RD_STATUS_INVALID_HANDLE;
 		}
 
-		if (pfinfo->delete_on_close)
-			if (rmdir(pfinfo->path) < 0)
-			{
-				logger(Disk, Error, "disk_close(), rmdir() failed: %s",
-				       strerror(errno));
-				return RD_STATUS_ACCESS_DENIED;
-			}
-		pfinfo->delete_on_close = False;
+		if (pfinfo->delete_on_close && rmdir(pfinfo->path) < 0)
+		{
+			logger(Disk, Error, "disk_close(), rmdir() failed: %s", strerror(errno));
+			status = RD_STATUS_ACCESS_DENIED;
+		}
 	}
 	else
 	{
@@ -567,42 +1173,58 @@ disk_close(RD_NTHANDLE handle)
 			logger(Disk, Error, "disk_close(), close() failed: %s", strerror(errno));
 			return RD_STATUS_INVALID_HANDLE;
 		}
-		if (pfinfo->delete_on_close)
-			if (unlink(pfinfo->path) < 0)
-			{
-				logger(Disk, Error, "disk_close(), unlink() failed: %s",
-				       strerror(errno));
-				return RD_STATUS_ACCESS_DENIED;
-			}
 
-		pfinfo->delete_on_close = False;
+		if (pfinfo->delete_on_close && unlink(pfinfo->path) < 0)
+		{
+			logger(Disk, Error, "disk_close(), unlink() failed: %s", strerror(errno));
+			status = RD_STATUS_ACCESS_DENIED;
+		}
 	}
 
-	return RD_STATUS_SUCCESS;
+	/* the descriptor may be handed out again from here */
+	xfree(pfinfo->path);
+	xfree(pfinfo->pattern);
+	pfinfo->path = NULL;
+	pfinfo->pattern = NULL;
+	pfinfo->pdir = NULL;
+	pfinfo->delete_on_close = False;
+
+	return status;
 }
 
 static RD_NTSTATUS
-disk_read(RD_NTHANDLE handle, uint8 * data, uint32 length, uint64 offset, uint32 * result)
+disk_pread(RD_NTHANDLE handle, uint8 * data, uint32 length, uint64 offset, uint32 * result)
 {
-	int n;
+	ssize_t n;
 
 #if 0
 	/* browsing dir ????        */
 	/* each request is 24 bytes */
-	if (g_fileinfo[handle].flags_and_attributes & FILE_DIRECTORY_FILE)
+	if (disk_handle(handle)->info.flags_and_attributes & FILE_DIRECTORY_FILE)
 	{
 		*result = 0;
 		return STATUS_SUCCESS;
 	}
 #endif
 
-	lseek(handle, offset, SEEK_SET);
+	*result = 0;
+	while (*result < length)
+	{
+		n = pread(handle, data + *result, length - *result, offset + *result);
+		if (n == 0)
+			break;	/* end of file */
+		if (n > 0)
+		{
+			*result += n;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
 
-	n = read(handle, data, length);
+		/* report what was read before the error */
+		if (*result != 0)
+			break;
 
-	if (n < 0)
-	{
-		*result = 0;
 		switch (errno)
 		{
 			case EISDIR:
@@ -611,31 +1233,38 @@ disk_read(RD_NTHANDLE handle, uint8 * data, uint32 length, uint64 offset, uint32
 				/* return STATUS_FILE_IS_A_DIRECTORY; */
 				return RD_STATUS_NOT_IMPLEMENTED;
 			default:
-				logger(Disk, Error, "disk_read(), read failed: %s",
+				logger(Disk, Error, "disk_pread(), read failed: %s",
 				       strerror(errno));
 				return RD_STATUS_INVALID_PARAMETER;
 		}
 	}
 
-	*result = n;
-
 	return RD_STATUS_SUCCESS;
 }
 
 static RD_NTSTATUS
-disk_write(RD_NTHANDLE handle, uint8 * data, uint32 length, uint64 offset, uint32 * result)
+disk_pwrite(RD_NTHANDLE handle, uint8 * data, uint32 length, uint64 offset, uint32 * result)
 {
-	int n;
+	ssize_t n;
 
-	lseek(handle, offset, SEEK_SET);
+	*result = 0;
+	while (*result < length)
+	{
+		n = pwrite(handle, data + *result, length - *result, offset + *result);
+		if (n > 0)
+		{
+			*result += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
 
-	n = write(handle, data, length);
+		logger(Disk, Error, "disk_pwrite(), pwrite() failed: %s",
+		       n < 0 ? strerror(errno) : "no progress");
+		if (*result != 0)
+			break;
 
-	if (n < 0)
-	{
-		logger(Disk, Error, "disk_write(), write() failed: %s", strerror(errno));
-		*result = 0;
-		switch (errno)
+		switch (n < 0 ? errno : ENOSPC)
 		{
 			case ENOSPC:
 				return RD_STATUS_DISK_FULL;
@@ -644,11 +1273,237 @@ disk_write(RD_NTHANDLE handle, uint8 * data, uint32 length, uint64 offset, uint3
 		}
 	}
 
-	*result = n;
+	return RD_STATUS_SUCCESS;
+}
+
+/* Applications read redirected files in small sequential requests, and
+   write them the same way. Once a handle has been read sequentially a
+   few times, the kernel is told so, and each read from the file fetches
+   DISK_READAHEAD_SIZE bytes, from which the following requests are
+   served. Small writes that continue each other are gathered and
+   written together once DISK_WRITEBEHIND_SIZE is reached, on a write
+   elsewhere, and before the handle is read, queried, changed or closed.
+   A file may be open through several handles, so the buffers of the
+   others are written out or dropped before one of them is read,
+   written, queried or changed. IRPs of one handle are never run
+   concurrently, but those of the others are, so the buffers of a
+   handle are used under its stream_lock. */
+#define DISK_READAHEAD_SIZE	(64 * 1024)
+#define DISK_WRITEBEHIND_SIZE	(64 * 1024)
+/* Sequential reads seen before reading ahead */
+#define DISK_READAHEAD_AFTER	2
+
+
+/* Must be called with the stream_lock of the handle held */
+static RD_NTSTATUS
+disk_stream_flush(RD_NTHANDLE handle)
+{
+	DISK_STREAMING *ds = &disk_handle(handle)->streaming;
+	RD_NTSTATUS status;
+	uint32 result;
+
+	if (ds->wlength == 0)
+		return RD_STATUS_SUCCESS;
+
+	status = disk_pwrite(handle, ds->wbuf, ds->wlength, ds->woffset, &result);
+	if (status == RD_STATUS_SUCCESS && result != ds->wlength)
+		status = RD_STATUS_DISK_FULL;
+	ds->wlength = 0;
+
+	return status;
+}
+
+static RD_NTSTATUS
+disk_flush_writes(RD_NTHANDLE handle)
+{
+	DISK_HANDLE *dh = disk_handle(handle);
+	RD_NTSTATUS status;
+
+	pthread_mutex_lock(&dh->stream_lock);
+	status = disk_stream_flush(handle);
+	pthread_mutex_unlock(&dh->stream_lock);
+
+	return status;
+}
+
+/* Write out what is buffered and forget what was read ahead */
+static RD_NTSTATUS
+disk_stream_reset(RD_NTHANDLE handle)
+{
+	DISK_HANDLE *dh = disk_handle(handle);
+	RD_NTSTATUS status;
+
+	pthread_mutex_lock(&dh->stream_lock);
+	status = disk_stream_flush(handle);
+	dh->streaming.rlength = 0;
+	pthread_mutex_unlock(&dh->stream_lock);
+
+	return status;
+}
+
+static void
+disk_streaming_release(RD_NTHANDLE handle)
+{
+	DISK_HANDLE *dh = disk_handle(handle);
+	DISK_STREAMING *ds = &dh->streaming;
+
+	pthread_mutex_lock(&dh->stream_lock);
+	xfree(ds->rbuf);
+	xfree(ds->wbuf);
+	memset(ds, 0, sizeof(*ds));
+	pthread_mutex_unlock(&dh->stream_lock);
+}
+
+/* Must be called with the stream_lock of the handle held */
+static RD_NTSTATUS
+disk_stream_read(RD_NTHANDLE handle, uint8 * data, uint32 length, uint64 offset,
+		 uint32 * result)
+{
+	DISK_STREAMING *ds = &disk_handle(handle)->streaming;
+	RD_NTSTATUS status;
+
+	status = disk_stream_flush(handle);
+	if (status != RD_STATUS_SUCCESS)
+	{
+		*result = 0;
+		return status;
+	}
+
+	if (offset == ds->next_read)
+	{
+		ds->sequential++;
+	}
+	else
+	{
+		ds->sequential = 0;
+		ds->rlength = 0;
+	}
+	ds->next_read = offset + length;
+
+	if (ds->sequential < DISK_READAHEAD_AFTER || length >= DISK_READAHEAD_SIZE)
+		return disk_pread(handle, data, length, offset, result);
+
+#ifdef HAVE_POSIX_FADVISE
+	if (ds->sequential == DISK_READAHEAD_AFTER)
+		posix_fadvise(handle, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	/* refill when the request goes past what was read ahead */
+	if (offset < ds->roffset || offset + length > ds->roffset + ds->rlength)
+	{
+		if (ds->rbuf == NULL)
+			ds->rbuf = xmalloc(DISK_READAHEAD_SIZE);
+
+		ds->rlength = 0;
+		status = disk_pread(handle, ds->rbuf, DISK_READAHEAD_SIZE, offset, &ds->rlength);
+		ds->roffset = offset;
+		if (status != RD_STATUS_SUCCESS)
+		{
+			ds->rlength = 0;
+			*result = 0;
+			return status;
+		}
+	}
+
+	/* short of the end of file */
+	*result = MIN(length, ds->roffset + ds->rlength - offset);
+	memcpy(data, ds->rbuf + (offset - ds->roffset), *result);
 
 	return RD_STATUS_SUCCESS;
 }
 
+/* Must be called with the stream_lock of the handle held */
+static RD_NTSTATUS
+disk_stream_write(RD_NTHANDLE handle, uint8 * data, uint32 length, uint64 offset,
+		  uint32 * result)
+{
+	DISK_STREAMING *ds = &disk_handle(handle)->streaming;
+	RD_NTSTATUS status;
+
+	ds->rlength = 0;
+	disk_handle(handle)->attr_time = 0;
+
+	/* gather writes that continue the previous one */
+	if (ds->wlength != 0 && (offset != ds->woffset + ds->wlength ||
+				 ds->wlength + length > DISK_WRITEBEHIND_SIZE))
+	{
+		status = disk_stream_flush(handle);
+		if (status != RD_STATUS_SUCCESS)
+		{
+			*result = 0;
+			return status;
+		}
+	}
+
+	if (length >= DISK_WRITEBEHIND_SIZE / 2)
+		return disk_pwrite(handle, data, length, offset, result);
+
+	if (ds->wbuf == NULL)
+		ds->wbuf = xmalloc(DISK_WRITEBEHIND_SIZE);
+
+	if (ds->wlength == 0)
+		ds->woffset = offset;
+	memcpy(ds->wbuf + ds->wlength, data, length);
+	ds->wlength += length;
+	*result = length;
+
+	return RD_STATUS_SUCCESS;
+}
+
+static RD_NTSTATUS
+disk_read(RD_NTHANDLE handle, uint8 * data, uint32 length, uint64 offset, uint32 * result)
+{
+	DISK_HANDLE *dh = disk_handle(handle);
+	RD_NTSTATUS status;
+
+	disk_inode_sync(handle);
+	pthread_mutex_lock(&dh->stream_lock);
+	status = disk_stream_read(handle, data, length, offset, result);
+	pthread_mutex_unlock(&dh->stream_lock);
+
+	return status;
+}
+
+static RD_NTSTATUS
+disk_write(RD_NTHANDLE handle, uint8 * data, uint32 length, uint64 offset, uint32 * result)
+{
+	DISK_HANDLE *dh = disk_handle(handle);
+	RD_NTSTATUS status;
+
+	disk_inode_sync(handle);
+	pthread_mutex_lock(&dh->stream_lock);
+	status = disk_stream_write(handle, data, length, offset, result);
+	pthread_mutex_unlock(&dh->stream_lock);
+
+	return status;
+}
+
+/* Get the information about the file of a handle, which was most likely
+   just listed unless it is being written, through any handle */
+static RD_BOOL
+disk_attributes(RD_NTHANDLE handle, RD_BOOL writable, struct stat *st)
+{
+	DISK_HANDLE *dh = disk_handle(handle);
+	RD_BOOL cacheable;
+	uint64 now;
+
+	cacheable = !writable && !disk_inode_written(handle);
+	now = dir_cache_now();
+	if (!cacheable || dh->attr_time == 0 || now - dh->attr_time > DISK_ATTR_TTL)
+	{
+		if ((!cacheable || !dir_cache_stat(dh->info.path, &dh->attr)) &&
+		    fstat(handle, &dh->attr) != 0)
+		{
+			dh->attr_time = 0;
+			return False;
+		}
+		dh->attr_time = cacheable ? now : 0;
+	}
+
+	*st = dh->attr;
+	return True;
+}
+
 /* Btw, all used Flie* structures are described in [MS-FSCC] */
 RD_NTSTATUS
 disk_query_information(RD_NTHANDLE handle, uint32 info_class, STREAM out)
@@ -656,14 +1511,20 @@ disk_query_information(RD_NTHANDLE handle, uint32 info_class, STREAM out)
 	uint32 file_attributes, ft_high, ft_low;
 	struct stat filestat;
 	char *path, *filename;
+	RD_BOOL writable;
 
 	logger(Disk, Debug, "disk_query_information(handle=0x%x, info_class=0x%x)", handle,
 	       info_class);
 
-	path = g_fileinfo[handle].path;
+	path = disk_handle(handle)->info.path;
+	writable = disk_handle(handle)->info.accessmask & (GENERIC_ALL | GENERIC_WRITE);
 
-	/* Get information about file */
-	if (fstat(handle, &filestat) != 0)
+	/* the size may be waiting in the buffers of any handle */
+	disk_inode_sync(handle);
+	if (writable)
+		disk_flush_writes(handle);
+
+	if (!disk_attributes(handle, writable, &filestat))
 	{
 		logger(Disk, Error, "disk_query_information(), stat() failed: %s", strerror(errno));
 		out_uint8(out, 0);
@@ -754,9 +1615,14 @@ disk_set_information(RD_NTHANDLE handle, uint32 info_class, STREAM in, STREAM ou
 	logger(Disk, Debug, "disk_set_information(handle=0x%x, info_class=0x%x, ...)", handle,
 	       info_class);
 
-	pfinfo = &(g_fileinfo[handle]);
+	pfinfo = &disk_handle(handle)->info;
 	g_notify_stamp = True;
 	newname = NULL;
+	dir_cache_invalidate(pfinfo->path);
+
+	disk_inode_sync(handle);
+	disk_stream_reset(handle);
+	disk_handle(handle)->attr_time = 0;
 
 	switch (info_class)
 	{
@@ -855,6 +1721,7 @@ disk_set_information(RD_NTHANDLE handle, uint32 info_class, STREAM in, STREAM ou
 				newname);
 
 			free(newname);
+			dir_cache_invalidate(fullpath);
 
 			if (rename(pfinfo->path, fullpath) != 0)
 			{
@@ -949,20 +1816,302 @@ disk_set_information(RD_NTHANDLE handle, uint32 info_class, STREAM in, STREAM ou
 	return RD_STATUS_SUCCESS;
 }
 
+/* Directory change notifications are taken from inotify on Linux, which
+   reports what changed, or from kqueue on the BSDs, which only reports
+   that a directory changed, so the server is told to enumerate it
+   again. Changes are collected per handle from the first notify request
+   on, and handed to the server with the next pending request. Without
+   either, directories are scanned again after every change made through
+   this client, and compared with the previous scan. */
+#if defined(HAVE_SYS_INOTIFY_H)
+#define NOTIFY_INOTIFY
+#elif defined(HAVE_SYS_EVENT_H)
+#include <sys/event.h>
+#define NOTIFY_KQUEUE
+#endif
+
+/* Changes kept per handle, more make the server enumerate again */
+#define NOTIFY_MAX_CHANGES	64
+
+/* inotify or kqueue instance, -1 if there is none, -2 before the first use */
+static int g_notify_fd = -2;
+
+static void
+notify_init(void)
+{
+#if defined(NOTIFY_INOTIFY)
+	g_notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#elif defined(NOTIFY_KQUEUE)
+	g_notify_fd = kqueue();
+#else
+	g_notify_fd = -1;
+#endif
+
+	if (g_notify_fd >= 0)
+		evloop_add_fd(g_notify_fd, EVLOOP_READ);
+	else
+		logger(Disk, Debug, "notify_init(), falling back to scanning directories");
+}
+
+static void
+notify_release(RD_NTHANDLE handle)
+{
+	NOTIFY_WATCH *w = &disk_handle(handle)->notify;
+	unsigned int i;
+
+	if (!w->active)
+		return;
+
+	for (i = 0; i < w->num_changes; i++)
+		free(w->changes[i].name);
+	xfree(w->changes);
+
+#ifdef NOTIFY_INOTIFY
+	/* handles of the same directory share the watch */
+	for (i = 0; i < g_disk_handles_limit; i++)
+		if (i != handle && disk_handle(i)->notify.active && disk_handle(i)->notify.wd == w->wd)
+			break;
+	if (w->wd != -1 && i == g_disk_handles_limit)
+		inotify_rm_watch(g_notify_fd, w->wd);
+#endif
+
+	memset(w, 0, sizeof(*w));
+}
+
+#ifdef NOTIFY_INOTIFY
+static void
+notify_add_change(NOTIFY_WATCH * w, uint32 action, const char *name)
+{
+	NOTIFY_CHANGE *last;
+
+	/* a file being written reports the same change many times */
+	last = w->num_changes ? &w->changes[w->num_changes - 1] : NULL;
+	if (last != NULL && last->action == action && strcmp(last->name, name) == 0)
+		return;
+
+	if (w->num_changes == NOTIFY_MAX_CHANGES)
+	{
+		w->enum_dir = True;
+		return;
+	}
+
+	w->changes = xrealloc(w->changes, (w->num_changes + 1) * sizeof(NOTIFY_CHANGE));
+	w->changes[w->num_changes].action = action;
+	w->changes[w->num_changes].name = xstrdup(name);
+	w->num_changes++;
+}
+
+/* Record ev, and the IN_MOVED_TO event next when it ends the same rename,
+   with every handle watching the directory */
+static void
+notify_dispatch(const struct inotify_event *ev, const struct inotify_event *next)
+{
+	uint32 name_filter, action;
+	NOTIFY_WATCH *w;
+	unsigned int i;
+
+	name_filter = (ev->mask & IN_ISDIR) ? FILE_NOTIFY_CHANGE_DIR_NAME :
+		FILE_NOTIFY_CHANGE_FILE_NAME;
+
+	for (i = 0; i < g_disk_handles_limit; i++)
+	{
+		w = &disk_handle(i)->notify;
+		if (!w->active || w->wd != ev->wd)
+			continue;
+
+		if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+		{
+			w->enum_dir = True;
+			if (ev->mask & IN_IGNORED)
+				w->wd = -1;
+			continue;
+		}
+
+		if (ev->len == 0)
+			continue;
+
+		if (ev->mask & IN_MOVED_FROM && next != NULL)
+		{
+			if (w->filter & name_filter)
+			{
+				notify_add_change(w, FILE_ACTION_RENAMED_OLD_NAME, ev->name);
+				notify_add_change(w, FILE_ACTION_RENAMED_NEW_NAME, next->name);
+			}
+			continue;
+		}
+
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+		{
+			action = FILE_ACTION_ADDED;
+			if (!(w->filter & name_filter))
+				continue;
+		}
+		else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+		{
+			action = FILE_ACTION_REMOVED;
+			if (!(w->filter & name_filter))
+				continue;
+		}
+		else if (ev->mask & IN_MODIFY)
+		{
+			action = FILE_ACTION_MODIFIED;
+			if (!(w->filter & (FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE)))
+				continue;
+		}
+		else if (ev->mask & IN_ATTRIB)
+		{
+			action = FILE_ACTION_MODIFIED;
+			if (!(w->filter & (FILE_NOTIFY_CHANGE_ATTRIBUTES |
+					   FILE_NOTIFY_CHANGE_LAST_WRITE |
+					   FILE_NOTIFY_CHANGE_SECURITY | FILE_NOTIFY_CHANGE_EA)))
+				continue;
+		}
+		else
+			continue;
+
+		notify_add_change(w, action, ev->name);
+	}
+}
+#endif
+
+/* Collect the directory changes reported since the last call */
+void
+disk_collect_notify(void)
+{
+#if defined(NOTIFY_INOTIFY)
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev, *next;
+	ssize_t n;
+	char *p;
+	unsigned int i;
+
+	if (g_notify_fd < 0 || !(evloop_check_fd(g_notify_fd) & EVLOOP_READ))
+		return;
+
+	while ((n = read(g_notify_fd, buf, sizeof(buf))) > 0)
+	{
+		for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len)
+		{
+			ev = (const struct inotify_event *) p;
+
+			if (ev->mask & IN_Q_OVERFLOW)
+			{
+				for (i = 0; i < g_disk_handles_limit; i++)
+					disk_handle(i)->notify.enum_dir = True;
+				continue;
+			}
+
+			/* a rename within the directory comes as two events */
+			next = NULL;
+			if (ev->mask & IN_MOVED_FROM &&
+			    p + sizeof(struct inotify_event) + ev->len < buf + n)
+			{
+				next = (const struct inotify_event *) (p +
+								       sizeof(struct inotify_event)
+								       + ev->len);
+				if (!(next->mask & IN_MOVED_TO) || next->cookie != ev->cookie ||
+				    next->wd != ev->wd || next->len == 0)
+					next = NULL;
+			}
+
+			notify_dispatch(ev, next);
+			if (next != NULL)
+			{
+				p += sizeof(struct inotify_event) + ev->len;
+				ev = next;
+			}
+		}
+	}
+#elif defined(NOTIFY_KQUEUE)
+	struct kevent evs[32];
+	struct timespec ts;
+	int i, n;
+
+	if (g_notify_fd < 0 || !(evloop_check_fd(g_notify_fd) & EVLOOP_READ))
+		return;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 0;
+	while ((n = kevent(g_notify_fd, NULL, 0, evs, 32, &ts)) > 0)
+		for (i = 0; i < n; i++)
+			if (evs[i].ident < g_disk_handles_limit &&
+			    disk_handle(evs[i].ident)->notify.active)
+				disk_handle(evs[i].ident)->notify.enum_dir = True;
+#endif
+}
+
+/* Complete a pending notify request with the FILE_NOTIFY_INFORMATION
+   records of the changes seen, or return RD_STATUS_PENDING */
 RD_NTSTATUS
-disk_check_notify(RD_NTHANDLE handle)
+disk_check_notify(RD_NTHANDLE handle, STREAM out)
 {
 	struct fileinfo *pfinfo;
 	RD_NTSTATUS status = RD_STATUS_PENDING;
+	NOTIFY_WATCH *w;
 	NOTIFY notify;
+	STREAM name;
+	unsigned int i;
+	size_t size, start;
 
 	logger(Disk, Debug, "disk_check_notify(handle=0x%x)", handle);
 
-	pfinfo = &(g_fileinfo[handle]);
+	pfinfo = &disk_handle(handle)->info;
 	if (!pfinfo->pdir)
 		return RD_STATUS_INVALID_DEVICE_REQUEST;
 
+	w = &disk_handle(handle)->notify;
+	if (w->active)
+	{
+		if (w->enum_dir)
+		{
+			status = RD_STATUS_NOTIFY_ENUM_DIR;
+		}
+		else if (w->num_changes != 0)
+		{
+			status = RD_STATUS_SUCCESS;
+			for (i = 0; i < w->num_changes; i++)
+			{
+				name = s_alloc(PATH_MAX * 4);
+				out_utf16s_no_eos(name, w->changes[i].name);
+				s_mark_end(name);
+
+				/* entries are aligned to 4 bytes */
+				size = 12 + s_length(name);
+				if (i + 1 < w->num_changes)
+					size = (size + 3) & ~3;
+
+				if (size > s_left(out))
+				{
+					s_free(name);
+					s_reset(out);
+					status = RD_STATUS_NOTIFY_ENUM_DIR;
+					break;
+				}
 
+				start = s_tell(out);
+				out_uint32_le(out, i + 1 < w->num_changes ? size : 0);	/* NextEntryOffset */
+				out_uint32_le(out, w->changes[i].action);
+				out_uint32_le(out, s_length(name));	/* FileNameLength */
+				out_stream(out, name);
+				out_uint8s(out, size - (s_tell(out) - start));
+				s_free(name);
+			}
+		}
+
+		if (status != RD_STATUS_PENDING)
+		{
+			for (i = 0; i < w->num_changes; i++)
+				free(w->changes[i].name);
+			w->num_changes = 0;
+			w->enum_dir = False;
+		}
+
+		s_mark_end(out);
+		return status;
+	}
+
+	if (!g_notify_stamp)
+		return RD_STATUS_PENDING;
 
 	status = NotifyInfo(handle, pfinfo->info_class, &notify);
 
@@ -977,24 +2126,53 @@ disk_check_notify(RD_NTHANDLE handle)
 	}
 
 	return status;
-
-
 }
 
 RD_NTSTATUS
 disk_create_notify(RD_NTHANDLE handle, uint32 info_class)
 {
 	struct fileinfo *pfinfo;
+	NOTIFY_WATCH *w;
 	RD_NTSTATUS ret = RD_STATUS_PENDING;
 
 	logger(Disk, Debug, "disk_create_notify(handle=0x%x, info_class=0x%x)", handle, info_class);
 
-	pfinfo = &(g_fileinfo[handle]);
+	pfinfo = &disk_handle(handle)->info;
 	pfinfo->info_class = info_class;
 
+	if (g_notify_fd == -2)
+		notify_init();
+
+	w = &disk_handle(handle)->notify;
+	if (g_notify_fd >= 0 && !w->active)
+	{
+#if defined(NOTIFY_INOTIFY)
+		w->wd = inotify_add_watch(g_notify_fd, pfinfo->path,
+					  IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+					  IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF |
+					  IN_ONLYDIR);
+		w->active = w->wd != -1;
+#elif defined(NOTIFY_KQUEUE)
+		struct kevent kev;
+
+		EV_SET(&kev, handle, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+		       NOTE_WRITE | NOTE_EXTEND | NOTE_ATTRIB | NOTE_DELETE | NOTE_RENAME, 0, NULL);
+		w->active = kevent(g_notify_fd, &kev, 1, NULL, 0, NULL) == 0;
+#endif
+		if (!w->active)
+			logger(Disk, Warning, "disk_create_notify(), failed to watch '%s': %s",
+			       pfinfo->path, strerror(errno));
+	}
+
+	if (w->active)
+	{
+		w->filter = info_class;
+		return RD_STATUS_PENDING;
+	}
+
 	ret = NotifyInfo(handle, info_class, &pfinfo->notify);
 
-	if (info_class & 0x1000)
+	if (info_class & FILE_NOTIFY_CHANGE_LAST_WRITE)
 	{			/* ???? */
 		if (ret == RD_STATUS_PENDING)
 			return RD_STATUS_SUCCESS;
@@ -1017,7 +2195,7 @@ NotifyInfo(RD_NTHANDLE handle, uint32 info_class, NOTIFY * p)
 	char *fullname;
 	DIR *dpr;
 
-	pfinfo = &(g_fileinfo[handle]);
+	pfinfo = &disk_handle(handle)->info;
 	if (fstat(handle, &filestat) < 0)
 	{
 		logger(Disk, Error, "NotifyInfo(), fstat failed: %s", strerror(errno));
@@ -1057,32 +2235,30 @@ NotifyInfo(RD_NTHANDLE handle, uint32 info_class, NOTIFY * p)
 	return RD_STATUS_PENDING;
 }
 
-static FsInfoType *
-FsVolumeInfo(char *fpath)
+static void
+FsVolumeInfo(char *fpath, FsInfoType * info)
 {
-
-	static FsInfoType info;
 #ifdef USE_SETMNTENT
 	FILE *fdfs;
 	struct mntent *e;
 #endif
 
 	/* initialize */
-	memset(&info, 0, sizeof(info));
-	strcpy(info.label, "RDESKTOP");
-	strcpy(info.type, "RDPFS");
+	memset(info, 0, sizeof(*info));
+	strcpy(info->label, "RDESKTOP");
+	strcpy(info->type, "RDPFS");
 
 #ifdef USE_SETMNTENT
 	fdfs = setmntent(MNTENT_PATH, "r");
 	if (!fdfs)
-		return &info;
+		return;
 
 	while ((e = getmntent(fdfs)))
 	{
 		if (str_startswith(e->mnt_dir, fpath))
 		{
-			strcpy(info.type, e->mnt_type);
-			strcpy(info.name, e->mnt_fsname);
+			strcpy(info->type, e->mnt_type);
+			strcpy(info->name, e->mnt_fsname);
 			if (strstr(e->mnt_opts, "vfat") || strstr(e->mnt_opts, "iso9660"))
 			{
 				int fd = open(e->mnt_fsname, O_RDONLY);
@@ -1093,20 +2269,20 @@ FsVolumeInfo(char *fpath)
 					if (strstr(e->mnt_opts, "vfat"))
 						 /*FAT*/
 					{
-						strcpy(info.type, "vfat");
+						strcpy(info->type, "vfat");
 						read(fd, buf, sizeof(buf));
-						info.serial =
+						info->serial =
 							(buf[42] << 24) + (buf[41] << 16) +
 							(buf[40] << 8) + buf[39];
-						strncpy(info.label, (char *) buf + 43, 10);
-						info.label[10] = '\0';
+						memcpy(info->label, buf + 43, 10);
+						info->label[10] = '\0';
 					}
 					else if (lseek(fd, 32767, SEEK_SET) >= 0)	/* ISO9660 */
 					{
 						read(fd, buf, sizeof(buf));
-						strncpy(info.label, (char *) buf + 41, 32);
-						info.label[32] = '\0';
-						/* info.Serial = (buf[128]<<24)+(buf[127]<<16)+(buf[126]<<8)+buf[125]; */
+						memcpy(info->label, buf + 41, 32);
+						info->label[32] = '\0';
+						/* info->Serial = (buf[128]<<24)+(buf[127]<<16)+(buf[126]<<8)+buf[125]; */
 					}
 					close(fd);
 				}
@@ -1114,38 +2290,75 @@ FsVolumeInfo(char *fpath)
 		}
 	}
 	endmntent(fdfs);
-#else
-	/* initialize */
-	memset(&info, 0, sizeof(info));
-	strcpy(info.label, "RDESKTOP");
-	strcpy(info.type, "RDPFS");
-
 #endif
-	return &info;
 }
 
+/* Get the information about the volume the file of a handle is on
+   into volume */
+static RD_BOOL
+disk_volume_get(RD_NTHANDLE handle, DISK_VOLUME * volume)
+{
+	DISK_VOLUME *v = NULL;
+	char *path = disk_handle(handle)->info.path;
+	dev_t dev = disk_handle(handle)->dev;
+	uint64 now;
+	RD_BOOL ok = True;
+	int i;
+
+	pthread_mutex_lock(&g_disk_volume_lock);
+
+	/* or the one taken longest ago */
+	for (i = 0; i < DISK_VOLUME_CACHE; i++)
+	{
+		if (g_disk_volume[i].dev == dev && g_disk_volume[i].time != 0)
+		{
+			v = &g_disk_volume[i];
+			break;
+		}
+		if (v == NULL || g_disk_volume[i].time < v->time)
+			v = &g_disk_volume[i];
+	}
+
+	now = dir_cache_now();
+	if (v->dev != dev || v->time == 0 || now - v->time > DISK_VOLUME_TTL)
+	{
+		v->dev = dev;
+		ok = STATFS_FN(path, &v->stat_fs) == 0;
+		if (ok)
+		{
+			FsVolumeInfo(path, &v->fsinfo);
+			v->time = now;
+		}
+		else
+			v->time = 0;
+	}
+	if (ok)
+		*volume = *v;
+	pthread_mutex_unlock(&g_disk_volume_lock);
+
+	return ok;
+}
 
 RD_NTSTATUS
 disk_query_volume_information(RD_NTHANDLE handle, uint32 info_class, STREAM out)
 {
 	struct STATFS_T stat_fs;
-	struct fileinfo *pfinfo;
+	DISK_VOLUME volume;
 	FsInfoType *fsinfo;
 	STREAM stmp;
 
 	logger(Disk, Debug, "disk_query_volume_information(handle=0x%x, info_class=0x%x)", handle,
 	       info_class);
 
-	pfinfo = &(g_fileinfo[handle]);
-
-	if (STATFS_FN(pfinfo->path, &stat_fs) != 0)
+	if (!disk_volume_get(handle, &volume))
 	{
 		logger(Disk, Error, "disk_query_volume_information(), statfs() failed: %s",
 		       strerror(errno));
 		return RD_STATUS_ACCESS_DENIED;
 	}
 
-	fsinfo = FsVolumeInfo(pfinfo->path);
+	stat_fs = volume.stat_fs;
+	fsinfo = &volume.fsinfo;
 
 	switch (info_class)
 	{
@@ -1212,19 +2425,18 @@ RD_NTSTATUS
 disk_query_directory(RD_NTHANDLE handle, uint32 info_class, char *pattern, STREAM out)
 {
 	uint32 file_attributes, ft_low, ft_high;
-	char *dirname, fullpath[PATH_MAX];
-	DIR *pdir;
-	struct dirent *pdirent;
+	DIR_SNAPSHOT *snap;
+	DIR_ENTRY *entry;
 	struct stat filestat;
 	struct fileinfo *pfinfo;
+	DISK_HANDLE *dh;
 	STREAM stmp;
 
 	logger(Disk, Debug, "disk_query_directory(handle=0x%x, info_class=0x%x, pattern=%s, ...)",
 	       handle, info_class, pattern);
 
-	pfinfo = &(g_fileinfo[handle]);
-	pdir = pfinfo->pdir;
-	dirname = pfinfo->path;
+	dh = disk_handle(handle);
+	pfinfo = &dh->info;
 	file_attributes = 0;
 
 	switch (info_class)
@@ -1237,23 +2449,42 @@ disk_query_directory(RD_NTHANDLE handle, uint32 info_class, char *pattern, STREA
 			/* If a search pattern is received, remember this pattern, and restart search */
 			if (pattern != NULL && pattern[0] != 0)
 			{
-				strncpy(pfinfo->pattern, 1 + strrchr(pattern, '/'), PATH_MAX - 1);
-				rewinddir(pdir);
+				xfree(pfinfo->pattern);
+				pfinfo->pattern = xstrdup(1 + strrchr(pattern, '/'));
+				dir_snapshot_release(dh->dir_snapshot);
+				dh->dir_snapshot = NULL;
+			}
+
+			if (dh->dir_snapshot == NULL)
+			{
+				dh->dir_snapshot = dir_snapshot_get(pfinfo->path);
+				dh->dir_position = 0;
+				if (dh->dir_snapshot == NULL)
+				{
+					out_uint8(out, 0);
+					return RD_STATUS_ACCESS_DENIED;
+				}
 			}
 
-			/* find next dirent matching pattern */
-			pdirent = readdir(pdir);
-			while (pdirent && fnmatch(pfinfo->pattern, pdirent->d_name, 0) != 0)
-				pdirent = readdir(pdir);
+			/* find next entry matching pattern */
+			snap = dh->dir_snapshot;
+			entry = NULL;
+			while (dh->dir_position < snap->num_entries)
+			{
+				entry = &snap->entries[dh->dir_position++];
+				if (pfinfo->pattern != NULL && fnmatch(pfinfo->pattern, entry->name, 0) == 0)
+					break;
+				entry = NULL;
+			}
 
-			if (pdirent == NULL)
+			if (entry == NULL)
 				return RD_STATUS_NO_MORE_FILES;
 
 			/* Get information for directory entry */
-			sprintf(fullpath, "%s/%s", dirname, pdirent->d_name);
-
-			if (stat(fullpath, &filestat))
+			filestat = entry->st;
+			if (entry->error != 0)
 			{
+				errno = entry->error;
 				switch (errno)
 				{
 					case ENOENT:
@@ -1275,7 +2506,7 @@ disk_query_directory(RD_NTHANDLE handle, uint32 info_class, char *pattern, STREA
 
 			if (S_ISDIR(filestat.st_mode))
 				file_attributes |= FILE_ATTRIBUTE_DIRECTORY;
-			if (pdirent->d_name[0] == '.')
+			if (entry->name[0] == '.')
 				file_attributes |= FILE_ATTRIBUTE_HIDDEN;
 			if (!file_attributes)
 				file_attributes |= FILE_ATTRIBUTE_NORMAL;
@@ -1296,7 +2527,7 @@ disk_query_directory(RD_NTHANDLE handle, uint32 info_class, char *pattern, STREA
 
 	// Write entry name as utf16 into stmp
 	stmp = s_alloc(PATH_MAX * 4);
-	out_utf16s_no_eos(stmp, pdirent->d_name);
+	out_utf16s_no_eos(stmp, entry->name);
 	s_mark_end(stmp);
 
 	switch (info_class)
@@ -78,7 +78,23 @@
 #define ERROR_FILE_NOT_FOUND			2L
 #define ERROR_ALREADY_EXISTS			183L
 
-#define	MAX_OPEN_FILES	0x100
+#define FILE_NOTIFY_CHANGE_FILE_NAME		0x00000001
+#define FILE_NOTIFY_CHANGE_DIR_NAME		0x00000002
+#define FILE_NOTIFY_CHANGE_ATTRIBUTES		0x00000004
+#define FILE_NOTIFY_CHANGE_SIZE			0x00000008
+#define FILE_NOTIFY_CHANGE_LAST_WRITE		0x00000010
+#define FILE_NOTIFY_CHANGE_LAST_ACCESS		0x00000020
+#define FILE_NOTIFY_CHANGE_CREATION		0x00000040
+#define FILE_NOTIFY_CHANGE_EA			0x00000080
+#define FILE_NOTIFY_CHANGE_SECURITY		0x00000100
+
+#define FILE_ACTION_ADDED			0x00000001
+#define FILE_ACTION_REMOVED			0x00000002
+#define FILE_ACTION_MODIFIED			0x00000003
+#define FILE_ACTION_RENAMED_OLD_NAME		0x00000004
+#define FILE_ACTION_RENAMED_NEW_NAME		0x00000005
+
+#define	MAX_OPEN_FILES	0x10000
 
 typedef enum _FILE_INFORMATION_CLASS
 {
@@ -23,6 +23,13 @@
 #define MAX_DVC_CHANNELS 20
 #define INVALID_CHANNEL ((uint32)-1)
 
+/* Largest message reassembled from DATA_FIRST and DATA PDUs */
+#define DVC_MAX_MESSAGE (64 * 1024 * 1024)
+
+/* Buckets of the channel id index, a power of two */
+#define DVC_ID_HASH_SIZE 32
+#define DVC_ID_HASH(id) (((id) ^ ((id) >> 5)) & (DVC_ID_HASH_SIZE - 1))
+
 #define DYNVC_CREATE_REQ		0x01
 #define DYNVC_DATA_FIRST		0x02
 #define DYNVC_DATA			0x03
@@ -44,15 +51,33 @@ typedef union dvc_hdr_t
 	} hdr;
 } dvc_hdr_t;
 
+/* A PDU waiting in the send queue of a channel */
+typedef struct dvc_pdu_t
+{
+	STREAM s;
+	struct dvc_pdu_t *next;
+} dvc_pdu_t;
+
 typedef struct dvc_channel_t
 {
 	uint32 hash;
 	uint32 channel_id;
 	dvc_channel_process_fn handler;
+	dvc_channel_open_fn open;
+	STREAM fragment;	/* message being reassembled from DATA_FIRST */
+	uint32 discard;		/* bytes still to come of a dropped message */
+	int priority;		/* DVC_PRIORITY_* */
+	dvc_pdu_t *queue, *queue_tail;
+	size_t deficit;		/* bytes a bulk channel may still send this round */
+	RD_BOOL instances;	/* the server may open it more than once */
+	struct dvc_channel_t *id_next;	/* channels_by_id chain */
 } dvc_channel_t;
 
 static VCHANNEL *dvc_channel;
 static dvc_channel_t channels[MAX_DVC_CHANNELS];
+static dvc_channel_t *channels_by_id[DVC_ID_HASH_SIZE];
+static int dvc_bulk_next;	/* where the next bulk round starts */
+static uint32 dvc_handling = INVALID_CHANNEL;	/* channel of the data being handled */
 
 static uint32 dvc_in_channelid(STREAM s, dvc_hdr_t hdr);
 
@@ -71,24 +96,22 @@ dvc_channels_exists(const char *name)
 	return False;
 }
 
-static const dvc_channel_t *
+static dvc_channel_t *
 dvc_channels_get_by_id(uint32 id)
 {
-	int i;
+	dvc_channel_t *ch;
 
-	for (i = 0; i < MAX_DVC_CHANNELS; i++)
+	for (ch = channels_by_id[DVC_ID_HASH(id)]; ch != NULL; ch = ch->id_next)
 	{
-		if (channels[i].channel_id == id)
-		{
-			return &channels[i];
-		}
+		if (ch->channel_id == id)
+			return ch;
 	}
 
 	return NULL;
 }
 
-static uint32
-dvc_channels_get_id(const char *name)
+static dvc_channel_t *
+dvc_channels_get_by_name(const char *name)
 {
 	int i;
 	uint32 hash;
@@ -98,31 +121,81 @@ dvc_channels_get_id(const char *name)
 	{
 		if (channels[i].hash == hash)
 		{
-			return channels[i].channel_id;
+			return &channels[i];
 		}
 	}
 
-	return INVALID_CHANNEL;
+	return NULL;
 }
 
-static RD_BOOL
-dvc_channels_remove_by_id(uint32 channelid)
+/* Take a channel out of the id index */
+static void
+dvc_channels_unindex(dvc_channel_t * ch)
 {
-	int i;
+	dvc_channel_t **prev;
 
-	for (i = 0; i < MAX_DVC_CHANNELS; i++)
+	if (ch->channel_id == INVALID_CHANNEL)
+		return;
+
+	for (prev = &channels_by_id[DVC_ID_HASH(ch->channel_id)]; *prev != NULL;
+	     prev = &(*prev)->id_next)
 	{
-		if (channels[i].channel_id == channelid)
+		if (*prev == ch)
 		{
-			memset(&channels[i], 0, sizeof(dvc_channel_t));
-			return True;
+			*prev = ch->id_next;
+			break;
 		}
 	}
-	return False;
+	ch->id_next = NULL;
+}
+
+static void
+dvc_channels_clear_queue(dvc_channel_t * ch)
+{
+	dvc_pdu_t *pdu;
+
+	while (ch->queue != NULL)
+	{
+		pdu = ch->queue;
+		ch->queue = pdu->next;
+		s_free(pdu->s);
+		xfree(pdu);
+	}
+	ch->queue_tail = NULL;
+	ch->deficit = 0;
 }
 
 static RD_BOOL
-dvc_channels_add(const char *name, dvc_channel_process_fn handler, uint32 channel_id)
+dvc_channels_remove_by_id(uint32 channelid)
+{
+	dvc_channel_t *ch;
+	int i, count;
+
+	ch = dvc_channels_get_by_id(channelid);
+	if (ch == NULL)
+		return False;
+
+	dvc_channels_unindex(ch);
+	dvc_channels_clear_queue(ch);
+	if (ch->fragment != NULL)
+		s_free(ch->fragment);
+	ch->fragment = NULL;
+	ch->discard = 0;
+
+	/* the last instance of a channel keeps it registered */
+	for (i = 0, count = 0; i < MAX_DVC_CHANNELS; i++)
+		if (channels[i].hash == ch->hash)
+			count++;
+	if (ch->instances && count == 1)
+		ch->channel_id = INVALID_CHANNEL;
+	else
+		memset(ch, 0, sizeof(dvc_channel_t));
+	return True;
+}
+
+static RD_BOOL
+dvc_channels_add(const char *name, dvc_channel_process_fn handler, dvc_channel_open_fn open,
+		 int priority, uint32 channel_id)
 {
 	int i;
 	uint32 hash;
@@ -141,6 +214,8 @@ dvc_channels_add(const char *name, dvc_channel_process_fn handler, uint32 channe
 			hash = utils_djb2_hash(name);
 			channels[i].hash = hash;
 			channels[i].handler = handler;
+			channels[i].open = open;
+			channels[i].priority = priority;
 			channels[i].channel_id = channel_id;
 			logger(Core, Debug,
 			       "dvc_channels_add(), Added hash=%x, channel_id=%d, name=%s, handler=%p",
@@ -157,47 +232,97 @@ dvc_channels_add(const char *name, dvc_channel_process_fn handler, uint32 channe
 static int
 dvc_channels_set_id(const char *name, uint32 channel_id)
 {
+	dvc_channel_t *ch, **bucket;
 	int i;
-	uint32 hash;
 
-	hash = utils_djb2_hash(name);
+	ch = dvc_channels_get_by_name(name);
+	if (ch == NULL)
+		return -1;
 
-	for (i = 0; i < MAX_DVC_CHANNELS; i++)
+	/* a channel that may be opened more than once gets a slot for
+	   each instance */
+	if (ch->instances && ch->channel_id != INVALID_CHANNEL)
 	{
-		if (channels[i].hash == hash)
+		for (i = 0; i < MAX_DVC_CHANNELS && channels[i].hash != 0; i++);
+		if (i == MAX_DVC_CHANNELS)
 		{
-			logger(Core, Debug, "dvc_channels_set_id(), name = '%s', channel_id = %d",
-			       name, channel_id);
-			channels[i].channel_id = channel_id;
-			return 0;
+			logger(Core, Warning,
+			       "dvc_channels_set_id(), no room for another instance of '%s'", name);
+			return -1;
 		}
+		channels[i] = *ch;
+		channels[i].fragment = NULL;
+		channels[i].discard = 0;
+		channels[i].queue = channels[i].queue_tail = NULL;
+		channels[i].deficit = 0;
+		channels[i].id_next = NULL;
+		channels[i].channel_id = INVALID_CHANNEL;
+		ch = &channels[i];
 	}
 
-	return -1;
+	logger(Core, Debug, "dvc_channels_set_id(), name = '%s', channel_id = %d", name,
+	       channel_id);
+
+	/* a new channel id makes anything still queued for the old one stale */
+	dvc_channels_unindex(ch);
+	dvc_channels_clear_queue(ch);
+	ch->channel_id = channel_id;
+
+	bucket = &channels_by_id[DVC_ID_HASH(channel_id)];
+	ch->id_next = *bucket;
+	*bucket = ch;
+	return 0;
 }
 
 RD_BOOL
 dvc_channels_is_available(const char *name)
 {
-	int i;
-	uint32 hash;
-	hash = utils_djb2_hash(name);
+	dvc_channel_t *ch;
 
-	for (i = 0; i < MAX_DVC_CHANNELS; i++)
-	{
-		if (channels[i].hash == hash)
-		{
-			return (channels[i].channel_id != INVALID_CHANNEL);
-		}
-	}
+	ch = dvc_channels_get_by_name(name);
+	return (ch != NULL && ch->channel_id != INVALID_CHANNEL);
+}
 
-	return False;
+/* Register a channel by name, open is called when the server has
+   created it and may be NULL. The priority, DVC_PRIORITY_*, decides
+   how its sends are scheduled against those of other channels. */
+RD_BOOL
+dvc_channels_register(const char *name, dvc_channel_process_fn handler,
+		      dvc_channel_open_fn open, int priority)
+{
+	return dvc_channels_add(name, handler, open, priority, INVALID_CHANNEL);
 }
 
+/* Register a channel the server may open several instances of, the
+   handler tells them apart with dvc_channel_id() and answers with
+   dvc_send_to() */
 RD_BOOL
-dvc_channels_register(const char *name, dvc_channel_process_fn handler)
+dvc_channels_register_instances(const char *name, dvc_channel_process_fn handler,
+				dvc_channel_open_fn open, int priority)
+{
+	dvc_channel_t *ch;
+
+	if (!dvc_channels_add(name, handler, open, priority, INVALID_CHANNEL))
+		return False;
+
+	ch = dvc_channels_get_by_name(name);
+	ch->instances = True;
+	return True;
+}
+
+/* The channel id of the instance whose data the handler is given */
+uint32
+dvc_channel_id(void)
 {
-	return dvc_channels_add(name, handler, INVALID_CHANNEL);
+	return dvc_handling;
+}
+
+static void
+dvc_dispatch(dvc_channel_t * ch, STREAM s)
+{
+	dvc_handling = ch->channel_id;
+	ch->handler(s);
+	dvc_handling = INVALID_CHANNEL;
 }
 
 
@@ -240,35 +365,188 @@ dvc_init_packet(dvc_hdr_t hdr, uint32 channelid, size_t length)
 	return s;
 }
 
+/* A DVC PDU has to fit in one chunk of the static channel */
+#define DVC_CHUNK_LENGTH 1600
+
+/* Bytes a bulk channel may send per round */
+#define DVC_BULK_QUANTUM (4 * DVC_CHUNK_LENGTH)
+
+static void
+dvc_queue_pdu(dvc_channel_t * ch, STREAM s)
+{
+	dvc_pdu_t *pdu;
+
+	pdu = xmalloc(sizeof(dvc_pdu_t));
+	pdu->s = s;
+	pdu->next = NULL;
+	if (ch->queue_tail != NULL)
+		ch->queue_tail->next = pdu;
+	else
+		ch->queue = pdu;
+	ch->queue_tail = pdu;
+}
+
+/* Send the PDU at the head of the queue of a channel, returning its
+   length */
+static size_t
+dvc_send_pdu(dvc_channel_t * ch)
+{
+	dvc_pdu_t *pdu = ch->queue;
+	size_t length;
+
+	ch->queue = pdu->next;
+	if (ch->queue == NULL)
+		ch->queue_tail = NULL;
+
+	length = s_length(pdu->s);
+	channel_send(pdu->s, dvc_channel);
+	s_free(pdu->s);
+	xfree(pdu);
+	return length;
+}
+
+/* Send what the channels have queued. Interactive channels send
+   everything right away. Bulk channels take turns, deficit round
+   robin, sending at most a quantum each per call, so that a large
+   transfer does not hold back the other channels and the handling of
+   the data the server sends. */
 void
-dvc_send(const char *name, STREAM s)
+dvc_flush(void)
+{
+	dvc_channel_t *ch;
+	int i, n;
+
+	for (i = 0; i < MAX_DVC_CHANNELS; i++)
+	{
+		ch = &channels[i];
+		if (ch->priority != DVC_PRIORITY_INTERACTIVE)
+			continue;
+		while (ch->queue != NULL)
+			dvc_send_pdu(ch);
+	}
+
+	for (n = 0; n < MAX_DVC_CHANNELS; n++)
+	{
+		ch = &channels[(dvc_bulk_next + n) % MAX_DVC_CHANNELS];
+		if (ch->priority != DVC_PRIORITY_BULK || ch->queue == NULL)
+			continue;
+
+		ch->deficit += DVC_BULK_QUANTUM;
+		while (ch->queue != NULL && (size_t) s_length(ch->queue->s) <= ch->deficit)
+			ch->deficit -= dvc_send_pdu(ch);
+		if (ch->queue == NULL)
+			ch->deficit = 0;
+	}
+	dvc_bulk_next = (dvc_bulk_next + 1) % MAX_DVC_CHANNELS;
+}
+
+/* Milliseconds until dvc_flush() has something to send, or -1. Queued
+   bulk data is only due while the socket can take more, otherwise the
+   main loop is woken up for it once the socket has room again. */
+int
+dvc_send_timeout(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_DVC_CHANNELS; i++)
+	{
+		if (channels[i].queue != NULL)
+			break;
+	}
+	if (i == MAX_DVC_CHANNELS)
+		return -1;
+
+	if (tcp_can_send(0))
+		return 0;
+
+	tcp_want_send(True);
+	return -1;
+}
+
+static void
+dvc_send_channel(dvc_channel_t * ch, STREAM s)
 {
 	STREAM ls;
 	dvc_hdr_t hdr;
 	uint32 channel_id;
+	size_t length, chunk;
+	uint8 *data;
+
+	channel_id = ch->channel_id;
+	length = s_length(s);
+	data = s->data;
+
+	hdr.hdr.cbid = 2;
+	hdr.hdr.sp = 0;
+
+	/* Longer messages are split, the first part carries the total
+	   length in a 4 byte field */
+	if (1 + 4 + length > DVC_CHUNK_LENGTH)
+	{
+		hdr.hdr.cmd = DYNVC_DATA_FIRST;
+		hdr.hdr.sp = 2;
+		chunk = DVC_CHUNK_LENGTH - 1 - 4 - 4;
+
+		ls = dvc_init_packet(hdr, channel_id, 4 + chunk);
+		out_uint32_le(ls, length);
+		out_uint8a(ls, data, chunk);
+		s_mark_end(ls);
+		dvc_queue_pdu(ch, ls);
+
+		data += chunk;
+		length -= chunk;
+		hdr.hdr.sp = 0;
+	}
+
+	hdr.hdr.cmd = DYNVC_DATA;
+	do
+	{
+		chunk = MIN(length, DVC_CHUNK_LENGTH - 1 - 4);
+
+		ls = dvc_init_packet(hdr, channel_id, chunk);
+		out_uint8a(ls, data, chunk);
+		s_mark_end(ls);
+		dvc_queue_pdu(ch, ls);
+
+		data += chunk;
+		length -= chunk;
+	}
+	while (length > 0);
+
+	dvc_flush();
+}
+
+void
+dvc_send(const char *name, STREAM s)
+{
+	dvc_channel_t *ch;
 
-	channel_id = dvc_channels_get_id(name);
-	if (channel_id == INVALID_CHANNEL)
+	ch = dvc_channels_get_by_name(name);
+	if (ch == NULL || ch->channel_id == INVALID_CHANNEL)
 	{
 		logger(Core, Error, "dvc_send(), Trying to send data on invalid channel '%s'",
 		       name);
 		return;
 	}
 
-	/* FIXME: we assume length is less than 1600 */
-
-	hdr.hdr.cmd = DYNVC_DATA;
-	hdr.hdr.cbid = 2;
-	hdr.hdr.sp = 0;
-
-	ls = dvc_init_packet(hdr, channel_id, s_length(s));
+	dvc_send_channel(ch, s);
+}
 
-	out_stream(ls, s);
+/* Send on one instance of a channel */
+void
+dvc_send_to(uint32 channel_id, STREAM s)
+{
+	dvc_channel_t *ch;
 
-	s_mark_end(ls);
+	ch = dvc_channels_get_by_id(channel_id);
+	if (ch == NULL)
+	{
+		logger(Core, Error, "dvc_send_to(), Trying to send data on invalid channel %d",
+		       channel_id);
+		return;
+	}
 
-	channel_send(ls, dvc_channel);
-	s_free(ls);
+	dvc_send_channel(ch, s);
 }
 
 
@@ -330,6 +608,7 @@ dvc_process_create_pdu(STREAM s, dvc_hdr_t hdr)
 {
 	char name[512];
 	uint32 channelid;
+	dvc_channel_t *ch;
 
 	channelid = dvc_in_channelid(s, hdr);
 
@@ -338,12 +617,15 @@ dvc_process_create_pdu(STREAM s, dvc_hdr_t hdr)
 	logger(Protocol, Debug, "dvc_process_create(), server requests channelid = %d, name = '%s'",
 	       channelid, name);
 
-	if (dvc_channels_exists(name))
+	if (dvc_channels_exists(name) && dvc_channels_set_id(name, channelid) == 0)
 	{
 		logger(Core, Verbose, "Established dynamic virtual channel '%s'", name);
 
-		dvc_channels_set_id(name, channelid);
 		dvc_send_create_response(True, hdr, channelid);
+
+		ch = dvc_channels_get_by_id(channelid);
+		if (ch != NULL && ch->open != NULL)
+			ch->open();
 	}
 	else
 	{
@@ -377,8 +659,9 @@ dvc_in_channelid(STREAM s, dvc_hdr_t hdr)
 static void
 dvc_process_data_pdu(STREAM s, dvc_hdr_t hdr)
 {
-	const dvc_channel_t *ch;
+	dvc_channel_t *ch;
 	uint32 channelid;
+	size_t length;
 
 	channelid = dvc_in_channelid(s, hdr);
 	ch = dvc_channels_get_by_id(channelid);
@@ -389,8 +672,98 @@ dvc_process_data_pdu(STREAM s, dvc_hdr_t hdr)
 		return;
 	}
 
-	/* dispatch packet to channel handler */
-	ch->handler(s);
+	if (ch->discard > 0)
+	{
+		length = MIN(s_remaining(s), ch->discard);
+		in_uint8s(s, length);
+		ch->discard -= length;
+		return;
+	}
+
+	if (ch->fragment == NULL)
+	{
+		/* dispatch packet to channel handler */
+		dvc_dispatch(ch, s);
+		return;
+	}
+
+	/* continuation of a message started with DATA_FIRST */
+	length = MIN(s_remaining(s), s_left(ch->fragment));
+	in_uint8stream(s, ch->fragment, length);
+	if (s_left(ch->fragment) > 0)
+		return;
+
+	s_mark_end(ch->fragment);
+	s_seek(ch->fragment, 0);
+	dvc_dispatch(ch, ch->fragment);
+	s_free(ch->fragment);
+	ch->fragment = NULL;
+}
+
+/* The first part of a message longer than a channel chunk, it carries
+   the total length of the message, whose parts are collected before
+   the message is handed to the channel handler */
+static void
+dvc_process_data_first_pdu(STREAM s, dvc_hdr_t hdr)
+{
+	dvc_channel_t *ch;
+	uint32 channelid, total;
+	size_t length;
+
+	channelid = dvc_in_channelid(s, hdr);
+	ch = dvc_channels_get_by_id(channelid);
+	if (ch == NULL)
+	{
+		logger(Protocol, Warning,
+		       "dvc_process_data_first(), Received data on unregistered channel %d",
+		       channelid);
+		return;
+	}
+
+	total = 0;
+	switch (hdr.hdr.sp)
+	{
+		case 0:
+			in_uint8(s, total);
+			break;
+		case 1:
+			in_uint16_le(s, total);
+			break;
+		default:
+			in_uint32_le(s, total);
+			break;
+	}
+
+	if (ch->fragment != NULL)
+	{
+		logger(Protocol, Warning,
+		       "dvc_process_data_first(), Incomplete message on channel %d dropped",
+		       channelid);
+		s_free(ch->fragment);
+	}
+
+	if (total > DVC_MAX_MESSAGE)
+	{
+		logger(Protocol, Warning,
+		       "dvc_process_data_first(), %u byte message on channel %d dropped", total,
+		       channelid);
+		ch->fragment = NULL;
+		ch->discard = total - MIN(s_remaining(s), total);
+		return;
+	}
+	ch->discard = 0;
+
+	ch->fragment = s_alloc(total);
+	length = MIN(s_remaining(s), total);
+	in_uint8stream(s, ch->fragment, length);
+	if (s_left(ch->fragment) > 0)
+		return;
+
+	s_mark_end(ch->fragment);
+	s_seek(ch->fragment, 0);
+	dvc_dispatch(ch, ch->fragment);
+	s_free(ch->fragment);
+	ch->fragment = NULL;
 }
 
 static void
@@ -427,6 +800,10 @@ dvc_process_pdu(STREAM s)
 			dvc_process_create_pdu(s, hdr);
 			break;
 
+		case DYNVC_DATA_FIRST:
+			dvc_process_data_first_pdu(s, hdr);
+			break;
+
 		case DYNVC_DATA:
 			dvc_process_data_pdu(s, hdr);
 			break;
@@ -437,8 +814,6 @@ dvc_process_pdu(STREAM s)
 
 #if 0				/* Unimplemented */
 
-		case DYNVC_DATA_FIRST:
-			break;
 		case DYNVC_DATA_FIRST_COMPRESSED:
 			break;
 		case DYNVC_DATA_COMPRESSED:
@@ -457,10 +832,27 @@ dvc_process_pdu(STREAM s)
 	}
 }
 
+/* Drop what is still queued for a connection that is gone */
+void
+dvc_reset_state(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_DVC_CHANNELS; i++)
+	{
+		dvc_channels_clear_queue(&channels[i]);
+
+		/* the server opens the instances it wants again */
+		if (channels[i].instances && channels[i].channel_id != INVALID_CHANNEL)
+			dvc_channels_remove_by_id(channels[i].channel_id);
+	}
+}
+
 RD_BOOL
 dvc_init()
 {
 	memset(channels, 0, sizeof(channels));
+	memset(channels_by_id, 0, sizeof(channels_by_id));
 	dvc_channel = channel_register("drdynvc",
 				       CHANNEL_OPTION_INITIALIZED | CHANNEL_OPTION_ENCRYPT_RDP,
 				       dvc_process_pdu);
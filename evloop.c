@@ -0,0 +1,340 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Event loop for the main loop file descriptors
+   Copyright 2026 the rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Long lived file descriptors, such as the RDP and X11 connections and
+   the ctrl sockets, are registered once with evloop_add_fd() and stay in
+   the kernel's interest set (epoll on Linux, kqueue on the BSDs) until
+   they are removed. Only the short lived descriptors of pending sound
+   and device requests are still gathered in fd_sets for every wait;
+   those are handed to select() together with the epoll or kqueue
+   descriptor itself. Without either, everything falls back to
+   select(). */
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#if defined(HAVE_SYS_EPOLL_H)
+#include <sys/epoll.h>
+#define EVLOOP_EPOLL
+#elif defined(HAVE_SYS_EVENT_H)
+#include <sys/event.h>
+#define EVLOOP_KQUEUE
+#endif
+
+#include "rdesktop.h"
+
+/* Events collected by one call into the kernel */
+#define EVLOOP_MAX_EVENTS 32
+
+/* Interest and readiness of every registered fd, indexed by fd */
+static uint8 *g_evloop_events = NULL;
+static uint8 *g_evloop_ready = NULL;
+static int g_evloop_size = 0;
+static int g_evloop_max_fd = -1;
+
+#if defined(EVLOOP_EPOLL) || defined(EVLOOP_KQUEUE)
+static int g_evloop_fd = -1;
+
+/* fds marked ready by the last wait, so they can be cleared */
+static int g_evloop_hits[EVLOOP_MAX_EVENTS];
+static int g_evloop_num_hits;
+#endif
+
+static void
+evloop_grow(int fd)
+{
+	int size;
+
+	if (fd < g_evloop_size)
+		return;
+
+	size = MAX(fd + 1, g_evloop_size * 2);
+	size = MAX(size, 64);
+	g_evloop_events = xrealloc(g_evloop_events, size);
+	g_evloop_ready = xrealloc(g_evloop_ready, size);
+	memset(g_evloop_events + g_evloop_size, 0, size - g_evloop_size);
+	memset(g_evloop_ready + g_evloop_size, 0, size - g_evloop_size);
+	g_evloop_size = size;
+}
+
+#if defined(EVLOOP_EPOLL)
+
+static void
+evloop_backend_init(void)
+{
+	g_evloop_fd = epoll_create(16);
+	if (g_evloop_fd == -1)
+	{
+		logger(Core, Error, "evloop_backend_init(), epoll_create() failed: %s",
+		       strerror(errno));
+		exit(EX_OSERR);
+	}
+}
+
+static void
+evloop_backend_update(int fd, int old_events, int events)
+{
+	struct epoll_event ev;
+	int op;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+	if (events & EVLOOP_READ)
+		ev.events |= EPOLLIN;
+	if (events & EVLOOP_WRITE)
+		ev.events |= EPOLLOUT;
+
+	if (old_events == 0)
+		op = EPOLL_CTL_ADD;
+	else if (events == 0)
+		op = EPOLL_CTL_DEL;
+	else
+		op = EPOLL_CTL_MOD;
+
+	/* a closed fd has already left the interest set */
+	if (epoll_ctl(g_evloop_fd, op, fd, &ev) == -1 && op != EPOLL_CTL_DEL)
+		logger(Core, Error, "evloop_backend_update(), epoll_ctl() failed for fd %d: %s",
+		       fd, strerror(errno));
+}
+
+static int
+evloop_backend_collect(int timeout)
+{
+	struct epoll_event evs[EVLOOP_MAX_EVENTS];
+	int i, n, fd;
+
+	n = epoll_wait(g_evloop_fd, evs, EVLOOP_MAX_EVENTS, timeout);
+	for (i = 0; i < n; i++)
+	{
+		fd = evs[i].data.fd;
+		/* errors and hangups are reported as readable, so that the
+		   owner finds out on its next read */
+		if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			g_evloop_ready[fd] |= EVLOOP_READ;
+		if (evs[i].events & EPOLLOUT)
+			g_evloop_ready[fd] |= EVLOOP_WRITE;
+		g_evloop_hits[g_evloop_num_hits++] = fd;
+	}
+
+	return n;
+}
+
+#elif defined(EVLOOP_KQUEUE)
+
+static void
+evloop_backend_init(void)
+{
+	g_evloop_fd = kqueue();
+	if (g_evloop_fd == -1)
+	{
+		logger(Core, Error, "evloop_backend_init(), kqueue() failed: %s",
+		       strerror(errno));
+		exit(EX_OSERR);
+	}
+}
+
+static void
+evloop_backend_update(int fd, int old_events, int events)
+{
+	struct kevent kev[2];
+	int n = 0;
+
+	if ((old_events ^ events) & EVLOOP_READ)
+	{
+		EV_SET(&kev[n], fd, EVFILT_READ, (events & EVLOOP_READ) ? EV_ADD : EV_DELETE, 0,
+		       0, NULL);
+		n++;
+	}
+	if ((old_events ^ events) & EVLOOP_WRITE)
+	{
+		EV_SET(&kev[n], fd, EVFILT_WRITE, (events & EVLOOP_WRITE) ? EV_ADD : EV_DELETE,
+		       0, 0, NULL);
+		n++;
+	}
+
+	/* a closed fd has already left the interest set */
+	if (n != 0 && kevent(g_evloop_fd, kev, n, NULL, 0, NULL) == -1 && events != 0)
+		logger(Core, Error, "evloop_backend_update(), kevent() failed for fd %d: %s",
+		       fd, strerror(errno));
+}
+
+static int
+evloop_backend_collect(int timeout)
+{
+	struct kevent evs[EVLOOP_MAX_EVENTS];
+	struct timespec ts, *pts;
+	int i, n, fd;
+
+	pts = NULL;
+	if (timeout >= 0)
+	{
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		pts = &ts;
+	}
+
+	n = kevent(g_evloop_fd, NULL, 0, evs, EVLOOP_MAX_EVENTS, pts);
+	for (i = 0; i < n; i++)
+	{
+		fd = evs[i].ident;
+		if (evs[i].filter == EVFILT_READ || (evs[i].flags & (EV_EOF | EV_ERROR)))
+			g_evloop_ready[fd] |= EVLOOP_READ;
+		if (evs[i].filter == EVFILT_WRITE)
+			g_evloop_ready[fd] |= EVLOOP_WRITE;
+		g_evloop_hits[g_evloop_num_hits++] = fd;
+	}
+
+	return n;
+}
+
+#endif
+
+/* Register fd for the given EVLOOP_READ / EVLOOP_WRITE events, or
+   change the events of an fd already registered */
+void
+evloop_add_fd(int fd, int events)
+{
+	int old_events;
+
+	evloop_grow(fd);
+
+#if defined(EVLOOP_EPOLL) || defined(EVLOOP_KQUEUE)
+	if (g_evloop_fd == -1)
+		evloop_backend_init();
+#endif
+
+	old_events = g_evloop_events[fd];
+	g_evloop_events[fd] = events;
+	g_evloop_ready[fd] = 0;
+	g_evloop_max_fd = MAX(g_evloop_max_fd, fd);
+
+	if (old_events == events)
+		return;
+
+#if defined(EVLOOP_EPOLL) || defined(EVLOOP_KQUEUE)
+	evloop_backend_update(fd, old_events, events);
+#endif
+}
+
+/* Stop watching fd. Must be called before the fd is closed, as the
+   number may be reused right away. */
+void
+evloop_remove_fd(int fd)
+{
+	if (fd < 0 || fd >= g_evloop_size || g_evloop_events[fd] == 0)
+		return;
+
+#if defined(EVLOOP_EPOLL) || defined(EVLOOP_KQUEUE)
+	evloop_backend_update(fd, g_evloop_events[fd], 0);
+#endif
+
+	g_evloop_events[fd] = 0;
+	g_evloop_ready[fd] = 0;
+
+	while (g_evloop_max_fd >= 0 && g_evloop_events[g_evloop_max_fd] == 0)
+		g_evloop_max_fd--;
+}
+
+/* Returns the events that became ready on fd in the last
+   evloop_wait(), and clears them so that they are handled only once */
+int
+evloop_check_fd(int fd)
+{
+	int events;
+
+	if (fd < 0 || fd >= g_evloop_size)
+		return 0;
+
+	events = g_evloop_ready[fd];
+	g_evloop_ready[fd] = 0;
+	return events;
+}
+
+/* Wait for any registered fd, or any of the fds in rfds and wfds, to
+   become ready, or for tv to pass. n is the highest fd in the sets, -1
+   when they are empty. Returns like select(); the state of registered
+   fds is available from evloop_check_fd() afterwards. */
+int
+evloop_wait(int n, fd_set * rfds, fd_set * wfds, struct timeval *tv)
+{
+	int ret;
+#if defined(EVLOOP_EPOLL) || defined(EVLOOP_KQUEUE)
+	int i, timeout;
+
+	for (i = 0; i < g_evloop_num_hits; i++)
+		g_evloop_ready[g_evloop_hits[i]] = 0;
+	g_evloop_num_hits = 0;
+
+	if (g_evloop_fd == -1)
+		evloop_backend_init();
+
+	if (n < 0)
+	{
+		/* no short lived fds, so skip select() altogether */
+		timeout = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+		return evloop_backend_collect(timeout);
+	}
+
+	FD_SET(g_evloop_fd, rfds);
+	n = MAX(n, g_evloop_fd);
+
+	ret = select(n + 1, rfds, wfds, NULL, tv);
+	if (ret > 0 && FD_ISSET(g_evloop_fd, rfds))
+	{
+		FD_CLR(g_evloop_fd, rfds);
+		evloop_backend_collect(0);
+	}
+#else
+	int fd;
+
+	for (fd = 0; fd <= g_evloop_max_fd; fd++)
+	{
+		g_evloop_ready[fd] = 0;
+		if (g_evloop_events[fd] & EVLOOP_READ)
+			FD_SET(fd, rfds);
+		if (g_evloop_events[fd] & EVLOOP_WRITE)
+			FD_SET(fd, wfds);
+	}
+	n = MAX(n, g_evloop_max_fd);
+
+	ret = select(n + 1, rfds, wfds, NULL, tv);
+	if (ret > 0)
+	{
+		for (fd = 0; fd <= g_evloop_max_fd; fd++)
+		{
+			if (g_evloop_events[fd] == 0)
+				continue;
+			if (FD_ISSET(fd, rfds))
+			{
+				g_evloop_ready[fd] |= EVLOOP_READ;
+				FD_CLR(fd, rfds);
+			}
+			if (FD_ISSET(fd, wfds))
+			{
+				g_evloop_ready[fd] |= EVLOOP_WRITE;
+				FD_CLR(fd, wfds);
+			}
+		}
+	}
+#endif
+
+	return ret;
+}
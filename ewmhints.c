@@ -38,7 +38,7 @@ static Atom g_net_wm_state_maximized_vert_atom, g_net_wm_state_maximized_horz_at
 	g_net_wm_state_skip_taskbar_atom, g_net_wm_state_skip_pager_atom,
 	g_net_wm_state_modal_atom, g_net_wm_icon_atom, g_net_wm_state_above_atom, g_net_wm_pid_atom;
 
-Atom g_net_wm_state_atom, g_net_wm_desktop_atom, g_net_wm_ping_atom;
+Atom g_net_wm_state_atom, g_net_wm_desktop_atom, g_net_wm_ping_atom, g_net_current_desktop_atom;
 
 /* 
    Get window property value (32-bit format) 
@@ -190,6 +190,7 @@ ewmh_init()
 	g_net_wm_state_above_atom = XInternAtom(g_display, "_NET_WM_STATE_ABOVE", False);
 	g_net_wm_state_atom = XInternAtom(g_display, "_NET_WM_STATE", False);
 	g_net_wm_desktop_atom = XInternAtom(g_display, "_NET_WM_DESKTOP", False);
+	g_net_current_desktop_atom = XInternAtom(g_display, "_NET_CURRENT_DESKTOP", False);
 	g_net_wm_name_atom = XInternAtom(g_display, "_NET_WM_NAME", False);
 	g_net_wm_icon_atom = XInternAtom(g_display, "_NET_WM_ICON", False);
 	g_net_wm_pid_atom = XInternAtom(g_display, "_NET_WM_PID", False);
@@ -378,6 +379,31 @@ ewmh_get_window_desktop(Window wnd)
 	return desktop;
 }
 
+/* Returns False only when the window is known to be on a workspace
+   other than the current one, quietly, as not all window managers
+   have workspaces */
+RD_BOOL
+ewmh_is_window_on_current_desktop(Window wnd)
+{
+	unsigned long nitems;
+	unsigned char *props;
+	unsigned long desktop, current;
+
+	if (get_property_value(wnd, "_NET_WM_DESKTOP", 1, &nitems, &props, 1) < 0)
+		return True;
+	desktop = nitems == 1 ? *(unsigned long *) props : 0xffffffff;
+	XFree(props);
+
+	if (get_property_value(DefaultRootWindow(g_display), "_NET_CURRENT_DESKTOP", 1, &nitems,
+			       &props, 1) < 0)
+		return True;
+	current = nitems == 1 ? *(unsigned long *) props : desktop;
+	XFree(props);
+
+	/* 0xffffffff is on all workspaces */
+	return desktop == 0xffffffff || desktop == current;
+}
+
 
 int
 ewmh_move_to_desktop(Window wnd, unsigned int desktop)
@@ -579,6 +605,37 @@ ewmh_is_window_above(Window w)
 	return above;
 }
 
+/* Have a fullscreen window cover the monitors from the one given for
+   each edge, by their Xinerama index, rather than only the one it is
+   on */
+int
+ewmh_set_fullscreen_monitors(Window wnd, int top, int bottom, int left, int right)
+{
+	Status status;
+	XEvent xevent;
+	Atom monitors;
+
+	monitors = XInternAtom(g_display, "_NET_WM_FULLSCREEN_MONITORS", False);
+	if (!monitors)
+		return -1;
+
+	xevent.type = ClientMessage;
+	xevent.xclient.window = wnd;
+	xevent.xclient.message_type = monitors;
+	xevent.xclient.format = 32;
+	xevent.xclient.data.l[0] = top;
+	xevent.xclient.data.l[1] = bottom;
+	xevent.xclient.data.l[2] = left;
+	xevent.xclient.data.l[3] = right;
+	xevent.xclient.data.l[4] = 1;	/* source indication: application */
+
+	status = XSendEvent(g_display, DefaultRootWindow(g_display), False,
+			    SubstructureNotifyMask | SubstructureRedirectMask, &xevent);
+	if (!status)
+		return -1;
+	return 0;
+}
+
 #if 0
 
 /* FIXME: _NET_MOVERESIZE_WINDOW is for pagers, not for
@@ -0,0 +1,631 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Graphics pipeline H.264 decoding
+   Copyright 2026 the rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The AVC420 and AVC444 codecs of the graphics pipeline (MS-RDPEGFX
+   2.2.4.4 and 3.3.8.3) carry H.264 streams, one per surface, and two
+   for AVC444 where a second stream holds the chroma samples that do
+   not fit in a 4:2:0 picture. The streams are decoded with libavcodec,
+   on the GPU through VA-API when a device is available and in software
+   otherwise, and the pictures converted to the surface pixels within
+   the rectangles the server says have changed. */
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/hwcontext.h>
+
+#include "rdesktop.h"
+
+/* Chroma rebuilt from the 2x2 average further than this from it is
+   taken as coding noise and the average kept */
+#define H264_CHROMA_FILTER_LIMIT	30
+
+typedef struct
+{
+	AVCodecContext *ctx;
+	AVFrame *frame;
+	AVFrame *sw_frame;
+	AVPacket *packet;
+	uint8 *buffer;
+	int buffer_size;
+}
+H264_STREAM;
+
+/* 4:4:4 reconstruction state, the pictures of the two streams may
+   arrive separately so the last of each is kept */
+typedef struct
+{
+	int width, height;
+	uint8 *y;
+	uint8 *u420, *v420;
+	uint8 *u, *v;
+}
+H264_YUV444;
+
+typedef struct h264_surface
+{
+	uint16 id;
+	H264_STREAM *streams[2];
+	H264_YUV444 *yuv;
+	struct h264_surface *next;
+}
+H264_SURFACE;
+
+static H264_SURFACE *h264_surfaces;
+static AVBufferRef *h264_hw_device;
+static RD_BOOL h264_hw_tried;
+
+/* 2x2 chroma blocks of one row pair of a picture, the planes are
+   interleaved (NV12) after a transfer from the GPU */
+typedef struct
+{
+	uint8 *y0, *y1;
+	uint8 *u, *v;
+	int step;
+}
+H264_ROW;
+
+static void
+h264_get_row(AVFrame * f, int row, H264_ROW * r)
+{
+	r->y0 = f->data[0] + row * f->linesize[0];
+	r->y1 = r->y0 + f->linesize[0];
+	r->u = f->data[1] + (row / 2) * f->linesize[1];
+	if (f->format == AV_PIX_FMT_NV12)
+	{
+		r->v = r->u + 1;
+		r->step = 2;
+	}
+	else
+	{
+		r->v = f->data[2] + (row / 2) * f->linesize[2];
+		r->step = 1;
+	}
+}
+
+static inline uint8
+h264_clamp(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/* Full range BT.709, as Windows servers encode it */
+static inline void
+h264_put_pixel(uint8 * out, int y, int u, int v)
+{
+	int c = y << 8, d = u - 128, e = v - 128;
+
+	out[0] = h264_clamp((c + 475 * d) >> 8);
+	out[1] = h264_clamp((c - 48 * d - 120 * e) >> 8);
+	out[2] = h264_clamp((c + 403 * e) >> 8);
+	out[3] = 0xff;
+}
+
+static void
+h264_hw_init(void)
+{
+	h264_hw_tried = True;
+	if (av_hwdevice_ctx_create(&h264_hw_device, AV_HWDEVICE_TYPE_VAAPI, NULL, NULL, 0) < 0)
+	{
+		logger(Graphics, Notice,
+		       "h264_hw_init(), VA-API not available, decoding H.264 in software");
+		h264_hw_device = NULL;
+		return;
+	}
+	logger(Graphics, Verbose, "h264_hw_init(), decoding H.264 with VA-API");
+}
+
+static enum AVPixelFormat
+h264_get_format(AVCodecContext * ctx, const enum AVPixelFormat *formats)
+{
+	const enum AVPixelFormat *f;
+
+	if (ctx->hw_device_ctx != NULL)
+	{
+		for (f = formats; *f != AV_PIX_FMT_NONE; f++)
+			if (*f == AV_PIX_FMT_VAAPI)
+				return *f;
+		logger(Graphics, Warning,
+		       "h264_get_format(), stream not supported by VA-API, using software");
+	}
+	return avcodec_default_get_format(ctx, formats);
+}
+
+static void
+h264_stream_free(H264_STREAM * stream)
+{
+	if (stream == NULL)
+		return;
+	avcodec_free_context(&stream->ctx);
+	av_frame_free(&stream->frame);
+	av_frame_free(&stream->sw_frame);
+	av_packet_free(&stream->packet);
+	xfree(stream->buffer);
+	xfree(stream);
+}
+
+static H264_STREAM *
+h264_stream_new(void)
+{
+	const AVCodec *codec;
+	H264_STREAM *stream;
+
+	codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+	if (codec == NULL)
+	{
+		logger(Graphics, Error, "h264_stream_new(), libavcodec has no H.264 decoder");
+		return NULL;
+	}
+
+	if (!h264_hw_tried)
+		h264_hw_init();
+
+	stream = xmalloc(sizeof(H264_STREAM));
+	memset(stream, 0, sizeof(H264_STREAM));
+	stream->ctx = avcodec_alloc_context3(codec);
+	stream->frame = av_frame_alloc();
+	stream->sw_frame = av_frame_alloc();
+	stream->packet = av_packet_alloc();
+	if (stream->ctx == NULL || stream->frame == NULL || stream->sw_frame == NULL
+	    || stream->packet == NULL)
+		goto fail;
+
+	/* every access unit is shown as it arrives, frame threading would
+	   hold pictures back */
+	stream->ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+	stream->ctx->thread_type = FF_THREAD_SLICE;
+	stream->ctx->get_format = h264_get_format;
+	if (h264_hw_device != NULL)
+		stream->ctx->hw_device_ctx = av_buffer_ref(h264_hw_device);
+
+	if (avcodec_open2(stream->ctx, codec, NULL) < 0)
+		goto fail;
+
+	return stream;
+
+fail:
+	logger(Graphics, Error, "h264_stream_new(), failed to set up decoder");
+	h264_stream_free(stream);
+	return NULL;
+}
+
+/* Decode one access unit, returns the picture in system memory or
+   NULL if there is none to show */
+static AVFrame *
+h264_stream_decode(H264_STREAM * stream, uint8 * data, uint32 size)
+{
+	int ret;
+
+	/* libavcodec reads past the end of the data in its bit reader */
+	if (stream->buffer_size < (int) size + AV_INPUT_BUFFER_PADDING_SIZE)
+	{
+		stream->buffer_size = size + AV_INPUT_BUFFER_PADDING_SIZE;
+		stream->buffer = xrealloc(stream->buffer, stream->buffer_size);
+	}
+	memcpy(stream->buffer, data, size);
+	memset(stream->buffer + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+	stream->packet->data = stream->buffer;
+	stream->packet->size = size;
+	ret = avcodec_send_packet(stream->ctx, stream->packet);
+	if (ret < 0)
+	{
+		logger(Graphics, Warning, "h264_stream_decode(), decoder rejected data, %d", ret);
+		return NULL;
+	}
+
+	ret = avcodec_receive_frame(stream->ctx, stream->frame);
+	if (ret == AVERROR(EAGAIN))
+		return NULL;
+	if (ret < 0)
+	{
+		logger(Graphics, Warning, "h264_stream_decode(), decoding failed, %d", ret);
+		return NULL;
+	}
+
+	if (stream->frame->format != AV_PIX_FMT_VAAPI)
+		return stream->frame;
+
+	av_frame_unref(stream->sw_frame);
+	if (av_hwframe_transfer_data(stream->sw_frame, stream->frame, 0) < 0)
+	{
+		logger(Graphics, Warning, "h264_stream_decode(), failed to read back picture");
+		return NULL;
+	}
+	return stream->sw_frame;
+}
+
+static H264_SURFACE *
+h264_get_surface(uint16 id)
+{
+	H264_SURFACE *surface;
+
+	for (surface = h264_surfaces; surface != NULL; surface = surface->next)
+		if (surface->id == id)
+			return surface;
+
+	surface = xmalloc(sizeof(H264_SURFACE));
+	memset(surface, 0, sizeof(H264_SURFACE));
+	surface->id = id;
+	surface->next = h264_surfaces;
+	h264_surfaces = surface;
+	return surface;
+}
+
+static H264_STREAM *
+h264_get_stream(H264_SURFACE * surface, int n)
+{
+	if (surface->streams[n] == NULL)
+		surface->streams[n] = h264_stream_new();
+	return surface->streams[n];
+}
+
+static void
+h264_yuv_free(H264_YUV444 * yuv)
+{
+	if (yuv == NULL)
+		return;
+	xfree(yuv->y);
+	xfree(yuv->u420);
+	xfree(yuv->v420);
+	xfree(yuv->u);
+	xfree(yuv->v);
+	xfree(yuv);
+}
+
+static H264_YUV444 *
+h264_get_yuv(H264_SURFACE * surface, int width, int height)
+{
+	H264_YUV444 *yuv = surface->yuv;
+	size_t size, csize;
+
+	/* even sizes keep the 2x2 chroma blocks within the planes */
+	width = (width + 1) & ~1;
+	height = (height + 1) & ~1;
+
+	if (yuv != NULL && yuv->width == width && yuv->height == height)
+		return yuv;
+
+	h264_yuv_free(yuv);
+	size = (size_t) width * height;
+	csize = (size_t) ((width + 1) / 2) * ((height + 1) / 2);
+	yuv = xmalloc(sizeof(H264_YUV444));
+	yuv->width = width;
+	yuv->height = height;
+	yuv->y = xmalloc(size);
+	yuv->u420 = xmalloc(csize);
+	yuv->v420 = xmalloc(csize);
+	yuv->u = xmalloc(size);
+	yuv->v = xmalloc(size);
+	memset(yuv->y, 0, size);
+	memset(yuv->u420, 128, csize);
+	memset(yuv->v420, 128, csize);
+	memset(yuv->u, 128, size);
+	memset(yuv->v, 128, size);
+	surface->yuv = yuv;
+	return yuv;
+}
+
+/* Clip a rectangle to the picture and round it out to whole 2x2
+   chroma blocks, returns False if nothing is left */
+static RD_BOOL
+h264_clip_rect(BOUNDS * rect, int width, int height, int *left, int *top, int *right,
+	       int *bottom)
+{
+	*left = MAX(rect->left, 0) & ~1;
+	*top = MAX(rect->top, 0) & ~1;
+	*right = MIN(rect->right + 1, width);
+	*bottom = MIN(rect->bottom + 1, height);
+	return *left < *right && *top < *bottom;
+}
+
+/* Convert the rectangles of a 4:2:0 picture to pixels */
+static void
+h264_convert_420(AVFrame * f, uint8 * dst, int stride, int width, int height, BOUNDS * rects,
+		 int nrects)
+{
+	int i, x, y, left, top, right, bottom;
+	uint8 *out0, *out1;
+	H264_ROW r;
+
+	width = MIN(width, f->width);
+	height = MIN(height, f->height);
+
+	for (i = 0; i < nrects; i++)
+	{
+		if (!h264_clip_rect(&rects[i], width, height, &left, &top, &right, &bottom))
+			continue;
+
+		for (y = top; y < bottom; y += 2)
+		{
+			h264_get_row(f, y, &r);
+			out0 = dst + y * stride;
+			out1 = out0 + stride;
+			for (x = left; x < right; x++)
+			{
+				int u = r.u[(x / 2) * r.step];
+				int v = r.v[(x / 2) * r.step];
+
+				h264_put_pixel(out0 + x * 4, r.y0[x], u, v);
+				if (y + 1 < bottom)
+					h264_put_pixel(out1 + x * 4, r.y1[x], u, v);
+			}
+		}
+	}
+}
+
+/* Keep the luma and 4:2:0 chroma of the main picture */
+static void
+h264_store_main(H264_YUV444 * yuv, AVFrame * f, BOUNDS * rects, int nrects)
+{
+	int i, x, y, left, top, right, bottom, cw;
+	int width = MIN(yuv->width, f->width), height = MIN(yuv->height, f->height);
+	H264_ROW r;
+
+	cw = (yuv->width + 1) / 2;
+	for (i = 0; i < nrects; i++)
+	{
+		if (!h264_clip_rect(&rects[i], width, height, &left, &top, &right, &bottom))
+			continue;
+
+		for (y = top; y < bottom; y += 2)
+		{
+			h264_get_row(f, y, &r);
+			memcpy(yuv->y + y * yuv->width + left, r.y0 + left, right - left);
+			if (y + 1 < bottom)
+				memcpy(yuv->y + (y + 1) * yuv->width + left, r.y1 + left,
+				       right - left);
+			for (x = left / 2; x < (right + 1) / 2; x++)
+			{
+				yuv->u420[(y / 2) * cw + x] = r.u[x * r.step];
+				yuv->v420[(y / 2) * cw + x] = r.v[x * r.step];
+			}
+		}
+	}
+}
+
+/* Scatter the chroma samples of the auxiliary picture to where they
+   belong in the 4:4:4 planes, the two layouts are described in
+   MS-RDPEGFX 3.3.8.3.2 and 3.3.8.3.3 */
+static void
+h264_store_aux(H264_YUV444 * yuv, AVFrame * f, RD_BOOL v2, BOUNDS * rects, int nrects)
+{
+	int i, x, y, left, top, right, bottom, w = yuv->width;
+	int width = MIN(yuv->width, f->width), height = MIN(yuv->height, f->height);
+	int half = f->width / 2, quarter = f->width / 4;
+	H264_ROW r;
+
+	for (i = 0; i < nrects; i++)
+	{
+		if (!h264_clip_rect(&rects[i], width, height, &left, &top, &right, &bottom))
+			continue;
+
+		for (y = top; y < bottom; y += 2)
+		{
+			/* the picture may end on an even row */
+			RD_BOOL odd = y + 1 < height;
+
+			if (!v2)
+			{
+				/* odd rows of U and V in alternating 8 row
+				   strips of the luma plane */
+				int strip = ((y / 2) / 8) * 16 + (y / 2) % 8;
+
+				for (x = left; x < right && odd && strip + 8 < f->height; x++)
+				{
+					yuv->u[(y + 1) * w + x] =
+						f->data[0][strip * f->linesize[0] + x];
+					yuv->v[(y + 1) * w + x] =
+						f->data[0][(strip + 8) * f->linesize[0] + x];
+				}
+
+				/* odd columns of the even rows in the chroma
+				   planes */
+				h264_get_row(f, y, &r);
+				for (x = left + 1; x < right; x += 2)
+				{
+					yuv->u[y * w + x] = r.u[(x / 2) * r.step];
+					yuv->v[y * w + x] = r.v[(x / 2) * r.step];
+				}
+				continue;
+			}
+
+			/* odd columns in the left and right halves of the
+			   luma plane */
+			h264_get_row(f, y, &r);
+			for (x = left + 1; x < right; x += 2)
+			{
+				yuv->u[y * w + x] = r.y0[x / 2];
+				yuv->v[y * w + x] = r.y0[half + x / 2];
+				if (!odd)
+					continue;
+				yuv->u[(y + 1) * w + x] = r.y1[x / 2];
+				yuv->v[(y + 1) * w + x] = r.y1[half + x / 2];
+			}
+
+			/* even columns of the odd rows in the chroma planes,
+			   every other one in U and the rest in V */
+			for (x = left; x < right && odd; x += 2)
+			{
+				int n = x / 4;
+				uint8 *plane = (x & 2) ? r.v : r.u;
+
+				yuv->u[(y + 1) * w + x] = plane[n * r.step];
+				yuv->v[(y + 1) * w + x] = plane[(quarter + n) * r.step];
+			}
+		}
+	}
+}
+
+/* Rebuild the 2x2 blocks from the main picture's chroma average and
+   the three samples of the auxiliary picture, and convert to pixels */
+static void
+h264_convert_444(H264_YUV444 * yuv, uint8 * dst, int stride, int width, int height,
+		 BOUNDS * rects, int nrects)
+{
+	int i, x, y, left, top, right, bottom, w = yuv->width, cw = (yuv->width + 1) / 2;
+	uint8 *out0, *out1, *y0, *y1, *u0, *u1, *v0, *v1;
+
+	width = MIN(width, yuv->width);
+	height = MIN(height, yuv->height);
+
+	for (i = 0; i < nrects; i++)
+	{
+		if (!h264_clip_rect(&rects[i], width, height, &left, &top, &right, &bottom))
+			continue;
+
+		for (y = top; y < bottom; y += 2)
+		{
+			out0 = dst + y * stride;
+			out1 = out0 + stride;
+			y0 = yuv->y + y * w;
+			y1 = y0 + w;
+			u0 = yuv->u + y * w;
+			u1 = u0 + w;
+			v0 = yuv->v + y * w;
+			v1 = v0 + w;
+
+			for (x = left; x < right; x += 2)
+			{
+				int avg_u = yuv->u420[(y / 2) * cw + x / 2];
+				int avg_v = yuv->v420[(y / 2) * cw + x / 2];
+				int u = avg_u, v = avg_v;
+
+				/* a block cut by the last odd column or row
+				   keeps the average */
+				if (x + 1 < w && y + 1 < yuv->height)
+				{
+					u = 4 * avg_u - u0[x + 1] - u1[x] - u1[x + 1];
+					v = 4 * avg_v - v0[x + 1] - v1[x] - v1[x + 1];
+				}
+				if (abs(u - avg_u) > H264_CHROMA_FILTER_LIMIT)
+					u = avg_u;
+				if (abs(v - avg_v) > H264_CHROMA_FILTER_LIMIT)
+					v = avg_v;
+
+				h264_put_pixel(out0 + x * 4, y0[x], h264_clamp(u), h264_clamp(v));
+				if (x + 1 < right)
+					h264_put_pixel(out0 + (x + 1) * 4, y0[x + 1], u0[x + 1],
+						       v0[x + 1]);
+				if (y + 1 >= bottom)
+					continue;
+				h264_put_pixel(out1 + x * 4, y1[x], u1[x], v1[x]);
+				if (x + 1 < right)
+					h264_put_pixel(out1 + (x + 1) * 4, y1[x + 1], u1[x + 1],
+						       v1[x + 1]);
+			}
+		}
+	}
+}
+
+/* Decode an AVC420 picture covering width by height pixels at dst,
+   converting the changed rectangles, which have inclusive right and
+   bottom edges and are relative to dst */
+RD_BOOL
+h264_decompress_avc420(uint16 surface_id, uint8 * data, uint32 size, uint8 * dst, int stride,
+		       int width, int height, BOUNDS * rects, int nrects)
+{
+	H264_STREAM *stream;
+	AVFrame *f;
+
+	stream = h264_get_stream(h264_get_surface(surface_id), 0);
+	if (stream == NULL)
+		return False;
+
+	f = h264_stream_decode(stream, data, size);
+	if (f == NULL)
+		return False;
+
+	h264_convert_420(f, dst, stride, width, height, rects, nrects);
+	return True;
+}
+
+/* Decode an AVC444 picture pair. The main stream carries luma and the
+   chroma average, the auxiliary one the remaining chroma samples;
+   either may be left out (NULL) when only the other changed. */
+RD_BOOL
+h264_decompress_avc444(uint16 surface_id, RD_BOOL v2, uint8 * luma, uint32 luma_size,
+		       BOUNDS * luma_rects, int luma_nrects, uint8 * aux, uint32 aux_size,
+		       BOUNDS * aux_rects, int aux_nrects, uint8 * dst, int stride, int width,
+		       int height)
+{
+	H264_SURFACE *surface;
+	H264_STREAM *stream;
+	H264_YUV444 *yuv;
+	AVFrame *f;
+
+	surface = h264_get_surface(surface_id);
+	yuv = h264_get_yuv(surface, width, height);
+
+	if (luma != NULL)
+	{
+		stream = h264_get_stream(surface, 0);
+		if (stream == NULL || (f = h264_stream_decode(stream, luma, luma_size)) == NULL)
+			return False;
+		h264_store_main(yuv, f, luma_rects, luma_nrects);
+	}
+
+	if (aux != NULL)
+	{
+		stream = h264_get_stream(surface, 1);
+		if (stream == NULL || (f = h264_stream_decode(stream, aux, aux_size)) == NULL)
+			return False;
+		h264_store_aux(yuv, f, v2, aux_rects, aux_nrects);
+	}
+
+	if (luma != NULL)
+		h264_convert_444(yuv, dst, stride, width, height, luma_rects, luma_nrects);
+	/* the two usually name the same rectangles */
+	if (aux != NULL && (luma == NULL || aux_nrects != luma_nrects
+			    || memcmp(aux_rects, luma_rects, aux_nrects * sizeof(BOUNDS)) != 0))
+		h264_convert_444(yuv, dst, stride, width, height, aux_rects, aux_nrects);
+	return True;
+}
+
+void
+h264_delete_surface(uint16 surface_id)
+{
+	H264_SURFACE **link, *surface;
+
+	for (link = &h264_surfaces; *link != NULL; link = &(*link)->next)
+	{
+		surface = *link;
+		if (surface->id != surface_id)
+			continue;
+
+		*link = surface->next;
+		h264_stream_free(surface->streams[0]);
+		h264_stream_free(surface->streams[1]);
+		h264_yuv_free(surface->yuv);
+		xfree(surface);
+		return;
+	}
+}
+
+void
+h264_reset(void)
+{
+	while (h264_surfaces != NULL)
+		h264_delete_surface(h264_surfaces->id);
+}
+
+/* Whether the H.264 codecs can be offered to the server */
+RD_BOOL
+h264_available(void)
+{
+	return avcodec_find_decoder(AV_CODEC_ID_H264) != NULL;
+}
@@ -277,6 +277,7 @@ iso_connect(char *server, char *username, char *domain, char *password,
 		tcp_disconnect();
 		return False;
 	}
+	rdp_connect_phase(CONNECT_PHASE_X224);
 
 	if (g_rdp_version >= RDP_V5 && s_check_rem(s, 8))
 	{
@@ -389,10 +389,12 @@ licence_process(STREAM s)
 		case LICENCE_TAG_UPGRADE_LICENCE:
 			/* we can handle new and upgrades of licences the same way. */
 			licence_process_new_license(s);
+			rdp_connect_phase(CONNECT_PHASE_LICENCE);
 			break;
 
 		case LICENCE_TAG_ERROR_ALERT:
 			licence_process_error_alert(s);
+			rdp_connect_phase(CONNECT_PHASE_LICENCE);
 			break;
 
 		default:
@@ -0,0 +1,410 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Scripted input for load testing
+   Copyright 2026 the rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* rdesktop-headless plays the user from a script given with
+   --input-script, and measures how long the server takes to draw in
+   answer, from an input event to the first update touching the area
+   around the pointer. Each line of the script is a delay in ms after
+   the previous event, counted from the window being created for the
+   first, followed by one of:
+
+	move X Y		move the pointer
+	click X Y [BUTTON]	move and press and release button 1, 2 or 3
+	key SCANCODE		press and release a key, 0xe0 added for
+				extended keys, e.g. 0xe04b for left
+	text STRING		type the rest of the line, US layout
+	loop			start the script over
+	quit			end the session
+
+   Empty lines and lines starting with # are skipped. */
+
+#include <ctype.h>
+#include <errno.h>
+#include "rdesktop.h"
+
+/* Half the side of the square around the pointer that counts as an
+   answer to the input */
+#define LOADGEN_AREA		64
+/* Input not answered within this long is given up on */
+#define LOADGEN_TIMEOUT		10000
+
+#define SC_LSHIFT		0x2a
+#define SC_EXTENDED		0xe000
+
+enum loadgen_op
+{
+	LOADGEN_MOVE,
+	LOADGEN_CLICK,
+	LOADGEN_KEY,
+	LOADGEN_TEXT,
+	LOADGEN_LOOP,
+	LOADGEN_QUIT
+};
+
+struct loadgen_event
+{
+	uint32 delay;
+	enum loadgen_op op;
+	int x, y, button;
+	char *text;
+};
+
+static struct loadgen_event *g_events = NULL;
+static int g_nevents = 0;
+static int g_next = 0;
+static RD_BOOL g_started = False;
+static uint64 g_due;		/* ms, of the next event */
+
+static int g_pointer_x, g_pointer_y;
+
+/* Input waiting for an answer */
+static RD_BOOL g_waiting = False;
+static uint64 g_sent;
+
+static uint32 g_events_sent, g_latency_samples, g_latency_timeouts;
+static uint64 g_latency_total, g_latency_min, g_latency_max;
+
+/* Scancodes of US layout characters, with the shift needed */
+static const char g_keys_plain[] = "1234567890-=\tqwertyuiop[]\nasdfghjkl;'`\\zxcvbnm,./ ";
+static const char g_keys_shift[] = "!@#$%^&*()_+\tQWERTYUIOP{}\nASDFGHJKL:\"~|ZXCVBNM<>? ";
+static const uint8 g_keys_scancode[] = {
+	0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d,
+	0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b,
+	0x1c, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29,
+	0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x39
+};
+
+static uint64
+loadgen_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static RD_BOOL
+loadgen_parse(char *line, struct loadgen_event *ev)
+{
+	char *p, *op;
+	int n;
+
+	memset(ev, 0, sizeof(*ev));
+	ev->delay = strtoul(line, &p, 10);
+	if (p == line)
+		return False;
+	while (isspace((unsigned char) *p))
+		p++;
+	op = p;
+	while (*p && !isspace((unsigned char) *p))
+		p++;
+	if (*p)
+		*p++ = '\0';
+
+	if (strcmp(op, "move") == 0)
+	{
+		ev->op = LOADGEN_MOVE;
+		return sscanf(p, "%d %d", &ev->x, &ev->y) == 2;
+	}
+	if (strcmp(op, "click") == 0)
+	{
+		ev->op = LOADGEN_CLICK;
+		ev->button = 1;
+		n = sscanf(p, "%d %d %d", &ev->x, &ev->y, &ev->button);
+		return n >= 2 && ev->button >= 1 && ev->button <= 3;
+	}
+	if (strcmp(op, "key") == 0)
+	{
+		ev->op = LOADGEN_KEY;
+		ev->x = strtol(p, &op, 0);
+		return op != p && ev->x > 0 && (ev->x < 0x80 || (ev->x & ~0xff) == SC_EXTENDED);
+	}
+	if (strcmp(op, "text") == 0)
+	{
+		ev->op = LOADGEN_TEXT;
+		ev->text = xstrdup(p);
+		return True;
+	}
+	if (strcmp(op, "loop") == 0)
+	{
+		ev->op = LOADGEN_LOOP;
+		return True;
+	}
+	if (strcmp(op, "quit") == 0)
+	{
+		ev->op = LOADGEN_QUIT;
+		return True;
+	}
+	return False;
+}
+
+/* Read the script, returns False if it could not be read or is not
+   understood */
+RD_BOOL
+loadgen_open(const char *filename)
+{
+	char line[1024];
+	FILE *fp;
+	int lineno = 0;
+	size_t len;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL)
+	{
+		logger(Core, Error, "loadgen_open(), can't open '%s': %s", filename,
+		       strerror(errno));
+		return False;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		lineno++;
+		len = strlen(line);
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0 || line[0] == '#')
+			continue;
+
+		g_events = xrealloc(g_events, (g_nevents + 1) * sizeof(*g_events));
+		if (!loadgen_parse(line, &g_events[g_nevents]))
+		{
+			logger(Core, Error, "loadgen_open(), %s:%d not understood", filename,
+			       lineno);
+			fclose(fp);
+			loadgen_close();
+			return False;
+		}
+		g_nevents++;
+	}
+	fclose(fp);
+
+	logger(Core, Verbose, "Input script '%s' has %d events", filename, g_nevents);
+	return True;
+}
+
+/* Start playing the script, once there is a window for it */
+void
+loadgen_start(void)
+{
+	if (g_nevents == 0 || g_started)
+		return;
+	g_started = True;
+	g_next = 0;
+	g_due = loadgen_clock() + g_events[0].delay;
+}
+
+/* Returns the ms until the next event is due, or until the input
+   waiting for an answer is given up on, -1 if neither */
+int
+loadgen_timeout(void)
+{
+	uint64 now, until = 0;
+
+	if (!g_started)
+		return -1;
+
+	if (g_next < g_nevents)
+		until = g_due;
+	if (g_waiting && (until == 0 || g_sent + LOADGEN_TIMEOUT < until))
+		until = g_sent + LOADGEN_TIMEOUT;
+	if (until == 0)
+		return -1;
+
+	now = loadgen_clock();
+	return until > now ? (int) (until - now) : 0;
+}
+
+static void
+loadgen_send_key(uint16 scancode)
+{
+	uint16 flags = 0;
+
+	if ((scancode & 0xff00) == SC_EXTENDED)
+		flags = KBD_FLAG_EXT;
+	rdp_send_input(time(NULL), RDP_INPUT_SCANCODE, RDP_KEYPRESS | flags, scancode & 0xff, 0);
+	rdp_send_input(time(NULL), RDP_INPUT_SCANCODE, RDP_KEYRELEASE | flags, scancode & 0xff,
+		       0);
+}
+
+static void
+loadgen_send_text(const char *text)
+{
+	const char *p;
+	int i;
+
+	for (; *text; text++)
+	{
+		if ((p = strchr(g_keys_plain, *text)) != NULL)
+		{
+			loadgen_send_key(g_keys_scancode[p - g_keys_plain]);
+			continue;
+		}
+		if ((p = strchr(g_keys_shift, *text)) == NULL)
+		{
+			logger(Core, Warning, "loadgen_send_text(), can't type '%c'", *text);
+			continue;
+		}
+		i = p - g_keys_shift;
+		rdp_send_input(time(NULL), RDP_INPUT_SCANCODE, RDP_KEYPRESS, SC_LSHIFT, 0);
+		loadgen_send_key(g_keys_scancode[i]);
+		rdp_send_input(time(NULL), RDP_INPUT_SCANCODE, RDP_KEYRELEASE, SC_LSHIFT, 0);
+	}
+}
+
+static void
+loadgen_send_click(int button)
+{
+	static const uint16 flags[] = {
+		MOUSE_FLAG_BUTTON1, MOUSE_FLAG_BUTTON2, MOUSE_FLAG_BUTTON3
+	};
+
+	rdp_send_input(time(NULL), RDP_INPUT_MOUSE, flags[button - 1] | MOUSE_FLAG_DOWN,
+		       g_pointer_x, g_pointer_y);
+	rdp_send_input(time(NULL), RDP_INPUT_MOUSE, flags[button - 1], g_pointer_x, g_pointer_y);
+}
+
+/* Send the events that are due, returns False when the script asks
+   to end the session */
+RD_BOOL
+loadgen_run(void)
+{
+	struct loadgen_event *ev;
+	uint64 now;
+	int n = 0;
+
+	if (!g_started)
+		return True;
+
+	now = loadgen_clock();
+	if (g_waiting && now >= g_sent + LOADGEN_TIMEOUT)
+	{
+		g_waiting = False;
+		g_latency_timeouts++;
+	}
+
+	rdp_input_batch_begin();
+	/* a script of no delays at all still goes once round per call */
+	while (g_next < g_nevents && now >= g_due && n++ < g_nevents)
+	{
+		ev = &g_events[g_next++];
+		switch (ev->op)
+		{
+			case LOADGEN_MOVE:
+			case LOADGEN_CLICK:
+				g_pointer_x = ev->x;
+				g_pointer_y = ev->y;
+				rdp_send_input(time(NULL), RDP_INPUT_MOUSE, MOUSE_FLAG_MOVE,
+					       g_pointer_x, g_pointer_y);
+				if (ev->op == LOADGEN_CLICK)
+					loadgen_send_click(ev->button);
+				break;
+
+			case LOADGEN_KEY:
+				loadgen_send_key(ev->x);
+				break;
+
+			case LOADGEN_TEXT:
+				loadgen_send_text(ev->text);
+				break;
+
+			case LOADGEN_LOOP:
+				g_next = 0;
+				break;
+
+			case LOADGEN_QUIT:
+				rdp_input_batch_end();
+				logger(Core, Verbose, "Input script done, ending the session");
+				return False;
+		}
+
+		if (ev->op != LOADGEN_LOOP)
+		{
+			g_events_sent++;
+			/* the first unanswered input is what is measured */
+			if (!g_waiting)
+			{
+				g_waiting = True;
+				g_sent = now;
+			}
+		}
+		if (g_next < g_nevents)
+			g_due += g_events[g_next].delay;
+	}
+	rdp_input_batch_end();
+
+	return True;
+}
+
+/* The screen has been drawn to at x, y, cx, cy */
+void
+loadgen_drawn(int x, int y, int cx, int cy)
+{
+	uint64 latency;
+
+	if (!g_waiting)
+		return;
+	if (x >= g_pointer_x + LOADGEN_AREA || x + cx <= g_pointer_x - LOADGEN_AREA ||
+	    y >= g_pointer_y + LOADGEN_AREA || y + cy <= g_pointer_y - LOADGEN_AREA)
+		return;
+
+	g_waiting = False;
+	latency = loadgen_clock() - g_sent;
+	if (g_latency_samples == 0 || latency < g_latency_min)
+		g_latency_min = latency;
+	if (latency > g_latency_max)
+		g_latency_max = latency;
+	g_latency_total += latency;
+	g_latency_samples++;
+}
+
+/* Format the input sent and the latencies measured into buf, for the
+   ctrl socket */
+RD_BOOL
+loadgen_format_stats(int n, char *buf, size_t size)
+{
+	if (n != 0 || g_nevents == 0)
+		return False;
+
+	snprintf(buf, size,
+		 "input_events=%u latency_samples=%u latency_timeouts=%u latency_min=%u "
+		 "latency_avg=%u latency_max=%u", g_events_sent, g_latency_samples,
+		 g_latency_timeouts, (unsigned) g_latency_min,
+		 g_latency_samples ? (unsigned) (g_latency_total / g_latency_samples) : 0,
+		 (unsigned) g_latency_max);
+	return True;
+}
+
+/* Report what was measured and forget the script */
+void
+loadgen_close(void)
+{
+	char buf[256];
+	int i;
+
+	if (g_started && loadgen_format_stats(0, buf, sizeof(buf)))
+		logger(Core, Notice, "Input script: %s", buf);
+
+	for (i = 0; i < g_nevents; i++)
+		xfree(g_events[i].text);
+	xfree(g_events);
+	g_events = NULL;
+	g_nevents = 0;
+	g_started = False;
+	g_waiting = False;
+}
@@ -24,6 +24,7 @@
 uint16 g_mcs_userid;
 extern VCHANNEL g_channels[];
 extern unsigned int g_num_channels;
+extern uint16 g_mcs_msgchannel;
 
 
 /* Output a DOMAIN_PARAMS structure (ASN.1 BER) */
@@ -403,6 +404,13 @@ mcs_connect_finalize(STREAM mcs_data)
 		if (!mcs_recv_cjcf())
 			goto error;
 	}
+
+	if (g_mcs_msgchannel != 0)
+	{
+		mcs_send_cjrq(g_mcs_msgchannel);
+		if (!mcs_recv_cjcf())
+			goto error;
+	}
 	return True;
 
       error:
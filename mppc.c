@@ -39,6 +39,10 @@
 /* decompression is alright as long as we   */
 /* don't compress data                      */
 
+/* the patents have expired since, so data  */
+/* sent on virtual channels is compressed   */
+/* as well, see mppc_compress()             */
+
 /* Algorithm: */
 
 /* as the RFC states the algorithm seems to */
@@ -54,17 +58,112 @@
 
 RDPCOMP g_mppc_dict;
 
+/* Tokens are decoded from a 64 bit, MSB aligned bit buffer. It is
+   refilled before every token, and a token takes at most 49 bits (a
+   19 bit offset and a 30 bit length), so the decoding itself never
+   runs out of bits in the middle of the input. Past the end of the
+   input the buffer reads as zeros, and nbits going negative tells
+   that a token was truncated. */
+typedef struct
+{
+	uint64 bits;
+	int nbits;
+	const uint8 *p, *end;
+}
+MPPC_READER;
+
+#define MPPC_REFILL(r) \
+	while ((r)->nbits <= 56 && (r)->p < (r)->end) \
+	{ \
+		(r)->bits |= (uint64) *(r)->p++ << (56 - (r)->nbits); \
+		(r)->nbits += 8; \
+	}
+
+#define MPPC_PEEK(r,n)		((uint32) ((r)->bits >> (64 - (n))))
+#define MPPC_SKIP(r,n)		{ (r)->bits <<= (n); (r)->nbits -= (n); }
+
+/* Copy tuple offsets, indexed by the top bits of a token starting with
+   11: the length of the prefix, the number of value bits that follow
+   it and the offset they are relative to */
+typedef struct
+{
+	uint8 prefix;
+	uint8 bits;
+	uint16 base;
+}
+MPPC_OFFSET_CODE;
+
+/* 64k history, top 5 bits: 110 + 16, 1110 + 11, 11110 + 8, 11111 + 6 */
+static const MPPC_OFFSET_CODE mppc_offsets_big[8] = {
+	{3, 16, 2368}, {3, 16, 2368}, {3, 16, 2368}, {3, 16, 2368},
+	{4, 11, 320}, {4, 11, 320},
+	{5, 8, 64},
+	{5, 6, 0}
+};
+
+/* 8k history, top 4 bits: 110 + 13, 1110 + 8, 1111 + 6 */
+static const MPPC_OFFSET_CODE mppc_offsets_small[4] = {
+	{3, 13, 320}, {3, 13, 320},
+	{4, 8, 64},
+	{4, 6, 0}
+};
+
+/* Number of leading one bits in a nibble */
+static const uint8 mppc_leading_ones[16] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 3, 4
+};
+
+/* Copy a match of length bytes from src to dst in the history. When
+   the match overlaps its own output, the data repeats with a period of
+   dst - src, so it can be copied in chunks that double in size. */
+static void
+mppc_copy_match(uint8 * dict, uint32 dst, uint32 src, uint32 length)
+{
+	uint32 n;
+
+	if (src + length > RDP_MPPC_DICT_SIZE || src == dst)
+	{
+		/* wraps around the end of the history, or copies onto itself */
+		while (length-- != 0)
+		{
+			dict[dst++] = dict[src];
+			src = (src + 1) & (RDP_MPPC_DICT_SIZE - 1);
+		}
+		return;
+	}
+
+	if (src > dst || dst - src >= length)
+	{
+		memmove(dict + dst, dict + src, length);
+		return;
+	}
+
+	if (dst - src == 1)
+	{
+		memset(dict + dst, dict[src], length);
+		return;
+	}
+
+	while (length != 0)
+	{
+		n = MIN(dst - src, length);
+		memcpy(dict + dst, dict + src, n);
+		dst += n;
+		length -= n;
+	}
+}
+
 int
 mppc_expand(uint8 * data, uint32 clen, uint8 ctype, uint32 * roff, uint32 * rlen)
 {
-	int k, walker_len = 0, walker;
-	uint32 i = 0;
-	int next_offset, match_off;
-	int match_len;
-	int old_offset, match_bits;
+	MPPC_READER r;
+	const MPPC_OFFSET_CODE *code;
+	uint32 next_offset, old_offset, match_off, match_len, mask;
+	int ones, n;
 	RD_BOOL big = ctype & RDP_MPPC_BIG ? True : False;
 
 	uint8 *dict = g_mppc_dict.hist;
+	TRACE_SCOPE(TRACE_MPPC_EXPAND);
 
 	if ((ctype & RDP_MPPC_COMPRESSED) == 0)
 	{
@@ -84,290 +183,94 @@ mppc_expand(uint8 * data, uint32 clen, uint8 ctype, uint32 * roff, uint32 * rlen
 		g_mppc_dict.roff = 0;
 	}
 
-	*roff = 0;
-	*rlen = 0;
-
-	walker = g_mppc_dict.roff;
-
-	next_offset = walker;
-	old_offset = next_offset;
+	next_offset = old_offset = g_mppc_dict.roff;
 	*roff = old_offset;
+	*rlen = 0;
 	if (clen == 0)
 		return 0;
-	clen += i;
 
-	do
+	mask = big ? 65535 : 8191;
+	r.bits = 0;
+	r.nbits = 0;
+	r.p = data;
+	r.end = data + clen;
+
+	while (1)
 	{
-		if (walker_len == 0)
-		{
-			if (i >= clen)
-				break;
-			walker = data[i++] << 24;
-			walker_len = 8;
-		}
-		if (walker >= 0)
-		{
-			if (walker_len < 8)
-			{
-				if (i >= clen)
-				{
-					if (walker != 0)
-						return -1;
-					break;
-				}
-				walker |= (data[i++] & 0xff) << (24 - walker_len);
-				walker_len += 8;
-			}
-			if (next_offset >= RDP_MPPC_DICT_SIZE)
-				return -1;
-			dict[next_offset++] = (((uint32) walker) >> ((uint32) 24));
-			walker <<= 8;
-			walker_len -= 8;
-			continue;
-		}
-		walker <<= 1;
-		/* fetch next 8-bits */
-		if (--walker_len == 0)
+		MPPC_REFILL(&r);
+
+		/* the input ends with less than a byte of zero padding */
+		if (r.nbits < 8)
 		{
-			if (i >= clen)
+			if (r.nbits > 0 && r.bits != 0)
 				return -1;
-			walker = data[i++] << 24;
-			walker_len = 8;
+			break;
 		}
-		/* literal decoding */
-		if (walker >= 0)
+
+		/* literals: 0 + 7 bits, or 10 + 7 bits for 0x80 and up */
+		if ((r.bits >> 63) == 0)
 		{
-			if (walker_len < 8)
-			{
-				if (i >= clen)
-					return -1;
-				walker |= (data[i++] & 0xff) << (24 - walker_len);
-				walker_len += 8;
-			}
 			if (next_offset >= RDP_MPPC_DICT_SIZE)
 				return -1;
-			dict[next_offset++] = (uint8) (walker >> 24 | 0x80);
-			walker <<= 8;
-			walker_len -= 8;
+			dict[next_offset++] = MPPC_PEEK(&r, 8);
+			MPPC_SKIP(&r, 8);
 			continue;
 		}
-
-		/* decode offset  */
-		/* length pair    */
-		walker <<= 1;
-		if (--walker_len < (big ? 3 : 2))
+		if ((r.bits >> 62) == 2)
 		{
-			if (i >= clen)
+			if (r.nbits < 9 || next_offset >= RDP_MPPC_DICT_SIZE)
 				return -1;
-			walker |= (data[i++] & 0xff) << (24 - walker_len);
-			walker_len += 8;
+			dict[next_offset++] = 0x80 | (MPPC_PEEK(&r, 9) & 0x7f);
+			MPPC_SKIP(&r, 9);
+			continue;
 		}
 
+		/* copy tuple, offset first */
 		if (big)
-		{
-			/* offset decoding where offset len is:
-			   -63: 11111 followed by the lower 6 bits of the value
-			   64-319: 11110 followed by the lower 8 bits of the value ( value - 64 )
-			   320-2367: 1110 followed by lower 11 bits of the value ( value - 320 )
-			   2368-65535: 110 followed by lower 16 bits of the value ( value - 2368 )
-			 */
-			switch (((uint32) walker) >> ((uint32) 29))
-			{
-				case 7:	/* - 63 */
-					for (; walker_len < 9; walker_len += 8)
-					{
-						if (i >= clen)
-							return -1;
-						walker |= (data[i++] & 0xff) << (24 - walker_len);
-					}
-					walker <<= 3;
-					match_off = ((uint32) walker) >> ((uint32) 26);
-					walker <<= 6;
-					walker_len -= 9;
-					break;
-
-				case 6:	/* 64 - 319 */
-					for (; walker_len < 11; walker_len += 8)
-					{
-						if (i >= clen)
-							return -1;
-						walker |= (data[i++] & 0xff) << (24 - walker_len);
-					}
-
-					walker <<= 3;
-					match_off = (((uint32) walker) >> ((uint32) 24)) + 64;
-					walker <<= 8;
-					walker_len -= 11;
-					break;
-
-				case 5:
-				case 4:	/* 320 - 2367 */
-					for (; walker_len < 13; walker_len += 8)
-					{
-						if (i >= clen)
-							return -1;
-						walker |= (data[i++] & 0xff) << (24 - walker_len);
-					}
-
-					walker <<= 2;
-					match_off = (((uint32) walker) >> ((uint32) 21)) + 320;
-					walker <<= 11;
-					walker_len -= 13;
-					break;
-
-				default:	/* 2368 - 65535 */
-					for (; walker_len < 17; walker_len += 8)
-					{
-						if (i >= clen)
-							return -1;
-						walker |= (data[i++] & 0xff) << (24 - walker_len);
-					}
-
-					walker <<= 1;
-					match_off = (((uint32) walker) >> ((uint32) 16)) + 2368;
-					walker <<= 16;
-					walker_len -= 17;
-					break;
-			}
-		}
+			code = &mppc_offsets_big[MPPC_PEEK(&r, 5) & 7];
 		else
+			code = &mppc_offsets_small[MPPC_PEEK(&r, 4) & 3];
+		MPPC_SKIP(&r, code->prefix);
+		match_off = MPPC_PEEK(&r, code->bits) + code->base;
+		MPPC_SKIP(&r, code->bits);
+
+		/* then the length: 0 for 3, or n ones, a zero and n + 1 bits
+		   of the value, with its top bit implied */
+		if ((r.bits >> 63) == 0)
 		{
-			/* offset decoding where offset len is:
-			   -63: 1111 followed by the lower 6 bits of the value
-			   64-319: 1110 followed by the lower 8 bits of the value ( value - 64 )
-			   320-8191: 110 followed by the lower 13 bits of the value ( value - 320 )
-			 */
-			switch (((uint32) walker) >> ((uint32) 30))
-			{
-				case 3:	/* - 63 */
-					if (walker_len < 8)
-					{
-						if (i >= clen)
-							return -1;
-						walker |= (data[i++] & 0xff) << (24 - walker_len);
-						walker_len += 8;
-					}
-					walker <<= 2;
-					match_off = ((uint32) walker) >> ((uint32) 26);
-					walker <<= 6;
-					walker_len -= 8;
-					break;
-
-				case 2:	/* 64 - 319 */
-					for (; walker_len < 10; walker_len += 8)
-					{
-						if (i >= clen)
-							return -1;
-						walker |= (data[i++] & 0xff) << (24 - walker_len);
-					}
-
-					walker <<= 2;
-					match_off = (((uint32) walker) >> ((uint32) 24)) + 64;
-					walker <<= 8;
-					walker_len -= 10;
-					break;
-
-				default:	/* 320 - 8191 */
-					for (; walker_len < 14; walker_len += 8)
-					{
-						if (i >= clen)
-							return -1;
-						walker |= (data[i++] & 0xff) << (24 - walker_len);
-					}
-
-					match_off = (walker >> 18) + 320;
-					walker <<= 14;
-					walker_len -= 14;
-					break;
-			}
-		}
-		if (walker_len == 0)
-		{
-			if (i >= clen)
-				return -1;
-			walker = data[i++] << 24;
-			walker_len = 8;
-		}
-
-		/* decode length of match */
-		match_len = 0;
-		if (walker >= 0)
-		{		/* special case - length of 3 is in bit 0 */
 			match_len = 3;
-			walker <<= 1;
-			walker_len--;
+			MPPC_SKIP(&r, 1);
 		}
 		else
 		{
-			/* this is how it works len of:
-			   4-7: 10 followed by 2 bits of the value
-			   8-15: 110 followed by 3 bits of the value
-			   16-31: 1110 followed by 4 bits of the value
-			   32-63: .... and so forth
-			   64-127:
-			   128-255:
-			   256-511:
-			   512-1023:
-			   1024-2047:
-			   2048-4095:
-			   4096-8191:
-
-			   i.e. 4097 is encoded as: 111111111110 000000000001
-			   meaning 4096 + 1...
-			 */
-			match_bits = big ? 14 : 11;	/* 11 or 14 bits of value at most */
+			ones = 0;
 			do
 			{
-				walker <<= 1;
-				if (--walker_len == 0)
-				{
-					if (i >= clen)
-						return -1;
-					walker = data[i++] << 24;
-					walker_len = 8;
-				}
-				if (walker >= 0)
-					break;
-				if (--match_bits == 0)
-				{
-					return -1;
-				}
-			}
-			while (1);
-			match_len = (big ? 16 : 13) - match_bits;
-			walker <<= 1;
-			if (--walker_len < match_len)
-			{
-				for (; walker_len < match_len; walker_len += 8)
-				{
-					if (i >= clen)
-					{
-						return -1;
-					}
-					walker |= (data[i++] & 0xff) << (24 - walker_len);
-				}
+				n = mppc_leading_ones[MPPC_PEEK(&r, 4)];
+				ones += n;
+				MPPC_SKIP(&r, n);
 			}
+			while (n == 4 && ones < 16);
 
-			match_bits = match_len;
-			match_len = (walker >> (32 - match_bits));
-			match_len &= ((1 << match_bits) - 1);
-			match_len |= (1 << match_bits);
-			walker <<= match_bits;
-			walker_len -= match_bits;
+			if (ones > (big ? 14 : 11))
+				return -1;
+
+			MPPC_SKIP(&r, 1);
+			match_len = MPPC_PEEK(&r, ones + 1) | (1 << (ones + 1));
+			MPPC_SKIP(&r, ones + 1);
 		}
+
+		if (r.nbits < 0)
+			return -1;
+
 		if (next_offset + match_len >= RDP_MPPC_DICT_SIZE)
 		{
 			return -1;
 		}
-		/* memory areas can overlap - meaning we can't use memXXX functions */
-		k = (next_offset - match_off) & (big ? 65535 : 8191);
-		do
-		{
-			dict[next_offset++] = dict[k++];
-		}
-		while (--match_len != 0);
+
+		mppc_copy_match(dict, next_offset, (next_offset - match_off) & mask, match_len);
+		next_offset += match_len;
 	}
-	while (1);
 
 	/* store history offset */
 	g_mppc_dict.roff = next_offset;
@@ -377,3 +280,322 @@ mppc_expand(uint8 * data, uint32 clen, uint8 ctype, uint32 * roff, uint32 * rlen
 
 	return 0;
 }
+
+/* RDP 6.1 bulk compression. The level 1 pass replaces runs that occur
+   anywhere in the last 2 MB of output with matches, given as a list
+   ahead of the literals. Its output may in turn be MPPC compressed with
+   the 64k history (level 2). */
+static uint8 *g_xcrush_hist = NULL;
+static uint32 g_xcrush_offset = 0;
+
+static uint32
+get_uint16_le(const uint8 * p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static int
+xcrush_expand(uint8 * data, uint32 clen, uint8 ctype, uint8 ** out, uint32 * rlen)
+{
+	uint8 l1_flags, l2_flags, *src, *end, *literals, *dst, *match;
+	uint32 roff, len, count, i, match_len, match_out, match_hist, done, n;
+
+	if (g_xcrush_hist == NULL)
+		g_xcrush_hist = xmalloc(XCRUSH_HISTORY_SIZE);
+
+	if ((ctype & RDP_MPPC_FLUSH) != 0)
+	{
+		memset(g_xcrush_hist, 0, XCRUSH_HISTORY_SIZE);
+		g_xcrush_offset = 0;
+	}
+
+	if (clen < 2)
+		return -1;
+
+	l1_flags = data[0];
+	l2_flags = data[1];
+	src = data + 2;
+	len = clen - 2;
+
+	if ((l2_flags & RDP_MPPC_COMPRESSED) != 0)
+	{
+		if (mppc_expand(src, len, l2_flags | RDP_MPPC_BIG, &roff, &len) == -1)
+			return -1;
+		src = g_mppc_dict.hist + roff;
+	}
+	end = src + len;
+
+	if ((l1_flags & XCRUSH_L1_PACKET_AT_FRONT) != 0)
+		g_xcrush_offset = 0;
+
+	*out = dst = g_xcrush_hist + g_xcrush_offset;
+
+	if ((l1_flags & XCRUSH_L1_NO_COMPRESSION) != 0)
+	{
+		literals = src;
+	}
+	else if ((l1_flags & XCRUSH_L1_COMPRESSED) != 0)
+	{
+		if (len < 2)
+			return -1;
+		count = get_uint16_le(src);
+		if (2 + count * 8 > len)
+			return -1;
+		literals = src + 2 + count * 8;
+
+		/* every match is preceded by the literals up to its
+		   offset in the output */
+		done = 0;
+		for (i = 0; i < count; i++)
+		{
+			match_len = get_uint16_le(src + 2 + i * 8);
+			match_out = get_uint16_le(src + 4 + i * 8);
+			match_hist = get_uint16_le(src + 6 + i * 8) |
+				(get_uint16_le(src + 8 + i * 8) << 16);
+
+			if (match_out < done)
+				return -1;
+			n = match_out - done;
+			if (n > (uint32) (end - literals)
+			    || (dst - g_xcrush_hist) + n + match_len > XCRUSH_HISTORY_SIZE
+			    || match_hist + match_len > XCRUSH_HISTORY_SIZE)
+				return -1;
+
+			memcpy(dst, literals, n);
+			dst += n;
+			literals += n;
+
+			/* a match may overlap its own output */
+			match = g_xcrush_hist + match_hist;
+			if (match + match_len <= dst || match >= dst + match_len)
+				memcpy(dst, match, match_len);
+			else
+				for (n = 0; n < match_len; n++)
+					dst[n] = match[n];
+			dst += match_len;
+			done = match_out + match_len;
+		}
+	}
+	else
+	{
+		return -1;
+	}
+
+	n = end - literals;
+	if ((dst - g_xcrush_hist) + n > XCRUSH_HISTORY_SIZE)
+		return -1;
+	memcpy(dst, literals, n);
+	dst += n;
+
+	*rlen = dst - *out;
+	g_xcrush_offset = dst - g_xcrush_hist;
+
+	return 0;
+}
+
+/* Expand a compressed PDU, of whichever compression type ctype gives.
+   The returned stream reads straight from the history buffer the data
+   was expanded into, and stays valid until the next call. NULL if the
+   data does not decode. */
+STREAM
+mppc_decompress(uint8 * data, uint32 clen, uint8 ctype)
+{
+	STREAM ns = &g_mppc_dict.ns;
+	uint8 *out;
+	uint32 roff, rlen;
+
+	switch (ctype & RDP_COMPR_TYPE_MASK)
+	{
+		case RDP_COMPR_TYPE_8K:
+		case RDP_COMPR_TYPE_64K:
+			if (mppc_expand(data, clen, ctype, &roff, &rlen) == -1)
+				return NULL;
+			out = g_mppc_dict.hist + roff;
+			break;
+
+		case RDP_COMPR_TYPE_RDP61:
+			if (xcrush_expand(data, clen, ctype, &out, &rlen) == -1)
+				return NULL;
+			break;
+
+		default:
+			logger(Protocol, Error, "mppc_decompress(), unsupported compression type %d",
+			       ctype & RDP_COMPR_TYPE_MASK);
+			return NULL;
+	}
+
+	memset(ns, 0, sizeof(*ns));
+	ns->data = ns->p = out;
+	ns->size = rlen;
+	ns->end = ns->data + rlen;
+	s_push_layer(ns, rdp_hdr, 0);
+
+	return ns;
+}
+
+/* Compression of the data sent on virtual channels, with the 8k
+   history. The compressor keeps a copy of the history the server
+   builds up, so a match may refer to anything before the current
+   position in it. */
+#define MPPC_ENC_HISTORY	8192
+#define MPPC_ENC_HASH_SIZE	4096
+#define MPPC_ENC_MAX_MATCH	8191
+
+static struct
+{
+	uint8 hist[MPPC_ENC_HISTORY];
+	uint16 hash[MPPC_ENC_HASH_SIZE];
+	uint32 offset;
+	RD_BOOL flush;
+} g_mppc_enc = { {0}, {0}, 0, True };
+
+typedef struct
+{
+	uint8 *data;
+	uint32 bits;
+	uint32 limit;
+	uint32 value;
+	int count;
+}
+MPPC_WRITER;
+
+/* Append n bits, False once the output reached its limit */
+static RD_BOOL
+mppc_put_bits(MPPC_WRITER * w, uint32 bits, int n)
+{
+	w->value = (w->value << n) | (bits & ((1 << n) - 1));
+	w->count += n;
+	while (w->count >= 8)
+	{
+		if (w->bits / 8 >= w->limit)
+			return False;
+		w->count -= 8;
+		w->data[w->bits / 8] = w->value >> w->count;
+		w->bits += 8;
+	}
+	return True;
+}
+
+static RD_BOOL
+mppc_put_match(MPPC_WRITER * w, uint32 offset, uint32 length)
+{
+	RD_BOOL ok;
+	int n;
+
+	if (offset < 64)
+		ok = mppc_put_bits(w, (0xf << 6) | offset, 10);
+	else if (offset < 320)
+		ok = mppc_put_bits(w, (0xe << 8) | (offset - 64), 12);
+	else
+		ok = mppc_put_bits(w, (0x6 << 13) | (offset - 320), 16);
+	if (!ok)
+		return False;
+
+	if (length == 3)
+		return mppc_put_bits(w, 0, 1);
+
+	/* n - 1 ones, a zero and the low n bits of the length */
+	for (n = 2; (length >> (n + 1)) != 0; n++);
+	return mppc_put_bits(w, ((1 << (n - 1)) - 1) << 1, n) &&
+		mppc_put_bits(w, length, n);
+}
+
+#define MPPC_ENC_HASH(p)	((((p)[0] << 8) ^ ((p)[1] << 4) ^ (p)[2]) & (MPPC_ENC_HASH_SIZE - 1))
+
+/* Compress len bytes of data into out, which must have room for len
+   bytes. Returns the RDP_MPPC_* flags to send the data with: with
+   RDP_MPPC_COMPRESSED, *olen bytes of out are to be sent, otherwise
+   the data itself goes out, as it did not compress. */
+uint8
+mppc_compress(uint8 * data, uint32 len, uint8 * out, uint32 * olen)
+{
+	MPPC_WRITER w;
+	uint8 ctype = RDP_MPPC_COMPRESSED;
+	uint8 *hist = g_mppc_enc.hist;
+	uint32 pos, end, candidate, length, max;
+	uint16 *slot;
+
+	if (g_mppc_enc.flush)
+	{
+		/* the server clears its history as well */
+		memset(hist, 0, sizeof(g_mppc_enc.hist));
+		memset(g_mppc_enc.hash, 0, sizeof(g_mppc_enc.hash));
+		g_mppc_enc.offset = 0;
+		g_mppc_enc.flush = False;
+		ctype |= RDP_MPPC_FLUSH;
+	}
+
+	if (len > MPPC_ENC_HISTORY)
+		goto raw;
+
+	if (g_mppc_enc.offset + len > MPPC_ENC_HISTORY)
+	{
+		/* start over at the front, the data there stays usable */
+		g_mppc_enc.offset = 0;
+		ctype |= RDP_MPPC_RESET;
+	}
+
+	pos = g_mppc_enc.offset;
+	end = pos + len;
+	memcpy(hist + pos, data, len);
+
+	memset(&w, 0, sizeof(w));
+	w.data = out;
+	w.limit = len;
+
+	while (pos < end)
+	{
+		length = 0;
+		if (pos + 3 <= end)
+		{
+			slot = &g_mppc_enc.hash[MPPC_ENC_HASH(hist + pos)];
+			candidate = *slot;
+			*slot = pos;
+			if (candidate < pos)
+			{
+				max = MIN(end - pos, MPPC_ENC_MAX_MATCH);
+				while (length < max && hist[candidate + length] == hist[pos + length])
+					length++;
+			}
+		}
+
+		if (length >= 3)
+		{
+			if (!mppc_put_match(&w, pos - candidate, length))
+				goto raw;
+			pos += length;
+		}
+		else
+		{
+			if (hist[pos] < 0x80)
+			{
+				if (!mppc_put_bits(&w, hist[pos], 8))
+					goto raw;
+			}
+			else if (!mppc_put_bits(&w, 0x100 | (hist[pos] & 0x7f), 9))
+				goto raw;
+			pos++;
+		}
+	}
+
+	/* pad the last byte with zeros */
+	if (w.count > 0 && !mppc_put_bits(&w, 0, 8 - w.count))
+		goto raw;
+
+	g_mppc_enc.offset = end;
+	*olen = w.bits / 8;
+	return ctype;
+
+      raw:
+	/* sent as is, which also flushes the history on both ends */
+	g_mppc_enc.flush = True;
+	*olen = len;
+	return RDP_MPPC_FLUSH;
+}
+
+/* Start over with an empty history, for a new connection */
+void
+mppc_compress_reset(void)
+{
+	g_mppc_enc.flush = True;
+}
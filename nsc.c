@@ -0,0 +1,263 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   NSCodec decoder
+   Copyright 2026 the rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* NSCodec (MS-RDPNSC) sends an image as four run length coded planes:
+   luma, orange and green chroma, and alpha. The chroma planes may have
+   their precision reduced by the colour loss level, and may be
+   subsampled by two in both directions. It is used on its own in
+   surface bits commands and as a ClearCodec subcodec. */
+
+#include "rdesktop.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/* Run length decoding of one plane, the last four bytes are always
+   sent raw */
+static RD_BOOL
+nsc_rle_decode(uint8 * in, uint32 in_size, uint8 * out, uint32 out_size)
+{
+	uint8 *in_end = in + in_size;
+	uint32 left = out_size;
+	uint32 len;
+	uint8 value;
+
+	while (left > 4)
+	{
+		if (in_end - in < 2)
+			return False;
+		value = *in++;
+		if (left == 5 || value != *in)
+		{
+			*out++ = value;
+			left--;
+			continue;
+		}
+
+		in++;
+		if (in >= in_end)
+			return False;
+		if (*in < 0xff)
+		{
+			len = *in++ + 2;
+		}
+		else
+		{
+			if (in_end - in < 5)
+				return False;
+			len = in[1] | (in[2] << 8) | (in[3] << 16) | ((uint32) in[4] << 24);
+			in += 5;
+		}
+		if (len > left)
+			return False;
+		memset(out, value, len);
+		out += len;
+		left -= len;
+	}
+
+	if (in_end - in < 4)
+		return False;
+	memcpy(out, in, 4);
+	return True;
+}
+
+/* Convert one row from YCoCg to opaque BGRA. With subsampling each
+   chroma sample covers two pixels of the row. */
+static void
+nsc_ycocg_to_bgra(uint8 * yp, uint8 * cop, uint8 * cgp, int shift, RD_BOOL subsampled,
+		  uint8 * out, int width)
+{
+	int x = 0, cx;
+	sint16 yv, co, cg, r, g, b;
+
+#if defined(__SSE2__)
+	__m128i zero = _mm_setzero_si128();
+	__m128i alpha = _mm_set1_epi8((char) 0xff);
+	__m128i cshift = _mm_cvtsi32_si128(shift + 8);
+	__m128i vy, vco, vcg, vr, vg, vb, bg, ra;
+	uint32 tmp;
+
+	for (; x + 8 <= width; x += 8)
+	{
+		vy = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i *) (yp + x)), zero);
+		if (subsampled)
+		{
+			memcpy(&tmp, cop + x / 2, 4);
+			vco = _mm_cvtsi32_si128(tmp);
+			vco = _mm_unpacklo_epi8(vco, vco);
+			memcpy(&tmp, cgp + x / 2, 4);
+			vcg = _mm_cvtsi32_si128(tmp);
+			vcg = _mm_unpacklo_epi8(vcg, vcg);
+		}
+		else
+		{
+			vco = _mm_loadl_epi64((__m128i *) (cop + x));
+			vcg = _mm_loadl_epi64((__m128i *) (cgp + x));
+		}
+		/* (sint8) (c << shift), in 16 bit lanes */
+		vco = _mm_srai_epi16(_mm_sll_epi16(_mm_unpacklo_epi8(vco, zero), cshift), 8);
+		vcg = _mm_srai_epi16(_mm_sll_epi16(_mm_unpacklo_epi8(vcg, zero), cshift), 8);
+
+		vr = _mm_sub_epi16(_mm_add_epi16(vy, vco), vcg);
+		vg = _mm_add_epi16(vy, vcg);
+		vb = _mm_sub_epi16(_mm_sub_epi16(vy, vco), vcg);
+
+		vr = _mm_packus_epi16(vr, vr);
+		vg = _mm_packus_epi16(vg, vg);
+		vb = _mm_packus_epi16(vb, vb);
+		bg = _mm_unpacklo_epi8(vb, vg);
+		ra = _mm_unpacklo_epi8(vr, alpha);
+		_mm_storeu_si128((__m128i *) (out + x * 4), _mm_unpacklo_epi16(bg, ra));
+		_mm_storeu_si128((__m128i *) (out + x * 4 + 16), _mm_unpackhi_epi16(bg, ra));
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	int16x8_t cshift = vdupq_n_s16(shift + 8);
+	int16x8_t vy, vco, vcg;
+	uint8x8_t c8;
+	uint8x8x4_t px;
+	uint32 tmp;
+
+	px.val[3] = vdup_n_u8(0xff);
+	for (; x + 8 <= width; x += 8)
+	{
+		vy = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(yp + x)));
+		if (subsampled)
+		{
+			memcpy(&tmp, cop + x / 2, 4);
+			c8 = vreinterpret_u8_u32(vdup_n_u32(tmp));
+			vco = vreinterpretq_s16_u16(vmovl_u8(vzip_u8(c8, c8).val[0]));
+			memcpy(&tmp, cgp + x / 2, 4);
+			c8 = vreinterpret_u8_u32(vdup_n_u32(tmp));
+			vcg = vreinterpretq_s16_u16(vmovl_u8(vzip_u8(c8, c8).val[0]));
+		}
+		else
+		{
+			vco = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(cop + x)));
+			vcg = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(cgp + x)));
+		}
+		/* (sint8) (c << shift), in 16 bit lanes */
+		vco = vshrq_n_s16(vshlq_s16(vco, cshift), 8);
+		vcg = vshrq_n_s16(vshlq_s16(vcg, cshift), 8);
+
+		px.val[0] = vqmovun_s16(vsubq_s16(vsubq_s16(vy, vco), vcg));
+		px.val[1] = vqmovun_s16(vaddq_s16(vy, vcg));
+		px.val[2] = vqmovun_s16(vsubq_s16(vaddq_s16(vy, vco), vcg));
+		vst4_u8(out + x * 4, px);
+	}
+#endif
+
+	for (; x < width; x++)
+	{
+		cx = subsampled ? x >> 1 : x;
+		yv = yp[x];
+		co = (sint8) (cop[cx] << shift);
+		cg = (sint8) (cgp[cx] << shift);
+		r = yv + co - cg;
+		g = yv + cg;
+		b = yv - co - cg;
+		out[x * 4] = MIN(MAX(b, 0), 255);
+		out[x * 4 + 1] = MIN(MAX(g, 0), 255);
+		out[x * 4 + 2] = MIN(MAX(r, 0), 255);
+		out[x * 4 + 3] = 0xff;
+	}
+}
+
+/* Decode an NSCodec bitstream of width by height pixels to 32 bpp
+   BGRA at dst */
+RD_BOOL
+nsc_decode(uint8 * data, uint32 size, int width, int height, uint8 * dst, int stride)
+{
+	struct stream packet;
+	STREAM s = &packet;
+	uint32 plane_size[4], orig_size[4];
+	uint8 cll, subsampling, *planes[4], *p;
+	uint8 *yp, *cop, *cgp;
+	int i, y, rw, rh;
+	RD_BOOL rv = False;
+
+	memset(s, 0, sizeof(*s));
+	s->data = s->p = data;
+	s->end = data + size;
+
+	if (!s_check_rem(s, 20))
+		return False;
+	for (i = 0; i < 4; i++)
+		in_uint32_le(s, plane_size[i]);
+	in_uint8(s, cll);
+	in_uint8(s, subsampling);
+	in_uint8s(s, 2);	/* reserved */
+
+	if (cll < 1 || cll > 7)
+		return False;
+
+	rw = (width + 7) & ~7;
+	rh = (height + 1) & ~1;
+	for (i = 0; i < 4; i++)
+		orig_size[i] = width * height;
+	if (subsampling)
+	{
+		orig_size[0] = rw * height;
+		orig_size[1] = orig_size[2] = (rw / 2) * (rh / 2);
+	}
+
+	for (i = 0; i < 4; i++)
+		planes[i] = NULL;
+	for (i = 0; i < 4; i++)
+	{
+		planes[i] = xmalloc(orig_size[i]);
+		if (!s_check_rem(s, plane_size[i]))
+			goto out;
+		in_uint8p(s, p, plane_size[i]);
+		if (plane_size[i] == 0)
+			memset(planes[i], 0xff, orig_size[i]);
+		else if (plane_size[i] < orig_size[i])
+		{
+			if (!nsc_rle_decode(p, plane_size[i], planes[i], orig_size[i]))
+				goto out;
+		}
+		else
+			memcpy(planes[i], p, orig_size[i]);
+	}
+
+	for (y = 0; y < height; y++)
+	{
+		if (subsampling)
+		{
+			yp = planes[0] + y * rw;
+			cop = planes[1] + (y >> 1) * (rw >> 1);
+			cgp = planes[2] + (y >> 1) * (rw >> 1);
+		}
+		else
+		{
+			yp = planes[0] + y * width;
+			cop = planes[1] + y * width;
+			cgp = planes[2] + y * width;
+		}
+		nsc_ycocg_to_bgra(yp, cop, cgp, cll - 1, subsampling, dst + y * stride, width);
+	}
+	rv = True;
+
+out:
+	for (i = 0; i < 4; i++)
+		xfree(planes[i]);
+	return rv;
+}
@@ -0,0 +1,735 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Headless user interface
+   Copyright 2026 the rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The ui_* functions of xwin.c, xkeymap.c and xclip.c without an X
+   display, for running many clients from one machine to load test
+   servers. Everything the server sends is received, decompressed and
+   cached as usual, only the drawing is left out. Bitmaps, glyphs and
+   cursors are all the same non-NULL handle, so the caches behave as
+   they would with a display. Input comes from the script of
+   --input-script, if any, see loadgen.c, and there is no clipboard as
+   the channel is never registered. Built as rdesktop-headless. */
+
+#include <errno.h>
+#include "rdesktop.h"
+
+/* Size of the screen there is not, for fullscreen and percentage
+   geometries */
+#define NULLWIN_SCREEN_WIDTH	1920
+#define NULLWIN_SCREEN_HEIGHT	1080
+
+extern RD_BOOL g_exit_mainloop;
+extern RD_BOOL g_user_quit;
+extern char *g_input_script;
+
+RD_BOOL g_dynamic_session_resize = True;
+RD_BOOL g_bitmap_alpha = True;
+time_t g_wait_for_deactivate_ts = 0;
+
+static uint8 g_null_handle;
+static RD_BOOL g_have_window = False;
+static RD_BOOL g_offscreen = False;
+
+/* What is drawn on the screen may answer scripted input */
+static void
+null_drawn(int x, int y, int cx, int cy)
+{
+	if (!g_offscreen)
+		loadgen_drawn(x, y, cx, cy);
+}
+
+RD_BOOL
+ui_init(void)
+{
+	logger(GUI, Verbose, "Running headless, nothing is drawn");
+	if (g_input_script != NULL && !loadgen_open(g_input_script))
+		return False;
+	return True;
+}
+
+void
+ui_deinit(void)
+{
+	loadgen_close();
+}
+
+void
+ui_get_screen_size(uint32 * width, uint32 * height)
+{
+	*width = NULLWIN_SCREEN_WIDTH;
+	*height = NULLWIN_SCREEN_HEIGHT;
+}
+
+int
+ui_get_monitors(RD_MONITOR * monitors, int max)
+{
+	UNUSED(monitors);
+	UNUSED(max);
+	return 0;
+}
+
+void
+ui_get_screen_size_from_percentage(uint32 pw, uint32 ph, uint32 * width, uint32 * height)
+{
+	*width = NULLWIN_SCREEN_WIDTH * pw / 100;
+	*height = NULLWIN_SCREEN_HEIGHT * ph / 100;
+}
+
+void
+ui_get_workarea_size(uint32 * width, uint32 * height)
+{
+	ui_get_screen_size(width, height);
+}
+
+RD_BOOL
+ui_create_window(uint32 width, uint32 height)
+{
+	logger(GUI, Debug, "ui_create_window(), %dx%d", width, height);
+	g_have_window = True;
+	loadgen_start();
+	return True;
+}
+
+void
+ui_resize_window(uint32 width, uint32 height)
+{
+	logger(GUI, Debug, "ui_resize_window(), %dx%d", width, height);
+}
+
+void
+ui_destroy_window(void)
+{
+	g_have_window = False;
+}
+
+void
+ui_update_window_sizehints(uint32 width, uint32 height)
+{
+	UNUSED(width);
+	UNUSED(height);
+}
+
+RD_BOOL
+ui_have_window(void)
+{
+	return g_have_window;
+}
+
+/* Wait for data on the rdp socket, looking after the other file
+   descriptors in the meantime, as xwin.c does without the X events */
+static RD_BOOL
+process_fds(int rdp_socket, int ms)
+{
+	int n, ret, events;
+	fd_set rfds, wfds;
+	struct timeval tv;
+	RD_BOOL s_timeout = False;
+
+	n = -1;
+	FD_ZERO(&rfds);
+	FD_ZERO(&wfds);
+
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms - (tv.tv_sec * 1000)) * 1000;
+
+#ifdef WITH_RDPSND
+	rdpsnd_add_fds(&n, &rfds, &wfds, &tv);
+#endif
+
+	rdpdr_add_fds(&n, &rfds, &wfds, &tv, &s_timeout);
+	seamless_select_timeout(&tv);
+
+	ret = evloop_wait(n, &rfds, &wfds, &tv);
+	if (ret <= 0)
+	{
+		if (ret == -1 && errno != EINTR)
+			logger(GUI, Error, "process_fds(), wait failed: %s", strerror(errno));
+#ifdef WITH_RDPSND
+		rdpsnd_check_fds(&rfds, &wfds);
+#endif
+		if (s_timeout)
+			rdpdr_check_fds(&rfds, &wfds, (RD_BOOL) True);
+		return False;
+	}
+
+	tcp_cork();
+#ifdef WITH_RDPSND
+	rdpsnd_check_fds(&rfds, &wfds);
+#endif
+	rdpdr_check_fds(&rfds, &wfds, (RD_BOOL) False);
+	ctrl_check_fds();
+	tcp_uncork();
+
+	events = evloop_check_fd(rdp_socket);
+	if (events & EVLOOP_WRITE)
+		channel_flush();
+
+	return (events & EVLOOP_READ) ? True : False;
+}
+
+void
+ui_select(int rdp_socket)
+{
+	int timeout, ret;
+	RD_BOOL rdp_socket_has_data = False;
+
+	while (g_exit_mainloop == False && rdp_socket_has_data == False)
+	{
+#ifdef WITH_TRACE
+		trace_check_signal();
+#endif
+		if (!loadgen_run())
+		{
+			g_user_quit = True;
+			g_exit_mainloop = True;
+			break;
+		}
+
+		timeout = 60000;
+
+		dvc_flush();
+		ret = dvc_send_timeout();
+		if (ret >= 0 && ret < timeout)
+			timeout = ret;
+		ret = loadgen_timeout();
+		if (ret >= 0 && ret < timeout)
+			timeout = ret;
+#ifdef WITH_TSMF
+		ret = tsmf_present();
+		if (ret >= 0 && ret < timeout)
+			timeout = ret;
+#endif
+
+		rdp_socket_has_data = process_fds(rdp_socket, timeout);
+	}
+}
+
+void
+ui_move_pointer(int x, int y)
+{
+	UNUSED(x);
+	UNUSED(y);
+}
+
+RD_HBITMAP
+ui_create_bitmap(int width, int height, uint8 * data)
+{
+	UNUSED(width);
+	UNUSED(height);
+	UNUSED(data);
+	return (RD_HBITMAP) & g_null_handle;
+}
+
+void
+ui_paint_bitmap(int x, int y, int cx, int cy, int width, int height, uint8 * data)
+{
+	UNUSED(width);
+	UNUSED(height);
+	UNUSED(data);
+	null_drawn(x, y, cx, cy);
+}
+
+void
+ui_destroy_bitmap(RD_HBITMAP bmp)
+{
+	UNUSED(bmp);
+}
+
+RD_HBITMAP
+ui_create_surface(int width, int height)
+{
+	UNUSED(width);
+	UNUSED(height);
+	return (RD_HBITMAP) & g_null_handle;
+}
+
+void
+ui_switch_surface(RD_HBITMAP surface)
+{
+	g_offscreen = surface != NULL;
+}
+
+RD_HGLYPH
+ui_create_glyph(int width, int height, uint8 * data)
+{
+	UNUSED(width);
+	UNUSED(height);
+	UNUSED(data);
+	return (RD_HGLYPH) & g_null_handle;
+}
+
+void
+ui_destroy_glyph(RD_HGLYPH glyph)
+{
+	UNUSED(glyph);
+}
+
+RD_HCURSOR
+ui_create_cursor(unsigned int x, unsigned int y, uint32 width, uint32 height,
+		 uint8 * andmask, uint8 * xormask, int bpp)
+{
+	UNUSED(x);
+	UNUSED(y);
+	UNUSED(width);
+	UNUSED(height);
+	UNUSED(andmask);
+	UNUSED(xormask);
+	UNUSED(bpp);
+	return (RD_HCURSOR) & g_null_handle;
+}
+
+void
+ui_set_cursor(RD_HCURSOR cursor)
+{
+	UNUSED(cursor);
+}
+
+void
+ui_destroy_cursor(RD_HCURSOR cursor)
+{
+	UNUSED(cursor);
+}
+
+void
+ui_set_null_cursor(void)
+{
+}
+
+void
+ui_set_standard_cursor(void)
+{
+}
+
+RD_HCOLOURMAP
+ui_create_colourmap(COLOURMAP * colours)
+{
+	UNUSED(colours);
+	return (RD_HCOLOURMAP) & g_null_handle;
+}
+
+void
+ui_set_colourmap(RD_HCOLOURMAP map)
+{
+	UNUSED(map);
+}
+
+void
+ui_set_clip(int x, int y, int cx, int cy)
+{
+	UNUSED(x);
+	UNUSED(y);
+	UNUSED(cx);
+	UNUSED(cy);
+}
+
+void
+ui_reset_clip(void)
+{
+}
+
+void
+ui_bell(void)
+{
+}
+
+void
+ui_destblt(uint8 opcode, int x, int y, int cx, int cy)
+{
+	UNUSED(opcode);
+	null_drawn(x, y, cx, cy);
+}
+
+void
+ui_patblt(uint8 opcode, int x, int y, int cx, int cy, BRUSH * brush, uint32 bgcolour,
+	  uint32 fgcolour)
+{
+	UNUSED(opcode);
+	UNUSED(brush);
+	UNUSED(bgcolour);
+	UNUSED(fgcolour);
+	null_drawn(x, y, cx, cy);
+}
+
+void
+ui_screenblt(uint8 opcode, int x, int y, int cx, int cy, int srcx, int srcy)
+{
+	UNUSED(opcode);
+	UNUSED(srcx);
+	UNUSED(srcy);
+	null_drawn(x, y, cx, cy);
+}
+
+void
+ui_memblt(uint8 opcode, int x, int y, int cx, int cy, RD_HBITMAP src, int srcx, int srcy)
+{
+	UNUSED(opcode);
+	UNUSED(src);
+	UNUSED(srcx);
+	UNUSED(srcy);
+	null_drawn(x, y, cx, cy);
+}
+
+void
+ui_triblt(uint8 opcode, int x, int y, int cx, int cy, RD_HBITMAP src, int srcx, int srcy,
+	  BRUSH * brush, uint32 bgcolour, uint32 fgcolour)
+{
+	UNUSED(opcode);
+	UNUSED(src);
+	UNUSED(srcx);
+	UNUSED(srcy);
+	UNUSED(brush);
+	UNUSED(bgcolour);
+	UNUSED(fgcolour);
+	null_drawn(x, y, cx, cy);
+}
+
+void
+ui_line(uint8 opcode, int startx, int starty, int endx, int endy, PEN * pen)
+{
+	UNUSED(opcode);
+	UNUSED(pen);
+	null_drawn(MIN(startx, endx), MIN(starty, endy), abs(endx - startx) + 1,
+		   abs(endy - starty) + 1);
+}
+
+void
+ui_rect(int x, int y, int cx, int cy, uint32 colour)
+{
+	UNUSED(colour);
+	null_drawn(x, y, cx, cy);
+}
+
+void
+ui_polygon(uint8 opcode, uint8 fillmode, RD_POINT * point, int npoints, BRUSH * brush,
+	   uint32 bgcolour, uint32 fgcolour)
+{
+	UNUSED(opcode);
+	UNUSED(fillmode);
+	UNUSED(point);
+	UNUSED(npoints);
+	UNUSED(brush);
+	UNUSED(bgcolour);
+	UNUSED(fgcolour);
+}
+
+void
+ui_polyline(uint8 opcode, RD_POINT * points, int npoints, PEN * pen)
+{
+	UNUSED(opcode);
+	UNUSED(points);
+	UNUSED(npoints);
+	UNUSED(pen);
+}
+
+void
+ui_ellipse(uint8 opcode, uint8 fillmode, int x, int y, int cx, int cy, BRUSH * brush,
+	   uint32 bgcolour, uint32 fgcolour)
+{
+	UNUSED(opcode);
+	UNUSED(fillmode);
+	UNUSED(brush);
+	UNUSED(bgcolour);
+	UNUSED(fgcolour);
+	null_drawn(x, y, cx, cy);
+}
+
+/* Nothing is drawn, but the text cache is kept as xwin.c keeps it, the
+   server refers back to the fragments it has had the client store */
+void
+ui_draw_text(uint8 font, uint8 flags, uint8 opcode, int mixmode, int x, int y, int clipx,
+	     int clipy, int clipcx, int clipcy, int boxx, int boxy, int boxcx, int boxcy,
+	     BRUSH * brush, uint32 bgcolour, uint32 fgcolour, uint8 * text, uint8 length)
+{
+	int i;
+
+	UNUSED(font);
+	UNUSED(opcode);
+	UNUSED(mixmode);
+	UNUSED(x);
+	UNUSED(y);
+	UNUSED(brush);
+	UNUSED(bgcolour);
+	UNUSED(fgcolour);
+
+	if (boxcx > 1)
+		null_drawn(boxx, boxy, boxcx, boxcy);
+	else
+		null_drawn(clipx, clipy, clipcx, clipcy);
+
+	for (i = 0; i < length;)
+	{
+		switch (text[i])
+		{
+			case 0xff:
+				if (i + 3 > length)
+					return;
+				cache_put_text(text[i + 1], text, text[i + 2]);
+				i += 3;
+				length -= i;
+				text = &(text[i]);
+				i = 0;
+				break;
+
+			case 0xfe:
+				i += (i + 2 < length) ? 3 : 2;
+				break;
+
+			default:
+				/* glyph, with its offset unless implicit */
+				if (!(flags & TEXT2_IMPLICIT_X) && ++i < length && (text[i] & 0x80))
+					i += 2;
+				i++;
+				break;
+		}
+	}
+}
+
+void
+ui_desktop_save(uint32 offset, int x, int y, int cx, int cy)
+{
+	UNUSED(offset);
+	UNUSED(x);
+	UNUSED(y);
+	UNUSED(cx);
+	UNUSED(cy);
+}
+
+void
+ui_desktop_restore(uint32 offset, int x, int y, int cx, int cy)
+{
+	UNUSED(offset);
+	null_drawn(x, y, cx, cy);
+}
+
+void
+ui_begin_update(void)
+{
+}
+
+void
+ui_end_update(void)
+{
+}
+
+void
+ui_report_frame_stats(void)
+{
+}
+
+/* Format the input sent and how long the answers took into buf */
+RD_BOOL
+ui_format_stats(int n, char *buf, size_t size)
+{
+	return loadgen_format_stats(n, buf, size);
+}
+
+void
+ui_reset_stats(void)
+{
+}
+
+/* Seamless windows are accepted and forgotten */
+void
+ui_seamless_begin(RD_BOOL hidden)
+{
+	UNUSED(hidden);
+}
+
+void
+ui_seamless_end()
+{
+}
+
+void
+ui_seamless_hide_desktop(void)
+{
+}
+
+void
+ui_seamless_unhide_desktop(void)
+{
+}
+
+void
+ui_seamless_create_window(unsigned long id, unsigned long group, unsigned long parent,
+			  unsigned long flags)
+{
+	UNUSED(id);
+	UNUSED(group);
+	UNUSED(parent);
+	UNUSED(flags);
+}
+
+void
+ui_seamless_destroy_window(unsigned long id, unsigned long flags)
+{
+	UNUSED(id);
+	UNUSED(flags);
+}
+
+void
+ui_seamless_destroy_group(unsigned long id, unsigned long flags)
+{
+	UNUSED(id);
+	UNUSED(flags);
+}
+
+void
+ui_seamless_seticon(unsigned long id, const char *format, int width, int height, int chunk,
+		    const char *data, size_t chunk_len)
+{
+	UNUSED(id);
+	UNUSED(format);
+	UNUSED(width);
+	UNUSED(height);
+	UNUSED(chunk);
+	UNUSED(data);
+	UNUSED(chunk_len);
+}
+
+void
+ui_seamless_delicon(unsigned long id, const char *format, int width, int height)
+{
+	UNUSED(id);
+	UNUSED(format);
+	UNUSED(width);
+	UNUSED(height);
+}
+
+void
+ui_seamless_move_window(unsigned long id, int x, int y, int width, int height,
+			unsigned long flags)
+{
+	UNUSED(id);
+	UNUSED(x);
+	UNUSED(y);
+	UNUSED(width);
+	UNUSED(height);
+	UNUSED(flags);
+}
+
+void
+ui_seamless_restack_window(unsigned long id, unsigned long behind, unsigned long flags)
+{
+	UNUSED(id);
+	UNUSED(behind);
+	UNUSED(flags);
+}
+
+void
+ui_seamless_settitle(unsigned long id, const char *title, unsigned long flags)
+{
+	UNUSED(id);
+	UNUSED(title);
+	UNUSED(flags);
+}
+
+void
+ui_seamless_setstate(unsigned long id, unsigned int state, unsigned long flags)
+{
+	UNUSED(id);
+	UNUSED(state);
+	UNUSED(flags);
+}
+
+void
+ui_seamless_syncbegin(unsigned long flags)
+{
+	UNUSED(flags);
+}
+
+void
+ui_seamless_ack(unsigned int serial)
+{
+	UNUSED(serial);
+}
+
+void
+ui_seamless_batch_begin(void)
+{
+}
+
+void
+ui_seamless_batch_end(void)
+{
+}
+
+/* Keyboard, which is never used */
+RD_BOOL
+xkeymap_from_locale(const char *locale)
+{
+	UNUSED(locale);
+	return False;
+}
+
+void
+xkeymap_load(void)
+{
+}
+
+unsigned int
+read_keyboard_state(void)
+{
+	return 0;
+}
+
+uint16
+ui_get_numlock_state(unsigned int state)
+{
+	UNUSED(state);
+	return 0;
+}
+
+/* Clipboard, the channel is never registered so nothing comes in */
+void
+ui_clip_format_announce(uint8 * data, uint32 length)
+{
+	UNUSED(data);
+	UNUSED(length);
+}
+
+void
+ui_clip_handle_data(uint8 * data, uint32 length)
+{
+	UNUSED(data);
+	UNUSED(length);
+}
+
+void
+ui_clip_request_failed(void)
+{
+}
+
+void
+ui_clip_request_data(uint32 format)
+{
+	UNUSED(format);
+	cliprdr_send_data(NULL, 0);
+}
+
+void
+ui_clip_sync(void)
+{
+}
+
+void
+ui_clip_set_mode(const char *optarg)
+{
+	UNUSED(optarg);
+}
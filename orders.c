@@ -17,12 +17,15 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <time.h>
+
 #include "rdesktop.h"
 #include "orders.h"
 
 extern size_t g_next_packet;
 static RDP_ORDER_STATE g_order_state;
 extern RDP_VERSION g_rdp_version;
+extern int g_server_depth;
 
 /* Read field indicating which parameters are present */
 static void
@@ -69,6 +72,11 @@ rdp_in_coord(STREAM s, sint16 * coord, RD_BOOL delta)
 	}
 }
 
+/* Same, without checking, for orders whose length has been checked */
+#define rdp_in_coord_nc(s, coord, delta) \
+	{ if (delta) { sint8 change; in_uint8_nc(s, change); *(coord) += change; } \
+	  else in_uint16_le_nc(s, *(coord)); }
+
 /* Parse a delta co-ordinate in polyline/polygon order form */
 static int
 parse_delta(uint8 * buffer, int *offset)
@@ -404,47 +412,64 @@ process_desksave(STREAM s, DESKSAVE_ORDER * os, uint32 present, RD_BOOL delta)
 		ui_desktop_restore(os->offset, os->left, os->top, width, height);
 }
 
+/* The source of a memblt or triblt, a cached or an offscreen bitmap */
+static RD_HBITMAP
+order_source_bitmap(uint8 cache_id, uint16 cache_idx)
+{
+	if (cache_id == OFFSCREEN_CACHE_ID)
+		return cache_get_offscreen(cache_idx);
+	return cache_get_bitmap(cache_id, cache_idx);
+}
+
 /* Process a memory blt order */
 static void
 process_memblt(STREAM s, MEMBLT_ORDER * os, uint32 present, RD_BOOL delta)
 {
 	RD_HBITMAP bitmap;
+	int coord = delta ? 1 : 2;
+
+	/* the fields present have fixed sizes, check them all at once */
+	s_assert_r(s, ((present & 0x0001) ? 2 : 0) + ((present & 0x0002) ? coord : 0) +
+		   ((present & 0x0004) ? coord : 0) + ((present & 0x0008) ? coord : 0) +
+		   ((present & 0x0010) ? coord : 0) + ((present & 0x0020) ? 1 : 0) +
+		   ((present & 0x0040) ? coord : 0) + ((present & 0x0080) ? coord : 0) +
+		   ((present & 0x0100) ? 2 : 0));
 
 	if (present & 0x0001)
 	{
-		in_uint8(s, os->cache_id);
-		in_uint8(s, os->colour_table);
+		in_uint8_nc(s, os->cache_id);
+		in_uint8_nc(s, os->colour_table);
 	}
 
 	if (present & 0x0002)
-		rdp_in_coord(s, &os->x, delta);
+		rdp_in_coord_nc(s, &os->x, delta);
 
 	if (present & 0x0004)
-		rdp_in_coord(s, &os->y, delta);
+		rdp_in_coord_nc(s, &os->y, delta);
 
 	if (present & 0x0008)
-		rdp_in_coord(s, &os->cx, delta);
+		rdp_in_coord_nc(s, &os->cx, delta);
 
 	if (present & 0x0010)
-		rdp_in_coord(s, &os->cy, delta);
+		rdp_in_coord_nc(s, &os->cy, delta);
 
 	if (present & 0x0020)
-		in_uint8(s, os->opcode);
+		in_uint8_nc(s, os->opcode);
 
 	if (present & 0x0040)
-		rdp_in_coord(s, &os->srcx, delta);
+		rdp_in_coord_nc(s, &os->srcx, delta);
 
 	if (present & 0x0080)
-		rdp_in_coord(s, &os->srcy, delta);
+		rdp_in_coord_nc(s, &os->srcy, delta);
 
 	if (present & 0x0100)
-		in_uint16_le(s, os->cache_idx);
+		in_uint16_le_nc(s, os->cache_idx);
 
 	logger(Graphics, Debug,
 	       "process_memblt(), op=0x%x, x=%d, y=%d, cx=%d, cy=%d, id=%d, idx=%d", os->opcode,
 	       os->x, os->y, os->cx, os->cy, os->cache_id, os->cache_idx);
 
-	bitmap = cache_get_bitmap(os->cache_id, os->cache_idx);
+	bitmap = order_source_bitmap(os->cache_id, os->cache_idx);
 	if (bitmap == NULL)
 		return;
 
@@ -504,7 +529,7 @@ process_triblt(STREAM s, TRIBLT_ORDER * os, uint32 present, RD_BOOL delta)
 	       os->opcode, os->x, os->y, os->cx, os->cy, os->cache_id, os->cache_idx,
 	       os->brush.style, os->bgcolour, os->fgcolour);
 
-	bitmap = cache_get_bitmap(os->cache_id, os->cache_idx);
+	bitmap = order_source_bitmap(os->cache_id, os->cache_idx);
 	if (bitmap == NULL)
 		return;
 
@@ -556,7 +581,7 @@ process_polygon(STREAM s, POLYGON_ORDER * os, uint32 present, RD_BOOL delta)
 		return;
 	}
 
-	points = (RD_POINT *) xmalloc((os->npoints + 1) * sizeof(RD_POINT));
+	points = (RD_POINT *) s_arena_alloc((os->npoints + 1) * sizeof(RD_POINT));
 	memset(points, 0, (os->npoints + 1) * sizeof(RD_POINT));
 
 	points[0].x = os->x;
@@ -583,8 +608,6 @@ process_polygon(STREAM s, POLYGON_ORDER * os, uint32 present, RD_BOOL delta)
 			   os->fgcolour);
 	else
 		logger(Graphics, Error, "process_polygon(), polygon parse error");
-
-	xfree(points);
 }
 
 /* Process a polygon2 order */
@@ -638,7 +661,7 @@ process_polygon2(STREAM s, POLYGON2_ORDER * os, uint32 present, RD_BOOL delta)
 
 	setup_brush(&brush, &os->brush);
 
-	points = (RD_POINT *) xmalloc((os->npoints + 1) * sizeof(RD_POINT));
+	points = (RD_POINT *) s_arena_alloc((os->npoints + 1) * sizeof(RD_POINT));
 	memset(points, 0, (os->npoints + 1) * sizeof(RD_POINT));
 
 	points[0].x = os->x;
@@ -665,8 +688,6 @@ process_polygon2(STREAM s, POLYGON2_ORDER * os, uint32 present, RD_BOOL delta)
 			   &brush, os->bgcolour, os->fgcolour);
 	else
 		logger(Graphics, Error, "process_polygon2(), polygon parse error");
-
-	xfree(points);
 }
 
 /* Process a polyline order */
@@ -708,7 +729,7 @@ process_polyline(STREAM s, POLYLINE_ORDER * os, uint32 present, RD_BOOL delta)
 		return;
 	}
 
-	points = (RD_POINT *) xmalloc((os->lines + 1) * sizeof(RD_POINT));
+	points = (RD_POINT *) s_arena_alloc((os->lines + 1) * sizeof(RD_POINT));
 	memset(points, 0, (os->lines + 1) * sizeof(RD_POINT));
 
 	points[0].x = os->x;
@@ -736,8 +757,6 @@ process_polyline(STREAM s, POLYLINE_ORDER * os, uint32 present, RD_BOOL delta)
 		ui_polyline(os->opcode - 1, points, os->lines + 1, &pen);
 	else
 		logger(Graphics, Error, "process_polyline(), parse error");
-
-	xfree(points);
 }
 
 /* Process an ellipse order */
@@ -916,7 +935,7 @@ process_raw_bmpcache(STREAM s)
 
 	logger(Graphics, Debug, "process_raw_bpmcache(), cx=%d, cy=%d, id=%d, idx=%d", width,
 	       height, cache_id, cache_idx);
-	inverted = (uint8 *) xmalloc(width * height * Bpp);
+	inverted = (uint8 *) s_arena_alloc(width * height * Bpp);
 	for (y = 0; y < height; y++)
 	{
 		memcpy(&inverted[(height - y - 1) * (width * Bpp)], &data[y * (width * Bpp)],
@@ -924,8 +943,7 @@ process_raw_bmpcache(STREAM s)
 	}
 
 	bitmap = ui_create_bitmap(width, height, inverted);
-	xfree(inverted);
-	cache_put_bitmap(cache_id, cache_idx, bitmap);
+	cache_put_bitmap(cache_id, cache_idx, bitmap, width * height * Bpp);
 }
 
 /* Process a bitmap cache order */
@@ -971,19 +989,20 @@ process_bmpcache(STREAM s)
 	       width, height, cache_id, cache_idx, bpp, size, pad1, bufsize, pad2, row_size,
 	       final_size);
 
-	bmpdata = (uint8 *) xmalloc(width * height * Bpp);
+	if (cache_put_compressed_bitmap(cache_id, cache_idx, width, height, Bpp, data, size))
+		return;
+
+	bmpdata = (uint8 *) s_arena_alloc(width * height * Bpp);
 
 	if (bitmap_decompress(bmpdata, width, height, data, size, Bpp))
 	{
 		bitmap = ui_create_bitmap(width, height, bmpdata);
-		cache_put_bitmap(cache_id, cache_idx, bitmap);
+		cache_put_bitmap(cache_id, cache_idx, bitmap, width * height * Bpp);
 	}
 	else
 	{
 		logger(Graphics, Error, "process_bmpcache(), Failed to decompress bitmap data");
 	}
-
-	xfree(bmpdata);
 }
 
 /* Process a bitmap cache v2 order */
@@ -1000,25 +1019,27 @@ process_bmpcache2(STREAM s, uint16 flags, RD_BOOL compressed)
 	cache_id = flags & ID_MASK;
 	Bpp = ((flags & MODE_MASK) >> MODE_SHIFT) - 2;
 
+	s_assert_r(s, ((flags & PERSIST) ? 8 : 0) + ((flags & SQUARE) ? 1 : 2) + 3);
+
 	if (flags & PERSIST)
 	{
-		in_uint8p(s, bitmap_id, 8);
+		in_uint8p_nc(s, bitmap_id, 8);
 	}
 
 	if (flags & SQUARE)
 	{
-		in_uint8(s, width);
+		in_uint8_nc(s, width);
 		height = width;
 	}
 	else
 	{
-		in_uint8(s, width);
-		in_uint8(s, height);
+		in_uint8_nc(s, width);
+		in_uint8_nc(s, height);
 	}
 
-	in_uint16_be(s, bufsize);
+	in_uint16_be_nc(s, bufsize);
 	bufsize &= BUFSIZE_MASK;
-	in_uint8(s, cache_idx);
+	in_uint8_nc(s, cache_idx);
 
 	if (cache_idx & LONG_FORMAT)
 	{
@@ -1032,7 +1053,11 @@ process_bmpcache2(STREAM s, uint16 flags, RD_BOOL compressed)
 	       "process_bmpcache2(), compr=%d, flags=%x, cx=%d, cy=%d, id=%d, idx=%d, Bpp=%d, bs=%d",
 	       compressed, flags, width, height, cache_id, cache_idx, Bpp, bufsize);
 
-	bmpdata = (uint8 *) xmalloc(width * height * Bpp);
+	if (compressed && !(flags & PERSIST)
+	    && cache_put_compressed_bitmap(cache_id, cache_idx, width, height, Bpp, data, bufsize))
+		return;
+
+	bmpdata = (uint8 *) s_arena_alloc(width * height * Bpp);
 
 	if (compressed)
 	{
@@ -1040,7 +1065,6 @@ process_bmpcache2(STREAM s, uint16 flags, RD_BOOL compressed)
 		{
 			logger(Graphics, Error,
 			       "process_bmpcache2(), failed to decompress bitmap data");
-			xfree(bmpdata);
 			return;
 		}
 	}
@@ -1055,7 +1079,7 @@ process_bmpcache2(STREAM s, uint16 flags, RD_BOOL compressed)
 
 	if (bitmap)
 	{
-		cache_put_bitmap(cache_id, cache_idx, bitmap);
+		cache_put_bitmap(cache_id, cache_idx, bitmap, width * height * Bpp);
 		if (flags & PERSIST)
 			pstcache_save_bitmap(cache_id, cache_idx, bitmap_id, width, height,
 					     width * height * Bpp, bmpdata);
@@ -1064,8 +1088,6 @@ process_bmpcache2(STREAM s, uint16 flags, RD_BOOL compressed)
 	{
 		logger(Graphics, Error, "process_bmpcache2(), ui_create_bitmap(), failed");
 	}
-
-	xfree(bmpdata);
 }
 
 /* Process a colourmap cache order */
@@ -1081,7 +1103,7 @@ process_colcache(STREAM s)
 	in_uint8(s, cache_id);
 	in_uint16_le(s, map.ncolours);
 
-	map.colours = (COLOURENTRY *) xmalloc(sizeof(COLOURENTRY) * map.ncolours);
+	map.colours = (COLOURENTRY *) s_arena_alloc(sizeof(COLOURENTRY) * map.ncolours);
 
 	for (i = 0; i < map.ncolours; i++)
 	{
@@ -1098,8 +1120,6 @@ process_colcache(STREAM s)
 
 	if (cache_id)
 		ui_set_colourmap(hmap);
-
-	xfree(map.colours);
 }
 
 /* Process a font cache order */
@@ -1133,36 +1153,45 @@ process_fontcache(STREAM s)
 	}
 }
 
+/* Expand the 8 pixels of a brush row, from 2 bytes of 2-bit palette
+   indices, most significant first, to n bytes each */
+#define BRUSH_EXPAND_ROW(row, in, pal, n) \
+	do { \
+		int i_; \
+		for (i_ = 0; i_ < 8; i_++) \
+			memcpy((row) + i_ * (n), \
+			       (pal) + (((in)[i_ >> 2] >> (6 - 2 * (i_ & 3))) & 3) * (n), (n)); \
+	} while (0)
+
 static void
 process_compressed_8x8_brush_data(uint8 * in, uint8 * out, int Bpp)
 {
-	int x, y, pal_index, in_index, shift, do2, i;
-	uint8 *pal;
+	int y;
+	uint8 *pal, *row;
 
-	in_index = 0;
 	pal = in + 16;
-	/* read it bottom up */
+	/* read it bottom up, 2 bytes per row of 4 palette indices each.
+	   The copies have a constant size for each Bpp, so that they
+	   compile to single moves. */
 	for (y = 7; y >= 0; y--)
 	{
-		/* 2 bytes per row */
-		x = 0;
-		for (do2 = 0; do2 < 2; do2++)
+		row = out + y * 8 * Bpp;
+		switch (Bpp)
 		{
-			/* 4 pixels per byte */
-			shift = 6;
-			while (shift >= 0)
-			{
-				pal_index = (in[in_index] >> shift) & 3;
-				/* size of palette entries depends on Bpp */
-				for (i = 0; i < Bpp; i++)
-				{
-					out[(y * 8 + x) * Bpp + i] = pal[pal_index * Bpp + i];
-				}
-				x++;
-				shift -= 2;
-			}
-			in_index++;
+			case 1:
+				BRUSH_EXPAND_ROW(row, in, pal, 1);
+				break;
+			case 2:
+				BRUSH_EXPAND_ROW(row, in, pal, 2);
+				break;
+			case 3:
+				BRUSH_EXPAND_ROW(row, in, pal, 3);
+				break;
+			case 4:
+				BRUSH_EXPAND_ROW(row, in, pal, 4);
+				break;
 		}
+		in += 2;
 	}
 }
 
@@ -1242,6 +1271,89 @@ process_brushcache(STREAM s, uint16 flags)
 	}
 }
 
+/* Process a bitmap cache v3 order, whose data may be compressed with
+   one of the bitmap codecs */
+static void
+process_bmpcache3(STREAM s, uint16 flags)
+{
+	RD_HBITMAP bitmap;
+	uint8 cache_id, bpp, codec, *data, *bmpdata, *key;
+	uint16 cache_idx, width, height;
+	uint32 length, size;
+	uint64 size64;
+	int y, Bpp;
+
+	cache_id = flags & BMPCACHE3_ID_MASK;
+	in_uint16_le(s, cache_idx);
+	in_uint8p(s, key, 8);	/* key1, key2 */
+	in_uint8(s, bpp);
+	in_uint8s(s, 2);	/* reserved */
+	in_uint8(s, codec);
+	in_uint16_le(s, width);
+	in_uint16_le(s, height);
+	in_uint32_le(s, length);
+
+	logger(Graphics, Debug,
+	       "process_bmpcache3(), codec=%d, cx=%d, cy=%d, id=%d, idx=%d, bpp=%d, bs=%d",
+	       codec, width, height, cache_id, cache_idx, bpp, length);
+
+	if (!s_check_rem(s, length))
+	{
+		logger(Graphics, Error, "process_bmpcache3(), bitmap data would overrun");
+		return;
+	}
+	in_uint8p(s, data, length);
+
+	/* cached bitmaps are drawn as they are, so they must be of the
+	   session depth */
+	Bpp = (bpp + 7) / 8;
+	if (width == 0 || height == 0 || width > BMPCACHE3_MAX_SIZE
+	    || height > BMPCACHE3_MAX_SIZE || Bpp != (g_server_depth + 7) / 8)
+	{
+		logger(Graphics, Error, "process_bmpcache3(), bad bitmap %dx%d at %d bpp", width,
+		       height, bpp);
+		return;
+	}
+	size64 = (uint64) width * height * Bpp;
+	size = (uint32) size64;
+	bmpdata = (uint8 *) s_arena_alloc(size);
+
+	switch (codec)
+	{
+		case RDP_CODEC_ID_NSCODEC:
+			if (Bpp != 4 || !nsc_decode(data, length, width, height, bmpdata, width * 4))
+			{
+				logger(Graphics, Error,
+				       "process_bmpcache3(), failed to decode NSCodec data");
+				return;
+			}
+			break;
+
+		case RDP_CODEC_ID_NONE:
+			/* bottom up, like bitmap cache v2 */
+			if (length < size)
+			{
+				logger(Graphics, Error, "process_bmpcache3(), short bitmap data");
+				return;
+			}
+			for (y = 0; y < height; y++)
+				memcpy(&bmpdata[(height - y - 1) * (width * Bpp)],
+				       &data[y * (width * Bpp)], width * Bpp);
+			break;
+
+		default:
+			logger(Graphics, Warning, "process_bmpcache3(), unhandled codec %d", codec);
+			return;
+	}
+
+	bitmap = ui_create_bitmap(width, height, bmpdata);
+	cache_put_bitmap(cache_id, cache_idx, bitmap, size);
+
+	/* the persistent cache has room for cells up to 255 pixels */
+	if (width <= 0xff && height <= 0xff && size <= 0xffff)
+		pstcache_save_bitmap(cache_id, cache_idx, key, width, height, size, bmpdata);
+}
+
 /* Process a secondary order */
 static void
 process_secondary_order(STREAM s)
@@ -1301,6 +1413,10 @@ process_secondary_order(STREAM s)
 			process_brushcache(s, flags);
 			break;
 
+		case RDP_ORDER_BMPCACHE3:
+			process_bmpcache3(s, flags);
+			break;
+
 		default:
 			logger(Graphics, Warning,
 			       "process_secondary_order(), unhandled secondary order %d", type);
@@ -1309,20 +1425,346 @@ process_secondary_order(STREAM s)
 	s_seek(s, next_order);
 }
 
+/* Process a create offscreen bitmap order */
+static void
+process_create_offscreen_bitmap(STREAM s)
+{
+	uint16 flags, id, cx, cy, count, idx;
+	int i;
+
+	in_uint16_le(s, flags);
+	in_uint16_le(s, cx);
+	in_uint16_le(s, cy);
+	id = flags & OFFSCREEN_BITMAP_ID_MASK;
+
+	logger(Graphics, Debug, "process_create_offscreen_bitmap(), id=%d, cx=%d, cy=%d", id, cx,
+	       cy);
+
+	if (flags & OFFSCREEN_DELETE_LIST_PRESENT)
+	{
+		in_uint16_le(s, count);
+		for (i = 0; i < count; i++)
+		{
+			in_uint16_le(s, idx);
+			cache_put_offscreen(idx, NULL);
+		}
+	}
+
+	cache_put_offscreen(id, ui_create_surface(cx, cy));
+}
+
+/* Process a switch surface order */
+static void
+process_switch_surface(STREAM s)
+{
+	uint16 id;
+	RD_HBITMAP surface = NULL;
+
+	in_uint16_le(s, id);
+
+	if (id != SCREEN_BITMAP_SURFACE)
+	{
+		surface = cache_get_offscreen(id);
+		if (surface == NULL)
+		{
+			logger(Graphics, Warning,
+			       "process_switch_surface(), no offscreen bitmap %d", id);
+			return;
+		}
+	}
+
+	ui_switch_surface(surface);
+}
+
+/* Process an alternate secondary order. These have no length field, so
+   the order PDU cannot go on past one that is not known. */
+static RD_BOOL
+process_altsec_order(STREAM s, uint8 type)
+{
+	switch (type)
+	{
+		case RDP_ORDER_SWITCH_SURFACE:
+			process_switch_surface(s);
+			break;
+
+		case RDP_ORDER_CREATE_OFFSCREEN_BITMAP:
+			process_create_offscreen_bitmap(s);
+			break;
+
+		default:
+			logger(Graphics, Warning,
+			       "process_altsec_order(), unhandled alternate secondary order %d",
+			       type);
+			return False;
+	}
+	return True;
+}
+
+/* Parse the fields of a FastIndex or FastGlyph order up to their
+   variable bytes */
+static void
+rdp_parse_fast_text(STREAM s, FAST_TEXT_FIELDS * f, uint32 present, RD_BOOL delta)
+{
+	if (present & 0x0001)
+		in_uint8(s, f->font);
+
+	if (present & 0x0002)
+	{
+		in_uint8(s, f->charinc);
+		in_uint8(s, f->flags);
+	}
+
+	/* the first colour is that of the text, as in a GlyphIndex order */
+	if (present & 0x0004)
+		rdp_in_colour(s, &f->fgcolour);
+
+	if (present & 0x0008)
+		rdp_in_colour(s, &f->bgcolour);
+
+	if (present & 0x0010)
+		rdp_in_coord(s, &f->bkleft, delta);
+
+	if (present & 0x0020)
+		rdp_in_coord(s, &f->bktop, delta);
+
+	if (present & 0x0040)
+		rdp_in_coord(s, &f->bkright, delta);
+
+	if (present & 0x0080)
+		rdp_in_coord(s, &f->bkbottom, delta);
+
+	if (present & 0x0100)
+		rdp_in_coord(s, &f->opleft, delta);
+
+	if (present & 0x0200)
+		rdp_in_coord(s, &f->optop, delta);
+
+	if (present & 0x0400)
+		rdp_in_coord(s, &f->opright, delta);
+
+	if (present & 0x0800)
+		rdp_in_coord(s, &f->opbottom, delta);
+
+	if (present & 0x1000)
+		rdp_in_coord(s, &f->x, delta);
+
+	if (present & 0x2000)
+		rdp_in_coord(s, &f->y, delta);
+}
+
+/* Draw the text of a FastIndex or FastGlyph order. The opaque
+   rectangle takes the sides of the background one that are 0, or that
+   are flagged in its top when its bottom is -32768, and the origin
+   defaults to the top left of the background. */
+static void
+draw_fast_text(FAST_TEXT_FIELDS * f, uint8 * text, uint8 length)
+{
+	int opleft = f->opleft, optop = f->optop, opright = f->opright, opbottom = f->opbottom;
+	int x = f->x, y = f->y;
+	int sides;
+
+	if (opbottom == -32768)
+	{
+		/* a side that is not flagged leaves the rectangle empty */
+		sides = optop;
+		optop = (sides & 0x04) ? f->bktop : f->bkbottom;
+		opbottom = (sides & 0x01) ? f->bkbottom : optop;
+		if (sides & 0x02)
+			opright = f->bkright;
+		if (sides & 0x08)
+			opleft = f->bkleft;
+	}
+	if (opleft == 0)
+		opleft = f->bkleft;
+	if (opright == 0)
+		opright = f->bkright;
+	if (x == -32768)
+		x = f->bkleft;
+	if (y == -32768)
+		y = f->bktop;
+
+	ui_draw_text(f->font, f->flags, f->charinc, MIX_TRANSPARENT, x, y,
+		     f->bkleft, f->bktop, f->bkright - f->bkleft, f->bkbottom - f->bktop,
+		     opleft, optop, opright - opleft, opbottom - optop,
+		     NULL, f->bgcolour, f->fgcolour, text, length);
+}
+
+/* Process a FastIndex order, text from cached glyphs */
+static void
+process_fast_index(STREAM s, FAST_INDEX_ORDER * os, uint32 present, RD_BOOL delta)
+{
+	rdp_parse_fast_text(s, &os->f, present, delta);
+
+	if (present & 0x4000)
+	{
+		in_uint8(s, os->length);
+		in_uint8a(s, os->text, os->length);
+	}
+
+	logger(Graphics, Debug, "process_fast_index(), x=%d, y=%d, font=%d, fl=0x%x, n=%d",
+	       os->f.x, os->f.y, os->f.font, os->f.flags, os->length);
+
+	draw_fast_text(&os->f, os->text, os->length);
+}
+
+/* Process a FastGlyph order, a single glyph that may come with it */
+static void
+process_fast_glyph(STREAM s, FAST_GLYPH_ORDER * os, uint32 present, RD_BOOL delta)
+{
+	struct stream packet;
+	STREAM gs = &packet;
+	sint16 offset, baseline;
+	uint16 width, height;
+	uint8 length, *data;
+	uint8 text[2];
+	int datasize;
+
+	rdp_parse_fast_text(s, &os->f, present, delta);
+
+	if (present & 0x4000)
+	{
+		in_uint8(s, length);
+		in_uint8p(s, data, length);
+
+		memset(gs, 0, sizeof(*gs));
+		gs->data = gs->p = data;
+		gs->end = data + length;
+
+		in_uint8(gs, os->character);
+		/* the glyph itself is only sent when it is not cached */
+		if (length > 1)
+		{
+			in_uint16_le(gs, offset);
+			in_uint16_le(gs, baseline);
+			in_uint16_le(gs, width);
+			in_uint16_le(gs, height);
+
+			datasize = (height * ((width + 7) / 8) + 3) & ~3;
+			in_uint8p(gs, data, datasize);
+			cache_put_font(os->f.font, os->character, offset, baseline, width, height,
+				       ui_create_glyph(width, height, data));
+		}
+	}
+
+	logger(Graphics, Debug, "process_fast_glyph(), x=%d, y=%d, font=%d, character=%d",
+	       os->f.x, os->f.y, os->f.font, os->character);
+
+	/* a glyph at no offset, the offset is left out with implicit x */
+	text[0] = os->character;
+	text[1] = 0;
+	draw_fast_text(&os->f, text, (os->f.flags & TEXT2_IMPLICIT_X) ? 1 : 2);
+}
+
+/* Primary orders are dispatched through a table indexed by order type,
+   which also keeps count of what each order type costs */
+typedef void (*order_handler) (STREAM s, RDP_ORDER_STATE * os, uint32 present,
+			       RD_BOOL delta);
+
+#define ORDER_HANDLER(name, member) \
+static void \
+order_##name(STREAM s, RDP_ORDER_STATE * os, uint32 present, RD_BOOL delta) \
+{ \
+	process_##name(s, &os->member, present, delta); \
+}
+
+ORDER_HANDLER(destblt, destblt)
+ORDER_HANDLER(patblt, patblt)
+ORDER_HANDLER(screenblt, screenblt)
+ORDER_HANDLER(line, line)
+ORDER_HANDLER(rect, rect)
+ORDER_HANDLER(desksave, desksave)
+ORDER_HANDLER(memblt, memblt)
+ORDER_HANDLER(triblt, triblt)
+ORDER_HANDLER(polygon, polygon)
+ORDER_HANDLER(polygon2, polygon2)
+ORDER_HANDLER(polyline, polyline)
+ORDER_HANDLER(ellipse, ellipse)
+ORDER_HANDLER(ellipse2, ellipse2)
+ORDER_HANDLER(text2, text2)
+ORDER_HANDLER(fast_index, fast_index)
+ORDER_HANDLER(fast_glyph, fast_glyph)
+
+#define ORDER_TYPES	32
+
+struct order_type
+{
+	const char *name;
+	int present_size;	/* bytes of field present flags */
+	order_handler process;
+};
+
+/* indexed by enum RDP_ORDER_TYPE */
+static const struct order_type g_order_types[ORDER_TYPES] = {
+	{"destblt", 1, order_destblt},
+	{"patblt", 2, order_patblt},
+	{"screenblt", 1, order_screenblt},
+	{NULL, 0, NULL}, {NULL, 0, NULL}, {NULL, 0, NULL},
+	{NULL, 0, NULL}, {NULL, 0, NULL}, {NULL, 0, NULL},
+	{"line", 2, order_line},
+	{"rect", 1, order_rect},
+	{"desksave", 1, order_desksave},
+	{NULL, 0, NULL},
+	{"memblt", 2, order_memblt},
+	{"triblt", 3, order_triblt},
+	{NULL, 0, NULL}, {NULL, 0, NULL}, {NULL, 0, NULL},
+	{NULL, 0, NULL},
+	{"fast_index", 2, order_fast_index},
+	{"polygon", 1, order_polygon},
+	{"polygon2", 2, order_polygon2},
+	{"polyline", 1, order_polyline},
+	{NULL, 0, NULL},
+	{"fast_glyph", 2, order_fast_glyph},
+	{"ellipse", 1, order_ellipse},
+	{"ellipse2", 2, order_ellipse2},
+	{"text2", 3, order_text2}
+};
+
+struct order_stats
+{
+	uint32 count;
+	uint64 bytes;		/* including the order header */
+	uint64 nsec;		/* parsing and drawing */
+};
+
+static struct order_stats g_order_stats[ORDER_TYPES];
+
+static uint64
+order_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 /* Process an order PDU */
 void
 process_orders(STREAM s, uint16 num_orders)
 {
 	RDP_ORDER_STATE *os = &g_order_state;
+	const struct order_type *type;
+	struct order_stats *st;
 	uint32 present;
 	uint8 order_flags;
-	int size, processed = 0;
+	int processed = 0;
 	RD_BOOL delta;
+	unsigned char *start;
+	uint64 begin;
+	TRACE_SCOPE(TRACE_PROCESS_ORDERS);
 
 	while (processed < num_orders)
 	{
+		start = s->p;
 		in_uint8(s, order_flags);
 
+		if ((order_flags & RDP_ORDER_CLASS_MASK) == RDP_ORDER_SECONDARY)
+		{
+			if (!process_altsec_order(s, order_flags >> RDP_ORDER_ALTSEC_SHIFT))
+				break;
+			processed++;
+			continue;
+		}
+
 		if (!(order_flags & RDP_ORDER_STANDARD))
 		{
 			logger(Graphics, Error, "process_orders(), order parsing failed");
@@ -1340,26 +1782,20 @@ process_orders(STREAM s, uint16 num_orders)
 				in_uint8(s, os->order_type);
 			}
 
-			switch (os->order_type)
+			type = NULL;
+			if (os->order_type < ORDER_TYPES)
+				type = &g_order_types[os->order_type];
+			if (type == NULL || type->process == NULL)
 			{
-				case RDP_ORDER_TRIBLT:
-				case RDP_ORDER_TEXT2:
-					size = 3;
-					break;
-
-				case RDP_ORDER_PATBLT:
-				case RDP_ORDER_MEMBLT:
-				case RDP_ORDER_LINE:
-				case RDP_ORDER_POLYGON2:
-				case RDP_ORDER_ELLIPSE2:
-					size = 2;
-					break;
-
-				default:
-					size = 1;
+				logger(Graphics, Warning,
+				       "process_orders(), unhandled order type %d",
+				       os->order_type);
+				return;
 			}
 
-			rdp_in_present(s, &present, order_flags, size);
+			begin = order_clock();
+
+			rdp_in_present(s, &present, order_flags, type->present_size);
 
 			if (order_flags & RDP_ORDER_BOUNDS)
 			{
@@ -1375,73 +1811,15 @@ process_orders(STREAM s, uint16 num_orders)
 
 			delta = order_flags & RDP_ORDER_DELTA;
 
-			switch (os->order_type)
-			{
-				case RDP_ORDER_DESTBLT:
-					process_destblt(s, &os->destblt, present, delta);
-					break;
-
-				case RDP_ORDER_PATBLT:
-					process_patblt(s, &os->patblt, present, delta);
-					break;
-
-				case RDP_ORDER_SCREENBLT:
-					process_screenblt(s, &os->screenblt, present, delta);
-					break;
-
-				case RDP_ORDER_LINE:
-					process_line(s, &os->line, present, delta);
-					break;
-
-				case RDP_ORDER_RECT:
-					process_rect(s, &os->rect, present, delta);
-					break;
-
-				case RDP_ORDER_DESKSAVE:
-					process_desksave(s, &os->desksave, present, delta);
-					break;
-
-				case RDP_ORDER_MEMBLT:
-					process_memblt(s, &os->memblt, present, delta);
-					break;
-
-				case RDP_ORDER_TRIBLT:
-					process_triblt(s, &os->triblt, present, delta);
-					break;
-
-				case RDP_ORDER_POLYGON:
-					process_polygon(s, &os->polygon, present, delta);
-					break;
-
-				case RDP_ORDER_POLYGON2:
-					process_polygon2(s, &os->polygon2, present, delta);
-					break;
-
-				case RDP_ORDER_POLYLINE:
-					process_polyline(s, &os->polyline, present, delta);
-					break;
-
-				case RDP_ORDER_ELLIPSE:
-					process_ellipse(s, &os->ellipse, present, delta);
-					break;
-
-				case RDP_ORDER_ELLIPSE2:
-					process_ellipse2(s, &os->ellipse2, present, delta);
-					break;
-
-				case RDP_ORDER_TEXT2:
-					process_text2(s, &os->text2, present, delta);
-					break;
-
-				default:
-					logger(Graphics, Warning,
-					       "process_orders(), unhandled order type %d",
-					       os->order_type);
-					return;
-			}
+			type->process(s, os, present, delta);
 
 			if (order_flags & RDP_ORDER_BOUNDS)
 				ui_reset_clip();
+
+			st = &g_order_stats[os->order_type];
+			st->count++;
+			st->bytes += s->p - start;
+			st->nsec += order_clock() - begin;
 		}
 
 		processed++;
@@ -1455,6 +1833,47 @@ process_orders(STREAM s, uint16 num_orders)
 
 }
 
+/* Format the statistics of the n:th primary order type that has been
+   seen into buf. Returns False when there are no more. */
+RD_BOOL
+orders_format_stats(int n, char *buf, size_t size)
+{
+	struct order_stats *st;
+	int i;
+
+	for (i = 0; i < ORDER_TYPES; i++)
+	{
+		if (g_order_stats[i].count == 0 || n-- != 0)
+			continue;
+
+		st = &g_order_stats[i];
+		snprintf(buf, size, "%s count=%u bytes=%llu usec=%llu avg_nsec=%llu",
+			 g_order_types[i].name, st->count, (unsigned long long) st->bytes,
+			 (unsigned long long) (st->nsec / 1000),
+			 (unsigned long long) (st->nsec / st->count));
+		return True;
+	}
+
+	return False;
+}
+
+void
+orders_reset_stats(void)
+{
+	memset(g_order_stats, 0, sizeof(g_order_stats));
+}
+
+/* Log what the orders of the session cost */
+void
+orders_report_stats(void)
+{
+	char buf[256];
+	int n;
+
+	for (n = 0; orders_format_stats(n, buf, sizeof(buf)); n++)
+		logger(Graphics, Verbose, "Order statistics: %s", buf);
+}
+
 /* Reset order state */
 void
 reset_order_state(void)
@@ -36,9 +36,11 @@ enum RDP_ORDER_TYPE
 	RDP_ORDER_DESKSAVE = 11,
 	RDP_ORDER_MEMBLT = 13,
 	RDP_ORDER_TRIBLT = 14,
+	RDP_ORDER_FAST_INDEX = 19,
 	RDP_ORDER_POLYGON = 20,
 	RDP_ORDER_POLYGON2 = 21,
 	RDP_ORDER_POLYLINE = 22,
+	RDP_ORDER_FAST_GLYPH = 24,
 	RDP_ORDER_ELLIPSE = 25,
 	RDP_ORDER_ELLIPSE2 = 26,
 	RDP_ORDER_TEXT2 = 27
@@ -52,9 +54,27 @@ enum RDP_SECONDARY_ORDER_TYPE
 	RDP_ORDER_FONTCACHE = 3,
 	RDP_ORDER_RAW_BMPCACHE2 = 4,
 	RDP_ORDER_BMPCACHE2 = 5,
-	RDP_ORDER_BRUSHCACHE = 7
+	RDP_ORDER_BRUSHCACHE = 7,
+	RDP_ORDER_BMPCACHE3 = 8
 };
 
+/* Alternate secondary orders carry their type in the upper six bits of
+   the control flags, and only have the secondary bit set */
+#define RDP_ORDER_CLASS_MASK	0x03
+#define RDP_ORDER_ALTSEC_SHIFT	2
+
+enum RDP_ALTSEC_ORDER_TYPE
+{
+	RDP_ORDER_SWITCH_SURFACE = 0,
+	RDP_ORDER_CREATE_OFFSCREEN_BITMAP = 1
+};
+
+#define OFFSCREEN_BITMAP_ID_MASK	0x7fff
+#define OFFSCREEN_DELETE_LIST_PRESENT	0x8000
+#define SCREEN_BITMAP_SURFACE		0xffff
+/* the cache id of a memblt or triblt from an offscreen bitmap */
+#define OFFSCREEN_CACHE_ID		0xff
+
 typedef struct _DESTBLT_ORDER
 {
 	sint16 x;
@@ -266,6 +286,45 @@ typedef struct _TEXT2_ORDER
 }
 TEXT2_ORDER;
 
+/* The fields FastIndex and FastGlyph orders have in common. The opaque
+   rectangle may be given in terms of the background one. */
+typedef struct _FAST_TEXT_FIELDS
+{
+	uint8 font;
+	uint8 charinc;
+	uint8 flags;
+	uint32 bgcolour;
+	uint32 fgcolour;
+	sint16 bkleft;
+	sint16 bktop;
+	sint16 bkright;
+	sint16 bkbottom;
+	sint16 opleft;
+	sint16 optop;
+	sint16 opright;
+	sint16 opbottom;
+	sint16 x;
+	sint16 y;
+}
+FAST_TEXT_FIELDS;
+
+typedef struct _FAST_INDEX_ORDER
+{
+	FAST_TEXT_FIELDS f;
+	uint8 length;
+	uint8 text[MAX_TEXT];
+
+}
+FAST_INDEX_ORDER;
+
+typedef struct _FAST_GLYPH_ORDER
+{
+	FAST_TEXT_FIELDS f;
+	uint8 character;	/* index in the glyph cache */
+
+}
+FAST_GLYPH_ORDER;
+
 typedef struct _RDP_ORDER_STATE
 {
 	uint8 order_type;
@@ -285,6 +344,8 @@ typedef struct _RDP_ORDER_STATE
 	ELLIPSE_ORDER ellipse;
 	ELLIPSE2_ORDER ellipse2;
 	TEXT2_ORDER text2;
+	FAST_INDEX_ORDER fast_index;
+	FAST_GLYPH_ORDER fast_glyph;
 
 }
 RDP_ORDER_STATE;
@@ -333,6 +394,10 @@ RDP_BMPCACHE_ORDER;
 #define LONG_FORMAT		0x80
 #define BUFSIZE_MASK		0x3FFF	/* or 0x1FFF? */
 
+/* RDP_BMPCACHE3_ORDER */
+#define BMPCACHE3_ID_MASK	0x0003
+#define BMPCACHE3_MAX_SIZE	4096	/* largest side taken from the server */
+
 #define MAX_GLYPH 32
 
 typedef struct _RDP_FONT_GLYPH
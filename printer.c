@@ -16,6 +16,15 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/* Print jobs are streamed to lpr through a non-blocking pipe. Writes
+   are queued as asynchronous io requests, and the main loop feeds them
+   to the pipe whenever the spooler has room, so a slow spooler holds
+   back the completion of the write instead of the whole client. The
+   server does not send more data before a write completes. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "rdesktop.h"
 
 extern RDPDR_DEVICE g_rdpdr_device[];
@@ -124,6 +133,15 @@ printer_create(uint32 device_id, uint32 access, uint32 share_mode, uint32 dispos
 		pprinter_data->printer_fp = popen(cmd, "w");
 	}
 
+	if (pprinter_data->printer_fp == NULL)
+	{
+		logger(Core, Error, "printer_create(), failed to start lpr: %s", strerror(errno));
+		return RD_STATUS_DEVICE_OFF_LINE;
+	}
+
+	fcntl(fileno(pprinter_data->printer_fp), F_SETFL,
+	      fcntl(fileno(pprinter_data->printer_fp), F_GETFL) | O_NONBLOCK);
+
 	g_rdpdr_device[device_id].handle = fileno(pprinter_data->printer_fp);
 	*handle = g_rdpdr_device[device_id].handle;
 	return RD_STATUS_SUCCESS;
@@ -148,15 +166,27 @@ printer_write(RD_NTHANDLE handle, uint8 * data, uint32 length, uint64 offset, ui
 {
 	UNUSED(offset);  /* Currently unused, MS-RDPEPC reserves for later use */
 	PRINTER *pprinter_data;
+	ssize_t n;
+
+	*result = 0;
 
 	pprinter_data = get_printer_data(handle);
-	*result = length * fwrite(data, length, 1, pprinter_data->printer_fp);
+	if (pprinter_data == NULL)
+		return RD_STATUS_INVALID_HANDLE;
 
-	if (ferror(pprinter_data->printer_fp))
+	do
+		n = write(handle, data, length);
+	while (n == -1 && errno == EINTR);
+
+	if (n == -1)
 	{
-		*result = 0;
+		/* the spooler is behind, try again when the pipe has room */
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return RD_STATUS_PENDING;
 		return RD_STATUS_INVALID_HANDLE;
 	}
+
+	*result = n;
 	return RD_STATUS_SUCCESS;
 }
 
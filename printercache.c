@@ -27,6 +27,9 @@
  * This data blob is saved to the registry. The client returns this
  * data blob in a new session with the printer announce data.
  * The data is not interpreted by the client.
+ *
+ * Blobs are kept in memory once they have been read or written, so
+ * the files are only read the first time a printer is announced.
  */
 
 #include <sys/stat.h>
@@ -37,6 +40,78 @@
 #include <string.h>
 #include "rdesktop.h"
 
+typedef struct printercache_entry
+{
+	char *printer;
+	uint8 *data;
+	int length;
+	struct printercache_entry *next;
+}
+PRINTERCACHE_ENTRY;
+
+static PRINTERCACHE_ENTRY *g_printercache = NULL;
+
+static PRINTERCACHE_ENTRY *
+printercache_find(const char *printer)
+{
+	PRINTERCACHE_ENTRY *entry;
+
+	for (entry = g_printercache; entry != NULL; entry = entry->next)
+	{
+		if (strcmp(entry->printer, printer) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+/* Remember data as the blob of printer, or that it has none if data is NULL */
+static void
+printercache_remember(const char *printer, const uint8 * data, int length)
+{
+	PRINTERCACHE_ENTRY *entry;
+
+	entry = printercache_find(printer);
+	if (entry == NULL)
+	{
+		entry = (PRINTERCACHE_ENTRY *) xmalloc(sizeof(PRINTERCACHE_ENTRY));
+		entry->printer = xstrdup(printer);
+		entry->next = g_printercache;
+		g_printercache = entry;
+	}
+	else
+	{
+		xfree(entry->data);
+	}
+
+	entry->data = NULL;
+	entry->length = 0;
+	if (data != NULL && length > 0)
+	{
+		entry->data = (uint8 *) xmalloc(length);
+		memcpy(entry->data, data, length);
+		entry->length = length;
+	}
+}
+
+static void
+printercache_forget(const char *printer)
+{
+	PRINTERCACHE_ENTRY **pentry, *entry;
+
+	for (pentry = &g_printercache; *pentry != NULL; pentry = &(*pentry)->next)
+	{
+		entry = *pentry;
+		if (strcmp(entry->printer, printer) == 0)
+		{
+			*pentry = entry->next;
+			xfree(entry->printer);
+			xfree(entry->data);
+			xfree(entry);
+			return;
+		}
+	}
+}
+
 static RD_BOOL
 printercache_mkdir(char *base, char *printer)
 {
@@ -82,6 +157,8 @@ printercache_unlink_blob(char *printer)
 	if (printer == NULL)
 		return False;
 
+	printercache_forget(printer);
+
 	home = getenv("HOME");
 	if (home == NULL)
 		return False;
@@ -122,6 +199,10 @@ printercache_rename_blob(char *printer, char *new_printer)
 	if (printer == NULL)
 		return False;
 
+	/* the blob is read back from the new location when needed */
+	printercache_forget(printer);
+	printercache_forget(new_printer);
+
 	home = getenv("HOME");
 	if (home == NULL)
 		return False;
@@ -158,6 +239,7 @@ int
 printercache_load_blob(char *printer_name, uint8 ** data)
 {
 	char *home, *path;
+	PRINTERCACHE_ENTRY *entry;
 	struct stat st;
 	int fd, length;
 
@@ -166,6 +248,16 @@ printercache_load_blob(char *printer_name, uint8 ** data)
 
 	*data = NULL;
 
+	entry = printercache_find(printer_name);
+	if (entry != NULL)
+	{
+		if (entry->length == 0)
+			return 0;
+		*data = (uint8 *) xmalloc(entry->length);
+		memcpy(*data, entry->data, entry->length);
+		return entry->length;
+	}
+
 	home = getenv("HOME");
 	if (home == NULL)
 		return 0;
@@ -178,11 +270,13 @@ printercache_load_blob(char *printer_name, uint8 ** data)
 	if (fd == -1)
 	{
 		xfree(path);
+		printercache_remember(printer_name, NULL, 0);
 		return 0;
 	}
 
 	if (fstat(fd, &st))
 	{
+		close(fd);
 		xfree(path);
 		return 0;
 	}
@@ -191,6 +285,8 @@ printercache_load_blob(char *printer_name, uint8 ** data)
 	length = read(fd, *data, st.st_size);
 	close(fd);
 	xfree(path);
+
+	printercache_remember(printer_name, *data, length);
 	return length;
 }
 
@@ -203,6 +299,8 @@ printercache_save_blob(char *printer_name, uint8 * data, uint32 length)
 	if (printer_name == NULL)
 		return;
 
+	printercache_remember(printer_name, data, length);
+
 	home = getenv("HOME");
 	if (home == NULL)
 		return;
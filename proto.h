@@ -32,21 +32,37 @@ extern "C" {
 #endif // __GNUC__
 /* bitmap.c */
 RD_BOOL bitmap_decompress(uint8 * output, int width, int height, uint8 * input, int size, int Bpp);
+RD_BOOL bitmap_decompress_planar(uint8 * output, int width, int height, uint8 * input, int size,
+				 RD_BOOL bottom_up);
+int bitmap_compress(uint8 * output, int size, int width, int height, uint8 * input, int Bpp);
+void bitmap_decompress_queue(BITMAP_JOB * job);
+RD_BOOL bitmap_decompress_wait(BITMAP_JOB * job);
+RD_BOOL bitmap_format_stats(int n, char *buf, size_t size);
+void bitmap_reset_stats(void);
 /* cache.c */
 void cache_rebuild_bmpcache_linked_list(uint8 id, sint16 * idx, int count);
-void cache_bump_bitmap(uint8 id, uint16 idx, int bump);
+void cache_renumber_bitmaps(uint8 id, sint16 * old, int count);
+RD_BOOL cache_set_bitmap_policy(const char *name);
+uint32 cache_bitmap_cells(uint8 id, uint32 cells, RD_BOOL persistent);
 void cache_evict_bitmap(uint8 id);
 RD_HBITMAP cache_get_bitmap(uint8 id, uint16 idx);
-void cache_put_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap);
+RD_BOOL cache_has_bitmap(uint8 id, uint16 idx);
+RD_BOOL cache_preload_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap, uint32 size);
+void cache_put_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap, uint32 size);
+RD_BOOL cache_put_compressed_bitmap(uint8 id, uint16 idx, uint8 width, uint8 height, uint8 Bpp,
+				    uint8 * data, uint16 size);
 void cache_save_state(void);
+RD_BOOL cache_format_stats(int n, char *buf, size_t size);
+void cache_reset_stats(void);
+void cache_report_stats(void);
 FONTGLYPH *cache_get_font(uint8 font, uint16 character);
 void cache_put_font(uint8 font, uint16 character, uint16 offset, uint16 baseline, uint16 width,
 		    uint16 height, RD_HGLYPH pixmap);
 DATABLOB *cache_get_text(uint8 cache_id);
 void cache_put_text(uint8 cache_id, void *data, int length);
-uint8 *cache_get_desktop(uint32 offset, int cx, int cy, int bytes_per_pixel);
-void cache_put_desktop(uint32 offset, int cx, int cy, int scanline, int bytes_per_pixel,
-		       uint8 * data);
+RD_HBITMAP cache_get_offscreen(uint16 idx);
+void cache_put_offscreen(uint16 idx, RD_HBITMAP bitmap);
+void cache_reset_offscreen(void);
 RD_HCURSOR cache_get_cursor(uint16 cache_idx);
 void cache_put_cursor(uint16 cache_idx, RD_HCURSOR cursor);
 BRUSHDATA *cache_get_brush_data(uint8 colour_code, uint8 idx);
@@ -55,32 +71,59 @@ void cache_put_brush_data(uint8 colour_code, uint8 idx, BRUSHDATA * brush_data);
 VCHANNEL *channel_register(char *name, uint32 flags, void (*callback) (STREAM));
 STREAM channel_init(VCHANNEL * channel, uint32 length);
 void channel_send(STREAM s, VCHANNEL * channel);
+void channel_send_begin(VCHANNEL * channel, uint32 length);
+void channel_send_part(uint8 * data, uint32 length);
+void channel_send_end(void);
+void channel_flush(void);
+void channel_reset_state(void);
 void channel_process(STREAM s, uint16 mcs_channel);
 /* cliprdr.c */
 void cliprdr_send_simple_native_format_announce(uint32 format);
 void cliprdr_send_native_format_announce(uint8 * formats_data, uint32 formats_data_length);
 void cliprdr_send_data_request(uint32 format);
 void cliprdr_send_data(uint8 * data, uint32 length);
+void cliprdr_send_data_begin(uint32 length);
+void cliprdr_send_data_part(uint8 * data, uint32 length);
+void cliprdr_send_data_end(void);
 void cliprdr_set_mode(const char *optarg);
 RD_BOOL cliprdr_init(void);
 /* ctrl.c */
 int ctrl_init(const char *user, const char *domain, const char *host);
+int ctrl_host_init(void);
+int ctrl_host_serve(int *argc, char ***argv);
+int ctrl_host_open_session(int argc, char *argv[]);
 void ctrl_cleanup();
 RD_BOOL ctrl_is_slave();
 int ctrl_send_command(const char *cmd, const char *args);
-void ctrl_add_fds(int *n, fd_set * rfds);
-void ctrl_check_fds(fd_set * rfds, fd_set * wfds);
+void ctrl_check_fds(void);
 
 /* disk.c */
 int disk_enum_devices(uint32 * id, char *optarg);
 RD_NTSTATUS disk_query_information(RD_NTHANDLE handle, uint32 info_class, STREAM out);
 RD_NTSTATUS disk_set_information(RD_NTHANDLE handle, uint32 info_class, STREAM in, STREAM out);
-RD_NTSTATUS disk_check_notify(RD_NTHANDLE handle);
+void disk_collect_notify(void);
+RD_NTSTATUS disk_check_notify(RD_NTHANDLE handle, STREAM out);
 RD_NTSTATUS disk_create_notify(RD_NTHANDLE handle, uint32 info_class);
 RD_NTSTATUS disk_query_volume_information(RD_NTHANDLE handle, uint32 info_class, STREAM out);
 RD_NTSTATUS disk_query_directory(RD_NTHANDLE handle, uint32 info_class, char *pattern, STREAM out);
+FILEINFO *disk_fileinfo(RD_NTHANDLE handle);
+/* clearcodec.c */
+RD_BOOL clear_decompress(uint8 * data, uint32 size, int width, int height, uint8 * dst,
+			 int stride);
+void clear_reset(void);
 /* mppc.c */
 int mppc_expand(uint8 * data, uint32 clen, uint8 ctype, uint32 * roff, uint32 * rlen);
+STREAM mppc_decompress(uint8 * data, uint32 clen, uint8 ctype);
+uint8 mppc_compress(uint8 * data, uint32 len, uint8 * out, uint32 * olen);
+void mppc_compress_reset(void);
+/* zgfx.c */
+STREAM zgfx_decompress(STREAM s);
+void zgfx_reset(void);
+/* evloop.c */
+void evloop_add_fd(int fd, int events);
+void evloop_remove_fd(int fd);
+int evloop_check_fd(int fd);
+int evloop_wait(int n, fd_set * rfds, fd_set * wfds, struct timeval *tv);
 /* ewmhints.c */
 int get_current_workarea(uint32 * x, uint32 * y, uint32 * width, uint32 * height);
 void ewmh_init(void);
@@ -96,6 +139,14 @@ void iso_reset_state(void);
 RD_BOOL cssp_connect(char *server, char *user, char *domain, char *password, STREAM s);
 /* licence.c */
 void licence_process(STREAM s);
+/* loadgen.c */
+RD_BOOL loadgen_open(const char *filename);
+void loadgen_start(void);
+int loadgen_timeout(void);
+RD_BOOL loadgen_run(void);
+void loadgen_drawn(int x, int y, int cx, int cy);
+RD_BOOL loadgen_format_stats(int n, char *buf, size_t size);
+void loadgen_close(void);
 /* mcs.c */
 STREAM mcs_init(int length);
 void mcs_send_to_channel(STREAM s, uint16 channel);
@@ -106,8 +157,21 @@ RD_BOOL mcs_connect_start(char *server, char *username, char *domain, char *pass
 RD_BOOL mcs_connect_finalize(STREAM s);
 void mcs_disconnect(int reason);
 void mcs_reset_state(void);
+/* autodetect.c */
+void autodetect_process(STREAM s);
+void autodetect_received(uint32 bytes);
+uint32 autodetect_bandwidth(void);
+uint32 autodetect_performance_flags(uint32 flags);
+RD_BOOL autodetect_format_stats(int n, char *buf, size_t size);
+void autodetect_reset_state(void);
+
+/* nsc.c */
+RD_BOOL nsc_decode(uint8 * data, uint32 size, int width, int height, uint8 * dst, int stride);
 /* orders.c */
 void process_orders(STREAM s, uint16 num_orders);
+RD_BOOL orders_format_stats(int n, char *buf, size_t size);
+void orders_reset_stats(void);
+void orders_report_stats(void);
 void reset_order_state(void);
 /* parallel.c */
 int parallel_enum_devices(uint32 * id, char *optarg);
@@ -122,7 +186,14 @@ RD_BOOL pstcache_load_bitmap(uint8 cache_id, uint16 cache_idx);
 RD_BOOL pstcache_save_bitmap(uint8 cache_id, uint16 cache_idx, uint8 * key, uint8 width,
 			     uint8 height, uint16 length, uint8 * data);
 int pstcache_enumerate(uint8 id, HASH_KEY * keylist);
+RD_BOOL pstcache_format_stats(char *buf, size_t size);
+void pstcache_preload_start(void);
+void pstcache_preload_step(void);
+void pstcache_set_server(const char *server);
 RD_BOOL pstcache_init(uint8 cache_id);
+void pstcache_mark_drawn(uint8 cache_id, uint16 cache_idx);
+void pstcache_reset_state(void);
+void pstcache_close(void);
 /* rdesktop.c */
 int main(int argc, char *argv[]);
 void generate_random(uint8 * random);
@@ -145,30 +216,49 @@ void rd_create_ui(void);
 RD_BOOL rd_pstcache_mkdir(void);
 RD_BOOL rd_certcache_mkdir(void);
 int rd_open_file(char *filename);
+RD_BOOL rd_claim_file(char *from, char *to);
 void rd_close_file(int fd);
 int rd_read_file(int fd, void *ptr, int len);
 int rd_write_file(int fd, void *ptr, int len);
 int rd_lseek_file(int fd, int offset);
 RD_BOOL rd_lock_file(int fd, int start, int len);
+void rd_lock_file_wait(int fd, int start, int len, RD_BOOL write);
+void rd_unlock_file(int fd, int start, int len);
+RD_BOOL rd_reserve_file(int fd, uint64 offset, size_t len);
+void *rd_map_file(int fd, size_t len);
+void rd_discard_file_pages(void *ptr, size_t len);
+void rd_sync_file(void *ptr, size_t len);
+void rd_unmap_file(void *ptr, size_t len);
 /* rdp5.c */
 void process_ts_fp_updates(STREAM s);
 /* rdp.c */
 void rdp_in_unistr(STREAM s, int in_len, char **string, uint32 * str_size);
 void rdp_send_input(uint32 time, uint16 message_type, uint16 device_flags, uint16 param1,
 		    uint16 param2);
+void rdp_input_batch_begin(void);
+void rdp_input_batch_end(void);
+int rdp_input_timeout(void);
 void rdp_send_suppress_output_pdu(enum RDP_SUPPRESS_STATUS allowupdates);
+void rdp_send_refresh_rect(int x, int y, int cx, int cy);
+void rdp_set_focus_region(int left, int top, int right, int bottom);
 void process_colour_pointer_pdu(STREAM s);
 void process_new_pointer_pdu(STREAM s);
 void process_cached_pointer_pdu(STREAM s);
 void process_system_pointer_pdu(STREAM s);
 void set_system_pointer(uint32 ptr);
 void process_bitmap_updates(STREAM s);
+void process_surface_commands(STREAM s);
 void process_palette(STREAM s);
 void rdp_main_loop(RD_BOOL * deactivated, uint32 * ext_disc_reason);
 RD_BOOL rdp_loop(RD_BOOL * deactivated, uint32 * ext_disc_reason);
+void rdp_connect_phase(connect_phase_t phase);
+RD_BOOL rdp_format_connect_stats(int n, char *buf, size_t size);
 RD_BOOL rdp_connect(char *server, uint32 flags, char *domain, char *password, char *command,
 		    char *directory, RD_BOOL reconnect);
 void rdp_reset_state(void);
+RD_BOOL rdp_format_stats(int n, char *buf, size_t size);
+void rdp_reset_stats(void);
+void rdp_set_session_size(uint16 width, uint16 height);
 void rdp_disconnect(void);
 #define rdp_protocol_error(m, s) _rdp_protocol_error(__FILE__, __LINE__, __func__, m, s)
 void _rdp_protocol_error(const char *file, int line, const char *func,
@@ -184,8 +274,14 @@ struct async_iorequest *rdpdr_remove_iorequest(struct async_iorequest *prev,
 					       struct async_iorequest *iorq);
 void rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out);
 RD_BOOL rdpdr_abort_io(uint32 fd, uint32 major, RD_NTSTATUS status);
+RD_BOOL rdpdr_format_stats(int n, char *buf, size_t size);
+void rdpdr_reset_stats(void);
 /* rdpsnd.c */
+typedef void (*rdpsnd_capture_fn) (unsigned char *data, unsigned int size);
 void rdpsnd_record(const void *data, unsigned int size);
+RD_BOOL rdpsnd_capture_open(RD_WAVEFORMATEX * format, unsigned int packet_size,
+			    rdpsnd_capture_fn handler);
+void rdpsnd_capture_close(void);
 RD_BOOL rdpsnd_init(char *optarg);
 void rdpsnd_show_help(void);
 void rdpsnd_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv);
@@ -195,6 +291,22 @@ RD_BOOL rdpsnd_queue_empty(void);
 void rdpsnd_queue_next(unsigned long completed_in_us);
 int rdpsnd_queue_next_tick(void);
 void rdpsnd_reset_state(void);
+RD_BOOL rdpsnd_format_stats(int n, char *buf, size_t size);
+unsigned int rdpsnd_queue_delay(void);
+RD_BOOL rdpsnd_play(RD_WAVEFORMATEX * format, uint8 * data, unsigned int size);
+void rdpsnd_reset_stats(void);
+/* rdpeai.c */
+void rdpeai_init(void);
+/* rdpsnd_dsp.c */
+RD_BOOL rdpsnd_dsp_resampler_select(const char *name);
+/* replay.c */
+RD_BOOL replay_record_open(const char *filename);
+void replay_record(STREAM s, RD_BOOL is_fastpath);
+void replay_record_close(void);
+RD_BOOL replay_open(const char *filename);
+RD_BOOL replay_is_active(void);
+STREAM replay_recv(RD_BOOL * is_fastpath);
+void replay_close(void);
 /* secure.c */
 void sec_hash_to_string(char *out, int out_size, uint8 * in, int in_size);
 void sec_hash_sha1_16(uint8 * out, uint8 * in, uint8 * salt1);
@@ -207,28 +319,50 @@ void sec_decrypt(uint8 * data, int length);
 STREAM sec_init(uint32 flags, int maxlen);
 void sec_send_to_channel(STREAM s, uint32 flags, uint16 channel);
 void sec_send(STREAM s, uint32 flags);
+STREAM sec_init_message(int maxlen);
+void sec_send_message(STREAM s, uint32 flags);
+void sec_send_fastpath_input(uint8 * data, uint32 length, uint8 num_events);
 void sec_process_mcs_data(STREAM s);
 STREAM sec_recv(RD_BOOL * is_fastpath);
 RD_BOOL sec_connect(char *server, char *username, char *domain, char *password, RD_BOOL reconnect);
 void sec_disconnect(void);
 void sec_reset_state(void);
+RD_BOOL sec_format_stats(int n, char *buf, size_t size);
+void sec_reset_stats(void);
 /* serial.c */
 int serial_enum_devices(uint32 * id, char *optarg);
 RD_BOOL serial_get_event(RD_NTHANDLE handle, uint32 * result);
 RD_BOOL serial_get_timeout(RD_NTHANDLE handle, uint32 length, uint32 * timeout,
 			   uint32 * itv_timeout);
+/* stream.c */
+RD_BOOL ascii_to_utf16(unsigned char *out, const char *string, size_t length);
+RD_BOOL s_format_stats(int n, char *buf, size_t size);
+void s_reset_stats(void);
+void s_report_stats(void);
 /* tcp.c */
 STREAM tcp_init(uint32 maxlen);
 void tcp_send(STREAM s);
+void tcp_cork(void);
+void tcp_uncork(void);
+RD_BOOL tcp_can_send(int millis);
+void tcp_want_send(RD_BOOL want);
 STREAM tcp_recv(STREAM s, uint32 length);
 RD_BOOL tcp_connect(char *server);
 void tcp_disconnect(void);
 char *tcp_get_address(void);
 RD_BOOL tcp_is_connected(void);
 void tcp_reset_state(void);
+void tcp_tls_preload(void);
 RD_BOOL tcp_tls_connect(void);
 STREAM tcp_tls_get_server_pubkey();
 void tcp_run_ui(RD_BOOL run);
+RD_BOOL tcp_set_profile(const char *name);
+void tcp_tune_buffers(uint32 rtt, uint32 bandwidth);
+uint32 tcp_backlog(void);
+/* trace.c */
+void trace_init(void);
+int trace_dump(const char *path);
+void trace_check_signal(void);
 
 /* asn.c */
 RD_BOOL ber_in_header(STREAM s, int *tagval, int *length);
@@ -249,6 +383,7 @@ void xclip_deinit(void);
 /* xkeymap.c */
 RD_BOOL xkeymap_from_locale(const char *locale);
 FILE *xkeymap_open(const char *filename);
+void xkeymap_load(void);
 void xkeymap_init(void);
 RD_BOOL handle_special_keys(uint32 keysym, unsigned int state, uint32 ev_time, RD_BOOL pressed);
 key_translation xkeymap_translate_key(uint32 keysym, unsigned int keycode, unsigned int state);
@@ -267,6 +402,7 @@ void rdp_send_scancode(uint32 time, uint16 flags, uint8 scancode);
 RD_BOOL get_key_state(unsigned int state, uint32 keysym);
 RD_BOOL ui_init(void);
 void ui_get_screen_size(uint32 * width, uint32 * height);
+int ui_get_monitors(RD_MONITOR * monitors, int max);
 void ui_get_screen_size_from_percentage(uint32 pw, uint32 ph, uint32 * width, uint32 * height);
 void ui_get_workarea_size(uint32 * width, uint32 * height);
 void ui_deinit(void);
@@ -281,6 +417,8 @@ void ui_move_pointer(int x, int y);
 RD_HBITMAP ui_create_bitmap(int width, int height, uint8 * data);
 void ui_paint_bitmap(int x, int y, int cx, int cy, int width, int height, uint8 * data);
 void ui_destroy_bitmap(RD_HBITMAP bmp);
+RD_HBITMAP ui_create_surface(int width, int height);
+void ui_switch_surface(RD_HBITMAP surface);
 RD_HGLYPH ui_create_glyph(int width, int height, uint8 * data);
 void ui_destroy_glyph(RD_HGLYPH glyph);
 RD_HCURSOR ui_create_cursor(unsigned int x, unsigned int y, uint32 width, uint32 height,
@@ -318,6 +456,9 @@ void ui_desktop_save(uint32 offset, int x, int y, int cx, int cy);
 void ui_desktop_restore(uint32 offset, int x, int y, int cx, int cy);
 void ui_begin_update(void);
 void ui_end_update(void);
+void ui_report_frame_stats(void);
+RD_BOOL ui_format_stats(int n, char *buf, size_t size);
+void ui_reset_stats(void);
 void ui_seamless_begin(RD_BOOL hidden);
 void ui_seamless_end();
 void ui_seamless_hide_desktop(void);
@@ -337,18 +478,56 @@ void ui_seamless_settitle(unsigned long id, const char *title, unsigned long fla
 void ui_seamless_setstate(unsigned long id, unsigned int state, unsigned long flags);
 void ui_seamless_syncbegin(unsigned long flags);
 void ui_seamless_ack(unsigned int serial);
+void ui_seamless_batch_begin(void);
+void ui_seamless_batch_end(void);
 /* lspci.c */
 RD_BOOL lspci_init(void);
+/* rdpegfx.c */
+void rdpegfx_init(void);
+RD_BOOL rdpegfx_format_stats(int n, char *buf, size_t size);
+void rdpegfx_reset_stats(void);
+/* h264.c */
+RD_BOOL h264_decompress_avc420(uint16 surface_id, uint8 * data, uint32 size, uint8 * dst,
+			       int stride, int width, int height, BOUNDS * rects, int nrects);
+RD_BOOL h264_decompress_avc444(uint16 surface_id, RD_BOOL v2, uint8 * luma, uint32 luma_size,
+			       BOUNDS * luma_rects, int luma_nrects, uint8 * aux,
+			       uint32 aux_size, BOUNDS * aux_rects, int aux_nrects, uint8 * dst,
+			       int stride, int width, int height);
+void h264_delete_surface(uint16 surface_id);
+void h264_reset(void);
+RD_BOOL h264_available(void);
+/* tsmf.c */
+void tsmf_init(void);
+int tsmf_present(void);
+void tsmf_reset_state(void);
+/* rfx.c */
+void rfx_rlgr_decode(RD_BOOL rlgr3, uint8 * data, uint32 size, sint16 * out, int count);
+void rfx_ycbcr_to_bgra(sint16 * y, sint16 * cb, sint16 * cr, uint8 * out);
+RD_BOOL rfx_process_message(uint8 * data, uint32 size, int left, int top, int width, int height);
+/* rfxprog.c */
+RD_BOOL rfxprog_decompress(uint16 surface_id, uint8 * data, uint32 size, uint8 * dst, int stride,
+			   int width, int height, BOUNDS * damage);
+void rfxprog_delete_surface(uint16 surface_id);
+void rfxprog_reset(void);
 /* rdpedisp.c */
 void rdpedisp_init(void);
 RD_BOOL rdpedisp_is_available();
 void rdpedisp_set_session_size(uint32 width, uint32 height);
 /* dvc.c */
 typedef void (*dvc_channel_process_fn) (STREAM s);
+typedef void (*dvc_channel_open_fn) (void);
 RD_BOOL dvc_init(void);
-RD_BOOL dvc_channels_register(const char *name, dvc_channel_process_fn handler);
+void dvc_reset_state(void);
+RD_BOOL dvc_channels_register(const char *name, dvc_channel_process_fn handler,
+			      dvc_channel_open_fn open, int priority);
+RD_BOOL dvc_channels_register_instances(const char *name, dvc_channel_process_fn handler,
+					dvc_channel_open_fn open, int priority);
+uint32 dvc_channel_id(void);
 RD_BOOL dvc_channels_is_available(const char *name);
 void dvc_send(const char *name, STREAM s);
+void dvc_send_to(uint32 channel_id, STREAM s);
+void dvc_flush(void);
+int dvc_send_timeout(void);
 /* seamless.c */
 RD_BOOL seamless_init(void);
 void seamless_reset_state(void);
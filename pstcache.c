@@ -17,9 +17,50 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <pthread.h>
+
 #include "rdesktop.h"
 
+/* All sessions of a user to a server share one pool of cells per
+   colour depth, keyed by the HASH_KEY the server gives each bitmap.
+   Other servers get pools of their own, so that using one now and
+   then does not push the bitmaps of the usual one out. The server
+   refers to bitmaps by the cell index it assigned in this session, so
+   each session maps its indices to pool cells, and checks the key of
+   a cell on every use because another session may have replaced it.
+
+   Cells are placed by their key, with a short linear probe, and the
+   one with the oldest stamp is replaced when all are taken. Writers
+   hold a write lock on the first byte of the file, readers a read
+   lock. As the file is mapped shared, identical bitmaps also take up
+   the same memory in every session.
+
+   Each cell counts the sessions that drew it. When the key list is
+   sent, cells are offered by how recently they were used, with those
+   used in many sessions moved ahead, so that the ones left out when
+   there are too many are the least likely to be drawn again.
+
+   The file starts with an index of the headers of all cells, followed
+   by room for the data of each at a whole number of pages. Cells can
+   be stored compressed, in which case only the pages they use take up
+   disk space. The file is reserved on disk when it is created and a
+   cell again before it is stored, so that storing to the mapping
+   never meets a full disk. */
+
 #define MAX_CELL_SIZE		0x1000	/* pixels */
+#define CELL_SIZE		(g_pstcache_Bpp * MAX_CELL_SIZE)
+
+/* Room for the cells of two full sessions */
+#define POOL_CELLS		(2 * BMPCACHE2_NUM_PSTCELLS)
+#define POOL_PROBES		16
+#define POOL_INDEX_SIZE		((POOL_CELLS * sizeof(CELLHEADER) + 0xffff) & ~0xffff)
+#define POOL_SIZE		(POOL_INDEX_SIZE + POOL_CELLS * CELL_SIZE)
+#define POOL_CELL(slot)		((CELLHEADER *) g_pstcache_pool + (slot))
+#define POOL_DATA(slot)		(g_pstcache_pool + POOL_INDEX_SIZE + (slot) * CELL_SIZE)
+
+/* Pool file used before there was one per server */
+#define POOL_FILE_SHARED	"cache/pstpool_%d"
+#define POOL_FILE		"cache/pstpool_%d_%08x"
 
 #define IS_PERSISTENT(id) (id < 8 && g_pstcache_fd[id] > 0)
 
@@ -27,35 +68,264 @@ extern int g_server_depth;
 extern RD_BOOL g_bitmap_cache;
 extern RD_BOOL g_bitmap_cache_persist_enable;
 extern RD_BOOL g_bitmap_cache_precache;
+extern RD_BOOL g_bitmap_cache_compress;
 
 int g_pstcache_fd[8];
 int g_pstcache_Bpp;
 RD_BOOL g_pstcache_enumerated = False;
 uint8 zero_key[] = { 0, 0, 0, 0, 0, 0, 0, 0 };
 
+static int g_pstcache_pool_fd = -1;
+static uint8 *g_pstcache_pool = NULL;
+
+/* Hash of the server name the pool is chosen by, 0 for none */
+static uint32 g_pstcache_server;
+
+/* The pool cell of each cell index of this session (-1 for none),
+   and the key the server knows it by */
+static int *g_pstcache_slot[8];
+static HASH_KEY *g_pstcache_keys[8];
+
+/* Whether the bitmap of each cell index was drawn in this session */
+static uint8 *g_pstcache_drawn[8];
+
+/* Added to the stamps of this session, so that they sort above those
+   of the sessions that were there before */
+static uint32 g_pstcache_stamp_base;
+
+/* Persistent cache file activity */
+static uint32 g_pstcache_loads;
+static uint32 g_pstcache_saves;
+static uint32 g_pstcache_touches;
+static uint64 g_pstcache_bytes_read;
+static uint64 g_pstcache_bytes_written;
+
+/* Cells to read ahead after the key list has been sent, the first
+   ones of the session, which are the most likely to be used. A
+   thread faults the cells of the mapping in, and the
+   main thread turns the ones it is done with into bitmaps a batch at a
+   time, as X can only be used from there. */
+#define PRELOAD_BATCH		16
+
+/* The selection, g_preload_slots and g_preload_count, is only changed
+   while the thread does not run */
+static pthread_mutex_t g_preload_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_preload_slots[BMPCACHE2_C2_CELLS];
+static uint8 g_preload_id;
+static int g_preload_count;
+static int g_preload_read;	/* protected by g_preload_lock */
+static int g_preload_done;
+static pthread_t g_preload_thread;
+static RD_BOOL g_preload_running;
+
+typedef struct
+{
+	uint32 stamp;
+	uint32 rank;
+	int slot;
+}
+POOL_ENTRY;
+
+
+static void
+pstcache_lock(RD_BOOL write)
+{
+	rd_lock_file_wait(g_pstcache_pool_fd, 0, 1, write);
+}
+
+static void
+pstcache_unlock(void)
+{
+	rd_unlock_file(g_pstcache_pool_fd, 0, 1);
+}
+
+/* The pool cell holding cache_idx of this session, or -1 if there is
+   none or it has been given to another bitmap since */
+static int
+pstcache_slot(uint8 cache_id, uint16 cache_idx)
+{
+	int slot;
+
+	slot = g_pstcache_slot[cache_id][cache_idx];
+	if (slot < 0)
+		return -1;
+
+	if (memcmp(POOL_CELL(slot)->key, g_pstcache_keys[cache_id][cache_idx],
+		   sizeof(HASH_KEY)) != 0)
+		return -1;
+
+	return slot;
+}
+
+/* Find the pool cell holding key, or else the one to put it in. Must
+   be called with the write lock held. */
+static int
+pstcache_find_slot(uint8 * key, RD_BOOL * found)
+{
+	CELLHEADER *cell;
+	uint32 first;
+	int i, slot, unused, oldest;
+
+	first = key[0] | (key[1] << 8) | (key[2] << 16) | ((uint32) key[3] << 24);
+	unused = oldest = -1;
+
+	for (i = 0; i < POOL_PROBES; i++)
+	{
+		slot = (first + i) % POOL_CELLS;
+		cell = POOL_CELL(slot);
+
+		if (memcmp(cell->key, key, sizeof(HASH_KEY)) == 0)
+		{
+			*found = True;
+			return slot;
+		}
+
+		if (memcmp(cell->key, zero_key, sizeof(HASH_KEY)) == 0)
+		{
+			if (unused == -1)
+				unused = slot;
+		}
+		else if (oldest == -1 || cell->stamp < POOL_CELL(oldest)->stamp)
+		{
+			oldest = slot;
+		}
+	}
+
+	*found = False;
+	return unused != -1 ? unused : oldest;
+}
 
 /* Update mru stamp/index for a bitmap */
 void
 pstcache_touch_bitmap(uint8 cache_id, uint16 cache_idx, uint32 stamp)
 {
-	int fd;
+	CELLHEADER *cell;
+	int slot;
 
 	if (!IS_PERSISTENT(cache_id) || cache_idx >= BMPCACHE2_NUM_PSTCELLS)
 		return;
 
-	fd = g_pstcache_fd[cache_id];
-	rd_lseek_file(fd, 12 + cache_idx * (g_pstcache_Bpp * MAX_CELL_SIZE + sizeof(CELLHEADER)));
-	rd_write_file(fd, &stamp, sizeof(stamp));
+	/* A bitmap dropped from memory is left to age in the pool, as
+	   other sessions may still be using it */
+	if (stamp == 0)
+		return;
+
+	/* other sessions may be saving to or enumerating the pool */
+	pstcache_lock(True);
+	slot = pstcache_slot(cache_id, cache_idx);
+	if (slot < 0)
+	{
+		pstcache_unlock();
+		return;
+	}
+
+	cell = POOL_CELL(slot);
+	cell->stamp = g_pstcache_stamp_base + stamp;
+	pstcache_unlock();
+	g_pstcache_touches++;
+	g_pstcache_bytes_written += sizeof(cell->stamp);
+}
+
+/* Note that a bitmap was drawn, which counts it as used in this
+   session */
+void
+pstcache_mark_drawn(uint8 cache_id, uint16 cache_idx)
+{
+	if (IS_PERSISTENT(cache_id) && cache_idx < BMPCACHE2_NUM_PSTCELLS)
+		g_pstcache_drawn[cache_id][cache_idx] = 1;
+}
+
+/* Count one more session in the cells drawn in this one, whether
+   their bitmaps are still in memory or not */
+static void
+pstcache_count_uses(void)
+{
+	CELLHEADER *cell;
+	int id, idx, slot;
+
+	if (g_pstcache_pool == NULL)
+		return;
+
+	pstcache_lock(True);
+	for (id = 0; id < 8; id++)
+	{
+		if (g_pstcache_drawn[id] == NULL)
+			continue;
+
+		for (idx = 0; idx < BMPCACHE2_NUM_PSTCELLS; idx++)
+		{
+			if (!g_pstcache_drawn[id][idx])
+				continue;
+
+			g_pstcache_drawn[id][idx] = 0;
+			slot = pstcache_slot(id, idx);
+			if (slot < 0)
+				continue;
+
+			cell = POOL_CELL(slot);
+			if (cell->uses < 0xffff)
+				cell->uses++;
+			g_pstcache_bytes_written += sizeof(cell->uses);
+		}
+	}
+	pstcache_unlock();
+}
+
+/* Create a bitmap from a cell of the persistent cache, NULL if the
+   cell is not valid */
+static RD_HBITMAP
+pstcache_read_bitmap(uint8 cache_id, uint16 cache_idx, uint32 * size)
+{
+	uint8 pixels[MAX_CELL_SIZE * 4];
+	CELLHEADER *cell;
+	RD_HBITMAP bitmap;
+	uint8 *data;
+	int slot;
+
+	pstcache_lock(False);
+
+	slot = pstcache_slot(cache_id, cache_idx);
+	if (slot < 0)
+	{
+		pstcache_unlock();
+		logger(Core, Debug, "pstcache_read_bitmap(), cell replaced: id=%d, idx=%d",
+		       cache_id, cache_idx);
+		return NULL;
+	}
+
+	cell = POOL_CELL(slot);
+	data = POOL_DATA(slot);
+
+	if (cell->width * cell->height > MAX_CELL_SIZE || cell->length > CELL_SIZE ||
+	    (!cell->compressed && cell->length < cell->width * cell->height * g_pstcache_Bpp) ||
+	    (cell->compressed && !bitmap_decompress(pixels, cell->width, cell->height, data,
+						   cell->length, g_pstcache_Bpp)))
+	{
+		pstcache_unlock();
+		logger(Core, Warning, "pstcache_read_bitmap(), corrupt cell: id=%d, idx=%d",
+		       cache_id, cache_idx);
+		return NULL;
+	}
+
+	/* uncompressed bitmaps are created straight from the mapping */
+	bitmap = ui_create_bitmap(cell->width, cell->height, cell->compressed ? pixels : data);
+	*size = cell->width * cell->height * g_pstcache_Bpp;
+	g_pstcache_loads++;
+	g_pstcache_bytes_read += sizeof(CELLHEADER) + cell->length;
+
+	pstcache_unlock();
+
+	logger(Core, Debug, "pstcache_read_bitmap(), load bitmap from disk: id=%d, idx=%d, bmp=%p)",
+	       cache_id, cache_idx, bitmap);
+	return bitmap;
 }
 
 /* Load a bitmap from the persistent cache */
 RD_BOOL
 pstcache_load_bitmap(uint8 cache_id, uint16 cache_idx)
 {
-	uint8 *celldata;
-	int fd;
-	CELLHEADER cellhdr;
 	RD_HBITMAP bitmap;
+	uint32 size;
 
 	if (!g_bitmap_cache_persist_enable)
 		return False;
@@ -63,18 +333,11 @@ pstcache_load_bitmap(uint8 cache_id, uint16 cache_idx)
 	if (!IS_PERSISTENT(cache_id) || cache_idx >= BMPCACHE2_NUM_PSTCELLS)
 		return False;
 
-	fd = g_pstcache_fd[cache_id];
-	rd_lseek_file(fd, cache_idx * (g_pstcache_Bpp * MAX_CELL_SIZE + sizeof(CELLHEADER)));
-	rd_read_file(fd, &cellhdr, sizeof(CELLHEADER));
-	celldata = (uint8 *) xmalloc(cellhdr.length);
-	rd_read_file(fd, celldata, cellhdr.length);
-
-	bitmap = ui_create_bitmap(cellhdr.width, cellhdr.height, celldata);
-	logger(Core, Debug, "pstcache_load_bitmap(), load bitmap from disk: id=%d, idx=%d, bmp=%p)",
-	       cache_id, cache_idx, bitmap);
-	cache_put_bitmap(cache_id, cache_idx, bitmap);
+	bitmap = pstcache_read_bitmap(cache_id, cache_idx, &size);
+	if (bitmap == NULL)
+		return False;
 
-	xfree(celldata);
+	cache_put_bitmap(cache_id, cache_idx, bitmap, size);
 	return True;
 }
 
@@ -83,90 +346,333 @@ RD_BOOL
 pstcache_save_bitmap(uint8 cache_id, uint16 cache_idx, uint8 * key,
 		     uint8 width, uint8 height, uint16 length, uint8 * data)
 {
-	int fd;
-	CELLHEADER cellhdr;
+	uint8 packed[MAX_CELL_SIZE * 4];
+	CELLHEADER *cell;
+	RD_BOOL found;
+	int slot, packed_length;
 
 	if (!IS_PERSISTENT(cache_id) || cache_idx >= BMPCACHE2_NUM_PSTCELLS)
 		return False;
 
-	memcpy(cellhdr.key, key, sizeof(HASH_KEY));
-	cellhdr.width = width;
-	cellhdr.height = height;
-	cellhdr.length = length;
-	cellhdr.stamp = 0;
+	if (length > CELL_SIZE)
+		return False;
+
+	packed_length = 0;
+	if (g_bitmap_cache_compress)
+		packed_length = bitmap_compress(packed, length, width, height, data,
+						g_pstcache_Bpp);
+
+	pstcache_lock(True);
+
+	slot = pstcache_find_slot(key, &found);
+	cell = POOL_CELL(slot);
+
+	/* another session may have stored the same bitmap already */
+	if (!found)
+	{
+		if (packed_length > 0)
+		{
+			data = packed;
+			length = packed_length;
+		}
+
+		/* the pages of the cell may have been given back */
+		if (!rd_reserve_file(g_pstcache_pool_fd, POOL_DATA(slot) - g_pstcache_pool,
+				     length))
+		{
+			pstcache_unlock();
+			return False;
+		}
+
+		memcpy(cell->key, key, sizeof(HASH_KEY));
+		cell->width = width;
+		cell->height = height;
+		cell->length = length;
+		cell->compressed = packed_length > 0;
+		cell->uses = 0;
+		memcpy(POOL_DATA(slot), data, length);
+
+		/* give back the disk space of a larger bitmap that was there */
+		rd_discard_file_pages(POOL_DATA(slot) + length, CELL_SIZE - length);
+
+		g_pstcache_saves++;
+		g_pstcache_bytes_written += sizeof(CELLHEADER) + length;
+	}
+	cell->stamp = g_pstcache_stamp_base;
+
+	pstcache_unlock();
 
-	fd = g_pstcache_fd[cache_id];
-	rd_lseek_file(fd, cache_idx * (g_pstcache_Bpp * MAX_CELL_SIZE + sizeof(CELLHEADER)));
-	rd_write_file(fd, &cellhdr, sizeof(CELLHEADER));
-	rd_write_file(fd, data, length);
+	g_pstcache_slot[cache_id][cache_idx] = slot;
+	memcpy(g_pstcache_keys[cache_id][cache_idx], key, sizeof(HASH_KEY));
 
 	return True;
 }
 
+/* Format the persistent cache file activity like cache_format_stats() */
+RD_BOOL
+pstcache_format_stats(char *buf, size_t size)
+{
+	snprintf(buf, size,
+		 "pstcache loads=%u saves=%u touches=%u bytes_read=%llu bytes_written=%llu",
+		 g_pstcache_loads, g_pstcache_saves, g_pstcache_touches,
+		 (unsigned long long) g_pstcache_bytes_read,
+		 (unsigned long long) g_pstcache_bytes_written);
+	return True;
+}
+
+static int
+pstcache_compare_stamps(const void *a, const void *b)
+{
+	const POOL_ENTRY *ea = a, *eb = b;
+
+	/* most recently used first */
+	if (ea->stamp != eb->stamp)
+		return ea->stamp > eb->stamp ? -1 : 1;
+	return ea->slot - eb->slot;
+}
+
+static int
+pstcache_compare_ranks(const void *a, const void *b)
+{
+	const POOL_ENTRY *ea = a, *eb = b;
+
+	if (ea->rank != eb->rank)
+		return ea->rank < eb->rank ? -1 : 1;
+	return pstcache_compare_stamps(a, b);
+}
+
+/* Weight of a cell used in the given number of sessions, which grows
+   with the number of bits of it so that a few busy sessions long ago
+   do not outweigh the last one */
+static uint32
+pstcache_use_weight(uint16 uses)
+{
+	uint32 weight = 1;
+
+	while (uses != 0)
+	{
+		weight++;
+		uses >>= 1;
+	}
+	return weight;
+}
+
+/* Wait for the read ahead thread, which uses the mapping and
+   the g_preload_* selection */
+static void
+pstcache_preload_wait(void)
+{
+	if (!g_preload_running)
+		return;
+
+	pthread_join(g_preload_thread, NULL);
+	g_preload_running = False;
+}
+
 /* List the bitmap keys from the persistent cache file */
 int
 pstcache_enumerate(uint8 id, HASH_KEY * keylist)
 {
-	int fd, n;
+	int slot, n, count, *previous;
 	uint16 idx;
-	sint16 mru_idx[0xa00];
-	uint32 mru_stamp[0xa00];
-	CELLHEADER cellhdr;
+	sint16 mru_idx[0xa00], old_idx[0xa00];
+	uint32 max_stamp;
+	POOL_ENTRY *entries;
+	CELLHEADER *cell;
 
 	if (!(g_bitmap_cache && g_bitmap_cache_persist_enable && IS_PERSISTENT(id)))
 		return 0;
 
-	/* The server disconnects if the bitmap cache content is sent more than once */
+	/* The server disconnects if the bitmap cache content is sent more
+	   than once on a connection */
 	if (g_pstcache_enumerated)
 		return 0;
 
 	logger(Core, Debug, "pstcache_enumerate(), start enumeration");
+
+	/* the cells the last read ahead went through are handed out anew,
+	   and its selection is replaced below */
+	pstcache_preload_wait();
+
+	entries = xmalloc(POOL_CELLS * sizeof(POOL_ENTRY));
+	previous = xmalloc(POOL_CELLS * sizeof(int));
+
+	pstcache_lock(True);
+
+	/* The cell index each pool cell had on the last connection, if
+	   this is a reconnect */
+	for (slot = 0; slot < POOL_CELLS; slot++)
+		previous[slot] = -1;
 	for (idx = 0; idx < BMPCACHE2_NUM_PSTCELLS; idx++)
 	{
-		fd = g_pstcache_fd[id];
-		rd_lseek_file(fd, idx * (g_pstcache_Bpp * MAX_CELL_SIZE + sizeof(CELLHEADER)));
-		if (rd_read_file(fd, &cellhdr, sizeof(CELLHEADER)) <= 0)
-			break;
+		slot = pstcache_slot(id, idx);
+		if (slot >= 0)
+			previous[slot] = idx;
+	}
 
-		if (memcmp(cellhdr.key, zero_key, sizeof(HASH_KEY)) != 0)
-		{
-			memcpy(keylist[idx], cellhdr.key, sizeof(HASH_KEY));
+	n = 0;
+	max_stamp = 0;
+	for (slot = 0; slot < POOL_CELLS; slot++)
+	{
+		cell = POOL_CELL(slot);
+		if (memcmp(cell->key, zero_key, sizeof(HASH_KEY)) == 0)
+			continue;
+
+		entries[n].stamp = cell->stamp;
+		entries[n].slot = slot;
+		max_stamp = MAX(max_stamp, cell->stamp);
+		n++;
+	}
 
-			/* Pre-cache (not possible for 8-bit colour depth cause it needs a colourmap) */
-			if (g_bitmap_cache_precache && cellhdr.stamp && g_server_depth > 8)
-				pstcache_load_bitmap(id, idx);
+	/* Rank the cells by how recently they were used, divided by the
+	   weight of how often. The best ones are offered, and the
+	   session's cell indices are handed out in that order. */
+	qsort(entries, n, sizeof(POOL_ENTRY), pstcache_compare_stamps);
+	for (idx = 0; idx < n; idx++)
+		entries[idx].rank =
+			idx / pstcache_use_weight(POOL_CELL(entries[idx].slot)->uses);
+	qsort(entries, n, sizeof(POOL_ENTRY), pstcache_compare_ranks);
+	count = MIN(n, BMPCACHE2_NUM_PSTCELLS);
+
+	for (idx = 0; idx < count; idx++)
+	{
+		cell = POOL_CELL(entries[idx].slot);
+		memcpy(keylist[idx], cell->key, sizeof(HASH_KEY));
+		memcpy(g_pstcache_keys[id][idx], cell->key, sizeof(HASH_KEY));
+		g_pstcache_slot[id][idx] = entries[idx].slot;
+		old_idx[idx] = previous[entries[idx].slot];
+		mru_idx[count - 1 - idx] = idx;
+
+		/* The server may use any of these from now on, so keep
+		   other sessions from replacing them */
+		cell->stamp = max_stamp + count - idx;
+	}
+	g_pstcache_stamp_base = max_stamp + count + 1;
+	for (idx = count; idx < BMPCACHE2_NUM_PSTCELLS; idx++)
+		g_pstcache_slot[id][idx] = -1;
 
-			/* Sort by stamp */
-			for (n = idx; n > 0 && cellhdr.stamp < mru_stamp[n - 1]; n--)
-			{
-				mru_idx[n] = mru_idx[n - 1];
-				mru_stamp[n] = mru_stamp[n - 1];
-			}
+	pstcache_unlock();
+	xfree(previous);
+	xfree(entries);
 
-			mru_idx[n] = idx;
-			mru_stamp[n] = cellhdr.stamp;
-		}
-		else
-		{
-			break;
-		}
+	logger(Core, Debug, "pstcache_enumerate(), %d cached bitmaps", count);
+
+	/* Bitmaps still in memory from the last connection are kept
+	   under their new index, so the server need not send them */
+	cache_renumber_bitmaps(id, old_idx, count);
+	cache_rebuild_bmpcache_linked_list(id, mru_idx, count);
+	g_pstcache_enumerated = True;
+
+	/* Pre-cache the best ranked cells, as many as fit in memory
+	   (not possible for 8-bit colour depth cause it needs a colourmap) */
+	g_preload_count = g_preload_read = g_preload_done = 0;
+	if (g_bitmap_cache_precache && g_server_depth > 8)
+	{
+		g_preload_id = id;
+		g_preload_count = MIN(count, BMPCACHE2_C2_CELLS);
+		for (idx = 0; idx < g_preload_count; idx++)
+			g_preload_slots[idx] = g_pstcache_slot[id][idx];
 	}
 
-	logger(Core, Debug, "pstcache_enumerate(), %d cached bitmaps", idx);
+	return count;
+}
 
-	cache_rebuild_bmpcache_linked_list(id, mru_idx, idx);
-	g_pstcache_enumerated = True;
-	return idx;
+static void *
+pstcache_preload_thread(void *arg)
+{
+	volatile uint8 sink;
+	uint8 *cell;
+	size_t offset, length;
+	int i;
+
+	UNUSED(arg);
+
+	for (i = 0; i < g_preload_count; i++)
+	{
+		/* touch every page of the cell data */
+		cell = POOL_DATA(g_preload_slots[i]);
+		length = POOL_CELL(g_preload_slots[i])->length;
+		for (offset = 0; offset < length; offset += 4096)
+			sink = cell[offset];
+
+		pthread_mutex_lock(&g_preload_lock);
+		g_preload_read = i + 1;
+		pthread_mutex_unlock(&g_preload_lock);
+	}
+
+	UNUSED(sink);
+	return NULL;
+}
+
+/* Start reading ahead the cells selected by pstcache_enumerate(), to
+   be called once the key list has been sent */
+void
+pstcache_preload_start(void)
+{
+	pstcache_preload_wait();
+	if (g_preload_count == 0)
+		return;
+
+	logger(Core, Debug, "pstcache_preload_start(), reading ahead %d cells",
+	       g_preload_count);
+
+	if (pthread_create(&g_preload_thread, NULL, pstcache_preload_thread, NULL) != 0)
+	{
+		/* everything is read as it is uploaded instead */
+		g_preload_read = g_preload_count;
+		return;
+	}
+	g_preload_running = True;
+}
+
+/* Create bitmaps for the next batch of cells that have been read
+   ahead. Cells the server has sent or referenced in the meantime are
+   left alone. */
+void
+pstcache_preload_step(void)
+{
+	RD_HBITMAP bitmap;
+	uint32 size;
+	uint16 idx;
+	int ready, n;
+
+	if (g_preload_done == g_preload_count)
+		return;
+
+	pthread_mutex_lock(&g_preload_lock);
+	ready = g_preload_read;
+	pthread_mutex_unlock(&g_preload_lock);
+
+	for (n = 0; n < PRELOAD_BATCH && g_preload_done < ready; n++)
+	{
+		idx = g_preload_done++;
+		if (!IS_PERSISTENT(g_preload_id) || cache_has_bitmap(g_preload_id, idx))
+			continue;
+
+		bitmap = pstcache_read_bitmap(g_preload_id, idx, &size);
+		if (bitmap != NULL && !cache_preload_bitmap(g_preload_id, idx, bitmap, size))
+			ui_destroy_bitmap(bitmap);
+	}
+}
+
+/* Choose the pool by the server connected to, which is kept when
+   redirected within a farm. Must be called before pstcache_init(). */
+void
+pstcache_set_server(const char *server)
+{
+	g_pstcache_server = utils_djb2_hash(server);
 }
 
 /* initialise the persistent bitmap cache */
 RD_BOOL
 pstcache_init(uint8 cache_id)
 {
-	int fd;
-	char filename[256];
+	int fd, idx;
+	char filename[256], shared[256];
 
-	if (g_pstcache_enumerated)
+	/* already set up by an earlier connection, which the cell
+	   indices are still kept from */
+	if (g_pstcache_fd[cache_id] > 0)
 		return True;
 
 	g_pstcache_fd[cache_id] = 0;
@@ -174,29 +680,87 @@ pstcache_init(uint8 cache_id)
 	if (!(g_bitmap_cache && g_bitmap_cache_persist_enable))
 		return False;
 
-	if (!rd_pstcache_mkdir())
+	if (g_pstcache_pool == NULL)
 	{
-		logger(Core, Error,
-		       "pstcache_init(), failed to get/make cache directory, disabling feature");
-		return False;
-	}
+		if (!rd_pstcache_mkdir())
+		{
+			logger(Core, Error,
+			       "pstcache_init(), failed to get/make cache directory, disabling feature");
+			return False;
+		}
 
-	g_pstcache_Bpp = (g_server_depth + 7) / 8;
-	sprintf(filename, "cache/pstcache_%d_%d", cache_id, g_pstcache_Bpp);
-	logger(Core, Debug, "pstcache_init(), bitmap cache file %s", filename);
+		g_pstcache_Bpp = (g_server_depth + 7) / 8;
+		sprintf(shared, POOL_FILE_SHARED, g_pstcache_Bpp);
+		sprintf(filename, POOL_FILE, g_pstcache_Bpp, g_pstcache_server);
 
-	fd = rd_open_file(filename);
-	if (fd == -1)
-		return False;
+		/* the first server used keeps the cells of the shared pool */
+		if (rd_claim_file(shared, filename))
+			logger(Core, Verbose, "pstcache_init(), moved %s to %s", shared,
+			       filename);
+
+		logger(Core, Debug, "pstcache_init(), bitmap cache file %s", filename);
+
+		fd = rd_open_file(filename);
+		if (fd == -1)
+			return False;
+
+		/* cells past the end of a short file read as unused */
+		g_pstcache_pool = rd_map_file(fd, POOL_SIZE);
+		if (g_pstcache_pool == NULL)
+		{
+			logger(Core, Error,
+			       "pstcache_init(), failed to map persistent cache file, disabling feature");
+			rd_close_file(fd);
+			return False;
+		}
+		g_pstcache_pool_fd = fd;
+	}
 
-	if (!rd_lock_file(fd, 0, 0))
+	if (g_pstcache_slot[cache_id] == NULL)
 	{
-		logger(Core, Error,
-		       "pstcache_init(), failed to lock persistent cache file, disabling feature");
-		rd_close_file(fd);
-		return False;
+		g_pstcache_slot[cache_id] = xmalloc(BMPCACHE2_NUM_PSTCELLS * sizeof(int));
+		g_pstcache_keys[cache_id] = xmalloc(BMPCACHE2_NUM_PSTCELLS * sizeof(HASH_KEY));
+		g_pstcache_drawn[cache_id] = xmalloc(BMPCACHE2_NUM_PSTCELLS);
 	}
+	for (idx = 0; idx < BMPCACHE2_NUM_PSTCELLS; idx++)
+		g_pstcache_slot[cache_id][idx] = -1;
+	memset(g_pstcache_drawn[cache_id], 0, BMPCACHE2_NUM_PSTCELLS);
 
-	g_pstcache_fd[cache_id] = fd;
+	g_pstcache_fd[cache_id] = g_pstcache_pool_fd;
 	return True;
 }
+
+/* A new connection is made, which has to be sent the key list again.
+   The stamps of the bitmaps used on the last one are written first,
+   so that they are offered first. */
+void
+pstcache_reset_state(void)
+{
+	if (!g_pstcache_enumerated)
+		return;
+
+	cache_save_state();
+	pstcache_count_uses();
+	g_pstcache_enumerated = False;
+}
+
+/* Have the changes to the mapped cache file written out and let go
+   of it, at exit */
+void
+pstcache_close(void)
+{
+	int id;
+
+	if (g_pstcache_pool == NULL)
+		return;
+
+	pstcache_preload_wait();
+	pstcache_count_uses();
+	rd_sync_file(g_pstcache_pool, POOL_SIZE);
+	rd_unmap_file(g_pstcache_pool, POOL_SIZE);
+	rd_close_file(g_pstcache_pool_fd);
+	g_pstcache_pool = NULL;
+	g_pstcache_pool_fd = -1;
+	for (id = 0; id < 8; id++)
+		g_pstcache_fd[id] = 0;
+}
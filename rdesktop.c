@@ -26,12 +26,15 @@
 #include <pwd.h>		/* getpwuid */
 #include <termios.h>		/* tcgetattr tcsetattr */
 #include <sys/stat.h>		/* stat */
+#include <sys/mman.h>		/* mmap munmap msync */
 #include <sys/time.h>		/* gettimeofday */
 #include <sys/times.h>		/* times */
+#include <sys/wait.h>		/* wait */
 #include <ctype.h>		/* toupper */
 #include <limits.h>
 #include <errno.h>
 #include <signal.h>
+#include <getopt.h>		/* getopt_long */
 
 #include "rdesktop.h"
 
@@ -54,6 +57,27 @@
 #define RECONNECT_TIMEOUT (3600+600)
 #define RDESKTOP_LICENSE_STORE "/.local/share/rdesktop/licenses"
 
+/* long options without a short equivalent */
+#define OPT_RECORD 256
+#define OPT_REPLAY 257
+#define OPT_MOTION_RATE 258
+#define OPT_BITMAP_CACHE_POLICY 259
+#define OPT_BITMAP_CACHE_COMPRESSION 260
+#define OPT_COMPRESSION_TYPE 261
+#define OPT_FRAME_PACING 262
+#define OPT_SOUND_RESAMPLER 263
+#define OPT_MICROPHONE 264
+#define OPT_GFX 265
+#define OPT_RFX 266
+#define OPT_NSC 267
+#define OPT_CONNECT_DELAY 268
+#define OPT_MULTIMON 269
+#define OPT_SCALE 270
+#define OPT_SESSION_HOST 271
+#define OPT_CACHE_BUDGET 272
+#define OPT_INPUT_SCRIPT 273
+#define OPT_SESSIONS 274
+
 uint8 g_static_rdesktop_salt_16[16] = {
 	0xb8, 0x82, 0x29, 0x31, 0xc5, 0x39, 0xd9, 0x44,
 	0x54, 0x15, 0x5e, 0x14, 0x71, 0x38, 0xd5, 0x4d
@@ -86,13 +110,22 @@ int g_pos = 0;			/* 0 position unspecified,
 				   2 xpos neg,
 				   4 ypos neg  */
 extern int g_tcp_port_rdp;
+extern int g_tcp_connect_delay;
 int g_server_depth = -1;
 int g_win_button_size = 0;	/* If zero, disable single app mode */
 RD_BOOL g_network_error = False;
 RD_BOOL g_sendmotion = True;
+uint32 g_motion_interval = 0;	/* ms between pointer updates, 0 for no limit */
 RD_BOOL g_bitmap_cache = True;
 RD_BOOL g_bitmap_cache_persist_enable = False;
 RD_BOOL g_bitmap_cache_precache = True;
+RD_BOOL g_bitmap_cache_compress = False;
+uint32 g_cache_budget = 0;	/* bytes of bitmap cache memory, 0 for no limit */
+RD_BOOL g_frame_pacing = False;
+RD_BOOL g_gfx = False;
+RD_BOOL g_rfx = False;
+RD_BOOL g_nsc = False;
+RD_BOOL g_autodetect = False;
 RD_BOOL g_use_ctrl = True;
 RD_BOOL g_encryption = True;
 RD_BOOL g_encryption_initial = True;
@@ -100,6 +133,11 @@ RD_BOOL g_packet_encryption = True;
 RD_BOOL g_desktop_save = True;	/* desktop save order */
 RD_BOOL g_polygon_ellipse_orders = True;	/* polygon / ellipse orders */
 RD_BOOL g_fullscreen = False;
+RD_BOOL g_multimon = False;
+int g_scale = 100;		/* percent the window shows the session enlarged by */
+static RD_BOOL g_host_session = False;	/* started by a --session-host process */
+RD_MONITOR g_monitors[RDP_MAX_MONITORS];	/* of a fullscreen session with g_multimon */
+int g_num_monitors = 0;
 RD_BOOL g_grab_keyboard = True;
 RD_BOOL g_local_cursor = False;
 RD_BOOL g_hide_decorations = False;
@@ -108,6 +146,7 @@ RD_BOOL g_rdpclip = True;
 RD_BOOL g_console_session = False;
 RD_BOOL g_numlock_sync = False;
 RD_BOOL g_lspci_enabled = False;
+RD_BOOL g_tsmf = False;
 RD_BOOL g_owncolmap = False;
 RD_BOOL g_ownbackstore = True;	/* We can't rely on external BackingStore */
 RD_BOOL g_seamless_rdp = False;
@@ -117,6 +156,7 @@ char g_seamless_spawn_cmd[512];
 char g_tls_version[4];
 RD_BOOL g_seamless_persistent_mode = True;
 RD_BOOL g_user_quit = False;
+char *g_input_script = NULL;
 uint32 g_embed_wnd;
 uint32 g_rdp5_performanceflags = (PERF_DISABLE_FULLWINDOWDRAG |
 				  PERF_DISABLE_MENUANIMATIONS | PERF_ENABLE_FONT_SMOOTHING);
@@ -147,6 +187,8 @@ struct timeval g_pending_resize_defer_timer = { 0 };
 
 #ifdef WITH_RDPSND
 RD_BOOL g_rdpsnd = False;
+RD_BOOL g_audio_capture = False;
+unsigned int g_audio_capture_frame = 20;	/* ms of sound per packet sent */
 #endif
 
 char g_codepage[16] = "";
@@ -170,6 +212,7 @@ usage(char *program)
 	fprintf(stderr, "See http://www.rdesktop.org/ for more information.\n\n");
 
 	fprintf(stderr, "Usage: %s [options] server[:port]\n", program);
+	fprintf(stderr, "       %s [options] --replay FILE\n", program);
 	fprintf(stderr, "   -u: user name\n");
 	fprintf(stderr, "   -d: domain\n");
 	fprintf(stderr, "   -s: shell / seamless application to start remotely\n");
@@ -201,7 +244,7 @@ usage(char *program)
 	fprintf(stderr, "   -X: embed into another window with a given id.\n");
 	fprintf(stderr, "   -a: connection colour depth\n");
 	fprintf(stderr, "   -z: enable rdp compression\n");
-	fprintf(stderr, "   -x: RDP5 experience (m[odem 28.8], b[roadband], l[an] or hex nr.)\n");
+	fprintf(stderr, "   -x: RDP5 experience (m[odem 28.8], b[roadband], l[an], auto or hex nr.)\n");
 	fprintf(stderr, "   -P: use persistent bitmap caching\n");
 	fprintf(stderr, "   -r: enable specified device redirection (this flag can be repeated)\n");
 	fprintf(stderr,
@@ -224,6 +267,10 @@ usage(char *program)
 	fprintf(stderr, "                     remote would leave sound on server\n");
 	fprintf(stderr, "                     available drivers for 'local':\n");
 	rdpsnd_show_help();
+#endif
+#ifdef WITH_TSMF
+	fprintf(stderr,
+		"         '-r multimedia': play video and audio of media players locally\n");
 #endif
 	fprintf(stderr,
 		"         '-r clipboard:[off|PRIMARYCLIPBOARD|CLIPBOARD]': enable clipboard\n");
@@ -250,8 +297,10 @@ usage(char *program)
 	fprintf(stderr, "   -0: attach to console\n");
 	fprintf(stderr, "   -4: use RDP version 4\n");
 	fprintf(stderr, "   -5: use RDP version 5 (default)\n");
-#ifdef WITH_SCARD
 	fprintf(stderr, "   -o: name=value: Adds an additional option to rdesktop.\n");
+	fprintf(stderr,
+		"           tcp                Socket options: interactive, bulk or default\n");
+#ifdef WITH_SCARD
 	fprintf(stderr,
 		"           sc-csp-name        Specifies the Crypto Service Provider name which\n");
 	fprintf(stderr,
@@ -263,6 +312,33 @@ usage(char *program)
 		"           sc-card-name       Specifies the card name of the smartcard to use\n");
 #endif
 	fprintf(stderr, "   -v: enable verbose logging\n");
+	fprintf(stderr,
+		"   --bitmap-cache-policy lru|clock: persistent bitmap cache eviction policy\n");
+	fprintf(stderr, "   --bitmap-cache-compression: compress the persistent bitmap cache\n");
+	fprintf(stderr, "   --cache-budget MB: memory the bitmap caches may use at most\n");
+	fprintf(stderr, "   --compression-type 8k|64k|rdp61: rdp compression to use, implies -z\n");
+	fprintf(stderr,
+		"   --connect-delay MS: wait MS ms before trying the next server address (250)\n");
+	fprintf(stderr, "   --frame-pacing: update the screen at most once per display refresh\n");
+	fprintf(stderr, "   --gfx: use the graphics pipeline, implies -a 32\n");
+	fprintf(stderr, "   --input-script FILE: play the input of FILE (rdesktop-headless)\n");
+	fprintf(stderr, "   --motion-rate N: send at most N pointer updates per second\n");
+	fprintf(stderr, "   --multimon: lay a fullscreen session out on all monitors\n");
+	fprintf(stderr, "   --nsc: decode NSCodec surface bits, implies -a 32\n");
+	fprintf(stderr, "   --record FILE: capture the packets received from the server to FILE\n");
+	fprintf(stderr, "   --replay FILE: replay a capture, without connecting to a server\n");
+	fprintf(stderr, "   --rfx: decode RemoteFX surface bits, implies -a 32\n");
+	fprintf(stderr, "   --scale PERCENT: show the session enlarged by PERCENT (100-400)\n");
+	fprintf(stderr,
+		"   --session-host: without a server, host sessions; with one, open it in the host\n");
+	fprintf(stderr,
+		"   --sessions N[:MS]: run N sessions, logging on one every MS ms (1000)\n");
+#ifdef WITH_RDPSND
+	fprintf(stderr,
+		"   --sound-resampler fast|polyphase|libsamplerate: sound sample rate converter\n");
+	fprintf(stderr,
+		"   --microphone[=MS]: send sound captured locally, in packets of MS ms (20)\n");
+#endif
 
 	fprintf(stderr, "\n");
 
@@ -497,12 +573,19 @@ rdesktop_reset_state(void)
 	g_pending_resize_defer = True;
 
 	rdp_reset_state();
+	pstcache_reset_state();
+	channel_reset_state();
+	autodetect_reset_state();
+	dvc_reset_state();
 #ifdef WITH_SCARD
 	scard_reset_state();
 #endif
 #ifdef WITH_RDPSND
 	rdpsnd_reset_state();
 #endif
+#ifdef WITH_TSMF
+	tsmf_reset_state();
+#endif
 }
 
 static RD_BOOL
@@ -747,6 +830,8 @@ setup_user_requested_session_size()
 	{
 		case Fullscreen:
 			ui_get_screen_size(&g_requested_session_width, &g_requested_session_height);
+			if (g_multimon)
+				g_num_monitors = ui_get_monitors(g_monitors, RDP_MAX_MONITORS);
 			break;
 
 		case Workarea:
@@ -766,6 +851,104 @@ setup_user_requested_session_size()
 	}
 }
 
+/* Run the session from a capture instead of a server, and report the
+   time it took to process it */
+static int
+replay_session(const char *filename)
+{
+	RD_BOOL deactivated = False;
+	uint32 ext_disc_reason = ERRINFO_UNSET;
+
+	if (!replay_open(filename))
+		return EX_NOINPUT;
+
+	rdesktop_reset_state();
+	g_encryption_initial = g_encryption = False;
+
+	rd_create_ui();
+	rdp_main_loop(&deactivated, &ext_disc_reason);
+	replay_close();
+	cache_report_stats();
+	orders_report_stats();
+	ui_report_frame_stats();
+	s_report_stats();
+
+	ui_seamless_end();
+	ui_destroy_window();
+	ui_deinit();
+
+	return EX_OK;
+}
+
+/* Put the number of the session in place of a %d in the user name */
+static void
+session_username(int n)
+{
+	char *p, *username;
+	size_t len;
+
+	p = strstr(g_username, "%d");
+	if (p == NULL)
+		return;
+
+	len = strlen(g_username) + 16;
+	username = (char *) xmalloc(len);
+	snprintf(username, len, "%.*s%d%s", (int) (p - g_username), g_username, n, p + 2);
+	xfree(g_username);
+	g_username = username;
+}
+
+/* Run count sessions of this client, logging on one every stagger ms,
+   to load test a server. Each session is a process of its own, as all
+   of the session state is global. Returns in the sessions, the
+   launcher exits once they have all ended. */
+static void
+launch_sessions(int count, int stagger)
+{
+	struct timespec ts;
+	int i, status, started = 0, failed = 0;
+	pid_t pid;
+
+	ts.tv_sec = stagger / 1000;
+	ts.tv_nsec = (stagger % 1000) * 1000000;
+
+	for (i = 1; i <= count; i++)
+	{
+		if (i > 1)
+			nanosleep(&ts, NULL);
+
+		pid = fork();
+		if (pid == 0)
+		{
+			session_username(i);
+			return;
+		}
+		if (pid < 0)
+		{
+			logger(Core, Error, "launch_sessions(), fork() failed: %s", strerror(errno));
+			break;
+		}
+		logger(Core, Verbose, "Started session %d of %d as %d", i, count, (int) pid);
+		started++;
+	}
+
+	while ((pid = wait(&status)) > 0 || (pid < 0 && errno == EINTR))
+	{
+		if (pid < 0)
+			continue;
+		/* ended by the script or by logging off is as planned */
+		if (!WIFEXITED(status) || (WEXITSTATUS(status) != EX_OK &&
+					   WEXITSTATUS(status) != EXRD_WINDOW_CLOSED &&
+					   WEXITSTATUS(status) != EXRD_LOGOFF_BY_USER))
+			failed++;
+	}
+
+	logger(Core, Notice, "%d of %d sessions started, %d ended with an error", started, count,
+	       failed);
+	exit(started < count || failed ? EX_SOFTWARE : EX_OK);
+}
+
+static int session_host_run(int *argc, char ***argv, char *locale);
 
 /* Client program */
 int
@@ -784,11 +967,38 @@ main(int argc, char *argv[])
 	char *locale = NULL;
 	int username_option = 0;
 	RD_BOOL geometry_option = False;
+	RD_BOOL session_host = False;
+	char *record_file = NULL;
+	char *replay_file = NULL;
+	int sessions = 1, session_stagger = 1000;
+	static const struct option long_options[] = {
+		{"record", required_argument, NULL, OPT_RECORD},
+		{"replay", required_argument, NULL, OPT_REPLAY},
+		{"motion-rate", required_argument, NULL, OPT_MOTION_RATE},
+		{"bitmap-cache-policy", required_argument, NULL, OPT_BITMAP_CACHE_POLICY},
+		{"bitmap-cache-compression", no_argument, NULL, OPT_BITMAP_CACHE_COMPRESSION},
+		{"cache-budget", required_argument, NULL, OPT_CACHE_BUDGET},
+		{"compression-type", required_argument, NULL, OPT_COMPRESSION_TYPE},
+		{"connect-delay", required_argument, NULL, OPT_CONNECT_DELAY},
+		{"frame-pacing", no_argument, NULL, OPT_FRAME_PACING},
+		{"gfx", no_argument, NULL, OPT_GFX},
+		{"input-script", required_argument, NULL, OPT_INPUT_SCRIPT},
+		{"rfx", no_argument, NULL, OPT_RFX},
+		{"nsc", no_argument, NULL, OPT_NSC},
+		{"multimon", no_argument, NULL, OPT_MULTIMON},
+		{"scale", required_argument, NULL, OPT_SCALE},
+		{"session-host", no_argument, NULL, OPT_SESSION_HOST},
+		{"sessions", required_argument, NULL, OPT_SESSIONS},
+		{"sound-resampler", required_argument, NULL, OPT_SOUND_RESAMPLER},
+		{"microphone", optional_argument, NULL, OPT_MICROPHONE},
+		{NULL, 0, NULL, 0}
+	};
 #ifdef WITH_RDPSND
 	char *rdpsnd_optarg = NULL;
 #endif
 
 	/* setup debug logging from environment */
+	logger_init();
 	logger_set_subjects(getenv("RDESKTOP_DEBUG"));
 
 #ifdef HAVE_LOCALE_H
@@ -808,6 +1018,9 @@ main(int argc, char *argv[])
 	sigemptyset(&act.sa_mask);
 	act.sa_flags = 0;
 	sigaction(SIGPIPE, &act, NULL);
+#ifdef WITH_TRACE
+	trace_init();
+#endif
 
 	/* setup default flags for TS_INFO_PACKET */
 	flags = RDP_INFO_MOUSE | RDP_INFO_DISABLECTRLALTDEL
@@ -819,11 +1032,135 @@ main(int argc, char *argv[])
 
 	g_num_devices = 0;
 
-	while ((c = getopt(argc, argv,
-			   "A:V:u:L:d:s:c:p:n:k:g:o:fbBeEitmMzCDKS:T:NX:a:x:Pr:045vh?")) != -1)
+	while ((c = getopt_long(argc, argv,
+				"A:V:u:L:d:s:c:p:n:k:g:o:fbBeEitmMzCDKS:T:NX:a:x:Pr:045vh?",
+				long_options, NULL)) != -1)
 	{
 		switch (c)
 		{
+			case OPT_RECORD:
+				record_file = optarg;
+				break;
+
+			case OPT_REPLAY:
+				replay_file = optarg;
+				break;
+
+			case OPT_MOTION_RATE:
+				if (strtol(optarg, NULL, 10) > 0)
+					g_motion_interval = 1000 / strtol(optarg, NULL, 10);
+				else
+					g_motion_interval = 0;
+				break;
+
+			case OPT_MULTIMON:
+				g_multimon = True;
+				break;
+
+			case OPT_SCALE:
+				g_scale = strtol(optarg, NULL, 10);
+				if (g_scale < 100 || g_scale > 400)
+				{
+					logger(Core, Error, "Invalid scale '%s', must be 100 to 400",
+					       optarg);
+					return EX_USAGE;
+				}
+				break;
+
+			case OPT_SESSION_HOST:
+				session_host = !g_host_session;
+				break;
+
+			case OPT_SESSIONS:
+				sessions = strtol(optarg, &p, 10);
+				if (*p == ':')
+					session_stagger = strtol(p + 1, NULL, 10);
+				if (sessions < 1 || session_stagger < 0)
+				{
+					logger(Core, Error, "Invalid number of sessions '%s'", optarg);
+					return EX_USAGE;
+				}
+				break;
+
+			case OPT_INPUT_SCRIPT:
+				g_input_script = optarg;
+				break;
+
+			case OPT_BITMAP_CACHE_POLICY:
+				if (!cache_set_bitmap_policy(optarg))
+				{
+					logger(Core, Error, "Unknown bitmap cache policy '%s'",
+					       optarg);
+					return EX_USAGE;
+				}
+				break;
+
+			case OPT_BITMAP_CACHE_COMPRESSION:
+				g_bitmap_cache_compress = True;
+				break;
+
+			case OPT_CACHE_BUDGET:
+				g_cache_budget =
+					(uint32) MIN(MAX(strtol(optarg, NULL, 10), 0), 4095) * 1024 * 1024;
+				break;
+
+			case OPT_COMPRESSION_TYPE:
+				flags &= ~RDP_INFO_COMPRESSION_TYPE_MASK;
+				if (str_startswith(optarg, "8k"))
+					flags |= RDP_INFO_COMPRESSION;
+				else if (str_startswith(optarg, "64k"))
+					flags |= RDP_INFO_COMPRESSION | RDP_INFO_COMPRESSION2;
+				else if (str_startswith(optarg, "rdp61"))
+					flags |= RDP_INFO_COMPRESSION | (RDP_COMPR_TYPE_RDP61 << 9);
+				else
+				{
+					logger(Core, Error, "Unknown compression type '%s'", optarg);
+					return EX_USAGE;
+				}
+				break;
+
+			case OPT_CONNECT_DELAY:
+				g_tcp_connect_delay = MAX(strtol(optarg, NULL, 10), 10);
+				break;
+
+			case OPT_FRAME_PACING:
+				g_frame_pacing = True;
+				break;
+
+			case OPT_GFX:
+				g_gfx = True;
+				break;
+
+			case OPT_RFX:
+				g_rfx = True;
+				break;
+
+			case OPT_NSC:
+				g_nsc = True;
+				break;
+
+			case OPT_SOUND_RESAMPLER:
+#ifdef WITH_RDPSND
+				if (!rdpsnd_dsp_resampler_select(optarg))
+				{
+					logger(Core, Error, "Unknown sound resampler '%s'", optarg);
+					return EX_USAGE;
+				}
+#else
+				logger(Core, Warning, "Not compiled with sound support");
+#endif
+				break;
+
+			case OPT_MICROPHONE:
+#ifdef WITH_RDPSND
+				g_audio_capture = True;
+				if (optarg != NULL && strtol(optarg, NULL, 10) > 0)
+					g_audio_capture_frame = strtol(optarg, NULL, 10);
+#else
+				logger(Core, Warning, "Not compiled with sound support");
+#endif
+				break;
+
 			case 'A':
 				g_seamless_rdp = True;
 				STRNCPY(g_seamless_shell, optarg, sizeof(g_seamless_shell));
@@ -980,11 +1317,20 @@ main(int argc, char *argv[])
 
 			case 'z':
 				logger(Core, Debug, "rdp compression enabled");
-				flags |= (RDP_INFO_COMPRESSION | RDP_INFO_COMPRESSION2);
+				/* unless --compression-type asked for another one */
+				if (!(flags & RDP_INFO_COMPRESSION))
+					flags |= (RDP_INFO_COMPRESSION | RDP_INFO_COMPRESSION2);
 				break;
 
 			case 'x':
-				if (str_startswith(optarg, "m"))	/* modem */
+				if (strcmp(optarg, "auto") == 0)
+				{
+					/* until the link has been measured */
+					g_rdp5_performanceflags = (PERF_DISABLE_WALLPAPER |
+								   PERF_ENABLE_FONT_SMOOTHING);
+					g_autodetect = True;
+				}
+				else if (str_startswith(optarg, "m"))	/* modem */
 				{
 					g_rdp5_performanceflags = (PERF_DISABLE_CURSOR_SHADOW |
 								   PERF_DISABLE_WALLPAPER |
@@ -1072,6 +1418,15 @@ main(int argc, char *argv[])
 				{
 					g_lspci_enabled = True;
 				}
+				else if (str_startswith(optarg, "multimedia"))
+				{
+#ifdef WITH_TSMF
+					g_tsmf = True;
+#else
+					logger(Core, Warning,
+					       "Not compiled with multimedia redirection support");
+#endif
+				}
 				else if (str_startswith(optarg, "lptport"))
 				{
 					parallel_enum_devices(&g_num_devices, optarg + 7);
@@ -1129,7 +1484,6 @@ main(int argc, char *argv[])
 			case '5':
 				g_rdp_version = RDP_V5;
 				break;
-#if WITH_SCARD
 			case 'o':
 				{
 					char *p = strchr(optarg, '=');
@@ -1141,8 +1495,19 @@ main(int argc, char *argv[])
 						continue;
 					}
 
-					if (strncmp(optarg, "sc-csp-name", strlen("sc-scp-name")) ==
-					    0)
+					if (strncmp(optarg, "tcp=", 4) == 0)
+					{
+						if (!tcp_set_profile(p + 1))
+						{
+							logger(Core, Error,
+							       "Invalid TCP profile '%s', expected interactive, bulk or default",
+							       p + 1);
+							return EX_USAGE;
+						}
+					}
+#ifdef WITH_SCARD
+					else if (strncmp(optarg, "sc-csp-name", strlen("sc-scp-name")) ==
+						 0)
 						g_sc_csp_name = strdup(p + 1);
 					else if (strncmp
 						 (optarg, "sc-reader-name",
@@ -1156,10 +1521,12 @@ main(int argc, char *argv[])
 						 (optarg, "sc-container-name",
 						  strlen("sc-container-name")) == 0)
 						g_sc_container_name = strdup(p + 1);
-
+#endif
+					else
+						logger(Core, Warning, "Skipping unknown option '%s'",
+						       optarg);
 				}
 				break;
-#endif
 			case 'v':
 				logger_set_verbose(1);
 				break;
@@ -1171,7 +1538,28 @@ main(int argc, char *argv[])
 		}
 	}
 
-	if (argc - optind != 1)
+	if (session_host && !replay_file)
+	{
+		if (argc == optind)
+			return session_host_run(&argc, &argv, locale);
+		if (argc - optind == 1)
+		{
+			switch (ctrl_host_open_session(argc, argv))
+			{
+				case 0:
+					return EX_OK;
+				case -1:
+					logger(Core, Notice,
+					       "No session host is running, starting the session here");
+					break;
+				default:
+					logger(Core, Error, "The session host failed to start the session");
+					return EX_SOFTWARE;
+			}
+		}
+	}
+
+	if (argc - optind != (replay_file ? 0 : 1) || (replay_file && record_file))
 	{
 		usage(argv[0]);
 		return EX_USAGE;
@@ -1183,8 +1571,16 @@ main(int argc, char *argv[])
 		g_rdp5_performanceflags |= PERF_DISABLE_CURSOR_SHADOW;
 	}
 
-	STRNCPY(server, argv[optind], sizeof(server));
-	parse_server_and_port(server);
+	if (replay_file)
+	{
+		STRNCPY(server, replay_file, sizeof(server));
+	}
+	else
+	{
+		STRNCPY(server, argv[optind], sizeof(server));
+		parse_server_and_port(server);
+	}
+	pstcache_set_server(server);
 
 	if (g_seamless_rdp)
 	{
@@ -1299,22 +1695,65 @@ main(int argc, char *argv[])
 		}
 	}
 
+	if (sessions > 1)
+	{
+		if (replay_file || record_file || session_host)
+		{
+			logger(Core, Error,
+			       "--sessions can't be used with --record, --replay or --session-host");
+			return EX_USAGE;
+		}
+		launch_sessions(sessions, session_stagger);
+	}
+
+	/* the graphics pipeline draws 32 bpp surfaces */
+	if (g_gfx && g_server_depth == -1)
+		g_server_depth = 32;
+	else if (g_gfx && g_server_depth != 32)
+	{
+		logger(Core, Warning, "The graphics pipeline needs -a 32, not using it");
+		g_gfx = False;
+	}
+
+	/* RemoteFX tiles are decoded to 32 bpp */
+	if (g_rfx && g_server_depth == -1)
+		g_server_depth = 32;
+	else if (g_rfx && g_server_depth != 32)
+	{
+		logger(Core, Warning, "RemoteFX needs -a 32, not using it");
+		g_rfx = False;
+	}
+
+	if (g_nsc && g_server_depth == -1)
+		g_server_depth = 32;
+	else if (g_nsc && g_server_depth != 32)
+	{
+		logger(Core, Warning, "NSCodec needs -a 32, not using it");
+		g_nsc = False;
+	}
+
 	if (g_title[0] == 0)
 	{
 		strcpy(g_title, "rdesktop - ");
 		strncat(g_title, server, sizeof(g_title) - sizeof("rdesktop - "));
 	}
 
-	/* Only startup ctrl functionality is seamless are used for now. */
-	if (g_use_ctrl && g_seamless_rdp)
+	/* The master serves cache statistics in any session, slaves are
+	   only of use to spawn seamless applications */
+	if (g_use_ctrl)
 	{
+		/* the session works without, only the statistics and
+		   spawning into it are lost */
 		if (ctrl_init(server, domain, g_username) < 0)
 		{
-			logger(Core, Error, "Failed to initialize ctrl mode");
-			exit(1);
+			logger(Core, Warning, "Failed to initialize ctrl mode, continuing without it");
 		}
-
-		if (ctrl_is_slave())
+		else if (ctrl_is_slave() && !g_seamless_rdp)
+		{
+			logger(Core, Debug,
+			       "Another rdesktop process owns the ctrl socket, continuing without it");
+		}
+		else if (ctrl_is_slave())
 		{
 			logger(Core, Notice,
 			       "rdesktop in slave mode sending command to master process");
@@ -1330,6 +1769,15 @@ main(int argc, char *argv[])
 	if (!ui_init())
 		return EX_OSERR;
 
+	if (replay_file)
+	{
+		setup_user_requested_session_size();
+		return replay_session(replay_file);
+	}
+
+	if (record_file && !replay_record_open(record_file))
+		return EX_CANTCREAT;
+
 #ifdef WITH_RDPSND
 	if (!rdpsnd_init(rdpsnd_optarg))
 		logger(Core, Warning, "Initializing sound-support failed");
@@ -1342,6 +1790,16 @@ main(int argc, char *argv[])
 
 	dvc_init();
 	rdpedisp_init();
+	if (g_gfx)
+		rdpegfx_init();
+#ifdef WITH_RDPSND
+	if (g_audio_capture)
+		rdpeai_init();
+#endif
+#ifdef WITH_TSMF
+	if (g_tsmf)
+		tsmf_init();
+#endif
 
 	setup_user_requested_session_size();
 
@@ -1477,8 +1935,9 @@ main(int argc, char *argv[])
 				g_pending_resize = False;
 				g_reconnect_loop = True;
 
+				/* The window and backstore are kept, and resized
+				   once the new session size is known */
 				ui_seamless_end();
-				ui_destroy_window();
 			}
 			else
 			{
@@ -1491,7 +1950,13 @@ main(int argc, char *argv[])
 	ui_seamless_end();
 	ui_destroy_window();
 
+	replay_record_close();
 	cache_save_state();
+	pstcache_close();
+	cache_report_stats();
+	orders_report_stats();
+	ui_report_frame_stats();
+	s_report_stats();
 	ui_deinit();
 
 	if (g_user_quit)
@@ -1505,6 +1970,38 @@ main(int argc, char *argv[])
 	xfree(g_username);
 }
 
+/* Run as the session host: load what sessions share and need no
+   display for, then wait for sessions to start. The host itself only
+   returns on failure, or in the child that runs a session, which then
+   parses the options of its own on top of those of the host. */
+static int
+session_host_run(int *argc, char ***argv, char *locale)
+{
+	switch (ctrl_host_init())
+	{
+		case 0:
+			break;
+		case 1:
+			logger(Core, Error, "A session host is already running");
+			return EX_UNAVAILABLE;
+		default:
+			logger(Core, Error, "Failed to initialize the session host socket");
+			return EX_OSERR;
+	}
+
+	if (g_keymapname[0] == 0 && !(locale && xkeymap_from_locale(locale)))
+		STRNCPY(g_keymapname, "en-us", sizeof(g_keymapname));
+	xkeymap_load();
+	tcp_tls_preload();
+
+	if (ctrl_host_serve(argc, argv) < 0)
+		return EX_OSERR;
+
+	g_host_session = True;
+	optind = 0;
+	return main(*argc, *argv);
+}
+
 #ifdef EGD_SOCKET
 /* Read 32 random bytes from PRNGD or EGD socket (based on OpenSSL RAND_egd) */
 static RD_BOOL
@@ -2122,6 +2619,27 @@ rd_open_file(char *filename)
 	return fd;
 }
 
+/* rename a file in the .rdesktop directory, unless there already is
+   one by the new name */
+RD_BOOL
+rd_claim_file(char *from, char *to)
+{
+	char *home;
+	char oldfn[256], newfn[256];
+
+	home = getenv("HOME");
+	if (home == NULL)
+		return False;
+	snprintf(oldfn, sizeof(oldfn), "%s/.rdesktop/%s", home, from);
+	snprintf(newfn, sizeof(newfn), "%s/.rdesktop/%s", home, to);
+
+	/* link() does not replace an existing file */
+	if (link(oldfn, newfn) == -1)
+		return False;
+	unlink(oldfn);
+	return True;
+}
+
 /* close file */
 void
 rd_close_file(int fd)
@@ -2164,3 +2682,120 @@ rd_lock_file(int fd, int start, int len)
 		return False;
 	return True;
 }
+
+/* wait for a read or write lock on a part of a file */
+void
+rd_lock_file_wait(int fd, int start, int len, RD_BOOL write)
+{
+	struct flock lock;
+
+	lock.l_type = write ? F_WRLCK : F_RDLCK;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = start;
+	lock.l_len = len;
+	while (fcntl(fd, F_SETLKW, &lock) == -1 && errno == EINTR);
+}
+
+void
+rd_unlock_file(int fd, int start, int len)
+{
+	struct flock lock;
+
+	lock.l_type = F_UNLCK;
+	lock.l_whence = SEEK_SET;
+	lock.l_start = start;
+	lock.l_len = len;
+	fcntl(fd, F_SETLK, &lock);
+}
+
+/* give back the disk space behind a part of a shared file mapping,
+   the whole pages in it read as zeros afterwards */
+void
+rd_discard_file_pages(void *ptr, size_t len)
+{
+#ifdef MADV_REMOVE
+	size_t page, head;
+	uint8 *start;
+
+	page = sysconf(_SC_PAGESIZE);
+	head = (page - (size_t) ptr % page) % page;
+	if (len <= head)
+		return;
+
+	start = (uint8 *) ptr + head;
+	len = (len - head) / page * page;
+	if (len > 0)
+		madvise(start, len, MADV_REMOVE);
+#else
+	UNUSED(ptr);
+	UNUSED(len);
+#endif
+}
+
+/* reserve the disk blocks of a part of a file, growing it if need
+   be, so that storing to a shared mapping of it cannot raise SIGBUS
+   on a full disk. Returns False if there is no room. */
+RD_BOOL
+rd_reserve_file(int fd, uint64 offset, size_t len)
+{
+#ifdef HAVE_POSIX_FALLOCATE
+	int err;
+
+	err = posix_fallocate(fd, offset, len);
+	if (err != 0)
+	{
+		logger(Core, Warning, "rd_reserve_file(), posix_fallocate() failed: %s",
+		       strerror(err));
+		return False;
+	}
+#else
+	UNUSED(fd);
+	UNUSED(offset);
+	UNUSED(len);
+#endif
+	return True;
+}
+
+/* map the first len bytes of a file read/write, growing the file
+   to len bytes, reserved on disk, if it is shorter. Returns NULL on
+   failure. */
+void *
+rd_map_file(int fd, size_t len)
+{
+	struct stat st;
+	void *p;
+
+	if (fstat(fd, &st) == -1)
+		return NULL;
+
+	if ((size_t) st.st_size < len && !rd_reserve_file(fd, 0, len))
+		return NULL;
+
+	if ((size_t) st.st_size < len && ftruncate(fd, len) == -1)
+	{
+		logger(Core, Error, "rd_map_file(), ftruncate() failed: %s", strerror(errno));
+		return NULL;
+	}
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+	{
+		logger(Core, Error, "rd_map_file(), mmap() failed: %s", strerror(errno));
+		return NULL;
+	}
+
+	return p;
+}
+
+/* schedule the changes to a mapped file to be written out */
+void
+rd_sync_file(void *ptr, size_t len)
+{
+	msync(ptr, len, MS_ASYNC);
+}
+
+void
+rd_unmap_file(void *ptr, size_t len)
+{
+	munmap(ptr, len);
+}
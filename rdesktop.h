@@ -189,4 +189,5 @@
 #include "stream.h"
 #include "constants.h"
 #include "types.h"
+#include "trace.h"
 #include "proto.h"
@@ -27,6 +27,7 @@
 #ifndef _WIN32
 #include <errno.h>
 #include <unistd.h>
+#include <sys/time.h>
 #endif
 #include "rdesktop.h"
 #include "ssl.h"
@@ -62,9 +63,11 @@ RD_BOOL g_exit_mainloop = False;
 size_t g_next_packet;
 uint32 g_rdp_shareid;
 
-extern RDPCOMP g_mppc_dict;
-
 extern uint32 vc_chunk_size;
+extern RD_BOOL g_vc_compress;
+
+/* Whether the client info PDU asked for compression */
+static RD_BOOL g_rdp_compression = False;
 
 /* Session Directory support */
 extern RD_BOOL g_redirect;
@@ -91,6 +94,9 @@ extern uint8 g_client_random[SEC_RANDOM_SIZE];
 static uint32 g_packetno;
 
 extern RD_BOOL g_fullscreen;
+extern RD_BOOL g_rfx;
+extern RD_BOOL g_nsc;
+extern uint32 g_fp_max_request_size;
 
 /* holds the actual session size reported by server */
 uint16 g_session_width;
@@ -157,14 +163,20 @@ rdp_recv(uint8 * type)
 		/* fill stream with data if needed for parsing a new packet */
 		if (g_next_packet == 0)
 		{
-			rdp_s = sec_recv(&is_fastpath);
+			if (replay_is_active())
+				rdp_s = replay_recv(&is_fastpath);
+			else
+				rdp_s = sec_recv(&is_fastpath);
 			if (rdp_s == NULL)
 				return NULL;
 
+			replay_record(rdp_s, is_fastpath);
+
 			if (is_fastpath == True)
 			{
 				/* process_ts_fp_updates moves g_next_packet */
 				process_ts_fp_updates(rdp_s);
+				s_arena_reset();
 				continue;
 			}
 
@@ -292,6 +304,8 @@ rdp_out_unistr(STREAM s, char *string, int len)
 
 	memset(pout, 0, len + 2);
 
+	if (ibl * 2 <= obl && ascii_to_utf16(pout, string, ibl))
+		return;
 
 	if (iconv(icv_local_to_utf16, (char **) &pin, &ibl, (char **)&pout, &obl) == (size_t) - 1)
 	{
@@ -540,7 +554,7 @@ rdp_send_client_info_pdu(uint32 flags, char *domain, char *user,
 
 		/* Rest of TS_EXTENDED_INFO_PACKET */
 		out_uint32_le(s, 0);	/* clientSessionId (Ignored by server MUST be 0) */
-		out_uint32_le(s, g_rdp5_performanceflags);
+		out_uint32_le(s, autodetect_performance_flags(g_rdp5_performanceflags));
 
 		/* Client Auto-Reconnect */
 		if (g_has_reconnect_random)
@@ -606,40 +620,296 @@ rdp_send_synchronise(void)
 	s_free(s);
 }
 
-/* Send a single input event */
-void
-rdp_send_input(uint32 time, uint16 message_type, uint16 device_flags, uint16 param1, uint16 param2)
+/* Input events waiting to be sent together */
+#define RDP_INPUT_QUEUE_SIZE 32
+
+typedef struct _RDP_INPUT_EVENT
 {
-	STREAM s;
+	uint32 time;
+	uint16 message_type;
+	uint16 device_flags;
+	uint16 param1;
+	uint16 param2;
+}
+RDP_INPUT_EVENT;
 
-	logger(Protocol, Debug, "%s()", __func__);
+static RDP_INPUT_EVENT g_input_queue[RDP_INPUT_QUEUE_SIZE];
+static int g_input_queue_len = 0;
+static RD_BOOL g_input_batching = False;
+
+/* Pointer motion is sent at most every g_motion_interval ms, if set */
+extern uint32 g_motion_interval;
+static struct timeval g_motion_sent;
 
-	s = rdp_init_data(16);
+/* Server accepts fast-path input PDUs */
+static RD_BOOL g_fastpath_input = False;
 
-	out_uint16_le(s, 1);	/* number of events */
+/* Send the queued events in a slow-path input PDU */
+static void
+rdp_send_input_pdu(void)
+{
+	STREAM s;
+	int i;
+
+	s = rdp_init_data(4 + 12 * g_input_queue_len);
+
+	out_uint16_le(s, g_input_queue_len);	/* number of events */
 	out_uint16(s, 0);	/* pad */
 
-	out_uint32_le(s, time);
-	out_uint16_le(s, message_type);
-	out_uint16_le(s, device_flags);
-	out_uint16_le(s, param1);
-	out_uint16_le(s, param2);
+	for (i = 0; i < g_input_queue_len; i++)
+	{
+		out_uint32_le(s, g_input_queue[i].time);
+		out_uint16_le(s, g_input_queue[i].message_type);
+		out_uint16_le(s, g_input_queue[i].device_flags);
+		out_uint16_le(s, g_input_queue[i].param1);
+		out_uint16_le(s, g_input_queue[i].param2);
+	}
 
 	s_mark_end(s);
 	rdp_send_data(s, RDP_DATA_PDU_INPUT);
 	s_free(s);
 }
 
-/* Send a Suppress Output PDU */
-void
-rdp_send_suppress_output_pdu(enum RDP_SUPPRESS_STATUS allowupdates)
+/* Encode ev as a fast-path input event, returns False if it has no
+   fast-path equivalent */
+static RD_BOOL
+rdp_out_fastpath_input_event(STREAM s, RDP_INPUT_EVENT * ev)
+{
+	uint8 flags;
+
+	switch (ev->message_type)
+	{
+		case RDP_INPUT_SYNCHRONIZE:
+			out_uint8(s, (FASTPATH_INPUT_EVENT_SYNC << 5) | (ev->param1 & 0x1f));
+			return True;
+
+		case RDP_INPUT_SCANCODE:
+			flags = 0;
+			if (ev->device_flags & KBD_FLAG_UP)
+				flags |= FASTPATH_INPUT_KBDFLAGS_RELEASE;
+			if (ev->device_flags & KBD_FLAG_EXT)
+				flags |= FASTPATH_INPUT_KBDFLAGS_EXTENDED;
+			if (ev->device_flags & KBD_FLAG_EXT1)
+				flags |= FASTPATH_INPUT_KBDFLAGS_EXTENDED1;
+			out_uint8(s, (FASTPATH_INPUT_EVENT_SCANCODE << 5) | flags);
+			out_uint8(s, ev->param1);
+			return True;
+
+		case RDP_INPUT_MOUSE:
+		case RDP_INPUT_MOUSEX:
+			out_uint8(s, (ev->message_type == RDP_INPUT_MOUSE ?
+				      FASTPATH_INPUT_EVENT_MOUSE : FASTPATH_INPUT_EVENT_MOUSEX) << 5);
+			out_uint16_le(s, ev->device_flags);
+			out_uint16_le(s, ev->param1);
+			out_uint16_le(s, ev->param2);
+			return True;
+	}
+
+	return False;
+}
+
+/* Send all queued input events, in one fast-path input PDU when the
+   server supports that */
+static void
+rdp_flush_input(void)
 {
 	STREAM s;
-	static enum RDP_SUPPRESS_STATUS current_status = ALLOW_DISPLAY_UPDATES;
+	int i;
+
+	if (g_input_queue_len == 0)
+		return;
+
+	logger(Protocol, Debug, "%s(), %d events", __func__, g_input_queue_len);
+
+	for (i = 0; i < g_input_queue_len; i++)
+		if (g_input_queue[i].message_type == RDP_INPUT_MOUSE)
+		{
+			gettimeofday(&g_motion_sent, NULL);
+			break;
+		}
+
+	if (g_fastpath_input)
+	{
+		s = s_alloc(7 * g_input_queue_len);
+		for (i = 0; i < g_input_queue_len; i++)
+			if (!rdp_out_fastpath_input_event(s, &g_input_queue[i]))
+				break;
+
+		if (i == g_input_queue_len)
+		{
+			s_mark_end(s);
+			sec_send_fastpath_input(s->data, s_length(s), g_input_queue_len);
+			s_free(s);
+			g_input_queue_len = 0;
+			return;
+		}
+
+		s_free(s);
+	}
+
+	rdp_send_input_pdu();
+	g_input_queue_len = 0;
+}
+
+static RD_BOOL
+rdp_input_is_motion(RDP_INPUT_EVENT * ev)
+{
+	return ev->message_type == RDP_INPUT_MOUSE && ev->device_flags == MOUSE_FLAG_MOVE;
+}
+
+/* Milliseconds until queued pointer motion may be sent, 0 if it may
+   be sent now */
+static uint32
+rdp_motion_delay(void)
+{
+	struct timeval now;
+	long elapsed;
+
+	if (g_motion_interval == 0)
+		return 0;
+
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - g_motion_sent.tv_sec) * 1000 +
+		(now.tv_usec - g_motion_sent.tv_usec) / 1000;
+	if (elapsed < 0 || elapsed >= (long) g_motion_interval)
+		return 0;
+
+	return g_motion_interval - elapsed;
+}
+
+/* Send the queued events. With a motion rate limit, a trailing pointer
+   move that is not due yet stays queued, to be merged with the next
+   moves or sent once rdp_input_timeout() has passed. */
+static void
+rdp_flush_input_due(void)
+{
+	RDP_INPUT_EVENT held;
+
+	if (g_input_queue_len > 0 &&
+	    rdp_input_is_motion(&g_input_queue[g_input_queue_len - 1]) && rdp_motion_delay() > 0)
+	{
+		held = g_input_queue[--g_input_queue_len];
+		rdp_flush_input();
+		g_input_queue[g_input_queue_len++] = held;
+		return;
+	}
+
+	rdp_flush_input();
+}
+
+/* Queue an input event. Outside of a batch it is sent right away,
+   within one it goes out with the others at rdp_input_batch_end().
+   Either way, pointer motion held back by the rate limit waits until it
+   is due. */
+void
+rdp_send_input(uint32 time, uint16 message_type, uint16 device_flags, uint16 param1, uint16 param2)
+{
+	RDP_INPUT_EVENT *ev;
 
 	logger(Protocol, Debug, "%s()", __func__);
 
-	if (current_status == allowupdates)
+	/* A move that directly follows another one supersedes it. Any
+	   other event ends the run, so key and button events keep their
+	   order relative to the motion around them. */
+	if (g_input_queue_len > 0 && message_type == RDP_INPUT_MOUSE &&
+	    device_flags == MOUSE_FLAG_MOVE &&
+	    rdp_input_is_motion(&g_input_queue[g_input_queue_len - 1]))
+	{
+		ev = &g_input_queue[g_input_queue_len - 1];
+		ev->time = time;
+		ev->param1 = param1;
+		ev->param2 = param2;
+		if (!g_input_batching)
+			rdp_flush_input_due();
+		return;
+	}
+
+	if (g_input_queue_len == RDP_INPUT_QUEUE_SIZE)
+		rdp_flush_input();
+
+	ev = &g_input_queue[g_input_queue_len++];
+	ev->time = time;
+	ev->message_type = message_type;
+	ev->device_flags = device_flags;
+	ev->param1 = param1;
+	ev->param2 = param2;
+
+	if (!g_input_batching)
+		rdp_flush_input_due();
+}
+
+/* Collect the input events that follow, until rdp_input_batch_end() */
+void
+rdp_input_batch_begin(void)
+{
+	g_input_batching = True;
+}
+
+/* Send the events of the batch, except for pointer motion that is not
+   due yet */
+void
+rdp_input_batch_end(void)
+{
+	g_input_batching = False;
+	rdp_flush_input_due();
+}
+
+/* Milliseconds until held back input should be sent, -1 if there is
+   none */
+int
+rdp_input_timeout(void)
+{
+	if (g_input_queue_len == 0)
+		return -1;
+
+	return rdp_motion_delay();
+}
+
+/* Whether the UI wants display updates, and what the server was last
+   told. A new activation starts with updates allowed. */
+static enum RDP_SUPPRESS_STATUS g_display_updates = ALLOW_DISPLAY_UPDATES;
+static enum RDP_SUPPRESS_STATUS g_display_updates_sent = ALLOW_DISPLAY_UPDATES;
+static BOUNDS g_display_rect_sent;	/* of updates allowed, all zero for the session */
+
+/* While the client falls behind on a slow link, updates are asked for
+   the region the user is looking at only, around the pointer or the
+   focused seamless window, and the rest of the session is refreshed
+   once the backlog has been worked through */
+#define RDP_BACKLOG_SLOW_KBPS	10000
+#define RDP_BACKLOG_HIGH	(256 * 1024)	/* bytes received but not processed */
+#define RDP_BACKLOG_LOW		(32 * 1024)
+#define RDP_FOCUS_INTERVAL	250	/* ms between moves of the region */
+
+static BOUNDS g_focus_rect;
+static RD_BOOL g_focus_set = False;
+static RD_BOOL g_prioritising = False;
+static uint64 g_focus_sent_time;
+
+static uint64
+display_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Send a Suppress Output PDU, allowing updates of rect, or of the whole
+   session when it is NULL */
+static void
+rdp_send_display_updates(enum RDP_SUPPRESS_STATUS allowupdates, BOUNDS * rect)
+{
+	BOUNDS all;
+	STREAM s;
+
+	if (rect == NULL || allowupdates == SUPPRESS_DISPLAY_UPDATES)
+	{
+		memset(&all, 0, sizeof(all));
+		rect = &all;
+	}
+
+	if (g_display_updates_sent == allowupdates
+	    && memcmp(&g_display_rect_sent, rect, sizeof(BOUNDS)) == 0)
 		return;
 
 	s = rdp_init_data(12);
@@ -653,17 +923,125 @@ rdp_send_suppress_output_pdu(enum RDP_SUPPRESS_STATUS allowupdates)
 			break;
 
 		case ALLOW_DISPLAY_UPDATES:	/* receive data again */
-			out_uint16_le(s, 0);	/* left */
-			out_uint16_le(s, 0);	/* top */
-			out_uint16_le(s, g_session_width);	/* right */
-			out_uint16_le(s, g_session_height);	/* bottom */
+			if (rect == &all)
+			{
+				out_uint16_le(s, 0);	/* left */
+				out_uint16_le(s, 0);	/* top */
+				out_uint16_le(s, g_session_width);	/* right */
+				out_uint16_le(s, g_session_height);	/* bottom */
+			}
+			else
+			{
+				out_uint16_le(s, rect->left);
+				out_uint16_le(s, rect->top);
+				out_uint16_le(s, rect->right);
+				out_uint16_le(s, rect->bottom);
+			}
 			break;
 	}
 
 	s_mark_end(s);
 	rdp_send_data(s, RDP_DATA_PDU_CLIENT_WINDOW_STATUS);
 	s_free(s);
-	current_status = allowupdates;
+	g_display_updates_sent = allowupdates;
+	g_display_rect_sent = *rect;
+}
+
+/* Send a Suppress Output PDU */
+void
+rdp_send_suppress_output_pdu(enum RDP_SUPPRESS_STATUS allowupdates)
+{
+	logger(Protocol, Debug, "%s()", __func__);
+
+	g_display_updates = allowupdates;
+	if (allowupdates == SUPPRESS_DISPLAY_UPDATES)
+		g_prioritising = False;
+	rdp_send_display_updates(allowupdates, g_prioritising ? &g_focus_rect : NULL);
+}
+
+/* Set the region the user is looking at, which is updated first when
+   the client falls behind. right and bottom are inclusive. */
+void
+rdp_set_focus_region(int left, int top, int right, int bottom)
+{
+	g_focus_rect.left = MAX(left, 0);
+	g_focus_rect.top = MAX(top, 0);
+	g_focus_rect.right = MIN(right, (int) g_session_width - 1);
+	g_focus_rect.bottom = MIN(bottom, (int) g_session_height - 1);
+	g_focus_set = g_focus_rect.right >= g_focus_rect.left
+		&& g_focus_rect.bottom >= g_focus_rect.top;
+}
+
+/* Narrow the updates asked for to the focus region while the backlog of
+   received data is large on a slow link, and widen them again when it
+   has been worked through */
+static void
+rdp_update_priority(void)
+{
+	uint32 backlog, bandwidth;
+	uint64 now;
+
+	if (g_display_updates != ALLOW_DISPLAY_UPDATES)
+		return;
+
+	backlog = tcp_backlog();
+	if (!g_prioritising)
+	{
+		bandwidth = autodetect_bandwidth();
+		if (!g_focus_set || backlog < RDP_BACKLOG_HIGH || bandwidth == 0
+		    || bandwidth >= RDP_BACKLOG_SLOW_KBPS)
+			return;
+
+		logger(Protocol, Verbose,
+		       "Falling behind with %u bytes at %u kbit/s, updating around %d,%d first",
+		       backlog, bandwidth, g_focus_rect.left, g_focus_rect.top);
+		g_prioritising = True;
+		g_focus_sent_time = display_clock();
+		rdp_send_display_updates(ALLOW_DISPLAY_UPDATES, &g_focus_rect);
+		return;
+	}
+
+	if (backlog <= RDP_BACKLOG_LOW)
+	{
+		logger(Protocol, Verbose, "Caught up, updating the whole session again");
+		g_prioritising = False;
+		rdp_send_display_updates(ALLOW_DISPLAY_UPDATES, NULL);
+		/* what was left out meanwhile */
+		rdp_send_refresh_rect(0, 0, g_session_width, g_session_height);
+		return;
+	}
+
+	/* follow the user around, but not with every pointer motion */
+	now = display_clock();
+	if (now - g_focus_sent_time < RDP_FOCUS_INTERVAL)
+		return;
+	g_focus_sent_time = now;
+	rdp_send_display_updates(ALLOW_DISPLAY_UPDATES, &g_focus_rect);
+}
+
+/* Send a Refresh Rect PDU, asking the server to redraw an area */
+void
+rdp_send_refresh_rect(int x, int y, int cx, int cy)
+{
+	STREAM s;
+
+	logger(Protocol, Debug, "%s(), %dx%d at %d,%d", __func__, cx, cy, x, y);
+
+	if (cx <= 0 || cy <= 0)
+		return;
+
+	s = rdp_init_data(12);
+
+	out_uint8(s, 1);	/* numberOfAreas */
+	out_uint8s(s, 3);	/* pad3Octets */
+	out_uint16_le(s, x);	/* left */
+	out_uint16_le(s, y);	/* top */
+	out_uint16_le(s, x + cx - 1);	/* right, inclusive */
+	out_uint16_le(s, y + cy - 1);	/* bottom, inclusive */
+
+	s_mark_end(s);
+	rdp_send_data(s, RDP_DATA_PDU_REFRESH_RECT);
+	s_free(s);
 }
 
 /* Send persistent bitmap cache enumeration PDUs */
@@ -711,6 +1089,8 @@ rdp_enum_bmpcache2(void)
 
 		offset += 169;
 	}
+
+	pstcache_preload_start();
 }
 
 /* Send an (empty) font information PDU */
@@ -784,16 +1164,29 @@ rdp_out_ts_bitmap_capabilityset(STREAM s)
 	out_uint16_le(s, 0);	/* pad2OctetsB */
 }
 
+/* Bitmap cache v3 entries are NSCodec compressed, and the cache v2
+   tables they go to are only used from RDP 5 */
+static RD_BOOL
+rdp_bmpcache3_supported(void)
+{
+	return g_nsc && g_bitmap_cache && g_rdp_version >= RDP_V5;
+}
+
 /* Output order capability set */
 static void
 rdp_out_ts_order_capabilityset(STREAM s)
 {
 	uint8 order_caps[32];
-	uint16 orderflags = 0;
+	uint16 orderflags = 0, orderflags_ex = 0;
 	uint32 cachesize = 0;
 
 	orderflags |= (NEGOTIATEORDERSUPPORT | ZEROBOUNDSDELTASSUPPORT);	/* mandatory flags */
 	orderflags |= COLORINDEXSUPPORT;
+	if (rdp_bmpcache3_supported())
+	{
+		orderflags |= ORDERFLAGS_EXTRA_FLAGS;
+		orderflags_ex |= ORDERFLAGS_EX_CACHE_BITMAP_REV3_SUPPORT;
+	}
 
 	memset(order_caps, 0, 32);
 
@@ -804,6 +1197,8 @@ rdp_out_ts_order_capabilityset(STREAM s)
 	order_caps[TS_NEG_MULTI_DRAWNINEGRID_INDEX] = 1;
 	order_caps[TS_NEG_POLYLINE_INDEX] = 1;
 	order_caps[TS_NEG_INDEX_INDEX] = 1;
+	order_caps[TS_NEG_FAST_INDEX_INDEX] = 1;
+	order_caps[TS_NEG_FAST_GLYPH_INDEX] = 1;
 
 	if (g_bitmap_cache)
 		order_caps[TS_NEG_MEMBLT_INDEX] = 1;
@@ -834,7 +1229,7 @@ rdp_out_ts_order_capabilityset(STREAM s)
 	out_uint16_le(s, orderflags);	/* orderFlags */
 	out_uint8a(s, order_caps, 32);	/* orderSupport */
 	out_uint16_le(s, 0);	/* textFlags (ignored) */
-	out_uint16_le(s, 0);	/* orderSupportExFlags */
+	out_uint16_le(s, orderflags_ex);	/* orderSupportExFlags */
 	out_uint32_le(s, 0);	/* pad4OctetsB */
 	out_uint32_le(s, cachesize);	/* desktopSaveSize */
 	out_uint16_le(s, 0);	/* pad2OctetsC */
@@ -856,11 +1251,11 @@ rdp_out_bmpcache_caps(STREAM s)
 
 	Bpp = (g_server_depth + 7) / 8;	/* bytes per pixel */
 	out_uint8s(s, 24);	/* unused */
-	out_uint16_le(s, 0x258);	/* entries */
+	out_uint16_le(s, cache_bitmap_cells(0, 0x258, False));	/* entries */
 	out_uint16_le(s, 0x100 * Bpp);	/* max cell size */
-	out_uint16_le(s, 0x12c);	/* entries */
+	out_uint16_le(s, cache_bitmap_cells(1, 0x12c, False));	/* entries */
 	out_uint16_le(s, 0x400 * Bpp);	/* max cell size */
-	out_uint16_le(s, 0x106);	/* entries */
+	out_uint16_le(s, cache_bitmap_cells(2, 0x106, False));	/* entries */
 	out_uint16_le(s, 0x1000 * Bpp);	/* max cell size */
 }
 
@@ -876,15 +1271,16 @@ rdp_out_bmpcache2_caps(STREAM s)
 	out_uint16_be(s, 3);	/* number of caches in this set */
 
 	/* max cell size for cache 0 is 16x16, 1 = 32x32, 2 = 64x64, etc */
-	out_uint32_le(s, BMPCACHE2_C0_CELLS);
-	out_uint32_le(s, BMPCACHE2_C1_CELLS);
+	out_uint32_le(s, cache_bitmap_cells(0, BMPCACHE2_C0_CELLS, False));
+	out_uint32_le(s, cache_bitmap_cells(1, BMPCACHE2_C1_CELLS, False));
 	if (pstcache_init(2))
 	{
-		out_uint32_le(s, BMPCACHE2_NUM_PSTCELLS | BMPCACHE2_FLAG_PERSIST);
+		out_uint32_le(s, cache_bitmap_cells(2, BMPCACHE2_NUM_PSTCELLS, True) |
+			      BMPCACHE2_FLAG_PERSIST);
 	}
 	else
 	{
-		out_uint32_le(s, BMPCACHE2_C2_CELLS);
+		out_uint32_le(s, cache_bitmap_cells(2, BMPCACHE2_C2_CELLS, False));
 	}
 	out_uint8s(s, 20);	/* other bitmap caches not used */
 }
@@ -969,6 +1365,28 @@ rdp_out_brushcache_caps(STREAM s)
 	out_uint32_le(s, 1);	/* cache type */
 }
 
+/* 2.2.1.1 MS-RDPEGDI */
+/* Output bitmap cache v3 codec id capability set */
+static void
+rdp_out_bmpcache3_codecid_caps(STREAM s)
+{
+	out_uint16_le(s, RDP_CAPSET_BMPCACHE3_CODECID);
+	out_uint16_le(s, RDP_CAPLEN_BMPCACHE3_CODECID);
+	out_uint8(s, RDP_CODEC_ID_NSCODEC);	/* codecId */
+}
+
+/* 2.2.7.1.9 MS-RDPBCGR */
+/* Output offscreen bitmap cache capability set */
+static void
+rdp_out_offscreen_caps(STREAM s)
+{
+	out_uint16_le(s, RDP_CAPSET_OFFSCREEN);
+	out_uint16_le(s, RDP_CAPLEN_OFFSCREEN);
+	out_uint32_le(s, 1);	/* offscreenSupportLevel */
+	out_uint16_le(s, OFFSCREEN_CACHE_SIZE);
+	out_uint16_le(s, OFFSCREEN_CACHE_ENTRIES);
+}
+
 /* 2.2.7.1.10 MS-RDPBCGR */
 /* Output virtual channel capability set */
 static void
@@ -976,8 +1394,7 @@ rdp_out_virtchan_caps(STREAM s)
 {
 	out_uint16_le(s, RDP_CAPSET_VC);
 	out_uint16_le(s, RDP_CAPLEN_VC);
-	/* VCCAPS_COMPR_SC */
-	out_uint32_le(s, 0x00000001);	/* compression flags */
+	out_uint32_le(s, VCCAPS_COMPR_SC);	/* compression flags */
 }
 
 static void
@@ -988,8 +1405,13 @@ rdp_process_virtchan_caps(STREAM s)
 	in_uint32_le(s, flags);
 	in_uint32_le(s, chunk_size);
 
-	UNUSED(flags);
 	vc_chunk_size = chunk_size;
+
+	/* compress what we send on channels, if we asked for compression
+	   and the server can take it */
+	g_vc_compress = g_rdp_compression && (flags & VCCAPS_COMPR_CS_8K);
+	if (g_vc_compress)
+		mppc_compress_reset();
 }
 
 /* Output Input Capability Set */
@@ -998,6 +1420,8 @@ rdp_out_ts_input_capabilityset(STREAM s)
 {
 	uint16 inputflags = 0;
 	inputflags |= INPUT_FLAG_SCANCODES;
+	if (g_rdp_version >= RDP_V5)
+		inputflags |= INPUT_FLAG_FASTPATH_INPUT2;
 
 	out_uint16_le(s, RDP_CAPSET_INPUT);
 	out_uint16_le(s, RDP_CAPLEN_INPUT);
@@ -1073,9 +1497,16 @@ rdp_out_ts_glyphcache_capabilityset(STREAM s)
 static void
 rdp_out_ts_multifragmentupdate_capabilityset(STREAM s)
 {
+	/* a RemoteFX frame comes as one update, which can be as large as
+	   the screen */
+	g_fp_max_request_size = RDESKTOP_FASTPATH_MULTIFRAGMENT_MAX_SIZE;
+	if (g_rfx)
+		g_fp_max_request_size = MAX(g_fp_max_request_size,
+					    (uint32) g_session_width * g_session_height * 4);
+
 	out_uint16_le(s, RDP_CAPSET_MULTIFRAGMENTUPDATE);
 	out_uint16_le(s, RDP_CAPLEN_MULTIFRAGMENTUPDATE);
-	out_uint32_le(s, RDESKTOP_FASTPATH_MULTIFRAGMENT_MAX_SIZE);	/* MaxRequestSize */
+	out_uint32_le(s, g_fp_max_request_size);	/* MaxRequestSize */
 }
 
 static void
@@ -1088,6 +1519,100 @@ rdp_out_ts_large_pointer_capabilityset(STREAM s)
 	out_uint16_le(s, flags);	/* largePointerSupportFlags */
 }
 
+/* Output Surface Commands Capability Set */
+static void
+rdp_out_ts_surfcmds_capabilityset(STREAM s)
+{
+	out_uint16_le(s, RDP_CAPSET_SURFCMDS);
+	out_uint16_le(s, RDP_CAPLEN_SURFCMDS);
+	out_uint32_le(s, SURFCMDS_SET_SURFACE_BITS | SURFCMDS_STREAM_SURFACE_BITS);	/* cmdFlags */
+	out_uint32_le(s, 0);	/* reserved */
+}
+
+/* CODEC_GUID_REMOTEFX */
+static const uint8 rdp_codec_guid_remotefx[16] = {
+	0x12, 0x2f, 0x77, 0x76, 0x72, 0xbd, 0x63, 0x44,
+	0xaf, 0xb3, 0xb7, 0x3c, 0x9c, 0x6f, 0x78, 0x86
+};
+
+/* CODEC_GUID_NSCODEC */
+static const uint8 rdp_codec_guid_nscodec[16] = {
+	0xb9, 0x1b, 0x8d, 0xca, 0x0f, 0x00, 0x4f, 0x15,
+	0x58, 0x9f, 0xae, 0x2d, 0x1a, 0x87, 0xe2, 0xd6
+};
+
+/* TS_NSCODEC_CAPABILITYSET */
+#define RDP_NSC_CAPS_LENGTH	3
+
+/* TS_RFX_CLNT_CAPS_CONTAINER with one capset of two icaps */
+#define RDP_RFX_CAPS_LENGTH	49
+
+static uint16
+rdp_bmpcodecs_caplen(void)
+{
+	uint16 len = 5;		/* header, bitmapCodecCount */
+
+	if (g_nsc)
+		len += 19 + RDP_NSC_CAPS_LENGTH;
+	if (g_rfx)
+		len += 19 + RDP_RFX_CAPS_LENGTH;
+	return len;
+}
+
+/* Output a TS_RFX_ICAP, tiles of 64 pixels with the ICT colour
+   conversion and the 5/3 wavelet */
+static void
+rdp_out_rfx_icap(STREAM s, uint8 entropy)
+{
+	out_uint16_le(s, 0x0100);	/* version */
+	out_uint16_le(s, 64);	/* tileSize */
+	out_uint8(s, 0);	/* flags */
+	out_uint8(s, 1);	/* colConvBits, CLW_COL_CONV_ICT */
+	out_uint8(s, 1);	/* transformBits, CLW_XFORM_DWT_53_A */
+	out_uint8(s, entropy);	/* entropyBits */
+}
+
+/* Output Bitmap Codecs Capability Set */
+static void
+rdp_out_ts_bitmapcodecs_capabilityset(STREAM s)
+{
+	out_uint16_le(s, RDP_CAPSET_BMPCODECS);
+	out_uint16_le(s, rdp_bmpcodecs_caplen());
+	out_uint8(s, (g_nsc ? 1 : 0) + (g_rfx ? 1 : 0));	/* bitmapCodecCount */
+
+	if (g_nsc)
+	{
+		out_uint8a(s, rdp_codec_guid_nscodec, 16);	/* codecGUID */
+		out_uint8(s, RDP_CODEC_ID_NSCODEC);	/* codecID */
+		out_uint16_le(s, RDP_NSC_CAPS_LENGTH);	/* codecPropertiesLength */
+		out_uint8(s, 1);	/* fAllowDynamicFidelity */
+		out_uint8(s, 1);	/* fAllowSubsampling */
+		out_uint8(s, 3);	/* colorLossLevel */
+	}
+
+	if (g_rfx)
+	{
+		out_uint8a(s, rdp_codec_guid_remotefx, 16);	/* codecGUID */
+		out_uint8(s, RDP_CODEC_ID_REMOTEFX);	/* codecID */
+		out_uint16_le(s, RDP_RFX_CAPS_LENGTH);	/* codecPropertiesLength */
+
+		out_uint32_le(s, RDP_RFX_CAPS_LENGTH);	/* length */
+		out_uint32_le(s, 1);	/* captureFlags, CARDP_CAPS_CAPTURE_NON_CAC */
+		out_uint32_le(s, RDP_RFX_CAPS_LENGTH - 12);	/* capsLength */
+		out_uint16_le(s, 0xcbc0);	/* blockType, CBY_CAPS */
+		out_uint32_le(s, 8);	/* blockLen */
+		out_uint16_le(s, 1);	/* numCapsets */
+		out_uint16_le(s, 0xcbc1);	/* blockType, CBY_CAPSET */
+		out_uint32_le(s, RDP_RFX_CAPS_LENGTH - 20);	/* blockLen */
+		out_uint8(s, 1);	/* codecId */
+		out_uint16_le(s, 0xcfc0);	/* capsetType, CLY_CAPSET */
+		out_uint16_le(s, 2);	/* numIcaps */
+		out_uint16_le(s, 8);	/* icapLen */
+		rdp_out_rfx_icap(s, 0x01);	/* CLW_ENTROPY_RLGR1 */
+		rdp_out_rfx_icap(s, 0x04);	/* CLW_ENTROPY_RLGR3 */
+	}
+}
+
 #define RDP5_FLAG 0x0030
 /* Send a confirm active PDU */
 static void
@@ -1095,6 +1620,7 @@ rdp_send_confirm_active(void)
 {
 	STREAM s;
 	uint32 sec_flags = g_encryption ? (RDP5_FLAG | SEC_ENCRYPT) : RDP5_FLAG;
+	uint16 numcaps = 17;
 	uint16 caplen =
 		RDP_CAPLEN_GENERAL +
 		RDP_CAPLEN_BITMAP +
@@ -1118,6 +1644,8 @@ rdp_send_confirm_active(void)
 	{
 		caplen += RDP_CAPLEN_BMPCACHE2;
 		caplen += RDP_CAPLEN_NEWPOINTER;
+		caplen += RDP_CAPLEN_OFFSCREEN;
+		numcaps++;
 	}
 	else
 	{
@@ -1125,6 +1653,18 @@ rdp_send_confirm_active(void)
 		caplen += RDP_CAPLEN_POINTER;
 	}
 
+	if (g_rfx || g_nsc)
+	{
+		caplen += RDP_CAPLEN_SURFCMDS + rdp_bmpcodecs_caplen();
+		numcaps += 2;
+	}
+
+	if (rdp_bmpcache3_supported())
+	{
+		caplen += RDP_CAPLEN_BMPCACHE3_CODECID;
+		numcaps++;
+	}
+
 	s = sec_init(sec_flags, 6 + 14 + caplen + sizeof(RDP_SOURCE));
 
 	out_uint16_le(s, 2 + 14 + caplen + sizeof(RDP_SOURCE));
@@ -1137,7 +1677,7 @@ rdp_send_confirm_active(void)
 	out_uint16_le(s, caplen);
 
 	out_uint8a(s, RDP_SOURCE, sizeof(RDP_SOURCE));
-	out_uint16_le(s, 17);	/* num_caps */
+	out_uint16_le(s, numcaps);	/* num_caps */
 	out_uint8s(s, 2);	/* pad */
 
 	rdp_out_ts_general_capabilityset(s);
@@ -1147,6 +1687,7 @@ rdp_send_confirm_active(void)
 	{
 		rdp_out_bmpcache2_caps(s);
 		rdp_out_newpointer_caps(s);
+		rdp_out_offscreen_caps(s);
 	}
 	else
 	{
@@ -1166,6 +1707,13 @@ rdp_send_confirm_active(void)
 	rdp_out_ts_glyphcache_capabilityset(s);
 	rdp_out_ts_multifragmentupdate_capabilityset(s);
 	rdp_out_ts_large_pointer_capabilityset(s);
+	if (g_rfx || g_nsc)
+	{
+		rdp_out_ts_surfcmds_capabilityset(s);
+		rdp_out_ts_bitmapcodecs_capabilityset(s);
+	}
+	if (rdp_bmpcache3_supported())
+		rdp_out_bmpcache3_codecid_caps(s);
 
 	s_mark_end(s);
 	sec_send(s, sec_flags);
@@ -1229,6 +1777,20 @@ rdp_process_bitmap_caps(STREAM s)
 		g_server_depth = depth;
 	}
 
+	rdp_set_session_size(g_session_width, g_session_height);
+}
+
+/* Take on a new session size, as given by the bitmap capabilities or
+   by a graphics pipeline reset after a monitor layout change */
+void
+rdp_set_session_size(uint16 width, uint16 height)
+{
+	g_session_width = width;
+	g_session_height = height;
+
+	/* a monitor layout sent earlier has been acted on */
+	g_wait_for_deactivate_ts = 0;
+
 	/* Resize window size to match session size, except when we're in
 	   fullscreen, where we want the window to always cover the entire
 	   screen. */
@@ -1247,6 +1809,22 @@ rdp_process_bitmap_caps(STREAM s)
 	ui_resize_window(g_session_width, g_session_height);
 }
 
+/* Process an input capability set */
+static void
+rdp_process_input_caps(STREAM s)
+{
+	uint16 inputflags;
+
+	in_uint16_le(s, inputflags);
+
+	g_fastpath_input = (g_rdp_version >= RDP_V5 &&
+			    (inputflags & (INPUT_FLAG_FASTPATH_INPUT | INPUT_FLAG_FASTPATH_INPUT2)))
+		? True : False;
+
+	logger(Protocol, Debug, "rdp_process_input_caps(), input flags 0x%x, fast-path input %s",
+	       inputflags, g_fastpath_input ? "enabled" : "disabled");
+}
+
 /* Process server capabilities */
 static void
 rdp_process_server_caps(STREAM s, uint16 length)
@@ -1281,6 +1859,10 @@ rdp_process_server_caps(STREAM s, uint16 length)
 			case RDP_CAPSET_BITMAP:
 				rdp_process_bitmap_caps(s);
 				break;
+
+			case RDP_CAPSET_INPUT:
+				rdp_process_input_caps(s);
+				break;
 			case RDP_CAPSET_VC:
 				/* Parse only if we got VCChunkSize */
 				if (capset_length > 8) {
@@ -1304,6 +1886,9 @@ process_demand_active(STREAM s)
 	/* at this point we need to ensure that we have ui created */
 	rd_create_ui();
 
+	/* the server starts over with the screen as the target */
+	cache_reset_offscreen();
+
 	in_uint32_le(s, g_rdp_shareid);
 	in_uint16_le(s, len_src_descriptor);
 	in_uint16_le(s, len_combined_caps);
@@ -1316,17 +1901,17 @@ process_demand_active(STREAM s)
 
 	logger(Protocol, Debug, "process_demand_active(), shareid=0x%x", g_rdp_shareid);
 
+	g_fastpath_input = False;
 	rdp_process_server_caps(s, len_combined_caps);
 
+	/* The client side of the finalization does not wait for the
+	   server's, so all of it goes out in one go, in as few segments
+	   and records as it fits in, before the answers are read */
+	tcp_cork();
 	rdp_send_confirm_active();
 	rdp_send_synchronise();
 	rdp_send_control(RDP_CTL_COOPERATE);
 	rdp_send_control(RDP_CTL_REQUEST_CONTROL);
-	rdp_recv(&type);	/* RDP_PDU_SYNCHRONIZE */
-	rdp_recv(&type);	/* RDP_CTL_COOPERATE */
-	rdp_recv(&type);	/* RDP_CTL_GRANT_CONTROL */
-	rdp_send_input(0, RDP_INPUT_SYNCHRONIZE, 0,
-		       g_numlock_sync ? ui_get_numlock_state(read_keyboard_state()) : 0, 0);
 
 	if (g_rdp_version >= RDP_V5)
 	{
@@ -1338,9 +1923,23 @@ process_demand_active(STREAM s)
 		rdp_send_fonts(1);
 		rdp_send_fonts(2);
 	}
+	tcp_uncork();
 
+	rdp_recv(&type);	/* RDP_PDU_SYNCHRONIZE */
+	rdp_recv(&type);	/* RDP_CTL_COOPERATE */
+	rdp_recv(&type);	/* RDP_CTL_GRANT_CONTROL */
 	rdp_recv(&type);	/* RDP_PDU_UNKNOWN 0x28 (Fonts?) */
+	rdp_send_input(0, RDP_INPUT_SYNCHRONIZE, 0,
+		       g_numlock_sync ? ui_get_numlock_state(read_keyboard_state()) : 0, 0);
 	reset_order_state();
+	rdp_connect_phase(CONNECT_PHASE_CAPABILITIES);
+
+	/* keep a window hidden across a reconnect quiet */
+	g_display_updates_sent = ALLOW_DISPLAY_UPDATES;
+	memset(&g_display_rect_sent, 0, sizeof(g_display_rect_sent));
+	g_prioritising = False;
+	if (g_display_updates == SUPPRESS_DISPLAY_UPDATES)
+		rdp_send_suppress_output_pdu(SUPPRESS_DISPLAY_UPDATES);
 }
 
 /* Process a colour pointer PDU */
@@ -1483,31 +2082,58 @@ process_pointer_pdu(STREAM s)
 	}
 }
 
-/* Process TS_BITMAP_DATA */
+/* Decode buffer for TS_BITMAP_DATA, kept between updates since a
+   busy session paints bitmaps many times per frame */
+static uint8 *g_bitmap_buffer = NULL;
+static size_t g_bitmap_buffer_size = 0;
+
+static uint8 *
+rdp_bitmap_buffer(size_t size)
+{
+	if (size > g_bitmap_buffer_size)
+	{
+		g_bitmap_buffer = (uint8 *) xrealloc(g_bitmap_buffer, size);
+		g_bitmap_buffer_size = size;
+	}
+	return g_bitmap_buffer;
+}
+
+/* A rectangle of TS_UPDATE_BITMAP_DATA waiting to be painted */
+typedef struct _BITMAP_UPDATE
+{
+	uint16 left, top, cx, cy;
+	RD_BOOL compressed;
+	RD_BOOL hidden;		/* painted over by a later rectangle */
+	BITMAP_JOB job;
+}
+BITMAP_UPDATE;
+
+/* How many of the following rectangles are looked at for one that
+   paints over a rectangle */
+#define BITMAP_COVER_WINDOW 64
+
+/* Parse TS_BITMAP_DATA, the bitmap data is referenced from the stream
+   and is not decoded until the output buffer has been assigned */
 static void
-process_bitmap_data(STREAM s)
+parse_bitmap_data(STREAM s, BITMAP_UPDATE * update)
 {
 	uint16 left, top, right, bottom, width, height;
-	uint16 cx, cy, bpp, Bpp, flags, bufsize, size;
-	uint8 *data, *bmpdata;
-	
-	logger(Protocol, Debug, "%s()", __func__);
-
+	uint16 bpp, Bpp, flags, bufsize, size;
 	struct stream packet = *s;
 
-	in_uint16_le(s, left); /* destLeft */
-	in_uint16_le(s, top); /* destTop */
-	in_uint16_le(s, right); /* destRight */
-	in_uint16_le(s, bottom); /* destBottom */
-	in_uint16_le(s, width); /* width */
-	in_uint16_le(s, height); /* height */
-	in_uint16_le(s, bpp); /*bitsPerPixel */
-	Bpp = (bpp + 7) / 8;
-	in_uint16_le(s, flags); /* flags */
-	in_uint16_le(s, bufsize); /* bitmapLength */
+	logger(Protocol, Debug, "%s()", __func__);
 
-	cx = right - left + 1;
-	cy = bottom - top + 1;
+	s_assert_r(s, 18);
+	in_uint16_le_nc(s, left); /* destLeft */
+	in_uint16_le_nc(s, top); /* destTop */
+	in_uint16_le_nc(s, right); /* destRight */
+	in_uint16_le_nc(s, bottom); /* destBottom */
+	in_uint16_le_nc(s, width); /* width */
+	in_uint16_le_nc(s, height); /* height */
+	in_uint16_le_nc(s, bpp); /*bitsPerPixel */
+	Bpp = (bpp + 7) / 8;
+	in_uint16_le_nc(s, flags); /* flags */
+	in_uint16_le_nc(s, bufsize); /* bitmapLength */
 
 	/* FIXME: There are a assumtion that we do not consider in
 		this code. The value of bpp is not passed to
@@ -1530,19 +2156,23 @@ process_bitmap_data(STREAM s)
 				left, top, right, bottom, width, height, bpp, flags);
 		rdp_protocol_error("TS_BITMAP_DATA, unsafe size of bitmap data received from server", &packet);
 	}
- 
+
+	update->left = left;
+	update->top = top;
+	update->cx = right - left + 1;
+	update->cy = bottom - top + 1;
+	update->job.output = NULL;
+	update->job.decode = NULL;
+	update->job.width = width;
+	update->job.height = height;
+	update->job.Bpp = Bpp;
+
 	if (flags == 0)
 	{
-		/* read uncompressed bitmap data */
-		int y;
-		bmpdata = (uint8 *) xmalloc(width * height * Bpp);
-		for (y = 0; y < height; y++)
-		{
-			in_uint8a(s, &bmpdata[(height - y - 1) * (width * Bpp)], width * Bpp);
-		}
-		
-		ui_paint_bitmap(left, top, cx, cy, width, height, bmpdata);
-		xfree(bmpdata);
+		/* uncompressed bitmap data */
+		update->compressed = False;
+		update->job.size = width * height * Bpp;
+		in_uint8p(s, update->job.input, update->job.size);
 		return;
 	}
 
@@ -1553,10 +2183,10 @@ process_bitmap_data(STREAM s)
 	else
 	{
 		/* Read TS_CD_HEADER */
-		in_uint8s(s, 2);        /* skip cbCompFirstRowSize (must be 0x0000) */
-		in_uint16_le(s, size);  /* cbCompMainBodySize */
-		in_uint8s(s, 2);        /* skip cbScanWidth */
-		in_uint8s(s, 2);        /* skip cbUncompressedSize */
+		s_assert_r(s, 8);
+		in_uint8s_nc(s, 2);     /* skip cbCompFirstRowSize (must be 0x0000) */
+		in_uint16_le_nc(s, size); /* cbCompMainBodySize */
+		in_uint8s_nc(s, 4);     /* skip cbScanWidth, cbUncompressedSize */
 	}
 
 	/* read compressed bitmap data */
@@ -1564,32 +2194,266 @@ process_bitmap_data(STREAM s)
 	{
 		rdp_protocol_error("consume of bitmap data from stream would overrun", &packet);
 	}
-	in_uint8p(s, data, size);
-	bmpdata = (uint8 *) xmalloc(width * height * Bpp);
-	if (bitmap_decompress(bmpdata, width, height, data, size, Bpp))
+	update->compressed = True;
+	update->job.size = size;
+	in_uint8p(s, update->job.input, size);
+}
+
+/* Paint a parsed TS_BITMAP_DATA, waiting for it to be decompressed */
+static void
+paint_bitmap_data(BITMAP_UPDATE * update)
+{
+	int y, width, height, Bpp;
+	BITMAP_JOB *job = &update->job;
+
+	width = job->width;
+	height = job->height;
+	Bpp = job->Bpp;
+
+	if (!update->compressed)
 	{
-		ui_paint_bitmap(left, top, cx, cy, width, height, bmpdata);
+		for (y = 0; y < height; y++)
+		{
+			memcpy(&job->output[(height - y - 1) * (width * Bpp)],
+			       &job->input[y * (width * Bpp)], width * Bpp);
+		}
 	}
-	else
+	else if (!bitmap_decompress_wait(job))
 	{
 		logger(Protocol, Warning, "%s(), failed to decompress bitmap", __func__);
+		return;
 	}
 
-	xfree(bmpdata);
+	ui_paint_bitmap(update->left, update->top, update->cx, update->cy, width, height,
+			job->output);
+}
+
+/* True if update b paints all of the area of update a */
+static RD_BOOL
+bitmap_update_covers(BITMAP_UPDATE * b, BITMAP_UPDATE * a)
+{
+	/* only what the bitmap has data for is painted */
+	if (b->cx > b->job.width || b->cy > b->job.height)
+		return False;
+
+	return b->left <= a->left && b->top <= a->top
+		&& b->left + b->cx >= a->left + a->cx && b->top + b->cy >= a->top + a->cy;
 }
 
-/* Process TS_UPDATE_BITMAP_DATA */
+/* Process TS_UPDATE_BITMAP_DATA
+
+   All rectangles are parsed up front so that their decompression can
+   be spread over the bitmap worker threads, they are then painted in
+   the order the server sent them. Those that a later one of the same
+   update paints over are neither decompressed nor painted. */
 void
 process_bitmap_updates(STREAM s)
 {
-	int i;
+	int i, j;
 	uint16 num_updates;
+	size_t total;
+	uint8 *buffer;
+	BITMAP_UPDATE *updates;
 	
 	in_uint16_le(s, num_updates);   /* rectangles */
+	if (num_updates == 0)
+		return;
+
+	updates = (BITMAP_UPDATE *) s_arena_alloc(sizeof(BITMAP_UPDATE) * num_updates);
 
+	for (i = 0; i < num_updates; i++)
+		parse_bitmap_data(s, &updates[i]);
+
+	total = 0;
 	for (i = 0; i < num_updates; i++)
 	{
-		process_bitmap_data(s);
+		updates[i].hidden = False;
+		for (j = i + 1; j < num_updates && j <= i + BITMAP_COVER_WINDOW; j++)
+		{
+			if (bitmap_update_covers(&updates[j], &updates[i]))
+			{
+				updates[i].hidden = True;
+				break;
+			}
+		}
+		if (!updates[i].hidden)
+			total += (size_t) updates[i].job.width * updates[i].job.height *
+				updates[i].job.Bpp;
+	}
+
+	buffer = rdp_bitmap_buffer(total);
+	for (i = 0; i < num_updates; i++)
+	{
+		if (updates[i].hidden)
+			continue;
+
+		updates[i].job.output = buffer;
+		buffer += (size_t) updates[i].job.width * updates[i].job.height * updates[i].job.Bpp;
+
+		if (updates[i].compressed)
+			bitmap_decompress_queue(&updates[i].job);
+	}
+
+	for (i = 0; i < num_updates; i++)
+	{
+		if (!updates[i].hidden)
+			paint_bitmap_data(&updates[i]);
+	}
+}
+
+/* Decoding time of the surface bits codecs, for the ctrl socket */
+enum
+{
+	SURFACE_CODEC_REMOTEFX,
+	SURFACE_CODEC_NSCODEC,
+	SURFACE_CODECS
+};
+
+static const char *g_surface_codec_names[SURFACE_CODECS] = {
+	"surface.remotefx", "surface.nscodec"
+};
+
+static struct
+{
+	uint32 count;
+	uint64 nsec;
+} g_surface_codec_stats[SURFACE_CODECS];
+
+static uint64
+surface_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+surface_codec_done(int codec, uint64 begin)
+{
+	g_surface_codec_stats[codec].count++;
+	g_surface_codec_stats[codec].nsec += surface_clock() - begin;
+}
+
+/* Format the decoding time of codec n into buf */
+RD_BOOL
+rdp_format_stats(int n, char *buf, size_t size)
+{
+	if (n < 0 || n >= SURFACE_CODECS)
+		return False;
+
+	snprintf(buf, size, "%s count=%u usec=%llu", g_surface_codec_names[n],
+		 g_surface_codec_stats[n].count,
+		 (unsigned long long) g_surface_codec_stats[n].nsec / 1000);
+	return True;
+}
+
+void
+rdp_reset_stats(void)
+{
+	memset(g_surface_codec_stats, 0, sizeof(g_surface_codec_stats));
+}
+
+/* Process TS_SURFCMD_SET_SURF_BITS and TS_SURFCMD_STREAM_SURF_BITS */
+static void
+process_surface_bits(STREAM s)
+{
+	uint16 left, top, right, bottom, width, height;
+	uint8 bpp, flags, codec, *data, *pixels;
+	uint32 length;
+	uint64 begin;
+	int y;
+	struct stream packet = *s;
+
+	in_uint16_le(s, left);	/* destLeft */
+	in_uint16_le(s, top);	/* destTop */
+	in_uint16_le(s, right);	/* destRight */
+	in_uint16_le(s, bottom);	/* destBottom */
+	in_uint8(s, bpp);	/* bpp */
+	in_uint8(s, flags);	/* flags */
+	in_uint8s(s, 1);	/* reserved */
+	in_uint8(s, codec);	/* codecID */
+	in_uint16_le(s, width);	/* width */
+	in_uint16_le(s, height);	/* height */
+	in_uint32_le(s, length);	/* bitmapDataLength */
+	if (flags & EX_COMPRESSED_BITMAP_HEADER_PRESENT)
+		in_uint8s(s, 24);	/* exBitmapDataHeader */
+
+	if (!s_check_rem(s, length))
+		rdp_protocol_error("consume of surface bits from stream would overrun", &packet);
+	in_uint8p(s, data, length);
+
+	if (right <= left || bottom <= top)
+		return;
+
+	switch (codec)
+	{
+		case RDP_CODEC_ID_REMOTEFX:
+			begin = surface_clock();
+			if (!rfx_process_message(data, length, left, top, right - left, bottom - top))
+				logger(Protocol, Warning, "%s(), failed to decode RemoteFX data",
+				       __func__);
+			surface_codec_done(SURFACE_CODEC_REMOTEFX, begin);
+			break;
+
+		case RDP_CODEC_ID_NSCODEC:
+			pixels = rdp_bitmap_buffer((size_t) width * height * 4);
+			begin = surface_clock();
+			if (!nsc_decode(data, length, width, height, pixels, width * 4))
+			{
+				logger(Protocol, Warning, "%s(), failed to decode NSCodec data",
+				       __func__);
+				break;
+			}
+			surface_codec_done(SURFACE_CODEC_NSCODEC, begin);
+			ui_paint_bitmap(left, top, right - left, bottom - top, width, height, pixels);
+			break;
+
+		case RDP_CODEC_ID_NONE:
+			/* bottom up, like uncompressed bitmap updates */
+			if (bpp != 32 || length < (uint32) width * height * 4)
+			{
+				logger(Protocol, Warning, "%s(), bad uncompressed data", __func__);
+				break;
+			}
+			pixels = rdp_bitmap_buffer((size_t) width * height * 4);
+			for (y = 0; y < height; y++)
+				memcpy(pixels + (height - y - 1) * width * 4, data + y * width * 4,
+				       width * 4);
+			ui_paint_bitmap(left, top, right - left, bottom - top, width, height, pixels);
+			break;
+
+		default:
+			logger(Protocol, Warning, "%s(), unhandled codec %d", __func__, codec);
+	}
+}
+
+/* Process the TS_SURFCMD structures of a surface commands update */
+void
+process_surface_commands(STREAM s)
+{
+	uint16 type;
+
+	while (s_check_rem(s, 2))
+	{
+		in_uint16_le(s, type);	/* cmdType */
+		switch (type)
+		{
+			case CMDTYPE_SET_SURFACE_BITS:
+			case CMDTYPE_STREAM_SURFACE_BITS:
+				process_surface_bits(s);
+				break;
+
+			case CMDTYPE_FRAME_MARKER:
+				in_uint8s(s, 6);	/* frameAction, frameId */
+				break;
+
+			default:
+				/* the length of the rest is not known */
+				logger(Protocol, Warning, "%s(), unhandled command %d", __func__,
+				       type);
+				return;
+		}
 	}
 }
 
@@ -1606,7 +2470,7 @@ process_palette(STREAM s)
 	in_uint16_le(s, map.ncolours);
 	in_uint8s(s, 2);	/* pad */
 
-	map.colours = (COLOURENTRY *) xmalloc(sizeof(COLOURENTRY) * map.ncolours);
+	map.colours = (COLOURENTRY *) s_arena_alloc(sizeof(COLOURENTRY) * map.ncolours);
 
 	logger(Graphics, Debug, "process_palette(), colour count %d", map.ncolours);
 
@@ -1620,8 +2484,6 @@ process_palette(STREAM s)
 
 	hmap = ui_create_colourmap(&map);
 	ui_set_colourmap(hmap);
-
-	xfree(map.colours);
 }
 
 /* Process an update PDU */
@@ -1663,6 +2525,8 @@ process_update_pdu(STREAM s)
 			       update_type);
 	}
 	ui_end_update();
+	if (update_type == RDP_UPDATE_ORDERS || update_type == RDP_UPDATE_BITMAP)
+		rdp_connect_phase(CONNECT_PHASE_FIRST_PAINT);
 }
 
 
@@ -1760,9 +2624,6 @@ process_data_pdu(STREAM s, uint32 * ext_disc_reason)
 	uint32 len;
 
 	uint8 *buf;
-	uint32 roff, rlen;
-
-	struct stream *ns = &(g_mppc_dict.ns);
 
 	in_uint8s(s, 6);	/* shareid, pad, streamid */
 	in_uint16_le(s, len);
@@ -1777,23 +2638,13 @@ process_data_pdu(STREAM s, uint32 * ext_disc_reason)
 			logger(Protocol, Error,
 			       "process_data_pdu(), error decompressed packet size exceeds max");
 		in_uint8p(s, buf, clen);
-		if (mppc_expand(buf, clen, ctype, &roff, &rlen) == -1)
+		s = mppc_decompress(buf, clen, ctype);
+		if (s == NULL)
+		{
 			logger(Protocol, Error,
 			       "process_data_pdu(), error while decompressing packet");
-
-		/* len -= 18; */
-
-		/* allocate memory and copy the uncompressed data into the temporary stream */
-		s_realloc(ns, rlen);
-		s_reset(ns);
-
-		out_uint8a(ns, (unsigned char *) (g_mppc_dict.hist + roff), rlen);
-
-		s_mark_end(ns);
-		s_seek(ns, 0);
-		s_push_layer(ns, rdp_hdr, 0);
-
-		s = ns;
+			return False;
+		}
 	}
 
 	switch (data_pdu_type)
@@ -2086,16 +2937,94 @@ rdp_loop(RD_BOOL * deactivated, uint32 * ext_disc_reason)
 					memset(g_password, 0, sizeof(g_password));
 
 				process_data_pdu(s, ext_disc_reason);
+				s_arena_reset();
 				break;
 			default:
 				logger(Protocol, Warning,
 				       "rdp_loop(), unhandled PDU type %d received", type);
 		}
+		pstcache_preload_step();
+		rdp_update_priority();
 		cont = g_next_packet < s_length(s);
 	}
 	return True;
 }
 
+static const char *g_connect_phase_names[CONNECT_PHASES] = {
+	"start", "dns", "tcp", "x224", "tls", "credssp", "mcs", "licence", "capabilities",
+	"first_paint"
+};
+
+/* When each phase of the last connection was reached, 0 if not (yet) */
+static uint64 g_connect_phase_usec[CONNECT_PHASES];
+static RD_BOOL g_connecting = False;
+
+static uint64
+connect_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 + 1;
+}
+
+/* Note the time a phase of connecting was reached. Only the first time
+   counts, such as for TCP when negotiation is retried, and nothing
+   once the first update has been drawn. */
+void
+rdp_connect_phase(connect_phase_t phase)
+{
+	char buf[320];
+
+	if (phase == CONNECT_PHASE_START)
+	{
+		memset(g_connect_phase_usec, 0, sizeof(g_connect_phase_usec));
+		g_connecting = True;
+	}
+	else if (!g_connecting || g_connect_phase_usec[phase] != 0)
+	{
+		return;
+	}
+
+	g_connect_phase_usec[phase] = connect_clock();
+
+	if (phase == CONNECT_PHASE_FIRST_PAINT)
+	{
+		g_connecting = False;
+		if (rdp_format_connect_stats(0, buf, sizeof(buf)))
+			logger(Protocol, Verbose, "Connection phases in ms: %s", buf);
+	}
+}
+
+/* Format the time each phase of the last connection took into buf,
+   in ms since the phase before it. Phases not gone through, such as
+   CredSSP without NLA, are left out. */
+RD_BOOL
+rdp_format_connect_stats(int n, char *buf, size_t size)
+{
+	uint64 last;
+	size_t len = 0;
+	int i;
+
+	if (n != 0 || g_connect_phase_usec[CONNECT_PHASE_START] == 0)
+		return False;
+
+	buf[0] = '\0';
+	last = g_connect_phase_usec[CONNECT_PHASE_START];
+	for (i = CONNECT_PHASE_START + 1; i < CONNECT_PHASES && len < size; i++)
+	{
+		if (g_connect_phase_usec[i] == 0)
+			continue;
+		len += snprintf(buf + len, size - len, "%s=%u ", g_connect_phase_names[i],
+				(unsigned) ((g_connect_phase_usec[i] - last) / 1000));
+		last = MAX(last, g_connect_phase_usec[i]);
+	}
+	if (len < size)
+		snprintf(buf + len, size - len, "total=%u",
+			 (unsigned) ((last - g_connect_phase_usec[CONNECT_PHASE_START]) / 1000));
+	return True;
+}
+
 /* Establish a connection up to the RDP layer */
 RD_BOOL
 rdp_connect(char *server, uint32 flags, char *domain, char *password,
@@ -2104,9 +3033,11 @@ rdp_connect(char *server, uint32 flags, char *domain, char *password,
 	RD_BOOL deactivated = False;
 	uint32 ext_disc_reason = 0;
 
+	rdp_connect_phase(CONNECT_PHASE_START);
 	if (!sec_connect(server, g_username, domain, password, reconnect))
 		return False;
 
+	g_rdp_compression = (flags & RDP_INFO_COMPRESSION) ? True : False;
 	rdp_send_client_info_pdu(flags, domain, g_username, password, command, directory);
 
 	/* run RDP loop until first licence demand active PDU */
@@ -2133,6 +3064,8 @@ rdp_reset_state(void)
 	g_rdp_shareid = 0;
 	g_exit_mainloop = False;
 	g_first_bitmap_caps = True;
+	g_fastpath_input = False;
+	g_input_queue_len = 0;
 	sec_reset_state();
 }
 
@@ -23,8 +23,58 @@
 
 extern size_t g_next_packet;
 
-extern RDPCOMP g_mppc_dict;
+/* MaxRequestSize of the multifragment update capability we sent */
+uint32 g_fp_max_request_size = RDESKTOP_FASTPATH_MULTIFRAGMENT_MAX_SIZE;
+
+/* Fragmented updates are not interleaved, so one buffer collects the
+   fragments of whichever update is in progress. It grows as needed, up
+   to the MaxRequestSize we advertise, and is kept for the next one. */
+static STREAM g_fp_assembly = NULL;
+static int g_fp_assembly_code = -1;
+
+/* Append a fragment of an update, returns the whole update once its last
+   fragment is in, NULL otherwise */
+static STREAM
+fp_assemble(STREAM s, uint8 code, uint8 frag, uint16 length)
+{
+	size_t size;
+
+	if (frag == FASTPATH_FRAGMENT_FIRST)
+	{
+		if (g_fp_assembly == NULL)
+			g_fp_assembly = s_alloc(MAX(length, 4096));
+		s_reset(g_fp_assembly);
+		g_fp_assembly_code = code;
+	}
+	else if (g_fp_assembly_code != code)
+	{
+		logger(Protocol, Warning,
+		       "fp_assemble(), dropping fragment of update %d without a start", code);
+		return NULL;
+	}
 
+	size = s_tell(g_fp_assembly) + length;
+	if (size > g_fp_max_request_size)
+	{
+		logger(Protocol, Error, "fp_assemble(), update %d exceeds %d bytes, dropping it",
+		       code, g_fp_max_request_size);
+		g_fp_assembly_code = -1;
+		return NULL;
+	}
+
+	if (size > g_fp_assembly->size)
+		s_realloc(g_fp_assembly, MIN(MAX(size, g_fp_assembly->size * 2),
+					     g_fp_max_request_size));
+	out_uint8stream(g_fp_assembly, s, length);
+
+	if (frag != FASTPATH_FRAGMENT_LAST)
+		return NULL;
+
+	g_fp_assembly_code = -1;
+	s_mark_end(g_fp_assembly);
+	s_seek(g_fp_assembly, 0);
+	return g_fp_assembly;
+}
 
 static void
 process_ts_fp_update_by_code(STREAM s, uint8 code)
@@ -47,6 +97,9 @@ process_ts_fp_update_by_code(STREAM s, uint8 code)
 			break;
 		case FASTPATH_UPDATETYPE_SYNCHRONIZE:
 			break;
+		case FASTPATH_UPDATETYPE_SURFCMDS:
+			process_surface_commands(s);
+			break;
 		case FASTPATH_UPDATETYPE_PTR_NULL:
 			ui_set_null_cursor();
 			break;
@@ -54,8 +107,9 @@ process_ts_fp_update_by_code(STREAM s, uint8 code)
 			set_system_pointer(SYSPTR_DEFAULT);
 			break;
 		case FASTPATH_UPDATETYPE_PTR_POSITION:
-			in_uint16_le(s, x);
-			in_uint16_le(s, y);
+			s_assert_r(s, 4);
+			in_uint16_le_nc(s, x);
+			in_uint16_le_nc(s, y);
 			ui_move_pointer(x, y);
 			break;
 		case FASTPATH_UPDATETYPE_COLOR:
@@ -81,11 +135,8 @@ process_ts_fp_updates(STREAM s)
 	size_t next;
 
 	uint8 *buf;
-	uint32 roff, rlen;
-	struct stream *ns = &(g_mppc_dict.ns);
 	struct stream *ts;
-
-	static STREAM assembled[16] = { 0 };
+	RD_BOOL drawn = False;
 
 	ui_begin_update();
 	while (!s_check_end(s))
@@ -96,32 +147,30 @@ process_ts_fp_updates(STREAM s)
 		frag = hdr & 0x30;	/*  |- fragmentation */
 		comp = hdr & 0xC0;	/*  `- compression */
 
+		if (code == FASTPATH_UPDATETYPE_ORDERS || code == FASTPATH_UPDATETYPE_BITMAP ||
+		    code == FASTPATH_UPDATETYPE_SURFCMDS)
+			drawn = True;
+
+		s_assert_r(s, (comp & FASTPATH_OUTPUT_COMPRESSION_USED) ? 3 : 2);
 		if (comp & FASTPATH_OUTPUT_COMPRESSION_USED)
-			in_uint8(s, ctype);	/* compressionFlags */
+			in_uint8_nc(s, ctype);	/* compressionFlags */
 
-		in_uint16_le(s, length);	/* length */
+		in_uint16_le_nc(s, length);	/* length */
 
 		g_next_packet = next = s_tell(s) + length;
 
 		if (ctype & RDP_MPPC_COMPRESSED)
 		{
 			in_uint8p(s, buf, length);
-			if (mppc_expand(buf, length, ctype, &roff, &rlen) == -1)
+			ts = mppc_decompress(buf, length, ctype);
+			if (ts == NULL)
+			{
 				logger(Protocol, Error,
 				       "process_ts_fp_update_pdu(), error while decompressing packet");
-
-			/* allocate memory and copy the uncompressed data into the temporary stream */
-			s_realloc(ns, rlen);
-			s_reset(ns);
-
-			out_uint8a(ns, (unsigned char *) (g_mppc_dict.hist + roff), rlen);
-
-			s_mark_end(ns);
-			s_seek(ns, 0);
-			s_push_layer(ns, rdp_hdr, 0);
-
-			length = rlen;
-			ts = ns;
+				s_seek(s, next);
+				continue;
+			}
+			length = s_length(ts);
 		}
 		else
 			ts = s;
@@ -132,27 +181,14 @@ process_ts_fp_updates(STREAM s)
 		}
 		else		/* Fragmented packet, we must reassemble */
 		{
-			if (assembled[code] == NULL)
-			{
-				assembled[code] = s_alloc(RDESKTOP_FASTPATH_MULTIFRAGMENT_MAX_SIZE);
-			}
-
-			if (frag == FASTPATH_FRAGMENT_FIRST)
-			{
-				s_reset(assembled[code]);
-			}
-
-			out_uint8stream(assembled[code], ts, length);
-
-			if (frag == FASTPATH_FRAGMENT_LAST)
-			{
-				s_mark_end(assembled[code]);
-				s_seek(assembled[code], 0);
-				process_ts_fp_update_by_code(assembled[code], code);
-			}
+			ts = fp_assemble(ts, code, frag, length);
+			if (ts != NULL)
+				process_ts_fp_update_by_code(ts, code);
 		}
 
 		s_seek(s, next);
 	}
 	ui_end_update();
+	if (drawn)
+		rdp_connect_phase(CONNECT_PHASE_FIRST_PAINT);
 }
@@ -42,7 +42,10 @@
 #include <dirent.h>		/* opendir, closedir, readdir */
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include "rdesktop.h"
+#include "disk.h"
 
 #define IRP_MJ_CREATE			0x00
 #define IRP_MJ_CLOSE			0x02
@@ -66,14 +69,11 @@ extern DEVICE_FNS disk_fns;
 #ifdef WITH_SCARD
 extern DEVICE_FNS scard_fns;
 #endif
-extern FILEINFO g_fileinfo[];
 extern RD_BOOL g_notify_stamp;
 
 static VCHANNEL *rdpdr_channel;
 static uint32 g_epoch;
 
-/* If select() times out, the request for the device with handle g_min_timeout_fd is aborted */
-RD_NTHANDLE g_min_timeout_fd;
 uint32 g_num_devices;
 
 uint32 g_client_id;
@@ -84,20 +84,29 @@ char *g_rdpdr_clientname = NULL;
 
 /* Used to store incoming io request, until they are ready to be completed */
 /* using a linked list ensures that they are processed in the right order, */
-/* if multiple IOs are being done on the same FD */
+/* if multiple IOs are being done on the same FD. The list is also hashed */
+/* by file handle, so that the requests of a handle are found quickly. */
+#define IOREQUEST_BUCKETS	64
+
 struct async_iorequest
 {
 	uint32 fd, major, minor, device, id, length, partial_len;
 	uint64 offset;
 	long timeout,		/* Total timeout */
 	  itv_timeout;		/* Interval timeout (between serial characters) */
+	struct timeval deadline,	/* when the total timeout expires, if set */
+	  itv_deadline;		/* when the interval timeout expires, if set */
 	uint8 *buffer;
 	DEVICE_FNS *fns;
 
 	struct async_iorequest *next;	/* next element in list */
+	struct async_iorequest *prev;	/* previous element in list */
+	struct async_iorequest *hnext;	/* next element with the same hash */
 };
 
 struct async_iorequest *g_iorequest;
+static struct async_iorequest *g_iorequest_tail;
+static struct async_iorequest *g_iorequest_hash[IOREQUEST_BUCKETS];
 
 /* Return device_id for a given handle */
 int
@@ -137,46 +146,76 @@ rdpdr_handle_ok(uint32 device, RD_NTHANDLE handle)
 				return False;
 			break;
 		case DEVICE_TYPE_DISK:
-			if (g_fileinfo[handle].device_id != device)
+			if (disk_fileinfo(handle) == NULL ||
+			    disk_fileinfo(handle)->device_id != device)
 				return False;
 			break;
 	}
 	return True;
 }
 
+static void
+rdpdr_set_deadline(struct timeval *deadline, uint32 ms)
+{
+	struct timeval now, timeout;
+
+	gettimeofday(&now, NULL);
+	timeout.tv_sec = ms / 1000;
+	timeout.tv_usec = (ms % 1000) * 1000;
+	timeradd(&now, &timeout, deadline);
+}
+
+static RD_BOOL
+rdpdr_deadline_passed(const struct timeval *deadline, const struct timeval *now)
+{
+	return timerisset(deadline) && !timercmp(now, deadline, <);
+}
+
+/* Shorten tv to the time left until deadline, if it is set */
+static void
+rdpdr_limit_timeout(const struct timeval *deadline, const struct timeval *now,
+		    struct timeval *tv, RD_BOOL * timeout)
+{
+	struct timeval left;
+
+	if (!timerisset(deadline))
+		return;
+
+	if (timercmp(deadline, now, <))
+		timerclear(&left);
+	else
+		timersub(deadline, now, &left);
+
+	if (timercmp(&left, tv, <))
+		*tv = left;
+	*timeout = True;
+}
+
 /* Add a new io request to the table containing pending io requests so it won't block rdesktop */
 static RD_BOOL
 add_async_iorequest(uint32 device, uint32 file, uint32 id, uint32 major, uint32 length,
 		    DEVICE_FNS * fns, uint32 total_timeout, uint32 interval_timeout, uint8 * buffer,
 		    uint64 offset)
 {
-	struct async_iorequest *iorq;
+	struct async_iorequest *iorq, **phash;
 
-	if (g_iorequest == NULL)
-	{
-		g_iorequest = (struct async_iorequest *) xmalloc(sizeof(struct async_iorequest));
-		if (!g_iorequest)
-			return False;
-		g_iorequest->fd = 0;
-		g_iorequest->next = NULL;
-	}
+	iorq = (struct async_iorequest *) xmalloc(sizeof(struct async_iorequest));
+	if (!iorq)
+		return False;
 
-	iorq = g_iorequest;
+	iorq->next = NULL;
+	iorq->prev = g_iorequest_tail;
+	if (g_iorequest_tail)
+		g_iorequest_tail->next = iorq;
+	else
+		g_iorequest = iorq;
+	g_iorequest_tail = iorq;
+
+	iorq->hnext = NULL;
+	for (phash = &g_iorequest_hash[file % IOREQUEST_BUCKETS]; *phash != NULL;
+	     phash = &(*phash)->hnext);
+	*phash = iorq;
 
-	while (iorq->fd != 0)
-	{
-		/* create new element if needed */
-		if (iorq->next == NULL)
-		{
-			iorq->next =
-				(struct async_iorequest *) xmalloc(sizeof(struct async_iorequest));
-			if (!iorq->next)
-				return False;
-			iorq->next->fd = 0;
-			iorq->next->next = NULL;
-		}
-		iorq = iorq->next;
-	}
 	iorq->device = device;
 	iorq->fd = file;
 	iorq->id = id;
@@ -186,6 +225,10 @@ add_async_iorequest(uint32 device, uint32 file, uint32 id, uint32 major, uint32
 	iorq->fns = fns;
 	iorq->timeout = total_timeout;
 	iorq->itv_timeout = interval_timeout;
+	timerclear(&iorq->deadline);
+	timerclear(&iorq->itv_deadline);
+	if (total_timeout)
+		rdpdr_set_deadline(&iorq->deadline, total_timeout);
 	iorq->buffer = buffer;
 	iorq->offset = offset;
 	return True;
@@ -362,12 +405,95 @@ rdpdr_send_client_device_list_announce(void)
 	s_free(s);
 }
 
+/* Latency of IRPs from arrival to completion. The arrival times are
+   kept by the low bits of the IRP id, which the server hands out in
+   sequence; an IRP outstanding for longer than it takes the ids to
+   wrap around simply goes unaccounted. Completions may come from the
+   smart card threads, hence the lock. */
+#define IRP_LATENCY_SLOTS	256
+#define IRP_LATENCY_BUCKETS	5
+
+static const char *irp_latency_names[IRP_LATENCY_BUCKETS] =
+	{ "lt_1ms", "lt_10ms", "lt_100ms", "lt_1s", "ge_1s" };
+
+static pthread_mutex_t g_irp_latency_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct
+{
+	uint32 id;
+	RD_BOOL pending;
+	struct timespec start;
+} g_irp_started[IRP_LATENCY_SLOTS];
+static unsigned long g_irp_latency[IRP_LATENCY_BUCKETS];
+
+static void
+rdpdr_irp_started(uint32 id)
+{
+	int slot = id % IRP_LATENCY_SLOTS;
+
+	pthread_mutex_lock(&g_irp_latency_lock);
+	g_irp_started[slot].id = id;
+	g_irp_started[slot].pending = True;
+	clock_gettime(CLOCK_MONOTONIC, &g_irp_started[slot].start);
+	pthread_mutex_unlock(&g_irp_latency_lock);
+}
+
+static void
+rdpdr_irp_completed(uint32 id)
+{
+	int slot = id % IRP_LATENCY_SLOTS;
+	struct timespec now;
+	long long usec;
+	int bucket;
+
+	pthread_mutex_lock(&g_irp_latency_lock);
+	if (g_irp_started[slot].pending && g_irp_started[slot].id == id)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		usec = (now.tv_sec - g_irp_started[slot].start.tv_sec) * 1000000LL +
+			(now.tv_nsec - g_irp_started[slot].start.tv_nsec) / 1000;
+		for (bucket = 0, usec /= 1000; usec > 0 && bucket < IRP_LATENCY_BUCKETS - 1;
+		     usec /= 10)
+			bucket++;
+		g_irp_latency[bucket]++;
+		g_irp_started[slot].pending = False;
+	}
+	pthread_mutex_unlock(&g_irp_latency_lock);
+}
+
+/* Format the IRP latency histogram into buf */
+RD_BOOL
+rdpdr_format_stats(int n, char *buf, size_t size)
+{
+	int i, len;
+
+	if (n != 0)
+		return False;
+
+	pthread_mutex_lock(&g_irp_latency_lock);
+	len = snprintf(buf, size, "irp_latency");
+	for (i = 0; i < IRP_LATENCY_BUCKETS && len > 0 && (size_t) len < size; i++)
+		len += snprintf(buf + len, size - len, " %s=%lu", irp_latency_names[i],
+				g_irp_latency[i]);
+	pthread_mutex_unlock(&g_irp_latency_lock);
+	return True;
+}
+
+void
+rdpdr_reset_stats(void)
+{
+	pthread_mutex_lock(&g_irp_latency_lock);
+	memset(g_irp_latency, 0, sizeof(g_irp_latency));
+	pthread_mutex_unlock(&g_irp_latency_lock);
+}
+
 void
 rdpdr_send_completion(uint32 device, uint32 id, uint32 status, uint32 result, uint8 * buffer,
 		      uint32 length)
 {
 	STREAM s;
 
+	rdpdr_irp_completed(id);
+
 #ifdef WITH_SCARD
 	scard_lock(SCARD_LOCK_RDPDR);
 #endif
@@ -401,6 +527,306 @@ rdpdr_send_completion(uint32 device, uint32 id, uint32 status, uint32 result, ui
 #endif
 }
 
+/* Disk IRPs that may block on slow storage are run by a small pool of
+   worker threads, so that the session stays responsive while a drive
+   is busy. The IRPs of one handle are run one at a time and in the
+   order they arrived, and any other IRP on that handle waits for them.
+   Finished jobs are collected by the main loop, which is woken up
+   through a pipe, and completed from there. */
+#define DISK_WORKER_THREADS 4
+
+typedef struct disk_job
+{
+	uint32 epoch, device, file, id, major, info_level, length;
+	uint64 offset;
+	uint8 *data;		/* data to write */
+	char *pattern;		/* pattern of a directory query */
+
+	RD_NTSTATUS status;
+	uint32 result;
+	STREAM out;
+
+	struct disk_job *next;
+}
+DISK_JOB;
+
+static pthread_mutex_t g_disk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_disk_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_disk_finished = PTHREAD_COND_INITIALIZER;
+static DISK_JOB *g_disk_queue = NULL;
+static DISK_JOB *g_disk_done = NULL;
+static DISK_JOB **g_disk_done_tail = &g_disk_done;
+/* Number of worker threads, -1 until the pool has been started */
+static int g_disk_threads = -1;
+static int g_disk_pipe[2] = { -1, -1 };
+
+/* Must be called with g_disk_lock held. Takes the oldest job of a
+   handle that has none running. */
+static DISK_JOB *
+disk_job_pop(void)
+{
+	DISK_JOB **pjob, *job;
+
+	for (pjob = &g_disk_queue; *pjob != NULL; pjob = &(*pjob)->next)
+	{
+		job = *pjob;
+		if (disk_fileinfo(job->file)->io_running)
+			continue;
+
+		*pjob = job->next;
+		job->next = NULL;
+		disk_fileinfo(job->file)->io_running = True;
+		return job;
+	}
+
+	return NULL;
+}
+
+static void
+disk_job_run(DISK_JOB * job)
+{
+	uint8 *buffer;
+
+	switch (job->major)
+	{
+		case IRP_MJ_READ:
+			job->out = s_alloc(job->length);
+			out_uint8p(job->out, buffer, job->length);
+			job->status = disk_fns.read(job->file, buffer, job->length, job->offset,
+						    &job->result);
+			/* Might have read less */
+			s_mark_end(job->out);
+			s_seek(job->out, job->result);
+			s_mark_end(job->out);
+			break;
+
+		case IRP_MJ_WRITE:
+			job->status = disk_fns.write(job->file, job->data, job->length, job->offset,
+						     &job->result);
+			job->out = s_alloc(1);
+			out_uint8(job->out, 0);
+			s_mark_end(job->out);
+			break;
+
+		case IRP_MJ_QUERY_INFORMATION:
+			job->out = s_alloc(1024);
+			job->status = disk_query_information(job->file, job->info_level, job->out);
+			s_mark_end(job->out);
+			job->result = s_length(job->out);
+			break;
+
+		case IRP_MJ_QUERY_VOLUME_INFORMATION:
+			job->out = s_alloc(1024);
+			job->status =
+				disk_query_volume_information(job->file, job->info_level, job->out);
+			s_mark_end(job->out);
+			job->result = s_length(job->out);
+			break;
+
+		case IRP_MJ_DIRECTORY_CONTROL:
+			job->out = s_alloc(1024);
+			job->status = disk_query_directory(job->file, job->info_level, job->pattern,
+							   job->out);
+			s_mark_end(job->out);
+			if (!s_length(job->out))
+			{
+				out_uint8(job->out, 0);
+				s_mark_end(job->out);
+			}
+			job->result = s_length(job->out);
+			break;
+	}
+}
+
+static void *
+disk_worker(void *arg)
+{
+	DISK_JOB *job;
+	RD_BOOL wakeup;
+	char c = 0;
+
+	UNUSED(arg);
+
+	pthread_mutex_lock(&g_disk_lock);
+	while (1)
+	{
+		job = disk_job_pop();
+		if (job == NULL)
+		{
+			pthread_cond_wait(&g_disk_queued, &g_disk_lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&g_disk_lock);
+		disk_job_run(job);
+		pthread_mutex_lock(&g_disk_lock);
+
+		disk_fileinfo(job->file)->io_running = False;
+		disk_fileinfo(job->file)->io_pending--;
+
+		wakeup = g_disk_done == NULL;
+		*g_disk_done_tail = job;
+		g_disk_done_tail = &job->next;
+
+		/* the next job of the handle may now be taken */
+		pthread_cond_broadcast(&g_disk_queued);
+		pthread_cond_broadcast(&g_disk_finished);
+
+		if (wakeup && write(g_disk_pipe[1], &c, 1) != 1)
+			logger(Core, Warning, "disk_worker(), failed to wake up the main loop");
+	}
+
+	return NULL;
+}
+
+static void
+disk_pool_start(void)
+{
+	pthread_t thread;
+	int i;
+
+	g_disk_threads = 0;
+	if (pipe(g_disk_pipe) != 0)
+	{
+		logger(Core, Warning, "disk_pool_start(), pipe() failed: %s", strerror(errno));
+		return;
+	}
+	fcntl(g_disk_pipe[0], F_SETFL, O_NONBLOCK);
+
+	for (i = 0; i < DISK_WORKER_THREADS; i++)
+	{
+		if (pthread_create(&thread, NULL, disk_worker, NULL) != 0)
+		{
+			logger(Core, Warning, "disk_pool_start(), failed to create worker thread");
+			break;
+		}
+		pthread_detach(thread);
+		g_disk_threads++;
+	}
+
+	if (g_disk_threads != 0)
+		evloop_add_fd(g_disk_pipe[0], EVLOOP_READ);
+
+	logger(Core, Debug, "disk_pool_start(), using %d disk threads", g_disk_threads);
+}
+
+/* Returns True for the disk IRPs that are run by the worker pool */
+static RD_BOOL
+disk_job_major(uint32 major, uint32 minor)
+{
+	switch (major)
+	{
+		case IRP_MJ_READ:
+		case IRP_MJ_WRITE:
+		case IRP_MJ_QUERY_INFORMATION:
+		case IRP_MJ_QUERY_VOLUME_INFORMATION:
+			return True;
+		case IRP_MJ_DIRECTORY_CONTROL:
+			return minor == IRP_MN_QUERY_DIRECTORY;
+	}
+	return False;
+}
+
+/* Hand a disk IRP to the worker pool, which takes over data and
+   pattern. Returns False if there is no pool to run it. */
+static RD_BOOL
+disk_job_queue(uint32 device, uint32 file, uint32 id, uint32 major, uint32 info_level,
+	       uint32 length, uint64 offset, uint8 * data, char *pattern)
+{
+	DISK_JOB *job, **pjob;
+
+	if (g_disk_threads == -1)
+		disk_pool_start();
+
+	if (g_disk_threads == 0 || disk_fileinfo(file) == NULL)
+		return False;
+
+	job = xmalloc(sizeof(DISK_JOB));
+	memset(job, 0, sizeof(DISK_JOB));
+	job->epoch = g_epoch;
+	job->device = device;
+	job->file = file;
+	job->id = id;
+	job->major = major;
+	job->info_level = info_level;
+	job->length = length;
+	job->offset = offset;
+	job->data = data;
+	job->pattern = pattern;
+
+	pthread_mutex_lock(&g_disk_lock);
+	for (pjob = &g_disk_queue; *pjob != NULL; pjob = &(*pjob)->next);
+	*pjob = job;
+	disk_fileinfo(file)->io_pending++;
+	pthread_cond_signal(&g_disk_queued);
+	pthread_mutex_unlock(&g_disk_lock);
+
+	return True;
+}
+
+/* Send the completions of the jobs the workers are done with */
+static void
+disk_jobs_complete(void)
+{
+	DISK_JOB *job, *next;
+	uint8 *buffer;
+	char c[64];
+
+	if (g_disk_threads <= 0)
+		return;
+
+	while (read(g_disk_pipe[0], c, sizeof(c)) > 0);
+
+	pthread_mutex_lock(&g_disk_lock);
+	job = g_disk_done;
+	g_disk_done = NULL;
+	g_disk_done_tail = &g_disk_done;
+	pthread_mutex_unlock(&g_disk_lock);
+
+	for (; job != NULL; job = next)
+	{
+		next = job->next;
+
+		/* requests of a previous connection are not answered */
+		if (job->epoch == g_epoch)
+		{
+			s_seek(job->out, 0);
+			in_uint8p(job->out, buffer, s_length(job->out));
+			rdpdr_send_completion(job->device, job->id, job->status, job->result,
+					      buffer, s_length(job->out));
+		}
+
+		s_free(job->out);
+		xfree(job->data);
+		free(job->pattern);
+		xfree(job);
+	}
+}
+
+/* Wait for the jobs of a handle, so that an IRP run right away does not
+   overtake them */
+static void
+disk_jobs_wait(uint32 file)
+{
+	FILEINFO *pfinfo;
+
+	pfinfo = disk_fileinfo(file);
+	if (g_disk_threads <= 0 || pfinfo == NULL)
+		return;
+
+	pthread_mutex_lock(&g_disk_lock);
+	if (pfinfo->io_pending == 0)
+	{
+		pthread_mutex_unlock(&g_disk_lock);
+		return;
+	}
+	while (pfinfo->io_pending != 0)
+		pthread_cond_wait(&g_disk_finished, &g_disk_lock);
+	pthread_mutex_unlock(&g_disk_lock);
+
+	disk_jobs_complete();
+}
+
 /* Processes a DR_DEVICE_IOREQUEST (minus the leading header field) */
 static void
 rdpdr_process_irp(STREAM s)
@@ -435,6 +861,8 @@ rdpdr_process_irp(STREAM s)
 	in_uint32_le(s, major);
 	in_uint32_le(s, minor);
 
+	rdpdr_irp_started(id);
+
 	filename = NULL;
 
 	out = NULL;
@@ -464,6 +892,7 @@ rdpdr_process_irp(STREAM s)
 		case DEVICE_TYPE_PRINTER:
 
 			fns = &printer_fns;
+			rw_blocking = False;
 			break;
 
 		case DEVICE_TYPE_DISK:
@@ -485,6 +914,9 @@ rdpdr_process_irp(STREAM s)
 			return;
 	}
 
+	if (fns == &disk_fns && !disk_job_major(major, minor))
+		disk_jobs_wait(file);
+
 	switch (major)
 	{
 		case IRP_MJ_CREATE:
@@ -552,6 +984,13 @@ rdpdr_process_irp(STREAM s)
 				break;
 			}
 
+			if (fns == &disk_fns &&
+			    disk_job_queue(device, file, id, major, 0, length, offset, NULL, NULL))
+			{
+				status = RD_STATUS_PENDING;
+				break;
+			}
+
 			if (rw_blocking)	/* Complete read immediately */
 			{
 				uint8* buffer;
@@ -627,6 +1066,13 @@ rdpdr_process_irp(STREAM s)
 
 			in_uint8a(s, pst_buf, length);
 
+			if (fns == &disk_fns &&
+			    disk_job_queue(device, file, id, major, 0, length, offset, pst_buf, NULL))
+			{
+				status = RD_STATUS_PENDING;
+				break;
+			}
+
 			if (add_async_iorequest
 			    (device, file, id, major, length, fns, 0, 0, pst_buf, offset))
 			{
@@ -646,6 +1092,12 @@ rdpdr_process_irp(STREAM s)
 			}
 			in_uint32_le(s, info_level);
 
+			if (disk_job_queue(device, file, id, major, info_level, 0, 0, NULL, NULL))
+			{
+				status = RD_STATUS_PENDING;
+				break;
+			}
+
 			out = s_alloc(1024);
 			status = disk_query_information(file, info_level, out);
 			s_mark_end(out);
@@ -679,6 +1131,12 @@ rdpdr_process_irp(STREAM s)
 
 			in_uint32_le(s, info_level);
 
+			if (disk_job_queue(device, file, id, major, info_level, 0, 0, NULL, NULL))
+			{
+				status = RD_STATUS_PENDING;
+				break;
+			}
+
 			out = s_alloc(1024);
 			status = disk_query_volume_information(file, info_level, out);
 			s_mark_end(out);
@@ -708,6 +1166,13 @@ rdpdr_process_irp(STREAM s)
 							convert_to_unix_filename(filename);
 					}
 
+					if (disk_job_queue(device, file, id, major, info_level, 0, 0,
+							   NULL, filename))
+					{
+						status = RD_STATUS_PENDING;
+						break;
+					}
+
 					out = s_alloc(1024);
 					status = disk_query_directory(file, info_level, filename,
 								      out);
@@ -727,7 +1192,8 @@ rdpdr_process_irp(STREAM s)
 					/* JIF
 					   unimpl("IRP major=0x%x minor=0x%x: IRP_MN_NOTIFY_CHANGE_DIRECTORY\n", major, minor);  */
 
-					in_uint32_le(s, info_level);	/* notify mask */
+					in_uint8s(s, 1);	/* WatchTree */
+					in_uint32_le(s, info_level);	/* CompletionFilter */
 
 					status = disk_create_notify(file, info_level);
 					result = 0;
@@ -860,7 +1326,7 @@ rdpdr_send_client_capability_response(void)
 	out_uint32_le(s, ALL_RDPDR_IRP_MJ);	/* ioCode1 */
 	out_uint32_le(s, 0);	/* ioCode2 */
 	out_uint32_le(s, RDPDR_DEVICE_REMOVE_PDUS | RDPDR_CLIENT_DISPLAY_NAME_PDU);	/* extendedPDU */
-	out_uint32_le(s, 0);	/* extraFlags1 */
+	out_uint32_le(s, ENABLE_ASYNCIO);	/* extraFlags1, many IRPs may be outstanding */
 	out_uint32_le(s, 0);	/* extraFlags2 */
 
 	out_uint16_le(s, CAP_PRINTER_TYPE);	/* CapabilityType */
@@ -993,10 +1459,12 @@ rdpdr_init()
 void
 rdpdr_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv, RD_BOOL * timeout)
 {
-	uint32 select_timeout = 0;	/* Timeout value to be used for select() (in milliseconds). */
+	struct timeval now, event_tv = { 0, 5000 };
 	struct async_iorequest *iorq;
 	char c;
 
+	gettimeofday(&now, NULL);
+
 	iorq = g_iorequest;
 	while (iorq != NULL)
 	{
@@ -1013,31 +1481,11 @@ rdpdr_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv, RD_BOOL
 					FD_SET(iorq->fd, rfds);
 					*n = MAX(*n, (int) iorq->fd);
 
-					/* Check if io request timeout is smaller than current (but not 0). */
-					if (iorq->timeout
-					    && (select_timeout == 0
-						|| iorq->timeout < select_timeout))
-					{
-						/* Set new timeout */
-						select_timeout = iorq->timeout;
-						g_min_timeout_fd = iorq->fd;	/* Remember fd */
-						tv->tv_sec = select_timeout / 1000;
-						tv->tv_usec = (select_timeout % 1000) * 1000;
-						*timeout = True;
-						break;
-					}
-					if (iorq->itv_timeout && iorq->partial_len > 0
-					    && (select_timeout == 0
-						|| iorq->itv_timeout < select_timeout))
-					{
-						/* Set new timeout */
-						select_timeout = iorq->itv_timeout;
-						g_min_timeout_fd = iorq->fd;	/* Remember fd */
-						tv->tv_sec = select_timeout / 1000;
-						tv->tv_usec = (select_timeout % 1000) * 1000;
-						*timeout = True;
-						break;
-					}
+					/* Wake up when the io request times out */
+					rdpdr_limit_timeout(&iorq->deadline, &now, tv, timeout);
+					if (iorq->partial_len > 0)
+						rdpdr_limit_timeout(&iorq->itv_deadline, &now, tv,
+								    timeout);
 					break;
 
 				case IRP_MJ_WRITE:
@@ -1050,8 +1498,13 @@ rdpdr_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv, RD_BOOL
 					break;
 
 				case IRP_MJ_DEVICE_CONTROL:
-					if (select_timeout > 5)
-						select_timeout = 5;	/* serial event queue */
+					/* Poll the serial event queue of a waiting
+					   WAIT_ON_MASK request */
+					if (iorq->fns != &serial_fns)
+						break;
+					if (timercmp(&event_tv, tv, <))
+						*tv = event_tv;
+					*timeout = True;
 					break;
 
 			}
@@ -1065,9 +1518,20 @@ rdpdr_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv, RD_BOOL
 struct async_iorequest *
 rdpdr_remove_iorequest(struct async_iorequest *prev, struct async_iorequest *iorq)
 {
+	struct async_iorequest **phash;
+
 	if (!iorq)
 		return NULL;
 
+	for (phash = &g_iorequest_hash[iorq->fd % IOREQUEST_BUCKETS]; *phash != iorq;
+	     phash = &(*phash)->hnext);
+	*phash = iorq->hnext;
+
+	if (iorq->next)
+		iorq->next->prev = prev;
+	else
+		g_iorequest_tail = prev;
+
 	if (iorq->buffer)
 		xfree(iorq->buffer);
 	if (prev)
@@ -1099,53 +1563,12 @@ _rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
 	uint32 buffer_len;
 	struct stream out;
 	uint8 *buffer = NULL;
+	STREAM notify;
 
 
+	/* timeouts are dealt with by rdpdr_check_timeouts() */
 	if (timed_out)
-	{
-		/* check serial iv_timeout */
-
-		iorq = g_iorequest;
-		prev = NULL;
-		while (iorq != NULL)
-		{
-			if (iorq->fd == g_min_timeout_fd)
-			{
-				if ((iorq->partial_len > 0) &&
-				    (g_rdpdr_device[iorq->device].device_type ==
-				     DEVICE_TYPE_SERIAL))
-				{
-
-					/* iv_timeout between 2 chars, send partial_len */
-					/*printf("RDPDR: IVT total %u bytes read of %u\n", iorq->partial_len, iorq->length); */
-					rdpdr_send_completion(iorq->device,
-							      iorq->id, RD_STATUS_SUCCESS,
-							      iorq->partial_len,
-							      iorq->buffer, iorq->partial_len);
-					iorq = rdpdr_remove_iorequest(prev, iorq);
-					return;
-				}
-				else
-				{
-					break;
-				}
-
-			}
-			else
-			{
-				break;
-			}
-
-
-			prev = iorq;
-			if (iorq)
-				iorq = iorq->next;
-
-		}
-
-		rdpdr_abort_io(g_min_timeout_fd, 0, RD_STATUS_TIMEOUT);
 		return;
-	}
 
 	iorq = g_iorequest;
 	prev = NULL;
@@ -1174,6 +1597,9 @@ _rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
 						{
 							iorq->partial_len += result;
 							iorq->offset += result;
+							if (iorq->itv_timeout)
+								rdpdr_set_deadline(&iorq->itv_deadline,
+										   iorq->itv_timeout);
 						}
 
 						logger(Protocol, Debug,
@@ -1227,8 +1653,10 @@ _rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
 						/* only delete link if all data has been transfered */
 						/* or we couldn't write */
 						if ((iorq->partial_len == iorq->length)
-						    || (result == 0))
+						    || (result == 0 && status != RD_STATUS_PENDING))
 						{
+							if (status == RD_STATUS_PENDING)
+								status = RD_STATUS_SUCCESS;
 							logger(Protocol, Debug,
 							       "_rdpdr_check_fds(), AIO total %u bytes written of %u",
 							       iorq->partial_len, iorq->length);
@@ -1281,20 +1709,18 @@ _rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
 					    DEVICE_TYPE_DISK)
 					{
 
-						if (g_notify_stamp)
+						notify = s_alloc(4096);
+						status = disk_check_notify(iorq->fd, notify);
+						if (status != RD_STATUS_PENDING)
 						{
-							g_notify_stamp = False;
-							status = disk_check_notify(iorq->fd);
-							if (status != RD_STATUS_PENDING)
-							{
-								rdpdr_send_completion(iorq->device,
-										      iorq->id,
-										      status, 0,
-										      NULL, 0);
-								iorq = rdpdr_remove_iorequest(prev,
-											      iorq);
-							}
+							s_seek(notify, 0);
+							in_uint8p(notify, buffer, s_length(notify));
+							rdpdr_send_completion(iorq->device, iorq->id,
+									      status, s_length(notify),
+									      buffer, s_length(notify));
+							iorq = rdpdr_remove_iorequest(prev, iorq);
 						}
+						s_free(notify);
 					}
 					break;
 
@@ -1308,6 +1734,48 @@ _rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
 			iorq = iorq->next;
 	}
 
+	/* changes made through this client have been checked for */
+	g_notify_stamp = False;
+}
+
+/* Complete the io requests whose timeouts have passed. A serial read
+   returns what it got so far, anything else times out. */
+static void
+rdpdr_check_timeouts(void)
+{
+	struct async_iorequest *iorq, *prev, *next;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	iorq = g_iorequest;
+	prev = NULL;
+	while (iorq != NULL)
+	{
+		next = iorq->next;
+
+		if (!rdpdr_deadline_passed(&iorq->deadline, &now) &&
+		    !(iorq->partial_len > 0 && rdpdr_deadline_passed(&iorq->itv_deadline, &now)))
+		{
+			prev = iorq;
+			iorq = next;
+			continue;
+		}
+
+		if ((iorq->partial_len > 0) &&
+		    (g_rdpdr_device[iorq->device].device_type == DEVICE_TYPE_SERIAL))
+		{
+			rdpdr_send_completion(iorq->device, iorq->id, RD_STATUS_SUCCESS,
+					      iorq->partial_len, iorq->buffer, iorq->partial_len);
+		}
+		else
+		{
+			rdpdr_send_completion(iorq->device, iorq->id, RD_STATUS_TIMEOUT, 0,
+					      (uint8 *) "", 1);
+		}
+		rdpdr_remove_iorequest(prev, iorq);
+		iorq = next;
+	}
 }
 
 void
@@ -1315,6 +1783,9 @@ rdpdr_check_fds(fd_set * rfds, fd_set * wfds, RD_BOOL timed_out)
 {
 	fd_set dummy;
 
+	disk_jobs_complete();
+	disk_collect_notify();
+	rdpdr_check_timeouts();
 
 	FD_ZERO(&dummy);
 
@@ -1334,11 +1805,8 @@ rdpdr_abort_io(uint32 fd, uint32 major, RD_NTSTATUS status)
 {
 	uint32 result;
 	struct async_iorequest *iorq;
-	struct async_iorequest *prev;
 
-	iorq = g_iorequest;
-	prev = NULL;
-	while (iorq != NULL)
+	for (iorq = g_iorequest_hash[fd % IOREQUEST_BUCKETS]; iorq != NULL; iorq = iorq->hnext)
 	{
 		/* Only remove from table when major is not set, or when correct major is supplied.
 		   Abort read should not abort a write io request. */
@@ -1348,12 +1816,9 @@ rdpdr_abort_io(uint32 fd, uint32 major, RD_NTSTATUS status)
 			rdpdr_send_completion(iorq->device, iorq->id, status, result, (uint8 *) "",
 					      1);
 
-			iorq = rdpdr_remove_iorequest(prev, iorq);
+			rdpdr_remove_iorequest(iorq->prev, iorq);
 			return True;
 		}
-
-		prev = iorq;
-		iorq = iorq->next;
 	}
 
 	return False;
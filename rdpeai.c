@@ -0,0 +1,338 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Audio Input Redirection Virtual Channel Extension.
+   Copyright 2026 the rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Sound captured by the rdpsnd driver is sent to the server over the
+   AUDIO_INPUT dynamic channel. Of the formats the server offers, the
+   compressed ones rdpsnd_dsp can encode are put first in the reply, so
+   a server that takes the first it likes saves upstream bandwidth.
+   The driver captures PCM, which is encoded a packet at a time on the
+   main loop. A packet holds g_audio_capture_frame ms of sound, or what
+   the server asks for if that is more, so fewer and larger PDUs are
+   sent than the driver delivers. */
+
+#include "rdesktop.h"
+#include "rdpsnd.h"
+#include "rdpsnd_dsp.h"
+
+#define MSG_SNDIN_VERSION		0x01
+#define MSG_SNDIN_FORMATS		0x02
+#define MSG_SNDIN_OPEN			0x03
+#define MSG_SNDIN_OPEN_REPLY		0x04
+#define MSG_SNDIN_DATA_INCOMING		0x05
+#define MSG_SNDIN_DATA			0x06
+#define MSG_SNDIN_FORMATCHANGE		0x07
+
+#define SNDIN_VERSION_Version_1		0x00000001
+
+#define RDPEAI_CHANNEL_NAME "AUDIO_INPUT"
+#define RDPEAI_MAX_FORMATS 16
+
+extern unsigned int g_audio_capture_frame;
+
+/* The formats the client offered, and the PCM formats they are
+   captured in */
+static RD_WAVEFORMATEX rdpeai_formats[RDPEAI_MAX_FORMATS];
+static RD_WAVEFORMATEX rdpeai_capture_formats[RDPEAI_MAX_FORMATS];
+static unsigned int rdpeai_format_count;
+
+static unsigned int rdpeai_frames_per_packet;
+static unsigned int rdpeai_current_format;
+
+static void
+rdpeai_send(STREAM s)
+{
+	s_mark_end(s);
+	dvc_send(RDPEAI_CHANNEL_NAME, s);
+	s_free(s);
+}
+
+static void
+rdpeai_out_format(STREAM s, RD_WAVEFORMATEX * format)
+{
+	out_uint16_le(s, format->wFormatTag);
+	out_uint16_le(s, format->nChannels);
+	out_uint32_le(s, format->nSamplesPerSec);
+	out_uint32_le(s, format->nAvgBytesPerSec);
+	out_uint16_le(s, format->nBlockAlign);
+	out_uint16_le(s, format->wBitsPerSample);
+	out_uint16_le(s, format->cbSize);
+	out_uint8a(s, format->cb, format->cbSize);
+}
+
+static RD_BOOL
+rdpeai_in_format(STREAM s, RD_WAVEFORMATEX * format)
+{
+	uint16 cbsize;
+
+	if (!s_check_rem(s, 18))
+		return False;
+
+	in_uint16_le(s, format->wFormatTag);
+	in_uint16_le(s, format->nChannels);
+	in_uint32_le(s, format->nSamplesPerSec);
+	in_uint32_le(s, format->nAvgBytesPerSec);
+	in_uint16_le(s, format->nBlockAlign);
+	in_uint16_le(s, format->wBitsPerSample);
+	in_uint16_le(s, cbsize);
+
+	if (!s_check_rem(s, cbsize))
+		return False;
+
+	format->cbSize = MIN(cbsize, MAX_CBSIZE);
+	in_uint8a(s, format->cb, format->cbSize);
+	in_uint8s(s, cbsize - format->cbSize);
+
+	return True;
+}
+
+static void
+rdpeai_process_version(STREAM s)
+{
+	uint32 version;
+	STREAM out;
+
+	in_uint32_le(s, version);
+	logger(Sound, Debug, "rdpeai_process_version(), server version %u", version);
+
+	out = s_alloc(5);
+	out_uint8(out, MSG_SNDIN_VERSION);
+	out_uint32_le(out, SNDIN_VERSION_Version_1);
+	rdpeai_send(out);
+}
+
+/* Add the server formats that can be captured to the list, the
+   compressed ones when compressed is set and PCM otherwise */
+static void
+rdpeai_add_formats(RD_WAVEFORMATEX * offered, unsigned int count, RD_BOOL compressed)
+{
+	RD_WAVEFORMATEX pcm;
+	unsigned int i;
+
+	for (i = 0; i < count && rdpeai_format_count < RDPEAI_MAX_FORMATS; i++)
+	{
+		if ((offered[i].wFormatTag == WAVE_FORMAT_PCM) == compressed)
+			continue;
+
+		if (compressed)
+		{
+			if (!rdpsnd_dsp_decode_supported(&offered[i], &pcm))
+				continue;
+		}
+		else
+		{
+			if (offered[i].wBitsPerSample != 16 ||
+			    (offered[i].nChannels != 1 && offered[i].nChannels != 2))
+				continue;
+			pcm = offered[i];
+		}
+
+		rdpeai_formats[rdpeai_format_count] = offered[i];
+		rdpeai_capture_formats[rdpeai_format_count] = pcm;
+		rdpeai_format_count++;
+	}
+}
+
+static void
+rdpeai_process_formats(STREAM s)
+{
+	RD_WAVEFORMATEX offered[RDPEAI_MAX_FORMATS];
+	uint32 num_formats, i, size;
+	STREAM out;
+
+	in_uint32_le(s, num_formats);
+	in_uint8s(s, 4);	/* cbSizeFormatsPacket */
+
+	num_formats = MIN(num_formats, RDPEAI_MAX_FORMATS);
+	for (i = 0; i < num_formats; i++)
+		if (!rdpeai_in_format(s, &offered[i]))
+			break;
+	num_formats = i;
+
+	rdpeai_format_count = 0;
+	rdpeai_add_formats(offered, num_formats, True);
+	rdpeai_add_formats(offered, num_formats, False);
+
+	logger(Sound, Debug, "rdpeai_process_formats(), %u of %u formats supported",
+	       rdpeai_format_count, num_formats);
+
+	size = 9;
+	for (i = 0; i < rdpeai_format_count; i++)
+		size += 18 + rdpeai_formats[i].cbSize;
+
+	out = s_alloc(size);
+	out_uint8(out, MSG_SNDIN_FORMATS);
+	out_uint32_le(out, rdpeai_format_count);
+	out_uint32_le(out, size);	/* cbSizeFormatsPacket */
+	for (i = 0; i < rdpeai_format_count; i++)
+		rdpeai_out_format(out, &rdpeai_formats[i]);
+	rdpeai_send(out);
+}
+
+/* Encode and send a packet of captured sound */
+static void
+rdpeai_send_data(unsigned char *data, unsigned int size)
+{
+	RD_WAVEFORMATEX *format = &rdpeai_formats[rdpeai_current_format];
+	STREAM out, encoded = NULL;
+
+	/* the server has closed the channel */
+	if (!dvc_channels_is_available(RDPEAI_CHANNEL_NAME))
+	{
+		rdpsnd_capture_close();
+		return;
+	}
+
+	if (format->wFormatTag != WAVE_FORMAT_PCM)
+	{
+		encoded = rdpsnd_dsp_encode((sint16 *) data,
+					    size / rdpeai_capture_formats[rdpeai_current_format].
+					    nBlockAlign, format);
+		if (encoded == NULL)
+			return;
+		data = encoded->data;
+		size = s_length(encoded);
+	}
+
+	out = s_alloc(1);
+	out_uint8(out, MSG_SNDIN_DATA_INCOMING);
+	rdpeai_send(out);
+
+	out = s_alloc(1 + size);
+	out_uint8(out, MSG_SNDIN_DATA);
+	out_uint8a(out, data, size);
+	rdpeai_send(out);
+
+	if (encoded != NULL)
+		s_free(encoded);
+}
+
+/* Start capturing for the format the server picked */
+static uint32
+rdpeai_start(uint32 format_index)
+{
+	RD_WAVEFORMATEX *format, *pcm;
+	unsigned int frames;
+
+	if (format_index >= rdpeai_format_count)
+	{
+		logger(Sound, Warning, "rdpeai_start(), invalid format index %u", format_index);
+		return 1;
+	}
+
+	format = &rdpeai_formats[format_index];
+	pcm = &rdpeai_capture_formats[format_index];
+
+	frames = MAX(rdpeai_frames_per_packet,
+		     pcm->nSamplesPerSec * g_audio_capture_frame / 1000);
+	frames = rdpsnd_dsp_encode_frames(format, frames);
+
+	logger(Sound, Debug,
+	       "rdpeai_start(), format 0x%x, %u Hz, %u channels, %u frames per packet",
+	       format->wFormatTag, pcm->nSamplesPerSec, pcm->nChannels, frames);
+
+	rdpeai_current_format = format_index;
+	if (!rdpsnd_capture_open(pcm, frames * pcm->nBlockAlign, rdpeai_send_data))
+		return 1;
+
+	return 0;
+}
+
+static void
+rdpeai_send_formatchange(uint32 format_index)
+{
+	STREAM out;
+
+	out = s_alloc(5);
+	out_uint8(out, MSG_SNDIN_FORMATCHANGE);
+	out_uint32_le(out, format_index);
+	rdpeai_send(out);
+}
+
+static void
+rdpeai_process_open(STREAM s)
+{
+	uint32 initial_format, result;
+	STREAM out;
+
+	in_uint32_le(s, rdpeai_frames_per_packet);
+	in_uint32_le(s, initial_format);
+	/* the capture format that follows is implied by initial_format */
+
+	result = rdpeai_start(initial_format);
+	if (result == 0)
+		rdpeai_send_formatchange(initial_format);
+
+	out = s_alloc(5);
+	out_uint8(out, MSG_SNDIN_OPEN_REPLY);
+	out_uint32_le(out, result);
+	rdpeai_send(out);
+}
+
+static void
+rdpeai_process_formatchange(STREAM s)
+{
+	uint32 new_format;
+
+	in_uint32_le(s, new_format);
+
+	rdpsnd_capture_close();
+	if (rdpeai_start(new_format) == 0)
+		rdpeai_send_formatchange(new_format);
+}
+
+static void
+rdpeai_process_pdu(STREAM s)
+{
+	uint8 type;
+
+	in_uint8(s, type);
+
+	logger(Sound, Debug, "rdpeai_process_pdu(), Got PDU type %d", type);
+
+	switch (type)
+	{
+		case MSG_SNDIN_VERSION:
+			rdpeai_process_version(s);
+			break;
+
+		case MSG_SNDIN_FORMATS:
+			rdpeai_process_formats(s);
+			break;
+
+		case MSG_SNDIN_OPEN:
+			rdpeai_process_open(s);
+			break;
+
+		case MSG_SNDIN_FORMATCHANGE:
+			rdpeai_process_formatchange(s);
+			break;
+
+		default:
+			logger(Sound, Warning, "rdpeai_process_pdu(), Unhandled PDU type %d",
+			       type);
+			break;
+	}
+}
+
+void
+rdpeai_init(void)
+{
+	dvc_channels_register(RDPEAI_CHANNEL_NAME, rdpeai_process_pdu, NULL,
+			      DVC_PRIORITY_INTERACTIVE);
+}
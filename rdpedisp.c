@@ -27,9 +27,15 @@
 #define RDPEDISP_CHANNEL_NAME "Microsoft::Windows::RDS::DisplayControl"
 
 extern int g_dpi;
+extern RD_MONITOR g_monitors[];
+extern int g_num_monitors;
 extern RD_BOOL g_pending_resize_defer;
 extern struct timeval g_pending_resize_defer_timer;
 
+/* Largest area of all monitors together the server will take, 0 until
+   the capabilities are known */
+static uint64 g_rdpedisp_max_area;
+
 static void rdpedisp_send(STREAM s);
 static void rdpedisp_init_packet(STREAM s, uint32 type, uint32 length);
 
@@ -45,6 +51,7 @@ rdpedisp_process_caps_pdu(STREAM s)
 	logger(Protocol, Debug,
 	       "rdpedisp_process_caps_pdu(), Max supported monitor area (square pixels) is %d",
 	       tmp[0] * tmp[1] * tmp[2]);
+	g_rdpedisp_max_area = (uint64) tmp[0] * tmp[1] * tmp[2];
 
 	/* When the RDPEDISP channel is established, we allow dynamic
 	   session resize straight away by clearing the defer flag and
@@ -81,36 +88,61 @@ rdpedisp_process_pdu(STREAM s)
 	}
 }
 
+static void
+rdpedisp_out_monitor(STREAM s, uint32 flags, sint32 left, sint32 top, uint32 width,
+		     uint32 height)
+{
+	uint32 physwidth, physheight, desktopscale, devicescale;
+
+	out_uint32_le(s, flags);	/* flags */
+	out_uint32_le(s, left);	/* left */
+	out_uint32_le(s, top);	/* top */
+	out_uint32_le(s, width);	/* width */
+	out_uint32_le(s, height);	/* height */
+
+	utils_calculate_dpi_scale_factors(width, height, g_dpi,
+					  &physwidth, &physheight, &desktopscale, &devicescale);
+
+	out_uint32_le(s, physwidth);	/* physicalwidth */
+	out_uint32_le(s, physheight);	/* physicalheight */
+	out_uint32_le(s, ORIENTATION_LANDSCAPE);	/* Orientation */
+	out_uint32_le(s, desktopscale);	/* DesktopScaleFactor */
+	out_uint32_le(s, devicescale);	/* DeviceScaleFactor */
+}
+
 static void
 rdpedisp_send_monitor_layout_pdu(uint32 width, uint32 height)
 {
 	struct stream s;
-	uint32 physwidth, physheight, desktopscale, devicescale;
+	sint32 origin_x, origin_y;
+	uint32 count;
+	int i;
 
 	memset(&s, 0, sizeof(s));
 
 	logger(Protocol, Debug, "rdpedisp_send_monitor_layout_pdu(), width = %d, height = %d",
 	       width, height);
 
-	rdpedisp_init_packet(&s, DISPLAYCONTROL_PDU_TYPE_MONITOR_LAYOUT, 16 + 1 * 40);
+	count = g_num_monitors > 1 ? g_num_monitors : 1;
+	rdpedisp_init_packet(&s, DISPLAYCONTROL_PDU_TYPE_MONITOR_LAYOUT, 16 + count * 40);
 
 	out_uint32_le(&s, 40);	/* MonitorLayoutSize - spec mandates 40 */
-	out_uint32_le(&s, 1);	/* NumMonitors */
+	out_uint32_le(&s, count);	/* NumMonitors */
 
-	out_uint32_le(&s, DISPLAYCONTROL_MONITOR_PRIMARY);	/* flags */
-	out_uint32_le(&s, 0);	/* left */
-	out_uint32_le(&s, 0);	/* top */
-	out_uint32_le(&s, width);	/* width */
-	out_uint32_le(&s, height);	/* height */
-
-	utils_calculate_dpi_scale_factors(width, height, g_dpi,
-					  &physwidth, &physheight, &desktopscale, &devicescale);
-
-	out_uint32_le(&s, physwidth);	/* physicalwidth */
-	out_uint32_le(&s, physheight);	/* physicalheight */
-	out_uint32_le(&s, ORIENTATION_LANDSCAPE);	/* Orientation */
-	out_uint32_le(&s, desktopscale);	/* DesktopScaleFactor */
-	out_uint32_le(&s, devicescale);	/* DeviceScaleFactor */
+	if (g_num_monitors > 1)
+	{
+		/* the primary monitor is at the origin */
+		utils_monitor_origin(g_monitors, g_num_monitors, &origin_x, &origin_y);
+		for (i = 0; i < g_num_monitors; i++)
+			rdpedisp_out_monitor(&s,
+					     g_monitors[i].primary ? DISPLAYCONTROL_MONITOR_PRIMARY : 0,
+					     g_monitors[i].x - origin_x, g_monitors[i].y - origin_y,
+					     g_monitors[i].width & ~1, g_monitors[i].height);
+	}
+	else
+	{
+		rdpedisp_out_monitor(&s, DISPLAYCONTROL_MONITOR_PRIMARY, 0, 0, width, height);
+	}
 	s_mark_end(&s);
 
 	rdpedisp_send(&s);
@@ -144,6 +176,15 @@ rdpedisp_set_session_size(uint32 width, uint32 height)
 	if (rdpedisp_is_available() == False)
 		return;
 
+	/* A layout larger than the server takes is ignored, and the
+	   window would be left without a matching session, so scale it
+	   down to fit */
+	while (g_rdpedisp_max_area != 0 && (uint64) width * height > g_rdpedisp_max_area)
+	{
+		width = width * 15 / 16;
+		height = height * 15 / 16;
+	}
+
 	/* monitor width MUST be even number */
 	utils_apply_session_size_limitations(&width, &height);
 
@@ -153,5 +194,6 @@ rdpedisp_set_session_size(uint32 width, uint32 height)
 void
 rdpedisp_init(void)
 {
-	dvc_channels_register(RDPEDISP_CHANNEL_NAME, rdpedisp_process_pdu);
+	dvc_channels_register(RDPEDISP_CHANNEL_NAME, rdpedisp_process_pdu, NULL,
+			      DVC_PRIORITY_INTERACTIVE);
 }
@@ -0,0 +1,1119 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Graphics Pipeline Virtual Channel Extension.
+   Copyright 2026 the rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* With the graphics pipeline (MS-RDPEGFX) the server draws on to
+   off-screen surfaces over a dynamic channel instead of sending
+   drawing orders and bitmap updates. A surface is kept here as 32 bpp
+   pixels, and the parts of it that a frame changed are painted to the
+   window when the frame ends. Surface contents can also be copied
+   within and between surfaces and kept in a cache of their own.
+
+   The uncompressed, planar, alpha, ClearCodec and RemoteFX
+   progressive codecs are decoded, and AVC420 and AVC444 when built
+   with libavcodec; the RemoteFX video codec is not offered. */
+
+#include "rdesktop.h"
+
+#define RDPGFX_CHANNEL_NAME "Microsoft::Windows::RDS::Graphics"
+
+#define RDPGFX_CMDID_WIRETOSURFACE_1		0x0001
+#define RDPGFX_CMDID_WIRETOSURFACE_2		0x0002
+#define RDPGFX_CMDID_DELETEENCODINGCONTEXT	0x0003
+#define RDPGFX_CMDID_SOLIDFILL			0x0004
+#define RDPGFX_CMDID_SURFACETOSURFACE		0x0005
+#define RDPGFX_CMDID_SURFACETOCACHE		0x0006
+#define RDPGFX_CMDID_CACHETOSURFACE		0x0007
+#define RDPGFX_CMDID_EVICTCACHEENTRY		0x0008
+#define RDPGFX_CMDID_CREATESURFACE		0x0009
+#define RDPGFX_CMDID_DELETESURFACE		0x000a
+#define RDPGFX_CMDID_STARTFRAME			0x000b
+#define RDPGFX_CMDID_ENDFRAME			0x000c
+#define RDPGFX_CMDID_FRAMEACKNOWLEDGE		0x000d
+#define RDPGFX_CMDID_RESETGRAPHICS		0x000e
+#define RDPGFX_CMDID_MAPSURFACETOOUTPUT		0x000f
+#define RDPGFX_CMDID_CACHEIMPORTOFFER		0x0010
+#define RDPGFX_CMDID_CACHEIMPORTREPLY		0x0011
+#define RDPGFX_CMDID_CAPSADVERTISE		0x0012
+#define RDPGFX_CMDID_CAPSCONFIRM		0x0013
+
+#define RDPGFX_CAPVERSION_8	0x00080004
+#define RDPGFX_CAPVERSION_81	0x00080105
+#define RDPGFX_CAPVERSION_10	0x000a0002
+
+#define RDPGFX_CAPS_FLAG_SMALL_CACHE	0x00000002
+#define RDPGFX_CAPS_FLAG_AVC420_ENABLED	0x00000010
+
+#define RDPGFX_CODECID_UNCOMPRESSED	0x0000
+#define RDPGFX_CODECID_CLEARCODEC	0x0008
+#define RDPGFX_CODECID_CAPROGRESSIVE	0x0009
+#define RDPGFX_CODECID_PLANAR		0x000a
+#define RDPGFX_CODECID_AVC420		0x000b
+#define RDPGFX_CODECID_ALPHA		0x000c
+#define RDPGFX_CODECID_AVC444		0x000e
+#define RDPGFX_CODECID_AVC444V2		0x000f
+
+/* with the small cache flag */
+#define RDPGFX_CACHE_SLOTS	4096
+
+/* Largest surface side accepted, the most a monitor layout may span */
+#define RDPGFX_MAX_SURFACE_SIZE	8192
+
+/* Changed areas of a surface are kept apart up to this many, more are
+   merged in to one */
+#define RDPGFX_MAX_DAMAGE	16
+
+typedef struct rdpgfx_surface
+{
+	uint16 id;
+	int width, height;
+	uint8 *data;
+	RD_BOOL mapped;
+	int x, y;
+	int ndamage;
+	BOUNDS damage[RDPGFX_MAX_DAMAGE];
+	struct rdpgfx_surface *next;
+}
+RDPGFX_SURFACE;
+
+typedef struct
+{
+	int width, height;
+	uint8 *data;
+}
+RDPGFX_CACHE_ENTRY;
+
+static RDPGFX_SURFACE *rdpegfx_surfaces;
+static RDPGFX_CACHE_ENTRY rdpegfx_cache[RDPGFX_CACHE_SLOTS];
+static uint32 rdpegfx_frames_decoded;
+
+/* Decoding time per codec id, for the ctrl socket */
+#define RDPGFX_CODEC_STATS	(RDPGFX_CODECID_AVC444V2 + 1)
+
+static struct
+{
+	uint32 count;
+	uint64 nsec;
+} rdpegfx_codec_stats[RDPGFX_CODEC_STATS];
+
+static const struct
+{
+	uint16 id;
+	const char *name;
+} rdpegfx_codec_names[] = {
+	{ RDPGFX_CODECID_UNCOMPRESSED, "gfx.uncompressed" },
+	{ RDPGFX_CODECID_CLEARCODEC, "gfx.clearcodec" },
+	{ RDPGFX_CODECID_CAPROGRESSIVE, "gfx.progressive" },
+	{ RDPGFX_CODECID_PLANAR, "gfx.planar" },
+	{ RDPGFX_CODECID_AVC420, "gfx.avc420" },
+	{ RDPGFX_CODECID_ALPHA, "gfx.alpha" },
+	{ RDPGFX_CODECID_AVC444, "gfx.avc444" },
+	{ RDPGFX_CODECID_AVC444V2, "gfx.avc444v2" }
+};
+
+static uint64
+rdpegfx_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+rdpegfx_codec_done(uint16 codec, uint64 begin)
+{
+	if (codec >= RDPGFX_CODEC_STATS)
+		return;
+	rdpegfx_codec_stats[codec].count++;
+	rdpegfx_codec_stats[codec].nsec += rdpegfx_clock() - begin;
+}
+
+static RDPGFX_SURFACE *
+rdpegfx_get_surface(uint16 id)
+{
+	RDPGFX_SURFACE *surface;
+
+	for (surface = rdpegfx_surfaces; surface != NULL; surface = surface->next)
+		if (surface->id == id)
+			return surface;
+
+	logger(Graphics, Warning, "rdpegfx_get_surface(), no surface %d", id);
+	return NULL;
+}
+
+static void
+rdpegfx_delete_surface(uint16 id)
+{
+	RDPGFX_SURFACE **link, *surface;
+
+	for (link = &rdpegfx_surfaces; *link != NULL; link = &(*link)->next)
+	{
+		surface = *link;
+		if (surface->id != id)
+			continue;
+
+		*link = surface->next;
+		rfxprog_delete_surface(id);
+#ifdef WITH_H264
+		h264_delete_surface(id);
+#endif
+		xfree(surface->data);
+		xfree(surface);
+		return;
+	}
+}
+
+static void
+rdpegfx_reset(void)
+{
+	int i;
+
+	while (rdpegfx_surfaces != NULL)
+		rdpegfx_delete_surface(rdpegfx_surfaces->id);
+
+	for (i = 0; i < RDPGFX_CACHE_SLOTS; i++)
+	{
+		xfree(rdpegfx_cache[i].data);
+		rdpegfx_cache[i].data = NULL;
+	}
+
+	clear_reset();
+	rfxprog_reset();
+#ifdef WITH_H264
+	h264_reset();
+#endif
+}
+
+/* Note a change to the area of a surface, right and bottom are
+   exclusive */
+static void
+rdpegfx_damage(RDPGFX_SURFACE * surface, int left, int top, int right, int bottom)
+{
+	BOUNDS *d;
+	int i;
+
+	left = MAX(left, 0);
+	top = MAX(top, 0);
+	right = MIN(right, surface->width);
+	bottom = MIN(bottom, surface->height);
+	if (!surface->mapped || left >= right || top >= bottom)
+		return;
+
+	/* already covered */
+	for (i = 0; i < surface->ndamage; i++)
+	{
+		d = &surface->damage[i];
+		if (left >= d->left && top >= d->top && right - 1 <= d->right
+		    && bottom - 1 <= d->bottom)
+			return;
+	}
+
+	if (surface->ndamage == RDPGFX_MAX_DAMAGE)
+	{
+		d = &surface->damage[0];
+		for (i = 1; i < surface->ndamage; i++)
+		{
+			d->left = MIN(d->left, surface->damage[i].left);
+			d->top = MIN(d->top, surface->damage[i].top);
+			d->right = MAX(d->right, surface->damage[i].right);
+			d->bottom = MAX(d->bottom, surface->damage[i].bottom);
+		}
+		surface->ndamage = 1;
+	}
+	else
+	{
+		d = &surface->damage[surface->ndamage++];
+		d->left = left;
+		d->top = top;
+		d->right = right - 1;
+		d->bottom = bottom - 1;
+		return;
+	}
+
+	d->left = MIN(d->left, left);
+	d->top = MIN(d->top, top);
+	d->right = MAX(d->right, right - 1);
+	d->bottom = MAX(d->bottom, bottom - 1);
+}
+
+/* Paint what the frame changed on the mapped surfaces */
+static void
+rdpegfx_present(void)
+{
+	RDPGFX_SURFACE *surface;
+	BOUNDS *d;
+	uint8 *pixels;
+	int i, y, cx, cy;
+
+	for (surface = rdpegfx_surfaces; surface != NULL; surface = surface->next)
+	{
+		for (i = 0; i < surface->ndamage; i++)
+		{
+			d = &surface->damage[i];
+			cx = d->right - d->left + 1;
+			cy = d->bottom - d->top + 1;
+
+			if (cx == surface->width)
+			{
+				ui_paint_bitmap(surface->x, surface->y + d->top, cx, cy, cx, cy,
+						surface->data + d->top * surface->width * 4);
+				continue;
+			}
+
+			pixels = xmalloc((size_t) cx * cy * 4);
+			for (y = 0; y < cy; y++)
+				memcpy(pixels + y * cx * 4,
+				       surface->data + ((d->top + y) * surface->width +
+							d->left) * 4, cx * 4);
+			ui_paint_bitmap(surface->x + d->left, surface->y + d->top, cx, cy, cx, cy,
+					pixels);
+			xfree(pixels);
+		}
+		surface->ndamage = 0;
+	}
+}
+
+static void
+rdpegfx_send(uint16 cmd, STREAM body)
+{
+	STREAM s;
+	size_t length;
+
+	length = body ? s_length(body) : 0;
+	s = s_alloc(8 + length);
+	out_uint16_le(s, cmd);
+	out_uint16_le(s, 0);	/* flags */
+	out_uint32_le(s, 8 + length);
+	if (body)
+		out_stream(s, body);
+	s_mark_end(s);
+
+	dvc_send(RDPGFX_CHANNEL_NAME, s);
+	s_free(s);
+}
+
+static void
+rdpegfx_send_caps_advertise(void)
+{
+	STREAM s;
+	RD_BOOL avc = False;
+
+#ifdef WITH_H264
+	avc = h264_available();
+#endif
+
+	s = s_alloc(2 + 3 * 12);
+	out_uint16_le(s, avc ? 3 : 2);	/* capsSetCount */
+	if (avc)
+	{
+		/* AVC444 is only used with version 10 */
+		out_uint32_le(s, RDPGFX_CAPVERSION_10);
+		out_uint32_le(s, 4);	/* capsDataLength */
+		out_uint32_le(s, RDPGFX_CAPS_FLAG_SMALL_CACHE);
+	}
+	out_uint32_le(s, RDPGFX_CAPVERSION_81);
+	out_uint32_le(s, 4);	/* capsDataLength */
+	out_uint32_le(s, RDPGFX_CAPS_FLAG_SMALL_CACHE |
+		      (avc ? RDPGFX_CAPS_FLAG_AVC420_ENABLED : 0));
+	out_uint32_le(s, RDPGFX_CAPVERSION_8);
+	out_uint32_le(s, 4);	/* capsDataLength */
+	out_uint32_le(s, RDPGFX_CAPS_FLAG_SMALL_CACHE);
+	s_mark_end(s);
+
+	rdpegfx_send(RDPGFX_CMDID_CAPSADVERTISE, s);
+	s_free(s);
+}
+
+static void
+rdpegfx_send_frame_acknowledge(uint32 frame_id)
+{
+	STREAM s;
+
+	s = s_alloc(12);
+	out_uint32_le(s, 0);	/* queueDepth */
+	out_uint32_le(s, frame_id);
+	out_uint32_le(s, rdpegfx_frames_decoded);
+	s_mark_end(s);
+
+	rdpegfx_send(RDPGFX_CMDID_FRAMEACKNOWLEDGE, s);
+	s_free(s);
+}
+
+static void
+rdpegfx_process_caps_confirm(STREAM s)
+{
+	uint32 version, flags;
+
+	in_uint32_le(s, version);
+	in_uint8s(s, 4);	/* capsDataLength */
+	in_uint32_le(s, flags);
+
+	logger(Graphics, Debug, "rdpegfx_process_caps_confirm(), version 0x%x, flags 0x%x",
+	       version, flags);
+}
+
+static void
+rdpegfx_process_reset_graphics(STREAM s)
+{
+	uint32 width, height;
+
+	in_uint32_le(s, width);
+	in_uint32_le(s, height);
+	/* the monitor layout is that of the session */
+
+	logger(Graphics, Debug, "rdpegfx_process_reset_graphics(), %dx%d", width, height);
+	rdpegfx_reset();
+
+	/* With the graphics pipeline a new monitor layout is taken on
+	   without a deactivation-reactivation sequence */
+	if (width > 0 && height > 0 && width <= 0xffff && height <= 0xffff)
+		rdp_set_session_size(width, height);
+}
+
+static void
+rdpegfx_process_create_surface(STREAM s)
+{
+	RDPGFX_SURFACE *surface;
+	uint16 id, width, height;
+	uint8 format;
+
+	in_uint16_le(s, id);
+	in_uint16_le(s, width);
+	in_uint16_le(s, height);
+	in_uint8(s, format);
+
+	logger(Graphics, Debug, "rdpegfx_process_create_surface(), id %d, %dx%d, format 0x%x",
+	       id, width, height, format);
+
+	rdpegfx_delete_surface(id);
+
+	/* commands for a surface that was refused are dropped as for any
+	   unknown one */
+	if (width == 0 || height == 0 || width > RDPGFX_MAX_SURFACE_SIZE
+	    || height > RDPGFX_MAX_SURFACE_SIZE)
+	{
+		logger(Graphics, Warning,
+		       "rdpegfx_process_create_surface(), refused %dx%d surface %d", width,
+		       height, id);
+		return;
+	}
+
+	surface = xmalloc(sizeof(RDPGFX_SURFACE));
+	memset(surface, 0, sizeof(RDPGFX_SURFACE));
+	surface->id = id;
+	surface->width = width;
+	surface->height = height;
+	surface->data = xmalloc((size_t) width * height * 4);
+	memset(surface->data, 0, (size_t) width * height * 4);
+	surface->next = rdpegfx_surfaces;
+	rdpegfx_surfaces = surface;
+}
+
+static void
+rdpegfx_process_map_surface(STREAM s)
+{
+	RDPGFX_SURFACE *surface;
+	uint16 id;
+	uint32 x, y;
+
+	in_uint16_le(s, id);
+	in_uint8s(s, 2);	/* reserved */
+	in_uint32_le(s, x);
+	in_uint32_le(s, y);
+
+	surface = rdpegfx_get_surface(id);
+	if (surface == NULL)
+		return;
+
+	surface->mapped = True;
+	surface->x = x;
+	surface->y = y;
+	rdpegfx_damage(surface, 0, 0, surface->width, surface->height);
+}
+
+/* Read an RDPGFX_RECT16 and check that it lies within the surface */
+static RD_BOOL
+rdpegfx_in_rect(STREAM s, RDPGFX_SURFACE * surface, int *left, int *top, int *right,
+		int *bottom)
+{
+	uint16 l, t, r, b;
+
+	in_uint16_le(s, l);
+	in_uint16_le(s, t);
+	in_uint16_le(s, r);
+	in_uint16_le(s, b);
+
+	if (l >= r || t >= b || r > surface->width || b > surface->height)
+		return False;
+
+	*left = l;
+	*top = t;
+	*right = r;
+	*bottom = b;
+	return True;
+}
+
+static void
+rdpegfx_process_solid_fill(STREAM s)
+{
+	RDPGFX_SURFACE *surface;
+	uint16 id, count, i;
+	uint8 pixel[4];
+	int left, top, right, bottom, x, y;
+	uint8 *line;
+
+	in_uint16_le(s, id);
+	in_uint8a(s, pixel, 4);	/* B, G, R, XA */
+	in_uint16_le(s, count);
+
+	surface = rdpegfx_get_surface(id);
+	if (surface == NULL || !s_check_rem(s, count * 8))
+		return;
+
+	for (i = 0; i < count; i++)
+	{
+		if (!rdpegfx_in_rect(s, surface, &left, &top, &right, &bottom))
+			continue;
+
+		line = surface->data + (top * surface->width + left) * 4;
+		for (x = 0; x < right - left; x++)
+			memcpy(line + x * 4, pixel, 4);
+		for (y = top + 1; y < bottom; y++)
+			memcpy(surface->data + (y * surface->width + left) * 4, line,
+			       (right - left) * 4);
+
+		rdpegfx_damage(surface, left, top, right, bottom);
+	}
+}
+
+static void
+rdpegfx_process_surface_to_surface(STREAM s)
+{
+	RDPGFX_SURFACE *src, *dst;
+	uint16 src_id, dst_id, count, i;
+	sint16 x, y;
+	int left, top, right, bottom, cx, cy, row;
+
+	in_uint16_le(s, src_id);
+	in_uint16_le(s, dst_id);
+
+	src = rdpegfx_get_surface(src_id);
+	dst = rdpegfx_get_surface(dst_id);
+	if (src == NULL || dst == NULL || !s_check_rem(s, 10))
+		return;
+
+	if (!rdpegfx_in_rect(s, src, &left, &top, &right, &bottom))
+		return;
+	in_uint16_le(s, count);
+	if (!s_check_rem(s, count * 4))
+		return;
+
+	cx = right - left;
+	cy = bottom - top;
+	for (i = 0; i < count; i++)
+	{
+		in_uint16_le(s, x);
+		in_uint16_le(s, y);
+		if (x < 0 || y < 0 || x + cx > dst->width || y + cy > dst->height)
+			continue;
+
+		/* the areas may overlap when copying within a surface */
+		if (src == dst && y > top)
+		{
+			for (row = cy - 1; row >= 0; row--)
+				memmove(dst->data + ((y + row) * dst->width + x) * 4,
+					src->data + ((top + row) * src->width + left) * 4, cx * 4);
+		}
+		else
+		{
+			for (row = 0; row < cy; row++)
+				memmove(dst->data + ((y + row) * dst->width + x) * 4,
+					src->data + ((top + row) * src->width + left) * 4, cx * 4);
+		}
+
+		rdpegfx_damage(dst, x, y, x + cx, y + cy);
+	}
+}
+
+static void
+rdpegfx_process_surface_to_cache(STREAM s)
+{
+	RDPGFX_SURFACE *surface;
+	RDPGFX_CACHE_ENTRY *entry;
+	uint16 id, slot;
+	int left, top, right, bottom, row;
+
+	in_uint16_le(s, id);
+	in_uint8s(s, 8);	/* cacheKey */
+	in_uint16_le(s, slot);
+
+	surface = rdpegfx_get_surface(id);
+	if (surface == NULL || slot == 0 || slot > RDPGFX_CACHE_SLOTS)
+		return;
+	if (!rdpegfx_in_rect(s, surface, &left, &top, &right, &bottom))
+		return;
+
+	entry = &rdpegfx_cache[slot - 1];
+	entry->width = right - left;
+	entry->height = bottom - top;
+	entry->data = xrealloc(entry->data, entry->width * entry->height * 4);
+	for (row = 0; row < entry->height; row++)
+		memcpy(entry->data + row * entry->width * 4,
+		       surface->data + ((top + row) * surface->width + left) * 4,
+		       entry->width * 4);
+}
+
+static void
+rdpegfx_process_cache_to_surface(STREAM s)
+{
+	RDPGFX_SURFACE *surface;
+	RDPGFX_CACHE_ENTRY *entry;
+	uint16 slot, id, count, i;
+	sint16 x, y;
+	int row;
+
+	in_uint16_le(s, slot);
+	in_uint16_le(s, id);
+	in_uint16_le(s, count);
+
+	surface = rdpegfx_get_surface(id);
+	if (surface == NULL || slot == 0 || slot > RDPGFX_CACHE_SLOTS
+	    || !s_check_rem(s, count * 4))
+		return;
+
+	entry = &rdpegfx_cache[slot - 1];
+	if (entry->data == NULL)
+	{
+		logger(Graphics, Warning, "rdpegfx_process_cache_to_surface(), empty slot %d",
+		       slot);
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		in_uint16_le(s, x);
+		in_uint16_le(s, y);
+		if (x < 0 || y < 0 || x + entry->width > surface->width
+		    || y + entry->height > surface->height)
+			continue;
+
+		for (row = 0; row < entry->height; row++)
+			memcpy(surface->data + ((y + row) * surface->width + x) * 4,
+			       entry->data + row * entry->width * 4, entry->width * 4);
+
+		rdpegfx_damage(surface, x, y, x + entry->width, y + entry->height);
+	}
+}
+
+static void
+rdpegfx_process_evict_cache_entry(STREAM s)
+{
+	uint16 slot;
+
+	in_uint16_le(s, slot);
+	if (slot == 0 || slot > RDPGFX_CACHE_SLOTS)
+		return;
+
+	xfree(rdpegfx_cache[slot - 1].data);
+	rdpegfx_cache[slot - 1].data = NULL;
+}
+
+/* The alpha codec only replaces the alpha channel of the pixels */
+static RD_BOOL
+rdpegfx_decode_alpha(uint8 * data, uint32 size, uint8 * dst, int stride, int width,
+		     int height)
+{
+	uint32 n, total, run;
+	uint16 compressed;
+	uint8 alpha;
+	int i;
+
+	if (size < 4 || data[0] != 0x4c || data[1] != 0x41)
+		return False;
+	compressed = data[2] | (data[3] << 8);
+	data += 4;
+	size -= 4;
+
+	total = width * height;
+	if (!compressed)
+	{
+		if (size < total)
+			return False;
+		for (n = 0; n < total; n++)
+			dst[(n / width) * stride + (n % width) * 4 + 3] = data[n];
+		return True;
+	}
+
+	n = 0;
+	while (n < total)
+	{
+		if (size < 2)
+			return False;
+		alpha = data[0];
+		run = data[1];
+		data += 2;
+		size -= 2;
+		if (run == 0xff)
+		{
+			if (size < 2)
+				return False;
+			run = data[0] | (data[1] << 8);
+			data += 2;
+			size -= 2;
+			if (run == 0xffff)
+			{
+				if (size < 4)
+					return False;
+				run = data[0] | (data[1] << 8) | (data[2] << 16) |
+					((uint32) data[3] << 24);
+				data += 4;
+				size -= 4;
+			}
+		}
+		if (run > total - n)
+			return False;
+		for (i = 0; i < (int) run; i++, n++)
+			dst[(n / width) * stride + (n % width) * 4 + 3] = alpha;
+	}
+	return True;
+}
+
+#ifdef WITH_H264
+/* An RDPGFX_AVC420_BITMAP_STREAM, with the region rectangles made
+   relative to the destination rectangle and inclusive */
+typedef struct
+{
+	BOUNDS *rects;
+	int nrects;
+	uint8 *data;
+	uint32 length;
+}
+RDPGFX_AVC420;
+
+static RD_BOOL
+rdpegfx_in_avc420(uint8 * data, uint32 size, int left, int top, RDPGFX_AVC420 * avc)
+{
+	struct stream packet;
+	STREAM s = &packet;
+	uint32 n, i;
+	uint16 l, t, r, b;
+
+	memset(s, 0, sizeof(*s));
+	s->data = s->p = data;
+	s->end = data + size;
+
+	if (!s_check_rem(s, 4))
+		return False;
+	in_uint32_le(s, n);
+	/* a rectangle and its quantQualityVals take 10 bytes */
+	if (n > s_remaining(s) / 10)
+		return False;
+
+	avc->rects = xmalloc(MAX(n, 1) * sizeof(BOUNDS));
+	avc->nrects = n;
+	for (i = 0; i < n; i++)
+	{
+		in_uint16_le(s, l);
+		in_uint16_le(s, t);
+		in_uint16_le(s, r);
+		in_uint16_le(s, b);
+		avc->rects[i].left = l - left;
+		avc->rects[i].top = t - top;
+		avc->rects[i].right = r - left - 1;
+		avc->rects[i].bottom = b - top - 1;
+	}
+	in_uint8s(s, 2 * n);	/* quantQualityVals */
+
+	avc->length = s_remaining(s);
+	in_uint8p(s, avc->data, avc->length);
+	return True;
+}
+
+static void
+rdpegfx_damage_avc420(RDPGFX_SURFACE * surface, RDPGFX_AVC420 * avc, int left, int top,
+		      int right, int bottom)
+{
+	int i;
+
+	for (i = 0; i < avc->nrects; i++)
+		rdpegfx_damage(surface, MAX(left + avc->rects[i].left, left),
+			       MAX(top + avc->rects[i].top, top),
+			       MIN(left + avc->rects[i].right + 1, right),
+			       MIN(top + avc->rects[i].bottom + 1, bottom));
+}
+
+/* Decode an AVC420 or AVC444 bitmap stream, only the region
+   rectangles are damaged since H.264 pictures usually cover the whole
+   surface */
+static void
+rdpegfx_process_avc(RDPGFX_SURFACE * surface, uint16 codec, uint8 * data, uint32 length,
+		    int left, int top, int right, int bottom)
+{
+	RDPGFX_AVC420 luma, chroma;
+	uint32 info, size;
+	int lc, stride;
+	uint8 *dst;
+	RD_BOOL rv;
+
+	memset(&luma, 0, sizeof(luma));
+	memset(&chroma, 0, sizeof(chroma));
+	stride = surface->width * 4;
+	dst = surface->data + top * stride + left * 4;
+
+	if (codec == RDPGFX_CODECID_AVC420)
+	{
+		rv = rdpegfx_in_avc420(data, length, left, top, &luma)
+			&& h264_decompress_avc420(surface->id, luma.data, luma.length, dst, stride,
+						  right - left, bottom - top, luma.rects,
+						  luma.nrects);
+		if (rv)
+			rdpegfx_damage_avc420(surface, &luma, left, top, right, bottom);
+		goto out;
+	}
+
+	/* the first stream is the luma one, unless the LC field says
+	   only the chroma one was sent */
+	rv = False;
+	if (length < 4)
+		goto out;
+	info = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32) data[3] << 24);
+	size = info & 0x3fffffff;
+	lc = info >> 30;
+	data += 4;
+	length -= 4;
+	if (lc == 3 || size > length)
+		goto out;
+
+	if (lc == 2)
+	{
+		if (!rdpegfx_in_avc420(data, size, left, top, &chroma))
+			goto out;
+	}
+	else
+	{
+		if (!rdpegfx_in_avc420(data, size, left, top, &luma))
+			goto out;
+		if (lc == 0
+		    && !rdpegfx_in_avc420(data + size, length - size, left, top, &chroma))
+			goto out;
+	}
+
+	rv = h264_decompress_avc444(surface->id, codec == RDPGFX_CODECID_AVC444V2, luma.data,
+				    luma.length, luma.rects, luma.nrects, chroma.data,
+				    chroma.length, chroma.rects, chroma.nrects, dst, stride,
+				    right - left, bottom - top);
+	if (rv)
+	{
+		rdpegfx_damage_avc420(surface, &luma, left, top, right, bottom);
+		rdpegfx_damage_avc420(surface, &chroma, left, top, right, bottom);
+	}
+
+out:
+	if (!rv)
+		logger(Graphics, Warning,
+		       "rdpegfx_process_avc(), failed to decode codec 0x%x", codec);
+	xfree(luma.rects);
+	xfree(chroma.rects);
+}
+#endif
+
+static void
+rdpegfx_process_wire_to_surface_1(STREAM s)
+{
+	RDPGFX_SURFACE *surface;
+	uint16 id, codec;
+	uint32 length;
+	int left, top, right, bottom, cx, cy, stride, y;
+	uint8 *data, *dst, *pixels;
+	uint64 begin;
+	RD_BOOL rv;
+
+	in_uint16_le(s, id);
+	in_uint16_le(s, codec);
+	in_uint8s(s, 1);	/* pixelFormat */
+
+	surface = rdpegfx_get_surface(id);
+	if (surface == NULL || !s_check_rem(s, 12))
+		return;
+	if (!rdpegfx_in_rect(s, surface, &left, &top, &right, &bottom))
+	{
+		logger(Graphics, Warning, "rdpegfx_process_wire_to_surface_1(), bad rectangle");
+		return;
+	}
+	in_uint32_le(s, length);
+	if (!s_check_rem(s, length))
+		return;
+	in_uint8p(s, data, length);
+
+	begin = rdpegfx_clock();
+#ifdef WITH_H264
+	if (codec == RDPGFX_CODECID_AVC420 || codec == RDPGFX_CODECID_AVC444
+	    || codec == RDPGFX_CODECID_AVC444V2)
+	{
+		rdpegfx_process_avc(surface, codec, data, length, left, top, right, bottom);
+		rdpegfx_codec_done(codec, begin);
+		return;
+	}
+#endif
+
+	cx = right - left;
+	cy = bottom - top;
+	stride = surface->width * 4;
+	dst = surface->data + top * stride + left * 4;
+
+	switch (codec)
+	{
+		case RDPGFX_CODECID_UNCOMPRESSED:
+			rv = (length >= (uint32) cx * cy * 4);
+			for (y = 0; rv && y < cy; y++)
+				memcpy(dst + y * stride, data + y * cx * 4, cx * 4);
+			break;
+
+		case RDPGFX_CODECID_PLANAR:
+			pixels = xmalloc((size_t) cx * cy * 4);
+			rv = bitmap_decompress_planar(pixels, cx, cy, data, length, False);
+			for (y = 0; rv && y < cy; y++)
+				memcpy(dst + y * stride, pixels + y * cx * 4, cx * 4);
+			xfree(pixels);
+			break;
+
+		case RDPGFX_CODECID_CLEARCODEC:
+			rv = clear_decompress(data, length, cx, cy, dst, stride);
+			break;
+
+		case RDPGFX_CODECID_ALPHA:
+			rv = rdpegfx_decode_alpha(data, length, dst, stride, cx, cy);
+			break;
+
+		default:
+			logger(Graphics, Warning,
+			       "rdpegfx_process_wire_to_surface_1(), unsupported codec 0x%x", codec);
+			return;
+	}
+	rdpegfx_codec_done(codec, begin);
+
+	if (!rv)
+	{
+		logger(Graphics, Warning,
+		       "rdpegfx_process_wire_to_surface_1(), failed to decode codec 0x%x", codec);
+		return;
+	}
+
+	rdpegfx_damage(surface, left, top, right, bottom);
+}
+
+static void
+rdpegfx_process_wire_to_surface_2(STREAM s)
+{
+	RDPGFX_SURFACE *surface;
+	uint16 id, codec;
+	uint32 length;
+	uint8 *data;
+	BOUNDS damage;
+	uint64 begin;
+	RD_BOOL rv;
+
+	in_uint16_le(s, id);
+	in_uint16_le(s, codec);
+	in_uint8s(s, 4);	/* codecContextId */
+	in_uint8s(s, 1);	/* pixelFormat */
+	in_uint32_le(s, length);
+
+	surface = rdpegfx_get_surface(id);
+	if (surface == NULL || !s_check_rem(s, length))
+		return;
+	in_uint8p(s, data, length);
+
+	if (codec != RDPGFX_CODECID_CAPROGRESSIVE)
+	{
+		logger(Graphics, Warning,
+		       "rdpegfx_process_wire_to_surface_2(), unsupported codec 0x%x", codec);
+		return;
+	}
+
+	damage.left = damage.top = 0x7fff;
+	damage.right = damage.bottom = -1;
+	begin = rdpegfx_clock();
+	rv = rfxprog_decompress(id, data, length, surface->data, surface->width * 4,
+				surface->width, surface->height, &damage);
+	rdpegfx_codec_done(codec, begin);
+	if (!rv)
+	{
+		logger(Graphics, Warning,
+		       "rdpegfx_process_wire_to_surface_2(), failed to decode progressive data");
+		return;
+	}
+
+	if (damage.left <= damage.right)
+		rdpegfx_damage(surface, damage.left, damage.top, damage.right + 1,
+			       damage.bottom + 1);
+}
+
+static void
+rdpegfx_process_pdu(STREAM s)
+{
+	STREAM data;
+	struct stream packet;
+	uint16 cmd;
+	uint32 length, frame_id;
+	uint16 id;
+
+	data = zgfx_decompress(s);
+	if (data == NULL)
+		return;
+
+	while (s_check_rem(data, 8))
+	{
+		in_uint16_le(data, cmd);
+		in_uint8s(data, 2);	/* flags */
+		in_uint32_le(data, length);
+		if (length < 8 || !s_check_rem(data, length - 8))
+		{
+			logger(Graphics, Warning, "rdpegfx_process_pdu(), truncated PDU %d", cmd);
+			break;
+		}
+
+		memset(&packet, 0, sizeof(packet));
+		in_uint8p(data, packet.data, length - 8);
+		packet.p = packet.data;
+		packet.end = packet.data + length - 8;
+		packet.size = length - 8;
+
+		logger(Graphics, Debug, "rdpegfx_process_pdu(), Got PDU type %d", cmd);
+
+		switch (cmd)
+		{
+			case RDPGFX_CMDID_WIRETOSURFACE_1:
+				rdpegfx_process_wire_to_surface_1(&packet);
+				break;
+
+			case RDPGFX_CMDID_WIRETOSURFACE_2:
+				rdpegfx_process_wire_to_surface_2(&packet);
+				break;
+
+			case RDPGFX_CMDID_DELETEENCODINGCONTEXT:
+				in_uint16_le(&packet, id);
+				rfxprog_delete_surface(id);
+				break;
+
+			case RDPGFX_CMDID_SOLIDFILL:
+				rdpegfx_process_solid_fill(&packet);
+				break;
+
+			case RDPGFX_CMDID_SURFACETOSURFACE:
+				rdpegfx_process_surface_to_surface(&packet);
+				break;
+
+			case RDPGFX_CMDID_SURFACETOCACHE:
+				rdpegfx_process_surface_to_cache(&packet);
+				break;
+
+			case RDPGFX_CMDID_CACHETOSURFACE:
+				rdpegfx_process_cache_to_surface(&packet);
+				break;
+
+			case RDPGFX_CMDID_EVICTCACHEENTRY:
+				rdpegfx_process_evict_cache_entry(&packet);
+				break;
+
+			case RDPGFX_CMDID_CREATESURFACE:
+				rdpegfx_process_create_surface(&packet);
+				break;
+
+			case RDPGFX_CMDID_DELETESURFACE:
+				in_uint16_le(&packet, id);
+				rdpegfx_delete_surface(id);
+				break;
+
+			case RDPGFX_CMDID_STARTFRAME:
+				ui_begin_update();
+				break;
+
+			case RDPGFX_CMDID_ENDFRAME:
+				in_uint32_le(&packet, frame_id);
+				rdpegfx_present();
+				ui_end_update();
+				rdp_connect_phase(CONNECT_PHASE_FIRST_PAINT);
+				rdpegfx_frames_decoded++;
+				rdpegfx_send_frame_acknowledge(frame_id);
+				break;
+
+			case RDPGFX_CMDID_RESETGRAPHICS:
+				rdpegfx_process_reset_graphics(&packet);
+				break;
+
+			case RDPGFX_CMDID_MAPSURFACETOOUTPUT:
+				rdpegfx_process_map_surface(&packet);
+				break;
+
+			case RDPGFX_CMDID_CACHEIMPORTREPLY:
+				/* nothing is offered for import */
+				break;
+
+			case RDPGFX_CMDID_CAPSCONFIRM:
+				rdpegfx_process_caps_confirm(&packet);
+				break;
+
+			default:
+				logger(Graphics, Warning, "rdpegfx_process_pdu(), Unhandled PDU type %d",
+				       cmd);
+				break;
+		}
+	}
+
+	s_free(data);
+}
+
+static void
+rdpegfx_open(void)
+{
+	rdpegfx_reset();
+	zgfx_reset();
+	rdpegfx_frames_decoded = 0;
+	rdpegfx_send_caps_advertise();
+}
+
+/* Format the decoding time of codec n into buf, for the ctrl socket */
+RD_BOOL
+rdpegfx_format_stats(int n, char *buf, size_t size)
+{
+	uint16 id;
+
+	if (n < 0 || n >= (int) (sizeof(rdpegfx_codec_names) / sizeof(rdpegfx_codec_names[0])))
+		return False;
+
+	id = rdpegfx_codec_names[n].id;
+	snprintf(buf, size, "%s count=%u usec=%llu", rdpegfx_codec_names[n].name,
+		 rdpegfx_codec_stats[id].count,
+		 (unsigned long long) rdpegfx_codec_stats[id].nsec / 1000);
+	return True;
+}
+
+void
+rdpegfx_reset_stats(void)
+{
+	memset(rdpegfx_codec_stats, 0, sizeof(rdpegfx_codec_stats));
+}
+
+void
+rdpegfx_init(void)
+{
+	dvc_channels_register(RDPGFX_CHANNEL_NAME, rdpegfx_process_pdu, rdpegfx_open,
+			      DVC_PRIORITY_INTERACTIVE);
+}
@@ -22,7 +22,19 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+/* Audio packets are handed from the main loop to the output driver
+   through a single producer, single consumer ring. The driver runs on
+   an audio thread of its own, so that playback goes on while the main
+   loop is busy. Calls into the driver from the main loop, such as
+   opening it or changing the format, take g_rdpsnd_lock. When a packet
+   has been played, the audio thread wakes up the main loop, which
+   sends the wave confirmation. */
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "rdesktop.h"
 #include "rdpsnd.h"
@@ -57,23 +69,85 @@ static RD_BOOL rdpsnd_negotiated;
 static RD_BOOL device_open;
 
 static RD_WAVEFORMATEX formats[MAX_FORMATS];
+/* Compressed formats are decoded before they are handed to the
+   driver, which is set up for the PCM format they decode to */
+static RD_BOOL format_decoded[MAX_FORMATS];
+static RD_WAVEFORMATEX decoded_formats[MAX_FORMATS];
 static unsigned int format_count;
 static unsigned int current_format;
-
+/* current_format while playing sound decoded on this side */
+#define LOCAL_FORMAT		MAX_FORMATS
+static RD_WAVEFORMATEX local_format;
+
+/* queue_hi and queue_pending belong to the main loop, queue_lo to the
+   audio thread. Packets from queue_pending to queue_lo have been played
+   and wait for their confirmation, those from queue_lo to queue_hi are
+   still to be played. */
 unsigned int queue_hi, queue_lo, queue_pending;
 struct audio_packet packet_queue[MAX_QUEUE];
 
+#define QUEUE_LOAD(x)		__atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define QUEUE_STORE(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+/* Playback of a stream is held back by twice the measured jitter in
+   arrival times, up to PLAYOUT_MAX_DELAY ms. While more than
+   PLAYOUT_MAX_BACKLOG ms beyond that waits to be played, new packets
+   are dropped. */
+#define PLAYOUT_MAX_DELAY	200
+#define PLAYOUT_MAX_BACKLOG	500
+
+/* hold playback back until then, set on the main loop and read on the
+   audio thread, under g_playout_lock */
+static struct timeval g_playout_tv;
+static pthread_mutex_t g_playout_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct
+{
+	RD_BOOL active;		/* a stream is being played */
+	struct timeval last_arrive_tv;
+	uint16 last_tick;
+	long jitter;		/* in 1/16 ms */
+	unsigned long packets, underruns, dropped;
+	unsigned long long latency;	/* in ms, summed over the packets */
+} g_playout;
+
+/* Totals over the streams that have ended, for the ctrl socket */
+static struct
+{
+	unsigned long streams, packets, underruns, dropped;
+} g_playout_totals;
+
+static pthread_mutex_t g_rdpsnd_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t g_rdpsnd_thread;
+static RD_BOOL g_rdpsnd_threaded = False;
+static int g_rdpsnd_wakeup[2] = { -1, -1 };	/* main loop to audio thread */
+static int g_rdpsnd_played[2] = { -1, -1 };	/* audio thread to main loop */
+
+static RD_BOOL capture_open = False;
+static RD_WAVEFORMATEX capture_format;
+static unsigned int capture_packet;	/* bytes handed to capture_handler at a time */
+static rdpsnd_capture_fn capture_handler;
+static uint8 *capture_buf = NULL;
+static unsigned int capture_len, capture_size;
+
 static uint8 packet_opcode;
 static size_t packet_len;
 static struct stream packet;
 
 void (*wave_out_play) (void);
 
-static void rdpsnd_queue_write(STREAM s, uint16 tick, uint8 index);
+static RD_BOOL rdpsnd_queue_write(STREAM s, uint16 tick, uint8 index, unsigned int duration,
+				  RD_BOOL local);
 static void rdpsnd_queue_init(void);
 static void rdpsnd_queue_clear(void);
 static void rdpsnd_queue_complete_pending(void);
 static long rdpsnd_queue_next_completion(void);
+static void rdpsnd_thread_start(void);
+static unsigned int rdpsnd_duration(RD_WAVEFORMATEX * format, unsigned int size);
+static void rdpsnd_playout_stop(RD_BOOL reset);
+static void rdpsnd_playout_timeout(struct timeval *tv);
+static void rdpsnd_wakeup(int fd);
+static RD_BOOL rdpsnd_auto_select(void);
 
 static STREAM
 rdpsnd_init_packet(uint8 type, uint16 size)
@@ -110,12 +184,121 @@ rdpsnd_send_waveconfirm(uint16 tick, uint8 packet_index)
 	       (unsigned) tick, (unsigned) packet_index);
 }
 
+/* Captured sound is added here by the driver, on the audio thread
+   and with g_rdpsnd_lock held. The main loop takes it out a packet
+   at a time and hands it to the capture handler. At most a second
+   is kept, beyond that the oldest packets are dropped. */
 void
 rdpsnd_record(const void *data, unsigned int size)
 {
-	UNUSED(data);
-	UNUSED(size);
-	/* TODO: Send audio over RDP */
+	unsigned int drop;
+
+	if (!capture_open)
+		return;
+
+	if (capture_len + size > capture_size)
+	{
+		capture_size = capture_len + size;
+		capture_buf = xrealloc(capture_buf, capture_size);
+	}
+	memcpy(capture_buf + capture_len, data, size);
+	capture_len += size;
+
+	if (capture_len > capture_format.nAvgBytesPerSec + capture_packet)
+	{
+		drop = capture_len - capture_format.nAvgBytesPerSec;
+		drop = (drop + capture_packet - 1) / capture_packet * capture_packet;
+		memmove(capture_buf, capture_buf + drop, capture_len - drop);
+		capture_len -= drop;
+		logger(Sound, Debug, "rdpsnd_record(), dropped %u bytes of captured sound", drop);
+	}
+
+	if (capture_len >= capture_packet)
+		rdpsnd_wakeup(g_rdpsnd_played[1]);
+}
+
+/* Start capturing in the PCM format, handing packet_size bytes at a
+   time to handler on the main loop */
+RD_BOOL
+rdpsnd_capture_open(RD_WAVEFORMATEX * format, unsigned int packet_size,
+		    rdpsnd_capture_fn handler)
+{
+	RD_BOOL ret = False;
+
+	pthread_mutex_lock(&g_rdpsnd_lock);
+	do
+	{
+		if (!current_driver)
+			rdpsnd_auto_select();
+
+		if (!current_driver || !current_driver->wave_in_open)
+		{
+			logger(Sound, Warning, "rdpsnd_capture_open(), no driver that can capture");
+			break;
+		}
+
+		if (!capture_open && !current_driver->wave_in_open())
+			break;
+
+		if (!current_driver->wave_in_set_format(format))
+		{
+			current_driver->wave_in_close();
+			capture_open = False;
+			break;
+		}
+
+		capture_format = *format;
+		capture_packet = packet_size;
+		capture_handler = handler;
+		capture_len = 0;
+		capture_open = True;
+		ret = True;
+	}
+	while (0);
+	pthread_mutex_unlock(&g_rdpsnd_lock);
+
+	/* let the audio thread wait on the capture fds too */
+	rdpsnd_wakeup(g_rdpsnd_wakeup[1]);
+
+	return ret;
+}
+
+void
+rdpsnd_capture_close(void)
+{
+	pthread_mutex_lock(&g_rdpsnd_lock);
+	if (capture_open)
+		current_driver->wave_in_close();
+	capture_open = False;
+	capture_len = 0;
+	pthread_mutex_unlock(&g_rdpsnd_lock);
+}
+
+/* Hand the whole packets captured so far to the capture handler */
+static void
+rdpsnd_capture_flush(void)
+{
+	static uint8 *packet_buf = NULL;
+	static unsigned int packet_buf_size = 0;
+
+	pthread_mutex_lock(&g_rdpsnd_lock);
+	while (capture_open && capture_len >= capture_packet)
+	{
+		if (packet_buf_size < capture_packet)
+		{
+			packet_buf_size = capture_packet;
+			packet_buf = xrealloc(packet_buf, packet_buf_size);
+		}
+		memcpy(packet_buf, capture_buf, capture_packet);
+		memmove(capture_buf, capture_buf + capture_packet, capture_len - capture_packet);
+		capture_len -= capture_packet;
+
+		/* the audio thread may go on capturing meanwhile */
+		pthread_mutex_unlock(&g_rdpsnd_lock);
+		capture_handler(packet_buf, capture_packet);
+		pthread_mutex_lock(&g_rdpsnd_lock);
+	}
+	pthread_mutex_unlock(&g_rdpsnd_lock);
 }
 
 static RD_BOOL
@@ -159,6 +342,7 @@ rdpsnd_process_negotiate(STREAM in)
 	RD_BOOL device_available = False;
 	int readcnt;
 	int discardcnt;
+	unsigned int size;
 
 	in_uint8s(in, 14);	/* initial bytes not valid from server */
 	in_uint16_le(in, in_format_count);
@@ -213,16 +397,32 @@ rdpsnd_process_negotiate(STREAM in)
 			in_uint8a(in, format->cb, readcnt);
 			in_uint8s(in, discardcnt);
 
-			if (current_driver && current_driver->wave_out_format_supported(format))
+			if (!current_driver)
+				continue;
+
+			format_decoded[format_count] = False;
+			if (!current_driver->wave_out_format_supported(format))
 			{
-				format_count++;
-				if (format_count == MAX_FORMATS)
-					break;
+				if (!rdpsnd_dsp_decode_supported
+				    (format, &decoded_formats[format_count])
+				    || !current_driver->
+				    wave_out_format_supported(&decoded_formats[format_count]))
+					continue;
+				format_decoded[format_count] = True;
 			}
+
+			format_count++;
+			if (format_count == MAX_FORMATS)
+				break;
 		}
 	}
 
-	out = rdpsnd_init_packet(SNDC_FORMATS, 20 + 18 * format_count);
+	/* the extra data of compressed formats is sent back as is */
+	size = 20;
+	for (i = 0; i < format_count; i++)
+		size += 18 + MIN(formats[i].cbSize, MAX_CBSIZE);
+
+	out = rdpsnd_init_packet(SNDC_FORMATS, size);
 
 	uint32 flags = TSSNDCAPS_VOLUME;
 
@@ -252,7 +452,8 @@ rdpsnd_process_negotiate(STREAM in)
 		out_uint32_le(out, format->nAvgBytesPerSec);
 		out_uint16_le(out, format->nBlockAlign);
 		out_uint16_le(out, format->wBitsPerSample);
-		out_uint16(out, 0);	/* cbSize */
+		out_uint16_le(out, MIN(format->cbSize, MAX_CBSIZE));
+		out_uint8a(out, format->cb, MIN(format->cbSize, MAX_CBSIZE));
 	}
 
 	s_mark_end(out);
@@ -299,8 +500,9 @@ rdpsnd_process_packet(uint8 opcode, STREAM s)
 
 	uint16 tick, format;
 	uint8 packet_index;
-	unsigned int size;
+	unsigned int size, duration;
 	unsigned char *data;
+	STREAM decoded;
 
 	switch (opcode)
 	{
@@ -321,6 +523,7 @@ rdpsnd_process_packet(uint8 opcode, STREAM s)
 				break;
 			}
 
+			pthread_mutex_lock(&g_rdpsnd_lock);
 			if (!device_open || (format != current_format))
 			{
 				/*
@@ -330,38 +533,68 @@ rdpsnd_process_packet(uint8 opcode, STREAM s)
 				 */
 				if (!current_driver)
 				{
+					pthread_mutex_unlock(&g_rdpsnd_lock);
 					rdpsnd_send_waveconfirm(tick, packet_index);
 					break;
 				}
 				if (!device_open && !current_driver->wave_out_open())
 				{
+					pthread_mutex_unlock(&g_rdpsnd_lock);
 					rdpsnd_send_waveconfirm(tick, packet_index);
 					break;
 				}
-				if (!current_driver->wave_out_set_format(&formats[format]))
+				if (!current_driver->wave_out_set_format(format_decoded[format] ?
+									 &decoded_formats[format] :
+									 &formats[format]))
 				{
-					rdpsnd_send_waveconfirm(tick, packet_index);
+					rdpsnd_playout_stop(False);
 					current_driver->wave_out_close();
 					device_open = False;
+					pthread_mutex_unlock(&g_rdpsnd_lock);
+					rdpsnd_send_waveconfirm(tick, packet_index);
 					break;
 				}
 				device_open = True;
 				current_format = format;
 			}
+			pthread_mutex_unlock(&g_rdpsnd_lock);
 
 			size = s_remaining(s);
 			in_uint8p(s, data, size);
+			duration = rdpsnd_duration(&formats[current_format], size);
+
+			if (format_decoded[current_format])
+			{
+				decoded = rdpsnd_dsp_decode(data, size, &formats[current_format]);
+				if (decoded == NULL)
+				{
+					rdpsnd_send_waveconfirm(tick, packet_index);
+					break;
+				}
+				data = decoded->data;
+				size = s_length(decoded);
+				rdpsnd_queue_write(rdpsnd_dsp_process(data, size, current_driver,
+								      &decoded_formats
+								      [current_format]), tick,
+						   packet_index, duration, False);
+				s_free(decoded);
+				return;
+			}
+
 			rdpsnd_queue_write(rdpsnd_dsp_process(data, size,
 							      current_driver,
 							      &formats[current_format]),
-					   tick, packet_index);
+					   tick, packet_index, duration, False);
 			return;
 			break;
 		case SNDC_CLOSE:
 			logger(Sound, Debug, "rdpsnd_process_packet(), SNDC_CLOSE()");
+			pthread_mutex_lock(&g_rdpsnd_lock);
+			rdpsnd_playout_stop(False);
 			if (device_open)
 				current_driver->wave_out_close();
 			device_open = False;
+			pthread_mutex_unlock(&g_rdpsnd_lock);
 			break;
 		case SNDC_FORMATS:
 			rdpsnd_process_negotiate(s);
@@ -376,8 +609,10 @@ rdpsnd_process_packet(uint8 opcode, STREAM s)
 			       "rdpsnd_process_packet(), SNDC_SETVOLUME(left: 0x%04x (%u %%), right: 0x%04x (%u %%))",
 			       (unsigned) vol_left, (unsigned) vol_left / 655, (unsigned) vol_right,
 			       (unsigned) vol_right / 655);
+			pthread_mutex_lock(&g_rdpsnd_lock);
 			if (device_open)
 				current_driver->wave_out_volume(vol_left, vol_right);
+			pthread_mutex_unlock(&g_rdpsnd_lock);
 			break;
 		default:
 			logger(Sound, Warning, "rdpsnd_process_packet(), Unhandled opcode 0x%x",
@@ -537,6 +772,7 @@ rdpsnd_init(char *optarg)
 	}
 
 	rdpsnd_queue_init();
+	rdpsnd_thread_start();
 
 	if (optarg != NULL && strlen(optarg) > 0)
 	{
@@ -577,10 +813,14 @@ rdpsnd_init(char *optarg)
 void
 rdpsnd_reset_state(void)
 {
+	pthread_mutex_lock(&g_rdpsnd_lock);
+	rdpsnd_playout_stop(True);
 	if (device_open)
 		current_driver->wave_out_close();
 	device_open = False;
 	rdpsnd_queue_clear();
+	pthread_mutex_unlock(&g_rdpsnd_lock);
+	rdpsnd_capture_close();
 	rdpsnd_negotiated = False;
 }
 
@@ -600,13 +840,129 @@ rdpsnd_show_help(void)
 	}
 }
 
+static void
+rdpsnd_wakeup(int fd)
+{
+	char c = 0;
+
+	if (fd != -1 && write(fd, &c, 1) == -1 && errno != EAGAIN)
+		logger(Sound, Error, "rdpsnd_wakeup(), write() failed: %s", strerror(errno));
+}
+
+static void
+rdpsnd_drain(int fd)
+{
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0);
+}
+
+/* Runs the output driver, woken up by its own fds or by the main loop */
+static void *
+rdpsnd_thread(void *arg)
+{
+	fd_set rfds, wfds;
+	struct timeval tv;
+	int n;
+
+	UNUSED(arg);
+
+	while (1)
+	{
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_SET(g_rdpsnd_wakeup[0], &rfds);
+		n = g_rdpsnd_wakeup[0];
+		tv.tv_sec = 60;
+		tv.tv_usec = 0;
+
+		pthread_mutex_lock(&g_rdpsnd_lock);
+		if (device_open || capture_open)
+		{
+			current_driver->add_fds(&n, &rfds, &wfds, &tv);
+			rdpsnd_playout_timeout(&tv);
+		}
+		pthread_mutex_unlock(&g_rdpsnd_lock);
+
+		if (select(n + 1, &rfds, &wfds, NULL, &tv) == -1)
+		{
+			/* a driver fd may have been closed meanwhile */
+			if (errno != EINTR && errno != EBADF)
+				logger(Sound, Error, "rdpsnd_thread(), select() failed: %s",
+				       strerror(errno));
+			continue;
+		}
+
+		if (FD_ISSET(g_rdpsnd_wakeup[0], &rfds))
+			rdpsnd_drain(g_rdpsnd_wakeup[0]);
+
+		pthread_mutex_lock(&g_rdpsnd_lock);
+		if (device_open || capture_open)
+			current_driver->check_fds(&rfds, &wfds);
+		pthread_mutex_unlock(&g_rdpsnd_lock);
+	}
+
+	return NULL;
+}
+
+static RD_BOOL
+rdpsnd_pipe(int fds[2])
+{
+	if (pipe(fds) == -1)
+		return False;
+
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+	return True;
+}
+
+/* Move the output driver to an audio thread. Without one, it is run
+   from the main loop. */
+static void
+rdpsnd_thread_start(void)
+{
+	if (g_rdpsnd_threaded)
+		return;
+
+	if (!rdpsnd_pipe(g_rdpsnd_wakeup))
+		goto failed;
+
+	if (!rdpsnd_pipe(g_rdpsnd_played))
+	{
+		close(g_rdpsnd_wakeup[0]);
+		close(g_rdpsnd_wakeup[1]);
+		goto failed;
+	}
+
+	if (pthread_create(&g_rdpsnd_thread, NULL, rdpsnd_thread, NULL) != 0)
+	{
+		close(g_rdpsnd_wakeup[0]);
+		close(g_rdpsnd_wakeup[1]);
+		close(g_rdpsnd_played[0]);
+		close(g_rdpsnd_played[1]);
+		goto failed;
+	}
+
+	evloop_add_fd(g_rdpsnd_played[0], EVLOOP_READ);
+	g_rdpsnd_threaded = True;
+	return;
+
+      failed:
+	logger(Sound, Warning, "rdpsnd_thread_start(), no audio thread, playing from main loop");
+	g_rdpsnd_wakeup[0] = g_rdpsnd_wakeup[1] = -1;
+	g_rdpsnd_played[0] = g_rdpsnd_played[1] = -1;
+}
+
 void
 rdpsnd_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv)
 {
 	long next_pending;
 
-	if (device_open)
+	if (!g_rdpsnd_threaded && (device_open || capture_open))
+	{
 		current_driver->add_fds(n, rfds, wfds, tv);
+		rdpsnd_playout_timeout(tv);
+	}
 
 	next_pending = rdpsnd_queue_next_completion();
 	if (next_pending >= 0)
@@ -625,31 +981,267 @@ rdpsnd_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv)
 void
 rdpsnd_check_fds(fd_set * rfds, fd_set * wfds)
 {
+	if (g_rdpsnd_threaded && evloop_check_fd(g_rdpsnd_played[0]))
+		rdpsnd_drain(g_rdpsnd_played[0]);
+
 	rdpsnd_queue_complete_pending();
 
-	if (device_open)
+	if (!g_rdpsnd_threaded && (device_open || capture_open))
 		current_driver->check_fds(rfds, wfds);
+
+	rdpsnd_capture_flush();
+}
+
+static long
+rdpsnd_elapsed_ms(struct timeval *from, struct timeval *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000 + (to->tv_usec - from->tv_usec) / 1000;
+}
+
+/* Milliseconds of sound in size bytes of format */
+static unsigned int
+rdpsnd_duration(RD_WAVEFORMATEX * format, unsigned int size)
+{
+	if (format->nAvgBytesPerSec == 0)
+		return 0;
+	return (uint64) size * 1000 / format->nAvgBytesPerSec;
+}
+
+/* Until when playback is held back, cleared if it is not */
+static void
+rdpsnd_playout_until(struct timeval *tv)
+{
+	pthread_mutex_lock(&g_playout_lock);
+	*tv = g_playout_tv;
+	pthread_mutex_unlock(&g_playout_lock);
+}
+
+static void
+rdpsnd_playout_hold(struct timeval *tv)
+{
+	pthread_mutex_lock(&g_playout_lock);
+	if (tv == NULL)
+		timerclear(&g_playout_tv);
+	else
+		g_playout_tv = *tv;
+	pthread_mutex_unlock(&g_playout_lock);
+}
+
+static long
+rdpsnd_playout_delay(void)
+{
+	return MIN(2 * g_playout.jitter / 16, PLAYOUT_MAX_DELAY);
+}
+
+/* Update the jitter estimate (RFC 3550) with a packet arriving now
+   that the server sent at tick */
+static void
+rdpsnd_playout_arrival(struct timeval *now, uint16 tick)
+{
+	long d;
+
+	if (g_playout.active)
+	{
+		d = rdpsnd_elapsed_ms(&g_playout.last_arrive_tv, now) -
+			(uint16) (tick - g_playout.last_tick);
+		if (d < 0)
+			d = -d;
+		g_playout.jitter += d - (g_playout.jitter + 8) / 16;
+	}
+
+	g_playout.last_arrive_tv = *now;
+	g_playout.last_tick = tick;
+}
+
+/* The stream has ended, report how it went. With reset, the jitter
+   measured in this session is forgotten too. */
+static void
+rdpsnd_playout_stop(RD_BOOL reset)
+{
+	if (g_playout.packets != 0)
+		logger(Sound, Verbose,
+		       "rdpsnd_playout_stop(), %lu packets, average latency %llu ms, jitter %ld ms, %lu underruns, %lu dropped",
+		       g_playout.packets, g_playout.latency / g_playout.packets,
+		       g_playout.jitter / 16, g_playout.underruns, g_playout.dropped);
+
+	if (g_playout.packets != 0 || g_playout.dropped != 0)
+		g_playout_totals.streams++;
+	g_playout_totals.packets += g_playout.packets;
+	g_playout_totals.underruns += g_playout.underruns;
+	g_playout_totals.dropped += g_playout.dropped;
+
+	rdpsnd_playout_hold(NULL);
+	g_playout.active = False;
+	g_playout.packets = g_playout.underruns = g_playout.dropped = 0;
+	g_playout.latency = 0;
+	if (reset)
+		g_playout.jitter = 0;
+}
+
+/* Format the playback totals into buf, the stream being played
+   included */
+RD_BOOL
+rdpsnd_format_stats(int n, char *buf, size_t size)
+{
+	if (n != 0)
+		return False;
+
+	snprintf(buf, size, "streams=%lu packets=%lu underruns=%lu dropped=%lu jitter=%ld",
+		 g_playout_totals.streams + (g_playout.active ? 1 : 0),
+		 g_playout_totals.packets + g_playout.packets,
+		 g_playout_totals.underruns + g_playout.underruns,
+		 g_playout_totals.dropped + g_playout.dropped, g_playout.jitter / 16);
+	return True;
+}
+
+void
+rdpsnd_reset_stats(void)
+{
+	memset(&g_playout_totals, 0, sizeof(g_playout_totals));
 }
 
+/* Wake up the driver when playback is no longer held back */
 static void
-rdpsnd_queue_write(STREAM s, uint16 tick, uint8 index)
+rdpsnd_playout_timeout(struct timeval *tv)
+{
+	struct timeval now, until, left;
+
+	rdpsnd_playout_until(&until);
+	if (!timerisset(&until) || queue_lo == QUEUE_LOAD(queue_hi))
+		return;
+
+	gettimeofday(&now, NULL);
+	if (timercmp(&until, &now, <))
+		return;
+
+	timersub(&until, &now, &left);
+	if (timercmp(&left, tv, <))
+		*tv = left;
+}
+
+/* Queue a packet of duration ms for the driver. Local packets are sound
+   decoded on this side, which is not confirmed to the server and is
+   not subject to the jitter of its arrival. */
+static RD_BOOL
+rdpsnd_queue_write(STREAM s, uint16 tick, uint8 index, unsigned int duration, RD_BOOL local)
 {
 	struct audio_packet *packet = &packet_queue[queue_hi];
 	unsigned int next_hi = (queue_hi + 1) % MAX_QUEUE;
+	unsigned int lo;
+	struct timeval now, delay, until;
 
 	if (next_hi == queue_pending)
 	{
 		logger(Sound, Error, "rdpsnd_queue_write(), no space to queue audio packet");
-		return;
+		s_free(s);
+		return False;
 	}
 
-	queue_hi = next_hi;
+	gettimeofday(&now, NULL);
+	if (!local)
+		rdpsnd_playout_arrival(&now, tick);
+
+	lo = QUEUE_LOAD(queue_lo);
+	if (lo == queue_hi && (!g_playout.active ||
+			       timercmp(&packet_queue[(lo + MAX_QUEUE - 1) % MAX_QUEUE].completion_tv,
+					&now, <)))
+	{
+		/* the driver has run dry, so fill up to the playout delay first */
+		if (g_playout.active)
+			g_playout.underruns++;
+		delay.tv_sec = rdpsnd_playout_delay() / 1000;
+		delay.tv_usec = (rdpsnd_playout_delay() % 1000) * 1000;
+		timeradd(&now, &delay, &until);
+		rdpsnd_playout_hold(&until);
+	}
+	else if (!local && rdpsnd_elapsed_ms(&packet_queue[lo].arrive_tv, &now) >
+		 rdpsnd_playout_delay() + PLAYOUT_MAX_BACKLOG)
+	{
+		g_playout.dropped++;
+		s_free(s);
+		rdpsnd_send_waveconfirm(tick, index);
+		return False;
+	}
+	g_playout.active = True;
 
 	packet->s = s;
 	packet->tick = tick;
 	packet->index = index;
+	packet->duration = duration;
+	packet->local = local;
+	packet->arrive_tv = now;
 
-	gettimeofday(&packet->arrive_tv, NULL);
+	QUEUE_STORE(queue_hi, next_hi);
+	rdpsnd_wakeup(g_rdpsnd_wakeup[1]);
+	return True;
+}
+
+/* Milliseconds from now until the sound queued last is heard, the
+   clock local playback is kept in step with */
+unsigned int
+rdpsnd_queue_delay(void)
+{
+	unsigned int i, lo, delay;
+	struct timeval now, until;
+	long left;
+
+	gettimeofday(&now, NULL);
+	delay = 0;
+	lo = QUEUE_LOAD(queue_lo);
+
+	/* what the driver has been given is heard by its completion */
+	if (queue_pending != lo)
+	{
+		left = rdpsnd_elapsed_ms(&now,
+					 &packet_queue[(lo + MAX_QUEUE - 1) % MAX_QUEUE].completion_tv);
+		if (left > 0)
+			delay = left;
+	}
+
+	rdpsnd_playout_until(&until);
+	if (timerisset(&until) && timercmp(&now, &until, <))
+		delay += rdpsnd_elapsed_ms(&now, &until);
+
+	for (i = lo; i != queue_hi; i = (i + 1) % MAX_QUEUE)
+		delay += packet_queue[i].duration;
+
+	return delay;
+}
+
+/* Play sound decoded on this side, such as the audio of redirected
+   multimedia, on the device the sound of the server is played on.
+   Returns False if it could not be queued. */
+RD_BOOL
+rdpsnd_play(RD_WAVEFORMATEX * format, uint8 * data, unsigned int size)
+{
+	pthread_mutex_lock(&g_rdpsnd_lock);
+	if (!device_open || current_format != LOCAL_FORMAT ||
+	    format->nSamplesPerSec != local_format.nSamplesPerSec ||
+	    format->nChannels != local_format.nChannels ||
+	    format->wBitsPerSample != local_format.wBitsPerSample)
+	{
+		if (current_driver == NULL ||
+		    (!device_open && !current_driver->wave_out_open()))
+		{
+			pthread_mutex_unlock(&g_rdpsnd_lock);
+			return False;
+		}
+		if (!current_driver->wave_out_set_format(format))
+		{
+			rdpsnd_playout_stop(False);
+			current_driver->wave_out_close();
+			device_open = False;
+			pthread_mutex_unlock(&g_rdpsnd_lock);
+			return False;
+		}
+		device_open = True;
+		current_format = LOCAL_FORMAT;
+		local_format = *format;
+	}
+	pthread_mutex_unlock(&g_rdpsnd_lock);
+
+	return rdpsnd_queue_write(rdpsnd_dsp_process(data, size, current_driver, format), 0, 0,
+				  rdpsnd_duration(format, size), True);
 }
 
 struct audio_packet *
@@ -661,7 +1253,22 @@ rdpsnd_queue_current_packet(void)
 RD_BOOL
 rdpsnd_queue_empty(void)
 {
-	return (queue_lo == queue_hi);
+	unsigned int hi = QUEUE_LOAD(queue_hi);
+	struct timeval now, until;
+
+	if (queue_lo == hi)
+		return True;
+
+	/* held back by the playout delay, unless the queue fills up */
+	if ((hi - queue_lo + MAX_QUEUE) % MAX_QUEUE < MAX_QUEUE / 2)
+	{
+		rdpsnd_playout_until(&until);
+		gettimeofday(&now, NULL);
+		if (timerisset(&until) && timercmp(&now, &until, <))
+			return True;
+	}
+
+	return False;
 }
 
 static void
@@ -702,15 +1309,19 @@ rdpsnd_queue_next(unsigned long completed_in_us)
 	packet->completion_tv.tv_sec += packet->completion_tv.tv_usec / 1000000;
 	packet->completion_tv.tv_usec %= 1000000;
 
-	queue_lo = (queue_lo + 1) % MAX_QUEUE;
+	QUEUE_STORE(queue_lo, (queue_lo + 1) % MAX_QUEUE);
 
-	rdpsnd_queue_complete_pending();
+	/* confirmations are only ever sent from the main loop */
+	if (g_rdpsnd_threaded)
+		rdpsnd_wakeup(g_rdpsnd_played[1]);
+	else
+		rdpsnd_queue_complete_pending();
 }
 
 int
 rdpsnd_queue_next_tick(void)
 {
-	if (((queue_lo + 1) % MAX_QUEUE) != queue_hi)
+	if (((queue_lo + 1) % MAX_QUEUE) != QUEUE_LOAD(queue_hi))
 	{
 		return packet_queue[(queue_lo + 1) % MAX_QUEUE].tick;
 	}
@@ -729,7 +1340,7 @@ rdpsnd_queue_complete_pending(void)
 
 	gettimeofday(&now, NULL);
 
-	while (queue_pending != queue_lo)
+	while (queue_pending != QUEUE_LOAD(queue_lo))
 	{
 		packet = &packet_queue[queue_pending];
 
@@ -744,8 +1355,13 @@ rdpsnd_queue_complete_pending(void)
 			(packet->completion_tv.tv_usec - packet->arrive_tv.tv_usec);
 		elapsed /= 1000;
 
+		g_playout.packets++;
+		g_playout.latency += elapsed;
+
 		s_free(packet->s);
-		rdpsnd_send_waveconfirm((packet->tick + elapsed) % 65536, packet->index);
+		if (!packet->local)
+			rdpsnd_send_waveconfirm((packet->tick + elapsed) % 65536,
+						packet->index);
 		queue_pending = (queue_pending + 1) % MAX_QUEUE;
 	}
 }
@@ -757,7 +1373,7 @@ rdpsnd_queue_next_completion(void)
 	long remaining;
 	struct timeval now;
 
-	if (queue_pending == queue_lo)
+	if (queue_pending == QUEUE_LOAD(queue_lo))
 		return -1;
 
 	gettimeofday(&now, NULL);
@@ -22,6 +22,8 @@ struct audio_packet
 	STREAM s;
 	uint16 tick;
 	uint8 index;
+	unsigned int duration;	/* ms */
+	RD_BOOL local;		/* decoded here, not confirmed to the server */
 
 	struct timeval arrive_tv;
 	struct timeval completion_tv;
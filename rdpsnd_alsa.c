@@ -42,6 +42,7 @@ static snd_pcm_t *out_handle = NULL;
 static snd_pcm_t *in_handle = NULL;
 
 static RD_BOOL reopened;
+static RD_BOOL mmap_out;
 
 static short samplewidth_out;
 static int audiochannels_out;
@@ -185,7 +186,16 @@ alsa_set_format(snd_pcm_t * pcm, RD_WAVEFORMATEX * pwfx)
 		return False;
 	}
 
-	if ((err = snd_pcm_hw_params_set_access(pcm, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
+	/* Playback writes straight into the device buffer when it can be
+	   mapped */
+	if (pcm == out_handle)
+		mmap_out = snd_pcm_hw_params_set_access(pcm, hwparams,
+							SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0;
+
+	if (pcm == out_handle && mmap_out)
+		logger(Sound, Debug, "alsa_set_format(), using mmap access for playback");
+	else if ((err =
+		  snd_pcm_hw_params_set_access(pcm, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
 	{
 		logger(Sound, Error, "alsa_set_format(), snd_pcm_hw_params_set_access() failed: %s",
 		       snd_strerror(err));
@@ -352,6 +362,50 @@ alsa_set_format_out(RD_WAVEFORMATEX * pwfx)
 	return True;
 }
 
+/* Copy frames into the mapped device buffer, returning the number of
+   frames written or a negative error code */
+static snd_pcm_sframes_t
+alsa_write_mmap(const unsigned char *data, snd_pcm_uframes_t frames)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, chunk, done;
+	snd_pcm_sframes_t avail, committed;
+	size_t frame_size;
+	int err;
+
+	avail = snd_pcm_avail_update(out_handle);
+	if (avail < 0)
+		return avail;
+	frames = MIN(frames, (snd_pcm_uframes_t) avail);
+
+	frame_size = samplewidth_out * audiochannels_out;
+
+	done = 0;
+	while (done < frames)
+	{
+		chunk = frames - done;
+		if ((err = snd_pcm_mmap_begin(out_handle, &areas, &offset, &chunk)) < 0)
+			return err;
+
+		memcpy((unsigned char *) areas[0].addr + areas[0].first / 8 +
+		       offset * areas[0].step / 8, data + done * frame_size, chunk * frame_size);
+
+		committed = snd_pcm_mmap_commit(out_handle, offset, chunk);
+		if (committed < 0)
+			return committed;
+
+		done += committed;
+		if ((snd_pcm_uframes_t) committed != chunk)
+			break;
+	}
+
+	/* Unlike snd_pcm_writei(), committing does not start the device */
+	if (done > 0 && snd_pcm_state(out_handle) == SND_PCM_STATE_PREPARED)
+		snd_pcm_start(out_handle);
+
+	return done;
+}
+
 void
 alsa_play(void)
 {
@@ -388,7 +442,10 @@ alsa_play(void)
 	len = MIN(len, MAX_FRAMES);
 	in_uint8p(out, data, len);
 
-	len = snd_pcm_writei(out_handle, data, len);
+	if (mmap_out)
+		len = alsa_write_mmap(data, len);
+	else
+		len = snd_pcm_writei(out_handle, data, len);
 	if (len < 0)
 	{
 		snd_pcm_prepare(out_handle);
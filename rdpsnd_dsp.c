@@ -18,12 +18,29 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <math.h>
 #include <strings.h>
 
 #include "rdesktop.h"
 #include "rdpsnd.h"
 #include "rdpsnd_dsp.h"
 
+/* The vector kernels below work on little endian samples, which is
+   what the stream carries before any byte swapping is done */
+#if !defined(B_ENDIAN)
+#if defined(__SSE2__)
+#define DSP_SIMD_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define DSP_SIMD_NEON
+#include <arm_neon.h>
+#endif
+#endif
+
+#ifdef HAVE_OPUS
+#include <opus.h>
+#endif
+
 #ifdef HAVE_LIBSAMPLERATE
 #include <samplerate.h>
 
@@ -32,6 +49,8 @@
 
 #define MAX_VOLUME 65535
 
+#define NUM_ELEMENTS(array) (sizeof(array) / sizeof(array[0]))
+
 static uint16 softvol_left = MAX_VOLUME;
 static uint16 softvol_right = MAX_VOLUME;
 static uint32 resample_to_srate = 44100;
@@ -49,12 +68,101 @@ rdpsnd_dsp_softvol_set(uint16 left, uint16 right)
 	logger(Sound, Debug, "rdpsnd_dsp_softvol_set(), left: %u, right: %u\n", left, right);
 }
 
+/* Scale count interleaved 8 bit samples, the even ones by factor_left
+   and the odd ones by factor_right */
+static void
+dsp_softvol8(uint8 * buf, unsigned int count, unsigned int factor_left,
+	     unsigned int factor_right)
+{
+	unsigned int i = 0;
+	sint8 val;
+#if defined(DSP_SIMD_SSE2)
+	const __m128i factor = _mm_set_epi16(factor_right, factor_left, factor_right, factor_left,
+					     factor_right, factor_left, factor_right, factor_left);
+	__m128i v, lo, hi;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		v = _mm_loadu_si128((__m128i *) (buf + i));
+		lo = _mm_srai_epi16(_mm_unpacklo_epi8(v, v), 8);
+		hi = _mm_srai_epi16(_mm_unpackhi_epi8(v, v), 8);
+		lo = _mm_srai_epi16(_mm_mullo_epi16(lo, factor), 8);
+		hi = _mm_srai_epi16(_mm_mullo_epi16(hi, factor), 8);
+		_mm_storeu_si128((__m128i *) (buf + i), _mm_packs_epi16(lo, hi));
+	}
+#elif defined(DSP_SIMD_NEON)
+	const int16_t factors[8] = { factor_left, factor_right, factor_left, factor_right,
+		factor_left, factor_right, factor_left, factor_right
+	};
+	const int16x8_t factor = vld1q_s16(factors);
+	int8x16_t v;
+	int16x8_t lo, hi;
+
+	for (; i + 16 <= count; i += 16)
+	{
+		v = vld1q_s8((int8_t *) (buf + i));
+		lo = vshrq_n_s16(vmulq_s16(vmovl_s8(vget_low_s8(v)), factor), 8);
+		hi = vshrq_n_s16(vmulq_s16(vmovl_s8(vget_high_s8(v)), factor), 8);
+		vst1q_s8((int8_t *) (buf + i), vcombine_s8(vmovn_s16(lo), vmovn_s16(hi)));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		val = buf[i];
+		val = (val * (int) ((i & 1) ? factor_right : factor_left)) >> 8;
+		buf[i] = val;
+	}
+}
+
+/* Scale count interleaved 16 bit little endian samples, the even ones
+   by factor_left and the odd ones by factor_right. The factors are at
+   most 256, so the scaled sample always fits in 16 bits again. */
+static void
+dsp_softvol16(uint8 * buf, unsigned int count, unsigned int factor_left,
+	      unsigned int factor_right)
+{
+	unsigned int i = 0;
+	sint16 val;
+#if defined(DSP_SIMD_SSE2)
+	const __m128i factor = _mm_set_epi16(factor_right, factor_left, factor_right, factor_left,
+					     factor_right, factor_left, factor_right, factor_left);
+	__m128i v, lo, hi;
+
+	/* (v * factor) >> 8 from the two halves of the 32 bit product */
+	for (; i + 8 <= count; i += 8)
+	{
+		v = _mm_loadu_si128((__m128i *) (buf + i * 2));
+		lo = _mm_mullo_epi16(v, factor);
+		hi = _mm_mulhi_epi16(v, factor);
+		_mm_storeu_si128((__m128i *) (buf + i * 2),
+				 _mm_or_si128(_mm_slli_epi16(hi, 8), _mm_srli_epi16(lo, 8)));
+	}
+#elif defined(DSP_SIMD_NEON)
+	const int16_t factors[4] = { factor_left, factor_right, factor_left, factor_right };
+	const int16x4_t factor = vld1_s16(factors);
+	int16x8_t v;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		v = vld1q_s16((int16_t *) (buf + i * 2));
+		vst1q_s16((int16_t *) (buf + i * 2),
+			  vcombine_s16(vshrn_n_s32(vmull_s16(vget_low_s16(v), factor), 8),
+				       vshrn_n_s32(vmull_s16(vget_high_s16(v), factor), 8)));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		val = buf[i * 2] | (buf[i * 2 + 1] << 8);
+		val = (val * (int) ((i & 1) ? factor_right : factor_left)) >> 8;
+		buf[i * 2] = val & 0xff;
+		buf[i * 2 + 1] = (val >> 8) & 0xff;
+	}
+}
+
 void
 rdpsnd_dsp_softvol(unsigned char *buffer, unsigned int size, RD_WAVEFORMATEX * format)
 {
 	unsigned int factor_left, factor_right;
-	unsigned char *posin = buffer;
-	unsigned char *posout = buffer;
 
 	if ((softvol_left == MAX_VOLUME) && (softvol_right == MAX_VOLUME))
 		return;
@@ -68,43 +176,9 @@ rdpsnd_dsp_softvol(unsigned char *buffer, unsigned int size, RD_WAVEFORMATEX * f
 	}
 
 	if (format->wBitsPerSample == 8)
-	{
-		sint8 val;
-
-		while (posout < buffer + size)
-		{
-			/* Left */
-			val = *posin++;
-			val = (val * factor_left) >> 8;
-			*posout++ = val;
-
-			/* Right */
-			val = *posin++;
-			val = (val * factor_right) >> 8;
-			*posout++ = val;
-		}
-	}
+		dsp_softvol8(buffer, size, factor_left, factor_right);
 	else
-	{
-		sint16 val;
-
-		while (posout < buffer + size)
-		{
-			/* Left */
-			val = *posin++;
-			val |= *posin++ << 8;
-			val = (val * factor_left) >> 8;
-			*posout++ = val & 0xff;
-			*posout++ = val >> 8;
-
-			/* Right */
-			val = *posin++;
-			val |= *posin++ << 8;
-			val = (val * factor_right) >> 8;
-			*posout++ = val & 0xff;
-			*posout++ = val >> 8;
-		}
-	}
+		dsp_softvol16(buffer, size / 2, factor_left, factor_right);
 
 	logger(Sound, Debug,
 	       "rdpsnd_dsp_softvol(), using softvol with factors left: %d, right: %d (%d/%d)",
@@ -114,8 +188,11 @@ rdpsnd_dsp_softvol(unsigned char *buffer, unsigned int size, RD_WAVEFORMATEX * f
 void
 rdpsnd_dsp_swapbytes(unsigned char *buffer, unsigned int size, RD_WAVEFORMATEX * format)
 {
-	int i;
+	unsigned int i = 0;
 	uint8 swap;
+#if defined(DSP_SIMD_SSE2)
+	__m128i v;
+#endif
 
 	if (format->wBitsPerSample == 8)
 		return;
@@ -123,7 +200,18 @@ rdpsnd_dsp_swapbytes(unsigned char *buffer, unsigned int size, RD_WAVEFORMATEX *
 	if (size & 0x1)
 		logger(Sound, Warning, "rdpsnd_dsp_swapbytes(), badly aligned sound data");
 
-	for (i = 0; i < (int) size; i += 2)
+#if defined(DSP_SIMD_SSE2)
+	for (; i + 16 <= size; i += 16)
+	{
+		v = _mm_loadu_si128((__m128i *) (buffer + i));
+		_mm_storeu_si128((__m128i *) (buffer + i),
+				 _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+	}
+#elif defined(DSP_SIMD_NEON)
+	for (; i + 16 <= size; i += 16)
+		vst1q_u8(buffer + i, vrev16q_u8(vld1q_u8(buffer + i)));
+#endif
+	for (; i + 1 < size; i += 2)
 	{
 		swap = *(buffer + i);
 		*(buffer + i) = *(buffer + i + 1);
@@ -131,6 +219,427 @@ rdpsnd_dsp_swapbytes(unsigned char *buffer, unsigned int size, RD_WAVEFORMATEX *
 	}
 }
 
+/* Duplicate each of count mono samples in to a stereo frame */
+static void
+dsp_mono_to_stereo(const uint8 * in, uint8 * out, unsigned int count, int samplewidth)
+{
+	unsigned int i = 0;
+#if defined(DSP_SIMD_SSE2)
+	__m128i v;
+
+	if (samplewidth == 1)
+		for (; i + 16 <= count; i += 16)
+		{
+			v = _mm_loadu_si128((__m128i *) (in + i));
+			_mm_storeu_si128((__m128i *) (out + i * 2), _mm_unpacklo_epi8(v, v));
+			_mm_storeu_si128((__m128i *) (out + i * 2 + 16), _mm_unpackhi_epi8(v, v));
+		}
+	else
+		for (; i + 8 <= count; i += 8)
+		{
+			v = _mm_loadu_si128((__m128i *) (in + i * 2));
+			_mm_storeu_si128((__m128i *) (out + i * 4), _mm_unpacklo_epi16(v, v));
+			_mm_storeu_si128((__m128i *) (out + i * 4 + 16), _mm_unpackhi_epi16(v, v));
+		}
+#elif defined(DSP_SIMD_NEON)
+	uint8x16x2_t v8;
+	uint16x8x2_t v16;
+
+	if (samplewidth == 1)
+		for (; i + 16 <= count; i += 16)
+		{
+			v8.val[0] = v8.val[1] = vld1q_u8(in + i);
+			vst2q_u8(out + i * 2, v8);
+		}
+	else
+		for (; i + 8 <= count; i += 8)
+		{
+			v16.val[0] = v16.val[1] = vld1q_u16((uint16_t *) (in + i * 2));
+			vst2q_u16((uint16_t *) (out + i * 4), v16);
+		}
+#endif
+	if (samplewidth == 1)
+		for (; i < count; i++)
+			out[i * 2] = out[i * 2 + 1] = in[i];
+	else
+		for (; i < count; i++)
+		{
+			out[i * 4] = out[i * 4 + 2] = in[i * 2];
+			out[i * 4 + 1] = out[i * 4 + 3] = in[i * 2 + 1];
+		}
+}
+
+/* Keep the left channel of each of count stereo frames */
+static void
+dsp_stereo_to_mono(const uint8 * in, uint8 * out, unsigned int count, int samplewidth)
+{
+	unsigned int i = 0;
+#if defined(DSP_SIMD_SSE2)
+	const __m128i low8 = _mm_set1_epi16(0x00ff);
+	__m128i a, b;
+
+	if (samplewidth == 1)
+		for (; i + 16 <= count; i += 16)
+		{
+			a = _mm_and_si128(_mm_loadu_si128((__m128i *) (in + i * 2)), low8);
+			b = _mm_and_si128(_mm_loadu_si128((__m128i *) (in + i * 2 + 16)), low8);
+			_mm_storeu_si128((__m128i *) (out + i), _mm_packus_epi16(a, b));
+		}
+	else
+		for (; i + 8 <= count; i += 8)
+		{
+			/* sign extend the left samples so that the pack does
+			   not saturate them */
+			a = _mm_loadu_si128((__m128i *) (in + i * 4));
+			b = _mm_loadu_si128((__m128i *) (in + i * 4 + 16));
+			a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+			b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+			_mm_storeu_si128((__m128i *) (out + i * 2), _mm_packs_epi32(a, b));
+		}
+#elif defined(DSP_SIMD_NEON)
+	if (samplewidth == 1)
+		for (; i + 16 <= count; i += 16)
+			vst1q_u8(out + i, vld2q_u8(in + i * 2).val[0]);
+	else
+		for (; i + 8 <= count; i += 8)
+			vst1q_u16((uint16_t *) (out + i * 2),
+				  vld2q_u16((uint16_t *) (in + i * 4)).val[0]);
+#endif
+	if (samplewidth == 1)
+		for (; i < count; i++)
+			out[i] = in[i * 2];
+	else
+		for (; i < count; i++)
+		{
+			out[i * 2] = in[i * 4];
+			out[i * 2 + 1] = in[i * 4 + 1];
+		}
+}
+
+/* The built in polyphase resampler. Each output sample is a 16 tap
+   windowed sinc filter over the input, with the filter picked from
+   POLY_PHASES sub-sample offsets. The filters are built for the
+   current input and output rate, and low pass below the lower of the
+   two Nyquist frequencies, so downsampling does not alias. The tail
+   of each packet is kept as history for the next one, which avoids
+   clicks between packets. */
+#define POLY_TAPS 16
+#define POLY_PHASES 512
+#define POLY_PHASE_SHIFT (32 - 9)
+#define POLY_COEFF_BITS 14
+
+static sint16 poly_coeffs[POLY_PHASES][POLY_TAPS];
+static uint32 poly_in_srate = 0;
+static uint32 poly_out_srate = 0;
+static uint16 poly_channels = 0;
+
+/* Per channel input, history followed by the frames of the current
+   packet. poly_pos is the position of the first tap of the next
+   output frame, in 32.32 fixed point frames. */
+static sint16 *poly_in[2] = { NULL, NULL };
+static unsigned int poly_in_size = 0;
+static unsigned int poly_in_frames = 0;
+static uint64 poly_pos = 0;
+static uint64 poly_step = 0;
+
+enum dsp_resampler
+{
+	DSP_RESAMPLER_FAST,
+	DSP_RESAMPLER_POLYPHASE,
+	DSP_RESAMPLER_LIBSAMPLERATE
+};
+
+static const char *dsp_resampler_names[] = { "fast", "polyphase", "libsamplerate" };
+
+#ifdef HAVE_LIBSAMPLERATE
+static enum dsp_resampler dsp_resampler = DSP_RESAMPLER_LIBSAMPLERATE;
+#else
+static enum dsp_resampler dsp_resampler = DSP_RESAMPLER_POLYPHASE;
+#endif
+
+/* Scratch buffers for the format conversions, kept between packets */
+static uint8 *dsp_scratch[2] = { NULL, NULL };
+static unsigned int dsp_scratch_size[2] = { 0, 0 };
+
+#ifdef HAVE_LIBSAMPLERATE
+static float *src_float = NULL;
+static unsigned int src_float_size = 0;
+#endif
+
+static uint8 *
+dsp_scratch_get(int i, unsigned int size)
+{
+	if (size > dsp_scratch_size[i])
+	{
+		dsp_scratch[i] = xrealloc(dsp_scratch[i], size);
+		dsp_scratch_size[i] = size;
+	}
+	return dsp_scratch[i];
+}
+
+/* Select the resampler used when the device rate differs from the
+   rate of the stream, by name */
+RD_BOOL
+rdpsnd_dsp_resampler_select(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < NUM_ELEMENTS(dsp_resampler_names); i++)
+		if (strcmp(name, dsp_resampler_names[i]) == 0)
+		{
+#ifndef HAVE_LIBSAMPLERATE
+			if (i == DSP_RESAMPLER_LIBSAMPLERATE)
+				return False;
+#endif
+			dsp_resampler = i;
+			return True;
+		}
+
+	return False;
+}
+
+/* Forget the history of the polyphase resampler, the next packet is
+   the start of a new stream */
+static void
+poly_reset(void)
+{
+	unsigned int c;
+
+	/* half a filter of silence, so the first input frame lines up
+	   with the centre of the filter */
+	poly_in_frames = POLY_TAPS / 2 - 1;
+	if (poly_in_size < poly_in_frames)
+	{
+		for (c = 0; c < 2; c++)
+			poly_in[c] = xrealloc(poly_in[c], POLY_TAPS * sizeof(sint16));
+		poly_in_size = POLY_TAPS;
+	}
+	for (c = 0; c < 2; c++)
+		memset(poly_in[c], 0, poly_in_frames * sizeof(sint16));
+	poly_pos = 0;
+}
+
+/* Build the filters for converting in_srate to out_srate */
+static void
+poly_init(uint32 in_srate, uint32 out_srate, uint16 channels)
+{
+	double cutoff, t, x, w, h[POLY_TAPS], sum;
+	int phase, k;
+
+	/* a little below Nyquist, to leave room for the transition band
+	   of such a short filter */
+	cutoff = 0.9 * MIN(1.0, (double) out_srate / (double) in_srate);
+
+	for (phase = 0; phase < POLY_PHASES; phase++)
+	{
+		sum = 0;
+		for (k = 0; k < POLY_TAPS; k++)
+		{
+			/* distance of the tap from the output position */
+			t = (double) (POLY_TAPS / 2 - 1 - k) + (double) phase / POLY_PHASES;
+			x = M_PI * cutoff * t;
+			h[k] = (x == 0) ? cutoff : cutoff * sin(x) / x;
+
+			/* Blackman window over the span of the taps */
+			w = (t + POLY_TAPS / 2) / POLY_TAPS;
+			if (w < 0 || w > 1)
+				w = 0;
+			else
+				w = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+			h[k] *= w;
+			sum += h[k];
+		}
+
+		/* unity gain at DC for every phase */
+		for (k = 0; k < POLY_TAPS; k++)
+			poly_coeffs[phase][k] = (sint16) floor(h[k] / sum * (1 << POLY_COEFF_BITS) + 0.5);
+	}
+
+	poly_in_srate = in_srate;
+	poly_out_srate = out_srate;
+	poly_channels = channels;
+	poly_step = ((uint64) in_srate << 32) / out_srate;
+	poly_reset();
+
+	logger(Sound, Debug, "poly_init(), %u Hz to %u Hz, %d channels", in_srate, out_srate,
+	       channels);
+}
+
+/* One output sample, the dot product of a filter with the taps */
+static inline sint16
+poly_filter(const sint16 * in, const sint16 * coeffs)
+{
+	int acc;
+#if defined(DSP_SIMD_SSE2)
+	__m128i sum;
+
+	sum = _mm_add_epi32(_mm_madd_epi16(_mm_loadu_si128((__m128i *) in),
+					   _mm_loadu_si128((__m128i *) coeffs)),
+			    _mm_madd_epi16(_mm_loadu_si128((__m128i *) (in + 8)),
+					   _mm_loadu_si128((__m128i *) (coeffs + 8))));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+	sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+	acc = _mm_cvtsi128_si32(sum);
+#elif defined(DSP_SIMD_NEON)
+	int32x4_t sum;
+	int32x2_t pair;
+
+	sum = vmull_s16(vld1_s16(in), vld1_s16(coeffs));
+	sum = vmlal_s16(sum, vld1_s16(in + 4), vld1_s16(coeffs + 4));
+	sum = vmlal_s16(sum, vld1_s16(in + 8), vld1_s16(coeffs + 8));
+	sum = vmlal_s16(sum, vld1_s16(in + 12), vld1_s16(coeffs + 12));
+	pair = vadd_s32(vget_low_s32(sum), vget_high_s32(sum));
+	acc = vget_lane_s32(vpadd_s32(pair, pair), 0);
+#else
+	int k;
+
+	acc = 0;
+	for (k = 0; k < POLY_TAPS; k++)
+		acc += in[k] * coeffs[k];
+#endif
+	acc = (acc + (1 << (POLY_COEFF_BITS - 1))) >> POLY_COEFF_BITS;
+	return (sint16) MAX(-32768, MIN(32767, acc));
+}
+
+/* Resample frames of interleaved 16 bit samples with the polyphase
+   filters, the output is appended to the history of the stream */
+static STREAM
+poly_resample(const sint16 * in, unsigned int frames, uint32 in_srate)
+{
+	unsigned int total, c, i, outframes, consumed;
+	sint16 *data;
+	uint8 *p;
+	STREAM out;
+	uint64 end;
+
+	if (in_srate != poly_in_srate || resample_to_srate != poly_out_srate ||
+	    resample_to_channels != poly_channels)
+		poly_init(in_srate, resample_to_srate, resample_to_channels);
+
+	total = poly_in_frames + frames;
+	if (total > poly_in_size)
+	{
+		for (c = 0; c < 2; c++)
+			poly_in[c] = xrealloc(poly_in[c], total * sizeof(sint16));
+		poly_in_size = total;
+	}
+
+	for (c = 0; c < resample_to_channels; c++)
+		for (i = 0; i < frames; i++)
+			poly_in[c][poly_in_frames + i] = in[i * resample_to_channels + c];
+
+	/* every output frame needs POLY_TAPS input frames from its
+	   position onwards */
+	outframes = 0;
+	if (total >= POLY_TAPS)
+	{
+		end = (uint64) (total - POLY_TAPS) << 32;
+		if (poly_pos <= end)
+			outframes = (end - poly_pos) / poly_step + 1;
+	}
+
+	out = s_alloc(outframes * resample_to_channels * sizeof(sint16));
+	out_uint8p(out, p, outframes * resample_to_channels * sizeof(sint16));
+	data = (sint16 *) p;
+
+	for (i = 0; i < outframes; i++)
+	{
+		const sint16 *coeffs =
+			poly_coeffs[(uint32) poly_pos >> POLY_PHASE_SHIFT];
+
+		for (c = 0; c < resample_to_channels; c++)
+			*data++ = poly_filter(poly_in[c] + (poly_pos >> 32), coeffs);
+		poly_pos += poly_step;
+	}
+
+	/* keep what the next output frames still need */
+	consumed = MIN(poly_pos >> 32, total);
+	for (c = 0; c < resample_to_channels; c++)
+		memmove(poly_in[c], poly_in[c] + consumed, (total - consumed) * sizeof(sint16));
+	poly_in_frames = total - consumed;
+	poly_pos -= (uint64) consumed << 32;
+
+	return out;
+}
+
+/* Nearest neighbour resampling of frames of interleaved 16 bit
+   samples, the cheapest there is but with audible artifacts */
+static STREAM
+fast_resample(const sint16 * in, unsigned int frames, uint32 in_srate)
+{
+	unsigned int outframes, i, c, source;
+	uint64 pos, step;
+	sint16 *data;
+	uint8 *p;
+	STREAM out;
+
+	outframes = ((uint64) frames * resample_to_srate) / in_srate;
+	step = ((uint64) in_srate << 32) / resample_to_srate;
+
+	out = s_alloc(outframes * resample_to_channels * sizeof(sint16));
+	out_uint8p(out, p, outframes * resample_to_channels * sizeof(sint16));
+	data = (sint16 *) p;
+
+	for (i = 0, pos = 0; i < outframes; i++, pos += step)
+	{
+		source = pos >> 32;
+		for (c = 0; c < resample_to_channels; c++)
+			*data++ = in[source * resample_to_channels + c];
+	}
+
+	return out;
+}
+
+#ifdef HAVE_LIBSAMPLERATE
+static STREAM
+src_resample(const sint16 * in, unsigned int frames, uint32 in_srate)
+{
+	SRC_DATA resample_data;
+	unsigned int innum, outnum, outsize;
+	unsigned char *data;
+	STREAM out;
+	int err;
+
+	if (src_converter == NULL)
+	{
+		logger(Sound, Warning,
+		       "rdpsndp_dsp_resample_set(), no sample rate converter available");
+		return NULL;
+	}
+
+	innum = frames * resample_to_channels;
+	outnum = ((float) innum * ((float) resample_to_srate / (float) in_srate)) + 1;
+
+	if (innum + outnum > src_float_size)
+	{
+		src_float = xrealloc(src_float, sizeof(float) * (innum + outnum));
+		src_float_size = innum + outnum;
+	}
+
+	src_short_to_float_array(in, src_float, innum);
+
+	bzero(&resample_data, sizeof(resample_data));
+	resample_data.data_in = src_float;
+	resample_data.data_out = src_float + innum;
+	resample_data.input_frames = frames;
+	resample_data.output_frames = outnum / resample_to_channels;
+	resample_data.src_ratio = (double) resample_to_srate / (double) in_srate;
+	resample_data.end_of_input = 0;
+
+	if ((err = src_process(src_converter, &resample_data)) != 0)
+		logger(Sound, Warning, "rdpsnd_dsp_resample_set(), src_process(): '%s'",
+		       src_strerror(err));
+
+	outsize = resample_data.output_frames_gen * resample_to_channels * sizeof(sint16);
+	out = s_alloc(outsize);
+	out_uint8p(out, data, outsize);
+	src_float_to_short_array(src_float + innum, (short *) data,
+				 resample_data.output_frames_gen * resample_to_channels);
+
+	return out;
+}
+#endif
+
 RD_BOOL
 rdpsnd_dsp_resample_set(uint32 device_srate, uint16 device_bitspersample, uint16 device_channels)
 {
@@ -148,6 +657,9 @@ rdpsnd_dsp_resample_set(uint32 device_srate, uint16 device_bitspersample, uint16
 	resample_to_bitspersample = device_bitspersample;
 	resample_to_channels = device_channels;
 
+	/* the device was (re)opened, start over with the history */
+	poly_in_srate = 0;
+
 #ifdef HAVE_LIBSAMPLERATE
 	if (src_converter != NULL)
 		src_converter = src_delete(src_converter);
@@ -175,25 +687,24 @@ rdpsnd_dsp_resample_supported(RD_WAVEFORMATEX * format)
 	return True;
 }
 
+/* Convert the stream to the format of the device. The conversions
+   happen in scratch buffers that are kept between packets, and only
+   the ones needed for the two formats are done: channels first, then
+   the sample rate on 16 bit samples, and the sample size last. */
 STREAM
 rdpsnd_dsp_resample(unsigned char *in, unsigned int size,
 		    RD_WAVEFORMATEX * format, RD_BOOL stream_be)
 {
-	UNUSED(stream_be);
-#ifdef HAVE_LIBSAMPLERATE
-	SRC_DATA resample_data;
-	float *infloat, *outfloat;
-	int err;
-#else
-	int ratio1k = (resample_to_srate * 1000) / format->nSamplesPerSec;
-#endif
-	int innum, outnum;
-	unsigned char *tmpdata = NULL, *tmp = NULL;
 	int samplewidth = format->wBitsPerSample / 8;
-	STREAM out;
-	int outsize = 0;
+	unsigned int frames, i;
 	unsigned char *data;
-	int i;
+	sint16 *wide;
+	STREAM out;
+#ifdef B_ENDIAN
+	RD_WAVEFORMATEX device_format;
+#endif
+
+	UNUSED(stream_be);
 
 	if ((resample_to_bitspersample == format->wBitsPerSample) &&
 	    (resample_to_channels == format->nChannels) &&
@@ -205,194 +716,510 @@ rdpsnd_dsp_resample(unsigned char *in, unsigned int size,
 		rdpsnd_dsp_swapbytes(in, size, format);
 #endif
 
+	frames = size / (samplewidth * format->nChannels);
+
 	if (resample_to_channels != format->nChannels)
 	{
-		int newsize = (size / format->nChannels) * resample_to_channels;
-		tmpdata = (unsigned char *) xmalloc(newsize);
+		size = frames * samplewidth * resample_to_channels;
+		data = dsp_scratch_get(0, size);
 
-		for (i = 0; i < newsize / samplewidth; i++)
-		{
-			if (format->nChannels > resample_to_channels)
-				memcpy(tmpdata + (i * samplewidth),
-				       in +
-				       (((i * format->nChannels) / resample_to_channels) *
-					samplewidth), samplewidth);
-			else
-				memcpy(tmpdata + (i * samplewidth),
-				       in +
-				       (((i / resample_to_channels) * format->nChannels +
-					 (i % format->nChannels)) * samplewidth), samplewidth);
+		if (format->nChannels > resample_to_channels)
+			dsp_stereo_to_mono(in, data, frames, samplewidth);
+		else
+			dsp_mono_to_stereo(in, data, frames, samplewidth);
 
-		}
+		in = data;
+	}
 
-		in = tmpdata;
-		size = newsize;
+	/* Expand 8-bit input-samples to 16-bit, the resamplers need them */
+	if (samplewidth == 1 && (resample_to_bitspersample == 16 ||
+				 resample_to_srate != format->nSamplesPerSec))
+	{
+		wide = (sint16 *) dsp_scratch_get(1, size * 2);
+		for (i = 0; i < size; i++)
+			wide[i] = (in[i] - 128) << 8;
+		in = (unsigned char *) wide;
+		samplewidth = 2;
+		size *= 2;
 	}
 
+	/* Do the resampling */
+	out = NULL;
+	if (resample_to_srate != format->nSamplesPerSec)
+	{
+		switch (dsp_resampler)
+		{
+			case DSP_RESAMPLER_FAST:
+				out = fast_resample((sint16 *) in, frames, format->nSamplesPerSec);
+				break;
+#ifdef HAVE_LIBSAMPLERATE
+			case DSP_RESAMPLER_LIBSAMPLERATE:
+				out = src_resample((sint16 *) in, frames, format->nSamplesPerSec);
+				break;
+#endif
+			default:
+				out = poly_resample((sint16 *) in, frames, format->nSamplesPerSec);
+				break;
+		}
+		if (out == NULL)
+			return NULL;
+	}
+	else
+	{
+		out = s_alloc(size);
+		out_uint8a(out, in, size);
+	}
 
-	/* Expand 8-bit input-samples to 16-bit */
-#ifndef HAVE_LIBSAMPLERATE	/* libsamplerate needs 16-bit samples */
-	if (format->wBitsPerSample != resample_to_bitspersample)
+	/* Shrink 16-bit output-samples to 8-bit */
+	size = s_tell(out);
+	data = out->data;
+	if (samplewidth == 2 && resample_to_bitspersample == 8)
+	{
+		wide = (sint16 *) data;
+		for (i = 0; i < size / 2; i++)
+			data[i] = (wide[i] >> 8) + 128;
+		size /= 2;
+	}
+	out->p = data + size;
+
+#ifdef B_ENDIAN
+	if (!stream_be)
+	{
+		device_format = *format;
+		device_format.wBitsPerSample = resample_to_bitspersample;
+		rdpsnd_dsp_swapbytes(data, size, &device_format);
+	}
 #endif
+
+	return out;
+}
+
+/* IMA ADPCM, as in WAVE_FORMAT_DVI_ADPCM. Every block starts with
+   the predictor and step index of each channel, followed by groups of
+   four bytes, eight samples, per channel in turn. */
+static const sint16 ima_step_table[89] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+	253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+	1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+	3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+	11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+	32767
+};
+
+static const sint8 ima_index_table[16] = {
+	-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+struct ima_state
+{
+	int predictor;
+	int index;
+};
+
+static inline sint16
+ima_decode_nibble(struct ima_state *state, uint8 nibble)
+{
+	int step = ima_step_table[state->index];
+	int diff = step >> 3;
+
+	if (nibble & 4)
+		diff += step;
+	if (nibble & 2)
+		diff += step >> 1;
+	if (nibble & 1)
+		diff += step >> 2;
+	if (nibble & 8)
+		diff = -diff;
+
+	state->predictor = MAX(-32768, MIN(32767, state->predictor + diff));
+	state->index = MAX(0, MIN(88, state->index + ima_index_table[nibble]));
+
+	return state->predictor;
+}
+
+/* Decode one block of at most size bytes, returns the number of
+   frames written to out */
+static unsigned int
+ima_decode_block(const uint8 * in, unsigned int size, int channels, sint16 * out)
+{
+	struct ima_state state[2];
+	unsigned int frames, group, i;
+	int c;
+
+	if (size < 4 * (unsigned int) channels)
+		return 0;
+
+	for (c = 0; c < channels; c++)
+	{
+		state[c].predictor = (sint16) (in[0] | (in[1] << 8));
+		state[c].index = MIN(88, in[2]);
+		out[c] = state[c].predictor;
+		in += 4;
+		size -= 4;
+	}
+	frames = 1;
+
+	for (group = 0; size >= 4 * (unsigned int) channels; group++)
 	{
-		/* source: 8 bit, dest: 16 bit */
-		if (format->wBitsPerSample == 8)
+		for (c = 0; c < channels; c++)
 		{
-			tmp = tmpdata;
-			tmpdata = (unsigned char *) xmalloc(size * 2);
-			for (i = 0; i < (int) size; i++)
+			for (i = 0; i < 4; i++)
 			{
-				tmpdata[i * 2] = in[i];
-				tmpdata[(i * 2) + 1] = 0x00;
+				out[(frames + i * 2) * channels + c] =
+					ima_decode_nibble(&state[c], in[i] & 0x0f);
+				out[(frames + i * 2 + 1) * channels + c] =
+					ima_decode_nibble(&state[c], in[i] >> 4);
 			}
-			in = tmpdata;
-			samplewidth = 16 / 2;
-			size *= 2;
-
-			if (tmp != NULL)
-				xfree(tmp);
+			in += 4;
+			size -= 4;
 		}
+		frames += 8;
 	}
 
-	innum = size / samplewidth;
+	return frames;
+}
 
-	/* Do the resampling */
-#ifdef HAVE_LIBSAMPLERATE
-	if (src_converter == NULL)
+static STREAM
+ima_decode(unsigned char *data, unsigned int size, RD_WAVEFORMATEX * format)
+{
+	unsigned int block, blocks, frames, maxframes;
+	sint16 *pcm;
+	STREAM out;
+
+	block = format->nBlockAlign;
+	blocks = (size + block - 1) / block;
+	/* the header sample, and two per byte after the headers */
+	maxframes = blocks * (1 + (block - 4 * format->nChannels) * 2 / format->nChannels);
+
+	out = s_alloc(maxframes * format->nChannels * sizeof(sint16));
+	pcm = (sint16 *) out->data;
+
+	frames = 0;
+	while (size > 0)
 	{
-		logger(Sound, Warning,
-		       "rdpsndp_dsp_resample_set(), no sample rate converter available");
-		return NULL;
+		frames += ima_decode_block(data, MIN(size, block), format->nChannels,
+					   pcm + frames * format->nChannels);
+		data += MIN(size, block);
+		size -= MIN(size, block);
 	}
 
-	outnum = ((float) innum * ((float) resample_to_srate / (float) format->nSamplesPerSec)) + 1;
+	out->p = out->data + frames * format->nChannels * sizeof(sint16);
+	return out;
+}
 
-	infloat = (float *) xmalloc(sizeof(float) * innum);
-	outfloat = (float *) xmalloc(sizeof(float) * outnum);
+static inline uint8
+ima_encode_nibble(struct ima_state *state, sint16 sample)
+{
+	int step = ima_step_table[state->index];
+	int diff = sample - state->predictor;
+	uint8 nibble = 0;
 
-	src_short_to_float_array((short *) in, infloat, innum);
+	if (diff < 0)
+	{
+		nibble = 8;
+		diff = -diff;
+	}
+	if (diff >= step)
+	{
+		nibble |= 4;
+		diff -= step;
+	}
+	if (diff >= step >> 1)
+	{
+		nibble |= 2;
+		diff -= step >> 1;
+	}
+	if (diff >= step >> 2)
+		nibble |= 1;
 
-	bzero(&resample_data, sizeof(resample_data));
-	resample_data.data_in = infloat;
-	resample_data.data_out = outfloat;
-	resample_data.input_frames = innum / resample_to_channels;
-	resample_data.output_frames = outnum / resample_to_channels;
-	resample_data.src_ratio = (double) resample_to_srate / (double) format->nSamplesPerSec;
-	resample_data.end_of_input = 0;
+	/* track what the decoder will reconstruct */
+	ima_decode_nibble(state, nibble);
 
-	if ((err = src_process(src_converter, &resample_data)) != 0)
-		logger(Sound, Warning, "rdpsnd_dsp_resample_set(), src_process(): '%s'",
-		       src_strerror(err));
+	return nibble;
+}
 
-	xfree(infloat);
+/* Encode one block of frames, which must be what the block holds.
+   The step index carries over from the previous block. */
+static void
+ima_encode_block(const sint16 * in, unsigned int frames, int channels,
+		 struct ima_state *state, uint8 * out)
+{
+	unsigned int frame, i;
+	int c;
 
-	outsize = resample_data.output_frames_gen * resample_to_channels * samplewidth;
-	out = s_alloc(outsize);
-	out_uint8p(out, data, outsize);
-	src_float_to_short_array(outfloat, (short *) data,
-				 resample_data.output_frames_gen * resample_to_channels);
-	xfree(outfloat);
+	for (c = 0; c < channels; c++)
+	{
+		state[c].predictor = in[c];
+		out[0] = in[c] & 0xff;
+		out[1] = (in[c] >> 8) & 0xff;
+		out[2] = state[c].index;
+		out[3] = 0;
+		out += 4;
+	}
 
-#else
-	/* Michaels simple linear resampler */
-	if (resample_to_srate < format->nSamplesPerSec)
+	for (frame = 1; frame < frames; frame += 8)
 	{
-		logger(Sound, Warning,
-		       "rdpsnd_dsp_reasmple_set(), downsampling currently not supported");
-		return 0;
+		for (c = 0; c < channels; c++)
+		{
+			for (i = 0; i < 4; i++)
+			{
+				*out = ima_encode_nibble(&state[c],
+							 in[(frame + i * 2) * channels + c]);
+				*out++ |= ima_encode_nibble(&state[c],
+							    in[(frame + i * 2 + 1) * channels +
+							       c]) << 4;
+			}
+		}
 	}
+}
 
-	outnum = (innum * ratio1k) / 1000;
+static unsigned int
+ima_samples_per_block(RD_WAVEFORMATEX * format)
+{
+	return (format->nBlockAlign - 4 * format->nChannels) * 2 / format->nChannels + 1;
+}
 
-	outsize = outnum * samplewidth;
-	out = s_alloc(outsize);
-	out_uint8p(out, data, outsize);
-	bzero(data, outsize);
+static struct ima_state ima_encoder[2];
 
-	for (i = 0; i < outsize / (resample_to_channels * samplewidth); i++)
-	{
-		int source = (i * 1000) / ratio1k;
-#if 0				/* Partial for linear resampler */
-		int part = (i * 100000) / ratio1k - source * 100;
-#endif
-		int j;
+static STREAM
+ima_encode(const sint16 * pcm, unsigned int frames, RD_WAVEFORMATEX * format)
+{
+	unsigned int spb, blocks, i;
+	STREAM out;
 
-		if (source * resample_to_channels + samplewidth > (int) size)
-			break;
+	spb = ima_samples_per_block(format);
+	blocks = frames / spb;
 
-#if 0				/* Linear resampling, TODO: soundquality fixes (LP filter) */
-		if (samplewidth == 1)
-		{
-			sint8 cval1, cval2;
-			for (j = 0; j < resample_to_channels; j++)
-			{
-				memcpy(&cval1,
-				       in + (source * resample_to_channels * samplewidth) +
-				       (samplewidth * j), samplewidth);
-				memcpy(&cval2,
-				       in + ((source + 1) * resample_to_channels * samplewidth) +
-				       (samplewidth * j), samplewidth);
+	out = s_alloc(blocks * format->nBlockAlign);
+	for (i = 0; i < blocks; i++)
+		ima_encode_block(pcm + i * spb * format->nChannels, spb, format->nChannels,
+				 ima_encoder, out->data + i * format->nBlockAlign);
+	out->p = out->data + blocks * format->nBlockAlign;
 
-				cval1 += (sint8) (cval2 * part) / 100;
+	return out;
+}
 
-				memcpy(data + (i * resample_to_channels * samplewidth) +
-				       (samplewidth * j), &cval1, samplewidth);
-			}
-		}
-		else
-		{
-			sint16 sval1, sval2;
-			for (j = 0; j < resample_to_channels; j++)
-			{
-				memcpy(&sval1,
-				       in + (source * resample_to_channels * samplewidth) +
-				       (samplewidth * j), samplewidth);
-				memcpy(&sval2,
-				       in + ((source + 1) * resample_to_channels * samplewidth) +
-				       (samplewidth * j), samplewidth);
+#ifdef HAVE_OPUS
+static OpusDecoder *opus_decoder = NULL;
+static uint32 opus_decoder_srate = 0;
+static uint16 opus_decoder_channels = 0;
 
-				sval1 += (sint16) (sval2 * part) / 100;
+/* Each packet of the stream is one Opus packet */
+static STREAM
+opus_decode_packet(unsigned char *data, unsigned int size, RD_WAVEFORMATEX * format)
+{
+	int err, frames, maxframes;
+	STREAM out;
 
-				memcpy(data + (i * resample_to_channels * samplewidth) +
-				       (samplewidth * j), &sval1, samplewidth);
-			}
+	if (opus_decoder == NULL || opus_decoder_srate != format->nSamplesPerSec ||
+	    opus_decoder_channels != format->nChannels)
+	{
+		if (opus_decoder != NULL)
+			opus_decoder_destroy(opus_decoder);
+		opus_decoder = opus_decoder_create(format->nSamplesPerSec, format->nChannels, &err);
+		if (opus_decoder == NULL)
+		{
+			logger(Sound, Warning, "opus_decode_packet(), opus_decoder_create(): %s",
+			       opus_strerror(err));
+			return NULL;
 		}
-#else /* Nearest neighbor search */
-		for (j = 0; j < resample_to_channels; j++)
+		opus_decoder_srate = format->nSamplesPerSec;
+		opus_decoder_channels = format->nChannels;
+	}
+
+	/* 120 ms, the longest an Opus packet can be */
+	maxframes = format->nSamplesPerSec * 120 / 1000;
+	out = s_alloc(maxframes * format->nChannels * sizeof(sint16));
+
+	frames = opus_decode(opus_decoder, data, size, (opus_int16 *) out->data, maxframes, 0);
+	if (frames < 0)
+	{
+		logger(Sound, Warning, "opus_decode_packet(), opus_decode(): %s",
+		       opus_strerror(frames));
+		s_free(out);
+		return NULL;
+	}
+
+	out->p = out->data + frames * format->nChannels * sizeof(sint16);
+	return out;
+}
+#endif
+
+#ifdef HAVE_OPUS
+static OpusEncoder *opus_encoder = NULL;
+static uint32 opus_encoder_srate = 0;
+static uint16 opus_encoder_channels = 0;
+
+/* The whole packet becomes one Opus packet */
+static STREAM
+opus_encode_packet(const sint16 * pcm, unsigned int frames, RD_WAVEFORMATEX * format)
+{
+	int err, size;
+	STREAM out;
+
+	if (opus_encoder == NULL || opus_encoder_srate != format->nSamplesPerSec ||
+	    opus_encoder_channels != format->nChannels)
+	{
+		if (opus_encoder != NULL)
+			opus_encoder_destroy(opus_encoder);
+		opus_encoder = opus_encoder_create(format->nSamplesPerSec, format->nChannels,
+						   OPUS_APPLICATION_VOIP, &err);
+		if (opus_encoder == NULL)
 		{
-			memcpy(out + (i * resample_to_channels * samplewidth) + (samplewidth * j),
-			       in + (source * resample_to_channels * samplewidth) +
-			       (samplewidth * j), samplewidth);
+			logger(Sound, Warning, "opus_encode_packet(), opus_encoder_create(): %s",
+			       opus_strerror(err));
+			return NULL;
 		}
+		if (format->nAvgBytesPerSec != 0)
+			opus_encoder_ctl(opus_encoder,
+					 OPUS_SET_BITRATE(format->nAvgBytesPerSec * 8));
+		opus_encoder_srate = format->nSamplesPerSec;
+		opus_encoder_channels = format->nChannels;
+	}
+
+	/* the largest packet Opus recommends allocating for */
+	out = s_alloc(4000);
+	size = opus_encode(opus_encoder, pcm, frames, out->data, 4000);
+	if (size < 0)
+	{
+		logger(Sound, Warning, "opus_encode_packet(), opus_encode(): %s",
+		       opus_strerror(size));
+		s_free(out);
+		return NULL;
+	}
+
+	out->p = out->data + size;
+	return out;
+}
+#endif
+
+/* Round the number of frames wanted in a packet to what the codec of
+   format can put in one */
+unsigned int
+rdpsnd_dsp_encode_frames(RD_WAVEFORMATEX * format, unsigned int frames)
+{
+	unsigned int spb;
+#ifdef HAVE_OPUS
+	unsigned int ms;
+#endif
+
+	switch (format->wFormatTag)
+	{
+		case WAVE_FORMAT_DVI_ADPCM:
+			spb = ima_samples_per_block(format);
+			return MAX(1, (frames + spb / 2) / spb) * spb;
+#ifdef HAVE_OPUS
+		case WAVE_FORMAT_OPUS:
+			/* the longest Opus frame that is not longer */
+			ms = frames * 1000 / format->nSamplesPerSec;
+			ms = ms >= 60 ? 60 : ms >= 40 ? 40 : ms >= 20 ? 20 : 10;
+			return format->nSamplesPerSec * ms / 1000;
+#endif
+		default:
+			return MAX(1, frames);
+	}
+}
+
+/* Encode frames of 16 bit host endian PCM to a compressed format, the
+   number of frames must come from rdpsnd_dsp_encode_frames() */
+STREAM
+rdpsnd_dsp_encode(const sint16 * pcm, unsigned int frames, RD_WAVEFORMATEX * format)
+{
+	STREAM out;
+
+	switch (format->wFormatTag)
+	{
+		case WAVE_FORMAT_DVI_ADPCM:
+			out = ima_encode(pcm, frames, format);
+			break;
+#ifdef HAVE_OPUS
+		case WAVE_FORMAT_OPUS:
+			out = opus_encode_packet(pcm, frames, format);
+			break;
 #endif
+		default:
+			return NULL;
 	}
-	outsize = i * resample_to_channels * samplewidth;
+
+	if (out == NULL)
+		return NULL;
+
+	s_mark_end(out);
+	s_seek(out, 0);
+	return out;
+}
+
+/* Check if a compressed format can be decoded and encoded, and give
+   the PCM format it decodes to */
+RD_BOOL
+rdpsnd_dsp_decode_supported(RD_WAVEFORMATEX * format, RD_WAVEFORMATEX * pcm)
+{
+	if ((format->nChannels != 1) && (format->nChannels != 2))
+		return False;
+
+	switch (format->wFormatTag)
+	{
+		case WAVE_FORMAT_DVI_ADPCM:
+			if (format->wBitsPerSample != 4)
+				return False;
+			if (format->nBlockAlign <= 4 * format->nChannels)
+				return False;
+			break;
+#ifdef HAVE_OPUS
+		case WAVE_FORMAT_OPUS:
+			break;
 #endif
+		default:
+			return False;
+	}
 
-	if (tmpdata != NULL)
-		xfree(tmpdata);
+	memset(pcm, 0, sizeof(*pcm));
+	pcm->wFormatTag = WAVE_FORMAT_PCM;
+	pcm->nChannels = format->nChannels;
+	pcm->nSamplesPerSec = format->nSamplesPerSec;
+	pcm->wBitsPerSample = 16;
+	pcm->nBlockAlign = pcm->nChannels * 2;
+	pcm->nAvgBytesPerSec = pcm->nSamplesPerSec * pcm->nBlockAlign;
 
-	/* Shrink 16-bit output-samples to 8-bit */
-#ifndef HAVE_LIBSAMPLERATE	/* libsamplerate produces 16-bit samples */
-	if (format->wBitsPerSample != resample_to_bitspersample)
+	return True;
+}
+
+/* Decode a packet of a compressed format to 16 bit host endian PCM,
+   returns NULL if the packet could not be decoded */
+STREAM
+rdpsnd_dsp_decode(unsigned char *data, unsigned int size, RD_WAVEFORMATEX * format)
+{
+	STREAM out;
+#ifdef B_ENDIAN
+	RD_WAVEFORMATEX pcm;
 #endif
+
+	switch (format->wFormatTag)
 	{
-		/* source: 16 bit, dest: 8 bit */
-		if (resample_to_bitspersample == 8)
-		{
-			for (i = 0; i < outsize; i++)
-			{
-				data[i] = data[i * 2];
-			}
-			outsize /= 2;
-		}
+		case WAVE_FORMAT_DVI_ADPCM:
+			out = ima_decode(data, size, format);
+			break;
+#ifdef HAVE_OPUS
+		case WAVE_FORMAT_OPUS:
+			out = opus_decode_packet(data, size, format);
+			break;
+#endif
+		default:
+			return NULL;
 	}
 
+	if (out == NULL)
+		return NULL;
+
 #ifdef B_ENDIAN
-	if (!stream_be)
-		rdpsnd_dsp_swapbytes(data, outsize, format);
+	/* the rest of the pipeline takes little endian samples */
+	rdpsnd_dsp_decode_supported(format, &pcm);
+	rdpsnd_dsp_swapbytes(out->data, s_tell(out), &pcm);
 #endif
 
+	s_mark_end(out);
+	s_seek(out, 0);
 	return out;
 }
 
@@ -28,5 +28,11 @@ RD_BOOL rdpsnd_dsp_resample_set(uint32 device_srate, uint16 device_bitspersample
 				uint16 device_channels);
 RD_BOOL rdpsnd_dsp_resample_supported(RD_WAVEFORMATEX * pwfx);
 
+/* Decoding and encoding of compressed formats */
+RD_BOOL rdpsnd_dsp_decode_supported(RD_WAVEFORMATEX * format, RD_WAVEFORMATEX * pcm);
+STREAM rdpsnd_dsp_decode(unsigned char *data, unsigned int size, RD_WAVEFORMATEX * format);
+unsigned int rdpsnd_dsp_encode_frames(RD_WAVEFORMATEX * format, unsigned int frames);
+STREAM rdpsnd_dsp_encode(const sint16 * pcm, unsigned int frames, RD_WAVEFORMATEX * format);
+
 STREAM rdpsnd_dsp_process(unsigned char *data, unsigned int size,
 			  struct audio_driver *current_driver, RD_WAVEFORMATEX * format);
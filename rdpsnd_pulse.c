@@ -1196,14 +1196,40 @@ pulse_play(void)
 		if (audio_size)
 		{
 			unsigned char *data;
+			void *buffer;
+#if PA_CHECK_VERSION(0,9,16)
+			size_t buffer_size = audio_size;
+
+			/* Copy the samples straight into a block of PulseAudio's
+			   memory pool, which pa_stream_write() then hands over
+			   without copying them again */
+			if (pa_stream_begin_write(playback_stream, &buffer, &buffer_size) != 0)
+			{
+				err = pa_context_errno(context);
+				logger(Sound, Error, "pulse_play(), pa_stream_begin_write: %s",
+				       pa_strerror(err));
+				break;
+			}
 
+			buffer_size -= buffer_size % pa_frame_size(pa_stream_get_sample_spec
+								   (playback_stream));
+			audio_size = MIN(audio_size, buffer_size);
 			in_uint8p(out, data, audio_size);
+			memcpy(buffer, data, audio_size);
+#else
+			in_uint8p(out, data, audio_size);
+			buffer = data;
+#endif
+
 			if (pa_stream_write
-			    (playback_stream, data, audio_size, NULL, 0, playback_seek) != 0)
+			    (playback_stream, buffer, audio_size, NULL, 0, playback_seek) != 0)
 			{
 				err = pa_context_errno(context);
 				logger(Sound, Error, "pulse_play(), pa_stream_write: %s",
 				       pa_strerror(err));
+#if PA_CHECK_VERSION(0,9,16)
+				pa_stream_cancel_write(playback_stream);
+#endif
 				break;
 			}
 			else if (playback_seek == PA_SEEK_RELATIVE_ON_READ)
@@ -0,0 +1,284 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Session capture and replay
+   Copyright 2026 the rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* A capture holds every decrypted packet returned by sec_recv() for
+   the I/O channel, in the order they arrived. Virtual channel data
+   and licensing are dealt with below sec_recv() and are not part of
+   it. Replaying a capture hands the packets back to rdp_recv() as
+   fast as they can be processed, so the orders, bitmap updates and
+   the drawing layer see exactly the same input as in the recorded
+   session, without any server.
+
+   The file starts with a header:
+
+	8 bytes		"RDPREPLY"
+	uint16 le	format version, currently 1
+	uint16 le	RDP version
+	uint16 le	requested session width
+	uint16 le	requested session height
+
+   followed by one record per packet:
+
+	uint8		flags, REPLAY_FASTPATH for fast-path output
+	uint32 le	offset of the payload in the packet
+	uint32 le	packet length
+	...		packet data
+*/
+
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "rdesktop.h"
+
+#define REPLAY_MAGIC		"RDPREPLY"
+#define REPLAY_VERSION		1
+#define REPLAY_HEADER_SIZE	16
+#define REPLAY_RECORD_SIZE	9
+#define REPLAY_FASTPATH		0x01
+
+extern uint32 g_requested_session_width;
+extern uint32 g_requested_session_height;
+extern RDP_VERSION g_rdp_version;
+
+static FILE *g_record_file = NULL;
+static FILE *g_replay_file = NULL;
+static STREAM g_replay_stream = NULL;
+
+/* Replay statistics */
+static unsigned long g_replay_packets;
+static unsigned long long g_replay_bytes;
+static struct timeval g_replay_start;
+static struct rusage g_replay_usage;
+
+static void
+put_uint16(uint8 * p, uint16 value)
+{
+	p[0] = value & 0xff;
+	p[1] = value >> 8;
+}
+
+static void
+put_uint32(uint8 * p, uint32 value)
+{
+	put_uint16(p, value & 0xffff);
+	put_uint16(p + 2, value >> 16);
+}
+
+static uint16
+get_uint16(const uint8 * p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32
+get_uint32(const uint8 * p)
+{
+	return get_uint16(p) | ((uint32) get_uint16(p + 2) << 16);
+}
+
+/* Start capturing the session to filename */
+RD_BOOL
+replay_record_open(const char *filename)
+{
+	g_record_file = fopen(filename, "wb");
+	if (g_record_file == NULL)
+	{
+		logger(Core, Error, "replay_record_open(), failed to open '%s': %s", filename,
+		       strerror(errno));
+		return False;
+	}
+
+	return True;
+}
+
+/* Append a packet from sec_recv() to the capture, if there is one */
+void
+replay_record(STREAM s, RD_BOOL is_fastpath)
+{
+	uint8 header[REPLAY_HEADER_SIZE];
+	uint8 record[REPLAY_RECORD_SIZE];
+	size_t length;
+
+	if (g_record_file == NULL)
+		return;
+
+	/* the header is written with the first packet, as the session
+	   size is not final before that */
+	if (ftell(g_record_file) == 0)
+	{
+		memcpy(header, REPLAY_MAGIC, 8);
+		put_uint16(header + 8, REPLAY_VERSION);
+		put_uint16(header + 10, g_rdp_version);
+		put_uint16(header + 12, g_requested_session_width);
+		put_uint16(header + 14, g_requested_session_height);
+		fwrite(header, sizeof(header), 1, g_record_file);
+	}
+
+	length = s_length(s);
+	record[0] = is_fastpath ? REPLAY_FASTPATH : 0;
+	put_uint32(record + 1, s_tell(s));
+	put_uint32(record + 5, length);
+
+	if (fwrite(record, sizeof(record), 1, g_record_file) != 1 ||
+	    fwrite(s->data, length, 1, g_record_file) != 1)
+	{
+		logger(Core, Error, "replay_record(), failed to write capture: %s",
+		       strerror(errno));
+		fclose(g_record_file);
+		g_record_file = NULL;
+	}
+}
+
+void
+replay_record_close(void)
+{
+	if (g_record_file == NULL)
+		return;
+
+	fclose(g_record_file);
+	g_record_file = NULL;
+}
+
+/* Open a capture for replay, and apply the session settings it was
+   recorded with */
+RD_BOOL
+replay_open(const char *filename)
+{
+	uint8 header[REPLAY_HEADER_SIZE];
+
+	g_replay_file = fopen(filename, "rb");
+	if (g_replay_file == NULL)
+	{
+		logger(Core, Error, "replay_open(), failed to open '%s': %s", filename,
+		       strerror(errno));
+		return False;
+	}
+
+	if (fread(header, sizeof(header), 1, g_replay_file) != 1 ||
+	    memcmp(header, REPLAY_MAGIC, 8) != 0)
+	{
+		logger(Core, Error, "replay_open(), '%s' is not a session capture", filename);
+		fclose(g_replay_file);
+		g_replay_file = NULL;
+		return False;
+	}
+
+	if (get_uint16(header + 8) != REPLAY_VERSION)
+	{
+		logger(Core, Error, "replay_open(), unsupported capture version %d",
+		       get_uint16(header + 8));
+		fclose(g_replay_file);
+		g_replay_file = NULL;
+		return False;
+	}
+
+	g_rdp_version = get_uint16(header + 10);
+	g_requested_session_width = get_uint16(header + 12);
+	g_requested_session_height = get_uint16(header + 14);
+
+	g_replay_stream = s_alloc(8192);
+	g_replay_packets = 0;
+	g_replay_bytes = 0;
+	gettimeofday(&g_replay_start, NULL);
+	getrusage(RUSAGE_SELF, &g_replay_usage);
+
+	return True;
+}
+
+RD_BOOL
+replay_is_active(void)
+{
+	return g_replay_file != NULL;
+}
+
+/* Replacement for sec_recv() while replaying, NULL at the end of the
+   capture */
+STREAM
+replay_recv(RD_BOOL * is_fastpath)
+{
+	uint8 record[REPLAY_RECORD_SIZE];
+	uint32 offset, length;
+
+	if (fread(record, sizeof(record), 1, g_replay_file) != 1)
+		return NULL;
+
+	offset = get_uint32(record + 1);
+	length = get_uint32(record + 5);
+	if (offset > length)
+	{
+		logger(Core, Error, "replay_recv(), corrupt capture record");
+		return NULL;
+	}
+
+	if (length > g_replay_stream->size)
+		s_realloc(g_replay_stream, length);
+	s_reset(g_replay_stream);
+
+	if (length != 0 && fread(g_replay_stream->data, length, 1, g_replay_file) != 1)
+	{
+		logger(Core, Error, "replay_recv(), capture is truncated");
+		return NULL;
+	}
+
+	g_replay_stream->end = g_replay_stream->data + length;
+	g_replay_stream->p = g_replay_stream->data + offset;
+	*is_fastpath = (record[0] & REPLAY_FASTPATH) ? True : False;
+
+	g_replay_packets++;
+	g_replay_bytes += length;
+
+	return g_replay_stream;
+}
+
+static double
+timeval_seconds(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+/* Finish replaying and report how long it took */
+void
+replay_close(void)
+{
+	struct timeval now;
+	struct rusage usage;
+	double wall, cpu;
+
+	if (g_replay_file == NULL)
+		return;
+
+	gettimeofday(&now, NULL);
+	getrusage(RUSAGE_SELF, &usage);
+
+	wall = timeval_seconds(&now) - timeval_seconds(&g_replay_start);
+	cpu = timeval_seconds(&usage.ru_utime) - timeval_seconds(&g_replay_usage.ru_utime) +
+		timeval_seconds(&usage.ru_stime) - timeval_seconds(&g_replay_usage.ru_stime);
+
+	logger(Core, Notice, "Replayed %lu packets, %llu bytes in %.3f s, %.3f s CPU",
+	       g_replay_packets, g_replay_bytes, wall, cpu);
+	if (g_replay_packets != 0 && wall > 0)
+		logger(Core, Notice, "%.1f packets/s, %.1f us CPU per packet",
+		       g_replay_packets / wall, cpu * 1000000.0 / g_replay_packets);
+
+	fclose(g_replay_file);
+	g_replay_file = NULL;
+	s_free(g_replay_stream);
+	g_replay_stream = NULL;
+}
@@ -0,0 +1,705 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   RemoteFX codec
+   Copyright 2026 the rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* RemoteFX (MS-RDPRFX) codes the screen as 64x64 tiles, each
+   transformed with a three level 5/3 wavelet, quantised and entropy
+   coded with RLGR. It is sent in surface bits commands. Tiles do not
+   depend on each other, so they are decoded on the bitmap worker
+   threads and then painted within the region rectangles of the
+   message. The entropy decoder and colour conversion are shared with
+   the progressive codec. */
+
+#include "rdesktop.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#define RFX_WBT_SYNC		0xccc0
+#define RFX_WBT_CODEC_VERSIONS	0xccc1
+#define RFX_WBT_CHANNELS	0xccc2
+#define RFX_WBT_CONTEXT		0xccc3
+#define RFX_WBT_FRAME_BEGIN	0xccc4
+#define RFX_WBT_FRAME_END	0xccc5
+#define RFX_WBT_REGION		0xccc6
+#define RFX_WBT_EXTENSION	0xccc7
+
+#define RFX_CBT_TILESET		0xcac2
+#define RFX_CBT_TILE		0xcac3
+
+#define RFX_MAGIC		0xcacccaca
+#define RFX_ENTROPY_RLGR3	0x04
+
+#define RFX_TILE_SIZE		64
+#define RFX_TILE_PIXELS		(RFX_TILE_SIZE * RFX_TILE_SIZE)
+#define RFX_BANDS		10
+
+/* RLGR adaptation parameters */
+#define RLGR_KPMAX	80
+#define RLGR_LSGR	3
+#define RLGR_UP_GR	4
+#define RLGR_DN_GR	6
+#define RLGR_UQ_GR	3
+#define RLGR_DQ_GR	3
+
+/* Where the bands of a tile lie and which of the quantisation values,
+   in the order they are sent (LL3, LH3, HL3, HH3, LH2, HL2, HH2, LH1,
+   HL1, HH1), applies to each */
+static const struct
+{
+	int offset, length, quant;
+}
+rfx_bands[RFX_BANDS] =
+{
+	{0, 1024, 8}, {1024, 1024, 7}, {2048, 1024, 9},
+	{3072, 256, 5}, {3328, 256, 4}, {3584, 256, 6},
+	{3840, 64, 2}, {3904, 64, 1}, {3968, 64, 3},
+	{4032, 64, 0}
+};
+
+#define RFX_LL3_OFFSET	4032
+
+typedef struct
+{
+	BITMAP_JOB job;
+	uint16 x, y;
+	uint8 *data[3];
+	uint16 length[3];
+	uint8 *quant[3];
+	RD_BOOL rlgr3;
+}
+RFX_TILE;
+
+/* Tile pixels of the message being decoded, kept between messages */
+static uint8 *rfx_pixels;
+static size_t rfx_pixels_size;
+
+/* Bit reader, most significant bit first */
+typedef struct
+{
+	uint8 *p, *end;
+	uint32 bits;
+	int nbits;
+	sint32 left;
+}
+RFX_BITS;
+
+static void
+rfx_bits_init(RFX_BITS * b, uint8 * data, uint32 size)
+{
+	b->p = data;
+	b->end = data + size;
+	b->bits = 0;
+	b->nbits = 0;
+	b->left = size * 8;
+}
+
+static uint32
+rfx_get_bits(RFX_BITS * b, int n)
+{
+	uint32 v;
+
+	if (n == 0)
+		return 0;
+
+	while (b->nbits < n)
+	{
+		b->bits |= (uint32) (b->p < b->end ? *b->p++ : 0) << (24 - b->nbits);
+		b->nbits += 8;
+	}
+
+	v = b->bits >> (32 - n);
+	b->bits <<= n;
+	b->nbits -= n;
+	b->left -= n;
+	return v;
+}
+
+static inline sint16
+rfx_rlgr_value(uint32 code)
+{
+	return (code & 1) ? -(sint16) ((code + 1) >> 1) : (sint16) (code >> 1);
+}
+
+/* Adaptive run-length Golomb-Rice decoding (MS-RDPRFX 3.1.8.1.7),
+   RLGR3 codes two values with each Golomb-Rice code where RLGR1 codes
+   one. Coefficients that are not coded are zero. */
+void
+rfx_rlgr_decode(RD_BOOL rlgr3, uint8 * data, uint32 size, sint16 * out, int count)
+{
+	RFX_BITS b;
+	int k = 1, kp = 1 << RLGR_LSGR;
+	int kr = 1, krp = 1 << RLGR_LSGR;
+	int n = 0, nbits;
+	uint32 run, vk, code, val1, val2;
+	sint16 mag;
+
+	rfx_bits_init(&b, data, size);
+
+	while (b.left > 0 && n < count)
+	{
+		if (k)
+		{
+			/* run-length mode, each 0 bit adds 1 << k zeros */
+			run = 0;
+			while (1)
+			{
+				if (b.left <= 0)
+					goto done;
+				if (rfx_get_bits(&b, 1))
+					break;
+				run += 1 << k;
+				kp = MIN(kp + RLGR_UP_GR, RLGR_KPMAX);
+				k = kp >> RLGR_LSGR;
+			}
+			if (b.left < k + 1)
+				break;
+			run += rfx_get_bits(&b, k);
+			mag = rfx_get_bits(&b, 1) ? -1 : 1;
+
+			vk = 0;
+			while (b.left > 0 && rfx_get_bits(&b, 1))
+				vk++;
+			code = rfx_get_bits(&b, kr) | (vk << kr);
+
+			if (vk == 0)
+			{
+				krp = MAX(krp - 2, 0);
+				kr = krp >> RLGR_LSGR;
+			}
+			else if (vk != 1)
+			{
+				krp = MIN(krp + (int) vk, RLGR_KPMAX);
+				kr = krp >> RLGR_LSGR;
+			}
+			kp = MAX(kp - RLGR_DN_GR, 0);
+			k = kp >> RLGR_LSGR;
+
+			run = MIN(run, (uint32) (count - n));
+			memset(out + n, 0, run * sizeof(sint16));
+			n += run;
+			if (n < count)
+				out[n++] = mag * (sint16) (code + 1);
+			continue;
+		}
+
+		/* Golomb-Rice mode */
+		vk = 0;
+		while (b.left > 0 && rfx_get_bits(&b, 1))
+			vk++;
+		code = rfx_get_bits(&b, kr) | (vk << kr);
+
+		if (vk == 0)
+		{
+			krp = MAX(krp - 2, 0);
+			kr = krp >> RLGR_LSGR;
+		}
+		else if (vk != 1)
+		{
+			krp = MIN(krp + (int) vk, RLGR_KPMAX);
+			kr = krp >> RLGR_LSGR;
+		}
+
+		if (!rlgr3)
+		{
+			if (code == 0)
+				kp = MIN(kp + RLGR_UQ_GR, RLGR_KPMAX);
+			else
+				kp = MAX(kp - RLGR_DQ_GR, 0);
+			k = kp >> RLGR_LSGR;
+			out[n++] = rfx_rlgr_value(code);
+			continue;
+		}
+
+		/* the first value takes as many bits as the code needs */
+		for (nbits = 0, val1 = code; val1 != 0; val1 >>= 1)
+			nbits++;
+		val1 = rfx_get_bits(&b, nbits);
+		val2 = code - val1;
+
+		if (val1 && val2)
+			kp = MAX(kp - 2 * RLGR_DQ_GR, 0);
+		else if (!val1 && !val2)
+			kp = MIN(kp + 2 * RLGR_UQ_GR, RLGR_KPMAX);
+		k = kp >> RLGR_LSGR;
+
+		out[n++] = rfx_rlgr_value(val1);
+		if (n < count)
+			out[n++] = rfx_rlgr_value(val2);
+	}
+
+done:
+	if (n < count)
+		memset(out + n, 0, (count - n) * sizeof(sint16));
+}
+
+static uint8
+rfx_clamp(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/* Colour convert the transformed components of a tile, which have 5
+   fractional bits, in to 32 bpp pixels */
+void
+rfx_ycbcr_to_bgra(sint16 * y, sint16 * cb, sint16 * cr, uint8 * out)
+{
+	int i = 0, yv, cbv, crv;
+	uint8 *px;
+#if defined(__SSE2__)
+	/* coefficients scaled by 1 << 14, so that the high half of the
+	   product has the 3 fractional bits left in Y after >> 2 */
+	const __m128i r_cr = _mm_set1_epi16(22986);
+	const __m128i g_cb = _mm_set1_epi16(-5636);
+	const __m128i g_cr = _mm_set1_epi16(-11698);
+	const __m128i b_cb = _mm_set1_epi16(28999);
+	const __m128i offset = _mm_set1_epi16(4096);
+	const __m128i opaque = _mm_set1_epi8((char) 0xff);
+	__m128i vy, vcb, vcr, vr, vg, vb, bg, ra;
+
+	for (; i + 8 <= RFX_TILE_PIXELS; i += 8)
+	{
+		vy = _mm_srai_epi16(_mm_add_epi16(_mm_loadu_si128((__m128i *) (y + i)), offset), 2);
+		vcb = _mm_loadu_si128((__m128i *) (cb + i));
+		vcr = _mm_loadu_si128((__m128i *) (cr + i));
+
+		vr = _mm_srai_epi16(_mm_add_epi16(vy, _mm_mulhi_epi16(vcr, r_cr)), 3);
+		vg = _mm_srai_epi16(_mm_add_epi16(_mm_add_epi16(vy, _mm_mulhi_epi16(vcb, g_cb)),
+						  _mm_mulhi_epi16(vcr, g_cr)), 3);
+		vb = _mm_srai_epi16(_mm_add_epi16(vy, _mm_mulhi_epi16(vcb, b_cb)), 3);
+
+		bg = _mm_unpacklo_epi8(_mm_packus_epi16(vb, vb), _mm_packus_epi16(vg, vg));
+		ra = _mm_unpacklo_epi8(_mm_packus_epi16(vr, vr), opaque);
+		_mm_storeu_si128((__m128i *) (out + i * 4), _mm_unpacklo_epi16(bg, ra));
+		_mm_storeu_si128((__m128i *) (out + i * 4 + 16), _mm_unpackhi_epi16(bg, ra));
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	/* vqdmulh doubles the product, so the coefficients are scaled by
+	   1 << 13 for the same result as above */
+	int16x8_t vy, vcb, vcr;
+	uint8x8x4_t px;
+
+	px.val[3] = vdup_n_u8(0xff);
+	for (; i + 8 <= RFX_TILE_PIXELS; i += 8)
+	{
+		vy = vshrq_n_s16(vaddq_s16(vld1q_s16(y + i), vdupq_n_s16(4096)), 2);
+		vcb = vld1q_s16(cb + i);
+		vcr = vld1q_s16(cr + i);
+
+		px.val[2] = vqmovun_s16(vshrq_n_s16(vaddq_s16(vy, vqdmulhq_n_s16(vcr, 11493)), 3));
+		px.val[1] = vqmovun_s16(vshrq_n_s16(vaddq_s16(vaddq_s16(vy, vqdmulhq_n_s16(vcb, -2818)),
+							      vqdmulhq_n_s16(vcr, -5849)), 3));
+		px.val[0] = vqmovun_s16(vshrq_n_s16(vaddq_s16(vy, vqdmulhq_n_s16(vcb, 14500)), 3));
+		vst4_u8(out + i * 4, px);
+	}
+#endif
+
+	/* the same fixed point steps as the vector code, so that every
+	   build gives the same pixels */
+	for (px = out + i * 4; i < RFX_TILE_PIXELS; i++, px += 4)
+	{
+		yv = (sint16) (y[i] + 4096) >> 2;
+		cbv = cb[i];
+		crv = cr[i];
+		px[0] = rfx_clamp((yv + ((cbv * 28999) >> 16)) >> 3);
+		px[1] = rfx_clamp((yv + ((cbv * -5636) >> 16) + ((crv * -11698) >> 16)) >> 3);
+		px[2] = rfx_clamp((yv + ((crv * 22986) >> 16)) >> 3);
+		px[3] = 0xff;
+	}
+}
+
+/* Even samples of the inverse 5/3 lifting, for n values of a row */
+static void
+rfx_lift_even(const sint16 * low, const sint16 * h0, const sint16 * h1, sint16 * out, int n)
+{
+	int x = 0;
+#if defined(__SSE2__)
+	const __m128i one = _mm_set1_epi16(1);
+	__m128i h;
+
+	for (; x + 8 <= n; x += 8)
+	{
+		h = _mm_add_epi16(_mm_add_epi16(_mm_loadu_si128((__m128i *) (h0 + x)),
+						_mm_loadu_si128((__m128i *) (h1 + x))), one);
+		_mm_storeu_si128((__m128i *) (out + x),
+				 _mm_sub_epi16(_mm_loadu_si128((__m128i *) (low + x)),
+					       _mm_srai_epi16(h, 1)));
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	int16x8_t h;
+
+	for (; x + 8 <= n; x += 8)
+	{
+		h = vaddq_s16(vaddq_s16(vld1q_s16(h0 + x), vld1q_s16(h1 + x)), vdupq_n_s16(1));
+		vst1q_s16(out + x, vsubq_s16(vld1q_s16(low + x), vshrq_n_s16(h, 1)));
+	}
+#endif
+	for (; x < n; x++)
+		out[x] = low[x] - ((h0[x] + h1[x] + 1) >> 1);
+}
+
+/* Odd samples of the inverse 5/3 lifting, from the even ones around */
+static void
+rfx_lift_odd(const sint16 * high, const sint16 * e0, const sint16 * e1, sint16 * out, int n)
+{
+	int x = 0;
+#if defined(__SSE2__)
+	__m128i e;
+
+	for (; x + 8 <= n; x += 8)
+	{
+		e = _mm_add_epi16(_mm_loadu_si128((__m128i *) (e0 + x)),
+				  _mm_loadu_si128((__m128i *) (e1 + x)));
+		_mm_storeu_si128((__m128i *) (out + x),
+				 _mm_add_epi16(_mm_slli_epi16
+					       (_mm_loadu_si128((__m128i *) (high + x)), 1),
+					       _mm_srai_epi16(e, 1)));
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	int16x8_t e;
+
+	for (; x + 8 <= n; x += 8)
+	{
+		e = vaddq_s16(vld1q_s16(e0 + x), vld1q_s16(e1 + x));
+		vst1q_s16(out + x, vaddq_s16(vshlq_n_s16(vld1q_s16(high + x), 1), vshrq_n_s16(e, 1)));
+	}
+#endif
+	for (; x < n; x++)
+		out[x] = 2 * high[x] + ((e0[x] + e1[x]) >> 1);
+}
+
+/* One dimensional inverse of a row of n low and n high coefficients,
+   the samples past the ends mirror those inside */
+static void
+rfx_idwt_row(const sint16 * low, const sint16 * high, sint16 * dst, int n)
+{
+	int i;
+
+	dst[0] = low[0] - ((high[0] + high[0] + 1) >> 1);
+	for (i = 1; i < n; i++)
+		dst[2 * i] = low[i] - ((high[i - 1] + high[i] + 1) >> 1);
+	for (i = 0; i < n - 1; i++)
+		dst[2 * i + 1] = 2 * high[i] + ((dst[2 * i] + dst[2 * i + 2]) >> 1);
+	dst[2 * i + 1] = 2 * high[i] + dst[2 * i];
+}
+
+/* Inverse transform of one level, buffer holds the HL, LH, HH and LL
+   bands of n x n coefficients and gets the 2n x 2n result */
+static void
+rfx_idwt_level(sint16 * buffer, sint16 * temp, int n)
+{
+	sint16 *hl, *lh, *hh, *ll, *l, *h;
+	int i, w = 2 * n;
+
+	hl = buffer;
+	lh = hl + n * n;
+	hh = lh + n * n;
+	ll = hh + n * n;
+	l = temp;
+	h = temp + n * w;
+
+	/* horizontally, LL and HL in to L, LH and HH in to H */
+	for (i = 0; i < n; i++)
+	{
+		rfx_idwt_row(ll + i * n, hl + i * n, l + i * w, n);
+		rfx_idwt_row(lh + i * n, hh + i * n, h + i * w, n);
+	}
+
+	/* vertically, whole rows at a time */
+	for (i = 0; i < n; i++)
+		rfx_lift_even(l + i * w, h + (i > 0 ? i - 1 : 0) * w, h + i * w,
+			      buffer + 2 * i * w, w);
+	for (i = 0; i < n; i++)
+		rfx_lift_odd(h + i * w, buffer + 2 * i * w,
+			     buffer + (i < n - 1 ? 2 * i + 2 : 2 * i) * w,
+			     buffer + (2 * i + 1) * w, w);
+}
+
+/* Decode the three components of a tile and colour convert them in to
+   its pixels, run on the bitmap worker threads */
+static RD_BOOL
+rfx_decode_tile(BITMAP_JOB * job)
+{
+	RFX_TILE *tile = (RFX_TILE *) job->arg;
+	sint16 planes[3][RFX_TILE_PIXELS];
+	sint16 temp[RFX_TILE_PIXELS];
+	sint16 *p;
+	int c, i, j, shift;
+
+	for (c = 0; c < 3; c++)
+	{
+		p = planes[c];
+		rfx_rlgr_decode(tile->rlgr3, tile->data[c], tile->length[c], p, RFX_TILE_PIXELS);
+
+		/* LL3 is coded as differences */
+		for (i = RFX_LL3_OFFSET + 1; i < RFX_TILE_PIXELS; i++)
+			p[i] += p[i - 1];
+
+		for (i = 0; i < RFX_BANDS; i++)
+		{
+			shift = tile->quant[c][rfx_bands[i].quant] - 1;
+			if (shift <= 0)
+				continue;
+			for (j = 0; j < rfx_bands[i].length; j++)
+				p[rfx_bands[i].offset + j] *= 1 << shift;
+		}
+
+		rfx_idwt_level(p + 3840, temp, 8);
+		rfx_idwt_level(p + 3072, temp, 16);
+		rfx_idwt_level(p, temp, 32);
+	}
+
+	rfx_ycbcr_to_bgra(planes[0], planes[1], planes[2], job->output);
+	return True;
+}
+
+/* Paint the parts of the decoded tiles that lie in a region
+   rectangle */
+static void
+rfx_paint_rect(RFX_TILE * tiles, int ntiles, int left, int top, int x, int y, int cx, int cy)
+{
+	int i, row, tx0, ty0, tx1, ty1;
+	uint8 *pixels;
+
+	if (cx <= 0 || cy <= 0)
+		return;
+
+	pixels = xmalloc(cx * cy * 4);
+	memset(pixels, 0, cx * cy * 4);
+
+	for (i = 0; i < ntiles; i++)
+	{
+		if (!tiles[i].job.result)
+			continue;
+
+		tx0 = MAX(tiles[i].x, x);
+		ty0 = MAX(tiles[i].y, y);
+		tx1 = MIN(tiles[i].x + RFX_TILE_SIZE, x + cx);
+		ty1 = MIN(tiles[i].y + RFX_TILE_SIZE, y + cy);
+		if (tx0 >= tx1 || ty0 >= ty1)
+			continue;
+
+		for (row = ty0; row < ty1; row++)
+			memcpy(pixels + ((row - y) * cx + tx0 - x) * 4,
+			       tiles[i].job.output + ((row - tiles[i].y) * RFX_TILE_SIZE +
+						      tx0 - tiles[i].x) * 4, (tx1 - tx0) * 4);
+	}
+
+	ui_paint_bitmap(left + x, top + y, cx, cy, cx, cy, pixels);
+	xfree(pixels);
+}
+
+/* Decode a TS_RFX_TILESET, queueing every tile before waiting for any
+   so that they are spread over the worker threads */
+static RD_BOOL
+rfx_process_tileset(STREAM s, BOUNDS * rects, int nrects, int left, int top)
+{
+	uint16 subtype, properties, ntiles, type, xidx, yidx, qidx[3];
+	uint8 nquant, tile_size, *quant;
+	uint32 length;
+	RFX_TILE *tiles, *tile;
+	int i, c, n;
+	RD_BOOL rlgr3;
+
+	in_uint8s(s, 2);	/* codecId, channelId */
+	in_uint16_le(s, subtype);
+	if (subtype != RFX_CBT_TILESET || !s_check_rem(s, 10))
+		return False;
+	in_uint8s(s, 2);	/* idx */
+	in_uint16_le(s, properties);
+	in_uint8(s, nquant);
+	in_uint8(s, tile_size);
+	in_uint16_le(s, ntiles);
+	in_uint8s(s, 4);	/* tileDataSize */
+
+	if (tile_size != RFX_TILE_SIZE || nquant == 0 || !s_check_rem(s, nquant * 5))
+		return False;
+	rlgr3 = ((properties >> 10) & 0x0f) == RFX_ENTROPY_RLGR3;
+
+	quant = xmalloc(nquant * RFX_BANDS);
+	for (i = 0; i < nquant * RFX_BANDS; i++)
+		quant[i] = (s->p[i / 2] >> ((i & 1) * 4)) & 0x0f;
+	in_uint8s(s, nquant * 5);
+
+	if (rfx_pixels_size < (size_t) ntiles * RFX_TILE_PIXELS * 4)
+	{
+		rfx_pixels_size = (size_t) ntiles * RFX_TILE_PIXELS * 4;
+		rfx_pixels = xrealloc(rfx_pixels, rfx_pixels_size);
+	}
+	tiles = xmalloc(MAX(ntiles, 1) * sizeof(RFX_TILE));
+
+	for (n = 0; n < ntiles && s_check_rem(s, 19); n++)
+	{
+		in_uint16_le(s, type);
+		in_uint32_le(s, length);
+		if (type != RFX_CBT_TILE || length < 19 || !s_check_rem(s, length - 6))
+			break;
+
+		tile = &tiles[n];
+		in_uint8(s, qidx[0]);
+		in_uint8(s, qidx[1]);
+		in_uint8(s, qidx[2]);
+		in_uint16_le(s, xidx);
+		in_uint16_le(s, yidx);
+		in_uint16_le(s, tile->length[0]);
+		in_uint16_le(s, tile->length[1]);
+		in_uint16_le(s, tile->length[2]);
+
+		if (qidx[0] >= nquant || qidx[1] >= nquant || qidx[2] >= nquant
+		    || 19U + tile->length[0] + tile->length[1] + tile->length[2] > length)
+			break;
+
+		tile->x = xidx * RFX_TILE_SIZE;
+		tile->y = yidx * RFX_TILE_SIZE;
+		tile->rlgr3 = rlgr3;
+		for (c = 0; c < 3; c++)
+		{
+			tile->quant[c] = quant + qidx[c] * RFX_BANDS;
+			in_uint8p(s, tile->data[c], tile->length[c]);
+		}
+		in_uint8s(s, length - 19 - tile->length[0] - tile->length[1] - tile->length[2]);
+
+		memset(&tile->job, 0, sizeof(tile->job));
+		tile->job.output = rfx_pixels + (size_t) n * RFX_TILE_PIXELS * 4;
+		tile->job.decode = rfx_decode_tile;
+		tile->job.arg = tile;
+		bitmap_decompress_queue(&tile->job);
+	}
+
+	for (i = 0; i < n; i++)
+		bitmap_decompress_wait(&tiles[i].job);
+
+	for (i = 0; i < nrects; i++)
+		rfx_paint_rect(tiles, n, left, top, rects[i].left, rects[i].top,
+			       rects[i].right - rects[i].left + 1, rects[i].bottom - rects[i].top + 1);
+
+	xfree(tiles);
+	xfree(quant);
+	return n == ntiles;
+}
+
+/* Decode a RemoteFX message from a surface bits command and paint it
+   at left, top. An empty region stands for the whole width by height
+   destination. */
+RD_BOOL
+rfx_process_message(uint8 * data, uint32 size, int left, int top, int width, int height)
+{
+	struct stream packet;
+	STREAM s = &packet, block;
+	struct stream sub;
+	uint16 type, nrects, x, y, cx, cy;
+	uint32 length, magic;
+	BOUNDS *rects = NULL;
+	int i, n = 0;
+	RD_BOOL rv = True;
+
+	memset(s, 0, sizeof(*s));
+	s->data = s->p = data;
+	s->end = data + size;
+
+	while (rv && s_check_rem(s, 6))
+	{
+		in_uint16_le(s, type);
+		in_uint32_le(s, length);
+		if (length < 6 || !s_check_rem(s, length - 6))
+		{
+			logger(Graphics, Warning, "rfx_process_message(), truncated block 0x%x", type);
+			rv = False;
+			break;
+		}
+
+		memset(&sub, 0, sizeof(sub));
+		in_uint8p(s, sub.data, length - 6);
+		sub.p = sub.data;
+		sub.end = sub.data + length - 6;
+		sub.size = length - 6;
+		block = &sub;
+
+		switch (type)
+		{
+			case RFX_WBT_SYNC:
+				in_uint32_le(block, magic);
+				if (magic != RFX_MAGIC)
+				{
+					logger(Graphics, Warning,
+					       "rfx_process_message(), bad magic 0x%x", magic);
+					rv = False;
+				}
+				break;
+
+			case RFX_WBT_CODEC_VERSIONS:
+			case RFX_WBT_CHANNELS:
+			case RFX_WBT_CONTEXT:
+			case RFX_WBT_FRAME_BEGIN:
+			case RFX_WBT_FRAME_END:
+				/* tile size and entropy coder come with each
+				   tileset */
+				break;
+
+			case RFX_WBT_REGION:
+				in_uint8s(block, 3);	/* codecId, channelId, regionFlags */
+				in_uint16_le(block, nrects);
+				if (!s_check_rem(block, nrects * 8))
+				{
+					rv = False;
+					break;
+				}
+				xfree(rects);
+				rects = xmalloc(MAX(nrects, 1) * sizeof(BOUNDS));
+				for (i = 0; i < nrects; i++)
+				{
+					in_uint16_le(block, x);
+					in_uint16_le(block, y);
+					in_uint16_le(block, cx);
+					in_uint16_le(block, cy);
+					rects[i].left = x;
+					rects[i].top = y;
+					rects[i].right = MIN(x + cx, width) - 1;
+					rects[i].bottom = MIN(y + cy, height) - 1;
+				}
+				n = nrects;
+				if (n == 0)
+				{
+					rects[0].left = rects[0].top = 0;
+					rects[0].right = width - 1;
+					rects[0].bottom = height - 1;
+					n = 1;
+				}
+				break;
+
+			case RFX_WBT_EXTENSION:
+				if (rects == NULL)
+				{
+					rv = False;
+					break;
+				}
+				rv = rfx_process_tileset(block, rects, n, left, top);
+				break;
+
+			default:
+				logger(Graphics, Debug,
+				       "rfx_process_message(), ignoring block 0x%x", type);
+		}
+	}
+
+	xfree(rects);
+	return rv;
+}
@@ -0,0 +1,792 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Graphics pipeline RemoteFX progressive codec decoder
+   Copyright 2026 the rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The RemoteFX progressive codec (MS-RDPEGFX 2.2.4.2 and 3.2.8.1)
+   codes a surface as 64x64 tiles of wavelet coefficients. A tile is
+   first sent coarsely quantised and then refined by upgrade passes,
+   which add the next bits of each coefficient. The coefficients of
+   every tile are therefore kept for as long as the surface lives.
+
+   Only the reduce-extrapolate wavelet that Windows servers use is
+   implemented, regions with the plain RemoteFX wavelet are dropped. */
+
+#include "rdesktop.h"
+
+#define PROGRESSIVE_WBT_SYNC		0xccc0
+#define PROGRESSIVE_WBT_FRAME_BEGIN	0xccc1
+#define PROGRESSIVE_WBT_FRAME_END	0xccc2
+#define PROGRESSIVE_WBT_CONTEXT		0xccc3
+#define PROGRESSIVE_WBT_REGION		0xccc4
+#define PROGRESSIVE_WBT_TILE_SIMPLE	0xccc5
+#define PROGRESSIVE_WBT_TILE_FIRST	0xccc6
+#define PROGRESSIVE_WBT_TILE_UPGRADE	0xccc7
+
+#define RFX_DWT_REDUCE_EXTRAPOLATE	0x01
+#define RFX_TILE_DIFFERENCE		0x01
+
+#define RFX_TILE_SIZE		64
+#define RFX_TILE_PIXELS		(RFX_TILE_SIZE * RFX_TILE_SIZE)
+#define RFX_BANDS		10
+#define RFX_QUALITY_FULL	0xff
+
+/* RLGR adaptation limit, the SRL coder of upgrade passes adapts the
+   same way */
+#define RLGR_KPMAX	80
+
+/* Bands in the order the coefficients are sent: HL1, LH1, HH1, HL2,
+   LH2, HH2, HL3, LH3, HH3 and LL3, with the reduce-extrapolate sizes */
+static const int rfx_band_offset[RFX_BANDS] =
+	{ 0, 1023, 2046, 3007, 3279, 3551, 3807, 3879, 3951, 4015 };
+static const int rfx_band_length[RFX_BANDS] = { 1023, 1023, 961, 272, 272, 256, 72, 72, 64, 81 };
+
+/* The band each quantisation nibble applies to, the nibbles are sent
+   in the order LL3, LH3, HL3, HH3, LH2, HL2, HH2, LH1, HL1, HH1 */
+static const int rfx_quant_band[RFX_BANDS] = { 9, 7, 6, 8, 4, 3, 5, 1, 0, 2 };
+
+#define RFX_LL3	9
+
+typedef struct
+{
+	uint8 q[RFX_BANDS];
+}
+RFX_QUANT;
+
+typedef struct
+{
+	uint8 quality;
+	RFX_QUANT comp[3];
+}
+RFX_PROG_QUANT;
+
+typedef struct
+{
+	sint16 coeff[3][RFX_TILE_PIXELS];
+	sint16 sign[3][RFX_TILE_PIXELS];
+	RFX_QUANT bitpos[3];
+}
+RFX_TILE;
+
+typedef struct rfxprog_surface
+{
+	uint16 id;
+	int grid_width, grid_height;
+	RFX_TILE **tiles;
+	struct rfxprog_surface *next;
+}
+RFXPROG_SURFACE;
+
+static RFXPROG_SURFACE *rfxprog_surfaces;
+
+/* Everything a region passes to its tiles */
+typedef struct
+{
+	RFXPROG_SURFACE *surface;
+	uint8 *dst;
+	int stride, width, height;
+	uint16 num_rects;
+	uint8 *rects;
+	uint8 num_quant, num_prog_quant;
+	RFX_QUANT *quant;
+	RFX_PROG_QUANT *prog_quant;
+}
+RFX_REGION;
+
+/* Bit reader, most significant bit first */
+typedef struct
+{
+	uint8 *p, *end;
+	uint32 bits;
+	int nbits;
+	sint32 left;
+}
+RFX_BITS;
+
+static void
+rfx_bits_init(RFX_BITS * b, uint8 * data, uint32 size)
+{
+	b->p = data;
+	b->end = data + size;
+	b->bits = 0;
+	b->nbits = 0;
+	b->left = size * 8;
+}
+
+static uint32
+rfx_get_bits(RFX_BITS * b, int n)
+{
+	uint32 v;
+
+	if (n == 0)
+		return 0;
+
+	while (b->nbits < n)
+	{
+		b->bits |= (uint32) (b->p < b->end ? *b->p++ : 0) << (24 - b->nbits);
+		b->nbits += 8;
+	}
+
+	v = b->bits >> (32 - n);
+	b->bits <<= n;
+	b->nbits -= n;
+	b->left -= n;
+	return v;
+}
+
+/* One dimensional inverse of the reduce-extrapolate wavelet, combining
+   low_count low and high_count high coefficients in to
+   low_count + high_count samples. lines sets of coefficients are
+   transformed, the *_step arguments are the distance between the
+   values of a line and the line_* ones that between lines. */
+static void
+rfx_idwt_1d(const sint16 * low, const sint16 * high, sint16 * dst, int low_count,
+	    int high_count, int src_low_step, int src_high_step, int dst_step,
+	    int line_low, int line_high, int line_dst, int lines)
+{
+	sint16 l0, h0, h1, x0, x1, x2;
+	const sint16 *pl, *ph;
+	sint16 *px;
+	int i, j;
+
+	for (i = 0; i < lines; i++)
+	{
+		pl = low + i * line_low;
+		ph = high + i * line_high;
+		px = dst + i * line_dst;
+
+		h0 = *ph;
+		ph += src_high_step;
+		l0 = *pl;
+		pl += src_low_step;
+		x0 = l0 - h0;
+		x2 = x0;
+
+		for (j = 0; j < high_count - 1; j++)
+		{
+			h1 = *ph;
+			ph += src_high_step;
+			l0 = *pl;
+			pl += src_low_step;
+			x2 = l0 - ((h0 + h1) / 2);
+			x1 = ((x0 + x2) / 2) + (2 * h0);
+			px[0] = x0;
+			px[dst_step] = x1;
+			px += 2 * dst_step;
+			x0 = x2;
+			h0 = h1;
+		}
+
+		if (low_count <= high_count + 1)
+		{
+			if (low_count <= high_count)
+			{
+				px[0] = x2;
+				px[dst_step] = x2 + (2 * h0);
+			}
+			else
+			{
+				l0 = *pl;
+				x0 = l0 - h0;
+				px[0] = x2;
+				px[dst_step] = ((x0 + x2) / 2) + (2 * h0);
+				px[2 * dst_step] = x0;
+			}
+		}
+		else
+		{
+			l0 = *pl;
+			pl += src_low_step;
+			x0 = l0 - (h0 / 2);
+			px[0] = x2;
+			px[dst_step] = ((x0 + x2) / 2) + (2 * h0);
+			px[2 * dst_step] = x0;
+			l0 = *pl;
+			px[3 * dst_step] = (x0 + l0) / 2;
+		}
+	}
+}
+
+/* Inverse transform of one level, buffer holds HL, LH, HH and LL and
+   gets the reconstructed LL of the level above */
+static void
+rfx_idwt_2d_level(sint16 * buffer, sint16 * temp, int level)
+{
+	int nl, nh, width;
+	sint16 *hl, *lh, *hh, *ll, *l, *h;
+
+	nl = (RFX_TILE_SIZE >> level) + 1;
+	nh = (level == 1) ? (RFX_TILE_SIZE >> 1) - 1 : (RFX_TILE_SIZE + (1 << (level - 1))) >> level;
+	width = nl + nh;
+
+	hl = buffer;
+	lh = hl + nh * nl;
+	hh = lh + nl * nh;
+	ll = hh + nh * nh;
+	l = temp;
+	h = temp + nl * width;
+
+	/* horizontally, LL and HL in to L, LH and HH in to H */
+	rfx_idwt_1d(ll, hl, l, nl, nh, 1, 1, 1, nl, nh, width, nl);
+	rfx_idwt_1d(lh, hh, h, nl, nh, 1, 1, 1, nl, nh, width, nh);
+	/* vertically, L and H in to the level above */
+	rfx_idwt_1d(l, h, buffer, nl, nh, width, width, width, 1, 1, 1, width);
+}
+
+static void
+rfx_idwt_2d(sint16 * buffer)
+{
+	sint16 temp[RFX_TILE_PIXELS];
+
+	rfx_idwt_2d_level(buffer + 3807, temp, 3);
+	rfx_idwt_2d_level(buffer + 3007, temp, 2);
+	rfx_idwt_2d_level(buffer, temp, 1);
+}
+
+static void
+rfx_in_quant(uint8 * p, RFX_QUANT * quant)
+{
+	int i;
+
+	for (i = 0; i < RFX_BANDS; i++)
+		quant->q[rfx_quant_band[i]] = (p[i / 2] >> ((i & 1) * 4)) & 0x0f;
+}
+
+/* The quantisation of the three components of a tile at a quality */
+static RD_BOOL
+rfx_tile_quant(RFX_REGION * region, uint8 * idx, uint8 quality, RFX_QUANT * bitpos)
+{
+	static const RFX_PROG_QUANT full;
+	const RFX_PROG_QUANT *prog;
+	int c, i;
+
+	if (quality == RFX_QUALITY_FULL)
+		prog = &full;
+	else if (quality < region->num_prog_quant)
+		prog = &region->prog_quant[quality];
+	else
+		return False;
+
+	for (c = 0; c < 3; c++)
+	{
+		if (idx[c] >= region->num_quant)
+			return False;
+		for (i = 0; i < RFX_BANDS; i++)
+			bitpos[c].q[i] = region->quant[idx[c]].q[i] + prog->comp[c].q[i];
+	}
+	return True;
+}
+
+static RFX_TILE *
+rfx_get_tile(RFXPROG_SURFACE * surface, uint16 xidx, uint16 yidx)
+{
+	RFX_TILE **tile;
+
+	if (xidx >= surface->grid_width || yidx >= surface->grid_height)
+		return NULL;
+
+	tile = &surface->tiles[yidx * surface->grid_width + xidx];
+	if (*tile == NULL)
+	{
+		*tile = xmalloc(sizeof(RFX_TILE));
+		memset(*tile, 0, sizeof(RFX_TILE));
+	}
+	return *tile;
+}
+
+/* Write the pixels of a tile that fall inside the region rectangles */
+static void
+rfx_put_tile(RFX_REGION * region, uint8 * pixels, uint16 xidx, uint16 yidx)
+{
+	int i, x1, y1, x2, y2, y;
+	uint8 *r;
+
+	for (i = 0; i < region->num_rects; i++)
+	{
+		r = region->rects + i * 8;
+		x1 = MAX(xidx * RFX_TILE_SIZE, r[0] | (r[1] << 8));
+		y1 = MAX(yidx * RFX_TILE_SIZE, r[2] | (r[3] << 8));
+		x2 = MIN((xidx + 1) * RFX_TILE_SIZE, (r[0] | (r[1] << 8)) + (r[4] | (r[5] << 8)));
+		y2 = MIN((yidx + 1) * RFX_TILE_SIZE, (r[2] | (r[3] << 8)) + (r[6] | (r[7] << 8)));
+		x2 = MIN(x2, region->width);
+		y2 = MIN(y2, region->height);
+		if (x1 >= x2 || y1 >= y2)
+			continue;
+
+		for (y = y1; y < y2; y++)
+			memcpy(region->dst + y * region->stride + x1 * 4,
+			       pixels + ((y - yidx * RFX_TILE_SIZE) * RFX_TILE_SIZE +
+					 x1 - xidx * RFX_TILE_SIZE) * 4, (x2 - x1) * 4);
+	}
+}
+
+static void
+rfx_render_tile(RFX_REGION * region, RFX_TILE * tile, uint16 xidx, uint16 yidx)
+{
+	sint16 planes[3][RFX_TILE_PIXELS];
+	uint8 pixels[RFX_TILE_PIXELS * 4];
+	int c;
+
+	for (c = 0; c < 3; c++)
+	{
+		memcpy(planes[c], tile->coeff[c], sizeof(planes[c]));
+		rfx_idwt_2d(planes[c]);
+	}
+	rfx_ycbcr_to_bgra(planes[0], planes[1], planes[2], pixels);
+	rfx_put_tile(region, pixels, xidx, yidx);
+}
+
+/* TILE_SIMPLE and TILE_FIRST, a tile coded in full at some quality */
+static RD_BOOL
+rfx_process_tile_first(RFX_REGION * region, STREAM s, RD_BOOL simple)
+{
+	uint8 idx[3], flags, quality;
+	uint16 xidx, yidx, len[4];
+	RFX_QUANT bitpos[3];
+	RFX_TILE *tile;
+	sint16 *coeff;
+	uint8 *data;
+	int c, b, i, shift;
+
+	if (!s_check_rem(s, (simple ? 16 : 17)))
+		return False;
+	in_uint8a(s, idx, 3);
+	in_uint16_le(s, xidx);
+	in_uint16_le(s, yidx);
+	in_uint8(s, flags);
+	quality = RFX_QUALITY_FULL;
+	if (!simple)
+		in_uint8(s, quality);
+	for (i = 0; i < 4; i++)
+		in_uint16_le(s, len[i]);
+
+	tile = rfx_get_tile(region->surface, xidx, yidx);
+	if (tile == NULL || !rfx_tile_quant(region, idx, quality, bitpos))
+		return False;
+
+	for (c = 0; c < 3; c++)
+	{
+		if (!s_check_rem(s, len[c]))
+			return False;
+		in_uint8p(s, data, len[c]);
+
+		coeff = tile->coeff[c];
+		if (flags & RFX_TILE_DIFFERENCE)
+		{
+			sint16 diff[RFX_TILE_PIXELS];
+
+			rfx_rlgr_decode(False, data, len[c], diff, RFX_TILE_PIXELS);
+			memcpy(tile->sign[c], diff, sizeof(diff));
+			for (i = 1; i < rfx_band_length[RFX_LL3]; i++)
+				diff[rfx_band_offset[RFX_LL3] + i] +=
+					diff[rfx_band_offset[RFX_LL3] + i - 1];
+			for (b = 0; b < RFX_BANDS; b++)
+			{
+				shift = MAX(bitpos[c].q[b] - 1, 0);
+				for (i = rfx_band_offset[b];
+				     i < rfx_band_offset[b] + rfx_band_length[b]; i++)
+					coeff[i] += diff[i] << shift;
+			}
+		}
+		else
+		{
+			rfx_rlgr_decode(False, data, len[c], coeff, RFX_TILE_PIXELS);
+			memcpy(tile->sign[c], coeff, sizeof(tile->sign[c]));
+			for (i = 1; i < rfx_band_length[RFX_LL3]; i++)
+				coeff[rfx_band_offset[RFX_LL3] + i] +=
+					coeff[rfx_band_offset[RFX_LL3] + i - 1];
+			for (b = 0; b < RFX_BANDS; b++)
+			{
+				shift = MAX(bitpos[c].q[b] - 1, 0);
+				for (i = rfx_band_offset[b];
+				     i < rfx_band_offset[b] + rfx_band_length[b]; i++)
+					coeff[i] <<= shift;
+			}
+		}
+		tile->bitpos[c] = bitpos[c];
+	}
+
+	rfx_render_tile(region, tile, xidx, yidx);
+	return True;
+}
+
+/* Upgrade passes code the bits of coefficients already known to be
+   non-zero raw, and the others with a run-length code of their own */
+typedef struct
+{
+	RFX_BITS srl, raw;
+	int kp, nz;
+	RD_BOOL unary;
+}
+RFX_UPGRADE;
+
+static sint16
+rfx_srl_read(RFX_UPGRADE * u, int num_bits)
+{
+	int k, mag, max;
+	RD_BOOL negative;
+
+	if (u->nz)
+	{
+		u->nz--;
+		return 0;
+	}
+
+	k = u->kp / 8;
+	if (!u->unary)
+	{
+		if (!rfx_get_bits(&u->srl, 1))
+		{
+			/* a whole run of 1 << k zeros */
+			u->nz = (1 << k) - 1;
+			u->kp = MIN(u->kp + 4, RLGR_KPMAX);
+			return 0;
+		}
+
+		/* fewer zeros than that, then a value */
+		u->unary = True;
+		u->nz = rfx_get_bits(&u->srl, k);
+		if (u->nz)
+		{
+			u->nz--;
+			return 0;
+		}
+	}
+
+	u->unary = False;
+	negative = rfx_get_bits(&u->srl, 1);
+	u->kp = MAX(u->kp - 6, 0);
+	if (num_bits == 1)
+		return negative ? -1 : 1;
+
+	mag = 1;
+	max = (1 << num_bits) - 1;
+	while (mag < max && !rfx_get_bits(&u->srl, 1))
+		mag++;
+
+	return negative ? -mag : mag;
+}
+
+static void
+rfx_upgrade_band(RFX_UPGRADE * u, sint16 * coeff, sint16 * sign, int length, int shift,
+		 int num_bits, RD_BOOL ll)
+{
+	int i, input;
+
+	if (num_bits <= 0)
+		return;
+
+	for (i = 0; i < length; i++)
+	{
+		if (ll)
+			input = rfx_get_bits(&u->raw, num_bits);
+		else if (sign[i] > 0)
+			input = rfx_get_bits(&u->raw, num_bits);
+		else if (sign[i] < 0)
+			input = -(int) rfx_get_bits(&u->raw, num_bits);
+		else
+		{
+			input = rfx_srl_read(u, num_bits);
+			sign[i] = input;
+		}
+		coeff[i] += input * (1 << shift);
+	}
+}
+
+static RD_BOOL
+rfx_process_tile_upgrade(RFX_REGION * region, STREAM s)
+{
+	uint8 idx[3], quality;
+	uint16 xidx, yidx, len[6];
+	RFX_QUANT bitpos[3];
+	RFX_UPGRADE u;
+	RFX_TILE *tile;
+	uint8 *srl, *raw;
+	int c, b, i;
+
+	if (!s_check_rem(s, 20))
+		return False;
+	in_uint8a(s, idx, 3);
+	in_uint16_le(s, xidx);
+	in_uint16_le(s, yidx);
+	in_uint8(s, quality);
+	for (i = 0; i < 6; i++)
+		in_uint16_le(s, len[i]);
+
+	tile = rfx_get_tile(region->surface, xidx, yidx);
+	if (tile == NULL || !rfx_tile_quant(region, idx, quality, bitpos))
+		return False;
+
+	for (c = 0; c < 3; c++)
+	{
+		if (!s_check_rem(s, len[c * 2] + len[c * 2 + 1]))
+			return False;
+		in_uint8p(s, srl, len[c * 2]);
+		in_uint8p(s, raw, len[c * 2 + 1]);
+
+		rfx_bits_init(&u.srl, srl, len[c * 2]);
+		rfx_bits_init(&u.raw, raw, len[c * 2 + 1]);
+		u.kp = 8;
+		u.nz = 0;
+		u.unary = False;
+
+		for (b = 0; b < RFX_BANDS; b++)
+		{
+			rfx_upgrade_band(&u, tile->coeff[c] + rfx_band_offset[b],
+					 tile->sign[c] + rfx_band_offset[b], rfx_band_length[b],
+					 MAX(bitpos[c].q[b] - 1, 0),
+					 tile->bitpos[c].q[b] - bitpos[c].q[b], b == RFX_LL3);
+		}
+		tile->bitpos[c] = bitpos[c];
+	}
+
+	rfx_render_tile(region, tile, xidx, yidx);
+	return True;
+}
+
+static RD_BOOL
+rfx_process_region(RFXPROG_SURFACE * surface, STREAM s, uint8 * dst, int stride, int width,
+		   int height, BOUNDS * damage)
+{
+	RFX_REGION region;
+	RFX_QUANT quant[256];
+	RFX_PROG_QUANT prog_quant[256];
+	uint8 tile_size, flags, *p, *tile;
+	uint16 num_tiles, block_type, x, y, cx, cy;
+	uint32 tile_data_size, block_len;
+	struct stream tiles;
+	RD_BOOL rv;
+	int i, c;
+
+	if (!s_check_rem(s, 12))
+		return False;
+	in_uint8(s, tile_size);
+	in_uint16_le(s, region.num_rects);
+	in_uint8(s, region.num_quant);
+	in_uint8(s, region.num_prog_quant);
+	in_uint8(s, flags);
+	in_uint16_le(s, num_tiles);
+	in_uint32_le(s, tile_data_size);
+
+	if (tile_size != RFX_TILE_SIZE)
+		return False;
+
+	if (!s_check_rem(s, region.num_rects * 8))
+		return False;
+	in_uint8p(s, region.rects, region.num_rects * 8);
+
+	if (!s_check_rem(s, region.num_quant * 5))
+		return False;
+	for (i = 0; i < region.num_quant; i++)
+	{
+		in_uint8p(s, p, 5);
+		rfx_in_quant(p, &quant[i]);
+	}
+
+	if (!s_check_rem(s, region.num_prog_quant * 16))
+		return False;
+	for (i = 0; i < region.num_prog_quant; i++)
+	{
+		in_uint8(s, prog_quant[i].quality);
+		for (c = 0; c < 3; c++)
+		{
+			in_uint8p(s, p, 5);
+			rfx_in_quant(p, &prog_quant[i].comp[c]);
+		}
+	}
+
+	if (!s_check_rem(s, tile_data_size))
+		return False;
+
+	for (i = 0; i < region.num_rects; i++)
+	{
+		p = region.rects + i * 8;
+		x = p[0] | (p[1] << 8);
+		y = p[2] | (p[3] << 8);
+		cx = p[4] | (p[5] << 8);
+		cy = p[6] | (p[7] << 8);
+		if (cx == 0 || cy == 0 || x >= width || y >= height)
+			continue;
+		damage->left = MIN(damage->left, x);
+		damage->top = MIN(damage->top, y);
+		damage->right = MAX(damage->right, MIN(x + cx, width) - 1);
+		damage->bottom = MAX(damage->bottom, MIN(y + cy, height) - 1);
+	}
+
+	if (!(flags & RFX_DWT_REDUCE_EXTRAPOLATE))
+	{
+		logger(Graphics, Warning,
+		       "rfx_process_region(), only the reduce-extrapolate wavelet is supported");
+		in_uint8s(s, tile_data_size);
+		return True;
+	}
+
+	region.surface = surface;
+	region.dst = dst;
+	region.stride = stride;
+	region.width = width;
+	region.height = height;
+	region.quant = quant;
+	region.prog_quant = prog_quant;
+
+	memset(&tiles, 0, sizeof(tiles));
+	in_uint8p(s, tiles.data, tile_data_size);
+	tiles.p = tiles.data;
+	tiles.end = tiles.data + tile_data_size;
+
+	for (i = 0; i < num_tiles; i++)
+	{
+		if (!s_check_rem(&tiles, 6))
+			return False;
+		tile = tiles.p;
+		in_uint16_le(&tiles, block_type);
+		in_uint32_le(&tiles, block_len);
+		if (block_len < 6 || !s_check_rem(&tiles, block_len - 6))
+			return False;
+
+		switch (block_type)
+		{
+			case PROGRESSIVE_WBT_TILE_SIMPLE:
+				rv = rfx_process_tile_first(&region, &tiles, True);
+				break;
+			case PROGRESSIVE_WBT_TILE_FIRST:
+				rv = rfx_process_tile_first(&region, &tiles, False);
+				break;
+			case PROGRESSIVE_WBT_TILE_UPGRADE:
+				rv = rfx_process_tile_upgrade(&region, &tiles);
+				break;
+			default:
+				rv = False;
+				break;
+		}
+		if (!rv)
+		{
+			logger(Graphics, Warning, "rfx_process_region(), bad tile block 0x%x",
+			       block_type);
+			return False;
+		}
+
+		/* the next tile starts where the length says, whatever the
+		   tile parser took */
+		tiles.p = tile + block_len;
+	}
+
+	return True;
+}
+
+static RFXPROG_SURFACE *
+rfxprog_get_surface(uint16 id, int width, int height)
+{
+	RFXPROG_SURFACE *surface;
+	size_t count;
+
+	for (surface = rfxprog_surfaces; surface != NULL; surface = surface->next)
+		if (surface->id == id)
+			return surface;
+
+	surface = xmalloc(sizeof(RFXPROG_SURFACE));
+	surface->id = id;
+	surface->grid_width = (width + RFX_TILE_SIZE - 1) / RFX_TILE_SIZE;
+	surface->grid_height = (height + RFX_TILE_SIZE - 1) / RFX_TILE_SIZE;
+	count = surface->grid_width * surface->grid_height;
+	surface->tiles = xmalloc(sizeof(RFX_TILE *) * count);
+	memset(surface->tiles, 0, sizeof(RFX_TILE *) * count);
+	surface->next = rfxprog_surfaces;
+	rfxprog_surfaces = surface;
+	return surface;
+}
+
+/* Decode a progressive bitmap stream on to a surface of width x
+   height pixels at dst, widening damage by the area it updated */
+RD_BOOL
+rfxprog_decompress(uint16 surface_id, uint8 * data, uint32 size, uint8 * dst, int stride,
+		   int width, int height, BOUNDS * damage)
+{
+	RFXPROG_SURFACE *surface;
+	struct stream packet;
+	STREAM s = &packet;
+	uint16 block_type;
+	uint32 block_len;
+	uint8 *block;
+
+	surface = rfxprog_get_surface(surface_id, width, height);
+
+	memset(s, 0, sizeof(*s));
+	s->data = s->p = data;
+	s->end = data + size;
+
+	while (s_remaining(s) > 0)
+	{
+		if (!s_check_rem(s, 6))
+			return False;
+		block = s->p;
+		in_uint16_le(s, block_type);
+		in_uint32_le(s, block_len);
+		if (block_len < 6 || !s_check_rem(s, block_len - 6))
+			return False;
+
+		switch (block_type)
+		{
+			case PROGRESSIVE_WBT_REGION:
+				if (!rfx_process_region(surface, s, dst, stride, width, height, damage))
+					return False;
+				break;
+
+			case PROGRESSIVE_WBT_SYNC:
+			case PROGRESSIVE_WBT_FRAME_BEGIN:
+			case PROGRESSIVE_WBT_FRAME_END:
+			case PROGRESSIVE_WBT_CONTEXT:
+				break;
+
+			default:
+				logger(Graphics, Warning,
+				       "rfxprog_decompress(), unknown block type 0x%x", block_type);
+				return False;
+		}
+		s->p = block + block_len;
+	}
+
+	return True;
+}
+
+void
+rfxprog_delete_surface(uint16 surface_id)
+{
+	RFXPROG_SURFACE **link, *surface;
+	int i;
+
+	for (link = &rfxprog_surfaces; *link != NULL; link = &(*link)->next)
+	{
+		surface = *link;
+		if (surface->id != surface_id)
+			continue;
+
+		*link = surface->next;
+		for (i = 0; i < surface->grid_width * surface->grid_height; i++)
+			xfree(surface->tiles[i]);
+		xfree(surface->tiles);
+		xfree(surface);
+		return;
+	}
+}
+
+void
+rfxprog_reset(void)
+{
+	while (rfxprog_surfaces != NULL)
+		rfxprog_delete_surface(rfxprog_surfaces->id);
+}
@@ -54,6 +54,20 @@
 #endif
 #define	OUT_STREAM_SIZE	4096
 
+/* Requests are run by a fixed set of workers. GetStatusChange may block
+   for as long as the server asks, so it may only occupy some of them. */
+#define SCARD_WORKER_THREADS	8
+#define SCARD_MAX_STATUS_CHANGE	(SCARD_WORKER_THREADS - 2)
+
+/* How long the status watcher waits for pcscd at a time, in ms */
+#define SC_WATCH_TIMEOUT	1000
+
+#define SC_PNP_NOTIFICATION	"\\\\?PnP?\\Notification"
+
+/* Allocation arenas grow by chunks of this size */
+#define SC_ARENA_CHUNK		4096
+#define SC_ARENA_ALIGN(n)	(((n) + 15) & ~15)
+
 #ifdef B_ENDIAN
 #define swap32(x)	((((x) & 0xff) << 24) | (((x) & 0xff00) << 8) |	\
 			(((x) & 0xff0000) >> 8) | (((x) & 0xff000000) >> 24))
@@ -70,21 +84,30 @@ static uint32 curEpoch = 0, curDevice = 0, curId = 0, curBytesOut = 0;
 static PSCNameMapRec nameMapList = NULL;
 static int nameMapCount = 0;
 
-static pthread_t queueHandler;
+static pthread_t workers[SCARD_WORKER_THREADS];
 static pthread_mutex_t queueAccess;
 static pthread_cond_t queueEmpty;
 static pthread_mutex_t hcardAccess;
 
-static PMEM_HANDLE threadListHandle = NULL;
-static PThreadListElement threadList = NULL;
-
-
 static PSCThreadData queueFirst = NULL, queueLast = NULL;
-static int threadCount = 0;
+
+/* Context establishment and release are run one at a time, with no
+   later request started before they are done */
+static RD_BOOL contextChangeRunning = False;
+static int statusChangeRunning = 0;
 
 static PSCHCardRec hcardFirst = NULL;
 
-static void *queue_handler_function(void *data);
+/* Reader states kept up to date by the status watcher, so that
+   GetStatusChange polls need not go to pcscd */
+static pthread_t statusWatcher;
+static pthread_mutex_t readerCacheAccess = PTHREAD_MUTEX_INITIALIZER;
+static PSCReaderCache readerCache = NULL;
+static int readerCacheCount = 0;
+static RD_BOOL readerCacheValid = False;
+
+static void *worker_function(void *data);
+static void *status_watcher_function(void *data);
 
 /* code segment */
 
@@ -151,7 +174,7 @@ scard_enum_devices(uint32 * id, char *optarg)
 {
 	char *name = optarg + 1;
 	char *alias;
-	int count = 0;
+	int count = 0, i;
 	PSCNameMapRec tmpMap;
 
 	MYPCSC_DWORD rv;
@@ -189,14 +212,20 @@ scard_enum_devices(uint32 * id, char *optarg)
 		return 0;
 	}
 
-	if (0 !=
-	    pthread_create(&queueHandler, NULL, (void *(*)(void *)) queue_handler_function, NULL))
+	for (i = 0; i < SCARD_WORKER_THREADS; i++)
 	{
-		logger(SmartCard, Error,
-		       "scard_enum_devices(), can't create queue handling thread");
-		return 0;
+		if (0 != pthread_create(&workers[i], NULL, worker_function, NULL))
+		{
+			logger(SmartCard, Error,
+			       "scard_enum_devices(), can't create request handling thread");
+			return 0;
+		}
 	}
 
+	if (0 != pthread_create(&statusWatcher, NULL, status_watcher_function, NULL))
+		logger(SmartCard, Warning,
+		       "scard_enum_devices(), can't create status watcher thread, reader states will not be cached");
+
 	strncpy(g_rdpdr_device[*id].name, "SCARD\0\0\0", 8);
 	toupper_str(g_rdpdr_device[*id].name);
 	g_rdpdr_device[*id].local_path = "/dev/scard";
@@ -370,77 +399,67 @@ _scard_handle_list_get_pcsc_handle(uint32_t server)
 	return 0;
 }
 
+/* Allocate from the arena behind memHandle, which is started or grown
+   as needed. Everything is freed at once by SC_xfreeallmemory(). */
 static void *
 SC_xmalloc(PMEM_HANDLE * memHandle, unsigned int size)
 {
-	PMEM_HANDLE handle = NULL;
-	if (size > 0 && memHandle)
+	PMEM_HANDLE handle;
+	unsigned int chunk_size;
+
+	if (size == 0 || !memHandle)
+		return NULL;
+
+	size = SC_ARENA_ALIGN(size);
+	handle = *memHandle;
+	if (handle == NULL || handle->dataSize - handle->used < size)
 	{
-		handle = xmalloc(size + sizeof(MEM_HANDLE));
-		if (handle)
-		{
-			handle->prevHandle = NULL;
-			handle->nextHandle = NULL;
-			handle->dataSize = size;
-			if (*memHandle)
-			{
-				handle->prevHandle = *memHandle;
-				(*memHandle)->nextHandle = handle;
-			}
-			*memHandle = handle;
-			return handle + 1;
-		}
-		else
-			return NULL;
+		chunk_size = MAX(size, SC_ARENA_CHUNK - SC_ARENA_ALIGN(sizeof(MEM_HANDLE)));
+		handle = xmalloc(SC_ARENA_ALIGN(sizeof(MEM_HANDLE)) + chunk_size);
+		handle->prevHandle = *memHandle;
+		handle->dataSize = chunk_size;
+		handle->used = 0;
+		*memHandle = handle;
 	}
-	else
-		return NULL;
+
+	handle->last = handle->used;
+	handle->used += size;
+	return (uint8 *) handle + SC_ARENA_ALIGN(sizeof(MEM_HANDLE)) + handle->last;
 }
 
+/* Give back memptr if it was the latest allocation, anything else
+   stays until the arena is freed */
 static void
 SC_xfree(PMEM_HANDLE * handle, void *memptr)
 {
-	if (memptr != NULL)
+	uint8 *data;
+
+	if (memptr == NULL || *handle == NULL)
+		return;
+
+	data = (uint8 *) (*handle) + SC_ARENA_ALIGN(sizeof(MEM_HANDLE));
+	if ((uint8 *) memptr == data + (*handle)->last)
 	{
-		PMEM_HANDLE lcHandle = (PMEM_HANDLE) memptr - 1;
-		if (lcHandle->dataSize > 0)
-		{
-			memset(memptr, 0, lcHandle->dataSize);
-			if (lcHandle->nextHandle)
-				lcHandle->nextHandle->prevHandle = lcHandle->prevHandle;
-			if (lcHandle->prevHandle)
-				lcHandle->prevHandle->nextHandle = lcHandle->nextHandle;
-			if (*handle == lcHandle)
-			{
-				if (lcHandle->prevHandle)
-					*handle = lcHandle->prevHandle;
-				else
-					*handle = lcHandle->nextHandle;
-			}
-			xfree(lcHandle);
-		}
+		memset(memptr, 0, (*handle)->used - (*handle)->last);
+		(*handle)->used = (*handle)->last;
 	}
 }
 
 static void
 SC_xfreeallmemory(PMEM_HANDLE * handle)
 {
-	if (handle && (*handle))
+	PMEM_HANDLE cur, prev;
+
+	if (!handle)
+		return;
+
+	for (cur = *handle; cur != NULL; cur = prev)
 	{
-		if ((*handle)->prevHandle)
-		{
-			(*handle)->prevHandle->nextHandle = NULL;
-			SC_xfreeallmemory(&((*handle)->prevHandle));
-		}
-		if ((*handle)->nextHandle)
-		{
-			(*handle)->nextHandle->prevHandle = NULL;
-			SC_xfreeallmemory(&((*handle)->nextHandle));
-		}
-		memset(*handle, 0, (*handle)->dataSize + sizeof(MEM_HANDLE));
-		xfree(*handle);
-		*handle = NULL;
+		prev = cur->prevHandle;
+		memset(cur, 0, SC_ARENA_ALIGN(sizeof(MEM_HANDLE)) + cur->used);
+		xfree(cur);
 	}
+	*handle = NULL;
 }
 
 /* ---------------------------------- */
@@ -1156,6 +1175,237 @@ copyReaderState_ServerToMyPCSC(SERVER_LPSCARD_READERSTATE_A src, MYPCSC_LPSCARD_
 	}
 }
 
+/* Replace the cached reader states with the first count of states */
+static void
+SC_readerCachePublish(MYPCSC_LPSCARD_READERSTATE_A states, int count, RD_BOOL valid)
+{
+	int i;
+
+	pthread_mutex_lock(&readerCacheAccess);
+
+	for (i = 0; i < readerCacheCount; i++)
+		xfree(readerCache[i].name);
+	xfree(readerCache);
+	readerCache = NULL;
+	readerCacheCount = 0;
+	readerCacheValid = valid;
+
+	if (valid && count > 0)
+	{
+		readerCache = xmalloc(count * sizeof(TSCReaderCache));
+		for (i = 0; i < count; i++)
+		{
+			readerCache[i].name = xstrdup(states[i].szReader);
+			readerCache[i].state = states[i].dwEventState & ~SCARD_STATE_CHANGED;
+			readerCache[i].cbAtr = MIN(states[i].cbAtr, MAX_ATR_SIZE);
+			memcpy(readerCache[i].rgbAtr, states[i].rgbAtr, readerCache[i].cbAtr);
+		}
+		readerCacheCount = count;
+	}
+
+	pthread_mutex_unlock(&readerCacheAccess);
+}
+
+static PSCReaderCache
+SC_readerCacheFind(const char *name)
+{
+	int i;
+
+	for (i = 0; i < readerCacheCount; i++)
+	{
+		if (strcmp(readerCache[i].name, name) == 0)
+			return &readerCache[i];
+	}
+	return NULL;
+}
+
+/* A reader state differs from what the caller knows, if it gave the
+   event count in the upper half as well it must match too */
+static RD_BOOL
+SC_readerStateChanged(MYPCSC_DWORD known, MYPCSC_DWORD state)
+{
+	known &= ~SCARD_STATE_CHANGED;
+	if ((known & 0xFFFF0000) == 0)
+		state &= 0x0000FFFF;
+	return known != state;
+}
+
+/* Answer a GetStatusChange from the cache, which is done when all of the
+   readers are known and either something has changed or the call only
+   polls. Returns False if pcscd has to be asked. */
+static RD_BOOL
+SC_readerCacheAnswer(MYPCSC_LPSCARD_READERSTATE_A states, MYPCSC_DWORD count, RD_BOOL polling,
+		     MYPCSC_DWORD * rv)
+{
+	MYPCSC_LPSCARD_READERSTATE_A cur;
+	PSCReaderCache entry;
+	RD_BOOL changed = False;
+	MYPCSC_DWORD i;
+
+	if (count == 0)
+		return False;
+
+	pthread_mutex_lock(&readerCacheAccess);
+
+	if (!readerCacheValid)
+	{
+		pthread_mutex_unlock(&readerCacheAccess);
+		return False;
+	}
+
+	for (i = 0, cur = states; i < count; i++, cur++)
+	{
+		if (cur->dwCurrentState & SCARD_STATE_IGNORE)
+			continue;
+
+		entry = cur->szReader ? SC_readerCacheFind(cur->szReader) : NULL;
+		if (entry == NULL)
+		{
+			pthread_mutex_unlock(&readerCacheAccess);
+			return False;
+		}
+		if (SC_readerStateChanged(cur->dwCurrentState, entry->state))
+			changed = True;
+	}
+
+	if (!changed && !polling)
+	{
+		pthread_mutex_unlock(&readerCacheAccess);
+		return False;
+	}
+
+	for (i = 0, cur = states; i < count; i++, cur++)
+	{
+		if (cur->dwCurrentState & SCARD_STATE_IGNORE)
+		{
+			cur->dwEventState = SCARD_STATE_IGNORE;
+			continue;
+		}
+
+		entry = SC_readerCacheFind(cur->szReader);
+		cur->dwEventState = entry->state;
+		if (SC_readerStateChanged(cur->dwCurrentState, entry->state))
+			cur->dwEventState |= SCARD_STATE_CHANGED;
+		cur->cbAtr = entry->cbAtr;
+		memcpy(cur->rgbAtr, entry->rgbAtr, entry->cbAtr);
+	}
+
+	pthread_mutex_unlock(&readerCacheAccess);
+
+	*rv = changed ? SCARD_S_SUCCESS : SCARD_E_TIMEOUT;
+	return True;
+}
+
+/* Follows the state of all readers through a context of its own, and
+   publishes it in the reader cache. The list of readers is read again
+   whenever pcscd reports that it changed, or at every timeout when it
+   cannot tell. */
+static void *
+status_watcher_function(void *data)
+{
+	MYPCSC_SCARDCONTEXT context;
+	MYPCSC_LPSCARD_READERSTATE_A states = NULL;
+	MYPCSC_DWORD rv, len;
+	char *readers = NULL, *name;
+	RD_BOOL connected = False, relist = True, pnp = True;
+	int i, count = 0;
+
+	UNUSED(data);
+
+	while (1)
+	{
+		if (!connected)
+		{
+			if (SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &context) !=
+			    SCARD_S_SUCCESS)
+			{
+				sleep(1);
+				continue;
+			}
+			connected = True;
+			relist = True;
+			pnp = True;
+		}
+
+		if (relist)
+		{
+			xfree(readers);
+			xfree(states);
+			readers = NULL;
+			count = 0;
+
+			len = 0;
+			rv = SCardListReaders(context, NULL, NULL, &len);
+			if (rv == SCARD_S_SUCCESS && len > 0)
+			{
+				readers = xmalloc(len);
+				rv = SCardListReaders(context, NULL, readers, &len);
+			}
+
+			if (rv == SCARD_S_SUCCESS && readers != NULL)
+			{
+				for (name = readers; *name != '\0'; name += strlen(name) + 1)
+					count++;
+			}
+			else if (rv != SCARD_S_SUCCESS && rv != SCARD_E_NO_READERS_AVAILABLE)
+			{
+				states = NULL;
+				goto failed;
+			}
+
+			states = xmalloc((count + 1) * sizeof(MYPCSC_SCARD_READERSTATE_A));
+			memset(states, 0, (count + 1) * sizeof(MYPCSC_SCARD_READERSTATE_A));
+			for (i = 0, name = readers; i < count; i++, name += strlen(name) + 1)
+			{
+				states[i].szReader = name;
+				states[i].dwCurrentState = SCARD_STATE_UNAWARE;
+			}
+			states[count].szReader = SC_PNP_NOTIFICATION;
+			states[count].dwCurrentState = pnp ? (count << 16) : SCARD_STATE_IGNORE;
+
+			relist = False;
+		}
+
+		rv = SCardGetStatusChange(context, SC_WATCH_TIMEOUT, states, count + 1);
+		if (rv == SCARD_E_TIMEOUT)
+		{
+			relist = !pnp;
+			continue;
+		}
+		if (rv != SCARD_S_SUCCESS)
+			goto failed;
+
+		for (i = 0; i < count; i++)
+		{
+			states[i].dwCurrentState = states[i].dwEventState & ~SCARD_STATE_CHANGED;
+			if (states[i].dwEventState & SCARD_STATE_UNKNOWN)
+				relist = True;
+		}
+
+		/* without this, the list of readers is polled on every timeout */
+		if (states[count].dwEventState & SCARD_STATE_UNKNOWN)
+		{
+			pnp = False;
+			states[count].dwCurrentState = SCARD_STATE_IGNORE;
+		}
+		else if (pnp && (states[count].dwEventState & SCARD_STATE_CHANGED))
+			relist = True;
+
+		SC_readerCachePublish(states, count, !relist);
+		continue;
+
+	      failed:
+		logger(SmartCard, Debug,
+		       "status_watcher_function(), pcscd failed with \"%s\" (0x%08x), retrying",
+		       pcsc_stringify_error(rv), (unsigned int) rv);
+		SC_readerCachePublish(NULL, 0, False);
+		SCardReleaseContext(context);
+		connected = False;
+		sleep(1);
+	}
+
+	return NULL;
+}
 
 static MYPCSC_DWORD
 TS_SCardGetStatusChange(STREAM in, STREAM out, RD_BOOL wide)
@@ -1213,7 +1463,7 @@ TS_SCardGetStatusChange(STREAM in, STREAM out, RD_BOOL wide)
 						 dataLength, wide));
 
 #if !WITH_PNP_NOTIFICATIONS
-				if (strcmp(cur->szReader, "\\\\?PnP?\\Notification") == 0)
+				if (strcmp(cur->szReader, SC_PNP_NOTIFICATION) == 0)
 					cur->dwCurrentState |= SCARD_STATE_IGNORE;
 #endif
 			}
@@ -1235,13 +1485,21 @@ TS_SCardGetStatusChange(STREAM in, STREAM out, RD_BOOL wide)
 	memset(myRsArray, 0, dwCount * sizeof(SERVER_SCARD_READERSTATE_A));
 	copyReaderState_ServerToMyPCSC(rsArray, myRsArray, (SERVER_DWORD) dwCount);
 
-	/* Workaround for a bug in pcsc-lite, timeout value of 0 is handled as INFINIT
-	   but is by Windows PCSC spec. used for polling current state.
-	 */
-	if (dwTimeout == 0)
-		dwTimeout = 1;
-	rv = SCardGetStatusChange(myHContext, (MYPCSC_DWORD) dwTimeout,
-				  myRsArray, (MYPCSC_DWORD) dwCount);
+	if (myHContext != 0 &&
+	    SC_readerCacheAnswer(myRsArray, (MYPCSC_DWORD) dwCount, dwTimeout == 0, &rv))
+	{
+		logger(SmartCard, Debug, "TS_SCardGetStatusChange(), answered from reader cache");
+	}
+	else
+	{
+		/* Workaround for a bug in pcsc-lite, timeout value of 0 is handled as INFINIT
+		   but is by Windows PCSC spec. used for polling current state.
+		 */
+		if (dwTimeout == 0)
+			dwTimeout = 1;
+		rv = SCardGetStatusChange(myHContext, (MYPCSC_DWORD) dwTimeout,
+					  myRsArray, (MYPCSC_DWORD) dwCount);
+	}
 	copyReaderState_MyPCSCToServer(myRsArray, rsArray, (MYPCSC_DWORD) dwCount);
 
 	logger(SmartCard, Debug,
@@ -2570,6 +2828,55 @@ SC_destroyThreadData(PSCThreadData data)
 	}
 }
 
+static RD_BOOL
+SC_isContextChange(PSCThreadData data)
+{
+	return data->request == SC_ESTABLISH_CONTEXT || data->request == SC_RELEASE_CONTEXT;
+}
+
+/* Take the first request that may run now, with queueAccess held */
+static PSCThreadData
+SC_takeFromQueue(void)
+{
+	PSCThreadData cur, prev;
+
+	if (contextChangeRunning)
+		return NULL;
+
+	for (prev = NULL, cur = queueFirst; cur != NULL; prev = cur, cur = cur->next)
+	{
+		/* nothing may overtake a context change */
+		if (SC_isContextChange(cur))
+		{
+			if (prev != NULL)
+				return NULL;
+			contextChangeRunning = True;
+			break;
+		}
+
+		if (cur->request == SC_GET_STATUS_CHANGE)
+		{
+			if (statusChangeRunning >= SCARD_MAX_STATUS_CHANGE)
+				continue;
+			statusChangeRunning++;
+		}
+		break;
+	}
+
+	if (cur == NULL)
+		return NULL;
+
+	if (prev)
+		prev->next = cur->next;
+	else
+		queueFirst = cur->next;
+	if (queueLast == cur)
+		queueLast = prev;
+	cur->next = NULL;
+
+	return cur;
+}
+
 static PSCThreadData
 SC_getNextInQueue()
 {
@@ -2577,22 +2884,29 @@ SC_getNextInQueue()
 
 	pthread_mutex_lock(&queueAccess);
 
-	while (queueFirst == NULL)
+	while ((Result = SC_takeFromQueue()) == NULL)
 		pthread_cond_wait(&queueEmpty, &queueAccess);
 
-	Result = queueFirst;
-	queueFirst = queueFirst->next;
-	if (!queueFirst)
-	{
-		queueLast = NULL;
-	}
-	Result->next = NULL;
-
 	pthread_mutex_unlock(&queueAccess);
 
 	return Result;
 }
 
+/* Let the requests held back by a finished one run */
+static void
+SC_finishInQueue(uint32 request)
+{
+	pthread_mutex_lock(&queueAccess);
+
+	if (request == SC_ESTABLISH_CONTEXT || request == SC_RELEASE_CONTEXT)
+		contextChangeRunning = False;
+	else if (request == SC_GET_STATUS_CHANGE)
+		statusChangeRunning--;
+
+	pthread_cond_broadcast(&queueEmpty);
+	pthread_mutex_unlock(&queueAccess);
+}
+
 static void
 SC_deviceControl(PSCThreadData data)
 {
@@ -2617,94 +2931,19 @@ SC_deviceControl(PSCThreadData data)
 
 
 static void *
-thread_function(PThreadListElement listElement)
+worker_function(void *data)
 {
-	pthread_mutex_lock(&listElement->busy);
-	while (1)
-	{
-		while (listElement->data == NULL)
-			pthread_cond_wait(&listElement->nodata, &listElement->busy);
-
-		SC_deviceControl(listElement->data);
-		listElement->data = NULL;
-	}
-	pthread_mutex_unlock(&listElement->busy);
-
-	pthread_exit(NULL);
-	return NULL;
-}
-
-static void
-SC_handleRequest(PSCThreadData data)
-{
-	int Result = 0;
-	PThreadListElement cur;
-
-	for (cur = threadList; cur != NULL; cur = cur->next)
-	{
-		if (cur->data == NULL)
-		{
-			pthread_mutex_lock(&cur->busy);
-			/* double check with lock held.... */
-			if (cur->data != NULL)
-			{
-				pthread_mutex_unlock(&cur->busy);
-				continue;
-			}
-
-			/* Wake up thread */
-			cur->data = data;
-			pthread_cond_broadcast(&cur->nodata);
-			pthread_mutex_unlock(&cur->busy);
-			return;
-		}
-	}
-
-	cur = SC_xmalloc(&threadListHandle, sizeof(TThreadListElement));
-	if (!cur)
-		return;
-
-	threadCount++;
-
-	pthread_mutex_init(&cur->busy, NULL);
-	pthread_cond_init(&cur->nodata, NULL);
-	cur->data = data;
-
-	Result = pthread_create(&cur->thread, NULL, (void *(*)(void *)) thread_function, cur);
-	if (0 != Result)
-	{
-		logger(SmartCard, Debug, "SC_handleRequest(), pthread_create() failed with 0x%.8x",
-		       Result);
-		SC_xfree(&threadListHandle, cur);
-		SC_destroyThreadData(data);
-		data = NULL;
-	}
-	cur->next = threadList;
-	threadList = cur;
-}
+	PSCThreadData cur_data = NULL;
+	uint32 request;
 
-static void *
-queue_handler_function(void *data)
-{
 	UNUSED(data);
-	PSCThreadData cur_data = NULL;
+
 	while (1)
 	{
 		cur_data = SC_getNextInQueue();
-		switch (cur_data->request)
-		{
-			case SC_ESTABLISH_CONTEXT:
-			case SC_RELEASE_CONTEXT:
-				{
-					SC_deviceControl(cur_data);
-					break;
-				}
-			default:
-				{
-					SC_handleRequest(cur_data);
-					break;
-				}
-		}
+		request = cur_data->request;
+		SC_deviceControl(cur_data);
+		SC_finishInQueue(request);
 	}
 	return NULL;
 }
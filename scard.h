@@ -122,11 +122,13 @@ typedef LPSCARD_IO_REQUEST MYPCSC_LPSCARD_IO_REQUEST;
 
 extern RDPDR_DEVICE g_rdpdr_device[];
 
+/* One chunk of an allocation arena, the handle points at the newest */
 typedef struct _MEM_HANDLE
 {
 	struct _MEM_HANDLE *prevHandle;
-	struct _MEM_HANDLE *nextHandle;
-	int dataSize;
+	unsigned int dataSize;
+	unsigned int used;
+	unsigned int last;
 } MEM_HANDLE, *PMEM_HANDLE;
 
 typedef struct _SCARD_ATRMASK_L
@@ -143,6 +145,15 @@ typedef struct _TSCNameMapRec
 	char vendor[128];
 } TSCNameMapRec, *PSCNameMapRec;
 
+/* State of a reader as last seen by the status watcher */
+typedef struct _TSCReaderCache
+{
+	char *name;
+	MYPCSC_DWORD state;
+	MYPCSC_DWORD cbAtr;
+	unsigned char rgbAtr[MAX_ATR_SIZE];
+} TSCReaderCache, *PSCReaderCache;
+
 typedef struct _TSCHCardRec
 {
 	DWORD hCard;
@@ -165,11 +176,3 @@ typedef struct _TSCThreadData
 	struct _TSCThreadData *next;
 } TSCThreadData, *PSCThreadData;
 
-typedef struct _TThreadListElement
-{
-	pthread_t thread;
-	pthread_mutex_t busy;
-	pthread_cond_t nodata;
-	PSCThreadData data;
-	struct _TThreadListElement *next;
-} TThreadListElement, *PThreadListElement;
@@ -382,7 +382,9 @@ seamless_process(STREAM s)
 	buf = xmalloc(pkglen + 1);
 	in_uint8a(s, buf, pkglen);
 	buf[pkglen] = '\0';
+	ui_seamless_batch_begin();
 	str_handle_lines(buf, &seamless_rest, seamless_line_handler, NULL);
+	ui_seamless_batch_end();
 
 	xfree(buf);
 }
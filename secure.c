@@ -37,8 +37,12 @@ extern RDP_VERSION g_rdp_version;
 extern RD_BOOL g_console_session;
 extern uint32 g_redirect_session_id;
 extern int g_server_depth;
+extern RD_BOOL g_gfx;
+extern RD_BOOL g_autodetect;
 extern VCHANNEL g_channels[];
 extern unsigned int g_num_channels;
+extern RD_MONITOR g_monitors[];
+extern int g_num_monitors;
 extern uint8 g_client_random[SEC_RANDOM_SIZE];
 
 static int g_rc4_key_len;
@@ -59,6 +63,23 @@ uint16 g_server_rdp_version = 0;
 static int g_sec_encrypt_use_count = 0;
 static int g_sec_decrypt_use_count = 0;
 
+/* The MCS message channel, 0 if the server has none. Its PDUs always
+   have a security header, with or without encryption. */
+uint16 g_mcs_msgchannel = 0;
+static uint32 g_multitransport_flags = 0;
+
+/* Traffic per MCS channel: the global channel with fast-path, the
+   message channel and then the virtual channels, as in g_channels */
+#define SEC_STATS_CHANNELS	(2 + 30)
+
+struct sec_channel_stats
+{
+	uint32 pdus_in, pdus_out;
+	uint64 bytes_in, bytes_out;
+};
+
+static struct sec_channel_stats g_sec_channel_stats[SEC_STATS_CHANNELS];
+
 /*
  * I believe this is based on SSLv3 with the following differences:
  *  MAC algorithm (5.2.3.1) uses only 32-bit length in place of seq_num/type/length fields
@@ -149,6 +170,42 @@ sec_make_40bit(uint8 * key)
 	key[2] = 0x9e;
 }
 
+static uint8 pad_54[40] = {
+	54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54,
+	54, 54, 54,
+	54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54,
+	54, 54, 54
+};
+
+static uint8 pad_92[48] = {
+	92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92,
+	92, 92, 92, 92, 92, 92, 92,
+	92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92,
+	92, 92, 92, 92, 92, 92, 92
+};
+
+/* The inner hashes of the MAC and of key updates always start with
+   the same key and pad, their states after that are kept so that only
+   the data needs hashing */
+static RDSSL_SHA1 g_sign_sha1, g_encrypt_update_sha1, g_decrypt_update_sha1;
+static RDSSL_MD5 g_sign_md5, g_encrypt_update_md5, g_decrypt_update_md5;
+
+/* Data is signed and encrypted in pieces of this size, which stay in
+   the cache from one pass to the other */
+#define SEC_CRYPT_CHUNK	2048
+
+static void
+sec_pad_states(RDSSL_SHA1 * sha1, RDSSL_MD5 * md5, uint8 * key, int keylen)
+{
+	rdssl_sha1_init(sha1);
+	rdssl_sha1_update(sha1, key, keylen);
+	rdssl_sha1_update(sha1, pad_54, 40);
+
+	rdssl_md5_init(md5);
+	rdssl_md5_update(md5, key, keylen);
+	rdssl_md5_update(md5, pad_92, 48);
+}
+
 /* Generate encryption keys given client and server randoms */
 static void
 sec_generate_keys(uint8 * client_random, uint8 * server_random, int rc4_key_size)
@@ -195,21 +252,14 @@ sec_generate_keys(uint8 * client_random, uint8 * server_random, int rc4_key_size
 	/* Initialise RC4 state arrays */
 	rdssl_rc4_set_key(&g_rc4_decrypt_key, g_sec_decrypt_key, g_rc4_key_len);
 	rdssl_rc4_set_key(&g_rc4_encrypt_key, g_sec_encrypt_key, g_rc4_key_len);
-}
-
-static uint8 pad_54[40] = {
-	54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54,
-	54, 54, 54,
-	54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54,
-	54, 54, 54
-};
 
-static uint8 pad_92[48] = {
-	92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92,
-	92, 92, 92, 92, 92, 92, 92,
-	92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92, 92,
-	92, 92, 92, 92, 92, 92, 92
-};
+	/* and the hash states keyed for signing and key updates */
+	sec_pad_states(&g_sign_sha1, &g_sign_md5, g_sec_sign_key, g_rc4_key_len);
+	sec_pad_states(&g_encrypt_update_sha1, &g_encrypt_update_md5, g_sec_encrypt_update_key,
+		       g_rc4_key_len);
+	sec_pad_states(&g_decrypt_update_sha1, &g_decrypt_update_md5, g_sec_decrypt_update_key,
+		       g_rc4_key_len);
+}
 
 /* Output a uint32 into a buffer (little-endian) */
 void
@@ -233,16 +283,12 @@ sec_sign(uint8 * signature, int siglen, uint8 * session_key, int keylen, uint8 *
 
 	buf_out_uint32(lenhdr, datalen);
 
-	rdssl_sha1_init(&sha1);
-	rdssl_sha1_update(&sha1, session_key, keylen);
-	rdssl_sha1_update(&sha1, pad_54, 40);
+	sec_pad_states(&sha1, &md5, session_key, keylen);
+
 	rdssl_sha1_update(&sha1, lenhdr, 4);
 	rdssl_sha1_update(&sha1, data, datalen);
 	rdssl_sha1_final(&sha1, shasig);
 
-	rdssl_md5_init(&md5);
-	rdssl_md5_update(&md5, session_key, keylen);
-	rdssl_md5_update(&md5, pad_92, 48);
 	rdssl_md5_update(&md5, shasig, 20);
 	rdssl_md5_final(&md5, md5sig);
 
@@ -251,22 +297,16 @@ sec_sign(uint8 * signature, int siglen, uint8 * session_key, int keylen, uint8 *
 
 /* Update an encryption key */
 static void
-sec_update(uint8 * key, uint8 * update_key)
+sec_update(uint8 * key, RDSSL_SHA1 * update_sha1, RDSSL_MD5 * update_md5)
 {
 	uint8 shasig[20];
-	RDSSL_SHA1 sha1;
-	RDSSL_MD5 md5;
+	RDSSL_SHA1 sha1 = *update_sha1;
+	RDSSL_MD5 md5 = *update_md5;
 	RDSSL_RC4 update;
 
-	rdssl_sha1_init(&sha1);
-	rdssl_sha1_update(&sha1, update_key, g_rc4_key_len);
-	rdssl_sha1_update(&sha1, pad_54, 40);
 	rdssl_sha1_update(&sha1, key, g_rc4_key_len);
 	rdssl_sha1_final(&sha1, shasig);
 
-	rdssl_md5_init(&md5);
-	rdssl_md5_update(&md5, update_key, g_rc4_key_len);
-	rdssl_md5_update(&md5, pad_92, 48);
 	rdssl_md5_update(&md5, shasig, 20);
 	rdssl_md5_final(&md5, key);
 
@@ -277,18 +317,42 @@ sec_update(uint8 * key, uint8 * update_key)
 		sec_make_40bit(key);
 }
 
-/* Encrypt data using RC4 */
+/* Write the MAC of data to signature, 8 bytes, and encrypt data using
+   RC4, in one pass over it */
 static void
-sec_encrypt(uint8 * data, int length)
+sec_sign_encrypt(uint8 * signature, uint8 * data, int length)
 {
+	uint8 shasig[20];
+	uint8 md5sig[16];
+	uint8 lenhdr[4];
+	RDSSL_SHA1 sha1 = g_sign_sha1;
+	RDSSL_MD5 md5 = g_sign_md5;
+	int chunk;
+
 	if (g_sec_encrypt_use_count == 4096)
 	{
-		sec_update(g_sec_encrypt_key, g_sec_encrypt_update_key);
+		sec_update(g_sec_encrypt_key, &g_encrypt_update_sha1, &g_encrypt_update_md5);
 		rdssl_rc4_set_key(&g_rc4_encrypt_key, g_sec_encrypt_key, g_rc4_key_len);
 		g_sec_encrypt_use_count = 0;
 	}
 
-	rdssl_rc4_crypt(&g_rc4_encrypt_key, data, data, length);
+	buf_out_uint32(lenhdr, length);
+	rdssl_sha1_update(&sha1, lenhdr, 4);
+
+	while (length > 0)
+	{
+		chunk = MIN(length, SEC_CRYPT_CHUNK);
+		rdssl_sha1_update(&sha1, data, chunk);
+		rdssl_rc4_crypt(&g_rc4_encrypt_key, data, data, chunk);
+		data += chunk;
+		length -= chunk;
+	}
+
+	rdssl_sha1_final(&sha1, shasig);
+	rdssl_md5_update(&md5, shasig, 20);
+	rdssl_md5_final(&md5, md5sig);
+	memcpy(signature, md5sig, 8);
+
 	g_sec_encrypt_use_count++;
 }
 
@@ -301,7 +365,7 @@ sec_decrypt(uint8 * data, int length)
 
 	if (g_sec_decrypt_use_count == 4096)
 	{
-		sec_update(g_sec_decrypt_key, g_sec_decrypt_update_key);
+		sec_update(g_sec_decrypt_key, &g_decrypt_update_sha1, &g_decrypt_update_md5);
 		rdssl_rc4_set_key(&g_rc4_decrypt_key, g_sec_decrypt_key, g_rc4_key_len);
 		g_sec_decrypt_use_count = 0;
 	}
@@ -335,10 +399,26 @@ sec_init(uint32 flags, int maxlen)
 	return s;
 }
 
+static struct sec_channel_stats *
+sec_channel_stats(uint16 channel)
+{
+	unsigned int i;
+
+	if (channel == g_mcs_msgchannel && channel != 0)
+		return &g_sec_channel_stats[1];
+	for (i = 0; i < g_num_channels && i + 2 < SEC_STATS_CHANNELS; i++)
+	{
+		if (g_channels[i].mcs_id == channel)
+			return &g_sec_channel_stats[i + 2];
+	}
+	return &g_sec_channel_stats[0];
+}
+
 /* Transmit secure transport packet over specified channel */
 void
 sec_send_to_channel(STREAM s, uint32 flags, uint16 channel)
 {
+	struct sec_channel_stats *st;
 	int datalen;
 
 #ifdef WITH_SCARD
@@ -346,7 +426,8 @@ sec_send_to_channel(STREAM s, uint32 flags, uint16 channel)
 #endif
 
 	s_pop_layer(s, sec_hdr);
-	if ((!g_licence_issued && !g_licence_error_result) || (flags & SEC_ENCRYPT))
+	if ((!g_licence_issued && !g_licence_error_result) || (flags & SEC_ENCRYPT)
+	    || (channel == g_mcs_msgchannel && channel != 0))
 		out_uint32_le(s, flags);
 
 	if (flags & SEC_ENCRYPT)
@@ -355,10 +436,13 @@ sec_send_to_channel(STREAM s, uint32 flags, uint16 channel)
 		flags &= ~SEC_ENCRYPT;
 		datalen = s_remaining(s) - 8;
 		inout_uint8p(s, data, datalen + 8);
-		sec_sign(data, 8, g_sec_sign_key, g_rc4_key_len, data + 8, datalen);
-		sec_encrypt(data + 8, datalen);
+		sec_sign_encrypt(data, data + 8, datalen);
 	}
 
+	st = sec_channel_stats(channel);
+	st->pdus_out++;
+	st->bytes_out += s_length(s);
+
 	mcs_send_to_channel(s, channel);
 
 #ifdef WITH_SCARD
@@ -374,6 +458,91 @@ sec_send(STREAM s, uint32 flags)
 	sec_send_to_channel(s, flags, MCS_GLOBAL_CHANNEL);
 }
 
+/* Initialise a PDU for the MCS message channel, sent with
+   sec_send_message() */
+STREAM
+sec_init_message(int maxlen)
+{
+	STREAM s;
+
+	s = mcs_init(maxlen + (g_encryption ? 12 : 4));
+	s_push_layer(s, sec_hdr, g_encryption ? 12 : 4);
+	return s;
+}
+
+void
+sec_send_message(STREAM s, uint32 flags)
+{
+	if (g_encryption)
+		flags |= SEC_ENCRYPT;
+	sec_send_to_channel(s, flags, g_mcs_msgchannel);
+}
+
+/* Transmit a fast-path input PDU holding num_events events, which
+   are already encoded in data [MS-RDPBCGR] 2.2.8.1.2 */
+void
+sec_send_fastpath_input(uint8 * data, uint32 length, uint8 num_events)
+{
+	STREAM s;
+	uint8 header, *payload;
+	uint32 total, datalen;
+
+	header = FASTPATH_INPUT_ACTION_FASTPATH;
+	if (g_encryption)
+		header |= FASTPATH_INPUT_ENCRYPTED << 6;
+
+	/* more than 15 events need the optional numEvents field */
+	datalen = length;
+	if (num_events < 16)
+		header |= num_events << 2;
+	else
+		datalen++;
+
+	total = 1 + 1 + (g_encryption ? 8 : 0) + datalen;
+	if (total > 0x7f)
+		total++;
+
+	s = tcp_init(total);
+
+#ifdef WITH_SCARD
+	scard_lock(SCARD_LOCK_SEC);
+#endif
+
+	out_uint8(s, header);
+	if (total > 0x7f)
+	{
+		out_uint16_be(s, total | 0x8000);
+	}
+	else
+	{
+		out_uint8(s, total);
+	}
+
+	if (g_encryption)
+		out_uint8s(s, 8);	/* dataSignature */
+
+	payload = s->p;
+	if (num_events >= 16)
+		out_uint8(s, num_events);
+	out_uint8a(s, data, length);
+	s_mark_end(s);
+
+	if (g_encryption)
+	{
+		sec_sign_encrypt(payload - 8, payload, datalen);
+	}
+
+	g_sec_channel_stats[0].pdus_out++;
+	g_sec_channel_stats[0].bytes_out += s_length(s);
+
+	tcp_send(s);
+
+#ifdef WITH_SCARD
+	scard_unlock(SCARD_LOCK_SEC);
+#endif
+
+	s_free(s);
+}
 
 /* Transfer the client random to the server */
 static void
@@ -398,8 +567,9 @@ sec_establish_key(void)
 static void
 sec_out_mcs_connect_initial_pdu(STREAM s, uint32 selected_protocol)
 {
-	int length = 162 + 76 + 12 + 4 + (g_dpi > 0 ? 18 : 0);
+	int length = 162 + 76 + 12 + 4 + 8 + (g_dpi > 0 ? 18 : 0);
 	unsigned int i;
+	sint32 origin_x, origin_y;
 	uint32 rdpversion = RDP_40;
 	uint16 capflags = RNS_UD_CS_SUPPORT_ERRINFO_PDU;
 	uint16 colorsupport = RNS_UD_24BPP_SUPPORT | RNS_UD_16BPP_SUPPORT | RNS_UD_32BPP_SUPPORT;
@@ -412,6 +582,8 @@ sec_out_mcs_connect_initial_pdu(STREAM s, uint32 selected_protocol)
 
 	if (g_num_channels > 0)
 		length += g_num_channels * 12 + 8;
+	if (g_num_monitors > 1)
+		length += g_num_monitors * 20 + 12;
 
 	/* Generic Conference Control (T.124) ConferenceCreateRequest */
 	out_uint16_be(s, 5);
@@ -461,11 +633,16 @@ sec_out_mcs_connect_initial_pdu(STREAM s, uint32 selected_protocol)
 	out_uint16_le(s, MIN(g_server_depth, 24));
 	if (g_server_depth == 32)
 		capflags |= RNS_UD_CS_WANT_32BPP_SESSION;
+	if (g_gfx)
+		capflags |= RNS_UD_CS_SUPPORT_DYNVC_GFX_PROTOCOL;
+	capflags |= RNS_UD_CS_SUPPORT_NETCHAR_AUTODETECT;
+	if (g_autodetect)
+		capflags |= RNS_UD_CS_VALID_CONNECTION_TYPE;
 
 	out_uint16_le(s, colorsupport);	/* supportedColorDepths */
 	out_uint16_le(s, capflags);	/* earlyCapabilityFlags */
 	out_uint8s(s, 64);	/* clientDigProductId */
-	out_uint8(s, 0);	/* connectionType */
+	out_uint8(s, g_autodetect ? CONNECTION_TYPE_AUTODETECT : 0);	/* connectionType */
 	out_uint8(s, 0);	/* pad */
 	out_uint32_le(s, selected_protocol);	/* serverSelectedProtocol */
 	if (g_dpi > 0)
@@ -501,6 +678,35 @@ sec_out_mcs_connect_initial_pdu(STREAM s, uint32 selected_protocol)
 	out_uint32_le(s, g_encryption ? 0x3 : 0);	/* encryptionMethods */
 	out_uint32(s, 0);	/* extEncryptionMethods */
 
+	/* Client monitor data (TS_UD_CS_MONITOR), for a session laid out
+	   on several monitors, the primary one at the origin */
+	if (g_num_monitors > 1)
+	{
+		utils_monitor_origin(g_monitors, g_num_monitors, &origin_x, &origin_y);
+
+		out_uint16_le(s, CS_MONITOR);	/* type */
+		out_uint16_le(s, g_num_monitors * 20 + 12);	/* length */
+		out_uint32_le(s, 0);	/* flags */
+		out_uint32_le(s, g_num_monitors);	/* monitorCount */
+		for (i = 0; i < (unsigned int) g_num_monitors; i++)
+		{
+			logger(Protocol, Debug, "sec_out_mcs_data(), monitor %dx%d+%d+%d%s",
+			       g_monitors[i].width, g_monitors[i].height, g_monitors[i].x,
+			       g_monitors[i].y, g_monitors[i].primary ? " primary" : "");
+			out_uint32_le(s, g_monitors[i].x - origin_x);	/* left */
+			out_uint32_le(s, g_monitors[i].y - origin_y);	/* top */
+			out_uint32_le(s, g_monitors[i].x - origin_x + g_monitors[i].width - 1);	/* right */
+			out_uint32_le(s, g_monitors[i].y - origin_y + g_monitors[i].height - 1);	/* bottom */
+			out_uint32_le(s, g_monitors[i].primary ? TS_MONITOR_PRIMARY : 0);	/* flags */
+		}
+	}
+
+	/* Client message channel data (TS_UD_CS_MCS_MSGCHANNEL), the
+	   channel carries the multitransport and auto-detect PDUs */
+	out_uint16_le(s, CS_MCS_MSGCHANNEL);	/* type */
+	out_uint16_le(s, 8);	/* length */
+	out_uint32_le(s, 0);	/* flags */
+
 	/* Channel definitions (TS_UD_CS_NET) */
 	logger(Protocol, Debug, "sec_out_mcs_data(), g_num_channels is %d", g_num_channels);
 	if (g_num_channels > 0)
@@ -855,6 +1061,18 @@ sec_process_mcs_data(STREAM s)
 				   channels */
 				break;
 
+			case SEC_TAG_SRV_MSGCHANNEL:
+				in_uint16_le(s, g_mcs_msgchannel);
+				logger(Protocol, Debug, "%s(), SEC_TAG_SRV_MSGCHANNEL, channel %d",
+				       __func__, g_mcs_msgchannel);
+				break;
+
+			case SEC_TAG_SRV_MULTITRANSPORT:
+				in_uint32_le(s, g_multitransport_flags);
+				logger(Protocol, Debug, "%s(), SEC_TAG_SRV_MULTITRANSPORT, flags 0x%x",
+				       __func__, g_multitransport_flags);
+				break;
+
 			default:
 				logger(Protocol, Warning, "Unhandled response tag 0x%x", tag);
 		}
@@ -863,22 +1081,74 @@ sec_process_mcs_data(STREAM s)
 	}
 }
 
+/* Process an Initiate Multitransport Request. There is no UDP
+   transport, so the server is asked to carry on over TCP alone. */
+static void
+sec_process_transport_req(STREAM s)
+{
+	uint32 request_id;
+	uint16 protocol;
+	STREAM out;
+
+	if (!s_check_rem(s, 24))
+	{
+		logger(Protocol, Warning, "%s(), short PDU", __func__);
+		return;
+	}
+
+	in_uint32_le(s, request_id);
+	in_uint16_le(s, protocol);
+	in_uint8s(s, 2);	/* reserved */
+	in_uint8s(s, 16);	/* securityCookie */
+
+	logger(Protocol, Debug, "%s(), request %d for protocol 0x%x, declining", __func__,
+	       request_id, protocol);
+
+	out = sec_init_message(8);
+	out_uint32_le(out, request_id);
+	out_uint32_le(out, MULTITRANSPORT_E_ABORT);	/* hrResponse */
+	s_mark_end(out);
+	sec_send_message(out, RDP_SEC_TRANSPORT_RSP);
+	s_free(out);
+}
+
+/* Process a PDU received on the MCS message channel */
+static void
+sec_process_message(STREAM s, uint16 flags)
+{
+	if (flags & SEC_TRANSPORT_REQ)
+		sec_process_transport_req(s);
+	else if (flags & SEC_AUTODETECT_REQ)
+		autodetect_process(s);
+	else if (flags & SEC_HEARTBEAT)
+		logger(Protocol, Debug, "%s(), heartbeat", __func__);
+	else
+		logger(Protocol, Warning, "%s(), unhandled PDU with flags 0x%x", __func__,
+		       flags);
+}
+
 /* Receive secure transport packet */
 STREAM
 sec_recv(RD_BOOL * is_fastpath)
 {
 	uint8 fastpath_hdr, fastpath_flags;
-	uint16 sec_flags;
+	uint16 sec_flags = 0;
 	uint16 channel;
 	STREAM s;
 	struct stream packet;
 	size_t data_offset;
 	size_t remaining;
 	unsigned char *data;
+	struct sec_channel_stats *st;
+	TRACE_SCOPE(TRACE_SEC_RECV);
 
 	while ((s = mcs_recv(&channel, is_fastpath, &fastpath_hdr)) != NULL)
 	{
 		packet = *s;
+		autodetect_received(s_length(s));
+		st = *is_fastpath ? &g_sec_channel_stats[0] : sec_channel_stats(channel);
+		st->pdus_in++;
+		st->bytes_in += s_length(s);
 		if (*is_fastpath == True)
 		{
 			/* If fastpath packet is encrypted, read data
@@ -904,7 +1174,8 @@ sec_recv(RD_BOOL * is_fastpath)
 			return s;
 		}
 
-		if (g_encryption || (!g_licence_issued && !g_licence_error_result))
+		if (g_encryption || (!g_licence_issued && !g_licence_error_result)
+		    || (channel == g_mcs_msgchannel && channel != 0))
 		{
 			data_offset = s_tell(s);
 
@@ -989,6 +1260,12 @@ sec_recv(RD_BOOL * is_fastpath)
 			s_seek(s, data_offset);
 		}
 
+		if (channel == g_mcs_msgchannel && channel != 0)
+		{
+			sec_process_message(s, sec_flags);
+			continue;
+		}
+
 		if (channel != MCS_GLOBAL_CHANNEL)
 		{
 			channel_process(s, channel);
@@ -1013,12 +1290,13 @@ sec_connect(char *server, char *username, char *domain, char *password, RD_BOOL
 		return False;
 
 	/* We exchange some RDP data during the MCS-Connect */
-	mcs_data = s_alloc(512);
+	mcs_data = s_alloc(512 + RDP_MAX_MONITORS * 20);
 	sec_out_mcs_connect_initial_pdu(mcs_data, selected_proto);
 
 	/* finalize the MCS connect sequence */
 	if (!mcs_connect_finalize(mcs_data))
 		return False;
+	rdp_connect_phase(CONNECT_PHASE_MCS);
 
 	/* sec_process_mcs_data(&mcs_data); */
 	if (g_encryption)
@@ -1036,6 +1314,36 @@ sec_disconnect(void)
 	mcs_disconnect(RN_USER_REQUESTED);
 }
 
+/* Format the traffic of channel n into buf, for the ctrl socket */
+RD_BOOL
+sec_format_stats(int n, char *buf, size_t size)
+{
+	struct sec_channel_stats *st;
+	const char *name;
+
+	if (n < 0 || n >= 2 + (int) MIN(g_num_channels, SEC_STATS_CHANNELS - 2))
+		return False;
+
+	if (n == 0)
+		name = "global";
+	else if (n == 1)
+		name = "message";
+	else
+		name = g_channels[n - 2].name;
+
+	st = &g_sec_channel_stats[n];
+	snprintf(buf, size, "%.8s pdus_in=%u bytes_in=%llu pdus_out=%u bytes_out=%llu", name,
+		 st->pdus_in, (unsigned long long) st->bytes_in, st->pdus_out,
+		 (unsigned long long) st->bytes_out);
+	return True;
+}
+
+void
+sec_reset_stats(void)
+{
+	memset(g_sec_channel_stats, 0, sizeof(g_sec_channel_stats));
+}
+
 /* reset the state of the sec layer */
 void
 sec_reset_state(void)
@@ -1045,5 +1353,7 @@ sec_reset_state(void)
 	g_sec_decrypt_use_count = 0;
 	g_licence_issued = 0;
 	g_licence_error_result = 0;
+	g_mcs_msgchannel = 0;
+	g_multitransport_flags = 0;
 	mcs_reset_state();
 }
@@ -20,19 +20,102 @@
 #include <errno.h>
 #include <iconv.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "rdesktop.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 extern char g_codepage[16];
 
+/* Streams of up to STREAM_POOL_MAX_SIZE bytes are allocated in power of
+   two size classes, and s_free() keeps a few of each class around for
+   the next s_alloc(), so that sending and receiving PDUs does not go to
+   the heap every time. The size of a stream is still the size asked
+   for; only its capacity is rounded up. */
+#define STREAM_POOL_MIN_SHIFT	8
+#define STREAM_POOL_CLASSES	9	/* 256 bytes to 64 KiB */
+#define STREAM_POOL_MAX_SIZE	(1u << (STREAM_POOL_MIN_SHIFT + STREAM_POOL_CLASSES - 1))
+#define STREAM_POOL_DEPTH	8
+
+struct stream_pool
+{
+	STREAM free[STREAM_POOL_DEPTH];
+	int count;
+
+	/* statistics */
+	uint32 allocs;
+	uint32 hits;
+	uint32 returns;
+};
+
+/* streams may be sent from the smartcard threads */
+static pthread_mutex_t g_stream_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stream_pool g_stream_pool[STREAM_POOL_CLASSES];
+static uint32 g_stream_large_allocs;
+
+/* Size class for a stream of size bytes, -1 if it is too large to pool */
+static int
+s_pool_class(unsigned int size)
+{
+	int n;
+
+	if (size > STREAM_POOL_MAX_SIZE)
+		return -1;
+
+	for (n = 0; (1u << (STREAM_POOL_MIN_SHIFT + n)) < size; n++);
+	return n;
+}
+
 STREAM
 s_alloc(unsigned int size)
 {
+	struct stream_pool *pool;
+	unsigned char *data;
 	STREAM s;
+	int n;
+
+	n = s_pool_class(size);
+	if (n < 0)
+	{
+		s = xmalloc(sizeof(struct stream));
+		memset(s, 0, sizeof(struct stream));
+		s_realloc(s, size);
+
+		pthread_mutex_lock(&g_stream_pool_lock);
+		g_stream_large_allocs++;
+		pthread_mutex_unlock(&g_stream_pool_lock);
+		return s;
+	}
+
+	pool = &g_stream_pool[n];
+	s = NULL;
+
+	pthread_mutex_lock(&g_stream_pool_lock);
+	pool->allocs++;
+	if (pool->count != 0)
+	{
+		s = pool->free[--pool->count];
+		pool->hits++;
+	}
+	pthread_mutex_unlock(&g_stream_pool_lock);
+
+	if (s == NULL)
+	{
+		s = xmalloc(sizeof(struct stream));
+		data = xmalloc(1u << (STREAM_POOL_MIN_SHIFT + n));
+	}
+	else
+		data = s->data;
 
-	s = xmalloc(sizeof(struct stream));
 	memset(s, 0, sizeof(struct stream));
-	s_realloc(s, size);
+	s->p = s->end = s->data = data;
+	s->size = size;
+	s->capacity = 1u << (STREAM_POOL_MIN_SHIFT + n);
 
 	return s;
 }
@@ -46,6 +129,7 @@ s_inherit(unsigned char *data, unsigned int size)
 	memset(s, 0, sizeof(struct stream));
 	s->p = s->data = data;
 	s->size = size;
+	s->capacity = size;
 
 	return s;
 }
@@ -58,8 +142,15 @@ s_realloc(STREAM s, unsigned int size)
 	if (s->size >= size)
 		return;
 
+	if (s->capacity >= size)
+	{
+		s->size = size;
+		return;
+	}
+
 	data = s->data;
 	s->size = size;
+	s->capacity = size;
 	s->data = xrealloc(data, size);
 	s->p = s->data + (s->p - data);
 	s->end = s->data + (s->end - data);
@@ -77,6 +168,7 @@ s_reset(STREAM s)
 	tmp = *s;
 	memset(s, 0, sizeof(struct stream));
 	s->size = tmp.size;
+	s->capacity = tmp.capacity;
 	s->end = s->p = s->data = tmp.data;
 }
 
@@ -84,12 +176,157 @@ s_reset(STREAM s)
 void
 s_free(STREAM s)
 {
+	struct stream_pool *pool;
+	int n;
+
 	if (s == NULL)
 		return;
+
+	/* only buffers of exactly a class size can be handed out again */
+	n = s_pool_class(s->capacity);
+	if (n >= 0 && s->capacity == 1u << (STREAM_POOL_MIN_SHIFT + n))
+	{
+		pool = &g_stream_pool[n];
+
+		pthread_mutex_lock(&g_stream_pool_lock);
+		if (pool->count < STREAM_POOL_DEPTH)
+		{
+			pool->free[pool->count++] = s;
+			pool->returns++;
+			s = NULL;
+		}
+		pthread_mutex_unlock(&g_stream_pool_lock);
+
+		if (s == NULL)
+			return;
+	}
+
 	free(s->data);
 	free(s);
 }
 
+RD_BOOL
+s_format_stats(int n, char *buf, size_t size)
+{
+	struct stream_pool *pool;
+
+	if (n < 0 || n > STREAM_POOL_CLASSES)
+		return False;
+
+	pthread_mutex_lock(&g_stream_pool_lock);
+	if (n == STREAM_POOL_CLASSES)
+	{
+		snprintf(buf, size, "size>%u allocs=%u", STREAM_POOL_MAX_SIZE,
+			 g_stream_large_allocs);
+	}
+	else
+	{
+		pool = &g_stream_pool[n];
+		snprintf(buf, size, "size=%u allocs=%u hits=%u returns=%u pooled=%d",
+			 1u << (STREAM_POOL_MIN_SHIFT + n), pool->allocs, pool->hits,
+			 pool->returns, pool->count);
+	}
+	pthread_mutex_unlock(&g_stream_pool_lock);
+
+	return True;
+}
+
+/* Start counting afresh, the pooled buffers are kept */
+void
+s_reset_stats(void)
+{
+	int n;
+
+	pthread_mutex_lock(&g_stream_pool_lock);
+	for (n = 0; n < STREAM_POOL_CLASSES; n++)
+		g_stream_pool[n].allocs = g_stream_pool[n].hits = g_stream_pool[n].returns = 0;
+	g_stream_large_allocs = 0;
+	pthread_mutex_unlock(&g_stream_pool_lock);
+}
+
+void
+s_report_stats(void)
+{
+	char buf[256];
+	int n;
+
+	for (n = 0; s_format_stats(n, buf, sizeof(buf)); n++)
+		logger(Core, Verbose, "Stream statistics: %s", buf);
+}
+
+/* The temporaries of parsing one received PDU, such as point lists and
+   decoded bitmaps, are carved out of one block by bumping a pointer,
+   and all released at once when the PDU has been processed. Should a
+   PDU need more than the block holds, further blocks are chained on,
+   and the block is grown to the total at the next reset so that it
+   covers such PDUs from then on. Only used by the main thread. */
+#define ARENA_MIN_SIZE	(64 * 1024)
+#define ARENA_ALIGN	16
+
+struct arena_block
+{
+	struct arena_block *next;
+	size_t size, used;
+	uint8 data[] __attribute__ ((aligned(ARENA_ALIGN)));
+};
+
+static struct arena_block *g_arena = NULL;
+
+static struct arena_block *
+s_arena_block(size_t size, struct arena_block *next)
+{
+	struct arena_block *b;
+
+	b = (struct arena_block *) xmalloc(sizeof(struct arena_block) + size);
+	b->next = next;
+	b->size = size;
+	b->used = 0;
+	return b;
+}
+
+void *
+s_arena_alloc(size_t size)
+{
+	struct arena_block *b = g_arena;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	if (b == NULL || b->size - b->used < size)
+	{
+		b = s_arena_block(MAX(size, b ? b->size : ARENA_MIN_SIZE), b);
+		g_arena = b;
+	}
+
+	p = b->data + b->used;
+	b->used += size;
+	return p;
+}
+
+void
+s_arena_reset(void)
+{
+	struct arena_block *b, *next;
+	size_t total;
+
+	if (g_arena == NULL)
+		return;
+
+	if (g_arena->next == NULL)
+	{
+		g_arena->used = 0;
+		return;
+	}
+
+	total = 0;
+	for (b = g_arena; b != NULL; b = next)
+	{
+		next = b->next;
+		total += b->size;
+		xfree(b);
+	}
+	g_arena = s_arena_block(total, NULL);
+}
+
 static iconv_t
 local_to_utf16()
 {
@@ -104,6 +341,49 @@ local_to_utf16()
 	return icv;
 }
 
+/* Writes an ASCII string as UTF-16LE, 16 characters at a time where
+   vector instructions are available. Returns False, with part of out
+   written, if the string is not all ASCII. */
+RD_BOOL
+ascii_to_utf16(unsigned char *out, const char *string, size_t length)
+{
+	size_t i = 0;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v;
+
+	for (; i + 16 <= length; i += 16)
+	{
+		v = _mm_loadu_si128((__m128i *) (string + i));
+		if (_mm_movemask_epi8(v))
+			return False;
+		_mm_storeu_si128((__m128i *) (out + i * 2), _mm_unpacklo_epi8(v, zero));
+		_mm_storeu_si128((__m128i *) (out + i * 2 + 16), _mm_unpackhi_epi8(v, zero));
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	uint8x16x2_t w;
+	uint8x8_t high;
+
+	w.val[1] = vdupq_n_u8(0);
+	for (; i + 16 <= length; i += 16)
+	{
+		w.val[0] = vld1q_u8((const uint8_t *) (string + i));
+		high = vshrn_n_u16(vreinterpretq_u16_u8(w.val[0]), 4);
+		if (vget_lane_u64(vreinterpret_u64_u8(high), 0) & 0x8888888888888888ULL)
+			return False;
+		vst2q_u8(out + i * 2, w);
+	}
+#endif
+	for (; i < length; i++)
+	{
+		if ((unsigned char) string[i] & 0x80)
+			return False;
+		out[i * 2] = string[i];
+		out[i * 2 + 1] = 0;
+	}
+	return True;
+}
+
 /* Writes a utf16 encoded string into stream excluding null termination.
    This function assumes that input is ASCII compatible, such as UTF-8.
  */
@@ -118,13 +398,20 @@ _out_utf16s(STREAM s, size_t maxlength, const char *string)
 	if (string == NULL)
 		return 0;
 
+	ibl = strlen(string);
+	obl = maxlength ? maxlength : (size_t) s_left(s);
+
+	/* Most strings sent are plain ASCII, which needs no iconv */
+	if (ibl * 2 <= obl && ascii_to_utf16(s->p, string, ibl))
+	{
+		s->p += ibl * 2;
+		return ibl * 2;
+	}
+
 	if (!icv_local_to_utf16)
 	{
 		icv_local_to_utf16 = local_to_utf16();
 	}
-
-	ibl = strlen(string);
-	obl = maxlength ? maxlength : (size_t) s_left(s);
 	pin = string;
 	pout = (char *) s->p;
 
@@ -30,6 +30,7 @@ typedef struct stream
 	unsigned char *end;
 	unsigned char *data;
 	unsigned int size;
+	unsigned int capacity;	/* allocated size of data */
 
 	/* Offsets of various headers */
 	unsigned char *iso_hdr;
@@ -51,6 +52,10 @@ void s_realloc(STREAM s, unsigned int size);
 void s_free(STREAM s);
 /* Reset all internal offsets, but keep the allocated size */
 void s_reset(STREAM s);
+/* Scratch memory that lives until the received PDU has been processed */
+void *s_arena_alloc(size_t size);
+/* Release everything s_arena_alloc() handed out, at the end of a PDU */
+void s_arena_reset(void);
 
 void out_utf16s(STREAM s, const char *string);
 void out_utf16s_padded(STREAM s, const char *string, size_t width, unsigned char pad);
@@ -72,7 +77,7 @@ size_t in_ansi_string(STREAM s, char *string, size_t len);
 /* Returns number of bytes that can still be read from STREAM */
 #define s_remaining(s)		(size_t)((s)->end - (s)->p)
 /* True if at least n bytes can still be read */
-#define s_check_rem(s,n)	(((s)->p <= (s)->end) && ((size_t)n <= s_remaining(s)))
+#define s_check_rem(s,n)	(((s)->p <= (s)->end) && ((size_t)(n) <= s_remaining(s)))
 /* True if all data has been read */
 #define s_check_end(s)		((s)->p == (s)->end)
 /* Return the total number of bytes that can be read */
@@ -84,30 +89,36 @@ size_t in_ansi_string(STREAM s, char *string, size_t len);
 #define s_assert_r(s,n)		{ if (!s_check_rem(s, n)) rdp_protocol_error( "unexpected stream overrun", s); }
 #define s_assert_w(s,n)		{ if (s_left(s) < (size_t)n) { logger(Core, Error, "%s:%d: %s(), %s", __FILE__, __LINE__, __func__, "unexpected stream overrun"); exit(0); } }
 
+/* The in_*_nc() variants read without checking, for fields of a
+   fixed-size header whose whole length one s_assert_r() has covered */
+
 /* Read/write an unsigned integer in little-endian order */
 #if defined(L_ENDIAN) && !defined(NEED_ALIGN)
-#define in_uint16_le(s,v)	{ s_assert_r(s, 2); v = *(uint16 *)((s)->p); (s)->p += 2; }
-#define in_uint32_le(s,v)	{ s_assert_r(s, 4); v = *(uint32 *)((s)->p); (s)->p += 4; }
+#define in_uint16_le_nc(s,v)	{ v = *(uint16 *)((s)->p); (s)->p += 2; }
+#define in_uint32_le_nc(s,v)	{ v = *(uint32 *)((s)->p); (s)->p += 4; }
 #define in_uint64_le(s,v)	{ s_assert_r(s, 8); v = *(uint64 *)((s)->p); (s)->p += 8; }
 #define out_uint16_le(s,v)	{ s_assert_w(s, 2); *(uint16 *)((s)->p) = v; (s)->p += 2; }
 #define out_uint32_le(s,v)	{ s_assert_w(s, 4); *(uint32 *)((s)->p) = v; (s)->p += 4; }
 #define out_uint64_le(s,v)	{ s_assert_w(s, 8); *(uint64 *)((s)->p) = v; (s)->p += 8; }
 #else
-#define in_uint16_le(s,v)	{ s_assert_r(s, 2); v = *((s)->p++); v += *((s)->p++) << 8; }
-#define in_uint32_le(s,v)	{ s_assert_r(s, 4); in_uint16_le(s,v) \
+#define in_uint16_le_nc(s,v)	{ v = *((s)->p++); v += *((s)->p++) << 8; }
+#define in_uint32_le_nc(s,v)	{ in_uint16_le_nc(s,v) \
 				v += *((s)->p++) << 16; v += *((s)->p++) << 24; }
-#define in_uint64_le(s,v)	{ s_assert_r(s, 8); in_uint32_le(s,v) \
+#define in_uint64_le(s,v)	{ s_assert_r(s, 8); in_uint32_le_nc(s,v) \
 				v += *((s)->p++) << 32; v += *((s)->p++) << 40; \
 				v += *((s)->p++) << 48; v += *((s)->p++) << 56; }
 #define out_uint16_le(s,v)	{ s_assert_w(s, 2); *((s)->p++) = (v) & 0xff; *((s)->p++) = ((v) >> 8) & 0xff; }
 #define out_uint32_le(s,v)	{ s_assert_w(s, 4); out_uint16_le(s, (v) & 0xffff); out_uint16_le(s, ((v) >> 16) & 0xffff); }
 #define out_uint64_le(s,v)	{ s_assert_w(s, 8); out_uint32_le(s, (v) & 0xffffffff); out_uint32_le(s, ((v) >> 32) & 0xffffffff); }
 #endif
+#define in_uint16_le(s,v)	{ s_assert_r(s, 2); in_uint16_le_nc(s,v); }
+#define in_uint32_le(s,v)	{ s_assert_r(s, 4); in_uint32_le_nc(s,v); }
 
 
 /* Read/write an unsigned integer in big-endian order */
 #if defined(B_ENDIAN) && !defined(NEED_ALIGN)
-#define in_uint16_be(s,v)	{ s_assert_r(s, 2); v = *(uint16 *)((s)->p); (s)->p += 2; }
+#define in_uint16_be_nc(s,v)	{ v = *(uint16 *)((s)->p); (s)->p += 2; }
+#define in_uint16_be(s,v)	{ s_assert_r(s, 2); in_uint16_be_nc(s,v); }
 #define in_uint32_be(s,v)	{ s_assert_r(s, 4); v = *(uint32 *)((s)->p); (s)->p += 4; }
 #define in_uint64_be(s,v)	{ s_assert_r(s, 8); v = *(uint64 *)((s)->p); (s)->p += 8; }
 #define out_uint16_be(s,v)	{ s_assert_w(s, 2); *(uint16 *)((s)->p) = v; (s)->p += 2; }
@@ -124,7 +135,8 @@ size_t in_ansi_string(STREAM s, char *string, size_t len);
 #define out_uint64(s,v)		out_uint64_be(s,v)
 
 #else
-#define in_uint16_be(s,v)	{ s_assert_r(s, 2); v = *((s)->p++); next_be(s,v); }
+#define in_uint16_be_nc(s,v)	{ v = *((s)->p++); v = ((v) << 8) + *((s)->p++); }
+#define in_uint16_be(s,v)	{ s_assert_r(s, 2); in_uint16_be_nc(s,v); }
 #define in_uint32_be(s,v)	{ s_assert_r(s, 4); in_uint16_be(s,v); next_be(s,v); next_be(s,v); }
 #define in_uint64_be(s,v)	{ s_assert_r(s, 8); in_uint32_be(s,v); next_be(s,v); next_be(s,v); next_be(s,v); next_be(s,v); }
 #define out_uint16_be(s,v)	{ s_assert_w(s, 2); *((s)->p++) = ((v) >> 8) & 0xff; *((s)->p++) = (v) & 0xff; }
@@ -142,13 +154,16 @@ size_t in_ansi_string(STREAM s, char *string, size_t len);
 #endif
 
 /* Read a single unsigned byte in v from STREAM s */
-#define in_uint8(s,v)		{ s_assert_r(s, 1); v = *((s)->p++); }
+#define in_uint8_nc(s,v)	{ v = *((s)->p++); }
+#define in_uint8(s,v)		{ s_assert_r(s, 1); in_uint8_nc(s,v); }
 /* Return a pointer in v to manually read n bytes from STREAM s */
-#define in_uint8p(s,v,n)	{ s_assert_r(s, n); v = (s)->p; (s)->p += n; }
+#define in_uint8p_nc(s,v,n)	{ v = (s)->p; (s)->p += n; }
+#define in_uint8p(s,v,n)	{ s_assert_r(s, n); in_uint8p_nc(s,v,n); }
 /* Copy n bytes from STREAM s in to array v */
 #define in_uint8a(s,v,n)	{ s_assert_r(s, n); memcpy(v,(s)->p,n); (s)->p += n; }
 /* Skip reading n bytes in STREAM s */
-#define in_uint8s(s,n)		{ s_assert_r(s, n); (s)->p += n; }
+#define in_uint8s_nc(s,n)	{ (s)->p += n; }
+#define in_uint8s(s,n)		{ s_assert_r(s, n); in_uint8s_nc(s,n); }
 /* Write a single unsigned byte from v to STREAM s */
 #define out_uint8(s,v)		{ s_assert_w(s, 1); *((s)->p++) = v; }
 /* Return a pointer in v to manually fill in n bytes in STREAM s */
@@ -30,11 +30,17 @@
 #include <netinet/tcp.h>	/* TCP_NODELAY */
 #include <arpa/inet.h>		/* inet_addr */
 #include <errno.h>		/* errno */
+#include <fcntl.h>		/* fcntl */
 #include <assert.h>
+#include <poll.h>
+#include <pthread.h>
 #endif
 
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+#include <gnutls/socket.h>
+#endif
 
 #include "rdesktop.h"
 #include "ssl.h"
@@ -45,10 +51,12 @@
 #define TCP_CLOSE(_sck) closesocket(_sck)
 #define TCP_STRERROR "tcp error"
 #define TCP_BLOCKS (WSAGetLastError() == WSAEWOULDBLOCK)
+#define TCP_INPROGRESS (WSAGetLastError() == WSAEWOULDBLOCK)
 #else
 #define TCP_CLOSE(_sck) close(_sck)
 #define TCP_STRERROR strerror(errno)
 #define TCP_BLOCKS (errno == EWOULDBLOCK)
+#define TCP_INPROGRESS (errno == EINPROGRESS)
 #endif
 
 #ifndef INADDR_NONE
@@ -60,18 +68,70 @@
    that violation. */
 #define GNUTLS_PRIORITY "NORMAL:%COMPAT"
 
+/* Large enough for a full TLS record, and for several small PDUs */
+#define TCP_RECV_BUFFER_SIZE 65536
+
+/* Socket options for the kind of session, from -o tcp=. Interactive
+   sends every input event at once, acknowledges what arrives at once
+   and notices a dead link within a minute; bulk lets small segments
+   be coalesced. Both size the receive buffer to the bandwidth-delay
+   product that network auto-detection measures. */
+typedef enum
+{
+	TCP_PROFILE_DEFAULT,
+	TCP_PROFILE_INTERACTIVE,
+	TCP_PROFILE_BULK
+} TCP_PROFILE;
+
+#define TCP_RCVBUF_MIN		(1024 * 16)
+#define TCP_RCVBUF_PROFILE_MIN	(1024 * 64)
+#define TCP_RCVBUF_MAX		(1024 * 1024 * 16)
+#define TCP_KEEPALIVE_IDLE	30	/* seconds */
+#define TCP_KEEPALIVE_INTERVAL	10
+#define TCP_KEEPALIVE_COUNT	3
+
 #ifdef IPv6
 static struct addrinfo *g_server_address = NULL;
+
+/* Addresses are tried as in RFC 8305, Happy Eyeballs: alternating
+   between address families, each attempt started when the one before
+   has failed or has not completed within g_tcp_connect_delay ms, and
+   the first to complete wins. */
+#define TCP_MAX_ATTEMPTS	16
+
+/* Results of getaddrinfo(), kept so that reconnects and redirects
+   back to a name already seen do not have to wait for DNS again */
+#define TCP_DNS_CACHE_SIZE	8
+#define TCP_DNS_CACHE_TTL	300	/* seconds */
+
+typedef struct
+{
+	char *name;
+	int port;
+	struct addrinfo *addrs;
+	time_t resolved;
+}
+TCP_DNS_ENTRY;
+
+static TCP_DNS_ENTRY g_dns_cache[TCP_DNS_CACHE_SIZE];
 #else
 struct sockaddr_in *g_server_address = NULL;
 #endif
 
 static char *g_last_server_name = NULL;
 static RD_BOOL g_ssl_initialized = False;
-static int g_sock;
+/* The system trust database, loaded once and used by every connection */
+static gnutls_certificate_credentials_t g_tls_cred = NULL;
+static int g_sock = -1;
 static RD_BOOL g_run_ui = False;
 static struct stream g_in;
+/* Read-ahead buffer, holding data received but not yet asked for */
+static uint8 g_rbuf[TCP_RECV_BUFFER_SIZE];
+static uint32 g_rbuf_start, g_rbuf_end;
 int g_tcp_port_rdp = TCP_PORT_RDP;
+/* Connection attempt delay, in ms */
+int g_tcp_connect_delay = 250;
+static TCP_PROFILE g_tcp_profile = TCP_PROFILE_DEFAULT;
 
 extern RD_BOOL g_exit_mainloop;
 extern RD_BOOL g_network_error;
@@ -80,9 +140,58 @@ extern char g_tls_version[];
 
 static gnutls_session_t g_tls_session;
 
+/* TLS sessions of the servers connected to, so that reconnecting, as
+   for redirects and resizes, can resume them instead of doing a full
+   handshake */
+#define TCP_TLS_SESSION_CACHE_SIZE 4
+
+typedef struct
+{
+	char *name;
+	int port;
+	gnutls_datum_t data;
+}
+TCP_TLS_SESSION;
+
+static TCP_TLS_SESSION g_tls_sessions[TCP_TLS_SESSION_CACHE_SIZE];
+static int g_tls_sessions_next = 0;
+
+/* With the record layer in the kernel, reads of at least this much
+   skip the read-ahead buffer */
+#define TCP_KTLS_DIRECT_READ 4096
+static RD_BOOL g_tls_ktls_recv = False;
+
+/* Nesting depth of tcp_cork() */
+static int g_tcp_corked = 0;
+
+/* Whether the main loop waits for the socket to become writable */
+static RD_BOOL g_tcp_want_send = False;
+
+/* Once the session is up, a receive thread reads and decrypts what the
+   server sends into a bounded queue, while the main thread parses,
+   decodes and draws. The main thread waits for the queue, rather than
+   the socket, in ui_select(): the thread writes a byte to g_recv_wake
+   whenever the queue stops being empty. The thread also watches the
+   socket for room when the main thread wants to send. */
+#define TCP_RECV_QUEUE_SIZE (1 << 20)
+
+static pthread_t g_recv_thread;
+static pthread_mutex_t g_recv_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_recv_space = PTHREAD_COND_INITIALIZER;
+static RD_BOOL g_recv_running = False;
+static uint8 *g_recv_queue = NULL;
+static uint32 g_recv_start, g_recv_end;	/* free running, wrapped on access */
+static int g_recv_wake[2] = { -1, -1 };	/* thread -> main thread */
+static int g_recv_ctl[2] = { -1, -1 };	/* main thread -> thread */
+static RD_BOOL g_recv_signalled;	/* a byte is waiting in g_recv_wake */
+static RD_BOOL g_recv_stop;
+static RD_BOOL g_recv_writable;	/* the socket had room, for the main thread */
+static RD_BOOL g_recv_eof;	/* the thread is done, the queue is all there is */
+static RD_BOOL g_recv_error;	/* and it stopped on an error */
+
 /* wait till socket is ready to write or timeout */
 static RD_BOOL
-tcp_can_send(int sck, int millis)
+tcp_wait_send(int sck, int millis)
 {
 	fd_set wfds;
 	struct timeval time;
@@ -100,6 +209,41 @@ tcp_can_send(int sck, int millis)
 	return False;
 }
 
+/* Returns True if the socket can take more data, waiting at most
+   millis for it */
+RD_BOOL
+tcp_can_send(int millis)
+{
+	if (g_sock == -1 || g_network_error == True)
+		return False;
+
+	return tcp_wait_send(g_sock, millis);
+}
+
+/* Have the main loop wake up, with EVLOOP_WRITE set for the socket,
+   once it can take more data */
+void
+tcp_want_send(RD_BOOL want)
+{
+	if (g_sock == -1 || want == g_tcp_want_send)
+		return;
+
+	if (g_recv_running)
+	{
+		pthread_mutex_lock(&g_recv_lock);
+		g_tcp_want_send = want;
+		pthread_mutex_unlock(&g_recv_lock);
+
+		/* the receive thread polls the socket, have it look again */
+		if (write(g_recv_ctl[1], "w", 1) < 0)
+			logger(Core, Warning, "tcp_want_send(), failed to wake receive thread");
+		return;
+	}
+
+	g_tcp_want_send = want;
+	evloop_add_fd(g_sock, want ? EVLOOP_READ | EVLOOP_WRITE : EVLOOP_READ);
+}
+
 /* Initialise TCP transport data packet */
 STREAM
 tcp_init(uint32 maxlen)
@@ -107,6 +251,98 @@ tcp_init(uint32 maxlen)
 	return s_alloc(maxlen);
 }
 
+/* Acknowledge received data at once rather than delaying the ACK,
+   for interactive sessions. Linux turns quick ACKs off again on its
+   own, so this is repeated after every read. */
+static void
+tcp_quickack(void)
+{
+#ifdef TCP_QUICKACK
+	int value = 1;
+
+	if (g_tcp_profile == TCP_PROFILE_INTERACTIVE)
+		setsockopt(g_sock, IPPROTO_TCP, TCP_QUICKACK, (void *) &value, sizeof(value));
+#endif
+}
+
+/* Set the kernel's cork on the socket, where there is one */
+static void
+tcp_set_cork(int value)
+{
+#if defined(TCP_CORK)
+	setsockopt(g_sock, IPPROTO_TCP, TCP_CORK, (void *) &value, sizeof(value));
+#elif defined(TCP_NOPUSH)
+	setsockopt(g_sock, IPPROTO_TCP, TCP_NOPUSH, (void *) &value, sizeof(value));
+#else
+	UNUSED(value);
+#endif
+}
+
+/* Hold back what is sent until the matching tcp_uncork(), so that a
+   burst of small PDUs leaves in as few TCP segments, and TLS records,
+   as possible. Calls nest. */
+void
+tcp_cork(void)
+{
+	if (g_network_error == True || replay_is_active())
+		return;
+
+	/* the smart card thread sends too, the count goes with the
+	   socket state */
+#ifdef WITH_SCARD
+	scard_lock(SCARD_LOCK_TCP);
+#endif
+	if (g_tcp_corked++ == 0)
+	{
+		if (g_ssl_initialized)
+			gnutls_record_cork(g_tls_session);
+		else
+			tcp_set_cork(1);
+	}
+#ifdef WITH_SCARD
+	scard_unlock(SCARD_LOCK_TCP);
+#endif
+}
+
+/* Send everything held back since tcp_cork() */
+void
+tcp_uncork(void)
+{
+	int ret;
+
+#ifdef WITH_SCARD
+	scard_lock(SCARD_LOCK_TCP);
+#endif
+	if (g_tcp_corked == 0 || --g_tcp_corked > 0 || g_network_error == True)
+	{
+#ifdef WITH_SCARD
+		scard_unlock(SCARD_LOCK_TCP);
+#endif
+		return;
+	}
+
+	if (g_ssl_initialized)
+	{
+		while ((ret = gnutls_record_uncork(g_tls_session, 0)) < 0)
+		{
+			if (gnutls_error_is_fatal(ret))
+			{
+				logger(Core, Error,
+				       "tcp_uncork(), gnutls_record_uncork() failed with %d: %s",
+				       ret, gnutls_strerror(ret));
+				g_network_error = True;
+				break;
+			}
+			tcp_wait_send(g_sock, 100);
+		}
+	}
+	else
+		tcp_set_cork(0);
+#ifdef WITH_SCARD
+	scard_unlock(SCARD_LOCK_TCP);
+#endif
+}
+
 /* Send TCP transport data packet */
 void
 tcp_send(STREAM s)
@@ -118,6 +354,10 @@ tcp_send(STREAM s)
 	if (g_network_error == True)
 		return;
 
+	/* there is no server to answer when replaying a capture */
+	if (replay_is_active())
+		return;
+
 #ifdef WITH_SCARD
 	scard_lock(SCARD_LOCK_TCP);
 #endif
@@ -141,7 +381,7 @@ tcp_send(STREAM s)
 					g_network_error = True;
 					return;
 				} else {
-					tcp_can_send(g_sock, 100);
+					tcp_wait_send(g_sock, 100);
 					sent = 0;
 				}
 			}
@@ -153,7 +393,7 @@ tcp_send(STREAM s)
 			{
 				if (sent == -1 && TCP_BLOCKS)
 				{
-					tcp_can_send(g_sock, 100);
+					tcp_wait_send(g_sock, 100);
 					sent = 0;
 				}
 				else
@@ -177,13 +417,330 @@ tcp_send(STREAM s)
 #endif
 }
 
+/* Wake the main thread up, must be called with g_recv_lock held */
+static void
+tcp_recv_notify(void)
+{
+	if (g_recv_signalled)
+		return;
+
+	g_recv_signalled = True;
+	if (write(g_recv_wake[1], "r", 1) < 0)
+		logger(Core, Warning, "tcp_recv_notify(), failed to wake main thread");
+}
+
+static void
+tcp_drain_pipe(int fd)
+{
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0);
+}
+
+static void *
+tcp_recv_thread(void *arg)
+{
+	struct pollfd fds[2];
+	uint32 used, offset, room;
+	RD_BOOL want_write;
+	int rcvd;
+
+	UNUSED(arg);
+
+	while (1)
+	{
+		pthread_mutex_lock(&g_recv_lock);
+		while (!g_recv_stop && g_recv_end - g_recv_start == TCP_RECV_QUEUE_SIZE)
+			pthread_cond_wait(&g_recv_space, &g_recv_lock);
+		if (g_recv_stop)
+		{
+			pthread_mutex_unlock(&g_recv_lock);
+			break;
+		}
+		used = g_recv_end - g_recv_start;
+		offset = g_recv_end % TCP_RECV_QUEUE_SIZE;
+		room = MIN(TCP_RECV_QUEUE_SIZE - used, TCP_RECV_QUEUE_SIZE - offset);
+		want_write = g_tcp_want_send && !g_recv_writable;
+		pthread_mutex_unlock(&g_recv_lock);
+
+		if (!g_ssl_initialized || gnutls_record_check_pending(g_tls_session) <= 0)
+		{
+			fds[0].fd = g_sock;
+			fds[0].events = POLLIN | (want_write ? POLLOUT : 0);
+			fds[1].fd = g_recv_ctl[0];
+			fds[1].events = POLLIN;
+			if (poll(fds, 2, -1) < 0)
+				continue;
+
+			if (fds[1].revents & POLLIN)
+				tcp_drain_pipe(g_recv_ctl[0]);
+
+			if (fds[0].revents & POLLOUT)
+			{
+				pthread_mutex_lock(&g_recv_lock);
+				g_recv_writable = True;
+				tcp_recv_notify();
+				pthread_mutex_unlock(&g_recv_lock);
+			}
+
+			if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+		}
+
+		if (g_ssl_initialized)
+		{
+			rcvd = gnutls_record_recv(g_tls_session, g_recv_queue + offset, room);
+			if (rcvd < 0 && !gnutls_error_is_fatal(rcvd))
+				continue;
+			if (rcvd < 0)
+				logger(Core, Error,
+				       "tcp_recv_thread(), gnutls_record_recv() failed with %d: %s",
+				       rcvd, gnutls_strerror(rcvd));
+		}
+		else
+		{
+			rcvd = recv(g_sock, g_recv_queue + offset, room, 0);
+			if (rcvd < 0 && (TCP_BLOCKS || errno == EINTR))
+				continue;
+			if (rcvd < 0)
+				logger(Core, Error, "tcp_recv_thread(), recv() failed: %s",
+				       TCP_STRERROR);
+		}
+
+		pthread_mutex_lock(&g_recv_lock);
+		if (rcvd <= 0)
+		{
+			if (rcvd == 0 && !g_recv_stop)
+				logger(Core, Error, "tcp_recv_thread(), connection closed by peer");
+			g_recv_eof = True;
+			g_recv_error = rcvd < 0;
+			tcp_recv_notify();
+			pthread_mutex_unlock(&g_recv_lock);
+			break;
+		}
+		g_recv_end += rcvd;
+		tcp_recv_notify();
+		pthread_mutex_unlock(&g_recv_lock);
+
+		tcp_quickack();
+	}
+
+	return NULL;
+}
+
+static void
+tcp_recv_thread_stop(void)
+{
+	int i;
+
+	if (g_recv_running)
+	{
+		pthread_mutex_lock(&g_recv_lock);
+		g_recv_stop = True;
+		pthread_cond_signal(&g_recv_space);
+		pthread_mutex_unlock(&g_recv_lock);
+
+		/* gets it out of a read waiting for the rest of a TLS record */
+		shutdown(g_sock, SHUT_RD);
+		if (write(g_recv_ctl[1], "s", 1) < 0)
+			logger(Core, Warning, "tcp_recv_thread_stop(), failed to wake thread");
+		pthread_join(g_recv_thread, NULL);
+
+		evloop_remove_fd(g_recv_wake[0]);
+		g_recv_running = False;
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		if (g_recv_wake[i] != -1)
+			close(g_recv_wake[i]);
+		if (g_recv_ctl[i] != -1)
+			close(g_recv_ctl[i]);
+		g_recv_wake[i] = g_recv_ctl[i] = -1;
+	}
+	g_recv_start = g_recv_end = 0;
+}
+
+static RD_BOOL
+tcp_recv_thread_start(void)
+{
+	if (pipe(g_recv_wake) != 0 || pipe(g_recv_ctl) != 0)
+	{
+		logger(Core, Warning, "tcp_recv_thread_start(), pipe() failed: %s",
+		       strerror(errno));
+		tcp_recv_thread_stop();
+		return False;
+	}
+	fcntl(g_recv_wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(g_recv_ctl[0], F_SETFL, O_NONBLOCK);
+
+	if (g_recv_queue == NULL)
+		g_recv_queue = xmalloc(TCP_RECV_QUEUE_SIZE);
+	g_recv_start = g_recv_end = 0;
+	g_recv_signalled = g_recv_stop = g_recv_writable = False;
+	g_recv_eof = g_recv_error = False;
+
+	if (pthread_create(&g_recv_thread, NULL, tcp_recv_thread, NULL) != 0)
+	{
+		logger(Core, Warning, "tcp_recv_thread_start(), failed to create thread");
+		tcp_recv_thread_stop();
+		return False;
+	}
+
+	/* the main loop now waits for the queue instead of the socket */
+	evloop_remove_fd(g_sock);
+	evloop_add_fd(g_recv_wake[0], EVLOOP_READ);
+	g_recv_running = True;
+	return True;
+}
+
+/* tcp_recv_some() for when the receive thread is running */
+static int
+tcp_recv_queued(unsigned char *data, uint32 length)
+{
+	uint32 offset, chunk, done;
+
+	pthread_mutex_lock(&g_recv_lock);
+	while (1)
+	{
+		if (g_recv_writable)
+		{
+			/* the socket has room again for queued virtual
+			   channel chunks */
+			g_recv_writable = False;
+			pthread_mutex_unlock(&g_recv_lock);
+			channel_flush();
+			pthread_mutex_lock(&g_recv_lock);
+		}
+
+		if (g_recv_end != g_recv_start || g_recv_eof)
+			break;
+
+		pthread_mutex_unlock(&g_recv_lock);
+
+		ui_select(g_recv_wake[0]);
+		if (g_exit_mainloop == True)
+			return -1;
+
+		pthread_mutex_lock(&g_recv_lock);
+		tcp_drain_pipe(g_recv_wake[0]);
+		g_recv_signalled = False;
+	}
+
+	if (g_recv_end == g_recv_start)
+	{
+		if (g_recv_error)
+			g_network_error = True;
+		pthread_mutex_unlock(&g_recv_lock);
+		return -1;
+	}
+
+	done = 0;
+	length = MIN(length, g_recv_end - g_recv_start);
+	while (done < length)
+	{
+		offset = g_recv_start % TCP_RECV_QUEUE_SIZE;
+		chunk = MIN(length - done, TCP_RECV_QUEUE_SIZE - offset);
+		memcpy(data + done, g_recv_queue + offset, chunk);
+		g_recv_start += chunk;
+		done += chunk;
+	}
+	pthread_cond_signal(&g_recv_space);
+	pthread_mutex_unlock(&g_recv_lock);
+
+	return done;
+}
+
+/* Bytes received from the server that have not been processed yet */
+uint32
+tcp_backlog(void)
+{
+	uint32 queued = 0;
+
+	if (g_recv_running)
+	{
+		pthread_mutex_lock(&g_recv_lock);
+		queued = g_recv_end - g_recv_start;
+		pthread_mutex_unlock(&g_recv_lock);
+	}
+
+	return queued + (g_rbuf_end - g_rbuf_start);
+}
+
+/* Read whatever is available from the connection, at most length
+   bytes, waiting for the socket in ui_select() first if nothing is
+   buffered. Returns the number of bytes read, which may be 0, or -1
+   on errors and when the connection is gone. */
+static int
+tcp_recv_some(unsigned char *data, uint32 length)
+{
+	int rcvd;
+
+	if (g_recv_running)
+		return tcp_recv_queued(data, length);
+
+	if ((!g_ssl_initialized || (gnutls_record_check_pending(g_tls_session) <= 0)) && g_run_ui)
+	{
+		ui_select(g_sock);
+
+		/* break out of recv, if request of exiting
+		   main loop has been done */
+		if (g_exit_mainloop == True)
+			return -1;
+	}
+
+	if (g_ssl_initialized) {
+		rcvd = gnutls_record_recv(g_tls_session, data, length);
+
+		if (rcvd < 0) {
+			if (gnutls_error_is_fatal(rcvd)) {
+				logger(Core, Error, "tcp_recv(), gnutls_record_recv() failed with %d: %s\n", rcvd, gnutls_strerror(rcvd));
+				g_network_error = True;
+				return -1;
+			} else {
+				rcvd = 0;
+			}
+		}
+
+	}
+	else
+	{
+		rcvd = recv(g_sock, data, length, 0);
+		if (rcvd < 0)
+		{
+			if (rcvd == -1 && TCP_BLOCKS)
+			{
+				rcvd = 0;
+			}
+			else
+			{
+				logger(Core, Error, "tcp_recv(), recv() failed: %s",
+						TCP_STRERROR);
+				g_network_error = True;
+				return -1;
+			}
+		}
+		else if (rcvd == 0)
+		{
+			logger(Core, Error, "rcp_recv(), connection closed by peer");
+			return -1;
+		}
+	}
+
+	if (rcvd > 0)
+		tcp_quickack();
+	return rcvd;
+}
+
 /* Receive a message on the TCP layer */
 STREAM
 tcp_recv(STREAM s, uint32 length)
 {
 	size_t before;
 	unsigned char *data;
+	uint32 chunk;
 	int rcvd = 0;
+	TRACE_SCOPE(TRACE_TCP_RECV);
 
 	if (g_network_error == True)
 		return NULL;
@@ -203,65 +760,46 @@ tcp_recv(STREAM s, uint32 length)
 
 	while (length > 0)
 	{
-
-		if ((!g_ssl_initialized || (gnutls_record_check_pending(g_tls_session) <= 0)) && g_run_ui)
-		{
-			ui_select(g_sock);
-
-			/* break out of recv, if request of exiting
-			   main loop has been done */
-			if (g_exit_mainloop == True)
-				return NULL;
-		}
-
 		before = s_tell(s);
 		s_seek(s, s_length(s));
 
-		out_uint8p(s, data, length);
-
-		s_seek(s, before);
-
-		if (g_ssl_initialized) {
-			rcvd = gnutls_record_recv(g_tls_session, data, length);
+		if (g_rbuf_start == g_rbuf_end)
+		{
+			/* Large reads go straight into the stream, everything
+			   else fills the read-ahead buffer with as much as the
+			   socket has, so that the following headers and PDUs
+			   need no syscall of their own. */
+			if (length >= sizeof(g_rbuf) ||
+			    (g_tls_ktls_recv && length >= TCP_KTLS_DIRECT_READ))
+			{
+				out_uint8p(s, data, length);
+				s_seek(s, before);
 
-			if (rcvd < 0) {
-				if (gnutls_error_is_fatal(rcvd)) {
-					logger(Core, Error, "tcp_recv(), gnutls_record_recv() failed with %d: %s\n", rcvd, gnutls_strerror(rcvd));
-					g_network_error = True;
+				rcvd = tcp_recv_some(data, length);
+				if (rcvd < 0)
 					return NULL;
-				} else {
-					rcvd = 0;
-				}
+
+				// FIXME: Should probably have a macro for this
+				s->end += rcvd;
+				length -= rcvd;
+				continue;
 			}
 
-		}
-		else
-		{
-			rcvd = recv(g_sock, data, length, 0);
+			rcvd = tcp_recv_some(g_rbuf, sizeof(g_rbuf));
 			if (rcvd < 0)
-			{
-				if (rcvd == -1 && TCP_BLOCKS)
-				{
-					rcvd = 0;
-				}
-				else
-				{
-					logger(Core, Error, "tcp_recv(), recv() failed: %s",
-							TCP_STRERROR);
-					g_network_error = True;
-					return NULL;
-				}
-			}
-			else if (rcvd == 0)
-			{
-				logger(Core, Error, "rcp_recv(), connection closed by peer");
 				return NULL;
-			}
+
+			g_rbuf_start = 0;
+			g_rbuf_end = rcvd;
 		}
 
-		// FIXME: Should probably have a macro for this
-		s->end += rcvd;
-		length -= rcvd;
+		chunk = MIN(length, g_rbuf_end - g_rbuf_start);
+		out_uint8a(s, g_rbuf + g_rbuf_start, chunk);
+		s_seek(s, before);
+
+		g_rbuf_start += chunk;
+		s->end += chunk;
+		length -= chunk;
 	}
 
 	return s;
@@ -341,14 +879,95 @@ gnutls_fatal(const char *text, int status)
 	exit(1);
 }
 
+static TCP_TLS_SESSION *
+tcp_tls_find_session(void)
+{
+	int i;
+
+	if (g_last_server_name == NULL)
+		return NULL;
+
+	for (i = 0; i < TCP_TLS_SESSION_CACHE_SIZE; i++)
+	{
+		if (g_tls_sessions[i].name != NULL &&
+		    strcmp(g_tls_sessions[i].name, g_last_server_name) == 0 &&
+		    g_tls_sessions[i].port == g_tcp_port_rdp)
+			return &g_tls_sessions[i];
+	}
+	return NULL;
+}
+
+/* Keep what is needed to resume the TLS session of the connection */
+static void
+tcp_tls_save_session(void)
+{
+	TCP_TLS_SESSION *ts;
+	gnutls_datum_t data;
+
+	if (g_last_server_name == NULL)
+		return;
+
+	/* TLS 1.3 can only be resumed with a ticket from the server */
+	if (gnutls_protocol_get_version(g_tls_session) == GNUTLS_TLS1_3 &&
+	    !(gnutls_session_get_flags(g_tls_session) & GNUTLS_SFLAGS_SESSION_TICKET))
+		return;
+
+	if (gnutls_session_get_data2(g_tls_session, &data) < 0)
+		return;
+
+	ts = tcp_tls_find_session();
+	if (ts == NULL)
+	{
+		ts = &g_tls_sessions[g_tls_sessions_next];
+		g_tls_sessions_next = (g_tls_sessions_next + 1) % TCP_TLS_SESSION_CACHE_SIZE;
+		xfree(ts->name);
+		ts->name = xstrdup(g_last_server_name);
+		ts->port = g_tcp_port_rdp;
+	}
+	gnutls_free(ts->data.data);
+	ts->data = data;
+}
+
+/* Load the TLS library and the system trust database, unless that has
+   been done already. Parsing the trust database is the costly part of
+   setting up TLS, and the result is only ever read. */
+void
+tcp_tls_preload(void)
+{
+	int err;
+
+	if (g_tls_cred != NULL)
+		return;
+
+	gnutls_global_init();
+	err = gnutls_certificate_allocate_credentials(&g_tls_cred);
+	if (err < 0) {
+		gnutls_fatal("Could not allocate TLS certificate structure", err);
+	}
+	err = gnutls_certificate_set_x509_system_trust(g_tls_cred);
+	if (err < 0) {
+		logger(Core, Error, "%s(), Could not load system trust database: %s",
+			   __func__, gnutls_strerror(err));
+	}
+	gnutls_certificate_set_verify_function(g_tls_cred, cert_verify_callback);
+}
+
 /* Establish a SSL/TLS 1.0 connection */
 RD_BOOL
 tcp_tls_connect(void)
 {
 	int err;
 	const char* priority;
+	TCP_TLS_SESSION *ts;
 
-	gnutls_certificate_credentials_t xcred;
+	/* The server does not send anything before our ClientHello, so
+	   nothing read ahead in the clear can belong to TLS */
+	if (g_rbuf_start != g_rbuf_end)
+	{
+		logger(Core, Warning, "tcp_tls_connect(), discarding %d unexpected bytes",
+		       g_rbuf_end - g_rbuf_start);
+		g_rbuf_start = g_rbuf_end = 0;
+	}
 
 	/* Initialize TLS session */
 	if (!g_ssl_initialized)
@@ -386,23 +1005,18 @@ tcp_tls_connect(void)
 		gnutls_fatal("Could not set GnuTLS priority setting", err);
 	}
 
-	err = gnutls_certificate_allocate_credentials(&xcred);
-	if (err < 0) {
-		gnutls_fatal("Could not allocate TLS certificate structure", err);
-	}
-	err = gnutls_credentials_set(g_tls_session, GNUTLS_CRD_CERTIFICATE, xcred);
+	tcp_tls_preload();
+	err = gnutls_credentials_set(g_tls_session, GNUTLS_CRD_CERTIFICATE, g_tls_cred);
 	if (err < 0) {
 		gnutls_fatal("Could not set TLS certificate structure", err);
 	}
-	err = gnutls_certificate_set_x509_system_trust(xcred);
-	if (err < 0) {
-		logger(Core, Error, "%s(), Could not load system trust database: %s",
-			   __func__, gnutls_strerror(err));
-	}
-	gnutls_certificate_set_verify_function(xcred, cert_verify_callback);
 	gnutls_transport_set_int(g_tls_session, g_sock);
 	gnutls_handshake_set_timeout(g_tls_session, GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
 
+	ts = tcp_tls_find_session();
+	if (ts != NULL)
+		gnutls_session_set_data(g_tls_session, ts->data.data, ts->data.size);
+
 	/* Perform the TLS handshake */
 	do {
 		err = gnutls_handshake(g_tls_session);
@@ -429,6 +1043,21 @@ tcp_tls_connect(void)
 		gnutls_free(desc);
 	}
 
+	if (gnutls_session_is_resumed(g_tls_session))
+		logger(Core, Verbose, "TLS session resumed");
+
+	/* The kernel takes over the record layer when GnuTLS is set up
+	   for it, see ktls in gnutls config(5) */
+	g_tls_ktls_recv = False;
+#if GNUTLS_VERSION_NUMBER >= 0x030703
+	if (gnutls_transport_is_ktls_enabled(g_tls_session) & GNUTLS_KTLS_RECV)
+	{
+		logger(Core, Verbose, "TLS records are decrypted by the kernel");
+		g_tls_ktls_recv = True;
+	}
+#endif
+
+	rdp_connect_phase(CONNECT_PHASE_TLS);
 	return True;
 
 fail:
@@ -528,6 +1157,235 @@ out:
 	return s;
 }
 
+#ifdef IPv6
+static void
+tcp_set_blocking(int sck, RD_BOOL blocking)
+{
+#ifdef _WIN32
+	u_long arg = !blocking;
+	ioctlsocket(sck, FIONBIO, &arg);
+#else
+	int flags = fcntl(sck, F_GETFL);
+
+	fcntl(sck, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+#endif
+}
+
+/* Look up server, or take the addresses of an earlier lookup */
+static struct addrinfo *
+tcp_resolve(const char *server)
+{
+	TCP_DNS_ENTRY *e, *slot = NULL;
+	struct addrinfo hints, *res;
+	char port[10];
+	time_t now = time(NULL);
+	int i, n;
+
+	for (i = 0; i < TCP_DNS_CACHE_SIZE; i++)
+	{
+		e = &g_dns_cache[i];
+		if (e->name == NULL || strcmp(e->name, server) != 0 || e->port != g_tcp_port_rdp)
+		{
+			if (slot == NULL || e->name == NULL ||
+			    (slot->name != NULL && e->resolved < slot->resolved))
+				slot = e;
+			continue;
+		}
+
+		if (now - e->resolved < TCP_DNS_CACHE_TTL)
+		{
+			logger(Core, Debug, "tcp_resolve(), using cached addresses of %s", server);
+			return e->addrs;
+		}
+		slot = e;
+		break;
+	}
+
+	snprintf(port, sizeof(port), "%d", g_tcp_port_rdp);
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((n = getaddrinfo(server, port, &hints, &res)))
+	{
+		logger(Core, Error, "tcp_connect(), getaddrinfo() failed: %s", gai_strerror(n));
+		return NULL;
+	}
+
+	if (slot->name != NULL)
+	{
+		xfree(slot->name);
+		freeaddrinfo(slot->addrs);
+	}
+	slot->name = xstrdup(server);
+	slot->port = g_tcp_port_rdp;
+	slot->addrs = res;
+	slot->resolved = now;
+	return res;
+}
+
+static void
+tcp_resolve_forget(const char *server)
+{
+	TCP_DNS_ENTRY *e;
+	int i;
+
+	for (i = 0; i < TCP_DNS_CACHE_SIZE; i++)
+	{
+		e = &g_dns_cache[i];
+		if (e->name == NULL || strcmp(e->name, server) != 0)
+			continue;
+
+		xfree(e->name);
+		freeaddrinfo(e->addrs);
+		e->name = NULL;
+		e->addrs = NULL;
+	}
+}
+
+/* The first of addr and the addresses after it that is, or is not, of
+   the given family */
+static struct addrinfo *
+tcp_next_family(struct addrinfo *addr, int family, RD_BOOL same)
+{
+	while (addr != NULL && (addr->ai_family == family) != same)
+		addr = addr->ai_next;
+	return addr;
+}
+
+/* Start a non-blocking connect to addr, returning the socket or -1 */
+static int
+tcp_connect_start(struct addrinfo *addr, const char *server)
+{
+	char buf[NI_MAXHOST];
+	int sck;
+
+	sck = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+	if (sck < 0)
+	{
+		logger(Core, Debug, "tcp_connect(), socket() failed: %s", TCP_STRERROR);
+		return -1;
+	}
+
+	if (getnameinfo(addr->ai_addr, addr->ai_addrlen, buf, sizeof(buf), NULL, 0,
+			NI_NUMERICHOST) != 0)
+		STRNCPY(buf, "?", sizeof(buf));
+	logger(Core, Debug, "tcp_connect(), trying %s (%s)", server, buf);
+
+	tcp_set_blocking(sck, False);
+	if (connect(sck, addr->ai_addr, addr->ai_addrlen) != 0 && !TCP_INPROGRESS)
+	{
+		logger(Core, Debug, "tcp_connect(), connect() to %s failed: %s", buf,
+		       TCP_STRERROR);
+		TCP_CLOSE(sck);
+		return -1;
+	}
+
+	return sck;
+}
+
+/* Connect to the first of res that answers, Happy Eyeballs style.
+   Returns the connected, blocking, socket and the address in winner,
+   or -1. */
+static int
+tcp_connect_addrs(struct addrinfo *res, const char *server, struct addrinfo **winner)
+{
+	struct addrinfo *addrs[TCP_MAX_ATTEMPTS], *first, *other;
+	int socks[TCP_MAX_ATTEMPTS];
+	int count, next, pending, i, n, maxfd, sck, err;
+	socklen_t len;
+	fd_set wfds;
+	struct timeval tv;
+
+	/* alternate between the families, starting with the one
+	   getaddrinfo() prefers */
+	count = 0;
+	first = res;
+	other = tcp_next_family(res, res->ai_family, False);
+	while ((first != NULL || other != NULL) && count < TCP_MAX_ATTEMPTS)
+	{
+		if (first != NULL)
+		{
+			addrs[count++] = first;
+			first = tcp_next_family(first->ai_next, res->ai_family, True);
+		}
+		if (other != NULL && count < TCP_MAX_ATTEMPTS)
+		{
+			addrs[count++] = other;
+			other = tcp_next_family(other->ai_next, res->ai_family, False);
+		}
+	}
+
+	sck = -1;
+	next = pending = 0;
+	while (sck == -1 && (next < count || pending > 0))
+	{
+		if (next < count)
+		{
+			socks[next] = tcp_connect_start(addrs[next], server);
+			if (socks[next++] == -1)
+				continue;
+			pending++;
+		}
+
+		FD_ZERO(&wfds);
+		maxfd = -1;
+		for (i = 0; i < next; i++)
+		{
+			if (socks[i] == -1)
+				continue;
+			FD_SET(socks[i], &wfds);
+			maxfd = MAX(maxfd, socks[i]);
+		}
+
+		/* the last attempt waits for as long as the kernel does */
+		tv.tv_sec = g_tcp_connect_delay / 1000;
+		tv.tv_usec = (g_tcp_connect_delay % 1000) * 1000;
+		n = select(maxfd + 1, NULL, &wfds, NULL, next < count ? &tv : NULL);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			logger(Core, Error, "tcp_connect(), select() failed: %s", TCP_STRERROR);
+			break;
+		}
+
+		for (i = 0; i < next && n > 0; i++)
+		{
+			if (socks[i] == -1 || !FD_ISSET(socks[i], &wfds))
+				continue;
+
+			err = 0;
+			len = sizeof(err);
+			getsockopt(socks[i], SOL_SOCKET, SO_ERROR, (void *) &err, &len);
+			if (err == 0)
+			{
+				sck = socks[i];
+				socks[i] = -1;
+				*winner = addrs[i];
+				break;
+			}
+
+			logger(Core, Debug, "tcp_connect(), attempt %d failed: %s", i, strerror(err));
+			TCP_CLOSE(socks[i]);
+			socks[i] = -1;
+			pending--;
+		}
+	}
+
+	for (i = 0; i < next; i++)
+	{
+		if (socks[i] != -1)
+			TCP_CLOSE(socks[i]);
+	}
+
+	if (sck != -1)
+		tcp_set_blocking(sck, True);
+	return sck;
+}
+#endif /* IPv6 */
+
 /* Helper function to determine if rdesktop should resolve hostnames again or not */
 static RD_BOOL
 tcp_connect_resolve_hostname(const char *server)
@@ -536,6 +1394,167 @@ tcp_connect_resolve_hostname(const char *server)
 		g_last_server_name == NULL || strcmp(g_last_server_name, server) != 0);
 }
 
+#if defined(__linux__)
+/* The n-th number in a file under /proc/sys/net, 0 if there is none */
+static int
+tcp_read_sysctl(const char *name, int n)
+{
+	char path[64];
+	FILE *fp;
+	int value = 0;
+
+	snprintf(path, sizeof(path), "/proc/sys/net/%s", name);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return 0;
+	while (n-- >= 0)
+		if (fscanf(fp, "%d", &value) != 1)
+		{
+			value = 0;
+			break;
+		}
+	fclose(fp);
+	return value;
+}
+#endif
+
+/* The size the kernel grows the receive buffer of a connection to by
+   itself, 0 if it does not. Setting SO_RCVBUF turns that off. */
+static int
+tcp_autotune_limit(void)
+{
+#if defined(__linux__)
+	if (!tcp_read_sysctl("ipv4/tcp_moderate_rcvbuf", 0))
+		return 0;
+	return tcp_read_sysctl("ipv4/tcp_rmem", 2);
+#else
+	return 0;
+#endif
+}
+
+/* The largest receive buffer SO_RCVBUF can ask for */
+static int
+tcp_rcvbuf_limit(int size)
+{
+#if defined(__linux__)
+	int max = tcp_read_sysctl("core/rmem_max", 0);
+
+	if (max > 0)
+		return MIN(size, max);
+#endif
+	return size;
+}
+
+/* The receive buffer size that can be used, Linux reports twice what
+   was asked for to cover its bookkeeping */
+static int
+tcp_get_rcvbuf(void)
+{
+	int value;
+	socklen_t len = sizeof(value);
+
+	if (getsockopt(g_sock, SOL_SOCKET, SO_RCVBUF, (void *) &value, &len) != 0)
+		return 0;
+#if defined(__linux__)
+	value /= 2;
+#endif
+	return value;
+}
+
+/* Make the receive buffer at least size bytes, unless the kernel
+   will grow it that far by itself */
+static void
+tcp_grow_rcvbuf(int size)
+{
+	int value, limit;
+
+	/* setting it would only lower the ceiling */
+	limit = tcp_autotune_limit();
+	if (limit >= tcp_rcvbuf_limit(size))
+	{
+		logger(Core, Debug, "tcp_grow_rcvbuf(), left to the kernel, up to %d bytes", limit);
+		return;
+	}
+
+	if (tcp_get_rcvbuf() >= size)
+		return;
+
+	value = size;
+	setsockopt(g_sock, SOL_SOCKET, SO_RCVBUF, (void *) &value, sizeof(value));
+	logger(Core, Debug, "tcp_grow_rcvbuf(), asked for %d bytes, got %d", size,
+	       tcp_get_rcvbuf());
+}
+
+/* Set the socket options of the profile on a new connection */
+static void
+tcp_apply_profile(void)
+{
+	int value;
+
+	value = g_tcp_profile != TCP_PROFILE_BULK;
+	setsockopt(g_sock, IPPROTO_TCP, TCP_NODELAY, (void *) &value, sizeof(value));
+
+	if (g_tcp_profile == TCP_PROFILE_DEFAULT)
+	{
+		tcp_grow_rcvbuf(TCP_RCVBUF_MIN);
+		return;
+	}
+
+	/* until auto-detection has measured the link */
+	tcp_grow_rcvbuf(TCP_RCVBUF_PROFILE_MIN);
+
+	value = 1;
+	setsockopt(g_sock, SOL_SOCKET, SO_KEEPALIVE, (void *) &value, sizeof(value));
+	if (g_tcp_profile != TCP_PROFILE_INTERACTIVE)
+		return;
+
+#ifdef TCP_KEEPIDLE
+	value = TCP_KEEPALIVE_IDLE;
+	setsockopt(g_sock, IPPROTO_TCP, TCP_KEEPIDLE, (void *) &value, sizeof(value));
+	value = TCP_KEEPALIVE_INTERVAL;
+	setsockopt(g_sock, IPPROTO_TCP, TCP_KEEPINTVL, (void *) &value, sizeof(value));
+	value = TCP_KEEPALIVE_COUNT;
+	setsockopt(g_sock, IPPROTO_TCP, TCP_KEEPCNT, (void *) &value, sizeof(value));
+#endif
+	tcp_quickack();
+}
+
+/* Select the socket options profile by name, for -o tcp= */
+RD_BOOL
+tcp_set_profile(const char *name)
+{
+	if (strcmp(name, "default") == 0)
+		g_tcp_profile = TCP_PROFILE_DEFAULT;
+	else if (strcmp(name, "interactive") == 0)
+		g_tcp_profile = TCP_PROFILE_INTERACTIVE;
+	else if (strcmp(name, "bulk") == 0)
+		g_tcp_profile = TCP_PROFILE_BULK;
+	else
+		return False;
+	return True;
+}
+
+/* Size the receive buffer for the link auto-detection has measured,
+   twice its bandwidth-delay product so that a window's worth can be
+   in flight while the previous one is read */
+void
+tcp_tune_buffers(uint32 rtt, uint32 bandwidth)
+{
+	uint64 size;
+
+	if (g_sock == -1 || g_tcp_profile == TCP_PROFILE_DEFAULT || rtt == 0 || bandwidth == 0)
+		return;
+
+	/* kbit/s * ms / 8 is bytes */
+	size = (uint64) bandwidth * rtt / 8 * 2;
+	size = MAX(size, TCP_RCVBUF_PROFILE_MIN);
+	size = MIN(size, TCP_RCVBUF_MAX);
+
+	logger(Core, Debug, "tcp_tune_buffers(), %u ms, %u kbit/s, receive buffer %u bytes",
+	       rtt, bandwidth, (unsigned int) size);
+	tcp_grow_rcvbuf(size);
+}
+
 /* Establish a connection on the TCP layer
 
    This function tries to avoid resolving any server address twice. The
@@ -549,69 +1568,33 @@ tcp_connect_resolve_hostname(const char *server)
 RD_BOOL
 tcp_connect(char *server)
 {
-	socklen_t option_len;
-	uint32 option_value;
-	char buf[NI_MAXHOST];
 
 #ifdef IPv6
 
-	int n;
-	struct addrinfo hints, *res, *addr;
+	struct addrinfo *res, *addr;
 	struct sockaddr *oldaddr;
-	char tcp_port_rdp_s[10];
+	RD_BOOL resolved;
 
-	if (tcp_connect_resolve_hostname(server))
+	resolved = tcp_connect_resolve_hostname(server);
+	if (resolved)
 	{
-		snprintf(tcp_port_rdp_s, 10, "%d", g_tcp_port_rdp);
-
-		memset(&hints, 0, sizeof(struct addrinfo));
-		hints.ai_family = AF_UNSPEC;
-		hints.ai_socktype = SOCK_STREAM;
-
-		if ((n = getaddrinfo(server, tcp_port_rdp_s, &hints, &res)))
-		{
-			logger(Core, Error, "tcp_connect(), getaddrinfo() failed: %s",
-			       gai_strerror(n));
+		res = tcp_resolve(server);
+		if (res == NULL)
 			return False;
-		}
 	}
+	rdp_connect_phase(CONNECT_PHASE_DNS);
 	else
 	{
 		res = g_server_address;
 	}
 
-	g_sock = -1;
-
-	for (addr = res; addr != NULL; addr = addr->ai_next)
-	{
-		g_sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
-		if (g_sock < 0)
-		{
-			logger(Core, Debug, "tcp_connect(), socket() failed: %s", TCP_STRERROR);
-			continue;
-		}
-
-		n = getnameinfo(addr->ai_addr, addr->ai_addrlen, buf, sizeof(buf), NULL, 0,
-				NI_NUMERICHOST);
-		if (n != 0)
-		{
-			logger(Core, Error, "tcp_connect(), getnameinfo() failed: %s",
-			       gai_strerror(n));
-			return False;
-		}
-
-		logger(Core, Debug, "tcp_connect(), trying %s (%s)", server, buf);
-
-		if (connect(g_sock, addr->ai_addr, addr->ai_addrlen) == 0)
-			break;
-
-		TCP_CLOSE(g_sock);
-		g_sock = -1;
-	}
-
+	g_sock = tcp_connect_addrs(res, server, &addr);
 	if (g_sock == -1)
 	{
 		logger(Core, Error, "tcp_connect(), unable to connect to %s", server);
+		/* the name may have moved on, so look it up again next time */
+		if (resolved)
+			tcp_resolve_forget(server);
 		return False;
 	}
 
@@ -634,11 +1617,10 @@ tcp_connect(char *server)
 
 		g_server_address->ai_canonname = NULL;
 		g_server_address->ai_next = NULL;
-
-		freeaddrinfo(res);
 	}
 
 #else /* no IPv6 support */
+	char buf[NI_MAXHOST];
 	struct hostent *nslookup = NULL;
 
 	if (tcp_connect_resolve_hostname(server))
@@ -660,6 +1642,7 @@ tcp_connect(char *server)
 			return False;
 		}
 	}
+	rdp_connect_phase(CONNECT_PHASE_DNS);
 
 	if ((g_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
 	{
@@ -683,23 +1666,14 @@ tcp_connect(char *server)
 
 #endif /* IPv6 */
 
-	option_value = 1;
-	option_len = sizeof(option_value);
-	setsockopt(g_sock, IPPROTO_TCP, TCP_NODELAY, (void *) &option_value, option_len);
-	/* receive buffer must be a least 16 K */
-	if (getsockopt(g_sock, SOL_SOCKET, SO_RCVBUF, (void *) &option_value, &option_len) == 0)
-	{
-		if (option_value < (1024 * 16))
-		{
-			option_value = 1024 * 16;
-			option_len = sizeof(option_value);
-			setsockopt(g_sock, SOL_SOCKET, SO_RCVBUF, (void *) &option_value,
-				   option_len);
-		}
-	}
+	tcp_apply_profile();
 
-	g_in.size = 4096;
+	g_in.size = g_in.capacity = 4096;
 	g_in.data = (uint8 *) xmalloc(g_in.size);
+	g_rbuf_start = g_rbuf_end = 0;
+
+	evloop_add_fd(g_sock, EVLOOP_READ);
+	rdp_connect_phase(CONNECT_PHASE_TCP);
 
 	/* After successful connect: update the last server name */
 	if (g_last_server_name)
@@ -712,7 +1686,10 @@ tcp_connect(char *server)
 void
 tcp_disconnect(void)
 {
+	tcp_recv_thread_stop();
+
 	if (g_ssl_initialized) {
+		tcp_tls_save_session();
 		(void)gnutls_bye(g_tls_session, GNUTLS_SHUT_WR);
 		gnutls_deinit(g_tls_session);
 		// Not needed since 3.3.0
@@ -721,12 +1698,17 @@ tcp_disconnect(void)
 		g_ssl_initialized = False;
 	}
 
+	evloop_remove_fd(g_sock);
 	TCP_CLOSE(g_sock);
 	g_sock = -1;
+	g_tcp_corked = 0;
+	g_tcp_want_send = False;
+	g_tls_ktls_recv = False;
 
-	g_in.size = 0;
+	g_in.size = g_in.capacity = 0;
 	xfree(g_in.data);
 	g_in.data = NULL;
+	g_rbuf_start = g_rbuf_end = 0;
 }
 
 char *
@@ -762,10 +1744,15 @@ tcp_reset_state(void)
 {
 	/* Clear the incoming stream */
 	s_reset(&g_in);
+	g_rbuf_start = g_rbuf_end = 0;
 }
 
 void
 tcp_run_ui(RD_BOOL run)
 {
 	g_run_ui = run;
+
+	/* stopped by tcp_disconnect(), nothing is read in between */
+	if (run && g_sock != -1 && !g_recv_running && !replay_is_active())
+		tcp_recv_thread_start();
 }
@@ -0,0 +1,26 @@
+#include <cgreen/mocks.h>
+#include "../rdesktop.h"
+
+uint32
+autodetect_performance_flags(uint32 flags)
+{
+  return mock(flags);
+}
+
+void
+autodetect_process(STREAM s)
+{
+  mock(s);
+}
+
+void
+autodetect_received(uint32 bytes)
+{
+  mock(bytes);
+}
+
+uint32
+autodetect_bandwidth(void)
+{
+  return mock();
+}
@@ -0,0 +1,173 @@
+/* Every benchmark is a single translation unit that includes the
+   module under test, so these helpers are all static. */
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Minimum measuring time for one benchmark, in nanoseconds */
+#define BENCH_MIN_TIME 250000000ULL
+
+typedef void (*bench_fn) (void *ctx);
+
+static unsigned long long
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Deterministic generator so every run sees the same corpus */
+static unsigned int bench_seed = 0x2545f491;
+
+static unsigned int
+bench_rand(void)
+{
+	bench_seed ^= bench_seed << 13;
+	bench_seed ^= bench_seed >> 17;
+	bench_seed ^= bench_seed << 5;
+	return bench_seed;
+}
+
+/* Random integer in [lo, hi] */
+static int
+bench_range(int lo, int hi)
+{
+	return lo + (int) (bench_rand() % (unsigned int) (hi - lo + 1));
+}
+
+static void
+bench_fail(const char *name, const char *what)
+{
+	fprintf(stderr, "%s: %s\n", name, what);
+	exit(EXIT_FAILURE);
+}
+
+/* Only run the benchmarks named on the command line, if any */
+static int bench_argc;
+static char **bench_argv;
+
+static int
+bench_selected(const char *name)
+{
+	int i;
+
+	if (bench_argc < 2)
+		return 1;
+
+	for (i = 1; i < bench_argc; i++)
+		if (strstr(name, bench_argv[i]) != NULL)
+			return 1;
+
+	return 0;
+}
+
+/* Run fn until BENCH_MIN_TIME has passed and report the cost of
+   each of the 'ops' operations one call does, plus the throughput if
+   every call handles 'bytes' bytes */
+static void
+bench_run(const char *name, bench_fn fn, void *ctx, unsigned int ops, size_t bytes)
+{
+	unsigned long long start, elapsed, iterations, i;
+	double ns;
+
+	if (!bench_selected(name))
+		return;
+
+	/* warm up caches and lazily initialised state */
+	fn(ctx);
+
+	iterations = 1;
+	while (1)
+	{
+		start = bench_now();
+		for (i = 0; i < iterations; i++)
+			fn(ctx);
+		elapsed = bench_now() - start;
+
+		if (elapsed >= BENCH_MIN_TIME)
+			break;
+
+		iterations *= 2;
+	}
+
+	ns = (double) elapsed / (double) iterations;
+	if (bytes != 0)
+		printf("%-36s %12.1f ns/op %10.1f MB/s\n", name, ns / ops,
+		       (double) bytes * 1000.0 / ns);
+	else
+		printf("%-36s %12.1f ns/op\n", name, ns / ops);
+	fflush(stdout);
+}
+
+static void
+bench_init(int argc, char **argv)
+{
+	bench_argc = argc;
+	bench_argv = argv;
+}
+
+/* The few rdesktop core helpers the codecs call. Logging is a no-op
+   so that debug messages on the hot paths cost only the call. */
+#ifndef BENCH_NO_GLUE
+
+void *
+xmalloc(int size)
+{
+	void *mem = malloc(size);
+	if (mem == NULL)
+		bench_fail("xmalloc", "out of memory");
+	return mem;
+}
+
+void *
+xrealloc(void *oldmem, size_t size)
+{
+	void *mem = realloc(oldmem, size ? size : 1);
+	if (mem == NULL)
+		bench_fail("xrealloc", "out of memory");
+	return mem;
+}
+
+void
+xfree(void *mem)
+{
+	free(mem);
+}
+
+void
+exit_if_null(void *ptr)
+{
+	if (ptr == NULL)
+		bench_fail("exit_if_null", "unexpected null pointer");
+}
+
+/* nothing is logged while benchmarking */
+log_level_t g_logger_level = Error;
+int g_logger_subjects = 0;
+
+void
+(logger) (log_subject_t c, log_level_t lvl, char *format, ...)
+{
+	(void) c;
+	(void) lvl;
+	(void) format;
+}
+
+void
+_rdp_protocol_error(const char *file, int line, const char *func, const char *message, STREAM s)
+{
+	(void) s;
+	fprintf(stderr, "%s:%d: %s(), %s\n", file, line, func, message);
+	exit(EXIT_FAILURE);
+}
+
+#endif /* BENCH_NO_GLUE */
+
+#endif /* _BENCH_H */
@@ -0,0 +1,291 @@
+#include "../rdesktop.h"
+#include "../proto.h"
+#include "bench.h"
+
+RD_BOOL g_bitmap_alpha = True;
+
+#include "../bitmap.c"
+
+/* Tiles per corpus, of the size servers normally send */
+#define TILES		64
+#define TILE_WIDTH	64
+#define TILE_HEIGHT	64
+
+typedef struct
+{
+	uint8 *data[TILES];
+	int size[TILES];
+	uint8 *output;
+	int next;
+	int Bpp;
+	const char *name;
+}
+BITMAP_CORPUS;
+
+static uint8 *
+put_count(uint8 * p, uint8 code, int count)
+{
+	*p++ = code;
+	*p++ = count & 0xff;
+	*p++ = count >> 8;
+	return p;
+}
+
+static uint8 *
+put_pixel(uint8 * p, uint32 value, int Bpp)
+{
+	int i;
+
+	for (i = 0; i < Bpp; i++)
+		*p++ = (value >> (i * 8)) & 0xff;
+	return p;
+}
+
+static uint32
+some_colour(int Bpp)
+{
+	/* a small palette, as on a typical desktop */
+	static const uint32 palette[8] = {
+		0x000000, 0xffffff, 0xd4d0c8, 0x0a246a,
+		0x808080, 0x3a6ea5, 0xf0f0f0, 0x404040
+	};
+	uint32 value = palette[bench_rand() % 8];
+
+	return value & ((1U << (Bpp * 8)) - 1);
+}
+
+/* Build an interleaved RLE stream using the long order forms, with
+   the mix of orders a server produces for window contents */
+static int
+encode_rle_tile(uint8 * out, int width, int height, int Bpp)
+{
+	uint8 *p = out;
+	int remaining = width * height;
+	int lastfill = 0;
+	int count, i, kind;
+
+	while (remaining > 0)
+	{
+		count = bench_range(1, 96);
+		count = MIN(count, remaining);
+		kind = bench_range(0, 99);
+
+		if (kind < 30 && !lastfill)
+		{
+			/* Fill, repeats the previous scanline */
+			p = put_count(p, 0xf0, count);
+			lastfill = 1;
+			remaining -= count;
+			continue;
+		}
+		lastfill = 0;
+
+		if (kind < 55)
+		{
+			/* Colour run */
+			p = put_count(p, 0xf3, count);
+			p = put_pixel(p, some_colour(Bpp), Bpp);
+		}
+		else if (kind < 72)
+		{
+			/* Copy, literal pixels such as text and icons */
+			count = MIN(count, 24);
+			p = put_count(p, 0xf4, count);
+			for (i = 0; i < count; i++)
+				p = put_pixel(p, some_colour(Bpp), Bpp);
+		}
+		else if (kind < 87)
+		{
+			/* FillOrMix, a foreground/background mask */
+			p = put_count(p, 0xf2, count);
+			for (i = 0; i < (count + 7) / 8; i++)
+				*p++ = bench_rand() & 0xff;
+		}
+		else if (kind < 92)
+		{
+			/* SetMix/Mix */
+			p = put_count(p, 0xf6, count);
+			p = put_pixel(p, some_colour(Bpp), Bpp);
+		}
+		else if (kind < 96)
+		{
+			/* Bicolour, every count is a pair */
+			count = MIN(count / 2 + 1, remaining / 2);
+			if (count == 0)
+				continue;
+			p = put_count(p, 0xf8, count);
+			p = put_pixel(p, some_colour(Bpp), Bpp);
+			p = put_pixel(p, some_colour(Bpp), Bpp);
+			count *= 2;
+		}
+		else
+		{
+			/* single White or Black pixels */
+			*p++ = (kind & 1) ? 0xfd : 0xfe;
+			count = 1;
+		}
+		remaining -= count;
+	}
+
+	return p - out;
+}
+
+/* True if a run of four equal values starts at position i */
+static int
+run_starts(const uint8 * values, int i, int width)
+{
+	return i + 3 < width && values[i] == values[i + 1] &&
+		values[i] == values[i + 2] && values[i] == values[i + 3];
+}
+
+/* Encode one plane row of raw or delta values in planar RLE form */
+static uint8 *
+encode_plane_row(uint8 * p, const uint8 * values, int width)
+{
+	int i = 0, literals, run;
+
+	while (i < width)
+	{
+		literals = 1;
+		run = 0;
+		while (run < 15 && i + 1 + run < width && values[i + 1 + run] == values[i])
+			run++;
+
+		/* run lengths of 1 and 2 mean something else in this encoding */
+		if (run < 3)
+		{
+			run = 0;
+			while (literals < 15 && i + literals < width &&
+			       !run_starts(values, i + literals, width))
+				literals++;
+		}
+
+		*p++ = (literals << 4) | run;
+		memcpy(p, values + i, literals);
+		p += literals;
+		i += literals + run;
+	}
+
+	return p;
+}
+
+static uint8 *
+encode_plane(uint8 * p, const uint8 * plane, int width, int height)
+{
+	uint8 row[TILE_WIDTH];
+	int x, y, delta;
+
+	p = encode_plane_row(p, plane, width);
+	for (y = 1; y < height; y++)
+	{
+		for (x = 0; x < width; x++)
+		{
+			delta = (sint8) (plane[y * width + x] - plane[(y - 1) * width + x]);
+			row[x] = delta >= 0 ? delta * 2 : -delta * 2 - 1;
+		}
+		p = encode_plane_row(p, row, width);
+	}
+
+	return p;
+}
+
+/* Build an RDP6 planar stream of a smooth gradient with some detail,
+   which is what planar bitmaps are usually used for */
+static int
+encode_planar_tile(uint8 * out, int width, int height)
+{
+	uint8 plane[4][TILE_WIDTH * TILE_HEIGHT];
+	uint8 *p = out;
+	int x, y, c, base[4];
+
+	for (c = 0; c < 4; c++)
+		base[c] = bench_range(0, 255);
+
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width; x++)
+		{
+			plane[0][y * width + x] = 0xff;
+			for (c = 1; c < 4; c++)
+				plane[c][y * width + x] =
+					base[c] + x * c + y + (bench_range(0, 9) == 0 ?
+							       bench_range(0, 31) : 0);
+		}
+
+	*p++ = 0x10;
+	for (c = 0; c < 4; c++)
+		p = encode_plane(p, plane[c], width, height);
+
+	return p - out;
+}
+
+static void
+corpus_init(BITMAP_CORPUS * corpus, int Bpp, const char *name)
+{
+	uint8 buffer[TILE_WIDTH * TILE_HEIGHT * 8];
+	int i;
+
+	corpus->Bpp = Bpp;
+	corpus->next = 0;
+	corpus->name = name;
+	corpus->output = xmalloc(TILE_WIDTH * TILE_HEIGHT * Bpp);
+
+	for (i = 0; i < TILES; i++)
+	{
+		if (Bpp == 4)
+			corpus->size[i] = encode_planar_tile(buffer, TILE_WIDTH, TILE_HEIGHT);
+		else
+			corpus->size[i] = encode_rle_tile(buffer, TILE_WIDTH, TILE_HEIGHT, Bpp);
+
+		corpus->data[i] = xmalloc(corpus->size[i]);
+		memcpy(corpus->data[i], buffer, corpus->size[i]);
+
+		if (!bitmap_decompress(corpus->output, TILE_WIDTH, TILE_HEIGHT,
+				       corpus->data[i], corpus->size[i], Bpp))
+			bench_fail(name, "corpus does not decode");
+	}
+}
+
+static void
+corpus_free(BITMAP_CORPUS * corpus)
+{
+	int i;
+
+	for (i = 0; i < TILES; i++)
+		xfree(corpus->data[i]);
+	xfree(corpus->output);
+}
+
+/* Decompress one tile of the corpus per call */
+static void
+bench_decompress(void *ctx)
+{
+	BITMAP_CORPUS *corpus = ctx;
+	int i = corpus->next;
+
+	bitmap_decompress(corpus->output, TILE_WIDTH, TILE_HEIGHT,
+			  corpus->data[i], corpus->size[i], corpus->Bpp);
+	corpus->next = (i + 1) % TILES;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char *names[] = {
+		"bitmap_decompress/8bpp", "bitmap_decompress/16bpp",
+		"bitmap_decompress/24bpp", "bitmap_decompress/32bpp"
+	};
+	BITMAP_CORPUS corpus;
+	int Bpp;
+
+	bench_init(argc, argv);
+
+	for (Bpp = 1; Bpp <= 4; Bpp++)
+	{
+		corpus_init(&corpus, Bpp, names[Bpp - 1]);
+		bench_run(names[Bpp - 1], bench_decompress, &corpus, 1,
+			  TILE_WIDTH * TILE_HEIGHT * Bpp);
+		corpus_free(&corpus);
+	}
+
+	return 0;
+}
@@ -5,3 +5,13 @@ RD_BOOL bitmap_decompress(uint8 * output, int width, int height, uint8 * input,
 {
   return mock(output, width, height, input, size, Bpp);
 };
+
+void bitmap_decompress_queue(BITMAP_JOB * job)
+{
+  mock(job);
+}
+
+RD_BOOL bitmap_decompress_wait(BITMAP_JOB * job)
+{
+  return mock(job);
+}
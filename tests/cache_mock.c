@@ -32,21 +32,32 @@ cache_put_text(uint8 cache_id, void *data, int length)
   mock(cache_id, data, length);
 }
 
-uint8 *
-cache_get_desktop(uint32 offset, int cx, int cy, int bytes_per_pixel)
+void
+cache_save_state()
 {
-  return (uint8 *) mock(offset, cx, cy, bytes_per_pixel);
+  mock();
 }
 
 void
-cache_put_desktop(uint32 offset, int cx, int cy, int scanline,
-		  int bytes_per_pixel, uint8 * data)
+cache_reset_offscreen(void)
 {
-  mock(offset, cx, cy, scanline, bytes_per_pixel, data);
+  mock();
 }
 
 void
-cache_save_state()
+cache_report_stats(void)
 {
   mock();
 }
+
+RD_BOOL
+cache_set_bitmap_policy(const char *name)
+{
+  return mock(name);
+}
+
+uint32
+cache_bitmap_cells(uint8 id, uint32 cells, RD_BOOL persistent)
+{
+  return mock(id, cells, persistent);
+}
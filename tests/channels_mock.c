@@ -5,3 +5,15 @@ void channel_process(STREAM s, uint16 mcs_channel)
 {
   mock(s, mcs_channel);
 }
+
+void
+channel_flush(void)
+{
+  mock();
+}
+
+void
+channel_reset_state(void)
+{
+  mock();
+}
@@ -2,15 +2,9 @@
 #include "../rdesktop.h"
 
 void
-ctrl_add_fds(int *n, fd_set * rfds)
+ctrl_check_fds(void)
 {
-  mock(n, rfds);
-}
-
-void
-ctrl_check_fds(fd_set * rfds, fd_set * wfds)
-{
-  mock(rfds, wfds);
+  mock();
 }
 
 int
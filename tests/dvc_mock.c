@@ -7,10 +7,17 @@ dvc_init(void)
   return mock();
 }
 
+void
+dvc_reset_state(void)
+{
+  mock();
+}
+
 RD_BOOL
-dvc_channels_register(const char *name, dvc_channel_process_fn handler)
+dvc_channels_register(const char *name, dvc_channel_process_fn handler,
+		      dvc_channel_open_fn open, int priority)
 {
-  return mock(name, handler);
+  return mock(name, handler, open, priority);
 }
 
 RD_BOOL
@@ -24,3 +31,15 @@ dvc_send(const char *name, STREAM s)
 {
   mock(name, s);
 }
+
+void
+dvc_flush(void)
+{
+  mock();
+}
+
+int
+dvc_send_timeout(void)
+{
+  return mock();
+}
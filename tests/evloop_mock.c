@@ -0,0 +1,26 @@
+#include <cgreen/mocks.h>
+#include "../rdesktop.h"
+
+void
+evloop_add_fd(int fd, int events)
+{
+  mock(fd, events);
+}
+
+void
+evloop_remove_fd(int fd)
+{
+  mock(fd);
+}
+
+int
+evloop_check_fd(int fd)
+{
+  return mock(fd);
+}
+
+int
+evloop_wait(int n, fd_set * rfds, fd_set * wfds, struct timeval *tv)
+{
+  return mock(n, rfds, wfds, tv);
+}
@@ -26,6 +26,12 @@ ewmh_get_window_desktop(Window wnd)
   return mock(wnd);
 }
 
+RD_BOOL
+ewmh_is_window_on_current_desktop(Window wnd)
+{
+  return mock(wnd);
+}
+
 void
 ewmh_set_wm_name(Window wnd, const char *title)
 {
@@ -74,6 +80,12 @@ ewmh_is_window_above(Window w)
   return mock(w);
 }
 
+int
+ewmh_set_fullscreen_monitors(Window wnd, int top, int bottom, int left, int right)
+{
+  return mock(wnd, top, bottom, left, right);
+}
+
 int
 get_current_workarea(uint32 *x, uint32 *y, uint32 *width, uint32 *height)
 {
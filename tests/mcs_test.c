@@ -10,6 +10,7 @@ AfterEach(MCS) {};
 char g_codepage[16];
 VCHANNEL g_channels[1];
 unsigned int g_num_channels;
+uint16 g_mcs_msgchannel;
 
 #include "../asn.c"
 #include "../mcs.c"
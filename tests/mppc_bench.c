@@ -0,0 +1,201 @@
+#include "../rdesktop.h"
+#include "../proto.h"
+#include "bench.h"
+
+#include "../mppc.c"
+
+/* One history buffer worth of data, sent as a few PDUs */
+#define BLOCKS		4
+#define BLOCK_SIZE	16000
+#define HASH_SIZE	4096
+
+typedef struct
+{
+	uint8 *data;
+	uint32 bits;
+	uint32 avail;
+}
+BIT_WRITER;
+
+typedef struct
+{
+	uint8 plain[BLOCKS * BLOCK_SIZE];
+	uint8 *data[BLOCKS];
+	uint32 size[BLOCKS];
+}
+MPPC_CORPUS;
+
+static void
+put_bits(BIT_WRITER * w, uint32 value, int count)
+{
+	while (count-- > 0)
+	{
+		if (w->bits == w->avail * 8)
+			bench_fail("mppc", "compressed block too large");
+		if (value & (1U << count))
+			w->data[w->bits / 8] |= 0x80 >> (w->bits % 8);
+		w->bits++;
+	}
+}
+
+static void
+put_literal(BIT_WRITER * w, uint8 c)
+{
+	if (c < 0x80)
+		put_bits(w, c, 8);
+	else
+		put_bits(w, 0x100 | (c & 0x7f), 9);
+}
+
+/* Copy tuple in the 64k history (RDP 5) format */
+static void
+put_match(BIT_WRITER * w, uint32 offset, uint32 length)
+{
+	int n;
+
+	if (offset < 64)
+		put_bits(w, (0x1f << 6) | offset, 11);
+	else if (offset < 320)
+		put_bits(w, (0x1e << 8) | (offset - 64), 13);
+	else if (offset < 2368)
+		put_bits(w, (0xe << 11) | (offset - 320), 15);
+	else
+		put_bits(w, (0x6 << 16) | (offset - 2368), 19);
+
+	if (length == 3)
+	{
+		put_bits(w, 0, 1);
+		return;
+	}
+
+	for (n = 0; (length >> (n + 1)) != 0; n++);
+	put_bits(w, ((1U << (n - 1)) - 1) << 1, n);
+	put_bits(w, length & ((1U << n) - 1), n);
+}
+
+static uint32
+hash3(const uint8 * p)
+{
+	return ((p[0] << 8) ^ (p[1] << 4) ^ p[2]) & (HASH_SIZE - 1);
+}
+
+/* Greedy compressor, good enough to produce a realistic mix of
+   literals and copy tuples for the decoder */
+static uint32
+compress_block(uint8 * out, uint32 avail, const uint8 * history, uint32 start, uint32 end,
+	       uint32 * table)
+{
+	BIT_WRITER w;
+	uint32 pos = start, candidate, length;
+
+	memset(out, 0, avail);
+	w.data = out;
+	w.bits = 0;
+	w.avail = avail;
+
+	while (pos < end)
+	{
+		length = 0;
+		if (pos + 3 <= end)
+		{
+			candidate = table[hash3(history + pos)];
+			table[hash3(history + pos)] = pos;
+			if (candidate != (uint32) - 1 && candidate < pos)
+				while (pos + length < end && length < 4096 &&
+				       history[candidate + length] == history[pos + length])
+					length++;
+			if (length >= 3)
+			{
+				put_match(&w, pos - candidate, length);
+				pos += length;
+				continue;
+			}
+		}
+		put_literal(&w, history[pos++]);
+	}
+
+	return (w.bits + 7) / 8;
+}
+
+/* Something like an order stream, with recurring records and a fair
+   amount of noise */
+static void
+corpus_init(MPPC_CORPUS * corpus)
+{
+	uint8 records[32][24];
+	uint32 table[HASH_SIZE];
+	uint8 buffer[BLOCK_SIZE * 2];
+	uint32 pos = 0, i, length;
+	int r;
+
+	for (r = 0; r < 32; r++)
+		for (i = 0; i < sizeof(records[r]); i++)
+			records[r][i] = bench_rand() & 0xff;
+
+	while (pos < sizeof(corpus->plain))
+	{
+		r = bench_range(0, 31);
+		length = bench_range(4, sizeof(records[r]));
+		length = MIN(length, sizeof(corpus->plain) - pos);
+		memcpy(corpus->plain + pos, records[r], length);
+		pos += length;
+
+		length = bench_range(0, 6);
+		for (i = 0; i < length && pos < sizeof(corpus->plain); i++)
+			corpus->plain[pos++] = bench_rand() & 0xff;
+	}
+
+	memset(table, 0xff, sizeof(table));
+	for (i = 0; i < BLOCKS; i++)
+	{
+		corpus->size[i] = compress_block(buffer, sizeof(buffer), corpus->plain,
+						 i * BLOCK_SIZE, (i + 1) * BLOCK_SIZE, table);
+		corpus->data[i] = xmalloc(corpus->size[i]);
+		memcpy(corpus->data[i], buffer, corpus->size[i]);
+	}
+}
+
+/* Expand the whole corpus, starting with a history reset */
+static void
+bench_expand(void *ctx)
+{
+	MPPC_CORPUS *corpus = ctx;
+	uint32 roff, rlen;
+	uint8 ctype;
+	int i;
+
+	for (i = 0; i < BLOCKS; i++)
+	{
+		ctype = RDP_MPPC_COMPRESSED | RDP_MPPC_BIG;
+		if (i == 0)
+			ctype |= RDP_MPPC_RESET;
+		if (mppc_expand(corpus->data[i], corpus->size[i], ctype, &roff, &rlen) != 0
+		    || rlen != BLOCK_SIZE)
+			bench_fail("mppc_expand", "corpus does not decode");
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	static MPPC_CORPUS corpus;
+	uint32 compressed = 0;
+	char name[64];
+	int i;
+
+	bench_init(argc, argv);
+	corpus_init(&corpus);
+
+	bench_expand(&corpus);
+	if (memcmp(g_mppc_dict.hist, corpus.plain, sizeof(corpus.plain)) != 0)
+		bench_fail("mppc_expand", "corpus decodes to the wrong data");
+
+	for (i = 0; i < BLOCKS; i++)
+		compressed += corpus.size[i];
+
+	snprintf(name, sizeof(name), "mppc_expand/64k (ratio %.2f)",
+		 (double) sizeof(corpus.plain) / compressed);
+	bench_run(name, bench_expand, &corpus, BLOCKS, sizeof(corpus.plain));
+
+	return 0;
+}
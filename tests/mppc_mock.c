@@ -6,3 +6,21 @@ mppc_expand(uint8 * data, uint32 clen, uint8 ctype, uint32 * roff, uint32 * rlen
 {
   return mock(data, clen, ctype, roff, rlen);
 }
+
+STREAM
+mppc_decompress(uint8 * data, uint32 clen, uint8 ctype)
+{
+  return (STREAM) mock(data, clen, ctype);
+}
+
+uint8
+mppc_compress(uint8 * data, uint32 len, uint8 * out, uint32 * olen)
+{
+  return mock(data, len, out, olen);
+}
+
+void
+mppc_compress_reset(void)
+{
+  mock();
+}
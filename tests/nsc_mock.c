@@ -0,0 +1,8 @@
+#include <cgreen/mocks.h>
+#include "../rdesktop.h"
+
+RD_BOOL
+nsc_decode(uint8 * data, uint32 size, int width, int height, uint8 * dst, int stride)
+{
+  return mock(data, size, width, height, dst, stride);
+}
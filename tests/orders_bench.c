@@ -0,0 +1,527 @@
+#include "../rdesktop.h"
+#include "../proto.h"
+#include "bench.h"
+
+char g_codepage[16];
+RDP_VERSION g_rdp_version = RDP_V5;
+int g_server_depth = 32;
+
+#include "../orders.c"
+#include "../stream.c"
+
+/* Orders per update, roughly what a busy screen produces */
+#define ORDERS	1000
+
+/* Drawing goes nowhere, we only want the parsing and dispatch cost */
+static unsigned int g_ui_calls;
+static uint8 g_dummy_bitmap;
+
+void
+ui_set_clip(int x, int y, int cx, int cy)
+{
+	UNUSED(x); UNUSED(y); UNUSED(cx); UNUSED(cy);
+	g_ui_calls++;
+}
+
+void
+ui_reset_clip(void)
+{
+	g_ui_calls++;
+}
+
+void
+ui_destblt(uint8 opcode, int x, int y, int cx, int cy)
+{
+	UNUSED(opcode); UNUSED(x); UNUSED(y); UNUSED(cx); UNUSED(cy);
+	g_ui_calls++;
+}
+
+void
+ui_patblt(uint8 opcode, int x, int y, int cx, int cy, BRUSH * brush, uint32 bgcolour,
+	uint32 fgcolour)
+{
+	UNUSED(opcode); UNUSED(x); UNUSED(y); UNUSED(cx); UNUSED(cy); UNUSED(brush);
+	UNUSED(bgcolour); UNUSED(fgcolour);
+	g_ui_calls++;
+}
+
+void
+ui_screenblt(uint8 opcode, int x, int y, int cx, int cy, int srcx, int srcy)
+{
+	UNUSED(opcode); UNUSED(x); UNUSED(y); UNUSED(cx); UNUSED(cy); UNUSED(srcx); UNUSED(srcy);
+	g_ui_calls++;
+}
+
+void
+ui_memblt(uint8 opcode, int x, int y, int cx, int cy, RD_HBITMAP src, int srcx, int srcy)
+{
+	UNUSED(opcode); UNUSED(x); UNUSED(y); UNUSED(cx); UNUSED(cy); UNUSED(src); UNUSED(srcx);
+	UNUSED(srcy);
+	g_ui_calls++;
+}
+
+void
+ui_triblt(uint8 opcode, int x, int y, int cx, int cy, RD_HBITMAP src, int srcx, int srcy,
+	BRUSH * brush, uint32 bgcolour, uint32 fgcolour)
+{
+	UNUSED(opcode); UNUSED(x); UNUSED(y); UNUSED(cx); UNUSED(cy); UNUSED(src); UNUSED(srcx);
+	UNUSED(srcy); UNUSED(brush); UNUSED(bgcolour); UNUSED(fgcolour);
+	g_ui_calls++;
+}
+
+void
+ui_line(uint8 opcode, int startx, int starty, int endx, int endy, PEN * pen)
+{
+	UNUSED(opcode); UNUSED(startx); UNUSED(starty); UNUSED(endx); UNUSED(endy); UNUSED(pen);
+	g_ui_calls++;
+}
+
+void
+ui_rect(int x, int y, int cx, int cy, uint32 colour)
+{
+	UNUSED(x); UNUSED(y); UNUSED(cx); UNUSED(cy); UNUSED(colour);
+	g_ui_calls++;
+}
+
+void
+ui_polygon(uint8 opcode, uint8 fillmode, RD_POINT * point, int npoints, BRUSH * brush,
+	uint32 bgcolour, uint32 fgcolour)
+{
+	UNUSED(opcode); UNUSED(fillmode); UNUSED(point); UNUSED(npoints); UNUSED(brush);
+	UNUSED(bgcolour); UNUSED(fgcolour);
+	g_ui_calls++;
+}
+
+void
+ui_polyline(uint8 opcode, RD_POINT * points, int npoints, PEN * pen)
+{
+	UNUSED(opcode); UNUSED(points); UNUSED(npoints); UNUSED(pen);
+	g_ui_calls++;
+}
+
+void
+ui_ellipse(uint8 opcode, uint8 fillmode, int x, int y, int cx, int cy, BRUSH * brush,
+	uint32 bgcolour, uint32 fgcolour)
+{
+	UNUSED(opcode); UNUSED(fillmode); UNUSED(x); UNUSED(y); UNUSED(cx); UNUSED(cy);
+	UNUSED(brush); UNUSED(bgcolour); UNUSED(fgcolour);
+	g_ui_calls++;
+}
+
+void
+ui_draw_text(uint8 font, uint8 flags, uint8 opcode, int mixmode, int x, int y, int clipx,
+	int clipy, int clipcx, int clipcy, int boxx, int boxy, int boxcx, int boxcy,
+	BRUSH * brush, uint32 bgcolour, uint32 fgcolour, uint8 * text, uint8 length)
+{
+	UNUSED(font); UNUSED(flags); UNUSED(opcode); UNUSED(mixmode); UNUSED(x); UNUSED(y);
+	UNUSED(clipx); UNUSED(clipy); UNUSED(clipcx); UNUSED(clipcy); UNUSED(boxx); UNUSED(boxy);
+	UNUSED(boxcx); UNUSED(boxcy); UNUSED(brush); UNUSED(bgcolour); UNUSED(fgcolour);
+	UNUSED(text); UNUSED(length);
+	g_ui_calls++;
+}
+
+void
+ui_desktop_save(uint32 offset, int x, int y, int cx, int cy)
+{
+	UNUSED(offset); UNUSED(x); UNUSED(y); UNUSED(cx); UNUSED(cy);
+	g_ui_calls++;
+}
+
+void
+ui_desktop_restore(uint32 offset, int x, int y, int cx, int cy)
+{
+	UNUSED(offset); UNUSED(x); UNUSED(y); UNUSED(cx); UNUSED(cy);
+	g_ui_calls++;
+}
+
+RD_HBITMAP
+ui_create_bitmap(int width, int height, uint8 * data)
+{
+	UNUSED(width); UNUSED(height); UNUSED(data);
+	return &g_dummy_bitmap;
+}
+
+RD_HBITMAP
+ui_create_surface(int width, int height)
+{
+	UNUSED(width); UNUSED(height);
+	return &g_dummy_bitmap;
+}
+
+void
+ui_switch_surface(RD_HBITMAP surface)
+{
+	UNUSED(surface);
+}
+
+RD_HGLYPH
+ui_create_glyph(int width, int height, uint8 * data)
+{
+	UNUSED(width); UNUSED(height); UNUSED(data);
+	return &g_dummy_bitmap;
+}
+
+RD_HCOLOURMAP
+ui_create_colourmap(COLOURMAP * colours)
+{
+	UNUSED(colours);
+	return &g_dummy_bitmap;
+}
+
+void
+ui_set_colourmap(RD_HCOLOURMAP map)
+{
+	UNUSED(map);
+}
+
+RD_HBITMAP
+cache_get_bitmap(uint8 id, uint16 idx)
+{
+	UNUSED(id); UNUSED(idx);
+	return &g_dummy_bitmap;
+}
+
+RD_HBITMAP
+cache_get_offscreen(uint16 idx)
+{
+	UNUSED(idx);
+	return &g_dummy_bitmap;
+}
+
+void
+cache_put_offscreen(uint16 idx, RD_HBITMAP bitmap)
+{
+	UNUSED(idx); UNUSED(bitmap);
+}
+
+void
+cache_put_bitmap(uint8 id, uint16 idx, RD_HBITMAP bitmap, uint32 size)
+{
+	UNUSED(id); UNUSED(idx); UNUSED(bitmap); UNUSED(size);
+}
+
+RD_BOOL
+cache_put_compressed_bitmap(uint8 id, uint16 idx, uint8 width, uint8 height, uint8 Bpp,
+			    uint8 * data, uint16 size)
+{
+	UNUSED(id); UNUSED(idx); UNUSED(width); UNUSED(height); UNUSED(Bpp); UNUSED(data);
+	UNUSED(size);
+	return False;
+}
+
+BRUSHDATA *
+cache_get_brush_data(uint8 colour_code, uint8 idx)
+{
+	UNUSED(colour_code); UNUSED(idx);
+	return NULL;
+}
+
+void
+cache_put_brush_data(uint8 colour_code, uint8 idx, BRUSHDATA * brush_data)
+{
+	UNUSED(colour_code); UNUSED(idx); UNUSED(brush_data);
+}
+
+void
+cache_put_font(uint8 font, uint16 character, uint16 offset, uint16 baseline, uint16 width,
+	uint16 height, RD_HGLYPH pixmap)
+{
+	UNUSED(font); UNUSED(character); UNUSED(offset); UNUSED(baseline); UNUSED(width);
+	UNUSED(height); UNUSED(pixmap);
+}
+
+RD_BOOL
+nsc_decode(uint8 * data, uint32 size, int width, int height, uint8 * dst, int stride)
+{
+	UNUSED(data); UNUSED(size); UNUSED(width); UNUSED(height); UNUSED(dst); UNUSED(stride);
+	return False;
+}
+
+RD_BOOL
+pstcache_save_bitmap(uint8 cache_id, uint16 cache_idx, uint8 * key, uint8 width, uint8 height,
+	uint16 length, uint8 * data)
+{
+	UNUSED(cache_id); UNUSED(cache_idx); UNUSED(key); UNUSED(width); UNUSED(height);
+	UNUSED(length); UNUSED(data);
+	return True;
+}
+
+RD_BOOL
+bitmap_decompress(uint8 * output, int width, int height, uint8 * input, int size, int Bpp)
+{
+	UNUSED(output); UNUSED(width); UNUSED(height); UNUSED(input); UNUSED(size); UNUSED(Bpp);
+	return True;
+}
+
+
+typedef struct
+{
+	STREAM s;
+	uint8 last_type;
+}
+ORDERS_CORPUS;
+
+static void
+put_coord(STREAM s)
+{
+	out_uint16_le(s, bench_range(0, 1919));
+}
+
+static void
+put_colour(STREAM s)
+{
+	out_uint8(s, bench_range(0, 255));
+	out_uint8(s, bench_range(0, 255));
+	out_uint8(s, bench_range(0, 255));
+}
+
+/* Order flags, type and the field present mask of 'size' bytes */
+static void
+put_header(ORDERS_CORPUS * corpus, uint8 flags, uint8 type, uint32 present, int size)
+{
+	STREAM s = corpus->s;
+	int i;
+
+	flags |= RDP_ORDER_STANDARD;
+	if (type != corpus->last_type)
+		flags |= RDP_ORDER_CHANGE;
+
+	out_uint8(s, flags);
+	if (flags & RDP_ORDER_CHANGE)
+		out_uint8(s, type);
+	for (i = 0; i < size; i++)
+		out_uint8(s, (present >> (i * 8)) & 0xff);
+
+	corpus->last_type = type;
+}
+
+static void
+put_bounds(STREAM s)
+{
+	out_uint8(s, 0x0f);
+	put_coord(s);
+	put_coord(s);
+	put_coord(s);
+	put_coord(s);
+}
+
+static void
+put_text2(ORDERS_CORPUS * corpus)
+{
+	STREAM s = corpus->s;
+	int i, length = bench_range(4, 40);
+
+	put_header(corpus, RDP_ORDER_BOUNDS, RDP_ORDER_TEXT2, 0x393fff, 3);
+	put_bounds(s);
+	out_uint8(s, 1);	/* font */
+	out_uint8(s, 0x03);	/* flags */
+	out_uint8(s, 0x01);	/* opcode */
+	out_uint8(s, 0);	/* mixmode */
+	put_colour(s);
+	put_colour(s);
+	for (i = 0; i < 8; i++)
+		put_coord(s);	/* clip and box */
+	out_uint8(s, 0);	/* brush style */
+	put_coord(s);
+	put_coord(s);
+	out_uint8(s, length);
+	for (i = 0; i < length; i++)
+		out_uint8(s, bench_range(0, 95));
+}
+
+static void
+put_memblt(ORDERS_CORPUS * corpus)
+{
+	STREAM s = corpus->s;
+
+	put_header(corpus, 0, RDP_ORDER_MEMBLT, 0x1ff, 2);
+	out_uint8(s, bench_range(0, 2));	/* cache id */
+	out_uint8(s, 0);	/* colour table */
+	put_coord(s);
+	put_coord(s);
+	out_uint16_le(s, 64);
+	out_uint16_le(s, 64);
+	out_uint8(s, 0xcc);
+	out_uint16_le(s, 0);
+	out_uint16_le(s, 0);
+	out_uint16_le(s, bench_range(0, 599));
+}
+
+static void
+put_rect(ORDERS_CORPUS * corpus)
+{
+	STREAM s = corpus->s;
+
+	if (corpus->last_type == RDP_ORDER_RECT && bench_range(0, 1))
+	{
+		/* next item in a list, moved by a delta */
+		put_header(corpus, RDP_ORDER_DELTA, RDP_ORDER_RECT, 0x03, 1);
+		out_uint8(s, bench_range(-20, 20));
+		out_uint8(s, bench_range(-20, 20));
+		return;
+	}
+
+	put_header(corpus, 0, RDP_ORDER_RECT, 0x7f, 1);
+	put_coord(s);
+	put_coord(s);
+	put_coord(s);
+	put_coord(s);
+	out_uint8(s, bench_range(0, 255));
+	out_uint8(s, bench_range(0, 255));
+	out_uint8(s, bench_range(0, 255));
+}
+
+static void
+put_patblt(ORDERS_CORPUS * corpus)
+{
+	STREAM s = corpus->s;
+
+	put_header(corpus, 0, RDP_ORDER_PATBLT, 0x27f, 2);
+	put_coord(s);
+	put_coord(s);
+	put_coord(s);
+	put_coord(s);
+	out_uint8(s, 0xf0);
+	put_colour(s);
+	put_colour(s);
+	out_uint8(s, 0);	/* solid brush */
+}
+
+static void
+put_screenblt(ORDERS_CORPUS * corpus)
+{
+	STREAM s = corpus->s;
+
+	put_header(corpus, 0, RDP_ORDER_SCREENBLT, 0x7f, 1);
+	put_coord(s);
+	put_coord(s);
+	put_coord(s);
+	put_coord(s);
+	out_uint8(s, 0xcc);
+	put_coord(s);
+	put_coord(s);
+}
+
+static void
+put_line(ORDERS_CORPUS * corpus)
+{
+	STREAM s = corpus->s;
+
+	put_header(corpus, 0, RDP_ORDER_LINE, 0x3ff, 2);
+	out_uint16_le(s, 1);	/* mixmode */
+	put_coord(s);
+	put_coord(s);
+	put_coord(s);
+	put_coord(s);
+	put_colour(s);
+	out_uint8(s, 0x0d);	/* R2_COPYPEN */
+	out_uint8(s, 0);	/* pen style */
+	out_uint8(s, 1);	/* pen width */
+	put_colour(s);
+}
+
+static void
+put_destblt(ORDERS_CORPUS * corpus)
+{
+	STREAM s = corpus->s;
+
+	put_header(corpus, 0, RDP_ORDER_DESTBLT, 0x1f, 1);
+	put_coord(s);
+	put_coord(s);
+	put_coord(s);
+	put_coord(s);
+	out_uint8(s, 0x00);
+}
+
+/* A mix weighted towards text and cached bitmaps, as seen when
+   working with ordinary applications */
+static void
+corpus_init(ORDERS_CORPUS * corpus)
+{
+	int i, kind;
+
+	corpus->s = s_alloc(ORDERS * 128);
+	corpus->last_type = RDP_ORDER_PATBLT;
+
+	for (i = 0; i < ORDERS; i++)
+	{
+		kind = bench_range(0, 99);
+		if (kind < 35)
+			put_text2(corpus);
+		else if (kind < 55)
+			put_memblt(corpus);
+		else if (kind < 70)
+			put_rect(corpus);
+		else if (kind < 80)
+			put_patblt(corpus);
+		else if (kind < 85)
+			put_screenblt(corpus);
+		else if (kind < 95)
+			put_line(corpus);
+		else
+			put_destblt(corpus);
+	}
+
+	s_mark_end(corpus->s);
+}
+
+static void
+bench_process_orders(void *ctx)
+{
+	ORDERS_CORPUS *corpus = ctx;
+
+	reset_order_state();
+	s_seek(corpus->s, 0);
+	process_orders(corpus->s, ORDERS);
+	s_arena_reset();
+	if (!s_check_end(corpus->s))
+		bench_fail("process_orders", "corpus was not consumed");
+}
+
+/* Compressed 8x8 brushes as the brush cache order carries them, 16
+   bytes of 2-bit palette indices followed by 4 palette entries */
+#define BRUSHES		256
+
+typedef struct
+{
+	uint8 in[BRUSHES][16 + 4 * 4];
+	uint8 out[8 * 8 * 4];
+	int Bpp;
+}
+BRUSH_CORPUS;
+
+static void
+bench_expand_brush(void *ctx)
+{
+	BRUSH_CORPUS *corpus = ctx;
+	int i;
+
+	for (i = 0; i < BRUSHES; i++)
+		process_compressed_8x8_brush_data(corpus->in[i], corpus->out, corpus->Bpp);
+}
+
+int
+main(int argc, char *argv[])
+{
+	ORDERS_CORPUS corpus;
+	BRUSH_CORPUS brushes;
+	char name[64];
+	int i, j;
+
+	bench_init(argc, argv);
+	corpus_init(&corpus);
+
+	bench_run("process_orders/mixed", bench_process_orders, &corpus, ORDERS, s_length(corpus.s));
+
+	for (i = 0; i < BRUSHES; i++)
+		for (j = 0; j < (int) sizeof(brushes.in[i]); j++)
+			brushes.in[i][j] = bench_rand();
+	for (brushes.Bpp = 1; brushes.Bpp <= 4; brushes.Bpp++)
+	{
+		snprintf(name, sizeof(name), "brush_8x8/%dBpp", brushes.Bpp);
+		bench_run(name, bench_expand_brush, &brushes, BRUSHES, 0);
+	}
+
+	s_free(corpus.s);
+	return 0;
+}
@@ -10,3 +10,13 @@ void reset_order_state()
 {
   mock();
 }
+
+RD_BOOL orders_format_stats(int n, char *buf, size_t size)
+{
+  return mock(n, buf, size);
+}
+
+void orders_report_stats()
+{
+  mock();
+}
@@ -10,3 +10,18 @@ RD_BOOL pstcache_init(uint8 cache_id)
 {
   return mock(cache_id);
 }
+
+void pstcache_preload_start(void)
+{
+  mock();
+}
+
+void pstcache_preload_step(void)
+{
+  mock();
+}
+
+void pstcache_mark_drawn(uint8 cache_id, uint16 cache_idx)
+{
+  mock(cache_id, cache_idx);
+}
@@ -1,6 +1,8 @@
 #include <cgreen/mocks.h>
 #include "../rdesktop.h"
 
+uint32 g_fp_max_request_size;
+
 void process_ts_fp_updates(STREAM s)
 {
   mock(s);
@@ -7,12 +7,42 @@ rdp_send_input(uint32 time, uint16 message_type, uint16 device_flags, uint16 par
   mock(time, message_type, device_flags, param1, param2);
 }
 
+void
+rdp_input_batch_begin(void)
+{
+  mock();
+}
+
+void
+rdp_input_batch_end(void)
+{
+  mock();
+}
+
+int
+rdp_input_timeout(void)
+{
+  return mock();
+}
+
 void
 rdp_send_suppress_output_pdu(enum RDP_SUPPRESS_STATUS allowupdates)
 {
   mock(allowupdates);
 }
 
+void
+rdp_send_refresh_rect(int x, int y, int cx, int cy)
+{
+  mock(x, y, cx, cy);
+}
+
+void
+rdp_set_focus_region(int left, int top, int right, int bottom)
+{
+  mock(left, top, right, bottom);
+}
+
 RD_BOOL
 rdp_connect(char *server, uint32 flags, char *domain, char *password, char *command,
 	    char *directory, RD_BOOL reconnect)
@@ -24,6 +24,7 @@ int g_server_depth;
 RD_BOOL g_bitmap_cache;
 RD_BOOL g_bitmap_cache_persist_enable;
 RD_BOOL g_numlock_sync;
+uint32 g_motion_interval;
 RD_BOOL g_pending_resize;
 RD_BOOL g_network_error;
 time_t g_wait_for_deactivate_ts;
@@ -47,6 +48,8 @@ time_t g_reconnect_random_ts;
 RD_BOOL g_has_reconnect_random;
 uint8 g_client_random[SEC_RANDOM_SIZE];
 RD_BOOL g_local_cursor;
+RD_BOOL g_rfx;
+RD_BOOL g_nsc;
 
 #include "../rdp.c"
 #include "../utils.c"
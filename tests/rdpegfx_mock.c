@@ -0,0 +1,8 @@
+#include <cgreen/mocks.h>
+#include "../rdesktop.h"
+
+void
+rdpegfx_init(void)
+{
+  mock();
+}
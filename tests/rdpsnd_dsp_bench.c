@@ -0,0 +1,129 @@
+#include "../rdesktop.h"
+#include "../proto.h"
+#include "bench.h"
+
+char g_codepage[16];
+
+#include "../rdpsnd_dsp.c"
+#include "../stream.c"
+
+typedef struct
+{
+	RD_WAVEFORMATEX format;
+	unsigned char *data;
+	unsigned int size;
+}
+DSP_CORPUS;
+
+/* 100 ms of a tone with some noise, in the given format */
+static void
+corpus_init(DSP_CORPUS * corpus, uint32 rate, uint16 bits, uint16 channels)
+{
+	unsigned int frames = rate / 10, i;
+	int sample;
+	uint16 c;
+
+	memset(&corpus->format, 0, sizeof(corpus->format));
+	corpus->format.wFormatTag = WAVE_FORMAT_PCM;
+	corpus->format.nChannels = channels;
+	corpus->format.nSamplesPerSec = rate;
+	corpus->format.wBitsPerSample = bits;
+	corpus->format.nBlockAlign = channels * bits / 8;
+	corpus->format.nAvgBytesPerSec = rate * corpus->format.nBlockAlign;
+
+	corpus->size = frames * corpus->format.nBlockAlign;
+	corpus->data = xmalloc(corpus->size);
+
+	for (i = 0; i < frames; i++)
+		for (c = 0; c < channels; c++)
+		{
+			sample = ((int) (i % 100) - 50) * 600 + bench_range(-256, 256);
+			if (bits == 8)
+				corpus->data[i * channels + c] = (sample >> 8) + 128;
+			else
+			{
+				corpus->data[(i * channels + c) * 2] = sample & 0xff;
+				corpus->data[(i * channels + c) * 2 + 1] = (sample >> 8) & 0xff;
+			}
+		}
+}
+
+static void
+bench_resample(void *ctx)
+{
+	DSP_CORPUS *corpus = ctx;
+	STREAM out;
+
+	out = rdpsnd_dsp_resample(corpus->data, corpus->size, &corpus->format, False);
+	if (out == NULL)
+		bench_fail("rdpsnd_dsp_resample", "no output");
+	s_free(out);
+}
+
+static void
+bench_softvol(void *ctx)
+{
+	DSP_CORPUS *corpus = ctx;
+
+	rdpsnd_dsp_softvol(corpus->data, corpus->size, &corpus->format);
+}
+
+static void
+bench_swapbytes(void *ctx)
+{
+	DSP_CORPUS *corpus = ctx;
+
+	rdpsnd_dsp_swapbytes(corpus->data, corpus->size, &corpus->format);
+}
+
+int
+main(int argc, char *argv[])
+{
+	DSP_CORPUS corpus;
+
+	bench_init(argc, argv);
+
+	/* the device format most audio drivers ask for */
+	rdpsnd_dsp_resample_set(44100, 16, 2);
+
+	corpus_init(&corpus, 22050, 16, 1);
+	bench_run("rdpsnd_dsp_resample/22050-16-mono", bench_resample, &corpus, 1, corpus.size);
+	xfree(corpus.data);
+
+	corpus_init(&corpus, 11025, 8, 2);
+	bench_run("rdpsnd_dsp_resample/11025-8-stereo", bench_resample, &corpus, 1, corpus.size);
+	xfree(corpus.data);
+
+	corpus_init(&corpus, 44100, 8, 2);
+	bench_run("rdpsnd_dsp_resample/44100-8-stereo", bench_resample, &corpus, 1, corpus.size);
+	xfree(corpus.data);
+
+	corpus_init(&corpus, 48000, 16, 2);
+	bench_run("rdpsnd_dsp_resample/48000-16-stereo", bench_resample, &corpus, 1, corpus.size);
+	xfree(corpus.data);
+
+	rdpsnd_dsp_resampler_select("fast");
+	corpus_init(&corpus, 22050, 16, 2);
+	bench_run("rdpsnd_dsp_resample/fast/22050-16-stereo", bench_resample, &corpus, 1,
+		  corpus.size);
+	xfree(corpus.data);
+
+	rdpsnd_dsp_resampler_select("polyphase");
+	corpus_init(&corpus, 22050, 16, 2);
+	bench_run("rdpsnd_dsp_resample/polyphase/22050-16-stereo", bench_resample, &corpus, 1,
+		  corpus.size);
+	xfree(corpus.data);
+
+	/* the samples decay towards zero, which doesn't matter for timing */
+	rdpsnd_dsp_softvol_set(40000, 30000);
+	corpus_init(&corpus, 44100, 16, 2);
+	bench_run("rdpsnd_dsp_softvol/44100-16-stereo", bench_softvol, &corpus, 1, corpus.size);
+	bench_run("rdpsnd_dsp_swapbytes/44100-16-stereo", bench_swapbytes, &corpus, 1, corpus.size);
+	xfree(corpus.data);
+
+	corpus_init(&corpus, 22050, 8, 2);
+	bench_run("rdpsnd_dsp_softvol/22050-8-stereo", bench_softvol, &corpus, 1, corpus.size);
+	xfree(corpus.data);
+
+	return 0;
+}
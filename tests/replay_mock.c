@@ -0,0 +1,44 @@
+#include <cgreen/mocks.h>
+#include "../rdesktop.h"
+
+RD_BOOL
+replay_record_open(const char *filename)
+{
+  return mock(filename);
+}
+
+void
+replay_record(STREAM s, RD_BOOL is_fastpath)
+{
+  mock(s, is_fastpath);
+}
+
+void
+replay_record_close(void)
+{
+  mock();
+}
+
+RD_BOOL
+replay_open(const char *filename)
+{
+  return mock(filename);
+}
+
+RD_BOOL
+replay_is_active(void)
+{
+  return mock();
+}
+
+STREAM
+replay_recv(RD_BOOL * is_fastpath)
+{
+  return (STREAM) mock(is_fastpath);
+}
+
+void
+replay_close(void)
+{
+  mock();
+}
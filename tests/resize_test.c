@@ -21,6 +21,10 @@ int g_ypos;
 int g_pos;
 RD_BOOL g_sendmotion;
 RD_BOOL g_fullscreen;
+RD_BOOL g_multimon;
+int g_scale = 100;
+RD_MONITOR g_monitors[RDP_MAX_MONITORS];
+int g_num_monitors;
 RD_BOOL g_grab_keyboard;
 RD_BOOL g_hide_decorations;
 RD_BOOL g_pending_resize;
@@ -61,6 +65,7 @@ uint32 g_requested_session_height;
 RD_BOOL g_bitmap_cache;
 RD_BOOL g_bitmap_cache_persist_enable;
 RD_BOOL g_numlock_sync;
+uint32 g_motion_interval;
 RD_BOOL g_pending_resize;
 RD_BOOL g_network_error;
 time_t g_wait_for_deactivate_ts;
@@ -84,6 +89,9 @@ time_t g_reconnect_random_ts;
 RD_BOOL g_has_reconnect_random;
 uint8 g_client_random[SEC_RANDOM_SIZE];
 RD_BOOL g_local_cursor;
+RD_BOOL g_rfx;
+RD_BOOL g_nsc;
+RD_BOOL g_autodetect;
 
 /* globals from secure.c */
 char g_hostname[16];
@@ -31,6 +31,11 @@ void sec_send(STREAM s, uint32 flags)
   mock(s, flags);
 }
 
+void sec_send_fastpath_input(uint8 * data, uint32 length, uint8 num_events)
+{
+  mock(data, length, num_events);
+}
+
 void
 sec_hash_sha1_16(uint8 * out, uint8 * in, uint8 * salt1)
 {
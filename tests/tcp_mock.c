@@ -11,3 +11,37 @@ tcp_run_ui(RD_BOOL run)
 {
   mock(run);
 }
+
+void tcp_cork()
+{
+  mock();
+}
+
+void tcp_uncork()
+{
+  mock();
+}
+
+RD_BOOL
+tcp_can_send(int millis)
+{
+  return mock(millis);
+}
+
+void
+tcp_want_send(RD_BOOL want)
+{
+  mock(want);
+}
+
+RD_BOOL
+tcp_set_profile(const char *name)
+{
+  return mock(name);
+}
+
+uint32
+tcp_backlog(void)
+{
+  return mock();
+}
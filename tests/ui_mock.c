@@ -50,6 +50,11 @@ void ui_end_update()
   mock();
 }
 
+void ui_report_frame_stats()
+{
+  mock();
+}
+
 void ui_move_pointer(int x, int y)
 {
   mock(x, y);
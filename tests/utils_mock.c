@@ -13,7 +13,12 @@ void utils_calculate_dpi_scale_factors(uint32 width, uint32 height, uint32 dpi,
 				       uint32 *physwidth, uint32 *physheight,
 				       uint32 *desktopscale, uint32 *devicescale) { mock(width, height, dpi, physwidth, physheight, desktopscale, devicescale); }
 void utils_apply_session_size_limitations(uint32 *width, uint32 *height) { mock(width, height); }
+void utils_monitor_origin(RD_MONITOR *monitors, int count, sint32 *x, sint32 *y) { mock(monitors, count, x, y); }
 
-void logger(log_subject_t c, log_level_t lvl, char *format, ...) { mock(c, lvl, format); }
+log_level_t g_logger_level = Debug;
+int g_logger_subjects = ~0;
+
+void (logger)(log_subject_t c, log_level_t lvl, char *format, ...) { mock(c, lvl, format); }
+void logger_init(void) { mock(); }
 void logger_set_verbose(int verbose) { mock(verbose); }
 void logger_set_subjects(char *subjects) { mock(subjects); }
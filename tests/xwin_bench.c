@@ -0,0 +1,160 @@
+#include "../rdesktop.h"
+#include "../proto.h"
+#include "bench.h"
+
+#include <X11/Xlib.h>
+
+/* Global Variables.. :( */
+RD_BOOL g_user_quit;
+RD_BOOL g_exit_mainloop;
+
+uint32 g_requested_session_width;
+uint32 g_requested_session_height;
+window_size_type_t g_window_size_type;
+uint16 g_session_width;
+uint16 g_session_height;
+int g_xpos;
+int g_ypos;
+int g_pos;
+RD_BOOL g_sendmotion;
+RD_BOOL g_fullscreen;
+RD_BOOL g_multimon;
+int g_scale = 100;
+RD_MONITOR g_monitors[RDP_MAX_MONITORS];
+int g_num_monitors;
+RD_BOOL g_grab_keyboard;
+RD_BOOL g_hide_decorations;
+RD_BOOL g_pending_resize;
+RD_BOOL g_pending_resize_defer;
+struct timeval g_pending_resize_defer_timer;
+char g_title[64];
+char g_seamless_spawn_cmd[512];
+int g_server_depth;
+int g_win_button_size;
+RD_BOOL g_seamless_rdp;
+RD_BOOL g_seamless_persistent_mode;
+uint32 g_embed_wnd;
+Atom g_net_wm_state_atom;
+Atom g_net_wm_desktop_atom;
+Atom g_net_wm_ping_atom;
+RD_BOOL g_ownbackstore;
+RD_BOOL g_rdpsnd;
+RD_BOOL g_owncolmap;
+RD_BOOL g_local_cursor;
+char g_codepage[16];
+
+#include "../xwin.c"
+
+/* Not covered by any of the mocks, and never called here */
+void
+utils_apply_session_size_limitations(uint32 * width, uint32 * height)
+{
+	UNUSED(width);
+	UNUSED(height);
+}
+
+void
+rdpsnd_add_fds(int *n, fd_set * rfds, fd_set * wfds, struct timeval *tv)
+{
+	UNUSED(n);
+	UNUSED(rfds);
+	UNUSED(wfds);
+	UNUSED(tv);
+}
+
+void
+rdpsnd_check_fds(fd_set * rfds, fd_set * wfds)
+{
+	UNUSED(rfds);
+	UNUSED(wfds);
+}
+
+#define TILE_PIXELS	(64 * 64)
+
+typedef struct
+{
+	uint8 data[TILE_PIXELS * 3];
+	uint8 out[TILE_PIXELS * 4];
+	int out_bpp;
+}
+TRANSLATE_CORPUS;
+
+/* Pretend we are on the usual little endian X server, with a visual
+   of the given depth and pixmaps of the given bpp */
+static void
+setup_visual(int depth, int bpp, RD_BOOL compatible)
+{
+	g_host_be = False;
+	g_xserver_be = False;
+	g_depth = depth;
+	g_bpp = bpp;
+	g_compatible_arch = compatible;
+	g_no_translate_image = False;
+
+	if (depth == 16)
+	{
+		calculate_shifts(0xf800, &g_red_shift_r, &g_red_shift_l);
+		calculate_shifts(0x07e0, &g_green_shift_r, &g_green_shift_l);
+		calculate_shifts(0x001f, &g_blue_shift_r, &g_blue_shift_l);
+	}
+	else
+	{
+		calculate_shifts(0xff0000, &g_red_shift_r, &g_red_shift_l);
+		calculate_shifts(0x00ff00, &g_green_shift_r, &g_green_shift_l);
+		calculate_shifts(0x0000ff, &g_blue_shift_r, &g_blue_shift_l);
+	}
+
+	translate_select();
+}
+
+static void
+bench_translate(void *ctx)
+{
+	TRANSLATE_CORPUS *corpus = ctx;
+
+	translate_pixels(corpus->data, corpus->out,
+			 corpus->out + TILE_PIXELS * corpus->out_bpp / 8);
+}
+
+static void
+run(TRANSLATE_CORPUS * corpus, int server_depth, int bpp, RD_BOOL compatible)
+{
+	char name[64];
+
+	g_server_depth = server_depth;
+	setup_visual(bpp == 16 ? 16 : 24, bpp, compatible);
+	corpus->out_bpp = bpp;
+
+	snprintf(name, sizeof(name), "translate%dto%d%s", server_depth, bpp,
+		 compatible ? "" : "/generic");
+	bench_run(name, bench_translate, corpus, 1, TILE_PIXELS * bpp / 8);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static TRANSLATE_CORPUS corpus;
+	static const int depths[] = { 8, 15, 16, 24 };
+	static const int bpps[] = { 16, 24, 32 };
+	unsigned int i, j;
+
+	bench_init(argc, argv);
+	translate_init();
+
+	for (i = 0; i < sizeof(corpus.data); i++)
+		corpus.data[i] = bench_rand() & 0xff;
+
+	g_colmap = xmalloc(256 * sizeof(uint32));
+	for (i = 0; i < 256; i++)
+		g_colmap[i] = bench_rand() & 0xffffff;
+
+	for (i = 0; i < sizeof(depths) / sizeof(depths[0]); i++)
+		for (j = 0; j < sizeof(bpps) / sizeof(bpps[0]); j++)
+		{
+			run(&corpus, depths[i], bpps[j], True);
+			run(&corpus, depths[i], bpps[j], False);
+		}
+
+	xfree(g_colmap);
+	return 0;
+}
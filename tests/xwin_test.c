@@ -27,6 +27,10 @@ int g_ypos;
 int g_pos;
 RD_BOOL g_sendmotion;
 RD_BOOL g_fullscreen;
+RD_BOOL g_multimon;
+int g_scale = 100;
+RD_MONITOR g_monitors[RDP_MAX_MONITORS];
+int g_num_monitors;
 RD_BOOL g_grab_keyboard;
 RD_BOOL g_hide_decorations;
 RD_BOOL g_pending_resize;
@@ -146,6 +150,58 @@ int XPending(Display *display)
   return mock(display);
 }
 
+Window
+XCreateWindow(Display *display, Window parent, int x, int y,
+	      unsigned int width, unsigned int height, unsigned int border_width,
+	      int depth, unsigned int class, Visual *visual,
+	      unsigned long valuemask, XSetWindowAttributes *attributes)
+{
+  return mock(display, parent, x, y, width, height, border_width, depth,
+	      class, visual, valuemask, attributes);
+}
+
+int
+XStoreName(Display *display, Window wnd, _Xconst char *name)
+{
+  return mock(display, wnd, name);
+}
+
+void
+XSetWMClientMachine(Display *display, Window wnd, XTextProperty *prop)
+{
+  mock(display, wnd, prop);
+}
+
+Atom
+XInternAtom(Display *display, _Xconst char *name, Bool only_if_exists)
+{
+  return mock(display, name, only_if_exists);
+}
+
+void
+XSetWMNormalHints(Display *display, Window wnd, XSizeHints *hints)
+{
+  mock(display, wnd, hints);
+}
+
+int
+XSelectInput(Display *display, Window wnd, long mask)
+{
+  return mock(display, wnd, mask);
+}
+
+Status
+XSetWMProtocols(Display *display, Window wnd, Atom *protocols, int count)
+{
+  return mock(display, wnd, protocols, count);
+}
+
+int
+XSetWMHints(Display *display, Window wnd, XWMHints *hints)
+{
+  return mock(display, wnd, hints);
+}
+
 /* Test functions */
 
 Ensure(XWIN, UiResizeWindowCallsXResizeWindow) {
@@ -165,6 +221,40 @@ Ensure(XWIN, UiResizeWindowCallsXResizeWindow) {
   ui_resize_window(width, height);
 }
 
+Ensure(XWIN, UiSeamlessCreateWindowCanBeLookedUp) {
+  Screen screen;
+  seamless_window *sw;
+
+  memset(&screen, 0, sizeof(screen));
+  g_screen = &screen;
+  g_seamless_active = True;
+
+  /* stubs */
+  expect(ewmh_set_wm_pid);
+  expect(ewmh_set_wm_pid);
+  expect(XSetWMClientMachine);
+  expect(XStoreName);
+  expect(ewmh_set_wm_name);
+  expect(XInternAtom, will_return(None));
+  expect(XAllocClassHint, will_return(NULL));
+  expect(XSetWMNormalHints);
+  expect(XSelectInput);
+  expect(XSetWMProtocols);
+  expect(XSetWMHints);
+
+  /* the window itself, then the one of its group */
+  expect(XCreateWindow, will_return(0x200));
+  expect(XCreateWindow, will_return(0x100));
+
+  ui_seamless_create_window(0x42, 0x7, 0, 0);
+
+  sw = sw_get_window_by_id(0x42);
+  assert_that(sw, is_non_null);
+  assert_that(sw->wnd, is_equal_to(0x200));
+  assert_that(sw_get_window_by_wnd(0x200), is_equal_to(sw));
+  assert_that(sw_get_window_by_id(0x43), is_null);
+}
+
 /* FIXME: This test is broken */
 #if 0
 Ensure(XWIN, UiSelectCallsProcessPendingResizeIfGPendingResizeIsTrue)
@@ -174,7 +264,6 @@ Ensure(XWIN, UiSelectCallsProcessPendingResizeIfGPendingResizeIsTrue)
   expect(rdpdr_add_fds);
   expect(rdpdr_check_fds);
 
-  expect(ctrl_add_fds);
   expect(ctrl_check_fds);
 
   expect(seamless_select_timeout);
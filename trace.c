@@ -0,0 +1,168 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Tracing of the stages a frame goes through
+   Copyright 2026 the rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Only built with ./configure --enable-trace. Each TRACE_SCOPE()
+   records when its block started and how long it took into a ring of
+   the most recent events, which the bitmap worker threads write to as
+   well without taking a lock. The ring is written out in the Chrome
+   trace event format, for chrome://tracing or Perfetto, on the
+   trace.dump control command or on SIGUSR2. */
+
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include "rdesktop.h"
+
+#define TRACE_RING_SIZE	65536	/* events, a power of two */
+
+typedef struct trace_event
+{
+	uint64 seq;		/* index + 1 once written, 0 before */
+	uint64 start;		/* ns */
+	uint32 duration;	/* ns */
+	uint16 stage;
+	uint16 thread;
+} trace_event;
+
+static const char *trace_stage_names[TRACE_STAGES] = {
+	"tcp_recv",
+	"sec_recv",
+	"mppc_expand",
+	"process_orders",
+	"bitmap_decompress",
+	"translate_image",
+	"ui_end_update"
+};
+
+static trace_event g_trace_ring[TRACE_RING_SIZE];
+static uint64 g_trace_head;
+static uint16 g_trace_threads;
+static __thread uint16 g_trace_thread;
+static volatile sig_atomic_t g_trace_dump_requested;
+
+uint64
+trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Record the event of a scope leaving, called by the compiler */
+void
+trace_scope_end(trace_scope * scope)
+{
+	trace_event *ev;
+	uint64 index;
+
+	if (g_trace_thread == 0)
+		g_trace_thread = __atomic_add_fetch(&g_trace_threads, 1, __ATOMIC_RELAXED);
+
+	index = __atomic_fetch_add(&g_trace_head, 1, __ATOMIC_RELAXED);
+	ev = &g_trace_ring[index & (TRACE_RING_SIZE - 1)];
+
+	/* a reader skips the slot while it is being written */
+	__atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	ev->start = scope->start;
+	ev->duration = (uint32) MIN(trace_now() - scope->start, 0xffffffff);
+	ev->stage = scope->stage;
+	ev->thread = g_trace_thread;
+	__atomic_store_n(&ev->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+/* Write the events in the ring to path, returns the number written or
+   -1 if the file could not be created */
+int
+trace_dump(const char *path)
+{
+	trace_event ev, *slot;
+	uint64 head, index, first;
+	int count = 0;
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	if (fp == NULL)
+	{
+		logger(Core, Error, "trace_dump(), failed to create '%s': %s", path,
+		       strerror(errno));
+		return -1;
+	}
+
+	head = __atomic_load_n(&g_trace_head, __ATOMIC_ACQUIRE);
+	first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+	fprintf(fp, "{\"traceEvents\":[\n");
+	for (index = first; index < head; index++)
+	{
+		slot = &g_trace_ring[index & (TRACE_RING_SIZE - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != index + 1)
+			continue;
+		ev = *slot;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != index + 1)
+			continue;
+
+		fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"rdesktop\",\"ph\":\"X\","
+			"\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+			count ? ",\n" : "", trace_stage_names[ev.stage], ev.start / 1000.0,
+			ev.duration / 1000.0, (int) getpid(), ev.thread);
+		count++;
+	}
+	fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	fclose(fp);
+
+	logger(Core, Notice, "Wrote %d trace events to %s", count, path);
+	return count;
+}
+
+static void
+trace_signal_handler(int sig)
+{
+	UNUSED(sig);
+	g_trace_dump_requested = 1;
+}
+
+void
+trace_init(void)
+{
+	struct sigaction act;
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = trace_signal_handler;
+	sigemptyset(&act.sa_mask);
+	sigaction(SIGUSR2, &act, NULL);
+}
+
+/* Dump the ring if SIGUSR2 asked for it, from the main loop where it
+   is safe to */
+void
+trace_check_signal(void)
+{
+	char path[PATH_MAX];
+
+	if (!g_trace_dump_requested)
+		return;
+	g_trace_dump_requested = 0;
+
+	snprintf(path, sizeof(path), "/tmp/rdesktop-trace.%d.json", (int) getpid());
+	trace_dump(path);
+}
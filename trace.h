@@ -0,0 +1,57 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Tracing of the stages a frame goes through
+   Copyright 2026 the rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+typedef enum trace_stage_t
+{
+	TRACE_TCP_RECV = 0,
+	TRACE_SEC_RECV,
+	TRACE_MPPC_EXPAND,
+	TRACE_PROCESS_ORDERS,
+	TRACE_BITMAP_DECOMPRESS,
+	TRACE_TRANSLATE_IMAGE,
+	TRACE_UI_END_UPDATE,
+	TRACE_STAGES
+} trace_stage_t;
+
+#ifdef WITH_TRACE
+
+typedef struct trace_scope
+{
+	trace_stage_t stage;
+	uint64 start;
+} trace_scope;
+
+uint64 trace_now(void);
+void trace_scope_end(trace_scope * scope);
+
+/* Times the rest of the enclosing block, put it last among the
+   declarations */
+#define TRACE_SCOPE(stage) \
+	trace_scope _trace_scope __attribute__ ((cleanup(trace_scope_end))) = { stage, trace_now() }
+
+#else
+
+#define TRACE_SCOPE(stage)
+
+#endif /* WITH_TRACE */
+
+#endif /* _TRACE_H */
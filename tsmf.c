@@ -0,0 +1,1366 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Video Optimized Remoting Virtual Channel Extension
+   Copyright 2026 the rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Media players on the server that play through Media Foundation or
+   DirectShow can hand the compressed streams to the client over the
+   TSMF channel (MS-RDPEV), rather than have the server decode them and
+   send the pictures as bitmaps. The channel is opened once for control
+   and once more for every stream. Video is decoded with libavcodec, on
+   the GPU through VA-API when a device is available, and painted into
+   the visible parts of the video window the server describes. Audio is
+   decoded to PCM and played through rdpsnd, and the pictures are shown
+   when the sound of the same time is heard. */
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/hwcontext.h>
+
+#include "rdesktop.h"
+
+#define TSMF_CHANNEL_NAME	"TSMF"
+
+/* InterfaceId, the top bits tell requests from responses */
+#define TSMF_INTERFACE_DEFAULT			0x00000000
+#define TSMF_INTERFACE_CLIENT_NOTIFICATIONS	0x00000001
+#define TSMF_INTERFACE_CAPABILITIES		0x00000002
+#define STREAM_ID_NONE				0x00000000
+#define STREAM_ID_PROXY				0x40000000
+#define STREAM_ID_STUB				0x80000000
+#define STREAM_ID_MASK				0xc0000000
+
+/* FunctionId */
+#define RIMCALL_RELEASE			0x00000001
+#define RIMCALL_QUERYINTERFACE		0x00000002
+#define RIM_EXCHANGE_CAPABILITY_REQUEST	0x00000100
+#define EXCHANGE_CAPABILITIES_REQ	0x00000100
+#define SET_CHANNEL_PARAMS		0x00000101
+#define ADD_STREAM			0x00000102
+#define ON_SAMPLE			0x00000103
+#define SET_VIDEO_WINDOW		0x00000104
+#define ON_NEW_PRESENTATION		0x00000105
+#define SHUTDOWN_PRESENTATION_REQ	0x00000106
+#define SET_TOPOLOGY_REQ		0x00000107
+#define CHECK_FORMAT_SUPPORT_REQ	0x00000108
+#define ON_PLAYBACK_STARTED		0x00000109
+#define ON_PLAYBACK_PAUSED		0x0000010a
+#define ON_PLAYBACK_STOPPED		0x0000010b
+#define ON_PLAYBACK_RESTARTED		0x0000010c
+#define ON_PLAYBACK_RATE_CHANGED	0x0000010d
+#define ON_FLUSH			0x0000010e
+#define ON_STREAM_VOLUME		0x0000010f
+#define ON_CHANNEL_VOLUME		0x00000110
+#define ON_END_OF_STREAM		0x00000111
+#define SET_ALLOCATOR			0x00000112
+#define NOTIFY_PREROLL			0x00000113
+#define UPDATE_GEOMETRY_INFO		0x00000114
+#define REMOVE_STREAM			0x00000115
+#define SET_SOURCE_VIDEO_RECT		0x00000116
+#define PLAYBACK_ACK			0x00000100
+#define CLIENT_EVENT_NOTIFICATION	0x00000101
+
+#define TSMM_CLIENT_EVENT_ENDOFSTREAM		0x0064
+#define TSMM_CLIENT_EVENT_STOP_COMPLETED	0x00c8
+#define TSMM_CLIENT_EVENT_START_COMPLETED	0x00c9
+
+/* TSMM_CAPABILITIES */
+#define TSMM_CAPABILITY_TYPE_VERSION		0x00000001
+#define TSMM_CAPABILITY_TYPE_PLATFORM		0x00000002
+#define TSMM_CAPABILITY_TYPE_AUDIO		0x00000003
+#define MMREDIR_CAPABILITY_PLATFORM_MF		0x00000001
+#define MMREDIR_CAPABILITY_PLATFORM_DSHOW	0x00000002
+#define MMREDIR_CAPABILITY_AUDIOSUPPORT		0x00000001
+#define RIM_CAPABILITY_VERSION_01		0x00000001
+
+/* Decoded pictures waiting for their time */
+#define TSMF_MAX_PICTURES	8
+/* Pictures later than this are dropped rather than shown, in 100 ns */
+#define TSMF_LATE		(100 * 10000)
+#define TSMF_MAX_RECTS		16
+/* Largest video window side taken from the server */
+#define TSMF_MAX_SIZE		0x7fff
+
+typedef struct
+{
+	sint32 x, y, cx, cy;
+}
+TSMF_RECT;
+
+typedef struct
+{
+	uint8 *data;		/* 32 bpp, width * height */
+	int width, height;
+	sint64 time;		/* 100 ns */
+	/* the sample is acknowledged when its picture has been shown */
+	uint32 channel_id, stream_id;
+	uint64 duration, size;
+}
+TSMF_PICTURE;
+
+typedef struct tsmf_stream
+{
+	uint32 id;
+	RD_BOOL video;
+	AVCodecContext *ctx;
+	AVFrame *frame, *sw_frame;
+	AVPacket *packet;
+	uint8 *buffer;
+	int buffer_size;
+	RD_BOOL pcm;		/* audio that needs no decoding */
+	uint16 pcm_channels;	/* of the PCM as sent */
+	RD_WAVEFORMATEX format;	/* of the PCM played */
+	uint32 channel_id;	/* samples came in on */
+	struct tsmf_stream *next;
+}
+TSMF_STREAM;
+
+typedef struct tsmf_presentation
+{
+	uint8 id[16];
+	TSMF_STREAM *streams;
+
+	/* video window, on the session */
+	sint32 x, y, width, height;
+	TSMF_RECT rects[TSMF_MAX_RECTS];	/* visible, within the window */
+	int nrects;
+
+	/* media clock, in 100 ns; from the sound heard while there is
+	   audio, and from the wall clock otherwise */
+	RD_BOOL clock_set, paused;
+	sint64 clock_base;
+	uint64 clock_wall;	/* ms, when the clock was at clock_base */
+	sint64 audio_end;	/* time of the end of the sound queued, 0 if none */
+	RD_BOOL muted;
+
+	TSMF_PICTURE pictures[TSMF_MAX_PICTURES];
+	int npictures;
+
+	struct tsmf_presentation *next;
+}
+TSMF_PRESENTATION;
+
+static TSMF_PRESENTATION *tsmf_presentations;
+static AVBufferRef *tsmf_hw_device;
+static RD_BOOL tsmf_hw_tried;
+
+extern int g_server_depth;
+extern uint16 g_session_width;
+extern uint16 g_session_height;
+
+/* Subtypes and formats come as GUIDs, those of most of the codecs are
+   a FOURCC or wave format tag followed by this */
+static const uint8 tsmf_guid_base[12] = {
+	0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71
+};
+
+static const uint8 tsmf_mediatype_video[16] = {
+	0x76, 0x69, 0x64, 0x73, 0x00, 0x00, 0x10, 0x00,
+	0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71
+};
+
+static const uint8 tsmf_mediatype_audio[16] = {
+	0x61, 0x75, 0x64, 0x73, 0x00, 0x00, 0x10, 0x00,
+	0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71
+};
+
+static const uint8 tsmf_subtype_mpeg2video[16] = {
+	0x26, 0x80, 0x6d, 0xe0, 0x46, 0xdb, 0xcf, 0x11,
+	0xb4, 0xd1, 0x00, 0x80, 0x5f, 0x6c, 0xbb, 0xea
+};
+
+static const uint8 tsmf_format_videoinfo[16] = {
+	0x80, 0x9f, 0x58, 0x05, 0x56, 0xc3, 0xce, 0x11,
+	0xbf, 0x01, 0x00, 0xaa, 0x00, 0x55, 0x59, 0x5a
+};
+
+static const uint8 tsmf_format_videoinfo2[16] = {
+	0xa0, 0x76, 0x2a, 0xf7, 0x0a, 0xeb, 0xd0, 0x11,
+	0xac, 0xe4, 0x00, 0x00, 0xc0, 0xcc, 0x16, 0xba
+};
+
+static const uint8 tsmf_format_mpeg2video[16] = {
+	0xe3, 0x80, 0x6d, 0xe0, 0x46, 0xdb, 0xcf, 0x11,
+	0xb4, 0xd1, 0x00, 0x80, 0x5f, 0x6c, 0xbb, 0xea
+};
+
+static const uint8 tsmf_format_waveformatex[16] = {
+	0x81, 0x9f, 0x58, 0x05, 0x56, 0xc3, 0xce, 0x11,
+	0xbf, 0x01, 0x00, 0xaa, 0x00, 0x55, 0x59, 0x5a
+};
+
+static const uint8 tsmf_format_mfvideoformat[16] = {
+	0x2d, 0xab, 0xd4, 0xae, 0x26, 0x73, 0xcb, 0x43,
+	0x94, 0x64, 0xc8, 0x79, 0xca, 0xb9, 0xc4, 0x3d
+};
+
+#define FOURCC(a, b, c, d)	((uint32) (a) | ((uint32) (b) << 8) | \
+				 ((uint32) (c) << 16) | ((uint32) (d) << 24))
+
+/* A TS_AM_MEDIA_TYPE, what the codec is and how to set it up */
+typedef struct
+{
+	RD_BOOL video;
+	enum AVCodecID codec;
+	RD_BOOL pcm;
+	uint16 channels, bits, block_align;
+	uint32 rate, bit_rate;
+	uint8 *extra;
+	uint32 extra_size;
+}
+TSMF_MEDIA_TYPE;
+
+static uint64
+tsmf_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static enum AVCodecID
+tsmf_video_codec(uint32 fourcc)
+{
+	switch (fourcc)
+	{
+		case FOURCC('H', '2', '6', '4'):
+		case FOURCC('h', '2', '6', '4'):
+		case FOURCC('X', '2', '6', '4'):
+		case FOURCC('x', '2', '6', '4'):
+		case FOURCC('A', 'V', 'C', '1'):
+		case FOURCC('a', 'v', 'c', '1'):
+			return AV_CODEC_ID_H264;
+		case FOURCC('W', 'V', 'C', '1'):
+		case FOURCC('w', 'v', 'c', '1'):
+			return AV_CODEC_ID_VC1;
+		case FOURCC('W', 'M', 'V', '3'):
+			return AV_CODEC_ID_WMV3;
+		case FOURCC('W', 'M', 'V', '2'):
+			return AV_CODEC_ID_WMV2;
+		case FOURCC('W', 'M', 'V', '1'):
+			return AV_CODEC_ID_WMV1;
+		case FOURCC('M', 'P', '4', 'V'):
+		case FOURCC('m', 'p', '4', 'v'):
+		case FOURCC('M', '4', 'S', '2'):
+		case FOURCC('X', 'V', 'I', 'D'):
+		case FOURCC('D', 'X', '5', '0'):
+			return AV_CODEC_ID_MPEG4;
+		case FOURCC('M', 'P', '4', '2'):
+			return AV_CODEC_ID_MSMPEG4V2;
+		case FOURCC('M', 'P', '4', '3'):
+			return AV_CODEC_ID_MSMPEG4V3;
+		case FOURCC('M', 'J', 'P', 'G'):
+			return AV_CODEC_ID_MJPEG;
+	}
+	return AV_CODEC_ID_NONE;
+}
+
+static enum AVCodecID
+tsmf_audio_codec(uint32 tag)
+{
+	switch (tag)
+	{
+		case 0x0050:
+			return AV_CODEC_ID_MP2;
+		case 0x0055:
+			return AV_CODEC_ID_MP3;
+		case 0x00ff:
+		case 0x1610:
+			return AV_CODEC_ID_AAC;
+		case 0x0160:
+			return AV_CODEC_ID_WMAV1;
+		case 0x0161:
+			return AV_CODEC_ID_WMAV2;
+		case 0x0162:
+			return AV_CODEC_ID_WMAPRO;
+		case 0x2000:
+			return AV_CODEC_ID_AC3;
+	}
+	return AV_CODEC_ID_NONE;
+}
+
+/* Read a TS_AM_MEDIA_TYPE, False if it is not one that can be played */
+static RD_BOOL
+tsmf_read_media_type(STREAM s, TSMF_MEDIA_TYPE * mt)
+{
+	uint8 major[16], subtype[16], format[16];
+	uint32 cb_format, offset, tag;
+	uint8 *pb_format;
+	uint16 cb_size;
+
+	memset(mt, 0, sizeof(*mt));
+	mt->codec = AV_CODEC_ID_NONE;
+
+	if (!s_check_rem(s, 16 + 16 + 12 + 16 + 4))
+		return False;
+	in_uint8a(s, major, 16);
+	in_uint8a(s, subtype, 16);
+	in_uint8s(s, 12);	/* bFixedSizeSamples, bTemporalCompression, SampleSize */
+	in_uint8a(s, format, 16);
+	in_uint32_le(s, cb_format);
+	if (!s_check_rem(s, cb_format))
+		return False;
+	in_uint8p(s, pb_format, cb_format);
+
+	tag = pb_format != NULL && memcmp(subtype + 4, tsmf_guid_base, 12) == 0 ?
+		subtype[0] | (subtype[1] << 8) | (subtype[2] << 16) | ((uint32) subtype[3] << 24) : 0;
+
+	if (memcmp(major, tsmf_mediatype_video, 16) == 0)
+	{
+		mt->video = True;
+		if (memcmp(subtype, tsmf_subtype_mpeg2video, 16) == 0)
+			mt->codec = AV_CODEC_ID_MPEG2VIDEO;
+		else
+			mt->codec = tsmf_video_codec(tag);
+
+		/* the codec private data follows the format structure */
+		offset = 0;
+		if (memcmp(format, tsmf_format_videoinfo, 16) == 0)
+			offset = 88;
+		else if (memcmp(format, tsmf_format_videoinfo2, 16) == 0)
+			offset = 112;
+		else if (memcmp(format, tsmf_format_mfvideoformat, 16) == 0)
+			offset = 176;
+		else if (memcmp(format, tsmf_format_mpeg2video, 16) == 0 && cb_format >= 132)
+		{
+			/* the sequence header of an MPEG2VIDEOINFO */
+			mt->extra = pb_format + 132;
+			mt->extra_size = MIN(cb_format - 132,
+					     (uint32) pb_format[116] | (pb_format[117] << 8) |
+					     (pb_format[118] << 16) | ((uint32) pb_format[119] << 24));
+		}
+		if (offset != 0 && cb_format > offset)
+		{
+			mt->extra = pb_format + offset;
+			mt->extra_size = cb_format - offset;
+		}
+	}
+	else if (memcmp(major, tsmf_mediatype_audio, 16) == 0)
+	{
+		if (memcmp(format, tsmf_format_waveformatex, 16) != 0 || cb_format < 18)
+			return False;
+
+		/* WAVEFORMATEX */
+		mt->channels = pb_format[2] | (pb_format[3] << 8);
+		mt->rate = pb_format[4] | (pb_format[5] << 8) | (pb_format[6] << 16) |
+			((uint32) pb_format[7] << 24);
+		mt->bit_rate = 8 * (pb_format[8] | (pb_format[9] << 8) | (pb_format[10] << 16) |
+				    ((uint32) pb_format[11] << 24));
+		mt->block_align = pb_format[12] | (pb_format[13] << 8);
+		mt->bits = pb_format[14] | (pb_format[15] << 8);
+		cb_size = pb_format[16] | (pb_format[17] << 8);
+
+		mt->extra = pb_format + 18;
+		mt->extra_size = MIN(cb_size, cb_format - 18);
+		/* an HEAACWAVEINFO comes before the AudioSpecificConfig */
+		if (tag == 0x1610)
+		{
+			mt->extra_size = mt->extra_size > 12 ? mt->extra_size - 12 : 0;
+			mt->extra += 12;
+		}
+
+		if (tag == 0x0001 && mt->bits == 16)
+			mt->pcm = True;
+		else
+			mt->codec = tsmf_audio_codec(tag);
+	}
+	else
+		return False;
+
+	if (mt->extra_size == 0)
+		mt->extra = NULL;
+
+	if (mt->pcm)
+		return mt->channels != 0 && mt->rate != 0;
+#ifndef WITH_RDPSND
+	if (!mt->video)
+		return False;
+#endif
+	return mt->codec != AV_CODEC_ID_NONE && avcodec_find_decoder(mt->codec) != NULL;
+}
+
+static enum AVPixelFormat
+tsmf_get_format(AVCodecContext * ctx, const enum AVPixelFormat *formats)
+{
+	const enum AVPixelFormat *f;
+
+	if (ctx->hw_device_ctx != NULL)
+	{
+		for (f = formats; *f != AV_PIX_FMT_NONE; f++)
+			if (*f == AV_PIX_FMT_VAAPI)
+				return *f;
+	}
+	return avcodec_default_get_format(ctx, formats);
+}
+
+static void
+tsmf_stream_free(TSMF_STREAM * stream)
+{
+	avcodec_free_context(&stream->ctx);
+	av_frame_free(&stream->frame);
+	av_frame_free(&stream->sw_frame);
+	av_packet_free(&stream->packet);
+	xfree(stream->buffer);
+	xfree(stream);
+}
+
+static TSMF_STREAM *
+tsmf_stream_new(uint32 id, TSMF_MEDIA_TYPE * mt)
+{
+	const AVCodec *codec;
+	TSMF_STREAM *stream;
+
+	stream = xmalloc(sizeof(TSMF_STREAM));
+	memset(stream, 0, sizeof(TSMF_STREAM));
+	stream->id = id;
+	stream->video = mt->video;
+	stream->pcm = mt->pcm;
+	stream->pcm_channels = mt->channels;
+
+	if (!mt->video)
+	{
+		stream->format.wFormatTag = WAVE_FORMAT_PCM;
+		stream->format.nChannels = MIN(mt->channels, 2);
+		stream->format.nSamplesPerSec = mt->rate;
+		stream->format.wBitsPerSample = 16;
+		stream->format.nBlockAlign = stream->format.nChannels * 2;
+		stream->format.nAvgBytesPerSec = stream->format.nBlockAlign * mt->rate;
+	}
+	if (mt->pcm)
+		return stream;
+
+	if (mt->video && !tsmf_hw_tried)
+	{
+		tsmf_hw_tried = True;
+		if (av_hwdevice_ctx_create(&tsmf_hw_device, AV_HWDEVICE_TYPE_VAAPI, NULL, NULL, 0)
+		    < 0)
+			tsmf_hw_device = NULL;
+		logger(Graphics, Verbose, "tsmf_stream_new(), decoding video %s",
+		       tsmf_hw_device != NULL ? "with VA-API" : "in software");
+	}
+
+	codec = avcodec_find_decoder(mt->codec);
+	stream->ctx = avcodec_alloc_context3(codec);
+	stream->frame = av_frame_alloc();
+	stream->sw_frame = av_frame_alloc();
+	stream->packet = av_packet_alloc();
+	if (stream->ctx == NULL || stream->frame == NULL || stream->sw_frame == NULL
+	    || stream->packet == NULL)
+		goto fail;
+
+	if (mt->extra != NULL)
+	{
+		stream->ctx->extradata = av_mallocz(mt->extra_size + AV_INPUT_BUFFER_PADDING_SIZE);
+		if (stream->ctx->extradata == NULL)
+			goto fail;
+		memcpy(stream->ctx->extradata, mt->extra, mt->extra_size);
+		stream->ctx->extradata_size = mt->extra_size;
+	}
+
+	if (mt->video)
+	{
+		stream->ctx->get_format = tsmf_get_format;
+		if (tsmf_hw_device != NULL)
+			stream->ctx->hw_device_ctx = av_buffer_ref(tsmf_hw_device);
+	}
+	else
+	{
+		av_channel_layout_default(&stream->ctx->ch_layout, mt->channels);
+		stream->ctx->sample_rate = mt->rate;
+		stream->ctx->bit_rate = mt->bit_rate;
+		stream->ctx->block_align = mt->block_align;
+		stream->ctx->bits_per_coded_sample = mt->bits;
+	}
+
+	if (avcodec_open2(stream->ctx, codec, NULL) < 0)
+		goto fail;
+
+	return stream;
+
+fail:
+	logger(Graphics, Error, "tsmf_stream_new(), failed to set up %s decoder",
+	       avcodec_get_name(mt->codec));
+	tsmf_stream_free(stream);
+	return NULL;
+}
+
+static TSMF_PRESENTATION *
+tsmf_get_presentation(uint8 * id)
+{
+	TSMF_PRESENTATION *p;
+
+	for (p = tsmf_presentations; p != NULL; p = p->next)
+		if (memcmp(p->id, id, 16) == 0)
+			return p;
+	return NULL;
+}
+
+static TSMF_STREAM *
+tsmf_get_stream(TSMF_PRESENTATION * p, uint32 id)
+{
+	TSMF_STREAM *stream;
+
+	if (p == NULL)
+		return NULL;
+	for (stream = p->streams; stream != NULL; stream = stream->next)
+		if (stream->id == id)
+			return stream;
+	return NULL;
+}
+
+static STREAM
+tsmf_init_reply(uint32 interface_id, uint32 message_id, size_t length)
+{
+	STREAM s;
+
+	s = s_alloc(8 + length);
+	out_uint32_le(s, (interface_id & ~STREAM_ID_MASK) | STREAM_ID_STUB);
+	out_uint32_le(s, message_id);
+	return s;
+}
+
+static void
+tsmf_send(uint32 channel_id, STREAM s)
+{
+	s_mark_end(s);
+	dvc_send_to(channel_id, s);
+	s_free(s);
+}
+
+static void
+tsmf_send_notification(uint32 channel_id, uint32 function, uint32 stream_id, uint32 event)
+{
+	STREAM s;
+
+	s = s_alloc(24);
+	out_uint32_le(s, TSMF_INTERFACE_CLIENT_NOTIFICATIONS | STREAM_ID_PROXY);
+	out_uint32_le(s, 0);	/* MessageId */
+	out_uint32_le(s, function);
+	out_uint32_le(s, stream_id);
+	out_uint32_le(s, event);	/* EventId */
+	out_uint32_le(s, 0);	/* cbData */
+	tsmf_send(channel_id, s);
+}
+
+/* Tell the server a sample has been played, which lets it send more */
+static void
+tsmf_send_ack(uint32 channel_id, uint32 stream_id, uint64 duration, uint64 size)
+{
+	STREAM s;
+
+	s = s_alloc(32);
+	out_uint32_le(s, TSMF_INTERFACE_CLIENT_NOTIFICATIONS | STREAM_ID_PROXY);
+	out_uint32_le(s, 0);	/* MessageId */
+	out_uint32_le(s, PLAYBACK_ACK);
+	out_uint32_le(s, stream_id);
+	out_uint64_le(s, duration);	/* DataDuration */
+	out_uint64_le(s, size);	/* cbData */
+	tsmf_send(channel_id, s);
+}
+
+/* The media time of the presentation now */
+static sint64
+tsmf_clock(TSMF_PRESENTATION * p)
+{
+	uint64 now = tsmf_now();
+#ifdef WITH_RDPSND
+	unsigned int delay;
+
+	/* while sound is queued, it is the clock, and the wall clock
+	   follows on from it when it runs out */
+	if (p->audio_end != 0 && !p->paused)
+	{
+		delay = rdpsnd_queue_delay();
+		if (delay != 0)
+		{
+			p->clock_base = p->audio_end - (sint64) delay * 10000;
+			p->clock_wall = now;
+			p->clock_set = True;
+		}
+	}
+#endif
+	if (p->paused)
+		return p->clock_base;
+	return p->clock_base + (sint64) (now - p->clock_wall) * 10000;
+}
+
+static void
+tsmf_set_clock(TSMF_PRESENTATION * p, sint64 time)
+{
+	p->clock_base = time;
+	p->clock_wall = tsmf_now();
+	p->clock_set = True;
+}
+
+static void
+tsmf_drop_pictures(TSMF_PRESENTATION * p, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		tsmf_send_ack(p->pictures[i].channel_id, p->pictures[i].stream_id,
+			      p->pictures[i].duration, p->pictures[i].size);
+		xfree(p->pictures[i].data);
+	}
+	memmove(p->pictures, p->pictures + n, (p->npictures - n) * sizeof(TSMF_PICTURE));
+	p->npictures -= n;
+}
+
+static inline uint8
+tsmf_clamp(int v)
+{
+	return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+/* Convert a decoded picture to 32 bpp, limited range BT.601 */
+static RD_BOOL
+tsmf_convert_picture(AVFrame * f, uint8 * out)
+{
+	uint8 *py, *pu, *pv, *o;
+	int x, y, c, d, e, step;
+
+	if (f->format != AV_PIX_FMT_YUV420P && f->format != AV_PIX_FMT_YUVJ420P &&
+	    f->format != AV_PIX_FMT_NV12)
+		return False;
+
+	o = out;
+	for (y = 0; y < f->height; y++)
+	{
+		py = f->data[0] + y * f->linesize[0];
+		pu = f->data[1] + (y / 2) * f->linesize[1];
+		if (f->format == AV_PIX_FMT_NV12)
+		{
+			pv = pu + 1;
+			step = 2;
+		}
+		else
+		{
+			pv = f->data[2] + (y / 2) * f->linesize[2];
+			step = 1;
+		}
+
+		for (x = 0; x < f->width; x++)
+		{
+			c = 298 * (py[x] - 16);
+			d = pu[(x / 2) * step] - 128;
+			e = pv[(x / 2) * step] - 128;
+			o[0] = tsmf_clamp((c + 516 * d + 128) >> 8);
+			o[1] = tsmf_clamp((c - 100 * d - 208 * e + 128) >> 8);
+			o[2] = tsmf_clamp((c + 409 * e + 128) >> 8);
+			o[3] = 0xff;
+			o += 4;
+		}
+	}
+	return True;
+}
+
+/* Paint a picture scaled to the video window, within what is visible
+   of it, in the pixel format of the session */
+static void
+tsmf_paint(TSMF_PRESENTATION * p, TSMF_PICTURE * pic)
+{
+	static RD_BOOL warned;
+	uint8 *pixels, *out, *in;
+	int bpp, i, x, y, sx, sy, cx, cy;
+	sint64 x0, y0, x1, y1;
+	uint16 v;
+	TSMF_RECT *r;
+
+	if (p->width <= 0 || p->height <= 0 || p->nrects == 0)
+		return;
+
+	bpp = (g_server_depth + 7) / 8;
+	if (bpp < 2)
+	{
+		if (!warned)
+			logger(Graphics, Warning,
+			       "tsmf_paint(), redirected video needs a colour depth over 8 bits");
+		warned = True;
+		return;
+	}
+
+	for (i = 0; i < p->nrects; i++)
+	{
+		r = &p->rects[i];
+
+		/* within the window, and then the session, the window
+		   itself may lie partly outside */
+		x0 = MAX(r->x, MAX(0, -(sint64) p->x));
+		y0 = MAX(r->y, MAX(0, -(sint64) p->y));
+		x1 = MIN((sint64) r->x + r->cx, MIN(p->width, (sint64) g_session_width - p->x));
+		y1 = MIN((sint64) r->y + r->cy, MIN(p->height, (sint64) g_session_height - p->y));
+		if (x1 <= x0 || y1 <= y0)
+			continue;
+		cx = x1 - x0;
+		cy = y1 - y0;
+
+		pixels = xmalloc((size_t) cx * cy * bpp);
+		out = pixels;
+		for (y = 0; y < cy; y++)
+		{
+			sy = (y0 + y) * pic->height / p->height;
+			for (x = 0; x < cx; x++)
+			{
+				sx = (x0 + x) * pic->width / p->width;
+				in = pic->data + (sy * pic->width + sx) * 4;
+				switch (g_server_depth)
+				{
+					case 15:
+						v = ((in[2] >> 3) << 10) | ((in[1] >> 3) << 5) |
+							(in[0] >> 3);
+						out[0] = v;
+						out[1] = v >> 8;
+						break;
+					case 16:
+						v = ((in[2] >> 3) << 11) | ((in[1] >> 2) << 5) |
+							(in[0] >> 3);
+						out[0] = v;
+						out[1] = v >> 8;
+						break;
+					default:
+						memcpy(out, in, bpp);
+						break;
+				}
+				out += bpp;
+			}
+		}
+
+		ui_paint_bitmap(p->x + x0, p->y + y0, cx, cy, cx, cy, pixels);
+		xfree(pixels);
+	}
+}
+
+/* Paint the pictures that are due, returns the ms until the next one
+   is, or -1 if there is none waiting */
+int
+tsmf_present(void)
+{
+	TSMF_PRESENTATION *p;
+	sint64 now;
+	int timeout, ms, due;
+
+	timeout = -1;
+	for (p = tsmf_presentations; p != NULL; p = p->next)
+	{
+		if (p->npictures == 0)
+			continue;
+
+		if (!p->clock_set)
+			tsmf_set_clock(p, p->pictures[0].time);
+		now = tsmf_clock(p);
+
+		/* of the pictures due, only the last is shown */
+		for (due = 0; due < p->npictures && p->pictures[due].time <= now; due++);
+		if (due > 0)
+		{
+			if (now - p->pictures[due - 1].time < TSMF_LATE || due == 1)
+			{
+				ui_begin_update();
+				tsmf_paint(p, &p->pictures[due - 1]);
+				ui_end_update();
+			}
+			tsmf_drop_pictures(p, due);
+		}
+
+		if (p->npictures == 0 || p->paused)
+			continue;
+		ms = (p->pictures[0].time - now) / 10000 + 1;
+		if (timeout == -1 || ms < timeout)
+			timeout = ms;
+	}
+
+	return timeout;
+}
+
+/* Decode a sample, the pictures are queued and the sound played */
+static void
+tsmf_decode(TSMF_PRESENTATION * p, TSMF_STREAM * stream, uint8 * data, uint32 size,
+	    sint64 start, sint64 end)
+{
+	AVFrame *f;
+	TSMF_PICTURE *pic;
+	RD_BOOL shown = False;
+	int ret;
+
+	if (stream->buffer_size < (int) size + AV_INPUT_BUFFER_PADDING_SIZE)
+	{
+		stream->buffer_size = size + AV_INPUT_BUFFER_PADDING_SIZE;
+		stream->buffer = xrealloc(stream->buffer, stream->buffer_size);
+	}
+	memcpy(stream->buffer, data, size);
+	memset(stream->buffer + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+	stream->packet->data = stream->buffer;
+	stream->packet->size = size;
+	stream->packet->pts = start;
+	if (avcodec_send_packet(stream->ctx, stream->packet) < 0)
+		logger(Graphics, Warning, "tsmf_decode(), decoder rejected sample");
+
+	while ((ret = avcodec_receive_frame(stream->ctx, stream->frame)) == 0)
+	{
+		if (!stream->video)
+		{
+#ifdef WITH_RDPSND
+			int i, c, sc, n, channels, decoded;
+			sint16 *pcm;
+			float fv;
+
+			/* a decoder may give fewer channels than the media type
+			   said, the last one is then played on the others */
+			decoded = stream->frame->ch_layout.nb_channels;
+			if (decoded <= 0)
+				continue;
+
+			n = stream->frame->nb_samples;
+			channels = stream->format.nChannels;
+			pcm = xmalloc((size_t) n * channels * 2);
+			for (i = 0; i < n; i++)
+				for (c = 0; c < channels; c++)
+				{
+					sc = MIN(c, decoded - 1);
+					switch (stream->frame->format)
+					{
+						case AV_SAMPLE_FMT_S16:
+							pcm[i * channels + c] =
+								((sint16 *) stream->frame->data[0])
+								[i * decoded + sc];
+							break;
+						case AV_SAMPLE_FMT_S16P:
+							pcm[i * channels + c] =
+								((sint16 *) stream->frame->data[sc])[i];
+							break;
+						case AV_SAMPLE_FMT_S32P:
+							pcm[i * channels + c] =
+								((sint32 *) stream->frame->data[sc])[i] >> 16;
+							break;
+						case AV_SAMPLE_FMT_FLT:
+						case AV_SAMPLE_FMT_FLTP:
+							fv = stream->frame->format == AV_SAMPLE_FMT_FLT ?
+								((float *) stream->frame->data[0])
+								[i * decoded + sc] :
+								((float *) stream->frame->data[sc])[i];
+							fv = fv > 1.0f ? 1.0f : (fv < -1.0f ? -1.0f : fv);
+							pcm[i * channels + c] = fv * 32767;
+							break;
+						default:
+							pcm[i * channels + c] = 0;
+							break;
+					}
+					if (p->muted)
+						pcm[i * channels + c] = 0;
+				}
+
+			if (rdpsnd_play(&stream->format, (uint8 *) pcm, n * channels * 2))
+				p->audio_end = (stream->frame->pts != AV_NOPTS_VALUE ?
+						stream->frame->pts : start) +
+					(sint64) n * 10000000 / stream->format.nSamplesPerSec;
+			xfree(pcm);
+#endif
+			continue;
+		}
+
+		f = stream->frame;
+		if (f->format == AV_PIX_FMT_VAAPI)
+		{
+			av_frame_unref(stream->sw_frame);
+			if (av_hwframe_transfer_data(stream->sw_frame, f, 0) < 0)
+				continue;
+			f = stream->sw_frame;
+		}
+
+		/* no room to wait, the oldest is shown now */
+		if (p->npictures == TSMF_MAX_PICTURES)
+		{
+			ui_begin_update();
+			tsmf_paint(p, &p->pictures[0]);
+			ui_end_update();
+			tsmf_drop_pictures(p, 1);
+		}
+
+		pic = &p->pictures[p->npictures];
+		pic->width = f->width;
+		pic->height = f->height;
+		pic->data = xmalloc((size_t) f->width * f->height * 4);
+		if (!tsmf_convert_picture(f, pic->data))
+		{
+			logger(Graphics, Warning, "tsmf_decode(), unhandled picture format %s",
+			       av_get_pix_fmt_name(f->format));
+			xfree(pic->data);
+			continue;
+		}
+		pic->time = stream->frame->pts != AV_NOPTS_VALUE ? stream->frame->pts : start;
+		pic->channel_id = stream->channel_id;
+		pic->stream_id = stream->id;
+		pic->duration = end > start ? end - start : 0;
+		pic->size = size;
+		p->npictures++;
+		shown = True;
+	}
+
+	/* an audio sample is done once queued, video once shown */
+	if (!shown)
+		tsmf_send_ack(stream->channel_id, stream->id, end > start ? end - start : 0, size);
+}
+
+#ifdef WITH_RDPSND
+/* Keep the front left and right channels of 16 bit PCM with more than
+   two, in place, returns the new length */
+static uint32
+tsmf_pcm_front_pair(uint8 * data, uint32 size, uint16 channels)
+{
+	uint32 i, frames;
+
+	frames = size / (channels * 2);
+	for (i = 0; i < frames; i++)
+		memmove(data + i * 4, data + i * channels * 2, 4);
+	return frames * 4;
+}
+#endif
+
+static void
+tsmf_process_sample(STREAM s)
+{
+	uint8 id[16], *data;
+	uint32 stream_id, cb_data;
+	sint64 start, end;
+	TSMF_PRESENTATION *p;
+	TSMF_STREAM *stream;
+
+	if (!s_check_rem(s, 16 + 4 + 4 + 36))
+		return;
+	in_uint8a(s, id, 16);
+	in_uint32_le(s, stream_id);
+	in_uint8s(s, 4);	/* numSample, always 1 */
+	in_uint64_le(s, start);	/* SampleStartTime */
+	in_uint64_le(s, end);	/* SampleEndTime */
+	in_uint8s(s, 8);	/* ThrottleDuration */
+	in_uint8s(s, 8);	/* SampleFlags, SampleExtensions */
+	in_uint32_le(s, cb_data);
+	if (!s_check_rem(s, cb_data))
+		return;
+	in_uint8p(s, data, cb_data);
+
+	p = tsmf_get_presentation(id);
+	stream = tsmf_get_stream(p, stream_id);
+	if (stream == NULL)
+	{
+		tsmf_send_ack(dvc_channel_id(), stream_id, end > start ? end - start : 0, cb_data);
+		return;
+	}
+	stream->channel_id = dvc_channel_id();
+
+	if (stream->pcm)
+	{
+#ifdef WITH_RDPSND
+		if (stream->pcm_channels > 2)
+			cb_data = tsmf_pcm_front_pair(data, cb_data, stream->pcm_channels);
+		if (p->muted)
+			memset(data, 0, cb_data);
+		if (rdpsnd_play(&stream->format, data, cb_data))
+			p->audio_end = end > start ? end : start +
+				(sint64) cb_data * 10000000 / stream->format.nAvgBytesPerSec;
+#endif
+		tsmf_send_ack(stream->channel_id, stream->id, end > start ? end - start : 0,
+			      cb_data);
+		return;
+	}
+
+	tsmf_decode(p, stream, data, cb_data, start, end);
+}
+
+/* The visible parts of the video window, and where it is */
+static void
+tsmf_process_geometry(TSMF_PRESENTATION * p, STREAM s)
+{
+	uint32 size, cb_rects, width, height, left, top, rtop, rleft, rbottom, rright;
+	size_t start;
+	int i;
+
+	if (!s_check_rem(s, 4))
+		return;
+	in_uint32_le(s, size);	/* numGeometryInfo, in bytes */
+	start = s_tell(s);
+	if (size < 28 || s_remaining(s) < 4 || size > s_remaining(s) - 4)
+		return;
+	in_uint8s(s, 12);	/* VideoWindowId, VideoWindowState */
+	in_uint32_le(s, width);
+	in_uint32_le(s, height);
+	in_uint32_le(s, left);
+	in_uint32_le(s, top);
+	s_seek(s, start + size);
+	in_uint32_le(s, cb_rects);
+
+	p->x = (sint32) left;
+	p->y = (sint32) top;
+	p->width = MIN(width, TSMF_MAX_SIZE);
+	p->height = MIN(height, TSMF_MAX_SIZE);
+
+	p->nrects = 0;
+	for (i = 0; i < (int) (cb_rects / 16) && s_check_rem(s, 16); i++)
+	{
+		in_uint32_le(s, rtop);
+		in_uint32_le(s, rleft);
+		in_uint32_le(s, rbottom);
+		in_uint32_le(s, rright);
+
+		/* the visible rects lie within the window */
+		rright = MIN(rright, (uint32) p->width);
+		rbottom = MIN(rbottom, (uint32) p->height);
+		if (p->nrects == TSMF_MAX_RECTS || rright <= rleft || rbottom <= rtop)
+			continue;
+		p->rects[p->nrects].x = rleft;
+		p->rects[p->nrects].y = rtop;
+		p->rects[p->nrects].cx = rright - rleft;
+		p->rects[p->nrects].cy = rbottom - rtop;
+		p->nrects++;
+	}
+
+	logger(Graphics, Debug, "tsmf_process_geometry(), %dx%d at %d,%d, %d visible rects",
+	       p->width, p->height, p->x, p->y, p->nrects);
+}
+
+static void
+tsmf_presentation_free(TSMF_PRESENTATION * p)
+{
+	TSMF_STREAM *stream;
+
+	while (p->npictures > 0)
+	{
+		xfree(p->pictures[p->npictures - 1].data);
+		p->npictures--;
+	}
+	while (p->streams != NULL)
+	{
+		stream = p->streams;
+		p->streams = stream->next;
+		tsmf_stream_free(stream);
+	}
+	xfree(p);
+}
+
+static void
+tsmf_remove_presentation(TSMF_PRESENTATION * p)
+{
+	TSMF_PRESENTATION **pp;
+
+	for (pp = &tsmf_presentations; *pp != NULL; pp = &(*pp)->next)
+		if (*pp == p)
+		{
+			*pp = p->next;
+			break;
+		}
+	tsmf_presentation_free(p);
+}
+
+static void
+tsmf_flush(TSMF_PRESENTATION * p, TSMF_STREAM * stream)
+{
+	TSMF_STREAM *st;
+
+	tsmf_drop_pictures(p, p->npictures);
+	p->audio_end = 0;
+	for (st = p->streams; st != NULL; st = st->next)
+		if ((stream == NULL || st == stream) && st->ctx != NULL)
+			avcodec_flush_buffers(st->ctx);
+}
+
+static void
+tsmf_process_capabilities(STREAM s, uint32 message_id)
+{
+	uint32 count, type, length, i;
+	STREAM out;
+
+	in_uint32_le(s, count);
+	for (i = 0; i < count && s_check_rem(s, 8); i++)
+	{
+		in_uint32_le(s, type);
+		in_uint32_le(s, length);
+		if (!s_check_rem(s, length))
+			break;
+		in_uint8s(s, length);
+		logger(Protocol, Debug, "tsmf_process_capabilities(), server capability %d", type);
+	}
+
+	out = tsmf_init_reply(TSMF_INTERFACE_DEFAULT, message_id, 4 + 3 * 12 + 4);
+	out_uint32_le(out, 3);	/* numClientCapabilities */
+	out_uint32_le(out, TSMM_CAPABILITY_TYPE_VERSION);
+	out_uint32_le(out, 4);
+	out_uint32_le(out, 2);
+	out_uint32_le(out, TSMM_CAPABILITY_TYPE_PLATFORM);
+	out_uint32_le(out, 4);
+	out_uint32_le(out, MMREDIR_CAPABILITY_PLATFORM_MF | MMREDIR_CAPABILITY_PLATFORM_DSHOW);
+	out_uint32_le(out, TSMM_CAPABILITY_TYPE_AUDIO);
+	out_uint32_le(out, 4);
+#ifdef WITH_RDPSND
+	out_uint32_le(out, MMREDIR_CAPABILITY_AUDIOSUPPORT);
+#else
+	out_uint32_le(out, 0);
+#endif
+	out_uint32_le(out, 0);	/* Result */
+	tsmf_send(dvc_channel_id(), out);
+}
+
+static void
+tsmf_process_pdu(STREAM s)
+{
+	uint32 interface_id, message_id, function_id;
+	uint32 stream_id, cookie, muted;
+	uint8 id[16];
+	TSMF_MEDIA_TYPE mt;
+	TSMF_PRESENTATION *p;
+	TSMF_STREAM *stream, **pstream;
+	RD_BOOL supported;
+	sint64 offset;
+	STREAM out;
+
+	if (!s_check_rem(s, 12))
+		return;
+	in_uint32_le(s, interface_id);
+	in_uint32_le(s, message_id);
+	in_uint32_le(s, function_id);
+
+	if (function_id == RIMCALL_RELEASE || function_id == RIMCALL_QUERYINTERFACE)
+		return;
+
+	if (interface_id == (TSMF_INTERFACE_CAPABILITIES | STREAM_ID_NONE))
+	{
+		if (function_id != RIM_EXCHANGE_CAPABILITY_REQUEST || !s_check_rem(s, 4))
+			return;
+		in_uint8s(s, 4);	/* Capability */
+		out = tsmf_init_reply(interface_id, message_id, 8);
+		out_uint32_le(out, RIM_CAPABILITY_VERSION_01);	/* CapabilityValue */
+		out_uint32_le(out, 0);	/* Result */
+		tsmf_send(dvc_channel_id(), out);
+		return;
+	}
+
+	if (interface_id != (TSMF_INTERFACE_DEFAULT | STREAM_ID_PROXY))
+	{
+		logger(Protocol, Warning, "tsmf_process_pdu(), unhandled interface 0x%x",
+		       interface_id);
+		return;
+	}
+
+	if (function_id == EXCHANGE_CAPABILITIES_REQ)
+	{
+		if (s_check_rem(s, 4))
+			tsmf_process_capabilities(s, message_id);
+		return;
+	}
+
+	if (function_id == CHECK_FORMAT_SUPPORT_REQ)
+	{
+		if (!s_check_rem(s, 12))
+			return;
+		in_uint32_le(s, cookie);	/* PlatformCookie */
+		in_uint8s(s, 8);	/* NoRolloverFlags, numMediaType */
+		supported = tsmf_read_media_type(s, &mt);
+		logger(Protocol, Debug, "tsmf_process_pdu(), %s %s format %s",
+		       mt.video ? "video" : "audio", avcodec_get_name(mt.codec),
+		       supported ? "supported" : "not supported");
+
+		out = tsmf_init_reply(interface_id, message_id, 12);
+		out_uint32_le(out, supported ? 1 : 0);	/* FormatSupported */
+		out_uint32_le(out, cookie);
+		out_uint32_le(out, 0);	/* Result */
+		tsmf_send(dvc_channel_id(), out);
+		return;
+	}
+
+	/* the rest are about a presentation */
+	if (!s_check_rem(s, 16))
+		return;
+	in_uint8a(s, id, 16);
+	p = tsmf_get_presentation(id);
+
+	switch (function_id)
+	{
+		case ON_NEW_PRESENTATION:
+			if (p != NULL)
+				break;
+			p = xmalloc(sizeof(TSMF_PRESENTATION));
+			memset(p, 0, sizeof(TSMF_PRESENTATION));
+			memcpy(p->id, id, 16);
+			p->next = tsmf_presentations;
+			tsmf_presentations = p;
+			break;
+
+		case SET_CHANNEL_PARAMS:
+			/* samples say which stream they are of */
+			break;
+
+		case ADD_STREAM:
+			if (p == NULL || !s_check_rem(s, 8))
+				break;
+			in_uint32_le(s, stream_id);
+			in_uint8s(s, 4);	/* numMediaType */
+			if (!tsmf_read_media_type(s, &mt))
+			{
+				logger(Protocol, Warning,
+				       "tsmf_process_pdu(), stream %d has a format not supported",
+				       stream_id);
+				break;
+			}
+			stream = tsmf_stream_new(stream_id, &mt);
+			if (stream == NULL)
+				break;
+			stream->next = p->streams;
+			p->streams = stream;
+			logger(Protocol, Verbose, "Redirected %s stream, %s",
+			       mt.video ? "video" : "audio",
+			       mt.pcm ? "PCM" : avcodec_get_name(mt.codec));
+			break;
+
+		case REMOVE_STREAM:
+			if (p == NULL || !s_check_rem(s, 4))
+				break;
+			in_uint32_le(s, stream_id);
+			for (pstream = &p->streams; *pstream != NULL; pstream = &(*pstream)->next)
+			{
+				if ((*pstream)->id != stream_id)
+					continue;
+				stream = *pstream;
+				*pstream = stream->next;
+				if (stream->video)
+					tsmf_drop_pictures(p, p->npictures);
+				tsmf_stream_free(stream);
+				break;
+			}
+			break;
+
+		case SET_TOPOLOGY_REQ:
+			out = tsmf_init_reply(interface_id, message_id, 8);
+			out_uint32_le(out, 1);	/* TopologyReady */
+			out_uint32_le(out, 0);	/* Result */
+			tsmf_send(dvc_channel_id(), out);
+			break;
+
+		case SHUTDOWN_PRESENTATION_REQ:
+			if (p != NULL)
+				tsmf_remove_presentation(p);
+			out = tsmf_init_reply(interface_id, message_id, 4);
+			out_uint32_le(out, 0);	/* Result */
+			tsmf_send(dvc_channel_id(), out);
+			break;
+
+		case ON_SAMPLE:
+			s_seek(s, 12);
+			tsmf_process_sample(s);
+			break;
+
+		case ON_FLUSH:
+			if (p == NULL || !s_check_rem(s, 4))
+				break;
+			in_uint32_le(s, stream_id);
+			tsmf_flush(p, tsmf_get_stream(p, stream_id));
+			break;
+
+		case ON_END_OF_STREAM:
+			if (!s_check_rem(s, 4))
+				break;
+			in_uint32_le(s, stream_id);
+			tsmf_send_notification(dvc_channel_id(), CLIENT_EVENT_NOTIFICATION, stream_id,
+					       TSMM_CLIENT_EVENT_ENDOFSTREAM);
+			break;
+
+		case ON_PLAYBACK_STARTED:
+			if (p != NULL && s_check_rem(s, 8))
+			{
+				in_uint64_le(s, offset);	/* PlaybackStartOffset */
+				tsmf_flush(p, NULL);
+				tsmf_set_clock(p, offset);
+				p->paused = False;
+			}
+			tsmf_send_notification(dvc_channel_id(), CLIENT_EVENT_NOTIFICATION, 0,
+					       TSMM_CLIENT_EVENT_START_COMPLETED);
+			break;
+
+		case ON_PLAYBACK_STOPPED:
+			if (p != NULL)
+			{
+				tsmf_flush(p, NULL);
+				p->clock_set = False;
+			}
+			tsmf_send_notification(dvc_channel_id(), CLIENT_EVENT_NOTIFICATION, 0,
+					       TSMM_CLIENT_EVENT_STOP_COMPLETED);
+			break;
+
+		case ON_PLAYBACK_PAUSED:
+			if (p != NULL && !p->paused)
+			{
+				p->clock_base = tsmf_clock(p);
+				p->paused = True;
+			}
+			break;
+
+		case ON_PLAYBACK_RESTARTED:
+			if (p != NULL && p->paused)
+			{
+				p->paused = False;
+				tsmf_set_clock(p, p->clock_base);
+			}
+			break;
+
+		case ON_STREAM_VOLUME:
+			if (p == NULL || !s_check_rem(s, 8))
+				break;
+			in_uint8s(s, 4);	/* NewVolume */
+			in_uint32_le(s, muted);	/* bMuted */
+			p->muted = muted != 0;
+			break;
+
+		case UPDATE_GEOMETRY_INFO:
+			if (p != NULL)
+				tsmf_process_geometry(p, s);
+			break;
+
+		case SET_VIDEO_WINDOW:
+		case SET_SOURCE_VIDEO_RECT:
+		case SET_ALLOCATOR:
+		case NOTIFY_PREROLL:
+		case ON_CHANNEL_VOLUME:
+		case ON_PLAYBACK_RATE_CHANGED:
+			break;
+
+		default:
+			logger(Protocol, Warning, "tsmf_process_pdu(), unhandled function 0x%x",
+			       function_id);
+			break;
+	}
+}
+
+/* Forget the presentations of a connection that is gone */
+void
+tsmf_reset_state(void)
+{
+	TSMF_PRESENTATION *p;
+
+	while (tsmf_presentations != NULL)
+	{
+		p = tsmf_presentations;
+		tsmf_presentations = p->next;
+		tsmf_presentation_free(p);
+	}
+}
+
+void
+tsmf_init(void)
+{
+	dvc_channels_register_instances(TSMF_CHANNEL_NAME, tsmf_process_pdu, NULL,
+					DVC_PRIORITY_INTERACTIVE);
+}
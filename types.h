@@ -68,6 +68,15 @@ typedef struct _RD_POINT
 }
 RD_POINT;
 
+/* A monitor of a session spanning several, in session coordinates */
+typedef struct _RD_MONITOR
+{
+	sint32 x, y;
+	uint32 width, height;
+	RD_BOOL primary;
+}
+RD_MONITOR;
+
 typedef struct _COLOURENTRY
 {
 	uint8 red;
@@ -110,6 +119,9 @@ typedef struct _BRUSHDATA
 	uint32 colour_code;
 	uint32 data_size;
 	uint8 *data;
+	/* the stipple or tile the UI made of it, kept while it is cached */
+	RD_HBITMAP pixmap;
+	uint32 pixmap_palette;
 }
 BRUSHDATA;
 
@@ -134,6 +146,25 @@ typedef struct _FONTGLYPH
 }
 FONTGLYPH;
 
+/* A bitmap waiting to be decompressed, possibly by a worker thread */
+typedef struct _BITMAP_JOB
+{
+	uint8 *output;
+	uint8 *input;
+	int width;
+	int height;
+	int size;
+	int Bpp;
+	/* decoder for other codecs than bitmap_decompress() handles, with
+	   its state in arg */
+	RD_BOOL(*decode) (struct _BITMAP_JOB * job);
+	void *arg;
+	RD_BOOL result;
+	RD_BOOL done;
+	struct _BITMAP_JOB *next;
+}
+BITMAP_JOB;
+
 typedef struct _DATABLOB
 {
 	void *data;
@@ -156,10 +187,8 @@ key_translation;
 typedef struct _key_translation_entry
 {
 	key_translation *tr;
-	/* The full KeySym for this entry, not KEYMAP_MASKed */
+	/* The KeySym for this entry, NoSymbol for a free slot */
 	uint32 keysym;
-	/* This will be non-NULL if there has been a hash collision */
-	struct _key_translation_entry *next;
 }
 key_translation_entry;
 
@@ -176,13 +205,16 @@ VCHANNEL;
 /* PSTCACHE */
 typedef uint8 HASH_KEY[8];
 
-/* Header for an entry in the persistent bitmap cache file */
+/* Index entry of a cell in the persistent bitmap cache file */
 typedef struct _PSTCACHE_CELLHEADER
 {
 	HASH_KEY key;
 	uint8 width, height;
-	uint16 length;
+	uint16 length;		/* of the data as stored */
 	uint32 stamp;
+	uint8 compressed;	/* data is in the form bitmap_decompress() reads */
+	uint8 pad;
+	uint16 uses;		/* sessions that drew it, saturating */
 }
 CELLHEADER;
 
@@ -301,13 +333,15 @@ NOTIFY;
 typedef struct fileinfo
 {
 	uint32 device_id, flags_and_attributes, accessmask;
-	char path[PATH_MAX];
+	char *path;		/* NULL when the handle is not open */
 	DIR *pdir;
 	struct dirent *pdirent;
-	char pattern[PATH_MAX];
+	char *pattern;
 	RD_BOOL delete_on_close;
 	NOTIFY notify;
 	uint32 info_class;
+	int io_pending;		/* disk jobs queued or running */
+	RD_BOOL io_running;
 }
 FILEINFO;
 
@@ -321,4 +355,21 @@ typedef enum
 	Fullscreen,
 } window_size_type_t;
 
+/* Phases of connecting, in the order they are gone through, see
+   rdp_connect_phase() */
+typedef enum
+{
+	CONNECT_PHASE_START,
+	CONNECT_PHASE_DNS,
+	CONNECT_PHASE_TCP,
+	CONNECT_PHASE_X224,
+	CONNECT_PHASE_TLS,
+	CONNECT_PHASE_CREDSSP,
+	CONNECT_PHASE_MCS,
+	CONNECT_PHASE_LICENCE,
+	CONNECT_PHASE_CAPABILITIES,
+	CONNECT_PHASE_FIRST_PAINT,
+	CONNECT_PHASES
+} connect_phase_t;
+
 #endif /* _TYPES_H */
@@ -279,6 +279,23 @@ utils_apply_session_size_limitations(uint32 * width, uint32 * height)
 		*height = 200;
 }
 
+/* Find where the primary monitor is, the protocol has it at the
+   origin of the desktop and places the others relative to it */
+void
+utils_monitor_origin(RD_MONITOR * monitors, int count, sint32 * x, sint32 * y)
+{
+	int i;
+
+	*x = *y = 0;
+	for (i = 0; i < count; i++)
+		if (monitors[i].primary)
+		{
+			*x = monitors[i].x;
+			*y = monitors[i].y;
+			break;
+		}
+}
+
 #define MAX_CHOICES 10
 const char *
 util_dialog_choice(const char *message, ...)
@@ -361,7 +378,7 @@ static char *subject[] = {
 	"Disk"
 };
 
-static log_level_t _logger_level = Warning;
+log_level_t g_logger_level = Warning;
 
 #define DEFAULT_LOGGER_SUBJECTS (1 << Core)
 
@@ -377,46 +394,67 @@ static log_level_t _logger_level = Warning;
 	| (1 << Disk)
 
 
-static int _logger_subjects = DEFAULT_LOGGER_SUBJECTS;
+int g_logger_subjects = DEFAULT_LOGGER_SUBJECTS;
+
+/* stderr is buffered as well, so that debug logging costs one write
+   per buffer full rather than per message */
+static char _logger_stderr_buf[BUFSIZ * 4];
+
+static void
+_logger_flush(void)
+{
+	fflush(stdout);
+	fflush(stderr);
+}
+
+/* Set up buffering, before anything is written to stderr */
+void
+logger_init(void)
+{
+	setvbuf(stderr, _logger_stderr_buf, _IOFBF, sizeof(_logger_stderr_buf));
+	atexit(_logger_flush);
+}
 
+/* Called through the logger() macro, once the level and subject have
+   been checked */
 void
-logger(log_subject_t s, log_level_t lvl, char *format, ...)
+(logger) (log_subject_t s, log_level_t lvl, char *format, ...)
 {
 	va_list ap;
-	char buf[1024];
+	FILE *out;
 
-	// Do not log if message is below global log level
-	if (_logger_level > lvl)
-		return;
+	out = (lvl == Notice || lvl == Verbose) ? stdout : stderr;
 
-	// Skip debug logging for non specified subjects
-	if (lvl < Verbose && !(_logger_subjects & (1 << s)))
-		return;
-
-	va_start(ap, format);
-	vsnprintf(buf, sizeof(buf), format, ap);
+	// One line at a time, as the disk, sound and network threads log too
+	flockfile(out);
 
 	// Notice and Verbose messages goes without prefix
-	if (lvl == Notice || lvl == Verbose)
-		fprintf(stdout, "%s\n", buf);
-	else
-		fprintf(stderr, "%s(%s): %s\n", subject[s], level[lvl], buf);
-
-	fflush(stdout);
+	if (out == stderr)
+		fprintf(stderr, "%s(%s): ", subject[s], level[lvl]);
 
+	va_start(ap, format);
+	vfprintf(out, format, ap);
 	va_end(ap);
+	putc('\n', out);
+
+	funlockfile(out);
+
+	// Only debug logging stays buffered, everything from verbose output
+	// up goes out right away
+	if (lvl >= Verbose)
+		_logger_flush();
 }
 
 void
 logger_set_verbose(int verbose)
 {
-	if (_logger_level < Verbose)
+	if (g_logger_level < Verbose)
 		return;
 
 	if (verbose)
-		_logger_level = Verbose;
+		g_logger_level = Verbose;
 	else
-		_logger_level = Warning;
+		g_logger_level = Warning;
 }
 
 void
@@ -439,7 +477,7 @@ logger_set_subjects(char *subjects)
 		return;
 	}
 
-	_logger_subjects = 0;
+	g_logger_subjects = 0;
 
 	do
 	{
@@ -454,7 +492,7 @@ logger_set_subjects(char *subjects)
 			token++;
 
 		if (strcmp(token, "All") == 0)
-			_logger_subjects |= ALL_LOGGER_SUBJECTS;
+			g_logger_subjects |= ALL_LOGGER_SUBJECTS;
 		else if (strcmp(token, "UI") == 0)
 			bit = (1 << GUI);
 		else if (strcmp(token, "Keyboard") == 0)
@@ -478,14 +516,14 @@ logger_set_subjects(char *subjects)
 
 		// set or clear logger subject bit
 		if (clear)
-			_logger_subjects &= ~bit;
+			g_logger_subjects &= ~bit;
 		else
-			_logger_subjects |= bit;
+			g_logger_subjects |= bit;
 
 	}
 	while ((token = strtok(NULL, ",")) != NULL);
 
-	_logger_level = Debug;
+	g_logger_level = Debug;
 
 	free(pcs);
 }
@@ -35,6 +35,7 @@ void utils_calculate_dpi_scale_factors(uint32 width, uint32 height, uint32 dpi,
 				       uint32 * physwidth, uint32 * physheight,
 				       uint32 * desktopscale, uint32 * devicescale);
 void utils_apply_session_size_limitations(uint32 * width, uint32 * height);
+void utils_monitor_origin(RD_MONITOR * monitors, int count, sint32 * x, sint32 * y);
 
 const char* util_dialog_choice(const char *message, ...);
 
@@ -63,7 +64,26 @@ typedef enum log_subject_t
 	Disk
 } log_subject_t;
 
-void logger(log_subject_t c, log_level_t lvl, char *format, ...);
+/* Messages below this level are left out at compile time,
+   --disable-debug-log sets it to Verbose */
+#ifndef LOGGER_MIN_LEVEL
+#define LOGGER_MIN_LEVEL Debug
+#endif
+
+extern log_level_t g_logger_level;
+extern int g_logger_subjects;
+
+/* Debug messages are only for the subjects asked for */
+#define logger_enabled(s, lvl) ((lvl) >= LOGGER_MIN_LEVEL && (lvl) >= g_logger_level \
+				&& ((lvl) >= Verbose || (g_logger_subjects & (1 << (s)))))
+
+/* Check the level before the arguments are evaluated, the parentheses
+   around the name call the function rather than the macro */
+#define logger(s, lvl, ...) \
+	do { if (logger_enabled(s, lvl)) (logger)(s, lvl, __VA_ARGS__); } while (0)
+
+void (logger) (log_subject_t c, log_level_t lvl, char *format, ...);
+void logger_init(void);
 void logger_set_verbose(int verbose);
 void logger_set_subjects(char *subjects);
 
@@ -37,9 +37,16 @@
 #ifdef HAVE_LANGINFO_H
 #include <langinfo.h>
 #include <iconv.h>
+#include <errno.h>
 #define USE_UNICODE_CLIPBOARD
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 #ifdef USE_UNICODE_CLIPBOARD
 #define RDP_CF_TEXT CF_UNICODETEXT
 #else
@@ -121,12 +128,104 @@ static Time acquire_time = 0;
 
 /* Denotes that an INCR ("chunked") transfer is in progress. */
 static int g_waiting_for_INCR = 0;
+/* Denotes that PropertyChangeMask was added on g_wnd for the INCR transfer. */
+static RD_BOOL g_incr_added_mask = False;
 /* Denotes the target format of the ongoing INCR ("chunked") transfer. */
 static Atom g_incr_target = 0;
 /* Buffers an INCR transfer. */
 static uint8 *g_clip_buffer = 0;
 /* Denotes the size of g_clip_buffer. */
 static uint32 g_clip_buflen = 0;
+/* Denotes the allocated size of g_clip_buffer. */
+static uint32 g_clip_bufsize = 0;
+
+/* Responses already converted for RDP, by format. They stay valid while
+   cache_selection is held by the same owner since the same time, which
+   is checked with a TIMESTAMP request before each use. */
+#define MAX_CACHED_FORMATS 4
+/* Selection time of owners that didn't give one, which can't be cached */
+#define XCLIP_TIME_UNKNOWN 1
+
+typedef struct
+{
+	uint32 format;
+	uint8 *data;
+	uint32 length;
+} XCLIP_CACHED;
+
+static XCLIP_CACHED cache[MAX_CACHED_FORMATS];
+static int cache_count = 0;
+static Atom cache_selection = None;
+static Window cache_owner = None;
+static Time cache_time = XCLIP_TIME_UNKNOWN;
+/* Where the response being converted goes in the cache */
+static uint8 *cache_fill = NULL;
+
+/* Selection, owner and selection time the current RDP request is
+   served from */
+static Atom request_selection = None;
+static Window request_owner = None;
+static Time request_time = XCLIP_TIME_UNKNOWN;
+/* TIMESTAMP replies still expected for the current RDP request */
+static int timestamps_pending = 0;
+
+/* Returns the number of bytes at the start of data that aren't c.
+   Line breaks are rare, so the bytes are checked 16 at a time. */
+static uint32
+xclip_span(const uint8 * data, uint32 length, uint8 c)
+{
+	uint32 i = 0;
+#if defined(__SSE2__)
+	const __m128i needle = _mm_set1_epi8((char) c);
+
+	for (; i + 16 <= length; i += 16)
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) (data + i)),
+						     needle)))
+			break;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	const uint8x16_t needle = vdupq_n_u8(c);
+	uint8x16_t eq;
+
+	for (; i + 16 <= length; i += 16)
+	{
+		eq = vceqq_u8(vld1q_u8(data + i), needle);
+		if (vget_lane_u64(vreinterpret_u64_u8(vorr_u8(vget_low_u8(eq), vget_high_u8(eq))), 0))
+			break;
+	}
+#endif
+	for (; i < length && data[i] != c; i++);
+	return i;
+}
+
+#ifdef USE_UNICODE_CLIPBOARD
+/* Returns the number of characters at the start of data that aren't c */
+static uint32
+xclip_span16(const uint16 * data, uint32 length, uint16 c)
+{
+	uint32 i = 0;
+#if defined(__SSE2__)
+	const __m128i needle = _mm_set1_epi16((short) c);
+
+	for (; i + 8 <= length; i += 8)
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128((__m128i *) (data + i)),
+						      needle)))
+			break;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	const uint16x8_t needle = vdupq_n_u16(c);
+	uint16x8_t eq;
+
+	for (; i + 8 <= length; i += 8)
+	{
+		eq = vceqq_u16(vld1q_u16(data + i), needle);
+		if (vget_lane_u64(vreinterpret_u64_u16(vorr_u16(vget_low_u16(eq), vget_high_u16(eq))),
+				  0))
+			break;
+	}
+#endif
+	for (; i < length && data[i] != c; i++);
+	return i;
+}
+#endif
 
 /* Translates CR-LF to LF.
    Changes the string in-place.
@@ -135,83 +234,185 @@ static uint32 g_clip_buflen = 0;
 static void
 crlf2lf(uint8 * data, uint32 * length)
 {
-	uint8 *dst, *src;
+	uint8 *dst, *src, *end;
+	uint32 n;
+
 	src = dst = data;
-	while (src < data + *length)
+	end = data + *length;
+	while (src < end)
 	{
-		if (*src != '\x0d')
-			*dst++ = *src;
-		src++;
+		/* move the run up to the next CR, and drop the CR */
+		n = xclip_span(src, end - src, '\x0d');
+		if (dst != src)
+			memmove(dst, src, n);
+		dst += n;
+		src += n;
+		if (src < end)
+			src++;
 	}
 	*length = dst - data;
 }
 
+/* Size of the pieces text is converted in on its way to RDP */
+#define XCLIP_CONVERT_CHUNK 4096
+
+/* Where converted clipboard text goes. Each piece is passed to emit, or
+   only counted when emit is NULL, so the length of the result can be
+   found before any of it is sent. */
+typedef struct
+{
+	void (*emit) (uint8 * data, uint32 length);
+	uint32 length;
+} XCLIP_SINK;
+
+static void
+xclip_sink_write(XCLIP_SINK * sink, uint8 * data, uint32 length)
+{
+	if (sink->emit != NULL && length > 0)
+		sink->emit(data, length);
+	sink->length += length;
+}
+
 #ifdef USE_UNICODE_CLIPBOARD
-/* Translate LF to CR-LF. To do this, we must allocate more memory.
-   The returned string is null-terminated, as required by CF_UNICODETEXT.
-   The size is updated. */
-static uint8 *
-utf16_lf2crlf(uint8 * data, uint32 * size)
+/* State of utf16_lf2crlf() between pieces of the same text */
+typedef struct
 {
-	uint8 *result;
-	uint16 *inptr, *outptr;
+	RD_BOOL started;
 	RD_BOOL swap_endianness;
+	uint16 previous;	/* Kept so we'll avoid translating CR-LF to CR-CR-LF */
+} UTF16_LF2CRLF_STATE;
 
+/* Translate LF to CR-LF in a piece of UTF-16 text.
+   The size must be a whole number of characters. */
+static void
+utf16_lf2crlf(XCLIP_SINK * sink, uint8 * data, uint32 size, UTF16_LF2CRLF_STATE * state)
+{
 	/* Worst case: Every char is LF */
-	result = xmalloc((*size * 2) + 2);
-	if (result == NULL)
-		return NULL;
+	uint16 result[XCLIP_CONVERT_CHUNK];
+	uint16 *inptr, *outptr, *end;
+	uint16 uvalue, lf;
+	uint32 n;
 
 	inptr = (uint16 *) data;
-	outptr = (uint16 *) result;
+	end = inptr + size / 2;
 
 	/* Check for a reversed BOM */
-	swap_endianness = (*inptr == 0xfffe);
+	if (!state->started && inptr < end)
+	{
+		state->swap_endianness = (*inptr == 0xfffe);
+		state->started = True;
+	}
 
-	uint16 uvalue_previous = 0;	/* Kept so we'll avoid translating CR-LF to CR-CR-LF */
-	while ((uint8 *) inptr < data + *size)
+	lf = state->swap_endianness ? 0x0a00 : 0x0a;
+	while (inptr < end)
 	{
-		uint16 uvalue = *inptr;
-		if (swap_endianness)
-			uvalue = ((uvalue << 8) & 0xff00) + (uvalue >> 8);
-		if ((uvalue == 0x0a) && (uvalue_previous != 0x0d))
-			*outptr++ = swap_endianness ? 0x0d00 : 0x0d;
-		uvalue_previous = uvalue;
-		*outptr++ = *inptr++;
+		outptr = result;
+		while (inptr < end && outptr < result + XCLIP_CONVERT_CHUNK - 1)
+		{
+			/* copy the run up to the next LF as it is */
+			n = xclip_span16(inptr, MIN(end - inptr, result + XCLIP_CONVERT_CHUNK - 1 - outptr),
+					 lf);
+			if (n > 0)
+			{
+				memcpy(outptr, inptr, n * 2);
+				outptr += n;
+				inptr += n;
+				state->previous = inptr[-1];
+				if (state->swap_endianness)
+					state->previous = ((state->previous << 8) & 0xff00) +
+						(state->previous >> 8);
+				continue;
+			}
+
+			uvalue = *inptr;
+			if (state->swap_endianness)
+				uvalue = ((uvalue << 8) & 0xff00) + (uvalue >> 8);
+			if ((uvalue == 0x0a) && (state->previous != 0x0d))
+				*outptr++ = state->swap_endianness ? 0x0d00 : 0x0d;
+			state->previous = uvalue;
+			*outptr++ = *inptr++;
+		}
+		xclip_sink_write(sink, (uint8 *) result, (outptr - result) * 2);
 	}
-	*outptr++ = 0;		/* null termination */
-	*size = (uint8 *) outptr - result;
+}
 
-	return result;
+/* Converts text in the given charset to null-terminated UTF-16 with
+   CR-LF line endings, as required by CF_UNICODETEXT */
+static RD_BOOL
+xclip_convert_unicode(XCLIP_SINK * sink, uint8 * source, size_t source_size, const char *charset)
+{
+	char buffer[XCLIP_CONVERT_CHUNK];
+	UTF16_LF2CRLF_STATE state;
+	char *data_remaining, *buffer_remaining;
+	size_t data_size_remaining, buffer_size_remaining, res;
+	uint16 null = 0;
+	iconv_t cd;
+
+	cd = iconv_open(WINDOWS_CODEPAGE, charset);
+	if (cd == (iconv_t) - 1)
+		return False;
+
+	memset(&state, 0, sizeof(state));
+	data_remaining = (char *) source;
+	data_size_remaining = source_size;
+	while (data_size_remaining > 0)
+	{
+		buffer_remaining = buffer;
+		buffer_size_remaining = sizeof(buffer);
+		res = iconv(cd, &data_remaining, &data_size_remaining,
+			    &buffer_remaining, &buffer_size_remaining);
+		utf16_lf2crlf(sink, (uint8 *) buffer, sizeof(buffer) - buffer_size_remaining,
+			      &state);
+
+		/* Whatever was converted before an invalid sequence is sent */
+		if (res == (size_t) - 1 && errno != E2BIG)
+			break;
+	}
+	iconv_close(cd);
+
+	xclip_sink_write(sink, (uint8 *) & null, sizeof(null));
+
+	return True;
 }
 #else
-/* Translate LF to CR-LF. To do this, we must allocate more memory.
-   The length is updated. */
-static uint8 *
-lf2crlf(uint8 * data, uint32 * length)
+/* Translate LF to CR-LF, followed by a null terminator */
+static void
+lf2crlf(XCLIP_SINK * sink, uint8 * data, uint32 length)
 {
-	uint8 *result, *p, *o;
-
 	/* Worst case: Every char is LF */
-	result = xmalloc(*length * 2);
-
-	p = data;
-	o = result;
+	uint8 result[XCLIP_CONVERT_CHUNK * 2];
+	uint8 *p, *o, *end;
+	uint32 n;
 
 	uint8 previous = '\0';	/* Kept to avoid translating CR-LF to CR-CR-LF */
-	while (p < data + *length)
+	p = data;
+	end = data + length;
+	while (p < end)
 	{
-		if ((*p == '\x0a') && (previous != '\x0d'))
-			*o++ = '\x0d';
-		previous = *p;
-		*o++ = *p++;
+		o = result;
+		while (p < end && o < result + sizeof(result) - 1)
+		{
+			/* copy the run up to the next LF as it is */
+			n = xclip_span(p, MIN(end - p, result + sizeof(result) - 1 - o), '\x0a');
+			if (n > 0)
+			{
+				memcpy(o, p, n);
+				o += n;
+				p += n;
+				previous = p[-1];
+				continue;
+			}
+
+			if ((*p == '\x0a') && (previous != '\x0d'))
+				*o++ = '\x0d';
+			previous = *p;
+			*o++ = *p++;
+		}
+		xclip_sink_write(sink, result, o - result);
 	}
-	*length = o - result;
 
 	/* Convenience */
-	*o++ = '\0';
-
-	return result;
+	xclip_sink_write(sink, (uint8 *) "", 1);
 }
 #endif
 
@@ -272,6 +473,15 @@ xclip_refuse_selection(XSelectionRequestEvent * req)
 	XSendEvent(g_display, req->requestor, False, NoEventMask, &xev);
 }
 
+/* Cleans the request state once a response was sent. */
+static void
+helper_cliprdr_end_response(void)
+{
+	rdp_clipboard_request_format = 0;
+	if (!rdesktop_is_selection_owner)
+		cliprdr_send_simple_native_format_announce(RDP_CF_TEXT);
+}
+
 /* Wrapper for cliprdr_send_data which also cleans the request state. */
 static void
 helper_cliprdr_send_response(uint8 * data, uint32 length)
@@ -279,9 +489,7 @@ helper_cliprdr_send_response(uint8 * data, uint32 length)
 	if (rdp_clipboard_request_format != 0)
 	{
 		cliprdr_send_data(data, length);
-		rdp_clipboard_request_format = 0;
-		if (!rdesktop_is_selection_owner)
-			cliprdr_send_simple_native_format_announce(RDP_CF_TEXT);
+		helper_cliprdr_end_response();
 	}
 }
 
@@ -294,33 +502,94 @@ helper_cliprdr_send_empty_response()
 	helper_cliprdr_send_response(NULL, 0);
 }
 
-/* Replies with clipboard data to RDP, converting it from the target format
-   to the expected RDP format as necessary. Returns true if data was sent.
- */
-static RD_BOOL
-xclip_send_data_with_convert(uint8 * source, size_t source_size, Atom target)
+static void
+xclip_cache_clear(void)
 {
-	char *target_name;
+	int i;
+
+	for (i = 0; i < cache_count; i++)
+		xfree(cache[i].data);
+	cache_count = 0;
+	cache_selection = None;
+	cache_owner = None;
+	cache_time = XCLIP_TIME_UNKNOWN;
+}
 
-	target_name = XGetAtomName(g_display, target);
-	logger(Clipboard, Debug, "xclip_send_data_with_convert(), target=%s, size=%u",
-	       target_name, (unsigned) source_size);
-	XFree(target_name);
+static XCLIP_CACHED *
+xclip_cache_find(uint32 format)
+{
+	int i;
+
+	for (i = 0; i < cache_count; i++)
+		if (cache[i].format == format)
+			return &cache[i];
+	return NULL;
+}
+
+/* Makes room for a response of the given length in the cache of the
+   current request's selection, evicting the oldest if it is full */
+static XCLIP_CACHED *
+xclip_cache_add(uint32 format, uint32 length)
+{
+	XCLIP_CACHED *entry;
 
+	if (cache_selection != request_selection || cache_owner != request_owner
+	    || cache_time != request_time)
+	{
+		xclip_cache_clear();
+		cache_selection = request_selection;
+		cache_owner = request_owner;
+		cache_time = request_time;
+	}
+
+	entry = xclip_cache_find(format);
+	if (entry != NULL)
+	{
+		xfree(entry->data);
+	}
+	else
+	{
+		if (cache_count == MAX_CACHED_FORMATS)
+		{
+			xfree(cache[0].data);
+			memmove(&cache[0], &cache[1], (MAX_CACHED_FORMATS - 1) * sizeof(cache[0]));
+			cache_count--;
+		}
+		entry = &cache[cache_count++];
+	}
+
+	entry->format = format;
+	entry->data = xmalloc(MAX(length, 1));
+	entry->length = length;
+	return entry;
+}
+
+static void
+xclip_cache_emit(uint8 * data, uint32 length)
+{
+	memcpy(cache_fill, data, length);
+	cache_fill += length;
+}
+
+static void
+xclip_send_cached(XCLIP_CACHED * entry)
+{
+	cliprdr_send_data_begin(entry->length);
+	cliprdr_send_data_part(entry->data, entry->length);
+	cliprdr_send_data_end();
+	helper_cliprdr_end_response();
+}
+
+/* Converts clipboard data from the target format to the expected RDP
+   format, passing the result to the sink. Returns false if the target
+   can't be converted to what was requested. */
+static RD_BOOL
+xclip_convert(XCLIP_SINK * sink, uint8 * source, size_t source_size, Atom target)
+{
 #ifdef USE_UNICODE_CLIPBOARD
 	if (target == format_string_atom ||
 	    target == format_unicode_atom || target == format_utf8_string_atom)
 	{
-		size_t unicode_buffer_size;
-		char *unicode_buffer;
-		iconv_t cd;
-		size_t unicode_buffer_size_remaining;
-		char *unicode_buffer_remaining;
-		char *data_remaining;
-		size_t data_size_remaining;
-		uint32 translated_data_size;
-		uint8 *translated_data;
-
 		if (rdp_clipboard_request_format != RDP_CF_TEXT)
 			return False;
 
@@ -332,92 +601,38 @@ xclip_send_data_with_convert(uint8 * source, size_t source_size, Atom target)
 		if (target == format_string_atom)
 		{
 			char *locale_charset = nl_langinfo(CODESET);
-			cd = iconv_open(WINDOWS_CODEPAGE, locale_charset);
-			if (cd == (iconv_t) - 1)
+			if (!xclip_convert_unicode(sink, source, source_size, locale_charset))
 			{
 				logger(Clipboard, Error,
-				       "xclip_send_data_with_convert(), convert failed, locale charset %s not found",
+				       "xclip_convert(), convert failed, locale charset %s not found",
 				       locale_charset);
 				return False;
 			}
-			unicode_buffer_size = source_size * 4;
+			return True;
 		}
 		else if (target == format_unicode_atom)
 		{
-			cd = iconv_open(WINDOWS_CODEPAGE, "UCS-2");
-			if (cd == (iconv_t) - 1)
-			{
-				return False;
-			}
-			unicode_buffer_size = source_size;
-		}
-		else if (target == format_utf8_string_atom)
-		{
-			cd = iconv_open(WINDOWS_CODEPAGE, "UTF-8");
-			if (cd == (iconv_t) - 1)
-			{
-				return False;
-			}
-			/* UTF-8 is guaranteed to be less or equally compact
-			   as UTF-16 for all Unicode chars >=2 bytes.
-			 */
-			unicode_buffer_size = source_size * 2;
+			return xclip_convert_unicode(sink, source, source_size, "UCS-2");
 		}
 		else
 		{
-			return False;
-		}
-
-		unicode_buffer = xmalloc(unicode_buffer_size);
-		unicode_buffer_size_remaining = unicode_buffer_size;
-		unicode_buffer_remaining = unicode_buffer;
-		data_remaining = (char *) source;
-		data_size_remaining = source_size;
-		iconv(cd, (char **) &data_remaining, &data_size_remaining,
-		      &unicode_buffer_remaining, &unicode_buffer_size_remaining);
-		iconv_close(cd);
-
-		/* translate linebreaks */
-		translated_data_size = unicode_buffer_size - unicode_buffer_size_remaining;
-		translated_data = utf16_lf2crlf((uint8 *) unicode_buffer, &translated_data_size);
-		if (translated_data != NULL)
-		{
-			logger(Clipboard, Debug,
-			       "xclip_send_data_with_convert(), sending unicode string of %d bytes",
-			       translated_data_size);
-			helper_cliprdr_send_response(translated_data, translated_data_size);
-			xfree(translated_data);	/* Not the same thing as XFree! */
+			return xclip_convert_unicode(sink, source, source_size, "UTF-8");
 		}
-
-		xfree(unicode_buffer);
-
-		return True;
 	}
 #else
 	if (target == format_string_atom)
 	{
-		uint8 *translated_data;
-		uint32 length = source_size;
-
 		if (rdp_clipboard_request_format != RDP_CF_TEXT)
 			return False;
 
-		logger(Clipboard, Debug,
-		       "xclip_send_data_with_convert(), translating linebreaks before sending data");
-		translated_data = lf2crlf(source, &length);
-		if (translated_data != NULL)
-		{
-			helper_cliprdr_send_response(translated_data, length + 1);
-			xfree(translated_data);	/* Not the same thing as XFree! */
-		}
-
+		lf2crlf(sink, source, source_size);
 		return True;
 	}
 #endif
 	else if (target == rdesktop_native_atom)
 	{
-		helper_cliprdr_send_response(source, source_size + 1);
-
+		xclip_sink_write(sink, source, source_size);
+		xclip_sink_write(sink, (uint8 *) "", 1);
 		return True;
 	}
 	else
@@ -426,6 +641,62 @@ xclip_send_data_with_convert(uint8 * source, size_t source_size, Atom target)
 	}
 }
 
+/* Replies with clipboard data to RDP, converting it from the target format
+   to the expected RDP format as necessary. Returns true if data was sent.
+ */
+static RD_BOOL
+xclip_send_data_with_convert(uint8 * source, size_t source_size, Atom target)
+{
+	XCLIP_SINK sink;
+	char *target_name;
+
+	target_name = XGetAtomName(g_display, target);
+	logger(Clipboard, Debug, "xclip_send_data_with_convert(), target=%s, size=%u",
+	       target_name, (unsigned) source_size);
+	XFree(target_name);
+
+	/* The response starts with its length, so the data is converted
+	   twice: once to measure it, and once more straight into the
+	   channel a piece at a time, rather than into a buffer holding
+	   all of it. */
+	sink.emit = NULL;
+	sink.length = 0;
+	if (!xclip_convert(&sink, source, source_size, target))
+		return False;
+
+	if (rdp_clipboard_request_format == 0)
+		return True;
+
+	logger(Clipboard, Debug,
+	       "xclip_send_data_with_convert(), sending %u bytes", (unsigned) sink.length);
+
+	/* Keep what the server asked for, in case it asks again */
+	if (request_time != XCLIP_TIME_UNKNOWN)
+	{
+		XCLIP_CACHED *entry;
+
+		entry = xclip_cache_add(rdp_clipboard_request_format, sink.length);
+		cache_fill = entry->data;
+		sink.emit = xclip_cache_emit;
+		sink.length = 0;
+		xclip_convert(&sink, source, source_size, target);
+
+		xclip_send_cached(entry);
+	}
+	else
+	{
+		cliprdr_send_data_begin(sink.length);
+		sink.emit = cliprdr_send_data_part;
+		sink.length = 0;
+		xclip_convert(&sink, source, source_size, target);
+		cliprdr_send_data_end();
+
+		helper_cliprdr_end_response();
+	}
+
+	return True;
+}
+
 static void
 xclip_clear_target_props()
 {
@@ -437,6 +708,7 @@ xclip_clear_target_props()
 static void
 xclip_notify_change()
 {
+	xclip_cache_clear();
 	XChangeProperty(g_display, DefaultRootWindow(g_display),
 			rdesktop_selection_notify_atom, XA_INTEGER, 32, PropModeReplace, NULL, 0);
 }
@@ -477,6 +749,7 @@ xclip_probe_selections()
 	{
 		primary_timestamp = 0;
 		clipboard_timestamp = 0;
+		timestamps_pending = 2;
 		XConvertSelection(g_display, primary_atom, timestamp_atom,
 				  rdesktop_primary_timestamp_target_atom, g_wnd, CurrentTime);
 		XConvertSelection(g_display, clipboard_atom, timestamp_atom,
@@ -512,6 +785,47 @@ xclip_probe_selections()
 	probing_selections = False;
 }
 
+/* Asks the most recent selection for its targets, to get the data the
+   server requested, unless that is still cached */
+static void
+xclip_request_targets(Time time)
+{
+	XCLIP_CACHED *entry;
+
+	if (primary_timestamp > clipboard_timestamp)
+	{
+		request_selection = primary_atom;
+		request_time = primary_timestamp;
+	}
+	else
+	{
+		request_selection = clipboard_atom;
+		request_time = clipboard_timestamp;
+	}
+	request_owner = XGetSelectionOwner(g_display, request_selection);
+
+	logger(Clipboard, Debug, "xclip_request_targets(), %s is most recent selection",
+	       request_selection == primary_atom ? "PRIMARY" : "CLIPBOARD");
+
+	if (!probing_selections && request_time != XCLIP_TIME_UNKNOWN
+	    && request_selection == cache_selection && request_owner == cache_owner
+	    && request_time == cache_time)
+	{
+		entry = xclip_cache_find(rdp_clipboard_request_format);
+		if (entry != NULL)
+		{
+			logger(Clipboard, Debug,
+			       "xclip_request_targets(), sending cached response of %u bytes",
+			       (unsigned) entry->length);
+			xclip_send_cached(entry);
+			return;
+		}
+	}
+
+	XConvertSelection(g_display, request_selection, targets_atom,
+			  rdesktop_clipboard_target_atom, g_wnd, time);
+}
+
 /* This function is called for SelectionNotify events.
    The SelectionNotify event is sent from the clipboard owner to the requestor
    after his request was satisfied.
@@ -528,7 +842,21 @@ xclip_handle_SelectionNotify(XSelectionEvent * event)
 	char *selection_name, *target_name, *property_name;
 
 	if (event->property == None)
+	{
+		/* An owner that can't tell when it took the selection is
+		   still asked for the data, which is then not cached */
+		if (event->target == timestamp_atom && timestamps_pending > 0)
+		{
+			if (event->selection == primary_atom)
+				primary_timestamp = XCLIP_TIME_UNKNOWN;
+			else
+				clipboard_timestamp = XCLIP_TIME_UNKNOWN;
+			if (--timestamps_pending == 0)
+				xclip_request_targets(event->time);
+			return;
+		}
 		goto fail;
+	}
 
 	selection_name = XGetAtomName(g_display, event->selection);
 	target_name = XGetAtomName(g_display, event->target);
@@ -588,25 +916,8 @@ xclip_handle_SelectionNotify(XSelectionEvent * event)
 
 		XFree(data);
 
-		if (primary_timestamp && clipboard_timestamp)
-		{
-			if (primary_timestamp > clipboard_timestamp)
-			{
-				logger(Clipboard, Debug,
-				       "xclip_handle_SelectionNotify(), PRIMARY is most recent selection");
-				XConvertSelection(g_display, primary_atom, targets_atom,
-						  rdesktop_clipboard_target_atom, g_wnd,
-						  event->time);
-			}
-			else
-			{
-				logger(Clipboard, Debug,
-				       "xclip_handle_SelectionNotify(), CLIPBOARD is most recent selection");
-				XConvertSelection(g_display, clipboard_atom, targets_atom,
-						  rdesktop_clipboard_target_atom, g_wnd,
-						  event->time);
-			}
-		}
+		if (timestamps_pending > 0 && --timestamps_pending == 0)
+			xclip_request_targets(event->time);
 
 		return;
 	}
@@ -639,6 +950,7 @@ xclip_handle_SelectionNotify(XSelectionEvent * event)
 		if ((wa.your_event_mask | PropertyChangeMask) != wa.your_event_mask)
 		{
 			XSelectInput(g_display, g_wnd, (wa.your_event_mask | PropertyChangeMask));
+			g_incr_added_mask = True;
 		}
 		XFree(data);
 		data = NULL;
@@ -945,9 +1257,13 @@ xclip_handle_PropertyNotify(XPropertyEvent * event)
 			if (nitems == 0)
 			{
 				/* INCR transfer finished */
-				XGetWindowAttributes(g_display, g_wnd, &wa);
-				XSelectInput(g_display, g_wnd,
-					     (wa.your_event_mask ^ PropertyChangeMask));
+				if (g_incr_added_mask)
+				{
+					XGetWindowAttributes(g_display, g_wnd, &wa);
+					XSelectInput(g_display, g_wnd,
+						     (wa.your_event_mask & ~PropertyChangeMask));
+					g_incr_added_mask = False;
+				}
 				XFree(data);
 				g_waiting_for_INCR = 0;
 
@@ -961,13 +1277,19 @@ xclip_handle_PropertyNotify(XPropertyEvent * event)
 					xfree(g_clip_buffer);
 					g_clip_buffer = NULL;
 					g_clip_buflen = 0;
+					g_clip_bufsize = 0;
 				}
 			}
 			else
 			{
 				/* Another chunk in the INCR transfer */
 				offset += (nitems / 4);	/* offset at which to begin the next slurp */
-				g_clip_buffer = xrealloc(g_clip_buffer, g_clip_buflen + nitems);
+				if (g_clip_buflen + nitems > g_clip_bufsize)
+				{
+					/* grow geometrically, chunks are small */
+					g_clip_bufsize = MAX(g_clip_bufsize * 2, g_clip_buflen + nitems);
+					g_clip_buffer = xrealloc(g_clip_buffer, g_clip_bufsize);
+				}
 				memcpy(g_clip_buffer + g_clip_buflen, data, nitems);
 				g_clip_buflen += nitems;
 
@@ -1111,6 +1433,7 @@ ui_clip_request_data(uint32 format)
 
 	logger(Clipboard, Debug, "request from server for format %d", format);
 	rdp_clipboard_request_format = format;
+	request_time = XCLIP_TIME_UNKNOWN;
 
 	if (probing_selections)
 	{
@@ -1139,33 +1462,25 @@ ui_clip_request_data(uint32 format)
 
 	clipboard_owner = XGetSelectionOwner(g_display, clipboard_atom);
 
-	/* Both available */
-	if ((primary_owner != None) && (clipboard_owner != None))
+	/* Ask the owners when they took their selections, to pick the most
+	   recent and to know if what was sent for it before still holds */
+	primary_timestamp = 0;
+	clipboard_timestamp = 0;
+	timestamps_pending = 0;
+	if (primary_owner != None)
 	{
-		primary_timestamp = 0;
-		clipboard_timestamp = 0;
 		XConvertSelection(g_display, primary_atom, timestamp_atom,
 				  rdesktop_primary_timestamp_target_atom, g_wnd, CurrentTime);
-		XConvertSelection(g_display, clipboard_atom, timestamp_atom,
-				  rdesktop_clipboard_timestamp_target_atom, g_wnd, CurrentTime);
-		return;
+		timestamps_pending++;
 	}
-
-	/* Just PRIMARY */
-	if (primary_owner != None)
-	{
-		XConvertSelection(g_display, primary_atom, targets_atom,
-				  rdesktop_clipboard_target_atom, g_wnd, CurrentTime);
-		return;
-	}
-
-	/* Just CLIPBOARD */
 	if (clipboard_owner != None)
 	{
-		XConvertSelection(g_display, clipboard_atom, targets_atom,
-				  rdesktop_clipboard_target_atom, g_wnd, CurrentTime);
-		return;
+		XConvertSelection(g_display, clipboard_atom, timestamp_atom,
+				  rdesktop_clipboard_timestamp_target_atom, g_wnd, CurrentTime);
+		timestamps_pending++;
 	}
+	if (timestamps_pending > 0)
+		return;
 
 	/* No data available */
 	helper_cliprdr_send_empty_response();
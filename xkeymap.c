@@ -23,18 +23,31 @@
 #include <X11/Xlib.h>
 #include <X11/keysym.h>
 
+#include <sys/stat.h>
 #include <ctype.h>
 #include <limits.h>
 #include <time.h>
 #include <string.h>
 #include <assert.h>
+#include <unistd.h>
 #include "rdesktop.h"
 #include "scancodes.h"
 
-#define KEYMAP_SIZE 0x7f+1
-#define KEYMAP_MASK 0x7f
+#define KEYMAP_INITIAL_SIZE 256
 #define KEYMAP_MAX_LINE_LENGTH 80
 
+/* Compiled keymap images in ~/.rdesktop/cache */
+#define KEYMAP_IMAGE_MAGIC 0x4d4b4452	/* "RDKM" in host byte order */
+#define KEYMAP_IMAGE_VERSION 1
+#define KEYMAP_MAX_SOURCES 32
+
+/* Settings a keymap file may change, see keymap_settings */
+#define KEYMAP_SET_LAYOUT		0x01
+#define KEYMAP_SET_COMPOSE		0x02
+#define KEYMAP_SET_KEYBOARD_TYPE	0x04
+#define KEYMAP_SET_KEYBOARD_SUBTYPE	0x08
+#define KEYMAP_SET_FUNCTIONKEYS	0x10
+
 extern Display *g_display;
 extern Window g_wnd;
 extern char g_keymapname[16];
@@ -50,7 +63,27 @@ extern RDP_VERSION g_rdp_version;
 extern RD_BOOL g_numlock_sync;
 
 static RD_BOOL keymap_loaded;
-static key_translation_entry *keymap[KEYMAP_SIZE];
+static char keymap_loaded_name[sizeof(g_keymapname)];
+
+/* Open addressed table of translations by keysym, with linear
+   probing. A NoSymbol keysym marks a free slot. */
+static key_translation_entry *keymap;
+static uint32 keymap_size;
+static uint32 keymap_count;
+
+/* The files the keymap was read from, to tell if an image of it is
+   still current */
+typedef struct
+{
+	char name[KEYMAP_MAX_LINE_LENGTH];
+	time_t mtime;
+	off_t size;
+}
+keymap_source;
+
+static keymap_source keymap_sources[KEYMAP_MAX_SOURCES];
+static int keymap_nsources;
+static uint32 keymap_settings;
 static KeySym keypress_keysyms[256];
 static int min_keycode;
 static uint16 remote_modifier_state = 0;
@@ -72,82 +105,117 @@ free_key_translation(key_translation * ptr)
 	}
 }
 
+/* Forget all translations and where they were read from */
+static void
+xkeymap_free(void)
+{
+	uint32 i;
+
+	for (i = 0; i < keymap_size; i++)
+		free_key_translation(keymap[i].tr);
+	xfree(keymap);
+	keymap = NULL;
+	keymap_size = keymap_count = 0;
+	keymap_nsources = 0;
+	keymap_settings = 0;
+}
+
+#define KEYMAP_HASH(keysym) (((uint32) (keysym) * 0x9e3779b1) >> 8)
+
 /* Free the key_translation_entry for a given keysym and remove from the table */
 static void
 delete_key_translation_entry(KeySym keysym)
 {
-	uint32 hash;
-	key_translation_entry *ptr;
-	key_translation_entry *next;
-	key_translation_entry *prev;
-	key_translation_entry tmp;
-
-	/* Faking a prev node allows us to keep the algorithm simple */
-	hash = keysym & KEYMAP_MASK;
-	ptr = keymap[hash];
-	tmp.next = ptr;
-	prev = &tmp;
+	uint32 mask, i, j, home;
 
-	while (ptr)
+	if (keymap == NULL || keysym == NoSymbol)
+		return;
+
+	mask = keymap_size - 1;
+	for (i = KEYMAP_HASH(keysym) & mask; keymap[i].keysym != keysym; i = (i + 1) & mask)
 	{
-		next = ptr->next;
-		if (ptr->keysym == keysym)
-		{
-			free_key_translation(ptr->tr);
-			prev->next = next;
-			xfree(ptr);
-		}
-		else
+		if (keymap[i].keysym == NoSymbol)
+			return;
+	}
+
+	free_key_translation(keymap[i].tr);
+	keymap_count--;
+
+	/* Move back the entries of the run that follows and would no
+	   longer be found past the hole */
+	for (j = (i + 1) & mask; keymap[j].keysym != NoSymbol; j = (j + 1) & mask)
+	{
+		home = KEYMAP_HASH(keymap[j].keysym) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask))
 		{
-			prev = ptr;
+			keymap[i] = keymap[j];
+			i = j;
 		}
-
-		ptr = next;
 	}
+	keymap[i].keysym = NoSymbol;
+	keymap[i].tr = NULL;
+}
+
+/* Resize the table, keeping its entries */
+static void
+resize_key_translation_table(uint32 size)
+{
+	key_translation_entry *old = keymap;
+	uint32 old_size = keymap_size, i, j;
+
+	keymap = (key_translation_entry *) xmalloc(size * sizeof(key_translation_entry));
+	memset(keymap, 0, size * sizeof(key_translation_entry));
+	keymap_size = size;
 
-	/* Copy pointer back from our fake node */
-	keymap[hash] = tmp.next;
+	for (i = 0; i < old_size; i++)
+	{
+		if (old[i].keysym == NoSymbol)
+			continue;
+		for (j = KEYMAP_HASH(old[i].keysym) & (size - 1); keymap[j].keysym != NoSymbol;
+		     j = (j + 1) & (size - 1));
+		keymap[j] = old[i];
+	}
+	xfree(old);
 }
 
 /* Allocate and return a new entry in the translation table */
 static key_translation_entry *
 new_key_translation_entry(KeySym keysym)
 {
-	uint32 hash;
-	key_translation_entry *entry;
+	uint32 i;
 
 	/* Clear out any existing entry */
 	delete_key_translation_entry(keysym);
 
-	/* Allocate the new one */
-	entry = (key_translation_entry *) xmalloc(sizeof(key_translation_entry));
-	memset(entry, 0, sizeof(key_translation_entry));
-	entry->keysym = keysym;
+	/* Keep the table at most three quarters full */
+	if (keymap == NULL)
+		resize_key_translation_table(KEYMAP_INITIAL_SIZE);
+	else if ((keymap_count + 1) * 4 > keymap_size * 3)
+		resize_key_translation_table(keymap_size * 2);
 
-	/* And insert it at head of list */
-	hash = keysym & KEYMAP_MASK;
-	entry->next = keymap[hash];
-	keymap[hash] = entry;
+	for (i = KEYMAP_HASH(keysym) & (keymap_size - 1); keymap[i].keysym != NoSymbol;
+	     i = (i + 1) & (keymap_size - 1));
+	keymap[i].keysym = keysym;
+	keymap[i].tr = NULL;
+	keymap_count++;
 
-	return entry;
+	return &keymap[i];
 }
 
 /* Retrieve the key_translation_entry for a given keysym */
 static key_translation_entry *
 get_key_translation_entry(uint32 keysym)
 {
-	key_translation_entry *ptr;
-	key_translation_entry *next;
+	uint32 i;
 
-	ptr = keymap[keysym & KEYMAP_MASK];
+	if (keymap == NULL || keysym == NoSymbol)
+		return NULL;
 
-	while (ptr)
+	for (i = KEYMAP_HASH(keysym) & (keymap_size - 1); keymap[i].keysym != NoSymbol;
+	     i = (i + 1) & (keymap_size - 1))
 	{
-		next = ptr->next;
-		if (ptr->keysym == keysym)
-			return ptr;
-
-		ptr = next;
+		if (keymap[i].keysym == keysym)
+			return &keymap[i];
 	}
 
 	/* Not found */
@@ -382,6 +450,8 @@ xkeymap_read(char *mapname)
 	char *line_rest;
 	uint8 scancode;
 	uint16 modifiers;
+	struct stat st;
+	keymap_source *source;
 
 	fp = xkeymap_open(mapname);
 	if (fp == NULL)
@@ -390,6 +460,18 @@ xkeymap_read(char *mapname)
 		return False;
 	}
 
+	/* an image can only be made of keymaps whose files are known */
+	if (keymap_nsources < KEYMAP_MAX_SOURCES && strlen(mapname) < sizeof(source->name)
+	    && fstat(fileno(fp), &st) == 0)
+	{
+		source = &keymap_sources[keymap_nsources++];
+		STRNCPY(source->name, mapname, sizeof(source->name));
+		source->mtime = st.st_mtime;
+		source->size = st.st_size;
+	}
+	else
+		keymap_nsources = KEYMAP_MAX_SOURCES + 1;
+
 	/* FIXME: More tolerant on white space */
 	while (fgets(line, sizeof(line), fp) != NULL)
 	{
@@ -420,6 +502,7 @@ xkeymap_read(char *mapname)
 		if (str_startswith(line, "map "))
 		{
 			g_keylayout = strtoul(line + sizeof("map ") - 1, NULL, 16);
+			keymap_settings |= KEYMAP_SET_LAYOUT;
 			logger(Keyboard, Debug, "xkeymap_read(), Keylayout 0x%x", g_keylayout);
 			continue;
 		}
@@ -429,6 +512,7 @@ xkeymap_read(char *mapname)
 		{
 			logger(Keyboard, Debug, "xkeymap_read(), enabling compose handling");
 			g_enable_compose = True;
+			keymap_settings |= KEYMAP_SET_COMPOSE;
 			continue;
 		}
 
@@ -443,6 +527,7 @@ xkeymap_read(char *mapname)
 		if (str_startswith(line, "keyboard_type "))
 		{
 			g_keyboard_type = strtol(line + sizeof("keyboard_type ") - 1, NULL, 16);
+			keymap_settings |= KEYMAP_SET_KEYBOARD_TYPE;
 			logger(Keyboard, Debug, "xkeymap_read(), keyboard_type 0x%x",
 			       g_keyboard_type);
 			continue;
@@ -453,6 +538,7 @@ xkeymap_read(char *mapname)
 		{
 			g_keyboard_subtype =
 				strtol(line + sizeof("keyboard_subtype ") - 1, NULL, 16);
+			keymap_settings |= KEYMAP_SET_KEYBOARD_SUBTYPE;
 			logger(Keyboard, Debug, "xkeymap_read(), keyboard_subtype 0x%x",
 			       g_keyboard_subtype);
 			continue;
@@ -463,6 +549,7 @@ xkeymap_read(char *mapname)
 		{
 			g_keyboard_functionkeys =
 				strtol(line + sizeof("keyboard_functionkeys ") - 1, NULL, 16);
+			keymap_settings |= KEYMAP_SET_FUNCTIONKEYS;
 			logger(Keyboard, Debug, "xkeymap_read(), keyboard_functionkeys 0x%x",
 			       g_keyboard_functionkeys);
 			continue;
@@ -539,18 +626,213 @@ xkeymap_read(char *mapname)
 }
 
 
-/* Before connecting and creating UI */
+/* Path of the image of a keymap, False if there is no home directory
+   or the path does not fit in size */
+static RD_BOOL
+xkeymap_image_path(const char *mapname, char *path, size_t size)
+{
+	char *home, *p;
+	int n;
+
+	home = getenv("HOME");
+	if (home == NULL)
+		return False;
+
+	n = snprintf(path, size, "%s/.rdesktop/cache/keymap_", home);
+	if (n < 0 || (size_t) n >= size)
+		return False;
+	if ((size_t) snprintf(path + n, size - n, "%s", mapname) >= size - n)
+		return False;
+
+	for (p = path + n; *p; p++)
+	{
+		if (!isalnum((unsigned char) *p) && *p != '-' && *p != '.')
+			*p = '_';
+	}
+	return True;
+}
+
+/* An image holds the header, the source files, the settings and then
+   for each keysym its translations. Images are only read back by the
+   machine that made them, so they are in host byte order. */
+static void
+xkeymap_save_image(const char *mapname)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	FILE *fp;
+	key_translation *tr;
+	uint32 header[3], values[5], i, n;
+	RD_BOOL ok;
+
+	if (keymap_nsources > KEYMAP_MAX_SOURCES || !rd_pstcache_mkdir())
+		return;
+
+	if (!xkeymap_image_path(mapname, path, sizeof(path)) ||
+	    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid()) >= (int) sizeof(tmp))
+		return;
+
+	fp = fopen(tmp, "wb");
+	if (fp == NULL)
+		return;
+
+	header[0] = KEYMAP_IMAGE_MAGIC;
+	header[1] = KEYMAP_IMAGE_VERSION;
+	header[2] = keymap_nsources;
+	ok = fwrite(header, sizeof(header), 1, fp) == 1;
+	ok = ok && fwrite(keymap_sources, sizeof(keymap_source), keymap_nsources,
+			  fp) == (size_t) keymap_nsources;
+
+	values[0] = keymap_settings;
+	values[1] = g_keylayout;
+	values[2] = g_keyboard_type;
+	values[3] = g_keyboard_subtype;
+	values[4] = g_keyboard_functionkeys;
+	ok = ok && fwrite(values, sizeof(values), 1, fp) == 1;
+	ok = ok && fwrite(&keymap_count, sizeof(keymap_count), 1, fp) == 1;
+
+	for (i = 0; ok && i < keymap_size; i++)
+	{
+		if (keymap[i].keysym == NoSymbol)
+			continue;
+		for (n = 0, tr = keymap[i].tr; tr; tr = tr->next)
+			n++;
+		ok = fwrite(&keymap[i].keysym, sizeof(uint32), 1, fp) == 1
+			&& fwrite(&n, sizeof(n), 1, fp) == 1;
+		for (tr = keymap[i].tr; ok && tr; tr = tr->next)
+			ok = fwrite(&tr->scancode, sizeof(tr->scancode), 1, fp) == 1
+				&& fwrite(&tr->modifiers, sizeof(tr->modifiers), 1, fp) == 1
+				&& fwrite(&tr->seq_keysym, sizeof(tr->seq_keysym), 1, fp) == 1;
+	}
+
+	if (fclose(fp) != 0)
+		ok = False;
+	if (!ok || rename(tmp, path) != 0)
+	{
+		logger(Keyboard, Warning, "xkeymap_save_image(), failed to write %s", path);
+		unlink(tmp);
+		return;
+	}
+	logger(Keyboard, Debug, "xkeymap_save_image(), wrote %s", path);
+}
+
+/* Load the image of a keymap, if the files it was made from have not
+   changed since */
+static RD_BOOL
+xkeymap_load_image(const char *mapname)
+{
+	char path[PATH_MAX];
+	FILE *fp, *src;
+	struct stat st;
+	keymap_source sources[KEYMAP_MAX_SOURCES];
+	key_translation_entry *entry;
+	key_translation *tr, **prev_next;
+	uint32 header[3], values[5], count, keysym, i, n;
+	RD_BOOL ok;
+
+	if (!xkeymap_image_path(mapname, path, sizeof(path)))
+		return False;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL)
+		return False;
+
+	ok = fread(header, sizeof(header), 1, fp) == 1 && header[0] == KEYMAP_IMAGE_MAGIC
+		&& header[1] == KEYMAP_IMAGE_VERSION && header[2] >= 1
+		&& header[2] <= KEYMAP_MAX_SOURCES
+		&& fread(sources, sizeof(keymap_source), header[2], fp) == header[2];
+
+	for (i = 0; ok && i < header[2]; i++)
+	{
+		sources[i].name[sizeof(sources[i].name) - 1] = '\0';
+		src = xkeymap_open(sources[i].name);
+		if (src == NULL)
+		{
+			ok = False;
+			break;
+		}
+		ok = fstat(fileno(src), &st) == 0 && st.st_mtime == sources[i].mtime
+			&& st.st_size == sources[i].size;
+		fclose(src);
+	}
+
+	ok = ok && fread(values, sizeof(values), 1, fp) == 1
+		&& fread(&count, sizeof(count), 1, fp) == 1;
+
+	for (i = 0; ok && i < count; i++)
+	{
+		ok = fread(&keysym, sizeof(keysym), 1, fp) == 1 && keysym != NoSymbol
+			&& fread(&n, sizeof(n), 1, fp) == 1;
+		if (!ok)
+			break;
+
+		entry = new_key_translation_entry(keysym);
+		prev_next = &entry->tr;
+		while (ok && n--)
+		{
+			tr = (key_translation *) xmalloc(sizeof(key_translation));
+			memset(tr, 0, sizeof(key_translation));
+			*prev_next = tr;
+			prev_next = &tr->next;
+			ok = fread(&tr->scancode, sizeof(tr->scancode), 1, fp) == 1
+				&& fread(&tr->modifiers, sizeof(tr->modifiers), 1, fp) == 1
+				&& fread(&tr->seq_keysym, sizeof(tr->seq_keysym), 1, fp) == 1;
+		}
+	}
+	fclose(fp);
+
+	if (!ok)
+	{
+		/* start over from the text files */
+		xkeymap_free();
+		return False;
+	}
+
+	if (values[0] & KEYMAP_SET_LAYOUT)
+		g_keylayout = values[1];
+	if (values[0] & KEYMAP_SET_COMPOSE)
+		g_enable_compose = True;
+	if (values[0] & KEYMAP_SET_KEYBOARD_TYPE)
+		g_keyboard_type = values[2];
+	if (values[0] & KEYMAP_SET_KEYBOARD_SUBTYPE)
+		g_keyboard_subtype = values[3];
+	if (values[0] & KEYMAP_SET_FUNCTIONKEYS)
+		g_keyboard_functionkeys = values[4];
+
+	logger(Keyboard, Debug, "xkeymap_load_image(), loaded %u keysyms from %s", count, path);
+	return True;
+}
+
+/* Load the keymap named by g_keymapname, unless it is the one loaded
+   already. Needs no display, so a session host can do it once for the
+   sessions it starts. */
 void
-xkeymap_init(void)
+xkeymap_load(void)
 {
-	unsigned int max_keycode;
+	if (keymap_loaded && !strcmp(keymap_loaded_name, g_keymapname))
+		return;
+
+	xkeymap_free();
+	keymap_loaded = False;
+	if (!strcmp(g_keymapname, "none"))
+		return;
 
-	if (strcmp(g_keymapname, "none"))
+	if (xkeymap_load_image(g_keymapname))
+		keymap_loaded = True;
+	else if (xkeymap_read(g_keymapname))
 	{
-		if (xkeymap_read(g_keymapname))
-			keymap_loaded = True;
+		keymap_loaded = True;
+		xkeymap_save_image(g_keymapname);
 	}
+	STRNCPY(keymap_loaded_name, g_keymapname, sizeof(keymap_loaded_name));
+}
+
+/* Before connecting and creating UI */
+void
+xkeymap_init(void)
+{
+	unsigned int max_keycode;
 
+	xkeymap_load();
 	XDisplayKeycodes(g_display, &min_keycode, (int *) &max_keycode);
 }
 
@@ -6,6 +6,7 @@ int ewmh_get_window_state(Window w);
 int ewmh_change_state(Window wnd, int state);
 int ewmh_move_to_desktop(Window wnd, unsigned int desktop);
 int ewmh_get_window_desktop(Window wnd);
+RD_BOOL ewmh_is_window_on_current_desktop(Window wnd);
 void ewmh_set_wm_name(Window wnd, const char *title);
 void ewmh_set_wm_pid(Window wnd, pid_t pid);
 int ewmh_set_window_popup(Window wnd);
@@ -14,5 +15,6 @@ void ewmh_set_icon(Window wnd, int width, int height, const char *rgba_data);
 void ewmh_del_icon(Window wnd, int width, int height);
 int ewmh_set_window_above(Window wnd);
 RD_BOOL ewmh_is_window_above(Window w);
+int ewmh_set_fullscreen_monitors(Window wnd, int top, int bottom, int left, int right);
 void set_keypress_keysym(unsigned int keycode, KeySym keysym);
 KeySym reset_keypress_keysym(unsigned int keycode, KeySym keysym);
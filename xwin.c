@@ -30,6 +30,7 @@
 #include <sys/time.h>
 #include <time.h>
 #include <errno.h>
+#include <limits.h>
 #include <strings.h>
 #include "rdesktop.h"
 #include "xproto.h"
@@ -37,6 +38,14 @@
 #ifdef HAVE_XRANDR
 #include <X11/extensions/Xrandr.h>
 #endif
+#ifdef HAVE_XRENDER
+#include <X11/extensions/Xrender.h>
+#endif
+#ifdef HAVE_MITSHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#endif
 
 #ifdef __APPLE__
 #include <sys/param.h>
@@ -65,6 +74,10 @@ extern int g_ypos;
 extern int g_pos;
 extern RD_BOOL g_sendmotion;
 extern RD_BOOL g_fullscreen;
+extern RD_BOOL g_multimon;
+extern int g_scale;
+extern RD_MONITOR g_monitors[];
+extern int g_num_monitors;
 extern RD_BOOL g_grab_keyboard;
 extern RD_BOOL g_hide_decorations;
 extern RD_BOOL g_pending_resize;
@@ -95,12 +108,18 @@ RD_BOOL g_dynamic_session_resize = True;
 static uint32 g_window_width;
 static uint32 g_window_height;
 
+/* Size of g_wnd as created, resized, or last configured, in every mode.
+   Kept so that drawing and input never wait for XGetWindowAttributes. */
+static int g_wnd_width;
+static int g_wnd_height;
+
 /* SeamlessRDP support */
 typedef struct _seamless_group
 {
 	Window wnd;
 	unsigned long id;
 	unsigned int refcnt;
+	struct _seamless_group *hash_next;
 } seamless_group;
 typedef struct _seamless_window
 {
@@ -124,19 +143,43 @@ typedef struct _seamless_window
 	char icon_buffer[32 * 32 * 4];
 
 	struct _seamless_window *next;
+	struct _seamless_window *id_next;	/* g_seamless_by_id chain */
+	struct _seamless_window *wnd_next;	/* g_seamless_by_wnd chain */
+
+	RD_BOOL gridded;	/* in g_seamless_grid, over the cells below */
+	int grid_x0, grid_y0, grid_x1, grid_y1;
+	unsigned int grid_stamp;
+	struct _seamless_window *draw_next;	/* sw_windows_in_rect() result */
+
+	/* Within a batch of SeamlessRDP commands, moves and restacks are
+	   only recorded, and applied to the X window when it ends */
+	RD_BOOL move_pending;
+	RD_BOOL restack_pending;
+	unsigned long restack_serial;
+	struct timeval restack_deadline;
 } seamless_window;
 static seamless_window *g_seamless_windows = NULL;
+
+/* Seamless windows are looked up by server id for every SeamlessRDP
+   command and by X window for every event, so they are also chained
+   into hash tables by both keys. Groups are only reachable through
+   their table. */
+#define SEAMLESS_HASH_SIZE 256
+#define SEAMLESS_HASH(key) ((((key) >> 8) ^ (key)) & (SEAMLESS_HASH_SIZE - 1))
+static seamless_window *g_seamless_by_id[SEAMLESS_HASH_SIZE];
+static seamless_window *g_seamless_by_wnd[SEAMLESS_HASH_SIZE];
+static seamless_group *g_seamless_groups[SEAMLESS_HASH_SIZE];
 static unsigned long g_seamless_focused = 0;
 static RD_BOOL g_seamless_started = False;	/* Server end is up and running */
 RD_BOOL g_seamless_active = False;	/* We are currently in seamless mode */
 static RD_BOOL g_seamless_hidden = False;	/* Desktop is hidden on server */
 static RD_BOOL g_seamless_broken_restack = False;	/* WM does not properly restack */
+static RD_BOOL g_seamless_batch = False;	/* Processing a batch of commands */
 extern RD_BOOL g_seamless_rdp;
 extern RD_BOOL g_seamless_persistent_mode;
 
 extern uint32 g_embed_wnd;
 RD_BOOL g_enable_compose = False;
-RD_BOOL g_Unobscured;		/* used for screenblt */
 static GC g_gc = NULL;
 static GC g_create_bitmap_gc = NULL;
 static GC g_create_glyph_gc = NULL;
@@ -150,6 +193,9 @@ static int g_depth;
    This may be larger than g_depth, in which case some of the bits would
    be kept solely for alignment (e.g. 32bpp pixmaps on a 24bpp visual). */
 static int g_bpp;
+/* Whether the alpha channel of 32 bpp RDP bitmaps is of any use to
+   us, which it is not unless the visual has one */
+RD_BOOL g_bitmap_alpha = True;
 static XIM g_IM;
 static XIC g_IC;
 static XModifierKeymap *g_mod_map;
@@ -162,6 +208,7 @@ static Atom g_protocol_atom, g_kill_atom;
 extern Atom g_net_wm_state_atom;
 extern Atom g_net_wm_desktop_atom;
 extern Atom g_net_wm_ping_atom;
+extern Atom g_net_current_desktop_atom;
 
 static RD_BOOL g_focused;
 static RD_BOOL g_mouse_in_wnd;
@@ -193,6 +240,102 @@ static int g_red_shift_l, g_blue_shift_l, g_green_shift_l;
 /* software backing store */
 extern RD_BOOL g_ownbackstore;
 static Pixmap g_backstore = 0;
+/* The size of the session drawn in the backstore, and the size of
+   the pixmap, which is left larger when the session shrinks */
+static uint32 g_backstore_width, g_backstore_height;
+static uint32 g_backstore_alloc_width, g_backstore_alloc_height;
+
+/* The offscreen surface drawing orders go to after a switch surface
+   order, 0 while they go to the screen */
+static Pixmap g_surface = 0;
+static int g_surface_width, g_surface_height;
+
+#define DRAW_TARGET	(g_surface != 0 ? g_surface : g_ownbackstore ? g_backstore : g_wnd)
+
+/* MIT-SHM image uploads. A small pool of shared memory segments is
+   kept around and reused, a segment is busy from the moment an image
+   is put from it until the X server reports completion. */
+#define XSHM_POOL_SIZE		4
+#define XSHM_MIN_IMAGE_SIZE	4096
+#define XSHM_SEGMENT_ROUNDING	65536
+
+typedef struct _xshm_segment
+{
+	XImage *image;
+#ifdef HAVE_MITSHM
+	XShmSegmentInfo info;
+	size_t size;
+	unsigned long serial;
+	RD_BOOL busy;
+#endif
+} xshm_segment;
+
+#ifdef HAVE_MITSHM
+static RD_BOOL g_shm_available = False;
+static int g_shm_completion_type;
+static xshm_segment g_shm_pool[XSHM_POOL_SIZE];
+#endif
+
+/* Glyphs, and the text run that ui_draw_text() composes them into */
+typedef struct _xglyph
+{
+	Pixmap pixmap;		/* created on first use by ui_draw_glyph() */
+	int width, height;
+	uint32 serial;		/* never reused, unlike the address */
+	uint8 *data;
+} xglyph;
+
+typedef struct _text_run_glyph
+{
+	xglyph *glyph;
+	int x, y;
+} text_run_glyph;
+
+static text_run_glyph *g_text_run = NULL;
+static int g_text_run_length = 0;
+static int g_text_run_size = 0;
+static uint8 *g_text_mask = NULL;
+static int g_text_mask_size = 0;
+static Pixmap g_text_pixmap = 0;
+static int g_text_pixmap_width = 0;
+static int g_text_pixmap_height = 0;
+static uint32 g_glyph_serial = 0;
+
+/* Stipples of the text runs drawn recently. A string drawn again, a
+   menu label or a list entry, is filled from the copy the X server
+   already has rather than composed and uploaded again. A run is known
+   by the serials of its glyphs and their positions relative to the
+   first one, so a glyph replaced in the font cache never matches. */
+#define TEXT_CACHE_SIZE		256
+#define TEXT_CACHE_MAX_GLYPHS	128
+#define TEXT_CACHE_MAX_PIXELS	(1024 * 64)
+
+typedef struct _text_cache_entry
+{
+	uint32 hash;
+	int n;
+	uint32 *key;		/* serial, x and y of each glyph */
+	Pixmap pixmap;
+	int x, y;		/* of the stipple, from the first glyph */
+	int width, height;
+} text_cache_entry;
+
+static text_cache_entry g_text_cache[TEXT_CACHE_SIZE];
+static unsigned long g_text_cache_hits, g_text_cache_misses;
+
+static void
+text_cache_clear(void)
+{
+	int i;
+
+	for (i = 0; i < TEXT_CACHE_SIZE; i++)
+	{
+		if (g_text_cache[i].pixmap != 0)
+			XFreePixmap(g_display, g_text_cache[i].pixmap);
+		xfree(g_text_cache[i].key);
+	}
+	memset(g_text_cache, 0, sizeof(g_text_cache));
+}
 
 /* Moving in single app mode */
 static RD_BOOL g_moving_wnd;
@@ -200,6 +343,13 @@ static int g_move_x_offset = 0;
 static int g_move_y_offset = 0;
 static RD_BOOL g_using_full_workarea = False;
 
+/* Why the main window cannot be seen, output is suppressed while it is
+   hidden. Allowing it again has the server repaint the whole session. */
+static RD_BOOL g_wnd_obscured = False;
+static RD_BOOL g_wnd_iconic = False;
+static RD_BOOL g_wnd_elsewhere = False;	/* on another workspace */
+static RD_BOOL g_wnd_hidden = False;
+
 #ifdef WITH_RDPSND
 extern RD_BOOL g_rdpsnd;
 #endif
@@ -225,6 +375,134 @@ typedef struct
 }
 PixelColour;
 
+/* Seamless windows are also kept in a grid of cells, so that drawing
+   is only copied to the windows it touches. The grid wraps around, so
+   it covers any desktop size, and a window is entered in every cell
+   its rectangle overlaps. */
+#define SEAMLESS_GRID_SHIFT	7	/* cells of 128x128 pixels */
+#define SEAMLESS_GRID_SIZE	16	/* cells per axis */
+
+typedef struct
+{
+	seamless_window **windows;
+	int count, size;
+}
+seamless_cell;
+
+static seamless_cell g_seamless_grid[SEAMLESS_GRID_SIZE][SEAMLESS_GRID_SIZE];
+static unsigned int g_seamless_grid_stamp = 0;
+
+/* Cells spanned by pixels first to last, as a range of at most
+   SEAMLESS_GRID_SIZE that is wrapped when indexing */
+static void
+sw_grid_span(int first, int last, int *c0, int *c1)
+{
+	*c0 = first >= 0 ? first >> SEAMLESS_GRID_SHIFT :
+		-((-first - 1) >> SEAMLESS_GRID_SHIFT) - 1;
+	*c1 = last >= 0 ? last >> SEAMLESS_GRID_SHIFT : -((-last - 1) >> SEAMLESS_GRID_SHIFT) - 1;
+	if (*c1 - *c0 >= SEAMLESS_GRID_SIZE)
+		*c1 = *c0 + SEAMLESS_GRID_SIZE - 1;
+}
+
+#define SEAMLESS_CELL(cx, cy) \
+	(&g_seamless_grid[(cy) & (SEAMLESS_GRID_SIZE - 1)][(cx) & (SEAMLESS_GRID_SIZE - 1)])
+
+static void
+sw_grid_remove(seamless_window * sw)
+{
+	seamless_cell *cell;
+	int cx, cy, i;
+
+	if (!sw->gridded)
+		return;
+
+	for (cy = sw->grid_y0; cy <= sw->grid_y1; cy++)
+	{
+		for (cx = sw->grid_x0; cx <= sw->grid_x1; cx++)
+		{
+			cell = SEAMLESS_CELL(cx, cy);
+			for (i = 0; i < cell->count; i++)
+			{
+				if (cell->windows[i] == sw)
+				{
+					cell->windows[i] = cell->windows[--cell->count];
+					break;
+				}
+			}
+		}
+	}
+	sw->gridded = False;
+}
+
+/* Enter a window in the grid at its current position, to be called
+   whenever its position or size changes */
+static void
+sw_grid_update(seamless_window * sw)
+{
+	seamless_cell *cell;
+	int cx, cy;
+
+	sw_grid_remove(sw);
+	if (sw->width <= 0 || sw->height <= 0)
+		return;
+
+	sw_grid_span(sw->xoffset, sw->xoffset + sw->width - 1, &sw->grid_x0, &sw->grid_x1);
+	sw_grid_span(sw->yoffset, sw->yoffset + sw->height - 1, &sw->grid_y0, &sw->grid_y1);
+	for (cy = sw->grid_y0; cy <= sw->grid_y1; cy++)
+	{
+		for (cx = sw->grid_x0; cx <= sw->grid_x1; cx++)
+		{
+			cell = SEAMLESS_CELL(cx, cy);
+			if (cell->count == cell->size)
+			{
+				cell->size = cell->size ? cell->size * 2 : 4;
+				cell->windows =
+					xrealloc(cell->windows,
+						 cell->size * sizeof(seamless_window *));
+			}
+			cell->windows[cell->count++] = sw;
+		}
+	}
+	sw->gridded = True;
+}
+
+/* Return the seamless windows intersecting x, y, cx, cy, chained
+   through draw_next */
+static seamless_window *
+sw_windows_in_rect(int x, int y, int cx, int cy)
+{
+	seamless_window *sw, *head = NULL;
+	seamless_cell *cell;
+	int gx0, gy0, gx1, gy1, gx, gy, i;
+
+	if (cx <= 0 || cy <= 0)
+		return NULL;
+
+	g_seamless_grid_stamp++;
+	sw_grid_span(x, x + cx - 1, &gx0, &gx1);
+	sw_grid_span(y, y + cy - 1, &gy0, &gy1);
+	for (gy = gy0; gy <= gy1; gy++)
+	{
+		for (gx = gx0; gx <= gx1; gx++)
+		{
+			cell = SEAMLESS_CELL(gx, gy);
+			for (i = 0; i < cell->count; i++)
+			{
+				sw = cell->windows[i];
+				if (sw->grid_stamp == g_seamless_grid_stamp)
+					continue;
+				sw->grid_stamp = g_seamless_grid_stamp;
+				if (sw->xoffset >= x + cx || sw->xoffset + sw->width <= x
+				    || sw->yoffset >= y + cy || sw->yoffset + sw->height <= y)
+					continue;
+				sw->draw_next = head;
+				head = sw;
+			}
+		}
+	}
+	return head;
+}
+
 #define ON_ALL_SEAMLESS_WINDOWS(func, args) \
         do { \
                 seamless_window *sw; \
@@ -241,6 +519,341 @@ PixelColour;
                 XSetClipRectangles(g_display, g_gc, 0, 0, &g_clip_rectangle, 1, YXBanded); \
         } while (0)
 
+/* Like ON_ALL_SEAMLESS_WINDOWS, for the windows that the area bx, by,
+   bcx, bcy within the clip rectangle intersects */
+#define ON_SEAMLESS_WINDOWS_IN(func, args, bx, by, bcx, bcy) \
+	do { \
+		seamless_window *sw, *sw_list; \
+		XRectangle rect; \
+		int sx0, sy0, sx1, sy1; \
+		if (!g_seamless_windows) break; \
+		sx0 = MAX((bx), g_clip_rectangle.x); \
+		sy0 = MAX((by), g_clip_rectangle.y); \
+		sx1 = MIN((bx) + (bcx), g_clip_rectangle.x + g_clip_rectangle.width); \
+		sy1 = MIN((by) + (bcy), g_clip_rectangle.y + g_clip_rectangle.height); \
+		sw_list = sw_windows_in_rect(sx0, sy0, sx1 - sx0, sy1 - sy0); \
+		if (!sw_list) break; \
+		for (sw = sw_list; sw; sw = sw->draw_next) { \
+			rect.x = g_clip_rectangle.x - sw->xoffset; \
+			rect.y = g_clip_rectangle.y - sw->yoffset; \
+			rect.width = g_clip_rectangle.width; \
+			rect.height = g_clip_rectangle.height; \
+			XSetClipRectangles(g_display, g_gc, 0, 0, &rect, 1, YXBanded); \
+			func args; \
+		} \
+		XSetClipRectangles(g_display, g_gc, 0, 0, &g_clip_rectangle, 1, YXBanded); \
+	} while (0)
+
+/* With a backstore, drawing goes to the backstore alone. The area
+   each operation touched is recorded, and the window and the seamless
+   windows are brought up to date from the backstore once per update. */
+#define DAMAGE_MAX_RECTS	128
+
+static Region g_damage = NULL;
+static int g_damage_rects = 0;
+static GC g_damage_gc = NULL;
+
+static void
+backstore_damage(int x, int y, int cx, int cy)
+{
+	XRectangle rect;
+	int right, bottom;
+
+	/* what is drawn to an offscreen surface is not on screen */
+	if (!g_ownbackstore || g_surface != 0)
+		return;
+
+	right = MIN(x + cx, g_clip_rectangle.x + g_clip_rectangle.width);
+	bottom = MIN(y + cy, g_clip_rectangle.y + g_clip_rectangle.height);
+	x = MAX(x, g_clip_rectangle.x);
+	y = MAX(y, g_clip_rectangle.y);
+	if (x >= right || y >= bottom)
+		return;
+
+	rect.x = x;
+	rect.y = y;
+	rect.width = right - x;
+	rect.height = bottom - y;
+
+	if (g_damage == NULL)
+		g_damage = XCreateRegion();
+	XUnionRectWithRegion(&rect, g_damage, g_damage);
+
+	/* merging into a region gets slower the more bands it has, so a
+	   very fragmented one is replaced by its bounding box */
+	if (++g_damage_rects > DAMAGE_MAX_RECTS)
+	{
+		XClipBox(g_damage, &rect);
+		XDestroyRegion(g_damage);
+		g_damage = XCreateRegion();
+		XUnionRectWithRegion(&rect, g_damage, g_damage);
+		g_damage_rects = 1;
+	}
+}
+
+/* With --scale, the window shows the session enlarged by g_scale
+   percent. Everything is drawn into the backstore at the size of the
+   session, and XRender scales what changes into the window. */
+#define SCALED(v) ((int) (v) * g_scale / 100)
+#define UNSCALED(v) ((int) (v) * 100 / g_scale)
+
+#ifdef HAVE_XRENDER
+static Picture g_backstore_picture = None;
+static Picture g_wnd_picture = None;
+#endif
+
+static void
+backstore_free_pictures(void)
+{
+#ifdef HAVE_XRENDER
+	if (g_backstore_picture != None)
+		XRenderFreePicture(g_display, g_backstore_picture);
+	if (g_wnd_picture != None)
+		XRenderFreePicture(g_display, g_wnd_picture);
+	g_backstore_picture = g_wnd_picture = None;
+#endif
+}
+
+/* Draw the area of the backstore given in session coordinates into the
+   window, scaled up with bilinear filtering */
+static void
+backstore_present_scaled(int x, int y, int cx, int cy)
+{
+#ifdef HAVE_XRENDER
+	XRenderPictFormat *format;
+	XTransform transform;
+	int left, top, right, bottom;
+
+	if (g_backstore_picture == None)
+	{
+		format = XRenderFindVisualFormat(g_display, g_visual);
+		g_backstore_picture = XRenderCreatePicture(g_display, g_backstore, format, 0, NULL);
+		g_wnd_picture = XRenderCreatePicture(g_display, g_wnd, format, 0, NULL);
+
+		/* maps window to backstore coordinates */
+		memset(&transform, 0, sizeof(transform));
+		transform.matrix[0][0] = XDoubleToFixed(100.0 / g_scale);
+		transform.matrix[1][1] = XDoubleToFixed(100.0 / g_scale);
+		transform.matrix[2][2] = XDoubleToFixed(1);
+		XRenderSetPictureTransform(g_display, g_backstore_picture, &transform);
+		XRenderSetPictureFilter(g_display, g_backstore_picture, FilterBilinear, NULL, 0);
+	}
+
+	/* the filter blends in the pixels around the area */
+	left = MAX(SCALED(x - 1), 0);
+	top = MAX(SCALED(y - 1), 0);
+	right = SCALED(x + cx + 1) + 1;
+	bottom = SCALED(y + cy + 1) + 1;
+
+	XRenderComposite(g_display, PictOpSrc, g_backstore_picture, None, g_wnd_picture,
+			 left, top, 0, 0, left, top, right - left, bottom - top);
+#else
+	UNUSED(x);
+	UNUSED(y);
+	UNUSED(cx);
+	UNUSED(cy);
+#endif
+}
+
+/* Presentation statistics */
+static unsigned long g_frames_presented;
+static unsigned long g_frames_merged;
+static unsigned long g_frames_missed;
+/* X requests made before the statistics were last reset */
+static unsigned long g_x_requests_base;
+/* Bitmap atlas pages, and the bitmaps in them */
+static unsigned long g_atlas_pages, g_atlas_bitmaps;
+
+/* Copy the damaged area to the window and every seamless window it
+   touches, with one request per window */
+static void
+backstore_update_windows(void)
+{
+	seamless_window *sw;
+	XGCValues values;
+	XRectangle box;
+
+	if (g_damage == NULL)
+		return;
+
+	if (XEmptyRegion(g_damage))
+		goto done;
+
+	g_frames_presented++;
+	if (g_damage_gc == NULL)
+	{
+		values.graphics_exposures = False;
+		g_damage_gc = XCreateGC(g_display, g_wnd, GCGraphicsExposures, &values);
+	}
+
+	XSetRegion(g_display, g_damage_gc, g_damage);
+	XClipBox(g_damage, &box);
+	if (g_scale != 100)
+		backstore_present_scaled(box.x, box.y, box.width, box.height);
+	else if (!g_seamless_active)
+	{
+		XSetClipOrigin(g_display, g_damage_gc, 0, 0);
+		XCopyArea(g_display, g_backstore, g_wnd, g_damage_gc, box.x, box.y, box.width,
+			  box.height, box.x, box.y);
+	}
+	for (sw = sw_windows_in_rect(box.x, box.y, box.width, box.height); sw;
+	     sw = sw->draw_next)
+	{
+		XSetClipOrigin(g_display, g_damage_gc, -sw->xoffset, -sw->yoffset);
+		XCopyArea(g_display, g_backstore, sw->wnd, g_damage_gc, sw->xoffset,
+			  sw->yoffset, sw->width, sw->height, 0, 0);
+	}
+
+      done:
+	XDestroyRegion(g_damage);
+	g_damage = NULL;
+	g_damage_rects = 0;
+}
+
+/* With --frame-pacing, the windows are brought up to date at most once
+   per display refresh. An update ending sooner than that after the last
+   presentation is held back, together with any that follow it, until
+   the next refresh is due. */
+extern RD_BOOL g_frame_pacing;
+
+static int g_frame_rate = 0;
+static struct timeval g_frame_last;
+static RD_BOOL g_frame_held = False;
+
+static int
+frame_refresh_rate(void)
+{
+	int rate = 0;
+#ifdef HAVE_XRANDR
+	XRRScreenConfiguration *conf;
+
+	conf = XRRGetScreenInfo(g_display, DefaultRootWindow(g_display));
+	if (conf != NULL)
+	{
+		rate = XRRConfigCurrentRate(conf);
+		XRRFreeScreenConfigInfo(conf);
+	}
+#endif
+	if (rate <= 0)
+		rate = 60;
+
+	logger(GUI, Debug, "frame_refresh_rate(), presenting at %d Hz", rate);
+	return rate;
+}
+
+/* Microseconds since the last presentation */
+static long
+frame_elapsed(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - g_frame_last.tv_sec) * 1000000L +
+		(now.tv_usec - g_frame_last.tv_usec);
+}
+
+static void
+frame_present(void)
+{
+	long interval, elapsed;
+
+	interval = 1000000L / g_frame_rate;
+	elapsed = frame_elapsed();
+
+	/* refreshes that went by while a frame was waiting for them */
+	if (g_frame_held && elapsed > 2 * interval)
+		g_frames_missed += elapsed / interval - 1;
+
+	backstore_update_windows();
+	gettimeofday(&g_frame_last, NULL);
+	g_frame_held = False;
+}
+
+/* Bring the windows up to date from the backstore, or with frame pacing
+   when the next refresh is due. Returns the ms until then when the
+   damage was held back, -1 otherwise. */
+static int
+frame_update(void)
+{
+	long interval, elapsed;
+
+	if (!g_frame_pacing)
+	{
+		backstore_update_windows();
+		return -1;
+	}
+
+	if (g_damage == NULL)
+		return -1;
+
+	if (g_frame_rate == 0)
+		g_frame_rate = frame_refresh_rate();
+
+	interval = 1000000L / g_frame_rate;
+	elapsed = frame_elapsed();
+
+	/* a negative time means the clock was set back */
+	if (elapsed >= 0 && elapsed < interval)
+		return (interval - elapsed + 999) / 1000;
+
+	frame_present();
+	return -1;
+}
+
+void
+ui_report_frame_stats(void)
+{
+	if (!g_frame_pacing || g_frame_rate == 0)
+		return;
+
+	logger(GUI, Verbose,
+	       "Frame pacing at %d Hz: %lu frames presented, %lu updates merged, %lu refreshes missed",
+	       g_frame_rate, g_frames_presented, g_frames_merged, g_frames_missed);
+}
+
+/* Format what has been shown, and the X requests it took, into buf */
+RD_BOOL
+ui_format_stats(int n, char *buf, size_t size)
+{
+	if (n != 0 || g_display == NULL)
+		return False;
+
+	snprintf(buf, size,
+		 "frames_presented=%lu frames_merged=%lu refreshes_missed=%lu x_requests=%lu "
+		 "atlas_pages=%lu atlas_bitmaps=%lu text_cache_hits=%lu text_cache_misses=%lu",
+		 g_frames_presented, g_frames_merged, g_frames_missed,
+		 NextRequest(g_display) - g_x_requests_base, g_atlas_pages, g_atlas_bitmaps,
+		 g_text_cache_hits, g_text_cache_misses);
+	return True;
+}
+
+void
+ui_reset_stats(void)
+{
+	g_frames_presented = g_frames_merged = g_frames_missed = 0;
+	g_text_cache_hits = g_text_cache_misses = 0;
+	if (g_display != NULL)
+		g_x_requests_base = NextRequest(g_display);
+}
+
+/* For drawing operations covering x, y, cx, cy. With a backstore,
+   the operation itself only draws to the backstore, and on an
+   offscreen surface nothing is shown. */
+#define ON_ALL_SEAMLESS_WINDOWS_DRAW(func, args, x, y, cx, cy) \
+	do { \
+		if (g_surface != 0) \
+			break; \
+		if (g_ownbackstore) \
+			backstore_damage(x, y, cx, cy); \
+		else \
+			ON_SEAMLESS_WINDOWS_IN(func, args, x, y, cx, cy); \
+	} while (0)
+
+/* For operations whose extent is only bounded by the clip rectangle */
+#define ON_ALL_SEAMLESS_WINDOWS_CLIPPED(func, args) \
+	ON_ALL_SEAMLESS_WINDOWS_DRAW(func, args, g_clip_rectangle.x, g_clip_rectangle.y, \
+				     g_clip_rectangle.width, g_clip_rectangle.height)
+
 static void
 seamless_XFillPolygon(Drawable d, XPoint * points, int npoints, int xoffset, int yoffset)
 {
@@ -263,23 +876,19 @@ seamless_XDrawLines(Drawable d, XPoint * points, int npoints, int xoffset, int y
 
 #define FILL_RECTANGLE(x,y,cx,cy)\
 { \
-	XFillRectangle(g_display, g_wnd, g_gc, x, y, cx, cy); \
-        ON_ALL_SEAMLESS_WINDOWS(XFillRectangle, (g_display, sw->wnd, g_gc, x-sw->xoffset, y-sw->yoffset, cx, cy)); \
-	if (g_ownbackstore) \
-		XFillRectangle(g_display, g_backstore, g_gc, x, y, cx, cy); \
+	XFillRectangle(g_display, DRAW_TARGET, g_gc, x, y, cx, cy); \
+        ON_ALL_SEAMLESS_WINDOWS_DRAW(XFillRectangle, (g_display, sw->wnd, g_gc, x-sw->xoffset, y-sw->yoffset, cx, cy), x, y, cx, cy); \
 }
 
 #define FILL_RECTANGLE_BACKSTORE(x,y,cx,cy)\
 { \
-	XFillRectangle(g_display, g_ownbackstore ? g_backstore : g_wnd, g_gc, x, y, cx, cy); \
+	XFillRectangle(g_display, DRAW_TARGET, g_gc, x, y, cx, cy); \
 }
 
 #define FILL_POLYGON(p,np)\
 { \
-	XFillPolygon(g_display, g_wnd, g_gc, p, np, Complex, CoordModePrevious); \
-	if (g_ownbackstore) \
-		XFillPolygon(g_display, g_backstore, g_gc, p, np, Complex, CoordModePrevious); \
-	ON_ALL_SEAMLESS_WINDOWS(seamless_XFillPolygon, (sw->wnd, p, np, sw->xoffset, sw->yoffset)); \
+	XFillPolygon(g_display, DRAW_TARGET, g_gc, p, np, Complex, CoordModePrevious); \
+	ON_ALL_SEAMLESS_WINDOWS_CLIPPED(seamless_XFillPolygon, (sw->wnd, p, np, sw->xoffset, sw->yoffset)); \
 }
 
 #define DRAW_ELLIPSE(x,y,cx,cy,m)\
@@ -287,16 +896,12 @@ seamless_XDrawLines(Drawable d, XPoint * points, int npoints, int xoffset, int y
 	switch (m) \
 	{ \
 		case 0:	/* Outline */ \
-			XDrawArc(g_display, g_wnd, g_gc, x, y, cx, cy, 0, 360*64); \
-                        ON_ALL_SEAMLESS_WINDOWS(XDrawArc, (g_display, sw->wnd, g_gc, x-sw->xoffset, y-sw->yoffset, cx, cy, 0, 360*64)); \
-			if (g_ownbackstore) \
-				XDrawArc(g_display, g_backstore, g_gc, x, y, cx, cy, 0, 360*64); \
+			XDrawArc(g_display, DRAW_TARGET, g_gc, x, y, cx, cy, 0, 360*64); \
+                        ON_ALL_SEAMLESS_WINDOWS_DRAW(XDrawArc, (g_display, sw->wnd, g_gc, x-sw->xoffset, y-sw->yoffset, cx, cy, 0, 360*64), x, y, cx + 1, cy + 1); \
 			break; \
 		case 1: /* Filled */ \
-			XFillArc(g_display, g_wnd, g_gc, x, y, cx, cy, 0, 360*64); \
-			ON_ALL_SEAMLESS_WINDOWS(XFillArc, (g_display, sw->wnd, g_gc, x-sw->xoffset, y-sw->yoffset, cx, cy, 0, 360*64)); \
-			if (g_ownbackstore) \
-				XFillArc(g_display, g_backstore, g_gc, x, y, cx, cy, 0, 360*64); \
+			XFillArc(g_display, DRAW_TARGET, g_gc, x, y, cx, cy, 0, 360*64); \
+			ON_ALL_SEAMLESS_WINDOWS_DRAW(XFillArc, (g_display, sw->wnd, g_gc, x-sw->xoffset, y-sw->yoffset, cx, cy, 0, 360*64), x, y, cx, cy); \
 			break; \
 	} \
 }
@@ -332,11 +937,75 @@ static int rop2_map[] = {
 #define SET_FUNCTION(rop2)	{ if (rop2 != ROP2_COPY) XSetFunction(g_display, g_gc, rop2_map[rop2]); }
 #define RESET_FUNCTION(rop2)	{ if (rop2 != ROP2_COPY) XSetFunction(g_display, g_gc, GXcopy); }
 
+/* Solid rectangles and lines are not drawn right away, but gathered
+   while they share a colour and raster operation. A batch goes out as
+   one XFillRectangles or XDrawSegments request when something else is
+   drawn, the clip rectangle changes, or the update ends. */
+#define DRAW_BATCH_MAX	256
+
+enum draw_batch_kind
+{
+	DRAW_BATCH_NONE,
+	DRAW_BATCH_RECTS,
+	DRAW_BATCH_SEGMENTS
+};
+
+static enum draw_batch_kind g_batch_kind = DRAW_BATCH_NONE;
+static unsigned long g_batch_pixel;
+static uint8 g_batch_opcode;
+static int g_batch_count = 0;
+static XRectangle g_batch_rects[DRAW_BATCH_MAX];
+static XSegment g_batch_segments[DRAW_BATCH_MAX];
+
+static void
+draw_batch_flush(void)
+{
+	if (g_batch_count == 0)
+		return;
+
+	XSetForeground(g_display, g_gc, g_batch_pixel);
+	if (g_batch_kind == DRAW_BATCH_RECTS)
+	{
+		XFillRectangles(g_display, DRAW_TARGET, g_gc,
+				g_batch_rects, g_batch_count);
+	}
+	else
+	{
+		SET_FUNCTION(g_batch_opcode);
+		XDrawSegments(g_display, DRAW_TARGET, g_gc,
+			      g_batch_segments, g_batch_count);
+		RESET_FUNCTION(g_batch_opcode);
+	}
+
+	g_batch_count = 0;
+	g_batch_kind = DRAW_BATCH_NONE;
+}
+
+/* Start or continue a batch of the given kind, returns False when the
+   operation has to be drawn right away instead */
+static RD_BOOL
+draw_batch_begin(enum draw_batch_kind kind, unsigned long pixel, uint8 opcode)
+{
+	/* without a backstore, every seamless window would need a batch
+	   of its own */
+	if (!g_ownbackstore && g_seamless_windows)
+		return False;
+
+	if (g_batch_count == DRAW_BATCH_MAX || g_batch_kind != kind ||
+	    g_batch_pixel != pixel || g_batch_opcode != opcode)
+		draw_batch_flush();
+
+	g_batch_kind = kind;
+	g_batch_pixel = pixel;
+	g_batch_opcode = opcode;
+	return True;
+}
+
 static seamless_window *
 sw_get_window_by_id(unsigned long id)
 {
 	seamless_window *sw;
-	for (sw = g_seamless_windows; sw; sw = sw->next)
+	for (sw = g_seamless_by_id[SEAMLESS_HASH(id)]; sw; sw = sw->id_next)
 	{
 		if (sw->id == id)
 			return sw;
@@ -349,7 +1018,7 @@ static seamless_window *
 sw_get_window_by_wnd(Window wnd)
 {
 	seamless_window *sw;
-	for (sw = g_seamless_windows; sw; sw = sw->next)
+	for (sw = g_seamless_by_wnd[SEAMLESS_HASH(wnd)]; sw; sw = sw->wnd_next)
 	{
 		if (sw->wnd == wnd)
 			return sw;
@@ -358,28 +1027,83 @@ sw_get_window_by_wnd(Window wnd)
 }
 
 
+static void
+sw_add_window(seamless_window * sw)
+{
+	seamless_window **bucket;
+
+	bucket = &g_seamless_by_id[SEAMLESS_HASH(sw->id)];
+	sw->id_next = *bucket;
+	*bucket = sw;
+
+	bucket = &g_seamless_by_wnd[SEAMLESS_HASH(sw->wnd)];
+	sw->wnd_next = *bucket;
+	*bucket = sw;
+}
+
+
+static void
+sw_remove_group(seamless_group * sg)
+{
+	seamless_group **prevnext;
+
+	for (prevnext = &g_seamless_groups[SEAMLESS_HASH(sg->id)]; *prevnext;
+	     prevnext = &(*prevnext)->hash_next)
+	{
+		if (*prevnext == sg)
+		{
+			*prevnext = sg->hash_next;
+			break;
+		}
+	}
+
+	XDestroyWindow(g_display, sg->wnd);
+	xfree(sg);
+}
+
+
 static void
 sw_remove_window(seamless_window * win)
 {
-	seamless_window *sw, **prevnext = &g_seamless_windows;
-	for (sw = g_seamless_windows; sw; sw = sw->next)
+	seamless_window *sw, **prevnext;
+
+	for (prevnext = &g_seamless_by_id[SEAMLESS_HASH(win->id)]; (sw = *prevnext);
+	     prevnext = &sw->id_next)
+	{
+		if (sw == win)
+		{
+			*prevnext = sw->id_next;
+			break;
+		}
+	}
+	if (!sw)
+		return;
+
+	for (prevnext = &g_seamless_by_wnd[SEAMLESS_HASH(win->wnd)]; (sw = *prevnext);
+	     prevnext = &sw->wnd_next)
+	{
+		if (sw == win)
+		{
+			*prevnext = sw->wnd_next;
+			break;
+		}
+	}
+
+	for (prevnext = &g_seamless_windows; (sw = *prevnext); prevnext = &sw->next)
 	{
 		if (sw == win)
 		{
 			*prevnext = sw->next;
-			sw->group->refcnt--;
-			if (sw->group->refcnt == 0)
-			{
-				XDestroyWindow(g_display, sw->group->wnd);
-				xfree(sw->group);
-			}
-			xfree(sw->position_timer);
-			xfree(sw);
-			return;
+			break;
 		}
-		prevnext = &sw->next;
 	}
-	return;
+
+	sw_grid_remove(win);
+	win->group->refcnt--;
+	if (win->group->refcnt == 0)
+		sw_remove_group(win->group);
+	xfree(win->position_timer);
+	xfree(win);
 }
 
 
@@ -426,7 +1150,8 @@ sw_update_position(seamless_window * sw)
 }
 
 
-/* Check if it's time to send our position */
+/* Check if it's time to send our position, or to give up on the
+   ConfigureNotify of a restack */
 static void
 sw_check_timers()
 {
@@ -441,6 +1166,12 @@ sw_check_timers()
 			timerclear(sw->position_timer);
 			sw_update_position(sw);
 		}
+		if (timerisset(&sw->restack_deadline) && timercmp(&sw->restack_deadline, &now, <))
+		{
+			logger(GUI, Warning,
+			       "Broken Window Manager: Timeout while waiting for ConfigureNotify");
+			timerclear(&sw->restack_deadline);
+		}
 	}
 }
 
@@ -528,30 +1259,188 @@ sw_handle_restack(seamless_window * sw)
 static seamless_group *
 sw_find_group(unsigned long id, RD_BOOL dont_create)
 {
-	seamless_window *sw;
 	seamless_group *sg;
 	XSetWindowAttributes attribs;
 
-	for (sw = g_seamless_windows; sw; sw = sw->next)
+	for (sg = g_seamless_groups[SEAMLESS_HASH(id)]; sg; sg = sg->hash_next)
+	{
+		if (sg->id == id)
+			return sg;
+	}
+
+	if (dont_create)
+		return NULL;
+
+	sg = xmalloc(sizeof(seamless_group));
+
+	sg->wnd =
+		XCreateWindow(g_display, RootWindowOfScreen(g_screen), -1, -1, 1, 1, 0,
+			      CopyFromParent, CopyFromParent, CopyFromParent, 0, &attribs);
+	ewmh_set_wm_pid(sg->wnd, getpid());
+
+	sg->id = id;
+	sg->refcnt = 0;
+	sg->hash_next = g_seamless_groups[SEAMLESS_HASH(id)];
+	g_seamless_groups[SEAMLESS_HASH(id)] = sg;
+
+	return sg;
+}
+
+
+/* Restack the X window to where sw->behind puts it. The ConfigureNotify
+   this results in is not waited for, but recognised by
+   sw_is_own_restack() when it arrives. */
+static void
+sw_apply_restack(seamless_window * sw)
+{
+	seamless_window *sw_behind;
+	XWindowChanges values;
+	unsigned int value_mask;
+
+	if (sw->behind)
+	{
+		sw_behind = sw_get_window_by_id(sw->behind);
+		if (!sw_behind)
+		{
+			logger(GUI, Warning,
+			       "sw_apply_restack(), no information for behind window 0x%lx",
+			       sw->behind);
+			return;
+		}
+
+		values.stack_mode = Below;
+		value_mask = CWStackMode | CWSibling;
+		values.sibling = sw_behind->wnd;
+
+		/* Avoid that topmost windows references non-topmost
+		   windows, and vice versa. */
+		if (ewmh_is_window_above(sw->wnd))
+		{
+			if (!ewmh_is_window_above(sw_behind->wnd))
+			{
+				/* Disallow, move to bottom of the
+				   topmost stack. */
+				values.stack_mode = Below;
+				value_mask = CWStackMode;	/* Not sibling */
+			}
+		}
+		else
+		{
+			if (ewmh_is_window_above(sw_behind->wnd))
+			{
+				/* Move to top of non-topmost
+				   stack. */
+				values.stack_mode = Above;
+				value_mask = CWStackMode;	/* Not sibling */
+			}
+		}
+	}
+	else
+	{
+		values.stack_mode = Above;
+		value_mask = CWStackMode;
+	}
+
+	sw->restack_serial = XNextRequest(g_display);
+	if (!XReconfigureWMWindow(g_display, sw->wnd, DefaultScreen(g_display), value_mask, &values))
+	{
+		logger(GUI, Warning, "sw_apply_restack(), failed to restack window 0x%lx", sw->id);
+		return;
+	}
+
+	/* some window managers never send it, see sw_wait_configurenotify() */
+	gettimeofday(&sw->restack_deadline, NULL);
+	sw->restack_deadline.tv_usec += 500000;
+	if (sw->restack_deadline.tv_usec >= 1000000)
+	{
+		sw->restack_deadline.tv_usec -= 1000000;
+		sw->restack_deadline.tv_sec += 1;
+	}
+}
+
+
+/* Check if a ConfigureNotify is the result of our own restack of the
+   window, rather than something the user or window manager did */
+static RD_BOOL
+sw_is_own_restack(seamless_window * sw, unsigned long serial)
+{
+	struct timeval now;
+
+	if (!timerisset(&sw->restack_deadline) || serial < sw->restack_serial)
+		return False;
+
+	gettimeofday(&now, NULL);
+	if (timercmp(&now, &sw->restack_deadline, >))
+	{
+		logger(GUI, Warning,
+		       "Broken Window Manager: Timeout while waiting for ConfigureNotify");
+		timerclear(&sw->restack_deadline);
+		return False;
+	}
+
+	timerclear(&sw->restack_deadline);
+	return True;
+}
+
+
+/* Milliseconds until the ConfigureNotify of a restack is overdue, -1 if
+   none is waited for */
+static int
+sw_restack_timeout(void)
+{
+	seamless_window *sw;
+	struct timeval now, left;
+	int timeout, ms;
+
+	timeout = -1;
+	gettimeofday(&now, NULL);
+	for (sw = g_seamless_windows; sw; sw = sw->next)
+	{
+		if (!timerisset(&sw->restack_deadline))
+			continue;
+		if (timercmp(&sw->restack_deadline, &now, <))
+			return 0;
+
+		timersub(&sw->restack_deadline, &now, &left);
+		ms = left.tv_sec * 1000 + left.tv_usec / 1000 + 1;
+		if (timeout < 0 || ms < timeout)
+			timeout = ms;
+	}
+
+	return timeout;
+}
+
+
+/* Apply a pending restack, after the one of the window it is to be
+   behind, so that each window goes right below its final neighbour */
+static void
+sw_flush_restack(seamless_window * sw)
+{
+	seamless_window *sw_behind;
+
+	if (!sw->restack_pending)
+		return;
+	sw->restack_pending = False;
+
+	if (sw->behind)
 	{
-		if (sw->group->id == id)
-			return sw->group;
+		sw_behind = sw_get_window_by_id(sw->behind);
+		if (sw_behind)
+			sw_flush_restack(sw_behind);
 	}
+	sw_apply_restack(sw);
+}
 
-	if (dont_create)
-		return NULL;
-
-	sg = xmalloc(sizeof(seamless_group));
-
-	sg->wnd =
-		XCreateWindow(g_display, RootWindowOfScreen(g_screen), -1, -1, 1, 1, 0,
-			      CopyFromParent, CopyFromParent, CopyFromParent, 0, &attribs);
-	ewmh_set_wm_pid(sg->wnd, getpid());
 
-	sg->id = id;
-	sg->refcnt = 0;
+static void
+sw_flush_move(seamless_window * sw)
+{
+	if (!sw->move_pending)
+		return;
+	sw->move_pending = False;
 
-	return sg;
+	/* FIXME: Perhaps use ewmh_net_moveresize_window instead */
+	XMoveResizeWindow(g_display, sw->wnd, sw->xoffset, sw->yoffset, sw->width, sw->height);
 }
 
 
@@ -933,6 +1822,259 @@ translate_colour(uint32 colour)
 }
 /* *INDENT-ON* */
 
+/* SIMD versions of the g_compatible_arch translations to 32 bpp,
+   which is what a 15/16/24 bit session on a regular R8G8B8 visual
+   ends up using. A kernel converts as many whole vectors as fit in
+   count pixels and returns the number of pixels done, the scalar
+   code below finishes off the tail and remains the reference for
+   what the output must look like. Kernels are selected at runtime by
+   translate_init(). */
+typedef int (*translate16_kernel) (const uint16 * data, uint8 * out, int count);
+typedef int (*translate24_kernel) (const uint8 * data, uint8 * out, int count);
+
+static translate16_kernel g_translate15to32_kernel = NULL;
+static translate16_kernel g_translate16to32_kernel = NULL;
+static translate24_kernel g_translate24to32_kernel = NULL;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define XWIN_SIMD_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define XWIN_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+/* *INDENT-OFF* */
+#ifdef XWIN_SIMD_X86
+
+/* Interleave b|g<<8 and r in to 32 bit B, G, R, 0 pixels */
+#define SSE2_STORE_BGR0(o, r, g, b) \
+{ \
+	__m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8)); \
+	_mm_storeu_si128((__m128i *) (o), _mm_unpacklo_epi16(bg, r)); \
+	_mm_storeu_si128((__m128i *) ((o) + 16), _mm_unpackhi_epi16(bg, r)); \
+}
+
+/* The unpack instructions work within each 128 bit lane, so put the
+   lanes back in pixel order before storing */
+#define AVX2_STORE_BGR0(o, r, g, b) \
+{ \
+	__m256i bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8)); \
+	__m256i lo = _mm256_unpacklo_epi16(bg, r); \
+	__m256i hi = _mm256_unpackhi_epi16(bg, r); \
+	_mm256_storeu_si256((__m256i *) (o), _mm256_permute2x128_si256(lo, hi, 0x20)); \
+	_mm256_storeu_si256((__m256i *) ((o) + 32), _mm256_permute2x128_si256(lo, hi, 0x31)); \
+}
+
+__attribute__ ((target("sse2"))) static int
+translate15to32_sse2(const uint16 * data, uint8 * out, int count)
+{
+	const __m128i m3 = _mm_set1_epi16(0x7), m5 = _mm_set1_epi16(0xf8);
+	__m128i v, r, g, b;
+	int i;
+
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		v = _mm_loadu_si128((const __m128i *) (data + i));
+		r = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 7), m5),
+				 _mm_and_si128(_mm_srli_epi16(v, 12), m3));
+		g = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 2), m5),
+				 _mm_and_si128(_mm_srli_epi16(v, 8), m3));
+		b = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(v, 3), m5),
+				 _mm_and_si128(_mm_srli_epi16(v, 2), m3));
+		SSE2_STORE_BGR0(out + i * 4, r, g, b);
+	}
+	return i;
+}
+
+__attribute__ ((target("sse2"))) static int
+translate16to32_sse2(const uint16 * data, uint8 * out, int count)
+{
+	const __m128i m2 = _mm_set1_epi16(0x3), m3 = _mm_set1_epi16(0x7);
+	const __m128i m5 = _mm_set1_epi16(0xf8), m6 = _mm_set1_epi16(0xfc);
+	__m128i v, r, g, b;
+	int i;
+
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		v = _mm_loadu_si128((const __m128i *) (data + i));
+		r = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 8), m5),
+				 _mm_srli_epi16(v, 13));
+		g = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 3), m6),
+				 _mm_and_si128(_mm_srli_epi16(v, 9), m2));
+		b = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(v, 3), m5),
+				 _mm_and_si128(_mm_srli_epi16(v, 2), m3));
+		SSE2_STORE_BGR0(out + i * 4, r, g, b);
+	}
+	return i;
+}
+
+__attribute__ ((target("avx2"))) static int
+translate15to32_avx2(const uint16 * data, uint8 * out, int count)
+{
+	const __m256i m3 = _mm256_set1_epi16(0x7), m5 = _mm256_set1_epi16(0xf8);
+	__m256i v, r, g, b;
+	int i;
+
+	for (i = 0; i + 16 <= count; i += 16)
+	{
+		v = _mm256_loadu_si256((const __m256i *) (data + i));
+		r = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(v, 7), m5),
+				    _mm256_and_si256(_mm256_srli_epi16(v, 12), m3));
+		g = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(v, 2), m5),
+				    _mm256_and_si256(_mm256_srli_epi16(v, 8), m3));
+		b = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(v, 3), m5),
+				    _mm256_and_si256(_mm256_srli_epi16(v, 2), m3));
+		AVX2_STORE_BGR0(out + i * 4, r, g, b);
+	}
+	return i;
+}
+
+__attribute__ ((target("avx2"))) static int
+translate16to32_avx2(const uint16 * data, uint8 * out, int count)
+{
+	const __m256i m2 = _mm256_set1_epi16(0x3), m3 = _mm256_set1_epi16(0x7);
+	const __m256i m5 = _mm256_set1_epi16(0xf8), m6 = _mm256_set1_epi16(0xfc);
+	__m256i v, r, g, b;
+	int i;
+
+	for (i = 0; i + 16 <= count; i += 16)
+	{
+		v = _mm256_loadu_si256((const __m256i *) (data + i));
+		r = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(v, 8), m5),
+				    _mm256_srli_epi16(v, 13));
+		g = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(v, 3), m6),
+				    _mm256_and_si256(_mm256_srli_epi16(v, 9), m2));
+		b = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(v, 3), m5),
+				    _mm256_and_si256(_mm256_srli_epi16(v, 2), m3));
+		AVX2_STORE_BGR0(out + i * 4, r, g, b);
+	}
+	return i;
+}
+
+__attribute__ ((target("ssse3"))) static int
+translate24to32_ssse3(const uint8 * data, uint8 * out, int count)
+{
+	const __m128i shuf = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+					   6, 7, 8, -1, 9, 10, 11, -1);
+	__m128i v;
+	int i;
+
+	/* Each load reads 16 bytes but only uses 12, stop early enough
+	   to never read beyond the input */
+	for (i = 0; i + 6 <= count; i += 4)
+	{
+		v = _mm_loadu_si128((const __m128i *) (data + i * 3));
+		_mm_storeu_si128((__m128i *) (out + i * 4), _mm_shuffle_epi8(v, shuf));
+	}
+	return i;
+}
+
+#endif /* XWIN_SIMD_X86 */
+
+#ifdef XWIN_SIMD_NEON
+
+#define NEON_STORE_BGR0(o, r, g, b) \
+{ \
+	uint8x8x4_t px; \
+	px.val[0] = vmovn_u16(b); \
+	px.val[1] = vmovn_u16(g); \
+	px.val[2] = vmovn_u16(r); \
+	px.val[3] = vdup_n_u8(0); \
+	vst4_u8(o, px); \
+}
+
+static int
+translate15to32_neon(const uint16 * data, uint8 * out, int count)
+{
+	const uint16x8_t m3 = vdupq_n_u16(0x7), m5 = vdupq_n_u16(0xf8);
+	uint16x8_t v, r, g, b;
+	int i;
+
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		v = vld1q_u16(data + i);
+		r = vorrq_u16(vandq_u16(vshrq_n_u16(v, 7), m5), vandq_u16(vshrq_n_u16(v, 12), m3));
+		g = vorrq_u16(vandq_u16(vshrq_n_u16(v, 2), m5), vandq_u16(vshrq_n_u16(v, 8), m3));
+		b = vorrq_u16(vandq_u16(vshlq_n_u16(v, 3), m5), vandq_u16(vshrq_n_u16(v, 2), m3));
+		NEON_STORE_BGR0(out + i * 4, r, g, b);
+	}
+	return i;
+}
+
+static int
+translate16to32_neon(const uint16 * data, uint8 * out, int count)
+{
+	const uint16x8_t m2 = vdupq_n_u16(0x3), m3 = vdupq_n_u16(0x7);
+	const uint16x8_t m5 = vdupq_n_u16(0xf8), m6 = vdupq_n_u16(0xfc);
+	uint16x8_t v, r, g, b;
+	int i;
+
+	for (i = 0; i + 8 <= count; i += 8)
+	{
+		v = vld1q_u16(data + i);
+		r = vorrq_u16(vandq_u16(vshrq_n_u16(v, 8), m5), vshrq_n_u16(v, 13));
+		g = vorrq_u16(vandq_u16(vshrq_n_u16(v, 3), m6), vandq_u16(vshrq_n_u16(v, 9), m2));
+		b = vorrq_u16(vandq_u16(vshlq_n_u16(v, 3), m5), vandq_u16(vshrq_n_u16(v, 2), m3));
+		NEON_STORE_BGR0(out + i * 4, r, g, b);
+	}
+	return i;
+}
+
+static int
+translate24to32_neon(const uint8 * data, uint8 * out, int count)
+{
+	uint8x16x3_t in;
+	uint8x16x4_t px;
+	int i;
+
+	px.val[3] = vdupq_n_u8(0);
+	for (i = 0; i + 16 <= count; i += 16)
+	{
+		in = vld3q_u8(data + i * 3);
+		px.val[0] = in.val[0];
+		px.val[1] = in.val[1];
+		px.val[2] = in.val[2];
+		vst4q_u8(out + i * 4, px);
+	}
+	return i;
+}
+
+#endif /* XWIN_SIMD_NEON */
+/* *INDENT-ON* */
+
+/* Select the fastest translation kernels this CPU can run */
+static void
+translate_init(void)
+{
+	const char *name = "scalar";
+
+#if defined(XWIN_SIMD_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		g_translate15to32_kernel = translate15to32_avx2;
+		g_translate16to32_kernel = translate16to32_avx2;
+		name = "AVX2";
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		g_translate15to32_kernel = translate15to32_sse2;
+		g_translate16to32_kernel = translate16to32_sse2;
+		name = "SSE2";
+	}
+	if (__builtin_cpu_supports("ssse3"))
+		g_translate24to32_kernel = translate24to32_ssse3;
+#elif defined(XWIN_SIMD_NEON)
+	g_translate15to32_kernel = translate15to32_neon;
+	g_translate16to32_kernel = translate16to32_neon;
+	g_translate24to32_kernel = translate24to32_neon;
+	name = "NEON";
+#endif
+
+	logger(GUI, Debug, "translate_init(), using %s colour translation kernels", name);
+}
+
 static void
 translate8to8(const uint8 * data, uint8 * out, uint8 * end)
 {
@@ -1030,111 +2172,56 @@ translate8to32(const uint8 * data, uint8 * out, uint8 * end)
 	}
 }
 
-static void
-translate15to16(const uint16 * data, uint8 * out, uint8 * end)
-{
-	uint16 pixel;
-	uint16 value;
-	PixelColour pc;
+/* 15 and 16 bpp pixels, as read on this host, are translated through
+   a table of the visual's pixel values, built by translate_select()
+   for the server depth of the connection */
+static uint32 *g_translate_lut = NULL;
 
-	if (g_xserver_be)
-	{
-		while (out < end)
-		{
-			pixel = *(data++);
-			if (g_host_be)
-			{
-				BSWAP16(pixel);
-			}
-			SPLITCOLOUR15(pixel, pc);
-			value = MAKECOLOUR(pc);
-			BOUT16(out, value);
-		}
-	}
-	else
-	{
-		while (out < end)
-		{
-			pixel = *(data++);
-			if (g_host_be)
-			{
-				BSWAP16(pixel);
-			}
-			SPLITCOLOUR15(pixel, pc);
-			value = MAKECOLOUR(pc);
-			LOUT16(out, value);
-		}
-	}
-}
+/* SIMD kernel for the compatible 32 bpp case of the same depth */
+static translate16_kernel g_translate16to32_lut_kernel = NULL;
 
 static void
-translate15to24(const uint16 * data, uint8 * out, uint8 * end)
+translate_build_lut(void)
 {
-	uint32 value;
+	uint32 i;
 	uint16 pixel;
 	PixelColour pc;
 
-	if (g_compatible_arch)
-	{
-		/* *INDENT-OFF* */
-		REPEAT3
-		(
-			pixel = *(data++);
-			SPLITCOLOUR15(pixel, pc);
-			*(out++) = pc.blue;
-			*(out++) = pc.green;
-			*(out++) = pc.red;
-		)
-		/* *INDENT-ON* */
-	}
-	else if (g_xserver_be)
+	if (g_translate_lut == NULL)
+		g_translate_lut = (uint32 *) xmalloc(0x10000 * sizeof(uint32));
+
+	for (i = 0; i < 0x10000; i++)
 	{
-		while (out < end)
+		pixel = i;
+		if (g_host_be)
 		{
-			pixel = *(data++);
-			if (g_host_be)
-			{
-				BSWAP16(pixel);
-			}
-			SPLITCOLOUR15(pixel, pc);
-			value = MAKECOLOUR(pc);
-			BOUT24(out, value);
+			BSWAP16(pixel);
 		}
-	}
-	else
-	{
-		while (out < end)
+		if (g_server_depth == 15)
 		{
-			pixel = *(data++);
-			if (g_host_be)
-			{
-				BSWAP16(pixel);
-			}
 			SPLITCOLOUR15(pixel, pc);
-			value = MAKECOLOUR(pc);
-			LOUT24(out, value);
 		}
+		else
+		{
+			SPLITCOLOUR16(pixel, pc);
+		}
+		g_translate_lut[i] = MAKECOLOUR(pc);
 	}
 }
 
 static void
-translate15to32(const uint16 * data, uint8 * out, uint8 * end)
+translate16lut_to16(const uint8 * data, uint8 * out, uint8 * end)
 {
-	uint16 pixel;
-	uint32 value;
-	PixelColour pc;
+	const uint16 *in = (const uint16 *) data;
+	uint16 value;
 
 	if (g_compatible_arch)
 	{
 		/* *INDENT-OFF* */
-		REPEAT4
+		REPEAT2
 		(
-			pixel = *(data++);
-			SPLITCOLOUR15(pixel, pc);
-			*(out++) = pc.blue;
-			*(out++) = pc.green;
-			*(out++) = pc.red;
-			*(out++) = 0;
+			*((uint16 *) out) = g_translate_lut[*(in++)];
+			out += 2;
 		)
 		/* *INDENT-ON* */
 	}
@@ -1142,226 +2229,83 @@ translate15to32(const uint16 * data, uint8 * out, uint8 * end)
 	{
 		while (out < end)
 		{
-			pixel = *(data++);
-			if (g_host_be)
-			{
-				BSWAP16(pixel);
-			}
-			SPLITCOLOUR15(pixel, pc);
-			value = MAKECOLOUR(pc);
-			BOUT32(out, value);
+			value = g_translate_lut[*(in++)];
+			BOUT16(out, value);
 		}
 	}
 	else
 	{
 		while (out < end)
 		{
-			pixel = *(data++);
-			if (g_host_be)
-			{
-				BSWAP16(pixel);
-			}
-			SPLITCOLOUR15(pixel, pc);
-			value = MAKECOLOUR(pc);
-			LOUT32(out, value);
+			value = g_translate_lut[*(in++)];
+			LOUT16(out, value);
 		}
 	}
 }
 
 static void
-translate16to16(const uint16 * data, uint8 * out, uint8 * end)
+translate16lut_to24(const uint8 * data, uint8 * out, uint8 * end)
 {
-	uint16 pixel;
-	uint16 value;
-	PixelColour pc;
+	const uint16 *in = (const uint16 *) data;
+	uint32 value;
 
 	if (g_xserver_be)
 	{
-		if (g_host_be)
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				BSWAP16(pixel);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				BOUT16(out, value);
-			}
-		}
-		else
+		while (out < end)
 		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				BOUT16(out, value);
-			}
+			value = g_translate_lut[*(in++)];
+			BOUT24(out, value);
 		}
 	}
 	else
-	{
-		if (g_host_be)
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				BSWAP16(pixel);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				LOUT16(out, value);
-			}
-		}
-		else
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				LOUT16(out, value);
-			}
-		}
-	}
-}
-
-static void
-translate16to24(const uint16 * data, uint8 * out, uint8 * end)
-{
-	uint32 value;
-	uint16 pixel;
-	PixelColour pc;
-
-	if (g_compatible_arch)
 	{
 		/* *INDENT-OFF* */
 		REPEAT3
 		(
-			pixel = *(data++);
-			SPLITCOLOUR16(pixel, pc);
-			*(out++) = pc.blue;
-			*(out++) = pc.green;
-			*(out++) = pc.red;
-		)
-		/* *INDENT-ON* */
-	}
-	else if (g_xserver_be)
-	{
-		if (g_host_be)
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				BSWAP16(pixel);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				BOUT24(out, value);
-			}
-		}
-		else
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				BOUT24(out, value);
-			}
-		}
-	}
-	else
-	{
-		if (g_host_be)
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				BSWAP16(pixel);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				LOUT24(out, value);
-			}
-		}
-		else
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				LOUT24(out, value);
-			}
-		}
+			value = g_translate_lut[*(in++)];
+			LOUT24(out, value);
+		)
+		/* *INDENT-ON* */
 	}
 }
 
 static void
-translate16to32(const uint16 * data, uint8 * out, uint8 * end)
+translate16lut_to32(const uint8 * data, uint8 * out, uint8 * end)
 {
-	uint16 pixel;
+	const uint16 *in = (const uint16 *) data;
 	uint32 value;
-	PixelColour pc;
+	int n;
 
 	if (g_compatible_arch)
 	{
+		if (g_translate16to32_lut_kernel != NULL)
+		{
+			n = g_translate16to32_lut_kernel(in, out, (end - out) / 4);
+			in += n;
+			out += n * 4;
+		}
 		/* *INDENT-OFF* */
 		REPEAT4
 		(
-			pixel = *(data++);
-			SPLITCOLOUR16(pixel, pc);
-			*(out++) = pc.blue;
-			*(out++) = pc.green;
-			*(out++) = pc.red;
-			*(out++) = 0;
+			*((uint32 *) out) = g_translate_lut[*(in++)];
+			out += 4;
 		)
 		/* *INDENT-ON* */
 	}
 	else if (g_xserver_be)
 	{
-		if (g_host_be)
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				BSWAP16(pixel);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				BOUT32(out, value);
-			}
-		}
-		else
+		while (out < end)
 		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				BOUT32(out, value);
-			}
+			value = g_translate_lut[*(in++)];
+			BOUT32(out, value);
 		}
 	}
 	else
 	{
-		if (g_host_be)
-		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				BSWAP16(pixel);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				LOUT32(out, value);
-			}
-		}
-		else
+		while (out < end)
 		{
-			while (out < end)
-			{
-				pixel = *(data++);
-				SPLITCOLOUR16(pixel, pc);
-				value = MAKECOLOUR(pc);
-				LOUT32(out, value);
-			}
+			value = g_translate_lut[*(in++)];
+			LOUT32(out, value);
 		}
 	}
 }
@@ -1430,9 +2374,16 @@ translate24to32(const uint8 * data, uint8 * out, uint8 * end)
 	uint32 pixel;
 	uint32 value;
 	PixelColour pc;
+	int n;
 
 	if (g_compatible_arch)
 	{
+		if (g_translate24to32_kernel != NULL)
+		{
+			n = g_translate24to32_kernel(data, out, (end - out) / 4);
+			data += n * 3;
+			out += n * 4;
+		}
 		/* *INDENT-OFF* */
 #ifdef NEED_ALIGN
 		REPEAT4
@@ -1479,13 +2430,11 @@ translate24to32(const uint8 * data, uint8 * out, uint8 * end)
 	}
 }
 
-static uint8 *
-translate_image(int width, int height, uint8 * data)
+/* Returns True if RDP bitmaps must be translated before they can be
+   used as ZPixmaps on our visual */
+static RD_BOOL
+translate_needed(void)
 {
-	int size;
-	uint8 *out;
-	uint8 *end;
-
 	/*
 	   If RDP depth and X Visual depths match,
 	   and arch(endian) matches, no need to translate:
@@ -1498,7 +2447,7 @@ translate_image(int width, int height, uint8 * data)
 	/* todo */
 	if (g_server_depth == 32 && g_depth == 24)
 	{
-		return data;
+		return False;
 	}
 
 	if (g_no_translate_image)
@@ -1506,75 +2455,119 @@ translate_image(int width, int height, uint8 * data)
 		if ((g_depth == 15 && g_server_depth == 15) ||
 		    (g_depth == 16 && g_server_depth == 16) ||
 		    (g_depth == 24 && g_server_depth == 24))
-			return data;
+			return False;
 	}
 
-	size = width * height * (g_bpp / 8);
-	out = (uint8 *) xmalloc(size);
-	end = out + size;
+	return True;
+}
+
+typedef void (*translate_func) (const uint8 * data, uint8 * out, uint8 * end);
+
+static void
+translate_none(const uint8 * data, uint8 * out, uint8 * end)
+{
+	UNUSED(data);
+	UNUSED(out);
+	UNUSED(end);
+}
+
+/* The translation for the server depth and the visual, chosen once by
+   translate_select() rather than for every bitmap */
+static translate_func g_translate = translate_none;
+static int g_translate_depth = 0;
+
+/* Choose the translation from the server depth to the visual, called
+   once the visual is known and again if the server changes the depth
+   while connecting */
+static void
+translate_select(void)
+{
+	translate_func translate = translate_none;
 
 	switch (g_server_depth)
 	{
 		case 24:
-			switch (g_bpp)
-			{
-				case 32:
-					translate24to32(data, out, end);
-					break;
-				case 24:
-					translate24to24(data, out, end);
-					break;
-				case 16:
-					translate24to16(data, out, end);
-					break;
-			}
-			break;
-		case 16:
-			switch (g_bpp)
-			{
-				case 32:
-					translate16to32((uint16 *) data, out, end);
-					break;
-				case 24:
-					translate16to24((uint16 *) data, out, end);
-					break;
-				case 16:
-					translate16to16((uint16 *) data, out, end);
-					break;
-			}
+			if (g_bpp == 32)
+				translate = translate24to32;
+			else if (g_bpp == 24)
+				translate = translate24to24;
+			else if (g_bpp == 16)
+				translate = translate24to16;
 			break;
 		case 15:
-			switch (g_bpp)
-			{
-				case 32:
-					translate15to32((uint16 *) data, out, end);
-					break;
-				case 24:
-					translate15to24((uint16 *) data, out, end);
-					break;
-				case 16:
-					translate15to16((uint16 *) data, out, end);
-					break;
-			}
+		case 16:
+			translate_build_lut();
+			g_translate16to32_lut_kernel = g_server_depth == 15 ?
+				g_translate15to32_kernel : g_translate16to32_kernel;
+			if (g_bpp == 32)
+				translate = translate16lut_to32;
+			else if (g_bpp == 24)
+				translate = translate16lut_to24;
+			else if (g_bpp == 16)
+				translate = translate16lut_to16;
 			break;
 		case 8:
-			switch (g_bpp)
-			{
-				case 8:
-					translate8to8(data, out, end);
-					break;
-				case 16:
-					translate8to16(data, out, end);
-					break;
-				case 24:
-					translate8to24(data, out, end);
-					break;
-				case 32:
-					translate8to32(data, out, end);
-					break;
-			}
+			/* g_colmap is the table, built with the colour map */
+			if (g_bpp == 8)
+				translate = translate8to8;
+			else if (g_bpp == 16)
+				translate = translate8to16;
+			else if (g_bpp == 24)
+				translate = translate8to24;
+			else if (g_bpp == 32)
+				translate = translate8to32;
 			break;
 	}
+
+	g_translate = translate;
+	g_translate_depth = g_server_depth;
+}
+
+/* Translate a run of pixels in to the visual's format, filling the
+   output up to end */
+static void
+translate_pixels(uint8 * data, uint8 * out, uint8 * end)
+{
+	if (g_translate_depth != g_server_depth)
+		translate_select();
+
+	g_translate(data, out, end);
+}
+
+/* Translate a bitmap straight in to a destination image buffer with
+   the given scanline length, such as a shared memory XImage */
+static void
+translate_image_into(int width, int height, uint8 * data, uint8 * out, int out_bpl)
+{
+	int y, in_bpl, row;
+
+	in_bpl = width * ((g_server_depth + 7) / 8);
+	row = width * (g_bpp / 8);
+
+	if (out_bpl == row)
+	{
+		translate_pixels(data, out, out + row * height);
+		return;
+	}
+
+	for (y = 0; y < height; y++)
+		translate_pixels(data + y * in_bpl, out + y * out_bpl, out + y * out_bpl + row);
+}
+
+static uint8 *
+translate_image(int width, int height, uint8 * data)
+{
+	int size;
+	uint8 *out;
+	TRACE_SCOPE(TRACE_TRANSLATE_IMAGE);
+
+	if (!translate_needed())
+		return data;
+
+	size = width * height * (g_bpp / 8);
+	out = (uint8 *) xmalloc(size);
+	translate_image_into(width, height, data, out, width * (g_bpp / 8));
+
 	return out;
 }
 
@@ -1849,38 +2842,332 @@ select_visual(int screen_num)
 
 static XErrorHandler g_old_error_handler;
 static RD_BOOL g_error_expected = False;
+static RD_BOOL g_error_occurred = False;
 
 /* Check if the X11 window corresponding to a seamless window with
    specified id exists. */
 RD_BOOL
 sw_window_exists(unsigned long id)
 {
-	seamless_window *sw;
-	char *name;
-	Status sts = 0;
+	seamless_window *sw;
+	char *name;
+	Status sts = 0;
+
+	sw = sw_get_window_by_id(id);
+	if (!sw)
+		return False;
+
+	g_error_expected = True;
+	sts = XFetchName(g_display, sw->wnd, &name);
+	g_error_expected = False;
+	if (sts)
+	{
+		XFree(name);
+	}
+
+	return sts;
+}
+
+static int
+error_handler(Display * dpy, XErrorEvent * eev)
+{
+	if (g_error_expected)
+	{
+		g_error_occurred = True;
+		return 0;
+	}
+
+	return g_old_error_handler(dpy, eev);
+}
+
+#ifdef HAVE_MITSHM
+/* Destroy a shared memory segment, the segment must not be busy */
+static void
+xshm_segment_destroy(xshm_segment * seg)
+{
+	if (seg->size == 0)
+		return;
+
+	XShmDetach(g_display, &seg->info);
+	shmdt(seg->info.shmaddr);
+	seg->info.shmaddr = NULL;
+	seg->size = 0;
+}
+
+/* Create a shared memory segment of at least size bytes and attach it
+   to the X server. Returns False if the server could not attach it,
+   which is the case for e.g. remote displays. */
+static RD_BOOL
+xshm_segment_create(xshm_segment * seg, size_t size)
+{
+	size = (size + XSHM_SEGMENT_ROUNDING - 1) & ~(size_t) (XSHM_SEGMENT_ROUNDING - 1);
+
+	seg->info.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+	if (seg->info.shmid == -1)
+	{
+		logger(GUI, Warning, "xshm_segment_create(), shmget() of %lu bytes failed: %s",
+		       (unsigned long) size, strerror(errno));
+		return False;
+	}
+
+	seg->info.shmaddr = shmat(seg->info.shmid, NULL, 0);
+	if (seg->info.shmaddr == (char *) -1)
+	{
+		logger(GUI, Warning, "xshm_segment_create(), shmat() failed: %s",
+		       strerror(errno));
+		shmctl(seg->info.shmid, IPC_RMID, NULL);
+		return False;
+	}
+	seg->info.readOnly = False;
+
+	g_error_occurred = False;
+	g_error_expected = True;
+	XShmAttach(g_display, &seg->info);
+	XSync(g_display, False);
+	g_error_expected = False;
+
+	/* The segment stays around until both we and the X server
+	   have detached from it. */
+	shmctl(seg->info.shmid, IPC_RMID, NULL);
+
+	if (g_error_occurred)
+	{
+		shmdt(seg->info.shmaddr);
+		seg->info.shmaddr = NULL;
+		return False;
+	}
+
+	seg->size = size;
+	seg->busy = False;
+	return True;
+}
+
+static void
+xshm_init(void)
+{
+	int major, minor;
+	Bool pixmaps;
+
+	g_shm_available = False;
+	memset(g_shm_pool, 0, sizeof(g_shm_pool));
+
+	if (!XShmQueryVersion(g_display, &major, &minor, &pixmaps))
+	{
+		logger(GUI, Debug, "xshm_init(), MIT-SHM extension not available");
+		return;
+	}
+
+	/* Probe that the server can actually attach our segments */
+	if (!xshm_segment_create(&g_shm_pool[0], XSHM_SEGMENT_ROUNDING))
+	{
+		logger(GUI, Verbose,
+		       "xshm_init(), unable to attach shared memory, not using MIT-SHM");
+		return;
+	}
+
+	g_shm_completion_type = XShmGetEventBase(g_display) + ShmCompletion;
+	g_shm_available = True;
+
+	logger(GUI, Debug, "xshm_init(), using MIT-SHM %d.%d for image uploads", major, minor);
+}
+
+static void
+xshm_deinit(void)
+{
+	int i;
+
+	if (!g_shm_available)
+		return;
+
+	XSync(g_display, False);
+	for (i = 0; i < XSHM_POOL_SIZE; i++)
+		xshm_segment_destroy(&g_shm_pool[i]);
+
+	g_shm_available = False;
+}
+
+static void
+xshm_handle_completion(XShmCompletionEvent * event)
+{
+	int i;
+	xshm_segment *seg;
+
+	for (i = 0; i < XSHM_POOL_SIZE; i++)
+	{
+		seg = &g_shm_pool[i];
+		if (seg->busy && seg->size != 0 && seg->info.shmseg == event->shmseg
+		    && event->serial >= seg->serial)
+			seg->busy = False;
+	}
+}
+
+/* Get a segment from the pool with an XImage of the specified size
+   backed by shared memory, or NULL if the regular XPutImage() path
+   should be used. */
+static xshm_segment *
+xshm_acquire(int width, int height)
+{
+	int i;
+	size_t size;
+	xshm_segment *seg, *small;
+
+	if (!g_shm_available)
+		return NULL;
+
+	/* Worst case scanline padding is 64 bits */
+	size = (size_t) height * ((width * g_bpp + 63) / 64 * 8);
+	if (size < XSHM_MIN_IMAGE_SIZE)
+		return NULL;
+
+	seg = small = NULL;
+	for (i = 0; i < XSHM_POOL_SIZE && seg == NULL; i++)
+	{
+		if (g_shm_pool[i].busy)
+			continue;
+
+		if (g_shm_pool[i].size >= size)
+			seg = &g_shm_pool[i];
+		else if (small == NULL)
+			small = &g_shm_pool[i];
+	}
+
+	if (seg == NULL && small == NULL)
+	{
+		/* All segments are in flight, wait for the server to
+		   catch up rather than growing the pool. */
+		XSync(g_display, False);
+		for (i = 0; i < XSHM_POOL_SIZE; i++)
+			g_shm_pool[i].busy = False;
+
+		return xshm_acquire(width, height);
+	}
+
+	if (seg == NULL)
+	{
+		seg = small;
+		xshm_segment_destroy(seg);
+		if (!xshm_segment_create(seg, size))
+			return NULL;
+	}
+
+	seg->image = XShmCreateImage(g_display, g_visual, g_depth, ZPixmap,
+				     seg->info.shmaddr, &seg->info, width, height);
+	if (seg->image == NULL)
+		return NULL;
+
+	if ((size_t) seg->image->bytes_per_line * height > seg->size)
+	{
+		XFree(seg->image);
+		seg->image = NULL;
+		return NULL;
+	}
+
+	seg->serial = 0;
+	seg->busy = True;
+	return seg;
+}
+
+/* Return the XImage of a segment, it is reused once the X server has
+   completed all puts from it */
+static void
+xshm_release(xshm_segment * seg)
+{
+	XFree(seg->image);
+	seg->image = NULL;
+
+	if (seg->serial == 0)
+		seg->busy = False;
+}
+
+static void
+xshm_put_image(xshm_segment * seg, Drawable d, GC gc, int x, int y, int cx, int cy)
+{
+	seg->serial = NextRequest(g_display);
+	XShmPutImage(g_display, d, gc, seg->image, 0, 0, x, y, cx, cy, True);
+}
+
+#else /* HAVE_MITSHM */
+
+static void
+xshm_init(void)
+{
+}
+
+static void
+xshm_deinit(void)
+{
+}
+
+static inline xshm_segment *
+xshm_acquire(int width, int height)
+{
+	UNUSED(width);
+	UNUSED(height);
+	return NULL;
+}
+
+static inline void
+xshm_release(xshm_segment * seg)
+{
+	UNUSED(seg);
+}
+
+static inline void
+xshm_put_image(xshm_segment * seg, Drawable d, GC gc, int x, int y, int cx, int cy)
+{
+	UNUSED(seg);
+	UNUSED(d);
+	UNUSED(gc);
+	UNUSED(x);
+	UNUSED(y);
+	UNUSED(cx);
+	UNUSED(cy);
+}
+
+#endif /* HAVE_MITSHM */
+
+/* Move the pixels of a regular XImage in to a shared memory one, the
+   two may differ in scanline padding */
+static void
+xshm_copy_image(XImage * dst, XImage * src, int cy)
+{
+	int y, bpl;
 
-	sw = sw_get_window_by_id(id);
-	if (!sw)
-		return False;
+	bpl = MIN(dst->bytes_per_line, src->bytes_per_line);
+	for (y = 0; y < cy; y++)
+		memcpy(dst->data + y * dst->bytes_per_line, src->data + y * src->bytes_per_line,
+		       bpl);
+}
 
-	g_error_expected = True;
-	sts = XFetchName(g_display, sw->wnd, &name);
-	g_error_expected = False;
-	if (sts)
+/* Fill the image of a shared memory segment with the first height
+   scanlines of an RDP bitmap. Translation writes directly in to the
+   segment, saving the intermediate buffer of translate_image(). */
+static void
+xshm_fill_image(xshm_segment * seg, int width, int height, uint8 * data, int bitmap_pad)
+{
+	XImage *image;
+
+	if (!g_owncolmap && translate_needed())
 	{
-		XFree(name);
+		translate_image_into(width, height, data, (uint8 *) seg->image->data,
+				     seg->image->bytes_per_line);
+		return;
 	}
 
-	return sts;
+	image = XCreateImage(g_display, g_visual, g_depth, ZPixmap, 0,
+			     (char *) data, width, height, bitmap_pad, 0);
+	xshm_copy_image(seg->image, image, height);
+	XFree(image);
 }
 
-static int
-error_handler(Display * dpy, XErrorEvent * eev)
+/* Upload an image, through shared memory if seg is set */
+static void
+put_image(xshm_segment * seg, Drawable d, GC gc, XImage * image, int x, int y, int cx, int cy)
 {
-	if (g_error_expected)
-		return 0;
-
-	return g_old_error_handler(dpy, eev);
+	if (seg != NULL)
+		xshm_put_image(seg, d, gc, x, y, cx, cy);
+	else
+		XPutImage(g_display, d, gc, image, 0, 0, x, y, cx, cy);
 }
 
 static void
@@ -1983,12 +3270,19 @@ ui_init(void)
 	g_xserver_be = (ImageByteOrder(g_display) == MSBFirst);
 	screen_num = DefaultScreen(g_display);
 	g_x_socket = ConnectionNumber(g_display);
+	evloop_add_fd(g_x_socket, EVLOOP_READ);
 	g_screen = ScreenOfDisplay(g_display, screen_num);
 	g_depth = DefaultDepthOfScreen(g_screen);
 
 	if (!select_visual(screen_num))
 		return False;
 
+	g_bitmap_alpha = (g_depth == 32);
+
+	xshm_init();
+	translate_init();
+	translate_select();
+
 	if (g_no_translate_image)
 	{
 		logger(GUI, Debug,
@@ -2023,6 +3317,27 @@ ui_init(void)
 		g_ownbackstore = True;
 	}
 
+	if (g_scale != 100)
+	{
+#ifdef HAVE_XRENDER
+		int event_base, error_base;
+
+		if (g_seamless_rdp || !XRenderQueryExtension(g_display, &event_base, &error_base))
+		{
+			logger(GUI, Warning, "Scaling needs the XRender extension and no seamless mode");
+			g_scale = 100;
+		}
+		else
+		{
+			/* the window is drawn from it */
+			g_ownbackstore = True;
+		}
+#else
+		logger(GUI, Warning, "rdesktop was built without XRender, not scaling");
+		g_scale = 100;
+#endif
+	}
+
 	g_mod_map = XGetModifierMapping(g_display);
 	xwin_refresh_pointer_map();
 
@@ -2046,8 +3361,77 @@ ui_init(void)
 void
 ui_get_screen_size(uint32 * width, uint32 * height)
 {
-	*width = WidthOfScreen(g_screen);
-	*height = HeightOfScreen(g_screen);
+	*width = UNSCALED(WidthOfScreen(g_screen));
+	*height = UNSCALED(HeightOfScreen(g_screen));
+}
+
+/* Get the monitors of the screen, in root window coordinates, which
+   are those of a fullscreen session. Returns 0 unless there are more
+   than one. */
+int
+ui_get_monitors(RD_MONITOR * monitors, int max)
+{
+#if defined(HAVE_XRANDR) && (RANDR_MAJOR > 1 || RANDR_MINOR >= 5)
+	XRRMonitorInfo *info;
+	int i, n, primary;
+
+	info = XRRGetMonitors(g_display, RootWindowOfScreen(g_screen), True, &n);
+	if (info == NULL)
+		return 0;
+
+	n = MIN(n, max);
+	primary = 0;
+	for (i = 0; i < n; i++)
+	{
+		monitors[i].x = UNSCALED(info[i].x);
+		monitors[i].y = UNSCALED(info[i].y);
+		monitors[i].width = UNSCALED(info[i].width);
+		monitors[i].height = UNSCALED(info[i].height);
+		monitors[i].primary = False;
+		if (info[i].primary)
+			primary = i;
+	}
+	XRRFreeMonitors(info);
+
+	if (n < 2)
+		return 0;
+
+	/* there has to be exactly one */
+	monitors[primary].primary = True;
+	logger(GUI, Verbose, "Laying out the session on %d monitors", n);
+	return n;
+#else
+	UNUSED(monitors);
+	UNUSED(max);
+	logger(GUI, Warning, "Monitors can not be told apart without RandR 1.5");
+	return 0;
+#endif
+}
+
+/* Have the fullscreen window of a session laid out on several
+   monitors cover them all */
+static void
+set_fullscreen_monitors(void)
+{
+	int i, top, bottom, left, right;
+
+	top = bottom = left = right = 0;
+	for (i = 1; i < g_num_monitors; i++)
+	{
+		if (g_monitors[i].y < g_monitors[top].y)
+			top = i;
+		if (g_monitors[i].y + g_monitors[i].height >
+		    g_monitors[bottom].y + g_monitors[bottom].height)
+			bottom = i;
+		if (g_monitors[i].x < g_monitors[left].x)
+			left = i;
+		if (g_monitors[i].x + g_monitors[i].width >
+		    g_monitors[right].x + g_monitors[right].width)
+			right = i;
+	}
+
+	/* RandR lists the monitors in Xinerama order */
+	ewmh_set_fullscreen_monitors(g_wnd, top, bottom, left, right);
 }
 
 void
@@ -2065,8 +3449,8 @@ ui_get_workarea_size(uint32 * width, uint32 * height)
 	uint32 x, y, w, h;
 	if (get_current_workarea(&x, &y, &w, &h) == 0)
 	{
-		*width = w;
-		*height = h;
+		*width = UNSCALED(w);
+		*height = UNSCALED(h);
 		g_using_full_workarea = True;
 	}
 	else
@@ -2078,6 +3462,110 @@ ui_get_workarea_size(uint32 * width, uint32 * height)
 }
 
 
+/* The stipples and tiles of recently used brushes, least recently used
+   first out. Applications fill with the same few brushes over and over,
+   so their pixmaps are kept by content rather than made and freed
+   around every order. Brushes from the brush cache of the protocol keep
+   theirs in their BRUSHDATA instead, so this holds hatches and RDP 4
+   patterns. */
+#define BRUSH_LRU_SIZE	64
+
+typedef struct
+{
+	Pixmap pixmap;		/* 0 for a free slot */
+	uint32 used;
+	RD_BOOL tiled;
+	uint32 palette;		/* g_palette_generation a tile was made in */
+	int size;
+	uint8 data[8 * 8 * 4];
+}
+brush_lru_entry;
+
+static brush_lru_entry g_brush_lru[BRUSH_LRU_SIZE];
+static uint32 g_brush_lru_clock;
+
+/* Bumped when the palette changes, as tiles are made with its colours */
+static uint32 g_palette_generation;
+
+static void
+brush_lru_clear(void)
+{
+	int i;
+
+	for (i = 0; i < BRUSH_LRU_SIZE; i++)
+	{
+		if (g_brush_lru[i].pixmap != 0)
+			XFreePixmap(g_display, g_brush_lru[i].pixmap);
+		g_brush_lru[i].pixmap = 0;
+	}
+}
+
+/* Regions saved by desktop save orders. The server addresses them by
+   their offset into a save buffer of DESKSAVE_PIXELS pixels it thinks
+   the client has, here each is kept in a pixmap of its own so that
+   saving and restoring is a copy within the X server. */
+#define DESKSAVE_PIXELS	0x38400
+#define DESKSAVE_SLOTS	16
+
+typedef struct
+{
+	Pixmap pixmap;		/* 0 for a free slot */
+	uint32 offset;
+	int cx, cy;
+}
+desksave_entry;
+
+static desksave_entry g_desksave[DESKSAVE_SLOTS];
+
+static void
+desksave_clear(void)
+{
+	int i;
+
+	for (i = 0; i < DESKSAVE_SLOTS; i++)
+	{
+		if (g_desksave[i].pixmap != 0)
+			XFreePixmap(g_display, g_desksave[i].pixmap);
+		g_desksave[i].pixmap = 0;
+	}
+}
+
+/* X cursors of the pointers seen, so that one the server sends again,
+   under the same or another cache index, need not be made again. An
+   entry no longer in the pointer cache stays until its place is
+   needed. */
+#define CURSOR_CACHE_SIZE	64
+
+typedef struct
+{
+	Cursor cursor;		/* None for a free entry */
+	uint32 hash;
+	int refs;
+	uint32 used;
+	uint8 *key;		/* hotspot, size and depth, then the masks */
+	size_t key_size;
+}
+cursor_cache_entry;
+
+static cursor_cache_entry g_cursor_cache[CURSOR_CACHE_SIZE];
+static uint32 g_cursor_cache_clock;
+
+static void
+cursor_cache_clear(void)
+{
+	int i;
+
+	for (i = 0; i < CURSOR_CACHE_SIZE; i++)
+	{
+		if (g_cursor_cache[i].cursor == None)
+			continue;
+		if ((RD_HCURSOR) g_cursor_cache[i].cursor != g_null_cursor)
+			XFreeCursor(g_display, g_cursor_cache[i].cursor);
+		xfree(g_cursor_cache[i].key);
+		g_cursor_cache[i].cursor = None;
+	}
+}
+
 void
 ui_deinit(void)
 {
@@ -2086,12 +3574,23 @@ ui_deinit(void)
 	if (g_IM != NULL)
 		XCloseIM(g_IM);
 
+	cursor_cache_clear();
 	if (g_null_cursor != NULL)
 		XFreeCursor(g_display, (Cursor) g_null_cursor);
+	g_null_cursor = NULL;
 
 	XFreeModifiermap(g_mod_map);
 
+	xshm_deinit();
+	brush_lru_clear();
+	desksave_clear();
+
+	xfree(g_translate_lut);
+	g_translate_lut = NULL;
+	g_translate_depth = 0;
+
 	XFreeGC(g_display, g_gc);
+	evloop_remove_fd(g_x_socket);
 	XCloseDisplay(g_display);
 	g_display = NULL;
 }
@@ -2127,7 +3626,7 @@ static void
 get_input_mask(long *input_mask)
 {
 	*input_mask = KeyPressMask | KeyReleaseMask | ButtonPressMask | ButtonReleaseMask |
-		VisibilityChangeMask | FocusChangeMask | StructureNotifyMask;
+		VisibilityChangeMask | FocusChangeMask | StructureNotifyMask | PropertyChangeMask;
 
 	if (g_sendmotion)
 		*input_mask |= PointerMotionMask;
@@ -2176,7 +3675,7 @@ ui_update_window_sizehints(uint32 width, uint32 height)
 	sizehints = XAllocSizeHints();
 	if (sizehints)
 	{
-		get_sizehints(sizehints, width, height);
+		get_sizehints(sizehints, SCALED(width), SCALED(height));
 		XSetWMNormalHints(g_display, g_wnd, sizehints);
 		XFree(sizehints);
 	}
@@ -2199,25 +3698,30 @@ ui_create_window(uint32 width, uint32 height)
 	XClassHint *classhints;
 	XSizeHints *sizehints;
 	unsigned long value_mask;
-	long input_mask, ic_input_mask;
+	long input_mask, ic_input_mask, root_mask;
 	XEvent xevent;
+	uint32 wnd_width, wnd_height;
 
 	/* reset stored window sizes */
 	g_window_width = 0;
 	g_window_height = 0;
 
 	logger(GUI, Debug, "ui_create_window() width = %d, height = %d", width, height);
+	wnd_width = SCALED(width);
+	wnd_height = SCALED(height);
 
 	/* Handle -x-y portion of geometry string */
 	if (g_xpos < 0 || (g_xpos == 0 && (g_pos & 2)))
-		g_xpos = WidthOfScreen(g_screen) + g_xpos - width;
+		g_xpos = WidthOfScreen(g_screen) + g_xpos - wnd_width;
 	if (g_ypos < 0 || (g_ypos == 0 && (g_pos & 4)))
-		g_ypos = HeightOfScreen(g_screen) + g_ypos - height;
+		g_ypos = HeightOfScreen(g_screen) + g_ypos - wnd_height;
 
 	value_mask = get_window_attribs(&attribs);
 
-	g_wnd = XCreateWindow(g_display, RootWindowOfScreen(g_screen), g_xpos, g_ypos, width,
-			      height, 0, g_depth, InputOutput, g_visual, value_mask, &attribs);
+	g_wnd = XCreateWindow(g_display, RootWindowOfScreen(g_screen), g_xpos, g_ypos, wnd_width,
+			      wnd_height, 0, g_depth, InputOutput, g_visual, value_mask, &attribs);
+	g_wnd_width = wnd_width;
+	g_wnd_height = wnd_height;
 
 	ewmh_set_wm_pid(g_wnd, getpid());
 	set_wm_client_machine(g_display, g_wnd);
@@ -2234,6 +3738,8 @@ ui_create_window(uint32 width, uint32 height)
 	if ((g_ownbackstore) && (g_backstore == 0))
 	{
 		g_backstore = XCreatePixmap(g_display, g_wnd, width, height, g_depth);
+		g_backstore_width = g_backstore_alloc_width = width;
+		g_backstore_height = g_backstore_alloc_height = height;
 
 		/* clear to prevent rubbish being exposed at startup */
 		XSetForeground(g_display, g_gc, BlackPixelOfScreen(g_screen));
@@ -2257,7 +3763,7 @@ ui_create_window(uint32 width, uint32 height)
 	sizehints = XAllocSizeHints();
 	if (sizehints)
 	{
-		get_sizehints(sizehints, width, height);
+		get_sizehints(sizehints, wnd_width, wnd_height);
 		XSetWMNormalHints(g_display, g_wnd, sizehints);
 		XFree(sizehints);
 	}
@@ -2280,13 +3786,18 @@ ui_create_window(uint32 width, uint32 height)
 	}
 
 	XSelectInput(g_display, g_wnd, input_mask);
+	/* _NET_CURRENT_DESKTOP, and the selection notifications of xclip */
+	root_mask = PropertyChangeMask;
 #ifdef HAVE_XRANDR
-	XSelectInput(g_display, RootWindowOfScreen(g_screen), StructureNotifyMask);
+	root_mask |= StructureNotifyMask;
 #endif
+	XSelectInput(g_display, RootWindowOfScreen(g_screen), root_mask);
 	if (g_fullscreen && g_has_wm) {
 		request_wm_fullscreen(g_display, g_wnd);
 	}
 	XMapWindow(g_display, g_wnd);
+	if (g_fullscreen && g_has_wm && g_num_monitors > 1)
+		set_fullscreen_monitors();
 
 	/* wait for VisibilityNotify */
 	do
@@ -2294,10 +3805,10 @@ ui_create_window(uint32 width, uint32 height)
 		XMaskEvent(g_display, VisibilityChangeMask, &xevent);
 	}
 	while (xevent.type != VisibilityNotify);
-	g_Unobscured = xevent.xvisibility.state == VisibilityUnobscured;
 
 	g_focused = False;
 	g_mouse_in_wnd = False;
+	g_wnd_obscured = g_wnd_iconic = g_wnd_elsewhere = False;
 
 	/* handle the WM_DELETE_WINDOW protocol */
 	g_protocol_atom = XInternAtom(g_display, "WM_PROTOCOLS", True);
@@ -2324,16 +3835,59 @@ ui_create_window(uint32 width, uint32 height)
 	return True;
 }
 
+/* Change the size of the session drawn in the backstore. The pixmap
+   is only replaced when it has to grow, and then with some room to
+   grow further, as a window dragged larger is resized many times over.
+   What the session gains is cleared to black. */
+static void
+resize_backstore(uint32 width, uint32 height)
+{
+	uint32 alloc_width, alloc_height;
+	Pixmap bs;
+
+	if (width > g_backstore_alloc_width || height > g_backstore_alloc_height)
+	{
+		alloc_width = MAX(width, g_backstore_alloc_width);
+		alloc_height = MAX(height, g_backstore_alloc_height);
+		alloc_width = MAX(alloc_width, MIN(width + width / 4, (uint32) WidthOfScreen(g_screen)));
+		alloc_height =
+			MAX(alloc_height, MIN(height + height / 4, (uint32) HeightOfScreen(g_screen)));
+
+		bs = XCreatePixmap(g_display, g_wnd, alloc_width, alloc_height, g_depth);
+		XCopyArea(g_display, g_backstore, bs, g_gc, 0, 0, MIN(width, g_backstore_width),
+			  MIN(height, g_backstore_height), 0, 0);
+		XFreePixmap(g_display, g_backstore);
+		backstore_free_pictures();
+		g_backstore = bs;
+		g_backstore_alloc_width = alloc_width;
+		g_backstore_alloc_height = alloc_height;
+	}
+
+	XSetForeground(g_display, g_gc, BlackPixelOfScreen(g_screen));
+	if (width > g_backstore_width)
+		XFillRectangle(g_display, g_backstore, g_gc, g_backstore_width, 0,
+			       width - g_backstore_width, height);
+	if (height > g_backstore_height)
+		XFillRectangle(g_display, g_backstore, g_gc, 0, g_backstore_height, width,
+			       height - g_backstore_height);
+
+	g_backstore_width = width;
+	g_backstore_height = height;
+}
+
 void
 ui_resize_window(uint32 width, uint32 height)
 {
 	XWindowAttributes attr;
 	XSizeHints *sizehints;
-	Pixmap bs;
 
+	draw_batch_flush();
 	XGetWindowAttributes(g_display, g_wnd, &attr);
 
-	if ((attr.width == (int) width && attr.height == (int) height))
+	/* The window may have been kept across a reconnect and resized by
+	   the user already, while the backstore still has the old size */
+	if ((attr.width == SCALED(width) && attr.height == SCALED(height)) &&
+	    (g_backstore == 0 || (g_backstore_width == width && g_backstore_height == height)))
 	{
 		/* no-op */
 		return;
@@ -2346,28 +3900,23 @@ ui_resize_window(uint32 width, uint32 height)
 	sizehints = XAllocSizeHints();
 	if (sizehints)
 	{
-		get_sizehints(sizehints, width, height);
+		get_sizehints(sizehints, SCALED(width), SCALED(height));
 		XSetWMNormalHints(g_display, g_wnd, sizehints);
 		XFree(sizehints);
 	}
 
 	if (!g_embed_wnd)
 	{
-		XResizeWindow(g_display, g_wnd, width, height);
-	}
-
-	/* create new backstore pixmap */
-	if (g_backstore != 0)
-	{
-		bs = XCreatePixmap(g_display, g_wnd, width, height, g_depth);
-		XSetForeground(g_display, g_gc, BlackPixelOfScreen(g_screen));
-		XFillRectangle(g_display, bs, g_gc, 0, 0, width, height);
-		XCopyArea(g_display, g_backstore, bs, g_gc, 0, 0, width, height, 0, 0);
-		XFreePixmap(g_display, g_backstore);
-		g_backstore = bs;
+		XResizeWindow(g_display, g_wnd, SCALED(width), SCALED(height));
+		g_wnd_width = SCALED(width);
+		g_wnd_height = SCALED(height);
 	}
 
+	/* the clip has to cover what the backstore gains */
 	ui_set_clip(0, 0, width, height);
+
+	if (g_backstore != 0)
+		resize_backstore(width, height);
 }
 
 RD_BOOL
@@ -2379,9 +3928,11 @@ ui_have_window()
 void
 ui_destroy_window(void)
 {
+	draw_batch_flush();
 	if (g_IC != NULL)
 		XDestroyIC(g_IC);
 
+	backstore_free_pictures();
 	XDestroyWindow(g_display, g_wnd);
 	g_wnd = 0;
 
@@ -2390,6 +3941,25 @@ ui_destroy_window(void)
 		XFreePixmap(g_display, g_backstore);
 		g_backstore = 0;
 	}
+
+	if (g_text_pixmap)
+	{
+		XFreePixmap(g_display, g_text_pixmap);
+		g_text_pixmap = 0;
+		g_text_pixmap_width = g_text_pixmap_height = 0;
+	}
+	text_cache_clear();
+
+	if (g_damage_gc)
+	{
+		XFreeGC(g_display, g_damage_gc);
+		g_damage_gc = NULL;
+	}
+	if (g_damage)
+	{
+		XDestroyRegion(g_damage);
+		g_damage = NULL;
+	}
 }
 
 void
@@ -2464,8 +4034,8 @@ xwin_toggle_fullscreen(void)
 		else
 		{
 			/* Resize window to fit session size */
-			width = g_session_width;
-			height = g_session_height;
+			width = SCALED(g_session_width);
+			height = SCALED(g_session_height);
 		}
 	}
 
@@ -2476,8 +4046,11 @@ xwin_toggle_fullscreen(void)
 	   attributes. */
 	g_xpos = x;
 	g_ypos = y;
+	g_num_monitors = 0;
+	if (g_fullscreen && g_multimon)
+		g_num_monitors = ui_get_monitors(g_monitors, RDP_MAX_MONITORS);
 	ui_destroy_window();
-	ui_create_window(width, height);
+	ui_create_window(UNSCALED(width), UNSCALED(height));
 
 	/* If the window manager overrides our window size request, we trust
 	   the normal window resize mechanism to take care of resizing the
@@ -2505,11 +4078,8 @@ xwin_toggle_fullscreen(void)
 static void
 handle_button_event(XEvent xevent, RD_BOOL down)
 {
-	XWindowAttributes attr;
 	uint16 button, input_type, flags = 0;
 
-	XGetWindowAttributes(g_display, g_wnd, &attr);
-
 	g_last_gesturetime = xevent.xbutton.time;
 	/* Reverse the pointer button mapping, e.g. in the case of
 	   "left-handed mouse mode"; the RDP session expects to
@@ -2532,12 +4102,12 @@ handle_button_event(XEvent xevent, RD_BOOL down)
 	if (xevent.xbutton.y < g_win_button_size)
 	{
 		/*  Check from right to left: */
-		if (xevent.xbutton.x >= attr.width - g_win_button_size)
+		if (xevent.xbutton.x >= g_wnd_width - g_win_button_size)
 		{
 			/* The close button, continue */
 			;
 		}
-		else if (xevent.xbutton.x >= attr.width - g_win_button_size * 2)
+		else if (xevent.xbutton.x >= g_wnd_width - g_win_button_size * 2)
 		{
 			/* The maximize/restore button. Do not send to
 			   server.  It might be a good idea to change the
@@ -2546,7 +4116,7 @@ handle_button_event(XEvent xevent, RD_BOOL down)
 			if (xevent.type == ButtonPress)
 				return;
 		}
-		else if (xevent.xbutton.x >= attr.width - g_win_button_size * 3)
+		else if (xevent.xbutton.x >= g_wnd_width - g_win_button_size * 3)
 		{
 			/* The minimize button. Iconify window. */
 			if (xevent.type == ButtonRelease)
@@ -2591,7 +4161,8 @@ handle_button_event(XEvent xevent, RD_BOOL down)
 	if (xevent.xmotion.window == g_wnd)
 	{
 		rdp_send_input(time(NULL), input_type,
-			       flags | button, xevent.xbutton.x, xevent.xbutton.y);
+			       flags | button, UNSCALED(xevent.xbutton.x),
+			       UNSCALED(xevent.xbutton.y));
 	}
 	else
 	{
@@ -2601,6 +4172,48 @@ handle_button_event(XEvent xevent, RD_BOOL down)
 	}
 }
 
+/* Suppress output from the server while the main window is unmapped,
+   minimised, fully covered or on another workspace, and let it through
+   again once the window can be seen */
+static void
+xwin_update_visibility(RD_BOOL mapped)
+{
+	RD_BOOL hidden;
+
+	if (g_seamless_active)
+		return;
+
+	hidden = !mapped || g_wnd_obscured || g_wnd_iconic || g_wnd_elsewhere;
+	if (hidden == g_wnd_hidden)
+		return;
+
+	logger(GUI, Debug, "xwin_update_visibility(), window %s", hidden ? "hidden" : "shown");
+
+	g_wnd_hidden = hidden;
+	rdp_send_suppress_output_pdu(hidden ? SUPPRESS_DISPLAY_UPDATES : ALLOW_DISPLAY_UPDATES);
+}
+
+/* Tell the RDP layer what the user is looking at, the focused seamless
+   window or else the area around the pointer, to be updated first when
+   the link cannot keep up */
+#define FOCUS_RADIUS 256
+
+static void
+xwin_update_focus_region(int x, int y)
+{
+	seamless_window *sw;
+
+	if (g_seamless_active && (sw = sw_get_window_by_id(g_seamless_focused)) != NULL)
+	{
+		rdp_set_focus_region(sw->xoffset, sw->yoffset, sw->xoffset + sw->width - 1,
+				     sw->yoffset + sw->height - 1);
+		return;
+	}
+
+	rdp_set_focus_region(x - FOCUS_RADIUS, y - FOCUS_RADIUS, x + FOCUS_RADIUS,
+			     y + FOCUS_RADIUS);
+}
+
 /* Process events in Xlib queue
    Returns 0 after user quit, 1 otherwise */
 static int
@@ -2623,8 +4236,11 @@ xwin_process_events(void)
 			/* Ignore events between ui_destroy_window and ui_create_window */
 			continue;
 
-		/* Also ignore root window events except ConfigureNotify */
+		/* Also ignore root window events except ConfigureNotify and
+		   workspace switches */
 		if (xevent.type != ConfigureNotify
+		    && !(xevent.type == PropertyNotify
+			 && xevent.xproperty.atom == g_net_current_desktop_atom)
 		    && xevent.xany.window == DefaultRootWindow(g_display))
 			continue;
 
@@ -2634,14 +4250,16 @@ xwin_process_events(void)
 			continue;
 		}
 
-		switch (xevent.type)
+#ifdef HAVE_MITSHM
+		if (g_shm_available && xevent.type == g_shm_completion_type)
 		{
-			case VisibilityNotify:
-				if (xevent.xvisibility.window == g_wnd)
-					g_Unobscured =
-						xevent.xvisibility.state == VisibilityUnobscured;
+			xshm_handle_completion((XShmCompletionEvent *) & xevent);
+			continue;
+		}
+#endif
 
-				break;
+		switch (xevent.type)
+		{
 			case ClientMessage:
 				if (xevent.xclient.message_type == g_protocol_atom)
 				{
@@ -2750,7 +4368,10 @@ xwin_process_events(void)
 				if (xevent.xmotion.window == g_wnd)
 				{
 					rdp_send_input(time(NULL), RDP_INPUT_MOUSE, MOUSE_FLAG_MOVE,
-						       xevent.xmotion.x, xevent.xmotion.y);
+						       UNSCALED(xevent.xmotion.x),
+						       UNSCALED(xevent.xmotion.y));
+					xwin_update_focus_region(UNSCALED(xevent.xmotion.x),
+								 UNSCALED(xevent.xmotion.y));
 				}
 				else
 				{
@@ -2758,6 +4379,8 @@ xwin_process_events(void)
 					rdp_send_input(time(NULL), RDP_INPUT_MOUSE, MOUSE_FLAG_MOVE,
 						       xevent.xmotion.x_root,
 						       xevent.xmotion.y_root);
+					xwin_update_focus_region(xevent.xmotion.x_root,
+								 xevent.xmotion.y_root);
 				}
 				break;
 
@@ -2793,6 +4416,7 @@ xwin_process_events(void)
 					if (sw_window_exists(g_seamless_focused))
 						seamless_send_focus(sw->id, 0);
 					g_seamless_focused = sw->id;
+					xwin_update_focus_region(0, 0);
 				}
 				break;
 
@@ -2825,8 +4449,22 @@ xwin_process_events(void)
 				XUngrabKeyboard(g_display, CurrentTime);
 				break;
 
+			case VisibilityNotify:
+				if (xevent.xvisibility.window != g_wnd)
+					break;
+				g_wnd_obscured = xevent.xvisibility.state == VisibilityFullyObscured;
+				xwin_update_visibility(is_g_wnd_mapped);
+				break;
+
 			case Expose:
-				if (xevent.xexpose.window == g_wnd)
+				if (xevent.xexpose.window == g_wnd && g_scale != 100)
+				{
+					backstore_present_scaled(UNSCALED(xevent.xexpose.x),
+								 UNSCALED(xevent.xexpose.y),
+								 UNSCALED(xevent.xexpose.width),
+								 UNSCALED(xevent.xexpose.height));
+				}
+				else if (xevent.xexpose.window == g_wnd)
 				{
 					XCopyArea(g_display, g_backstore, xevent.xexpose.window,
 						  g_gc,
@@ -2882,6 +4520,20 @@ xwin_process_events(void)
 				break;
 			case PropertyNotify:
 				xclip_handle_PropertyNotify(&xevent.xproperty);
+				if (xevent.xproperty.window == g_wnd
+				    && xevent.xproperty.atom == g_net_wm_state_atom)
+				{
+					g_wnd_iconic = xevent.xproperty.state == PropertyNewValue
+						&& ewmh_get_window_state(g_wnd) == SEAMLESSRDP_MINIMIZED;
+					xwin_update_visibility(is_g_wnd_mapped);
+				}
+				if ((xevent.xproperty.window == g_wnd
+				     && xevent.xproperty.atom == g_net_wm_desktop_atom)
+				    || xevent.xproperty.atom == g_net_current_desktop_atom)
+				{
+					g_wnd_elsewhere = !ewmh_is_window_on_current_desktop(g_wnd);
+					xwin_update_visibility(is_g_wnd_mapped);
+				}
 				if (xevent.xproperty.window == g_wnd)
 					break;
 				if (xevent.xproperty.window == DefaultRootWindow(g_display))
@@ -2920,25 +4572,22 @@ xwin_process_events(void)
 					       g_window_width, g_window_height);
 
 					is_g_wnd_mapped = True;
-				}
-
-				if (!g_seamless_active)
-				{
-					rdp_send_suppress_output_pdu(ALLOW_DISPLAY_UPDATES);
+					xwin_update_visibility(is_g_wnd_mapped);
 				}
 				break;
 			case UnmapNotify:
 				if (xevent.xconfigure.window == g_wnd)
 				{
 					is_g_wnd_mapped = False;
-				}
-
-				if (!g_seamless_active)
-				{
-					rdp_send_suppress_output_pdu(SUPPRESS_DISPLAY_UPDATES);
+					xwin_update_visibility(is_g_wnd_mapped);
 				}
 				break;
 			case ConfigureNotify:
+				if (xevent.xconfigure.window == g_wnd)
+				{
+					g_wnd_width = xevent.xconfigure.width;
+					g_wnd_height = xevent.xconfigure.height;
+				}
 #ifdef HAVE_XRANDR
 				/* Resize on root window size change */
 				if (xevent.xconfigure.window == DefaultRootWindow(g_display))
@@ -2963,10 +4612,12 @@ xwin_process_events(void)
 							/* Resize fullscreen window to match root window size */
 							/* TODO: Handle percentage of screen */
 							if (g_fullscreen)
-								ui_resize_window(xevent.xconfigure.
-										 width,
-										 xevent.xconfigure.
-										 height);
+								ui_resize_window(UNSCALED
+										 (xevent.xconfigure.
+										  width),
+										 UNSCALED
+										 (xevent.xconfigure.
+										  height));
 							g_pending_resize = True;
 						}
 					}
@@ -2974,6 +4625,9 @@ xwin_process_events(void)
 					XRRUpdateConfiguration(&xevent);
 					XSync(g_display, False);
 
+					/* the refresh rate may have changed too */
+					g_frame_rate = 0;
+
 				}
 				else
 #endif
@@ -2986,8 +4640,8 @@ xwin_process_events(void)
 					g_window_height = xevent.xconfigure.height;
 
 					uint32 w, h;
-					w = g_window_width;
-					h = g_window_height;
+					w = UNSCALED(g_window_width);
+					h = UNSCALED(g_window_height);
 
 					utils_apply_session_size_limitations(&w, &h);
 
@@ -3020,6 +4674,9 @@ xwin_process_events(void)
 				if (!sw)
 					break;
 
+				if (sw_is_own_restack(sw, xevent.xany.serial))
+					break;
+
 				gettimeofday(sw->position_timer, NULL);
 				if (sw->position_timer->tv_usec + SEAMLESSRDP_POSITION_TIMER >=
 				    1000000)
@@ -3056,17 +4713,18 @@ time_t g_wait_for_deactivate_ts = 0;
 static RD_BOOL
 process_fds(int rdp_socket, int ms)
 {
-	int n, ret;
+	int n, ret, events;
 	fd_set rfds, wfds;
 	struct timeval tv;
 	RD_BOOL s_timeout = False;
 
-	n = (rdp_socket > g_x_socket) ? rdp_socket : g_x_socket;
+	/* The rdp, X11 and ctrl sockets are registered with the event
+	   loop once; only the fds of pending sound and device requests
+	   are collected here. */
+	n = -1;
 
 	FD_ZERO(&rfds);
 	FD_ZERO(&wfds);
-	FD_SET(rdp_socket, &rfds);
-	FD_SET(g_x_socket, &rfds);
 
 	/* default timeout */
 	tv.tv_sec = ms / 1000;
@@ -3080,17 +4738,12 @@ process_fds(int rdp_socket, int ms)
 	rdpdr_add_fds(&n, &rfds, &wfds, &tv, &s_timeout);
 	seamless_select_timeout(&tv);
 
-	/* add ctrl slaves handles */
-	ctrl_add_fds(&n, &rfds);
-
-	n++;
-
-	ret = select(n, &rfds, &wfds, NULL, &tv);
+	ret = evloop_wait(n, &rfds, &wfds, &tv);
 	if (ret <= 0)
 	{
-		if (ret == -1)
+		if (ret == -1 && errno != EINTR)
 		{
-			logger(GUI, Error, "process_fds(), select failed: %s", strerror(errno));
+			logger(GUI, Error, "process_fds(), wait failed: %s", strerror(errno));
 		}
 #ifdef WITH_RDPSND
 		rdpsnd_check_fds(&rfds, &wfds);
@@ -3102,15 +4755,25 @@ process_fds(int rdp_socket, int ms)
 		return False;
 	}
 
+	/* the replies to whatever became ready leave together */
+	tcp_cork();
+
 #ifdef WITH_RDPSND
 	rdpsnd_check_fds(&rfds, &wfds);
 #endif
 
 	rdpdr_check_fds(&rfds, &wfds, (RD_BOOL) False);
 
-	ctrl_check_fds(&rfds, &wfds);
+	ctrl_check_fds();
+
+	tcp_uncork();
 
-	if (FD_ISSET(rdp_socket, &rfds))
+	/* the socket has room again for queued virtual channel chunks */
+	events = evloop_check_fd(rdp_socket);
+	if (events & EVLOOP_WRITE)
+		channel_flush();
+
+	if (events & EVLOOP_READ)
 		return True;
 
 	return False;
@@ -3136,12 +4799,16 @@ process_pending_resize()
 {
 	time_t now_ts;
 	struct timeval now;
+	uint32 elapsed;
 
 	/* Rate limit ConfigureNotify events before performing a
-	   resize - enough time has to pass after the last event
+	   resize - enough time has to pass after the last event. A
+	   resize through RDPEDISP costs no reconnect, so it may follow
+	   the window more closely.
 	 */
 	gettimeofday(&now, NULL);
-	if (time_difference_in_ms(g_resize_timer, now) <= 500)
+	elapsed = time_difference_in_ms(g_resize_timer, now);
+	if (elapsed <= 200 || (elapsed <= 500 && !rdpedisp_is_available()))
 		return False;
 
 	/* There is a race problem when using disconnect / reconnect
@@ -3175,8 +4842,10 @@ process_pending_resize()
 	if (g_fullscreen || g_seamless_rdp)
 	{
 		/* follow root window size */
-		g_requested_session_width = WidthOfScreen(g_screen);
-		g_requested_session_height = HeightOfScreen(g_screen);
+		g_requested_session_width = UNSCALED(WidthOfScreen(g_screen));
+		g_requested_session_height = UNSCALED(HeightOfScreen(g_screen));
+		if (g_multimon && g_fullscreen)
+			g_num_monitors = ui_get_monitors(g_monitors, RDP_MAX_MONITORS);
 		if (g_window_size_type == PercentageOfScreen)
 		{
 			/* TODO: Implement percentage of screen */
@@ -3185,8 +4854,9 @@ process_pending_resize()
 	else
 	{
 		/* Follow window size */
-		g_requested_session_width = g_window_width;
-		g_requested_session_height = g_window_height;
+		g_requested_session_width = UNSCALED(g_window_width);
+		g_requested_session_height = UNSCALED(g_window_height);
+		g_num_monitors = 0;
 	}
 
 
@@ -3234,13 +4904,24 @@ process_pending_resize()
 void
 ui_select(int rdp_socket)
 {
-	int timeout;
+	int timeout, frame_timeout, ret;
 	RD_BOOL rdp_socket_has_data = False;
 
 	while (g_exit_mainloop == False && rdp_socket_has_data == False)
 	{
-		/* Process a limited amount of pending x11 events */
-		if (!xwin_process_events())
+#ifdef WITH_TRACE
+		trace_check_signal();
+#endif
+		/* drawing done outside of an update must not linger */
+		draw_batch_flush();
+		frame_timeout = frame_update();
+
+		/* Process a limited amount of pending x11 events, and
+		   send the input they generate in as few PDUs as possible */
+		rdp_input_batch_begin();
+		ret = xwin_process_events();
+		rdp_input_batch_end();
+		if (!ret)
 		{
 			/* User quit */
 			g_user_quit = True;
@@ -3279,28 +4960,183 @@ ui_select(int rdp_socket)
 
 		timeout = 60000;
 
-		if (XPending(g_display) > 0)
+		/* xwin_process_events() has read what there was, only
+		   events it left in the queue matter, and the requests
+		   made since have to go out before sleeping */
+		XFlush(g_display);
+		if (XEventsQueued(g_display, QueuedAlready) > 0)
 			timeout = 0;
 		else if (g_pending_resize == True)
 			timeout = 100;
 
+		/* wake up for pointer motion held back by the rate limit */
+		ret = rdp_input_timeout();
+		if (ret >= 0 && ret < timeout)
+			timeout = ret;
+
+		/* to warn about a restack the window manager did not answer */
+		if (g_seamless_active)
+		{
+			ret = sw_restack_timeout();
+			if (ret >= 0 && ret < timeout)
+				timeout = ret;
+		}
+
+		/* and to give queued dynamic channel data its next turn */
+		dvc_flush();
+		ret = dvc_send_timeout();
+		if (ret >= 0 && ret < timeout)
+			timeout = ret;
+
+#ifdef WITH_TSMF
+		/* and for the next picture of redirected video */
+		ret = tsmf_present();
+		if (ret >= 0 && ret < timeout)
+			timeout = ret;
+#endif
+
+		/* and for presenting damage held back until the next refresh */
+		if (frame_timeout >= 0 && frame_timeout < timeout)
+			timeout = frame_timeout;
+
 		rdp_socket_has_data = process_fds(rdp_socket, timeout);
 	}
 }
 
-void
-ui_move_pointer(int x, int y)
+void
+ui_move_pointer(int x, int y)
+{
+	XWarpPointer(g_display, g_wnd, g_wnd, 0, 0, 0, 0, SCALED(x), SCALED(y));
+}
+
+/* Cached bitmaps are mostly small tiles, and one pixmap each would
+   cost the X server a resource and some memory per bitmap. Those up to
+   ATLAS_MAX_CELL pixels on a side are instead packed into atlas pages,
+   each page holding cells of one size. An RD_HBITMAP points to an
+   xbitmap, giving the pixmap and where in it the bitmap is; bigger
+   bitmaps get a pixmap of their own. */
+#define ATLAS_PAGE_SIZE	512
+#define ATLAS_MIN_CELL	16
+#define ATLAS_CLASSES	3	/* 16, 32 and 64 pixel cells */
+#define ATLAS_MAX_CELLS	((ATLAS_PAGE_SIZE / ATLAS_MIN_CELL) * (ATLAS_PAGE_SIZE / ATLAS_MIN_CELL))
+
+typedef struct atlas_page
+{
+	Pixmap pixmap;
+	int cell;		/* size of the cells, in pixels */
+	int used;
+	int nfree;
+	uint16 free[ATLAS_MAX_CELLS];
+	struct atlas_page *next;
+}
+atlas_page;
+
+typedef struct
+{
+	Pixmap pixmap;
+	int x, y;
+	int width, height;
+	atlas_page *page;	/* NULL for a pixmap of its own */
+}
+xbitmap;
+
+static atlas_page *g_atlas[ATLAS_CLASSES];
+
+/* The size class of a bitmap, -1 when it is too big for the atlas */
+static int
+atlas_class(int width, int height)
+{
+	int class, cell;
+
+	for (class = 0, cell = ATLAS_MIN_CELL; class < ATLAS_CLASSES; class++, cell *= 2)
+	{
+		if (width <= cell && height <= cell)
+			return class;
+	}
+	return -1;
+}
+
+/* Place bmp in a free cell of its class, adding a page if all are full */
+static void
+atlas_alloc(int class, xbitmap * bmp)
+{
+	atlas_page *page;
+	int slot, per_row;
+
+	for (page = g_atlas[class]; page != NULL; page = page->next)
+	{
+		if (page->nfree > 0)
+			break;
+	}
+
+	if (page == NULL)
+	{
+		page = xmalloc(sizeof(atlas_page));
+		page->cell = ATLAS_MIN_CELL << class;
+		page->pixmap = XCreatePixmap(g_display, g_wnd, ATLAS_PAGE_SIZE, ATLAS_PAGE_SIZE,
+					     g_depth);
+		page->used = 0;
+		per_row = ATLAS_PAGE_SIZE / page->cell;
+		/* hand out the low cells first */
+		for (page->nfree = 0; page->nfree < per_row * per_row; page->nfree++)
+			page->free[page->nfree] = per_row * per_row - 1 - page->nfree;
+		page->next = g_atlas[class];
+		g_atlas[class] = page;
+		g_atlas_pages++;
+	}
+
+	per_row = ATLAS_PAGE_SIZE / page->cell;
+	slot = page->free[--page->nfree];
+	page->used++;
+
+	bmp->page = page;
+	bmp->pixmap = page->pixmap;
+	bmp->x = (slot % per_row) * page->cell;
+	bmp->y = (slot / per_row) * page->cell;
+}
+
+static void
+atlas_free(xbitmap * bmp)
+{
+	atlas_page *page = bmp->page, **prev;
+	int per_row = ATLAS_PAGE_SIZE / page->cell;
+
+	page->free[page->nfree++] = (bmp->y / page->cell) * per_row + bmp->x / page->cell;
+	if (--page->used > 0)
+		return;
+
+	/* the page is empty, give it back to the X server */
+	prev = &g_atlas[atlas_class(page->cell, page->cell)];
+	while (*prev != page)
+		prev = &(*prev)->next;
+	*prev = page->next;
+	XFreePixmap(g_display, page->pixmap);
+	xfree(page);
+	g_atlas_pages--;
+}
+
+/* An RD_HBITMAP for a pixmap of its own */
+static RD_HBITMAP
+xbitmap_wrap(Pixmap pixmap, int width, int height)
 {
-	XWarpPointer(g_display, g_wnd, g_wnd, 0, 0, 0, 0, x, y);
+	xbitmap *bmp = xmalloc(sizeof(xbitmap));
+
+	bmp->pixmap = pixmap;
+	bmp->x = bmp->y = 0;
+	bmp->width = width;
+	bmp->height = height;
+	bmp->page = NULL;
+	return (RD_HBITMAP) bmp;
 }
 
-RD_HBITMAP
-ui_create_bitmap(int width, int height, uint8 * data)
+/* Put session depth data at x, y in drawable d */
+static void
+put_bitmap_data(Drawable d, int x, int y, int width, int height, uint8 * data)
 {
 	XImage *image;
-	Pixmap bitmap;
 	uint8 *tdata;
 	int bitmap_pad;
+	xshm_segment *seg;
 
 	if (g_server_depth == 8)
 	{
@@ -3314,17 +5150,49 @@ ui_create_bitmap(int width, int height, uint8 * data)
 			bitmap_pad = 32;
 	}
 
+	seg = xshm_acquire(width, height);
+	if (seg != NULL)
+	{
+		xshm_fill_image(seg, width, height, data, bitmap_pad);
+		xshm_put_image(seg, d, g_create_bitmap_gc, x, y, width, height);
+		xshm_release(seg);
+		return;
+	}
+
 	tdata = (g_owncolmap ? data : translate_image(width, height, data));
-	bitmap = XCreatePixmap(g_display, g_wnd, width, height, g_depth);
 	image = XCreateImage(g_display, g_visual, g_depth, ZPixmap, 0,
 			     (char *) tdata, width, height, bitmap_pad, 0);
 
-	XPutImage(g_display, bitmap, g_create_bitmap_gc, image, 0, 0, 0, 0, width, height);
+	XPutImage(g_display, d, g_create_bitmap_gc, image, 0, 0, x, y, width, height);
 
 	XFree(image);
 	if (tdata != data)
 		xfree(tdata);
-	return (RD_HBITMAP) bitmap;
+}
+
+RD_HBITMAP
+ui_create_bitmap(int width, int height, uint8 * data)
+{
+	xbitmap *bmp;
+	int class;
+
+	class = atlas_class(width, height);
+	if (class < 0)
+	{
+		bmp = xbitmap_wrap(XCreatePixmap(g_display, g_wnd, width, height, g_depth),
+				   width, height);
+	}
+	else
+	{
+		bmp = xmalloc(sizeof(xbitmap));
+		bmp->width = width;
+		bmp->height = height;
+		atlas_alloc(class, bmp);
+		g_atlas_bitmaps++;
+	}
+
+	put_bitmap_data(bmp->pixmap, bmp->x, bmp->y, width, height, data);
+	return (RD_HBITMAP) bmp;
 }
 
 void
@@ -3333,7 +5201,9 @@ ui_paint_bitmap(int x, int y, int cx, int cy, int width, int height, uint8 * dat
 	XImage *image;
 	uint8 *tdata;
 	int bitmap_pad;
+	xshm_segment *seg;
 
+	draw_batch_flush();
 	if (g_server_depth == 8)
 	{
 		bitmap_pad = 8;
@@ -3346,27 +5216,37 @@ ui_paint_bitmap(int x, int y, int cx, int cy, int width, int height, uint8 * dat
 			bitmap_pad = 32;
 	}
 
-	tdata = (g_owncolmap ? data : translate_image(width, height, data));
-	image = XCreateImage(g_display, g_visual, g_depth, ZPixmap, 0,
-			     (char *) tdata, width, height, bitmap_pad, 0);
+	seg = xshm_acquire(width, height);
+	if (seg != NULL)
+	{
+		xshm_fill_image(seg, width, cy, data, bitmap_pad);
+		image = seg->image;
+		tdata = data;
+	}
+	else
+	{
+		tdata = (g_owncolmap ? data : translate_image(width, height, data));
+		image = XCreateImage(g_display, g_visual, g_depth, ZPixmap, 0,
+				     (char *) tdata, width, height, bitmap_pad, 0);
+	}
 
 	if (g_ownbackstore)
 	{
-		XPutImage(g_display, g_backstore, g_gc, image, 0, 0, x, y, cx, cy);
-		XCopyArea(g_display, g_backstore, g_wnd, g_gc, x, y, cx, cy, x, y);
-		ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-					(g_display, g_backstore, sw->wnd, g_gc, x, y, cx, cy,
-					 x - sw->xoffset, y - sw->yoffset));
+		put_image(seg, g_backstore, g_gc, image, x, y, cx, cy);
+		backstore_damage(x, y, cx, cy);
 	}
 	else
 	{
-		XPutImage(g_display, g_wnd, g_gc, image, 0, 0, x, y, cx, cy);
-		ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-					(g_display, g_wnd, sw->wnd, g_gc, x, y, cx, cy,
-					 x - sw->xoffset, y - sw->yoffset));
+		put_image(seg, g_wnd, g_gc, image, x, y, cx, cy);
+		ON_SEAMLESS_WINDOWS_IN(XCopyArea,
+				       (g_display, g_wnd, sw->wnd, g_gc, x, y, cx, cy,
+					x - sw->xoffset, y - sw->yoffset), x, y, cx, cy);
 	}
 
-	XFree(image);
+	if (seg != NULL)
+		xshm_release(seg);
+	else
+		XFree(image);
 	if (tdata != data)
 		xfree(tdata);
 }
@@ -3374,11 +5254,53 @@ ui_paint_bitmap(int x, int y, int cx, int cy, int width, int height, uint8 * dat
 void
 ui_destroy_bitmap(RD_HBITMAP bmp)
 {
-	XFreePixmap(g_display, (Pixmap) bmp);
+	xbitmap *xbmp = (xbitmap *) bmp;
+
+	if (xbmp->page != NULL)
+	{
+		atlas_free(xbmp);
+		g_atlas_bitmaps--;
+	}
+	else
+	{
+		/* drawing to a surface that is gone goes to the screen */
+		if (xbmp->pixmap == g_surface)
+			ui_switch_surface(NULL);
+		XFreePixmap(g_display, xbmp->pixmap);
+	}
+	xfree(xbmp);
+}
+
+/* An offscreen surface, created blank */
+RD_HBITMAP
+ui_create_surface(int width, int height)
+{
+	Pixmap pixmap;
+
+	pixmap = XCreatePixmap(g_display, g_wnd, MAX(width, 1), MAX(height, 1), g_depth);
+	return xbitmap_wrap(pixmap, width, height);
 }
 
-RD_HGLYPH
-ui_create_glyph(int width, int height, uint8 * data)
+/* Make drawing orders go to surface, or to the screen when NULL */
+void
+ui_switch_surface(RD_HBITMAP surface)
+{
+	xbitmap *bmp = (xbitmap *) surface;
+
+	draw_batch_flush();
+	if (bmp == NULL)
+	{
+		g_surface = 0;
+		return;
+	}
+
+	g_surface = bmp->pixmap;
+	g_surface_width = bmp->width;
+	g_surface_height = bmp->height;
+}
+
+static Pixmap
+create_stipple(int width, int height, uint8 * data)
 {
 	XImage *image;
 	Pixmap bitmap;
@@ -3399,13 +5321,39 @@ ui_create_glyph(int width, int height, uint8 * data)
 	XPutImage(g_display, bitmap, g_create_glyph_gc, image, 0, 0, 0, 0, width, height);
 
 	XFree(image);
-	return (RD_HGLYPH) bitmap;
+	return bitmap;
+}
+
+/* Glyphs are kept on the client side, so that ui_draw_text() can compose
+   all glyphs of a text order into one mask. The pixmap is only created
+   when a glyph is drawn on its own. */
+RD_HGLYPH
+ui_create_glyph(int width, int height, uint8 * data)
+{
+	xglyph *glyph;
+	int size;
+
+	size = height * ((width + 7) / 8);
+
+	glyph = xmalloc(sizeof(xglyph) + size);
+	glyph->pixmap = 0;
+	glyph->width = width;
+	glyph->height = height;
+	glyph->serial = ++g_glyph_serial;
+	glyph->data = (uint8 *) (glyph + 1);
+	memcpy(glyph->data, data, size);
+
+	return (RD_HGLYPH) glyph;
 }
 
 void
 ui_destroy_glyph(RD_HGLYPH glyph)
 {
-	XFreePixmap(g_display, (Pixmap) glyph);
+	xglyph *g = (xglyph *) glyph;
+
+	if (g->pixmap != 0)
+		XFreePixmap(g_display, g->pixmap);
+	xfree(g);
 }
 
 #define GET_BIT(ptr, bit) (*(ptr + bit / 8) & (1 << (7 - (bit % 8))))
@@ -3467,71 +5415,59 @@ get_pixel(uint32 idx, uint8 * andmask, uint8 * xormask, int bpp, uint8 * xor_fla
 	return argb;
 }
 
-/* Copies the pixels from src to dest with given color and offset */
-static inline void
-xcursor_stencil(XcursorImage * src, XcursorImage * dst, int dx, int dy, uint32 argb)
+/* Give the shape a white outline, on the transparent pixels next to
+   it, so that it shows on black. The border columns are done outside
+   the inner loop, and a zero row stands in above the first and below
+   the last row, so that the inner loop has no branches and the
+   compiler can vectorise it. */
+static void
+xcursor_outline(XcursorImage * img)
 {
-	int x, y, si, di;
-	assert(src->width == dst->width);
-	assert(src->height == dst->height);
+	XcursorPixel *p = img->pixels, *edge, *zero, *row, *up, *down;
+	int width = img->width, height = img->height;
+	int x, y, i;
 
-	for (y = 0; y < (int) src->height; y++)
+	if (width == 0 || height == 0)
+		return;
+
+	edge = xmalloc(width * height * sizeof(XcursorPixel));
+	zero = xmalloc(width * sizeof(XcursorPixel));
+	memset(zero, 0, width * sizeof(XcursorPixel));
+	for (y = 0; y < height; y++)
 	{
-		for (x = 0; x < (int) src->width; x++)
-		{
-			si = y * src->width + x;
-			if (!src->pixels[si])
-				continue;
+		i = y * width;
+		row = p + i;
+		up = y > 0 ? row - width : zero;
+		down = y < height - 1 ? row + width : zero;
 
-			if ((y + dy) < 0 || (y + dy) >= (int) dst->height)
-				continue;
-			if ((x + dx) < 0 || (x + dx) >= (int) dst->width)
-				continue;
-			di = (y + dy) * src->width + (x + dx);
-			dst->pixels[di] = argb;
-		}
+		edge[i] = up[0] | down[0] | (width > 1 ? row[1] : 0);
+		for (x = 1; x < width - 1; x++)
+			edge[i + x] = row[x - 1] | row[x + 1] | up[x] | down[x];
+		if (width > 1)
+			edge[i + width - 1] = up[width - 1] | down[width - 1] | row[width - 2];
 	}
-}
 
-static inline void
-xcursor_merge(XcursorImage * src, XcursorImage * dst)
-{
-	uint32 i;
-	assert(src->width == dst->width);
-	assert(src->height == dst->height);
-	for (i = 0; i < src->width * src->height; i++)
-	{
-		if (!src->pixels[i])
-			continue;
-		dst->pixels[i] = src->pixels[i];
-	}
+	for (i = 0; i < width * height; i++)
+		p[i] = p[i] ? p[i] : (edge[i] ? 0xffffffff : 0);
+	xfree(zero);
+	xfree(edge);
 }
 
-RD_HCURSOR
-ui_create_cursor(unsigned int xhot, unsigned int yhot, uint32 width,
-		 uint32 height, uint8 * andmask, uint8 * xormask, int bpp)
+static Cursor
+create_xcursor(unsigned int xhot, unsigned int yhot, uint32 width,
+	       uint32 height, uint8 * andmask, uint8 * xormask, int bpp)
 {
 	Cursor cursor;
 	XcursorPixel *out;
-	XcursorImage *cimg, *tmp;
+	XcursorImage *cimg;
 	uint32 x, y, oidx, idx, argb;
 	uint8 outline, xor;
 
-	logger(GUI, Debug, "ui_create_cursor(): xhot=%d, yhot=%d, width=%d, height=%d, bpp=%d",
-	       xhot, yhot, width, height, bpp);
-
-	if (bpp != 1 && bpp != 16 && bpp != 24 && bpp != 32)
-	{
-		logger(GUI, Warning, "ui_create_xcursor_cursor(): Unhandled cursor bit depth %d",
-		       bpp);
-		return g_null_cursor;
-	}
-
 	cimg = XcursorImageCreate(width, height);
 	if (!cimg)
 	{
 		logger(GUI, Error, "ui_create_xcursor_cursor(): XcursorImageCreate() failed");
-		return g_null_cursor;
+		return None;
 	}
 
 	cimg->xhot = xhot;
@@ -3564,26 +5500,98 @@ ui_create_cursor(unsigned int xhot, unsigned int yhot, uint32 width,
 	// Render a white outline of cursor shape when xor
 	// pixels are identified in cursor
 	if (outline)
-	{
-		tmp = XcursorImageCreate(width, height);
-		memset(tmp->pixels, 0, tmp->width * tmp->height * 4);
-		xcursor_stencil(cimg, tmp, -1, 0, 0xffffffff);
-		xcursor_stencil(cimg, tmp, 1, 0, 0xffffffff);
-		xcursor_stencil(cimg, tmp, 0, -1, 0xffffffff);
-		xcursor_stencil(cimg, tmp, 0, 1, 0xffffffff);
-		xcursor_merge(cimg, tmp);
-		xcursor_merge(tmp, cimg);
-		XcursorImageDestroy(tmp);
-	}
+		xcursor_outline(cimg);
 
+	/* an ARGB cursor, through XRender when the server has it */
 	cursor = XcursorImageLoadCursor(g_display, cimg);
 	XcursorImageDestroy(cimg);
 	if (!cursor)
-	{
 		logger(GUI, Error, "ui_create_cursor(): XcursorImageLoadCursor() failed");
+
+	return cursor;
+}
+
+/* FNV-1a */
+static uint32
+cursor_hash(uint8 * data, size_t size, uint32 hash)
+{
+	while (size--)
+		hash = (hash ^ *data++) * 16777619;
+	return hash;
+}
+
+RD_HCURSOR
+ui_create_cursor(unsigned int xhot, unsigned int yhot, uint32 width,
+		 uint32 height, uint8 * andmask, uint8 * xormask, int bpp)
+{
+	cursor_cache_entry *entry, *victim = NULL;
+	Cursor cursor;
+	uint32 header[5], hash;
+	size_t and_size, xor_size;
+	int i;
+
+	logger(GUI, Debug, "ui_create_cursor(): xhot=%d, yhot=%d, width=%d, height=%d, bpp=%d",
+	       xhot, yhot, width, height, bpp);
+
+	if (bpp != 1 && bpp != 16 && bpp != 24 && bpp != 32)
+	{
+		logger(GUI, Warning, "ui_create_xcursor_cursor(): Unhandled cursor bit depth %d",
+		       bpp);
 		return g_null_cursor;
 	}
 
+	/* the masks are packed, without scanline padding */
+	and_size = (width * height + 7) / 8;
+	xor_size = (width * height * bpp + 7) / 8;
+	header[0] = xhot;
+	header[1] = yhot;
+	header[2] = width;
+	header[3] = height;
+	header[4] = bpp;
+	hash = cursor_hash((uint8 *) header, sizeof(header), 2166136261U);
+	hash = cursor_hash(andmask, and_size, hash);
+	hash = cursor_hash(xormask, xor_size, hash);
+
+	for (i = 0; i < CURSOR_CACHE_SIZE; i++)
+	{
+		entry = &g_cursor_cache[i];
+		if (entry->cursor != None && entry->hash == hash
+		    && entry->key_size == sizeof(header) + and_size + xor_size
+		    && memcmp(entry->key, header, sizeof(header)) == 0
+		    && memcmp(entry->key + sizeof(header), andmask, and_size) == 0
+		    && memcmp(entry->key + sizeof(header) + and_size, xormask, xor_size) == 0)
+		{
+			entry->refs++;
+			entry->used = ++g_cursor_cache_clock;
+			return (RD_HCURSOR) entry->cursor;
+		}
+		if (entry->refs == 0 && (victim == NULL || entry->cursor == None
+					 || (victim->cursor != None && entry->used < victim->used)))
+			victim = entry;
+	}
+
+	cursor = create_xcursor(xhot, yhot, width, height, andmask, xormask, bpp);
+	if (cursor == None)
+		return g_null_cursor;
+
+	/* with every entry in use, the cursor is just not kept */
+	if (victim == NULL)
+		return (RD_HCURSOR) cursor;
+
+	if (victim->cursor != None)
+	{
+		XFreeCursor(g_display, victim->cursor);
+		xfree(victim->key);
+	}
+	victim->cursor = cursor;
+	victim->hash = hash;
+	victim->refs = 1;
+	victim->used = ++g_cursor_cache_clock;
+	victim->key_size = sizeof(header) + and_size + xor_size;
+	victim->key = xmalloc(victim->key_size);
+	memcpy(victim->key, header, sizeof(header));
+	memcpy(victim->key + sizeof(header), andmask, and_size);
+	memcpy(victim->key + sizeof(header) + and_size, xormask, xor_size);
 	return (RD_HCURSOR) cursor;
 }
 
@@ -3604,10 +5612,22 @@ ui_set_cursor(RD_HCURSOR cursor)
 void
 ui_destroy_cursor(RD_HCURSOR cursor)
 {
+	int i;
+
 	// Do not destroy fallback null cursor
 	if (cursor == g_null_cursor)
 		return;
 
+	/* cached ones stay around for the server to send again */
+	for (i = 0; i < CURSOR_CACHE_SIZE; i++)
+	{
+		if (g_cursor_cache[i].cursor == (Cursor) cursor)
+		{
+			g_cursor_cache[i].refs--;
+			return;
+		}
+	}
+
 	XFreeCursor(g_display, (Cursor) cursor);
 }
 
@@ -3754,11 +5774,15 @@ ui_set_colourmap(RD_HCOLOURMAP map)
 		XSetWindowColormap(g_display, g_wnd, (Colormap) map);
 		ON_ALL_SEAMLESS_WINDOWS(XSetWindowColormap, (g_display, sw->wnd, (Colormap) map));
 	}
+
+	/* the colours of tiles were looked up in the old palette */
+	g_palette_generation++;
 }
 
 void
 ui_set_clip(int x, int y, int cx, int cy)
 {
+	draw_batch_flush();
 	g_clip_rectangle.x = x;
 	g_clip_rectangle.y = y;
 	g_clip_rectangle.width = cx;
@@ -3769,9 +5793,7 @@ ui_set_clip(int x, int y, int cx, int cy)
 void
 ui_reset_clip(void)
 {
-	XWindowAttributes attr;
-	XGetWindowAttributes(g_display, g_wnd, &attr);
-	ui_set_clip(0, 0, attr.width, attr.height);
+	ui_set_clip(0, 0, UNSCALED(g_wnd_width), UNSCALED(g_wnd_height));
 }
 
 void
@@ -3784,6 +5806,7 @@ void
 ui_destblt(uint8 opcode,
 	   /* dest */ int x, int y, int cx, int cy)
 {
+	draw_batch_flush();
 	SET_FUNCTION(opcode);
 	FILL_RECTANGLE(x, y, cx, cy);
 	RESET_FUNCTION(opcode);
@@ -3798,91 +5821,150 @@ static uint8 hatch_patterns[] = {
 	0x81, 0x42, 0x24, 0x18, 0x18, 0x24, 0x42, 0x81	/* 5 - bsDiagCross */
 };
 
-void
-ui_patblt(uint8 opcode,
-	  /* dest */ int x, int y, int cx, int cy,
-	  /* brush */ BRUSH * brush, uint32 bgcolour, uint32 fgcolour)
+/* An 8x8 stipple of 1 bpp data, or a tile of session depth data, from
+   the LRU */
+static Pixmap
+brush_pixmap(uint8 * data, RD_BOOL tiled)
 {
-	Pixmap fill;
-	uint8 i, ipattern[8];
+	brush_lru_entry *entry, *victim;
+	int i, size;
 
-	SET_FUNCTION(opcode);
+	size = tiled ? 8 * 8 * ((g_server_depth + 7) / 8) : 8;
+	victim = &g_brush_lru[0];
+	for (i = 0; i < BRUSH_LRU_SIZE; i++)
+	{
+		entry = &g_brush_lru[i];
+		if (entry->pixmap != 0 && entry->tiled == tiled && entry->size == size
+		    && (!tiled || entry->palette == g_palette_generation)
+		    && memcmp(entry->data, data, size) == 0)
+		{
+			entry->used = ++g_brush_lru_clock;
+			return entry->pixmap;
+		}
+		if (entry->pixmap == 0 || (victim->pixmap != 0 && entry->used < victim->used))
+			victim = entry;
+	}
+
+	if (victim->pixmap != 0)
+		XFreePixmap(g_display, victim->pixmap);
+	victim->pixmap = tiled ? (Pixmap) ui_create_bitmap(8, 8, data) : create_stipple(8, 8, data);
+	victim->used = ++g_brush_lru_clock;
+	victim->tiled = tiled;
+	victim->palette = g_palette_generation;
+	victim->size = size;
+	memcpy(victim->data, data, size);
+	return victim->pixmap;
+}
+
+/* The stipple or tile of a brush from the brush cache, made the first
+   time it is used and then kept with it */
+static Pixmap
+brush_cached_pixmap(BRUSHDATA * bd)
+{
+	RD_BOOL tiled = bd->colour_code > 1;
+
+	Pixmap pixmap;
+
+	if (bd->pixmap != NULL && (!tiled || bd->pixmap_palette == g_palette_generation))
+		return ((xbitmap *) bd->pixmap)->pixmap;
+
+	if (bd->pixmap != NULL)
+		ui_destroy_bitmap(bd->pixmap);
+	/* a tile has to be a pixmap of its own, not part of an atlas */
+	if (tiled)
+	{
+		pixmap = XCreatePixmap(g_display, g_wnd, 8, 8, g_depth);
+		put_bitmap_data(pixmap, 0, 0, 8, 8, bd->data);
+	}
+	else
+		pixmap = create_stipple(8, 8, bd->data);
+	bd->pixmap = xbitmap_wrap(pixmap, 8, 8);
+	bd->pixmap_palette = g_palette_generation;
+	return pixmap;
+}
+
+/* Set up g_gc to fill with brush, or with fgcolour when there is none.
+   Returns False for a brush that cannot be drawn. */
+static RD_BOOL
+set_brush(BRUSH * brush, uint32 bgcolour, uint32 fgcolour)
+{
+	uint8 style, i, ipattern[8];
 
-	switch (brush->style)
+	style = brush ? brush->style : 0;
+	switch (style)
 	{
 		case 0:	/* Solid */
 			SET_FOREGROUND(fgcolour);
-			FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
-			break;
+			return True;
 
 		case 2:	/* Hatch */
-			fill = (Pixmap) ui_create_glyph(8, 8,
-							hatch_patterns + brush->pattern[0] * 8);
 			SET_FOREGROUND(fgcolour);
 			SET_BACKGROUND(bgcolour);
 			XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
-			XSetStipple(g_display, g_gc, fill);
-			XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-			FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
-			XSetFillStyle(g_display, g_gc, FillSolid);
-			XSetTSOrigin(g_display, g_gc, 0, 0);
-			ui_destroy_glyph((RD_HGLYPH) fill);
+			XSetStipple(g_display, g_gc,
+				    brush_pixmap(hatch_patterns + brush->pattern[0] * 8, False));
 			break;
 
 		case 3:	/* Pattern */
+			if (brush->bd != 0 && brush->bd->colour_code > 1)	/* > 1 bpp */
+			{
+				XSetFillStyle(g_display, g_gc, FillTiled);
+				XSetTile(g_display, g_gc, brush_cached_pixmap(brush->bd));
+				break;
+			}
+
+			SET_FOREGROUND(bgcolour);
+			SET_BACKGROUND(fgcolour);
+			XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
 			if (brush->bd == 0)	/* rdp4 brush */
 			{
 				for (i = 0; i != 8; i++)
 					ipattern[7 - i] = brush->pattern[i];
-				fill = (Pixmap) ui_create_glyph(8, 8, ipattern);
-				SET_FOREGROUND(bgcolour);
-				SET_BACKGROUND(fgcolour);
-				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
-				XSetStipple(g_display, g_gc, fill);
-				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
-				XSetFillStyle(g_display, g_gc, FillSolid);
-				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_glyph((RD_HGLYPH) fill);
-			}
-			else if (brush->bd->colour_code > 1)	/* > 1 bpp */
-			{
-				fill = (Pixmap) ui_create_bitmap(8, 8, brush->bd->data);
-				XSetFillStyle(g_display, g_gc, FillTiled);
-				XSetTile(g_display, g_gc, fill);
-				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
-				XSetFillStyle(g_display, g_gc, FillSolid);
-				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_bitmap((RD_HBITMAP) fill);
+				XSetStipple(g_display, g_gc, brush_pixmap(ipattern, False));
 			}
 			else
-			{
-				fill = (Pixmap) ui_create_glyph(8, 8, brush->bd->data);
-				SET_FOREGROUND(bgcolour);
-				SET_BACKGROUND(fgcolour);
-				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
-				XSetStipple(g_display, g_gc, fill);
-				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
-				XSetFillStyle(g_display, g_gc, FillSolid);
-				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_glyph((RD_HGLYPH) fill);
-			}
+				XSetStipple(g_display, g_gc, brush_cached_pixmap(brush->bd));
 			break;
 
 		default:
-			logger(GUI, Warning, "Unimplemented support for brush type %d",
-			       brush->style);
+			logger(GUI, Warning, "Unimplemented brush style %d", style);
+			return False;
+	}
+
+	XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
+	return True;
+}
+
+/* Back to solid fills after set_brush() */
+static void
+reset_brush(BRUSH * brush)
+{
+	if (brush == NULL || brush->style == 0)
+		return;
+
+	XSetFillStyle(g_display, g_gc, FillSolid);
+	XSetTSOrigin(g_display, g_gc, 0, 0);
+}
+
+void
+ui_patblt(uint8 opcode,
+	  /* dest */ int x, int y, int cx, int cy,
+	  /* brush */ BRUSH * brush, uint32 bgcolour, uint32 fgcolour)
+{
+	draw_batch_flush();
+	SET_FUNCTION(opcode);
+
+	if (set_brush(brush, bgcolour, fgcolour))
+	{
+		FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
+		reset_brush(brush);
 	}
 
 	RESET_FUNCTION(opcode);
 
-	if (g_ownbackstore)
-		XCopyArea(g_display, g_backstore, g_wnd, g_gc, x, y, cx, cy, x, y);
-	ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-				(g_display, g_ownbackstore ? g_backstore : g_wnd, sw->wnd, g_gc,
-				 x, y, cx, cy, x - sw->xoffset, y - sw->yoffset));
+	ON_ALL_SEAMLESS_WINDOWS_DRAW(XCopyArea,
+				     (g_display, g_ownbackstore ? g_backstore : g_wnd, sw->wnd, g_gc,
+				      x, y, cx, cy, x - sw->xoffset, y - sw->yoffset), x, y, cx, cy);
 }
 
 void
@@ -3890,21 +5972,14 @@ ui_screenblt(uint8 opcode,
 	     /* dest */ int x, int y, int cx, int cy,
 	     /* src */ int srcx, int srcy)
 {
+	draw_batch_flush();
 	SET_FUNCTION(opcode);
-	if (g_ownbackstore)
-	{
-		XCopyArea(g_display, g_Unobscured ? g_wnd : g_backstore,
-			  g_wnd, g_gc, srcx, srcy, cx, cy, x, y);
-		XCopyArea(g_display, g_backstore, g_backstore, g_gc, srcx, srcy, cx, cy, x, y);
-	}
-	else
-	{
-		XCopyArea(g_display, g_wnd, g_wnd, g_gc, srcx, srcy, cx, cy, x, y);
-	}
+	XCopyArea(g_display, DRAW_TARGET, DRAW_TARGET, g_gc, srcx, srcy, cx, cy, x, y);
 
-	ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-				(g_display, g_ownbackstore ? g_backstore : g_wnd,
-				 sw->wnd, g_gc, x, y, cx, cy, x - sw->xoffset, y - sw->yoffset));
+	ON_ALL_SEAMLESS_WINDOWS_DRAW(XCopyArea,
+				     (g_display, DRAW_TARGET,
+				      sw->wnd, g_gc, x, y, cx, cy, x - sw->xoffset, y - sw->yoffset),
+				     x, y, cx, cy);
 
 	RESET_FUNCTION(opcode);
 }
@@ -3914,13 +5989,36 @@ ui_memblt(uint8 opcode,
 	  /* dest */ int x, int y, int cx, int cy,
 	  /* src */ RD_HBITMAP src, int srcx, int srcy)
 {
+	xbitmap *bmp = (xbitmap *) src;
+
+	/* keep to the bitmap, the rest of an atlas page is other bitmaps */
+	if (srcx < 0)
+	{
+		x -= srcx;
+		cx += srcx;
+		srcx = 0;
+	}
+	if (srcy < 0)
+	{
+		y -= srcy;
+		cy += srcy;
+		srcy = 0;
+	}
+	cx = MIN(cx, bmp->width - srcx);
+	cy = MIN(cy, bmp->height - srcy);
+	if (cx <= 0 || cy <= 0)
+		return;
+	srcx += bmp->x;
+	srcy += bmp->y;
+
+	draw_batch_flush();
 	SET_FUNCTION(opcode);
-	XCopyArea(g_display, (Pixmap) src, g_wnd, g_gc, srcx, srcy, cx, cy, x, y);
-	ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-				(g_display, (Pixmap) src, sw->wnd, g_gc,
-				 srcx, srcy, cx, cy, x - sw->xoffset, y - sw->yoffset));
-	if (g_ownbackstore)
-		XCopyArea(g_display, (Pixmap) src, g_backstore, g_gc, srcx, srcy, cx, cy, x, y);
+	XCopyArea(g_display, bmp->pixmap, DRAW_TARGET, g_gc, srcx, srcy,
+		  cx, cy, x, y);
+	ON_ALL_SEAMLESS_WINDOWS_DRAW(XCopyArea,
+				     (g_display, bmp->pixmap, sw->wnd, g_gc,
+				      srcx, srcy, cx, cy, x - sw->xoffset, y - sw->yoffset),
+				     x, y, cx, cy);
 	RESET_FUNCTION(opcode);
 }
 
@@ -3930,6 +6028,7 @@ ui_triblt(uint8 opcode,
 	  /* src */ RD_HBITMAP src, int srcx, int srcy,
 	  /* brush */ BRUSH * brush, uint32 bgcolour, uint32 fgcolour)
 {
+	draw_batch_flush();
 	/* This is potentially difficult to do in general. Until someone
 	   comes up with a more efficient way of doing it I am using cases. */
 
@@ -3962,14 +6061,27 @@ ui_line(uint8 opcode,
 	/* dest */ int startx, int starty, int endx, int endy,
 	/* pen */ PEN * pen)
 {
+	XSegment *seg;
+
+	if (draw_batch_begin(DRAW_BATCH_SEGMENTS, TRANSLATE(pen->colour), opcode))
+	{
+		seg = &g_batch_segments[g_batch_count++];
+		seg->x1 = startx;
+		seg->y1 = starty;
+		seg->x2 = endx;
+		seg->y2 = endy;
+		backstore_damage(MIN(startx, endx), MIN(starty, endy),
+				 abs(endx - startx) + 1, abs(endy - starty) + 1);
+		return;
+	}
+
 	SET_FUNCTION(opcode);
 	SET_FOREGROUND(pen->colour);
-	XDrawLine(g_display, g_wnd, g_gc, startx, starty, endx, endy);
-	ON_ALL_SEAMLESS_WINDOWS(XDrawLine, (g_display, sw->wnd, g_gc,
-					    startx - sw->xoffset, starty - sw->yoffset,
-					    endx - sw->xoffset, endy - sw->yoffset));
-	if (g_ownbackstore)
-		XDrawLine(g_display, g_backstore, g_gc, startx, starty, endx, endy);
+	XDrawLine(g_display, DRAW_TARGET, g_gc, startx, starty, endx,
+		  endy);
+	ON_ALL_SEAMLESS_WINDOWS_CLIPPED(XDrawLine, (g_display, sw->wnd, g_gc,
+						    startx - sw->xoffset, starty - sw->yoffset,
+						    endx - sw->xoffset, endy - sw->yoffset));
 	RESET_FUNCTION(opcode);
 }
 
@@ -3978,6 +6090,22 @@ ui_rect(
 	       /* dest */ int x, int y, int cx, int cy,
 	       /* brush */ uint32 colour)
 {
+	XRectangle *rect;
+
+	if (cx <= 0 || cy <= 0)
+		return;
+
+	if (draw_batch_begin(DRAW_BATCH_RECTS, TRANSLATE(colour), ROP2_COPY))
+	{
+		rect = &g_batch_rects[g_batch_count++];
+		rect->x = x;
+		rect->y = y;
+		rect->width = cx;
+		rect->height = cy;
+		backstore_damage(x, y, cx, cy);
+		return;
+	}
+
 	SET_FOREGROUND(colour);
 	FILL_RECTANGLE(x, y, cx, cy);
 }
@@ -3988,93 +6116,25 @@ ui_polygon(uint8 opcode,
 	   /* dest */ RD_POINT * point, int npoints,
 	   /* brush */ BRUSH * brush, uint32 bgcolour, uint32 fgcolour)
 {
-	uint8 style, i, ipattern[8];
-	Pixmap fill;
-
-	SET_FUNCTION(opcode);
-
-	switch (fillmode)
-	{
-		case ALTERNATE:
-			XSetFillRule(g_display, g_gc, EvenOddRule);
-			break;
-		case WINDING:
-			XSetFillRule(g_display, g_gc, WindingRule);
-			break;
-		default:
-			logger(GUI, Warning, "Unimplemented fill mode %d", fillmode);
-	}
-
-	if (brush)
-		style = brush->style;
-	else
-		style = 0;
-
-	switch (style)
-	{
-		case 0:	/* Solid */
-			SET_FOREGROUND(fgcolour);
-			FILL_POLYGON((XPoint *) point, npoints);
-			break;
-
-		case 2:	/* Hatch */
-			fill = (Pixmap) ui_create_glyph(8, 8,
-							hatch_patterns + brush->pattern[0] * 8);
-			SET_FOREGROUND(fgcolour);
-			SET_BACKGROUND(bgcolour);
-			XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
-			XSetStipple(g_display, g_gc, fill);
-			XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-			FILL_POLYGON((XPoint *) point, npoints);
-			XSetFillStyle(g_display, g_gc, FillSolid);
-			XSetTSOrigin(g_display, g_gc, 0, 0);
-			ui_destroy_glyph((RD_HGLYPH) fill);
-			break;
+	draw_batch_flush();
+	SET_FUNCTION(opcode);
 
-		case 3:	/* Pattern */
-			if (brush->bd == 0)	/* rdp4 brush */
-			{
-				for (i = 0; i != 8; i++)
-					ipattern[7 - i] = brush->pattern[i];
-				fill = (Pixmap) ui_create_glyph(8, 8, ipattern);
-				SET_FOREGROUND(bgcolour);
-				SET_BACKGROUND(fgcolour);
-				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
-				XSetStipple(g_display, g_gc, fill);
-				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				FILL_POLYGON((XPoint *) point, npoints);
-				XSetFillStyle(g_display, g_gc, FillSolid);
-				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_glyph((RD_HGLYPH) fill);
-			}
-			else if (brush->bd->colour_code > 1)	/* > 1 bpp */
-			{
-				fill = (Pixmap) ui_create_bitmap(8, 8, brush->bd->data);
-				XSetFillStyle(g_display, g_gc, FillTiled);
-				XSetTile(g_display, g_gc, fill);
-				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				FILL_POLYGON((XPoint *) point, npoints);
-				XSetFillStyle(g_display, g_gc, FillSolid);
-				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_bitmap((RD_HBITMAP) fill);
-			}
-			else
-			{
-				fill = (Pixmap) ui_create_glyph(8, 8, brush->bd->data);
-				SET_FOREGROUND(bgcolour);
-				SET_BACKGROUND(fgcolour);
-				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
-				XSetStipple(g_display, g_gc, fill);
-				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				FILL_POLYGON((XPoint *) point, npoints);
-				XSetFillStyle(g_display, g_gc, FillSolid);
-				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_glyph((RD_HGLYPH) fill);
-			}
+	switch (fillmode)
+	{
+		case ALTERNATE:
+			XSetFillRule(g_display, g_gc, EvenOddRule);
+			break;
+		case WINDING:
+			XSetFillRule(g_display, g_gc, WindingRule);
 			break;
-
 		default:
-			logger(GUI, Warning, "Unimplemented brush style %d", brush->style);
+			logger(GUI, Warning, "Unimplemented fill mode %d", fillmode);
+	}
+
+	if (set_brush(brush, bgcolour, fgcolour))
+	{
+		FILL_POLYGON((XPoint *) point, npoints);
+		reset_brush(brush);
 	}
 
 	RESET_FUNCTION(opcode);
@@ -4085,16 +6145,16 @@ ui_polyline(uint8 opcode,
 	    /* dest */ RD_POINT * points, int npoints,
 	    /* pen */ PEN * pen)
 {
+	draw_batch_flush();
 	/* TODO: set join style */
 	SET_FUNCTION(opcode);
 	SET_FOREGROUND(pen->colour);
-	XDrawLines(g_display, g_wnd, g_gc, (XPoint *) points, npoints, CoordModePrevious);
-	if (g_ownbackstore)
-		XDrawLines(g_display, g_backstore, g_gc, (XPoint *) points, npoints,
-			   CoordModePrevious);
+	XDrawLines(g_display, DRAW_TARGET, g_gc, (XPoint *) points,
+		   npoints, CoordModePrevious);
 
-	ON_ALL_SEAMLESS_WINDOWS(seamless_XDrawLines,
-				(sw->wnd, (XPoint *) points, npoints, sw->xoffset, sw->yoffset));
+	ON_ALL_SEAMLESS_WINDOWS_CLIPPED(seamless_XDrawLines,
+					(sw->wnd, (XPoint *) points, npoints, sw->xoffset,
+					 sw->yoffset));
 
 	RESET_FUNCTION(opcode);
 }
@@ -4105,81 +6165,13 @@ ui_ellipse(uint8 opcode,
 	   /* dest */ int x, int y, int cx, int cy,
 	   /* brush */ BRUSH * brush, uint32 bgcolour, uint32 fgcolour)
 {
-	uint8 style, i, ipattern[8];
-	Pixmap fill;
-
+	draw_batch_flush();
 	SET_FUNCTION(opcode);
 
-	if (brush)
-		style = brush->style;
-	else
-		style = 0;
-
-	switch (style)
+	if (set_brush(brush, bgcolour, fgcolour))
 	{
-		case 0:	/* Solid */
-			SET_FOREGROUND(fgcolour);
-			DRAW_ELLIPSE(x, y, cx, cy, fillmode);
-			break;
-
-		case 2:	/* Hatch */
-			fill = (Pixmap) ui_create_glyph(8, 8,
-							hatch_patterns + brush->pattern[0] * 8);
-			SET_FOREGROUND(fgcolour);
-			SET_BACKGROUND(bgcolour);
-			XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
-			XSetStipple(g_display, g_gc, fill);
-			XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-			DRAW_ELLIPSE(x, y, cx, cy, fillmode);
-			XSetFillStyle(g_display, g_gc, FillSolid);
-			XSetTSOrigin(g_display, g_gc, 0, 0);
-			ui_destroy_glyph((RD_HGLYPH) fill);
-			break;
-
-		case 3:	/* Pattern */
-			if (brush->bd == 0)	/* rdp4 brush */
-			{
-				for (i = 0; i != 8; i++)
-					ipattern[7 - i] = brush->pattern[i];
-				fill = (Pixmap) ui_create_glyph(8, 8, ipattern);
-				SET_FOREGROUND(bgcolour);
-				SET_BACKGROUND(fgcolour);
-				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
-				XSetStipple(g_display, g_gc, fill);
-				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				DRAW_ELLIPSE(x, y, cx, cy, fillmode);
-				XSetFillStyle(g_display, g_gc, FillSolid);
-				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_glyph((RD_HGLYPH) fill);
-			}
-			else if (brush->bd->colour_code > 1)	/* > 1 bpp */
-			{
-				fill = (Pixmap) ui_create_bitmap(8, 8, brush->bd->data);
-				XSetFillStyle(g_display, g_gc, FillTiled);
-				XSetTile(g_display, g_gc, fill);
-				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				DRAW_ELLIPSE(x, y, cx, cy, fillmode);
-				XSetFillStyle(g_display, g_gc, FillSolid);
-				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_bitmap((RD_HBITMAP) fill);
-			}
-			else
-			{
-				fill = (Pixmap) ui_create_glyph(8, 8, brush->bd->data);
-				SET_FOREGROUND(bgcolour);
-				SET_BACKGROUND(fgcolour);
-				XSetFillStyle(g_display, g_gc, FillOpaqueStippled);
-				XSetStipple(g_display, g_gc, fill);
-				XSetTSOrigin(g_display, g_gc, brush->xorigin, brush->yorigin);
-				DRAW_ELLIPSE(x, y, cx, cy, fillmode);
-				XSetFillStyle(g_display, g_gc, FillSolid);
-				XSetTSOrigin(g_display, g_gc, 0, 0);
-				ui_destroy_glyph((RD_HGLYPH) fill);
-			}
-			break;
-
-		default:
-			logger(GUI, Warning, "Unimplemented brush style %d", brush->style);
+		DRAW_ELLIPSE(x, y, cx, cy, fillmode);
+		reset_brush(brush);
 	}
 
 	RESET_FUNCTION(opcode);
@@ -4192,15 +6184,21 @@ ui_draw_glyph(int mixmode,
 	      /* src */ RD_HGLYPH glyph, int srcx, int srcy,
 	      uint32 bgcolour, uint32 fgcolour)
 {
+	xglyph *g = (xglyph *) glyph;
+
+	draw_batch_flush();
 	UNUSED(srcx);
 	UNUSED(srcy);
 
+	if (g->pixmap == 0)
+		g->pixmap = create_stipple(g->width, g->height, g->data);
+
 	SET_FOREGROUND(fgcolour);
 	SET_BACKGROUND(bgcolour);
 
 	XSetFillStyle(g_display, g_gc,
 		      (mixmode == MIX_TRANSPARENT) ? FillStippled : FillOpaqueStippled);
-	XSetStipple(g_display, g_gc, (Pixmap) glyph);
+	XSetStipple(g_display, g_gc, g->pixmap);
 	XSetTSOrigin(g_display, g_gc, x, y);
 
 	FILL_RECTANGLE_BACKSTORE(x, y, cx, cy);
@@ -4208,6 +6206,252 @@ ui_draw_glyph(int mixmode,
 	XSetFillStyle(g_display, g_gc, FillSolid);
 }
 
+static void
+text_run_add(xglyph * glyph, int x, int y)
+{
+	if (g_text_run_length == g_text_run_size)
+	{
+		g_text_run_size = MAX(64, g_text_run_size * 2);
+		g_text_run = xrealloc(g_text_run, g_text_run_size * sizeof(text_run_glyph));
+	}
+
+	g_text_run[g_text_run_length].glyph = glyph;
+	g_text_run[g_text_run_length].x = x;
+	g_text_run[g_text_run_length].y = y;
+	g_text_run_length++;
+}
+
+/* OR a glyph into the mask at x, y, clipping it to width x height */
+static void
+text_mask_add(uint8 * mask, int scanline, int width, int height, xglyph * glyph, int x, int y)
+{
+	int row, col, i, shift, glyph_scanline, lo, hi;
+	uint8 *src, *dst, bits, last;
+
+	glyph_scanline = (glyph->width + 7) / 8;
+	shift = x & 7;
+	/* the columns of the glyph within the mask */
+	lo = MAX(0, -x);
+	hi = MIN(glyph->width, width - x);
+	/* the padding bits of the last byte of a row may hold anything */
+	last = 0xff << ((8 - (glyph->width & 7)) & 7);
+
+	for (row = 0; row < glyph->height; row++)
+	{
+		if (y + row < 0 || y + row >= height)
+			continue;
+
+		src = glyph->data + row * glyph_scanline;
+		dst = mask + (y + row) * scanline;
+
+		if (x >= 0 && x + glyph->width <= width)
+		{
+			dst += x >> 3;
+			for (i = 0; i < glyph_scanline; i++)
+			{
+				bits = src[i];
+				if (i == glyph_scanline - 1)
+					bits &= last;
+				if (bits == 0)
+					continue;
+				dst[i] |= bits >> shift;
+				/* nonzero spill is always within width */
+				if (shift && (uint8) (bits << (8 - shift)))
+					dst[i + 1] |= bits << (8 - shift);
+			}
+		}
+		else
+		{
+			/* whole bytes too, with the columns outside masked off */
+			for (i = lo >> 3; i < glyph_scanline && i * 8 < hi; i++)
+			{
+				bits = src[i];
+				if (i * 8 < lo)
+					bits &= 0xff >> (lo - i * 8);
+				if (i * 8 + 8 > hi)
+					bits &= 0xff << (i * 8 + 8 - hi);
+				if (bits == 0)
+					continue;
+
+				col = x + i * 8;
+				if (col < 0)
+				{
+					/* the bits left of the mask are cleared */
+					dst[0] |= bits << -col;
+					continue;
+				}
+				dst[col >> 3] |= bits >> (col & 7);
+				if ((col & 7) && (uint8) (bits << (8 - (col & 7))))
+					dst[(col >> 3) + 1] |= bits << (8 - (col & 7));
+			}
+		}
+	}
+}
+
+/* Compose the glyphs of the run into a 1 bpp mask of width x height
+   at left, top, and put it in the top left corner of pixmap */
+static void
+text_run_put_mask(Pixmap pixmap, int left, int top, int width, int height)
+{
+	XImage *image;
+	int i, scanline, size;
+	text_run_glyph *g;
+
+	scanline = (width + 7) / 8;
+	size = scanline * height;
+
+	if (size > g_text_mask_size)
+	{
+		g_text_mask_size = size;
+		g_text_mask = xrealloc(g_text_mask, size);
+	}
+	memset(g_text_mask, 0, size);
+
+	for (i = 0; i < g_text_run_length; i++)
+	{
+		g = &g_text_run[i];
+		text_mask_add(g_text_mask, scanline, width, height, g->glyph, g->x - left,
+			      g->y - top);
+	}
+
+	if (g_create_glyph_gc == 0)
+		g_create_glyph_gc = XCreateGC(g_display, pixmap, 0, NULL);
+
+	image = XCreateImage(g_display, g_visual, 1, ZPixmap, 0, (char *) g_text_mask,
+			     width, height, 8, scanline);
+	image->byte_order = MSBFirst;
+	image->bitmap_bit_order = MSBFirst;
+	XInitImage(image);
+	XPutImage(g_display, pixmap, g_create_glyph_gc, image, 0, 0, 0, 0, width, height);
+	XFree(image);
+}
+
+/* The cached stipple of the run, composed and uploaded if it is not
+   there yet. NULL if the run is too large to be worth keeping. */
+static text_cache_entry *
+text_cache_get(int left, int top, int width, int height)
+{
+	uint32 key[TEXT_CACHE_MAX_GLYPHS * 3];
+	uint32 hash;
+	int i, n, x0, y0;
+	text_cache_entry *entry;
+
+	/* either side alone may already overflow the product */
+	n = g_text_run_length;
+	if (n > TEXT_CACHE_MAX_GLYPHS || width > TEXT_CACHE_MAX_PIXELS ||
+	    height > TEXT_CACHE_MAX_PIXELS || width * height > TEXT_CACHE_MAX_PIXELS)
+		return NULL;
+
+	x0 = g_text_run[0].x;
+	y0 = g_text_run[0].y;
+	hash = 2166136261u;
+	for (i = 0; i < n; i++)
+	{
+		key[i * 3] = g_text_run[i].glyph->serial;
+		key[i * 3 + 1] = g_text_run[i].x - x0;
+		key[i * 3 + 2] = g_text_run[i].y - y0;
+		hash = (hash ^ key[i * 3]) * 16777619u;
+		hash = (hash ^ key[i * 3 + 1]) * 16777619u;
+		hash = (hash ^ key[i * 3 + 2]) * 16777619u;
+	}
+
+	entry = &g_text_cache[hash % TEXT_CACHE_SIZE];
+	if (entry->pixmap != 0 && entry->hash == hash && entry->n == n
+	    && memcmp(entry->key, key, n * 3 * sizeof(uint32)) == 0)
+	{
+		g_text_cache_hits++;
+		return entry;
+	}
+
+	g_text_cache_misses++;
+	if (entry->pixmap == 0 || entry->width != width || entry->height != height)
+	{
+		if (entry->pixmap != 0)
+			XFreePixmap(g_display, entry->pixmap);
+		entry->pixmap = XCreatePixmap(g_display, g_wnd, width, height, 1);
+		entry->width = width;
+		entry->height = height;
+	}
+	text_run_put_mask(entry->pixmap, left, top, width, height);
+
+	entry->hash = hash;
+	entry->n = n;
+	entry->key = xrealloc(entry->key, n * 3 * sizeof(uint32));
+	memcpy(entry->key, key, n * 3 * sizeof(uint32));
+	entry->x = left - x0;
+	entry->y = top - y0;
+	return entry;
+}
+
+/* Draw all glyphs collected by DO_GLYPH with a single stippled fill,
+   instead of a stipple, an origin and a fill per glyph */
+static void
+text_run_flush(void)
+{
+	int i, n, left, top, right, bottom, clip_left, clip_top, clip_right, clip_bottom;
+	text_run_glyph *g;
+	text_cache_entry *entry;
+
+	n = g_text_run_length;
+	if (n == 0)
+		return;
+
+	left = top = INT_MAX;
+	right = bottom = INT_MIN;
+	for (i = 0; i < n; i++)
+	{
+		g = &g_text_run[i];
+		left = MIN(left, g->x);
+		top = MIN(top, g->y);
+		right = MAX(right, g->x + g->glyph->width);
+		bottom = MAX(bottom, g->y + g->glyph->height);
+	}
+
+	/* nothing outside of the session or surface can be seen */
+	clip_left = MAX(left, 0);
+	clip_top = MAX(top, 0);
+	clip_right = MIN(right, g_surface != 0 ? g_surface_width : g_session_width);
+	clip_bottom = MIN(bottom, g_surface != 0 ? g_surface_height : g_session_height);
+	if (clip_left >= clip_right || clip_top >= clip_bottom)
+	{
+		g_text_run_length = 0;
+		return;
+	}
+
+	entry = text_cache_get(left, top, right - left, bottom - top);
+	if (entry != NULL)
+	{
+		XSetStipple(g_display, g_gc, entry->pixmap);
+		XSetTSOrigin(g_display, g_gc, g_text_run[0].x + entry->x, g_text_run[0].y + entry->y);
+		g_text_run_length = 0;
+		FILL_RECTANGLE_BACKSTORE(clip_left, clip_top, clip_right - clip_left,
+					 clip_bottom - clip_top);
+		return;
+	}
+
+	/* too large to keep, composed for what can be seen only into a
+	   stipple pixmap that is reused, and only ever grows */
+	left = clip_left;
+	top = clip_top;
+	right = clip_right;
+	bottom = clip_bottom;
+	if (right - left > g_text_pixmap_width || bottom - top > g_text_pixmap_height)
+	{
+		if (g_text_pixmap != 0)
+			XFreePixmap(g_display, g_text_pixmap);
+		g_text_pixmap_width = MAX(right - left, g_text_pixmap_width);
+		g_text_pixmap_height = MAX(bottom - top, g_text_pixmap_height);
+		g_text_pixmap = XCreatePixmap(g_display, g_wnd, g_text_pixmap_width,
+					      g_text_pixmap_height, 1);
+	}
+	text_run_put_mask(g_text_pixmap, left, top, right - left, bottom - top);
+	g_text_run_length = 0;
+
+	XSetStipple(g_display, g_gc, g_text_pixmap);
+	XSetTSOrigin(g_display, g_gc, left, top);
+	FILL_RECTANGLE_BACKSTORE(left, top, right - left, bottom - top);
+}
+
 #define DO_GLYPH(ttext,idx) \
 {\
   glyph = cache_get_font (font, ttext[idx]);\
@@ -4234,9 +6478,7 @@ ui_draw_glyph(int mixmode,
   {\
     x1 = x + glyph->offset;\
     y1 = y + glyph->baseline;\
-    XSetStipple(g_display, g_gc, (Pixmap) glyph->pixmap);\
-    XSetTSOrigin(g_display, g_gc, x1, y1);\
-    FILL_RECTANGLE_BACKSTORE(x1, y1, glyph->width, glyph->height);\
+    text_run_add((xglyph *) glyph->pixmap, x1, y1);\
     if (flags & TEXT2_IMPLICIT_X)\
       x += glyph->width;\
   }\
@@ -4248,25 +6490,25 @@ ui_draw_text(uint8 font, uint8 flags, uint8 opcode, int mixmode, int x, int y,
 	     int boxx, int boxy, int boxcx, int boxcy, BRUSH * brush,
 	     uint32 bgcolour, uint32 fgcolour, uint8 * text, uint8 length)
 {
-	XWindowAttributes attr;
+	FONTGLYPH *glyph;
+	int i, j, xyoffset, x1, y1, window_width;
+	DATABLOB *entry;
+
+	draw_batch_flush();
 	UNUSED(opcode);
 	UNUSED(brush);
 
-	XGetWindowAttributes(g_display, g_wnd, &attr);
-
 	/* TODO: use brush appropriately */
 
-	FONTGLYPH *glyph;
-	int i, j, xyoffset, x1, y1;
-	DATABLOB *entry;
-
 	SET_FOREGROUND(bgcolour);
 
 	/* Sometimes, the boxcx value is something really large, like
 	   32691. This makes XCopyArea fail with Xvnc. The code below
-	   is a quick fix. */
-	if (boxx + boxcx > attr.width)
-		boxcx = attr.width - boxx;
+	   is a quick fix. The window size is the one last seen, or the
+	   session size before the window is mapped. */
+	window_width = g_window_width ? UNSCALED(g_window_width) : g_session_width;
+	if (boxx + boxcx > window_width)
+		boxcx = window_width - boxx;
 
 	if (boxcx > 1)
 	{
@@ -4281,7 +6523,7 @@ ui_draw_text(uint8 font, uint8 flags, uint8 opcode, int mixmode, int x, int y,
 	SET_BACKGROUND(bgcolour);
 	XSetFillStyle(g_display, g_gc, FillStippled);
 
-	/* Paint text, character by character */
+	/* Collect the glyphs of all characters, then paint them at once */
 	for (i = 0; i < length;)
 	{
 		switch (text[i])
@@ -4343,93 +6585,112 @@ ui_draw_text(uint8 font, uint8 flags, uint8 opcode, int mixmode, int x, int y,
 		}
 	}
 
+	text_run_flush();
 	XSetFillStyle(g_display, g_gc, FillSolid);
 
-	if (g_ownbackstore)
+	if (g_ownbackstore && g_surface == 0)
 	{
 		if (boxcx > 1)
-		{
-			XCopyArea(g_display, g_backstore, g_wnd, g_gc, boxx,
-				  boxy, boxcx, boxcy, boxx, boxy);
-			ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-						(g_display, g_backstore, sw->wnd, g_gc,
-						 boxx, boxy,
-						 boxcx, boxcy,
-						 boxx - sw->xoffset, boxy - sw->yoffset));
-		}
+			backstore_damage(boxx, boxy, boxcx, boxcy);
 		else
-		{
-			XCopyArea(g_display, g_backstore, g_wnd, g_gc, clipx,
-				  clipy, clipcx, clipcy, clipx, clipy);
-			ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-						(g_display, g_backstore, sw->wnd, g_gc,
-						 clipx, clipy,
-						 clipcx, clipcy, clipx - sw->xoffset,
-						 clipy - sw->yoffset));
-		}
+			backstore_damage(clipx, clipy, clipcx, clipcy);
 	}
 }
 
 void
 ui_desktop_save(uint32 offset, int x, int y, int cx, int cy)
 {
-	Pixmap pix;
-	XImage *image;
+	desksave_entry *entry, *slot = NULL;
+	uint32 length = cx * cy;
+	int i;
 
-	if (g_ownbackstore)
+	if (offset > DESKSAVE_PIXELS || length > DESKSAVE_PIXELS - offset)
 	{
-		image = XGetImage(g_display, g_backstore, x, y, cx, cy, AllPlanes, ZPixmap);
-		exit_if_null(image);
+		logger(GUI, Error, "ui_desktop_save(), offset=%d, length=%d", offset, length);
+		return;
 	}
-	else
+
+	/* what the new region overlaps in the save buffer is overwritten */
+	for (i = 0; i < DESKSAVE_SLOTS; i++)
+	{
+		entry = &g_desksave[i];
+		if (entry->pixmap != 0 && offset < entry->offset + entry->cx * entry->cy
+		    && entry->offset < offset + length)
+		{
+			if (slot == NULL && entry->cx == cx && entry->cy == cy)
+			{
+				slot = entry;
+				continue;
+			}
+			XFreePixmap(g_display, entry->pixmap);
+			entry->pixmap = 0;
+		}
+	}
+
+	for (i = 0; slot == NULL && i < DESKSAVE_SLOTS; i++)
+	{
+		if (g_desksave[i].pixmap == 0)
+			slot = &g_desksave[i];
+	}
+	if (slot == NULL)
 	{
-		pix = XCreatePixmap(g_display, g_wnd, cx, cy, g_depth);
-		XCopyArea(g_display, g_wnd, pix, g_gc, x, y, cx, cy, 0, 0);
-		image = XGetImage(g_display, pix, 0, 0, cx, cy, AllPlanes, ZPixmap);
-		exit_if_null(image);
-		XFreePixmap(g_display, pix);
+		/* more saved than the server ever keeps at once, drop one */
+		slot = &g_desksave[offset % DESKSAVE_SLOTS];
+		XFreePixmap(g_display, slot->pixmap);
+		slot->pixmap = 0;
 	}
 
-	offset *= g_bpp / 8;
-	cache_put_desktop(offset, cx, cy, image->bytes_per_line, g_bpp / 8, (uint8 *) image->data);
+	if (slot->pixmap == 0)
+		slot->pixmap = XCreatePixmap(g_display, g_wnd, cx, cy, g_depth);
+	slot->offset = offset;
+	slot->cx = cx;
+	slot->cy = cy;
 
-	XDestroyImage(image);
+	draw_batch_flush();
+	XCopyArea(g_display, DRAW_TARGET, slot->pixmap, g_gc,
+		  x, y, cx, cy, 0, 0);
 }
 
 void
 ui_desktop_restore(uint32 offset, int x, int y, int cx, int cy)
 {
-	XImage *image;
-	uint8 *data;
+	desksave_entry *entry;
+	int i;
 
-	offset *= g_bpp / 8;
-	data = cache_get_desktop(offset, cx, cy, g_bpp / 8);
-	if (data == NULL)
+	for (i = 0; i < DESKSAVE_SLOTS; i++)
+	{
+		entry = &g_desksave[i];
+		if (entry->pixmap != 0 && entry->offset == offset && entry->cx == cx
+		    && entry->cy == cy)
+			break;
+	}
+	if (i == DESKSAVE_SLOTS)
+	{
+		logger(GUI, Debug, "ui_desktop_restore(), nothing saved at offset=%d, %dx%d",
+		       offset, cx, cy);
 		return;
+	}
 
-	image = XCreateImage(g_display, g_visual, g_depth, ZPixmap, 0,
-			     (char *) data, cx, cy, g_bpp, 0);
-
-	if (g_ownbackstore)
+	draw_batch_flush();
+	if (g_surface != 0)
 	{
-		XPutImage(g_display, g_backstore, g_gc, image, 0, 0, x, y, cx, cy);
-		XCopyArea(g_display, g_backstore, g_wnd, g_gc, x, y, cx, cy, x, y);
-		ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-					(g_display, g_backstore, sw->wnd, g_gc,
-					 x, y, cx, cy, x - sw->xoffset, y - sw->yoffset));
+		XCopyArea(g_display, entry->pixmap, g_surface, g_gc, 0, 0, cx, cy, x, y);
+	}
+	else if (g_ownbackstore)
+	{
+		XCopyArea(g_display, entry->pixmap, g_backstore, g_gc, 0, 0, cx, cy, x, y);
+		backstore_damage(x, y, cx, cy);
 	}
 	else
 	{
-		XPutImage(g_display, g_wnd, g_gc, image, 0, 0, x, y, cx, cy);
-		ON_ALL_SEAMLESS_WINDOWS(XCopyArea,
-					(g_display, g_wnd, sw->wnd, g_gc, x, y, cx, cy,
-					 x - sw->xoffset, y - sw->yoffset));
+		XCopyArea(g_display, entry->pixmap, g_wnd, g_gc, 0, 0, cx, cy, x, y);
+		ON_SEAMLESS_WINDOWS_IN(XCopyArea,
+				       (g_display, g_wnd, sw->wnd, g_gc, x, y, cx, cy,
+					x - sw->xoffset, y - sw->yoffset), x, y, cx, cy);
 	}
-
-	XFree(image);
 }
 
-/* these do nothing here but are used in uiports */
+/* Drawing batched during an update is sent at its end */
 void
 ui_begin_update(void)
 {
@@ -4438,6 +6699,16 @@ ui_begin_update(void)
 void
 ui_end_update(void)
 {
+	TRACE_SCOPE(TRACE_UI_END_UPDATE);
+
+	draw_batch_flush();
+	if (frame_update() >= 0)
+	{
+		/* already waiting for the next refresh */
+		if (g_frame_held)
+			g_frames_merged++;
+		g_frame_held = True;
+	}
 	XFlush(g_display);
 }
 
@@ -4667,6 +6938,7 @@ ui_seamless_create_window(unsigned long id, unsigned long group, unsigned long p
 
 	sw->next = g_seamless_windows;
 	g_seamless_windows = sw;
+	sw_add_window(sw);
 
 	/* WM_HINTS */
 	wmhints = XAllocWMHints();
@@ -4857,9 +7129,37 @@ ui_seamless_move_window(unsigned long id, int x, int y, int width, int height, u
 	sw->yoffset = y;
 	sw->width = width;
 	sw->height = height;
+	sw_grid_update(sw);
 
-	/* FIXME: Perhaps use ewmh_net_moveresize_window instead */
-	XMoveResizeWindow(g_display, sw->wnd, sw->xoffset, sw->yoffset, sw->width, sw->height);
+	sw->move_pending = True;
+	if (!g_seamless_batch)
+		sw_flush_move(sw);
+}
+
+
+/* SeamlessRDP commands arriving together are processed as a batch, so
+   that a window moved or restacked several times only gets one
+   request, and the restacks do not wait for the window manager */
+void
+ui_seamless_batch_begin(void)
+{
+	g_seamless_batch = True;
+}
+
+
+void
+ui_seamless_batch_end(void)
+{
+	seamless_window *sw;
+
+	if (!g_seamless_batch)
+		return;
+	g_seamless_batch = False;
+
+	for (sw = g_seamless_windows; sw; sw = sw->next)
+		sw_flush_move(sw);
+	for (sw = g_seamless_windows; sw; sw = sw->next)
+		sw_flush_restack(sw);
 }
 
 
@@ -4867,9 +7167,6 @@ void
 ui_seamless_restack_window(unsigned long id, unsigned long behind, unsigned long flags)
 {
 	seamless_window *sw;
-	XWindowChanges values;
-	unsigned long restack_serial;
-	unsigned int value_mask;
 
 	if (!g_seamless_active)
 		return;
@@ -4882,57 +7179,18 @@ ui_seamless_restack_window(unsigned long id, unsigned long behind, unsigned long
 		return;
 	}
 
-	if (behind)
-	{
-		seamless_window *sw_behind;
-
-		sw_behind = sw_get_window_by_id(behind);
-		if (!sw_behind)
-		{
-			logger(GUI, Warning,
-			       "ui_seamless_restack_window(), no information for behind window 0x%lx",
-			       behind);
-			return;
-		}
-
-		values.stack_mode = Below;
-		value_mask = CWStackMode | CWSibling;
-		values.sibling = sw_behind->wnd;
-
-		/* Avoid that topmost windows references non-topmost
-		   windows, and vice versa. */
-		if (ewmh_is_window_above(sw->wnd))
-		{
-			if (!ewmh_is_window_above(sw_behind->wnd))
-			{
-				/* Disallow, move to bottom of the
-				   topmost stack. */
-				values.stack_mode = Below;
-				value_mask = CWStackMode;	/* Not sibling */
-			}
-		}
-		else
-		{
-			if (ewmh_is_window_above(sw_behind->wnd))
-			{
-				/* Move to top of non-topmost
-				   stack. */
-				values.stack_mode = Above;
-				value_mask = CWStackMode;	/* Not sibling */
-			}
-		}
-	}
-	else
+	if (behind && !sw_get_window_by_id(behind))
 	{
-		values.stack_mode = Above;
-		value_mask = CWStackMode;
+		logger(GUI, Warning,
+		       "ui_seamless_restack_window(), no information for behind window 0x%lx",
+		       behind);
+		return;
 	}
 
-	restack_serial = XNextRequest(g_display);
-	XReconfigureWMWindow(g_display, sw->wnd, DefaultScreen(g_display), value_mask, &values);
-	sw_wait_configurenotify(sw->wnd, restack_serial);
-
 	sw_restack_window(sw, behind);
+	sw->restack_pending = True;
+	if (!g_seamless_batch)
+		sw_flush_restack(sw);
 
 	if (flags & SEAMLESSRDP_CREATE_TOPMOST)
 	{
@@ -4982,6 +7240,9 @@ ui_seamless_setstate(unsigned long id, unsigned int state, unsigned long flags)
 		return;
 	}
 
+	/* map the window where the batch has put it */
+	sw_flush_move(sw);
+
 	switch (state)
 	{
 		case SEAMLESSRDP_NORMAL:
@@ -5041,6 +7302,8 @@ void
 ui_seamless_ack(unsigned int serial)
 {
 	seamless_window *sw;
+
+	draw_batch_flush();
 	for (sw = g_seamless_windows; sw; sw = sw->next)
 	{
 		if (sw->outstanding_position && (sw->outpos_serial == serial))
@@ -5050,6 +7313,7 @@ ui_seamless_ack(unsigned int serial)
 			sw->width = sw->outpos_width;
 			sw->height = sw->outpos_height;
 			sw->outstanding_position = False;
+			sw_grid_update(sw);
 
 			/* Do a complete redraw of the window as part of the
 			   completion of the move. This is to remove any
@@ -0,0 +1,333 @@
+/* -*- c-basic-offset: 8 -*-
+   rdesktop: A Remote Desktop Protocol client.
+   Protocol services - RDP8 bulk decompression
+   Copyright 2026 the rdesktop contributors
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The graphics pipeline channel compresses its PDUs with the RDP8
+   bulk compressor (MS-RDPEGFX 2.2.5 and 3.1.9.1). It is an LZ77
+   variant with a 2.5 MB history shared by all segments, and tokens
+   coded with a fixed prefix code read most significant bit first. */
+
+#include "rdesktop.h"
+
+#define ZGFX_HISTORY_SIZE	2500000
+#define ZGFX_SEGMENT_MAX	65535
+
+#define ZGFX_SEGMENTED_SINGLE		0xe0
+#define ZGFX_SEGMENTED_MULTIPART	0xe1
+
+#define ZGFX_PACKET_COMPR_TYPE_RDP8	0x04
+#define ZGFX_PACKET_COMPRESSED		0x20
+
+typedef struct
+{
+	uint8 prefix_length;
+	uint16 prefix_code;
+	uint8 value_bits;
+	uint8 is_match;
+	uint32 value_base;
+}
+ZGFX_TOKEN;
+
+/* In the order the prefixes have to be tried, literals carry their
+   value in value_base */
+static const ZGFX_TOKEN zgfx_tokens[] = {
+	{1, 0, 8, 0, 0},
+	{5, 17, 5, 1, 0},
+	{5, 18, 7, 1, 32},
+	{5, 19, 9, 1, 160},
+	{5, 20, 10, 1, 672},
+	{5, 21, 12, 1, 1696},
+	{5, 24, 0, 0, 0x00},
+	{5, 25, 0, 0, 0x01},
+	{6, 44, 14, 1, 5792},
+	{6, 45, 15, 1, 22176},
+	{6, 52, 0, 0, 0x02},
+	{6, 53, 0, 0, 0x03},
+	{6, 54, 0, 0, 0xff},
+	{7, 92, 18, 1, 54944},
+	{7, 93, 20, 1, 317088},
+	{7, 110, 0, 0, 0x04},
+	{7, 111, 0, 0, 0x05},
+	{7, 112, 0, 0, 0x06},
+	{7, 113, 0, 0, 0x07},
+	{7, 114, 0, 0, 0x08},
+	{7, 115, 0, 0, 0x09},
+	{7, 116, 0, 0, 0x0a},
+	{7, 117, 0, 0, 0x0b},
+	{7, 118, 0, 0, 0x3a},
+	{7, 119, 0, 0, 0x3b},
+	{7, 120, 0, 0, 0x3c},
+	{7, 121, 0, 0, 0x3d},
+	{7, 122, 0, 0, 0x3e},
+	{7, 123, 0, 0, 0x3f},
+	{7, 124, 0, 0, 0x40},
+	{7, 125, 0, 0, 0x80},
+	{8, 188, 20, 1, 1365664},
+	{8, 189, 21, 1, 2414240},
+	{8, 252, 0, 0, 0x0c},
+	{8, 253, 0, 0, 0x38},
+	{8, 254, 0, 0, 0x39},
+	{8, 255, 0, 0, 0x66},
+	{9, 380, 22, 1, 4511392},
+	{9, 381, 23, 1, 8705696},
+	{9, 382, 24, 1, 17094304},
+	{0, 0, 0, 0, 0}
+};
+
+static uint8 *zgfx_history;
+static uint32 zgfx_history_index;
+
+typedef struct
+{
+	uint8 *p, *end;
+	uint32 bits;		/* MSB aligned */
+	int nbits;
+	sint32 remaining;	/* bits of the segment still to read */
+}
+ZGFX_READER;
+
+static uint32
+zgfx_get_bits(ZGFX_READER * r, int n)
+{
+	uint32 v;
+
+	while (r->nbits < n)
+	{
+		r->bits |= (uint32) (r->p < r->end ? *r->p++ : 0) << (24 - r->nbits);
+		r->nbits += 8;
+	}
+
+	v = n ? r->bits >> (32 - n) : 0;
+	r->bits <<= n;
+	r->nbits -= n;
+	r->remaining -= n;
+	return v;
+}
+
+static void
+zgfx_history_put(uint8 * data, uint32 len)
+{
+	uint32 part;
+
+	if (len >= ZGFX_HISTORY_SIZE)
+	{
+		data += len - ZGFX_HISTORY_SIZE;
+		len = ZGFX_HISTORY_SIZE;
+	}
+
+	part = MIN(len, ZGFX_HISTORY_SIZE - zgfx_history_index);
+	memcpy(zgfx_history + zgfx_history_index, data, part);
+	memcpy(zgfx_history, data + part, len - part);
+	zgfx_history_index = (zgfx_history_index + len) % ZGFX_HISTORY_SIZE;
+}
+
+/* Copy count bytes from distance back in the history to out, the
+   ranges may overlap when the match is longer than the distance */
+static void
+zgfx_history_copy(uint8 * out, uint32 distance, uint32 count)
+{
+	uint32 src, i;
+
+	src = (zgfx_history_index + ZGFX_HISTORY_SIZE - distance) % ZGFX_HISTORY_SIZE;
+	for (i = 0; i < count; i++)
+	{
+		out[i] = zgfx_history[src];
+		zgfx_history[zgfx_history_index] = out[i];
+		src = (src + 1) % ZGFX_HISTORY_SIZE;
+		zgfx_history_index = (zgfx_history_index + 1) % ZGFX_HISTORY_SIZE;
+	}
+}
+
+/* Expand one bulk encoded segment on to the end of out */
+static RD_BOOL
+zgfx_expand_segment(uint8 * data, uint32 size, STREAM out)
+{
+	ZGFX_READER r;
+	const ZGFX_TOKEN *token;
+	uint32 prefix, value, count, extra;
+	int have;
+	uint8 flags, *start;
+
+	if (size < 1)
+		return False;
+
+	flags = data[0];
+	data++;
+	size--;
+
+	if ((flags & 0x0f) != ZGFX_PACKET_COMPR_TYPE_RDP8)
+		return False;
+
+	if (!(flags & ZGFX_PACKET_COMPRESSED))
+	{
+		s_realloc(out, s_tell(out) + size);
+		out_uint8a(out, data, size);
+		zgfx_history_put(data, size);
+		return True;
+	}
+
+	/* the last byte tells how many bits of the one before are unused */
+	if (size < 1 || data[size - 1] > 7)
+		return False;
+
+	r.p = data;
+	r.end = data + size - 1;
+	r.bits = 0;
+	r.nbits = 0;
+	r.remaining = 8 * (size - 1) - data[size - 1];
+
+	s_realloc(out, s_tell(out) + ZGFX_SEGMENT_MAX);
+	start = out->p;
+
+	while (r.remaining > 0)
+	{
+		prefix = 0;
+		have = 0;
+		for (token = zgfx_tokens; token->prefix_length != 0; token++)
+		{
+			while (have < token->prefix_length)
+			{
+				prefix = (prefix << 1) | zgfx_get_bits(&r, 1);
+				have++;
+			}
+			if (prefix == token->prefix_code)
+				break;
+		}
+		if (token->prefix_length == 0)
+			return False;
+
+		if (!token->is_match)
+		{
+			if (out->p - start >= ZGFX_SEGMENT_MAX)
+				return False;
+			*out->p = token->value_base + zgfx_get_bits(&r, token->value_bits);
+			zgfx_history[zgfx_history_index] = *out->p++;
+			zgfx_history_index = (zgfx_history_index + 1) % ZGFX_HISTORY_SIZE;
+			continue;
+		}
+
+		value = token->value_base + zgfx_get_bits(&r, token->value_bits);
+		if (value == 0)
+		{
+			/* unencoded bytes, starting at the next byte boundary */
+			count = zgfx_get_bits(&r, 15);
+			r.remaining -= r.nbits;
+			r.bits = 0;
+			r.nbits = 0;
+			if (count > (uint32) (r.end - r.p)
+			    || count > (uint32) (ZGFX_SEGMENT_MAX - (out->p - start)))
+				return False;
+			memcpy(out->p, r.p, count);
+			zgfx_history_put(r.p, count);
+			out->p += count;
+			r.p += count;
+			r.remaining -= 8 * count;
+			continue;
+		}
+
+		if (zgfx_get_bits(&r, 1) == 0)
+		{
+			count = 3;
+		}
+		else
+		{
+			count = 4;
+			extra = 2;
+			while (zgfx_get_bits(&r, 1) == 1 && extra < 16)
+			{
+				count *= 2;
+				extra++;
+			}
+			count += zgfx_get_bits(&r, extra);
+		}
+
+		if (value > ZGFX_HISTORY_SIZE
+		    || count > (uint32) (ZGFX_SEGMENT_MAX - (out->p - start)))
+			return False;
+		zgfx_history_copy(out->p, value, count);
+		out->p += count;
+	}
+
+	return True;
+}
+
+/* Decompress an RDP_SEGMENTED_DATA structure, returns a stream with
+   the data which the caller frees, or NULL on error */
+STREAM
+zgfx_decompress(STREAM s)
+{
+	uint8 descriptor;
+	uint16 count, i;
+	uint32 total, size;
+	uint8 *data;
+	STREAM out;
+
+	if (zgfx_history == NULL)
+		zgfx_history = xmalloc(ZGFX_HISTORY_SIZE);
+
+	in_uint8(s, descriptor);
+	if (descriptor == ZGFX_SEGMENTED_SINGLE)
+	{
+		out = s_alloc(ZGFX_SEGMENT_MAX);
+		size = s_remaining(s);
+		in_uint8p(s, data, size);
+		if (!zgfx_expand_segment(data, size, out))
+			goto fail;
+	}
+	else if (descriptor == ZGFX_SEGMENTED_MULTIPART)
+	{
+		in_uint16_le(s, count);
+		in_uint32_le(s, total);
+		out = s_alloc(total);
+		for (i = 0; i < count; i++)
+		{
+			if (!s_check_rem(s, 4))
+				goto fail;
+			in_uint32_le(s, size);
+			if (!s_check_rem(s, size))
+				goto fail;
+			in_uint8p(s, data, size);
+			if (!zgfx_expand_segment(data, size, out))
+				goto fail;
+		}
+		if (s_tell(out) != total)
+			goto fail;
+	}
+	else
+	{
+		logger(Graphics, Warning, "zgfx_decompress(), bad descriptor 0x%x", descriptor);
+		return NULL;
+	}
+
+	s_mark_end(out);
+	s_seek(out, 0);
+	return out;
+
+fail:
+	logger(Graphics, Warning, "zgfx_decompress(), corrupt segment");
+	s_free(out);
+	return NULL;
+}
+
+void
+zgfx_reset(void)
+{
+	zgfx_history_index = 0;
+	if (zgfx_history != NULL)
+		memset(zgfx_history, 0, ZGFX_HISTORY_SIZE);
+}